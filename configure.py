@@ -100,6 +100,14 @@ class Platform(object):
     def uses_usr_local(self):
         return self._platform in ('freebsd', 'openbsd', 'bitrig', 'dragonfly', 'netbsd')
 
+    def supports_epoll(self):
+        return self._platform == 'linux'
+
+    def supports_io_uring(self):
+        # Only the kernel headers are needed, not liburing.
+        return (self._platform == 'linux' and
+                os.path.exists('/usr/include/linux/io_uring.h'))
+
     def supports_ppoll(self):
         return self._platform in ('freebsd', 'linux', 'openbsd', 'bitrig',
                                   'dragonfly')
@@ -216,7 +224,7 @@ parser.add_option('--with-python', metavar='EXE',
                   help='use EXE as the Python interpreter',
                   default=os.path.basename(sys.executable))
 parser.add_option('--force-pselect', action='store_true',
-                  help='ppoll() is used by default where available, '
+                  help='epoll or ppoll() is used by default where available, '
                        'but some platforms may need to use pselect instead',)
 (options, args) = parser.parse_args()
 if args:
@@ -381,8 +389,17 @@ else:
         cflags.append('-fno-omit-frame-pointer')
         libs.extend(['-Wl,--no-as-needed', '-lprofiler'])
 
-if platform.supports_ppoll() and not options.force_pselect:
+# ParallelFor() and Thread use POSIX threads outside of Windows.
+if not platform.is_windows():
+    cflags.append('-pthread')
+    ldflags.append('-pthread')
+
+if platform.supports_epoll() and not options.force_pselect:
+    cflags.append('-DUSE_EPOLL')
+elif platform.supports_ppoll() and not options.force_pselect:
     cflags.append('-DUSE_PPOLL')
+if platform.supports_io_uring():
+    cflags.append('-DUSE_IO_URING')
 if platform.supports_ninja_browse():
     cflags.append('-DNINJA_HAVE_BROWSE')
 
@@ -488,29 +505,51 @@ n.comment('Core source files all build into ninja library.')
 cxxvariables = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja.pdb')]
-for name in ['build',
+for name in ['action_cache',
+             'arena',
+             'build',
+             'build_events',
              'build_log',
              'clean',
              'clparser',
+             'critical_path',
+             'content_hash',
              'debug_flags',
              'depfile_parser',
+             'depfile_parser_simd',
              'deps_log',
              'disk_interface',
+             'dyndep',
+             'dyndep_parser',
              'edit_distance',
              'eval_env',
+             'failure_log',
              'graph',
              'graphviz',
+             'jobserver',
              'lexer',
              'line_printer',
+             'log_writer',
+             'manifest_cache',
+             'manifest_index',
              'manifest_parser',
+             'memory_stats',
              'metrics',
+             'ninja_api',
+             'shared_pool',
+             'slot_usage',
+             'stat_audit',
              'state',
              'string_piece_util',
+             'subprocess',
              'util',
              'version']:
     objs += cxx(name, variables=cxxvariables) 
 if platform.is_windows():
     for name in ['subprocess-win32',
+                 'file_watcher-win32',
+                 'jobserver-win32',
+                 'server-win32',
                  'includes_normalize-win32',
                  'msvc_helper-win32',
                  'msvc_helper_main-win32']:
@@ -520,6 +559,9 @@ if platform.is_windows():
     objs += cc('getopt')
 else:
     objs += cxx('subprocess-posix')
+    objs += cxx('file_watcher-posix')
+    objs += cxx('jobserver-posix')
+    objs += cxx('server-posix')
 if platform.is_aix():
     objs += cc('getopt')
 if platform.is_msvc():
@@ -536,6 +578,12 @@ else:
 if platform.is_aix():
     libs.append('-lperfstat')
 
+# GetProcessMemoryInfo() lives in psapi on older Windows versions.
+if platform.is_msvc():
+    libs.append('psapi.lib')
+elif platform.is_windows():
+    libs.append('-lpsapi')
+
 all_targets = []
 
 n.comment('Main executable is library plus main() function.')
@@ -557,18 +605,36 @@ objs = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja_test.pdb')]
 
-for name in ['build_log_test',
+for name in ['arena_test',
+             'build_events_test',
+             'build_log_test',
              'build_test',
              'clean_test',
              'clparser_test',
+             'critical_path_test',
+             'content_hash_test',
              'depfile_parser_test',
              'deps_log_test',
              'disk_interface_test',
+             'dyndep_parser_test',
              'edit_distance_test',
+             'failure_log_test',
+             'file_watcher_test',
              'graph_test',
+             'hash_map_test',
+             'jobserver_test',
              'lexer_test',
+             'manifest_cache_test',
+             'manifest_index_test',
              'manifest_parser_test',
+             'memory_stats_test',
+             'metrics_test',
+             'ninja_api_test',
              'ninja_test',
+             'server_test',
+             'shared_pool_test',
+             'slot_usage_test',
+             'stat_audit_test',
              'state_test',
              'string_piece_util_test',
              'subprocess_test',
@@ -590,9 +656,12 @@ n.comment('Ancillary executables.')
 for name in ['build_log_perftest',
              'canon_perftest',
              'depfile_parser_perftest',
+             'deps_log_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
-             'clparser_perftest']:
+             'clparser_perftest',
+             'status_perftest',
+             'subprocess_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
   objs = cxx(name, variables=cxxvariables)
@@ -601,6 +670,16 @@ for name in ['build_log_perftest',
 
 n.newline()
 
+if not host.is_windows():
+    n.comment('Measure ninja end to end on large fake projects.')
+    n.rule('scale_benchmark',
+           command='%s $root/misc/scale_benchmark.py --ninja ./ninja '
+                   '--output $out %s' % (options.with_python, built('scale')),
+           description='SCALE_BENCHMARK $out', pool='console')
+    n.build(built('scale_benchmark.json'), 'scale_benchmark', ninja)
+    n.build('scale_benchmark', 'phony', built('scale_benchmark.json'))
+    n.newline()
+
 n.comment('Generate a graph using the "graph" tool.')
 n.rule('gendot',
        command='./ninja -t graph all > $out')
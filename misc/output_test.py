@@ -95,5 +95,75 @@ red
 \x1b[31mred\x1b[0m
 ''')
 
+    def test_dirs(self):
+        ninja = os.path.abspath('./ninja')
+        with tempfile.TemporaryDirectory() as top:
+            for d in ['a', 'b']:
+                os.makedirs(os.path.join(top, 'x', d))
+                with open(os.path.join(top, 'x', d, 'build.ninja'), 'w') as f:
+                    f.write('rule t\n  command = touch $out\nbuild out: t\n')
+
+            def built(d):
+                return os.path.exists(os.path.join(top, 'x', d, 'out'))
+
+            # -C applies before the directories, which are relative to it.
+            subprocess.check_output([ninja, '-C', 'x', '--dirs', 'a,b'],
+                                    cwd=top, env=default_env, timeout=30)
+            self.assertTrue(built('a') and built('b'))
+
+            # An abbreviated --dirs isn't passed on to the builds.
+            for d in ['a', 'b']:
+                os.remove(os.path.join(top, 'x', d, 'out'))
+            subprocess.check_output([ninja, '--di', 'a,b', '-Cx'],
+                                    cwd=top, env=default_env, timeout=30)
+            self.assertTrue(built('a') and built('b'))
+
+            # Nor may they run --dirs themselves.
+            env = dict(default_env, NINJA_IN_DIRS='1')
+            self.assertNotEqual(subprocess.call(
+                [ninja, '--dir=a', '-Cx'], cwd=top, env=env,
+                stderr=subprocess.DEVNULL, timeout=30), 0)
+
+    def test_required_version_of_repeated_include(self):
+        ninja = os.path.abspath('./ninja')
+        with tempfile.TemporaryDirectory() as top:
+            files = {
+                'build.ninja': 'subninja a.ninja\nsubninja b.ninja\n',
+                'a.ninja': 'include common.ninja\n',
+                'b.ninja': 'include common.ninja\n',
+                # The second include of the file replays what the first
+                # defined, and checks the version again.
+                'common.ninja': 'ninja_required_version = 0.1\n',
+            }
+            for name, contents in files.items():
+                with open(os.path.join(top, name), 'w') as f:
+                    f.write(contents)
+            output = subprocess.check_output(
+                [ninja, '-t', 'targets'], cwd=top, env=default_env,
+                stderr=subprocess.STDOUT).decode('utf-8')
+            self.assertEqual(2, output.count('ninja_required_version (0.1)'))
+
+    def test_cache_graph(self):
+        ninja = os.path.abspath('./ninja')
+        with tempfile.TemporaryDirectory() as top:
+            with open(os.path.join(top, 'build.ninja'), 'w') as f:
+                f.write('rule t\n  command = touch $out\nbuild out: t\n')
+            cache = os.path.join(top, '.ninja_graph')
+
+            def ninja_in_top(*args):
+                subprocess.check_output([ninja] + list(args), cwd=top,
+                                        env=default_env)
+
+            # Only written when asked for.
+            ninja_in_top('-t', 'targets')
+            self.assertFalse(os.path.exists(cache))
+            ninja_in_top('--cache-graph')
+            self.assertTrue(os.path.exists(cache))
+
+            # Cleaning everything removes it along with the outputs.
+            ninja_in_top('-t', 'clean')
+            self.assertFalse(os.path.exists(cache))
+            self.assertFalse(os.path.exists(os.path.join(top, 'out')))
+
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+
+# Copyright 2018 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measures ninja end to end on fake projects of increasing size.
+
+For each size, this writes a project with about that many edges using
+write_fake_manifests.py, with empty sources, and commands that only touch
+their outputs and write depfiles, so that building it once gives build and
+deps logs of a realistic size.  It then measures:
+
+  - a dry run of the whole build, in a copy of the project that is never
+    built, which schedules every edge without running anything, for
+    ninja's scheduling overhead;
+  - no-op builds, for their latency, peak RSS, and the number of files
+    stat()ed and directories listed.
+
+Usage:
+  python3 misc/scale_benchmark.py --ninja ./ninja build/scale
+
+The results are written as JSON, one object per size per line, to stdout
+or to --output.  The projects are kept in the given directory, and reused
+by later runs with the same seed.  Needs a POSIX shell.
+"""
+
+import argparse
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import write_fake_manifests
+
+# What write_fake_manifests.py writes comes to about this many edges per
+# target: its sources, and a link and sometimes a stamp.
+EDGES_PER_TARGET = 57
+
+# Stands in for the compiler, archiver and linker of the fake manifests:
+# touches the output and, like -MMD, writes a depfile, which lists the
+# headers next to the source.
+FAKE_TOOL = r'''#!/bin/sh
+out= depfile= in=
+while [ $# -gt 0 ]; do
+  case $1 in
+    -o) out=$2; shift;;
+    -MF) depfile=$2; shift;;
+    -c) in=$2; shift;;
+  esac
+  shift
+done
+touch "$out"
+if [ -n "$depfile" ]; then
+  echo "$out: $in" "${in%/*}"/*.h > "$depfile"
+fi
+'''
+
+
+def write_project(outdir, edges, seed, sources):
+    """Writes a project of about |edges| edges to |outdir|, and its sources
+    if |sources|."""
+    random.seed(seed)
+    num_targets = max(2, edges // EDGES_PER_TARGET)
+    targets = write_fake_manifests.random_targets(num_targets, 'src')
+    for target in targets:
+        path = os.path.join(outdir, target.ninja_file_path)
+        with write_fake_manifests.FileWriter(path) as n:
+            write_fake_manifests.write_target_ninja(n, target, 'src')
+        if not sources:
+            continue
+        for cc, _ in target.src_obj_pairs:
+            cc = os.path.join(outdir, cc)
+            if not os.path.isdir(os.path.dirname(cc)):
+                os.makedirs(os.path.dirname(cc))
+            for source in [cc, os.path.splitext(cc)[0] + '.h']:
+                open(source, 'w').close()
+
+    tool = os.path.join(outdir, 'fake_tool')
+    with open(tool, 'w') as f:
+        f.write(FAKE_TOOL)
+    os.chmod(tool, 0o755)
+
+    path = os.path.join(outdir, 'build.ninja')
+    with write_fake_manifests.FileWriter(path) as n:
+        write_fake_manifests.write_master_ninja(n, targets)
+        # Commands are evaluated once the whole manifest is loaded, so
+        # these win.
+        n.newline()
+        n.variable('cxx', './fake_tool')
+        n.variable('ld', './fake_tool')
+        n.variable('alink', './fake_tool')
+
+
+def run_ninja(ninja, outdir, args, stats_path=None):
+    """Runs ninja in |outdir|; returns its output, wall time in ms and peak
+    RSS in KB, and the metrics of -d stats=FILE if |stats_path|."""
+    cmd = [ninja] + args
+    if stats_path:
+        cmd += ['-d', 'stats=' + stats_path]
+    start = time.time()
+    proc = subprocess.Popen(cmd, cwd=outdir, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT)
+    output = proc.stdout.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall_ms = (time.time() - start) * 1000
+    if status != 0:
+        sys.stderr.write(output.decode('utf-8', 'replace'))
+        raise Exception('%s failed in %s' % (' '.join(cmd), outdir))
+    rss_kb = usage.ru_maxrss
+    if sys.platform == 'darwin':
+        rss_kb //= 1024  # Bytes there.
+    metrics = {}
+    if stats_path:
+        with open(os.path.join(outdir, stats_path)) as f:
+            for metric in json.load(f)['metrics']:
+                metrics[metric['name']] = metric
+    return output.decode('utf-8', 'replace'), wall_ms, rss_kb, metrics
+
+
+def metric(metrics, name, field):
+    return metrics[name][field] if name in metrics else 0
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def benchmark(ninja, workdir, edges, seed, repeat, jobs):
+    projectdir = os.path.join(workdir, '%d-%d' % (edges, seed))
+    outdir = os.path.join(projectdir, 'noop')
+    drydir = os.path.join(projectdir, 'dry')
+    stamp = os.path.join(outdir, '.primed')
+    result = {'requested_edges': edges, 'seed': seed}
+
+    if not os.path.exists(stamp):
+        sys.stderr.write('writing a project of about %d edges to %s\n' %
+                         (edges, projectdir))
+        write_project(outdir, edges, seed, sources=True)
+        write_project(drydir, edges, seed, sources=False)
+        for name in ['src', 'fake_tool']:
+            if not os.path.lexists(os.path.join(drydir, name)):
+                os.symlink(os.path.join('..', 'noop', name),
+                           os.path.join(drydir, name))
+        sys.stderr.write('building it once for the logs\n')
+        run_ninja(ninja, outdir, ['-j', str(jobs)])
+        open(stamp, 'w').close()
+
+    # -n doesn't write the logs, so every edge is dirty every time.
+    _, dry_ms, _, metrics = run_ninja(ninja, drydir, ['-n', '-j', str(jobs)],
+                                      '.dry_run_stats.json')
+    result['edges'] = metric(metrics, 'FinishCommand', 'count')
+    result['dry_run_ms'] = round(dry_ms, 1)
+    result['dry_run_us_per_edge'] = round(
+        dry_ms * 1000 / max(result['edges'], 1), 2)
+
+    # The first no-op build may have caches to write.
+    run_ninja(ninja, outdir, [])
+    output = ''
+    times, rss = [], []
+    for _ in range(repeat):
+        output, wall_ms, rss_kb, metrics = run_ninja(ninja, outdir, [],
+                                                     '.noop_stats.json')
+        times.append(wall_ms)
+        rss.append(rss_kb)
+    if 'no work to do' not in output:
+        raise Exception('the build in %s is not a no-op:\n%s' %
+                        (outdir, output))
+    result['noop_ms_min'] = round(min(times), 1)
+    result['noop_ms_median'] = round(median(times), 1)
+    result['noop_peak_rss_kb'] = max(rss)
+    result['noop_file_stats'] = metric(metrics, 'file stats', 'total')
+    result['noop_directory_listings'] = metric(metrics, 'directory listings',
+                                               'total')
+    for name in ['.ninja_log', '.ninja_deps']:
+        result[name[1:] + '_bytes'] = os.path.getsize(
+            os.path.join(outdir, name))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--ninja', default='ninja',
+                        help='ninja binary to measure (default: ninja)')
+    parser.add_argument('--sizes', default='10000,100000,1000000',
+                        help='comma-separated numbers of edges '
+                             '(default: 10000,100000,1000000)')
+    parser.add_argument('-S', '--seed', type=int, default=12345,
+                        help='random seed (default: 12345)')
+    parser.add_argument('-r', '--repeat', type=int, default=5,
+                        help='no-op builds to measure per size (default: 5)')
+    parser.add_argument('-j', '--jobs', type=int, default=32,
+                        help='parallelism of the priming build (default: 32)')
+    parser.add_argument('-o', '--output',
+                        help='file to write the results to (default: stdout)')
+    parser.add_argument('workdir', help='directory to keep the projects in')
+    args = parser.parse_args()
+
+    ninja = os.path.abspath(args.ninja) if os.sep in args.ninja else args.ninja
+    version = subprocess.check_output([ninja, '--version']).decode().strip()
+    output = open(args.output, 'w') if args.output else sys.stdout
+    for edges in [int(size) for size in args.sizes.split(',')]:
+        result = benchmark(ninja, os.path.abspath(args.workdir), edges,
+                           args.seed, args.repeat, args.jobs)
+        result['ninja_version'] = version
+        output.write(json.dumps(result, sort_keys=True) + '\n')
+        output.flush()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
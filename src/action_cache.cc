@@ -0,0 +1,276 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "content_hash.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+
+namespace {
+
+const char kManifestSignature[] = "# ninja action cache v1\n";
+
+/// How many sets of discovered dependencies an entry remembers, e.g. one
+/// per branch that is switched between.
+const size_t kMaxVariants = 8;
+
+string HexString(uint64_t value) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, value);
+  return buf;
+}
+
+/// The outputs of a command for one set of discovered dependencies.
+struct Variant {
+  string id;
+  size_t output_count;
+  /// The text of the "dep" lines of the manifest.
+  string deps_text;
+  vector<string> dep_paths;
+  vector<uint64_t> dep_slash_bits;
+  vector<uint64_t> dep_hashes;
+};
+
+/// Parse a manifest, which has a "variant ID OUTPUTS DEPS" line for each
+/// variant, followed by one "dep HASH SLASH_BITS PATH" line for each of its
+/// dependencies.
+bool ParseManifest(const string& manifest, vector<Variant>* variants) {
+  const size_t kSignatureSize = sizeof(kManifestSignature) - 1;
+  if (manifest.compare(0, kSignatureSize, kManifestSignature) != 0)
+    return false;
+  size_t pos = kSignatureSize;
+  while (pos < manifest.size()) {
+    size_t end = manifest.find('\n', pos);
+    if (end == string::npos)
+      return false;
+    string line = manifest.substr(pos, end - pos);
+    pos = end + 1;
+    if (line.compare(0, 8, "variant ") == 0) {
+      char id[17];
+      unsigned output_count, dep_count;
+      if (sscanf(line.c_str() + 8, "%16s %u %u", id, &output_count,
+                 &dep_count) != 3) {
+        return false;
+      }
+      variants->push_back(Variant());
+      variants->back().id = id;
+      variants->back().output_count = output_count;
+    } else if (line.compare(0, 4, "dep ") == 0 && !variants->empty()) {
+      Variant* variant = &variants->back();
+      char* p;
+      uint64_t hash = strtoull(line.c_str() + 4, &p, 16);
+      uint64_t slash_bits = strtoull(p, &p, 10);
+      if (*p != ' ')
+        return false;
+      variant->dep_hashes.push_back(hash);
+      variant->dep_slash_bits.push_back(slash_bits);
+      variant->dep_paths.push_back(p + 1);
+      variant->deps_text += line + "\n";
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void FormatVariant(const Variant& variant, string* out) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "variant %s %u %u\n", variant.id.c_str(),
+           (unsigned)variant.output_count,
+           (unsigned)variant.dep_hashes.size());
+  *out += buf;
+  *out += variant.deps_text;
+}
+
+}  // anonymous namespace
+
+ActionCache::ActionCache(const string& dir, State* state,
+                         DiskInterface* disk_interface)
+    : dir_(dir), state_(state), disk_interface_(disk_interface) {}
+
+// static
+bool ActionCache::IsCacheable(Edge* edge) {
+  if (edge->is_phony() || edge->use_console() || edge->outputs_.empty())
+    return false;
+  if (edge->GetBindingBool(VarNames::kGenerator))
+    return false;
+  return !edge->GetBinding(VarNames::kDeps).empty() ||
+      edge->GetUnescapedDepfile().empty();
+}
+
+bool ActionCache::Restore(Edge* edge, vector<Node*>* deps_nodes) {
+  METRIC_RECORD("action cache restore");
+  string entry_dir;
+  if (!IsCacheable(edge) || !EntryDir(edge, &entry_dir))
+    return false;
+
+  string manifest, err;
+  vector<Variant> variants;
+  if (disk_interface_->ReadFile(entry_dir + "/manifest", &manifest, &err) !=
+          DiskInterface::Okay ||
+      !ParseManifest(manifest, &variants)) {
+    return false;
+  }
+
+  // The most recently stored variants come last.
+  for (vector<Variant>::reverse_iterator v = variants.rbegin();
+       v != variants.rend(); ++v) {
+    if (v->output_count != edge->outputs_.size())
+      continue;
+    vector<Node*> deps(v->dep_paths.size());
+    for (size_t i = 0; i < deps.size(); ++i)
+      deps[i] = state_->GetNode(v->dep_paths[i], v->dep_slash_bits[i]);
+    vector<uint64_t> hashes;
+    HashNodes(deps, &hashes);
+    if (hashes != v->dep_hashes)
+      continue;
+
+    // A copy comes out newer than the inputs, like the output of the
+    // command would.  With hard links, a later command that writes to its
+    // output in place would change the entry as well.
+    string variant_dir = entry_dir + "/" + v->id;
+    for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+      string path = edge->outputs_[i]->path().AsString();
+      if (disk_interface_->RemoveFile(path) < 0 ||
+          !disk_interface_->CloneFile(variant_dir + "/" + HexString(i),
+                                      path)) {
+        return false;
+      }
+    }
+    deps_nodes->swap(deps);
+    return true;
+  }
+  return false;
+}
+
+void ActionCache::Store(Edge* edge, const vector<Node*>& deps_nodes) {
+  METRIC_RECORD("action cache store");
+  string entry_dir;
+  if (!IsCacheable(edge) || !EntryDir(edge, &entry_dir))
+    return;
+
+  Variant variant;
+  variant.output_count = edge->outputs_.size();
+  HashNodes(deps_nodes, &variant.dep_hashes);
+  for (size_t i = 0; i < deps_nodes.size(); ++i) {
+    if (!variant.dep_hashes[i])
+      return;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "dep %s %" PRIu64 " ",
+             HexString(variant.dep_hashes[i]).c_str(),
+             deps_nodes[i]->slash_bits());
+    variant.deps_text += buf;
+    variant.deps_text.append(deps_nodes[i]->path().str_,
+                             deps_nodes[i]->path().len_);
+    variant.deps_text += '\n';
+  }
+  variant.id = HexString(ContentHash::Hash(variant.deps_text.data(),
+                                           variant.deps_text.size()));
+
+  string manifest_path = entry_dir + "/manifest";
+  string variant_dir = entry_dir + "/" + variant.id;
+  if (!disk_interface_->MakeDirs(variant_dir + "/0"))
+    return;
+  for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+    if (!disk_interface_->CloneFile(edge->outputs_[i]->path().AsString(),
+                                    variant_dir + "/" + HexString(i))) {
+      return;
+    }
+  }
+
+  // Only the variants that the manifest lists are used, so it is updated
+  // once the outputs are in place.
+  string old_manifest, err;
+  vector<Variant> variants;
+  if (disk_interface_->ReadFile(manifest_path, &old_manifest, &err) !=
+          DiskInterface::Okay ||
+      !ParseManifest(old_manifest, &variants)) {
+    variants.clear();
+  }
+  string manifest = kManifestSignature;
+  for (vector<Variant>::iterator v = variants.begin(); v != variants.end();
+       ++v) {
+    if (v->id == variant.id)
+      continue;  // Superseded by the new one.
+    if (variants.end() - v >= (ptrdiff_t)kMaxVariants) {
+      // Too old to keep around.
+      for (size_t i = 0; i < v->output_count; ++i) {
+        disk_interface_->RemoveFile(entry_dir + "/" + v->id + "/" +
+                                    HexString(i));
+      }
+      continue;
+    }
+    FormatVariant(*v, &manifest);
+  }
+  FormatVariant(variant, &manifest);
+  disk_interface_->WriteFile(manifest_path, manifest);
+}
+
+bool ActionCache::EntryDir(Edge* edge, string* entry_dir) {
+  // The inputs that the manifest names; the ones loaded from the deps log
+  // are checked against the variants of the entry instead.
+  int loaded_deps = edge->loaded_deps_ > 0 ? edge->loaded_deps_ : 0;
+  vector<Node*> inputs(edge->inputs_.begin(),
+                       edge->inputs_.end() - edge->order_only_deps_ -
+                           loaded_deps);
+  vector<uint64_t> hashes;
+  HashNodes(inputs, &hashes);
+
+  string key = HexString(edge->GetCommandHash()) + "\n";
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!hashes[i])
+      return false;
+    key += HexString(hashes[i]);
+    key.append(inputs[i]->path().str_, inputs[i]->path().len_);
+    key += '\n';
+  }
+  string hex = HexString(ContentHash::Hash(key.data(), key.size()));
+  *entry_dir = dir_ + "/" + hex.substr(0, 2) + "/" + hex;
+  return true;
+}
+
+void ActionCache::HashNodes(const vector<Node*>& nodes,
+                            vector<uint64_t>* hashes) {
+  hashes->resize(nodes.size());
+  vector<string> paths;
+  vector<size_t> indices;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    map<Node*, uint64_t>::iterator known = hashes_.find(nodes[i]);
+    if (known != hashes_.end()) {
+      (*hashes)[i] = known->second;
+    } else {
+      paths.push_back(nodes[i]->path().AsString());
+      indices.push_back(i);
+    }
+  }
+  if (paths.empty())
+    return;
+
+  vector<const string*> path_ptrs(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    path_ptrs[i] = &paths[i];
+  vector<uint64_t> new_hashes;
+  disk_interface_->HashFiles(path_ptrs, &new_hashes);
+  for (size_t i = 0; i < indices.size(); ++i) {
+    (*hashes)[indices[i]] = new_hashes[i];
+    hashes_[nodes[indices[i]]] = new_hashes[i];
+  }
+}
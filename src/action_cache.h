@@ -0,0 +1,74 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ACTION_CACHE_H_
+#define NINJA_ACTION_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // uint64_t
+
+struct DiskInterface;
+struct Edge;
+struct Node;
+struct State;
+
+/// Keeps copies of the outputs of the commands that ran, so that a command
+/// that already ran with the same inputs, e.g. before switching branches
+/// back and forth, doesn't need to run again.
+///
+/// An entry is keyed on the hash of the command and on the contents of the
+/// inputs that the manifest names.  It holds a few variants of the outputs,
+/// one for each set of dependencies that the command discovered, with the
+/// hashes of their contents; the variant whose dependencies still have
+/// those contents is the one restored.
+struct ActionCache {
+  ActionCache(const string& dir, State* state, DiskInterface* disk_interface);
+
+  /// Whether the outputs of |edge| may come from the cache.  Commands with
+  /// a depfile but no "deps" are left out, since the dependencies they
+  /// discover are only known once the depfile is loaded again.
+  static bool IsCacheable(Edge* edge);
+
+  /// Restore the outputs of |edge| if the cache has them, and return the
+  /// dependencies that were recorded along with them in |deps_nodes|.
+  /// Returns false if the command has to run.
+  bool Restore(Edge* edge, vector<Node*>* deps_nodes);
+
+  /// Keep copies of the outputs of |edge|, which just ran successfully and
+  /// discovered |deps_nodes|.  A command that can't be stored just runs
+  /// again next time.
+  void Store(Edge* edge, const vector<Node*>& deps_nodes);
+
+ private:
+  /// The directory of the entry for |edge|.  Returns false if an input
+  /// can't be read, which makes the command uncacheable.
+  bool EntryDir(Edge* edge, string* entry_dir);
+
+  /// Hash the contents of |nodes| into |hashes|, 0 meaning unreadable.
+  void HashNodes(const vector<Node*>& nodes, vector<uint64_t>* hashes);
+
+  string dir_;
+  State* state_;
+  DiskInterface* disk_interface_;
+  /// The hashes of the files read so far.  Files only change when the
+  /// edges that produce them run, which happens before anything that
+  /// reads them looks at them, so these stay valid for the whole build.
+  map<Node*, uint64_t> hashes_;
+};
+
+#endif  // NINJA_ACTION_CACHE_H_
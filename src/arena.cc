@@ -0,0 +1,84 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace {
+
+const size_t kBlockSize = 64 * 1024;
+
+/// Requests at least this big get a block of their own, so that they don't
+/// waste the rest of the current one.
+const size_t kLargeAlloc = kBlockSize / 4;
+
+/// The alignment of every allocation; enough for anything the graph holds.
+const size_t kAlignment = sizeof(void*) > sizeof(double) ? sizeof(void*)
+                                                         : sizeof(double);
+
+}  // anonymous namespace
+
+Arena::~Arena() {
+  for (vector<char*>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    free(*i);
+}
+
+void Arena::Swap(Arena* other) {
+  swap(next_, other->next_);
+  swap(end_, other->end_);
+  swap(bytes_allocated_, other->bytes_allocated_);
+  blocks_.swap(other->blocks_);
+}
+
+char* Arena::NewBlock(size_t size) {
+  char* block = static_cast<char*>(malloc(size));
+  if (!block)
+    Fatal("out of memory allocating %u bytes", static_cast<unsigned>(size));
+  blocks_.push_back(block);
+  bytes_allocated_ += size;
+  return block;
+}
+
+char* Arena::Allocate(size_t size, size_t alignment) {
+  if (size >= kLargeAlloc)
+    return NewBlock(size);
+  size_t padding = -reinterpret_cast<uintptr_t>(next_) & (alignment - 1);
+  if (static_cast<size_t>(end_ - next_) < padding + size) {
+    next_ = NewBlock(kBlockSize);
+    end_ = next_ + kBlockSize;
+    padding = 0;
+  }
+  char* result = next_ + padding;
+  next_ = result + size;
+  return result;
+}
+
+void* Arena::Alloc(size_t size) {
+  return Allocate(size, kAlignment);
+}
+
+StringPiece Arena::CopyString(StringPiece str) {
+  // Strings need no alignment, so they pack tightly between the objects.
+  char* copy = Allocate(str.size() + 1, 1);
+  if (str.size())
+    memcpy(copy, str.str_, str.size());
+  copy[str.size()] = '\0';
+  return StringPiece(copy, str.size());
+}
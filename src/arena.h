@@ -0,0 +1,62 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+#include "string_piece.h"
+
+/// A bump allocator for objects that live as long as the graph does.
+/// Allocations are carved out of large blocks and only freed all at once
+/// when the arena goes away; destructors of objects placed in it are not
+/// run by the arena.
+struct Arena {
+  Arena() : next_(NULL), end_(NULL), bytes_allocated_(0) {}
+  ~Arena();
+
+  /// Return |size| bytes, aligned for any type.
+  void* Alloc(size_t size);
+
+  /// Copy |str| into the arena, followed by a NUL, and return the copy.
+  StringPiece CopyString(StringPiece str);
+
+  /// Exchange the blocks of the two arenas.
+  void Swap(Arena* other);
+
+  /// The total size of the blocks allocated so far.
+  size_t bytes_allocated() const { return bytes_allocated_; }
+
+ private:
+  /// Return |size| bytes at a multiple of |alignment|, a power of two.
+  char* Allocate(size_t size, size_t alignment);
+
+  /// Allocate a new block of at least |size| bytes and return it.
+  char* NewBlock(size_t size);
+
+  char* next_;
+  char* end_;
+  size_t bytes_allocated_;
+  vector<char*> blocks_;
+
+  // Not copyable.
+  Arena(const Arena&);
+  void operator=(const Arena&);
+};
+
+#endif  // NINJA_ARENA_H_
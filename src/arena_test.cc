@@ -0,0 +1,69 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdint.h>
+
+#include "test.h"
+
+TEST(Arena, Alloc) {
+  Arena arena;
+  EXPECT_EQ(0u, arena.bytes_allocated());
+
+  char* a = static_cast<char*>(arena.Alloc(1));
+  char* b = static_cast<char*>(arena.Alloc(sizeof(double)));
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(b) % sizeof(double));
+  EXPECT_TRUE(b > a);
+  size_t block = arena.bytes_allocated();
+  EXPECT_GT(block, 0u);
+
+  // Many small allocations share a block.
+  for (int i = 0; i < 100; ++i)
+    arena.Alloc(16);
+  EXPECT_EQ(block, arena.bytes_allocated());
+
+  // A large one gets its own.
+  arena.Alloc(1 << 20);
+  EXPECT_EQ(block + (1 << 20), arena.bytes_allocated());
+}
+
+TEST(Arena, CopyString) {
+  Arena arena;
+  string str = "foo/bar.o";
+  StringPiece copy = arena.CopyString(str);
+  EXPECT_EQ(str, copy);
+  EXPECT_NE(str.data(), copy.str_);
+  EXPECT_EQ('\0', copy.str_[copy.size()]);
+
+  StringPiece empty = arena.CopyString("");
+  EXPECT_EQ(0u, empty.size());
+  EXPECT_EQ('\0', empty.str_[0]);
+}
+
+TEST(Arena, Swap) {
+  Arena arena, other;
+  char* a = static_cast<char*>(arena.Alloc(16));
+  size_t block = arena.bytes_allocated();
+  arena.Swap(&other);
+  EXPECT_EQ(0u, arena.bytes_allocated());
+  EXPECT_EQ(block, other.bytes_allocated());
+
+  // Each arena carries on in its own blocks.
+  char* b = static_cast<char*>(other.Alloc(16));
+  EXPECT_TRUE(b > a && b < a + block);
+  arena.Alloc(16);
+  EXPECT_EQ(block, arena.bytes_allocated());
+  EXPECT_EQ(block, other.bytes_allocated());
+}
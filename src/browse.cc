@@ -69,8 +69,10 @@ void RunBrowsePython(State* state, const char* ninja_command,
     close(pipefd[0]);
 
     // Write the script file into the stdin of the Python process.
-    ssize_t len = write(pipefd[1], kBrowsePy, sizeof(kBrowsePy));
-    if (len < (ssize_t)sizeof(kBrowsePy))
+    // Python doesn't take the NUL that ends the string.
+    const ssize_t size = sizeof(kBrowsePy) - 1;
+    ssize_t len = write(pipefd[1], kBrowsePy, size);
+    if (len < size)
       perror("ninja: write");
     close(pipefd[1]);
     exit(0);
@@ -27,7 +27,6 @@ try:
 except ImportError:
     import BaseHTTPServer as httpserver
 import argparse
-import cgi
 import os
 import socket
 import subprocess
@@ -59,8 +58,13 @@ def match_strip(line, prefix):
         return (False, line)
     return (True, line[len(prefix):])
 
+try:
+    from html import escape as _escape
+except ImportError:
+    from cgi import escape as _escape
+
 def html_escape(text):
-    return cgi.escape(text, quote=True)
+    return _escape(text, quote=True)
 
 def parse(text):
     lines = iter(text.split('\n'))
@@ -153,11 +157,43 @@ def generate_html(node):
 
     return '\n'.join(document)
 
+class NinjaQuery(object):
+    """Keeps one `ninja -t query -i` running, so that the graph is loaded
+    once rather than for every page."""
+
+    def __init__(self):
+        self.proc = None
+
+    def dump(self, target):
+        if '\n' in target or '\r' in target:
+            return ('', 'invalid target %r' % target, 1)
+        if self.proc is None or self.proc.poll() is not None:
+            cmd = [args.ninja_command, '-f', args.f, '-t', 'query', '-i']
+            self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE,
+                                         stdout=subprocess.PIPE,
+                                         universal_newlines=True)
+        try:
+            self.proc.stdin.write(target + '\n')
+            self.proc.stdin.flush()
+            lines = []
+            for line in iter(self.proc.stdout.readline, ''):
+                if line == '\n':
+                    break
+                lines.append(line)
+            else:
+                return ('', 'ninja -t query exited', 1)
+        except (IOError, OSError) as e:
+            return ('', 'ninja -t query failed: %s' % e, 1)
+        output = ''.join(lines)
+        error_prefix = 'ninja: error: '
+        if output.startswith(error_prefix):
+            return ('', output[len(error_prefix):], 1)
+        return (output, '', 0)
+
+ninja_query = NinjaQuery()
+
 def ninja_dump(target):
-    cmd = [args.ninja_command, '-f', args.f, '-t', 'query', target]
-    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
-                            universal_newlines=True)
-    return proc.communicate() + (proc.returncode,)
+    return ninja_query.dump(target)
 
 class RequestHandler(httpserver.BaseHTTPRequestHandler):
     def do_GET(self):
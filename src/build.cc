@@ -16,26 +16,42 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <limits>
 
-#ifdef _WIN32
 #include <fcntl.h>
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
 #endif
 
 #if defined(__SVR4) && defined(__sun)
 #include <sys/termios.h>
 #endif
 
+#include "action_cache.h"
+#include "build_events.h"
 #include "build_log.h"
 #include "clparser.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
 #include "deps_log.h"
 #include "disk_interface.h"
+#include "failure_log.h"
 #include "graph.h"
+#include "jobserver.h"
+#include "metrics.h"
+#include "slot_usage.h"
+#include "stat_audit.h"
 #include "state.h"
 #include "subprocess.h"
 #include "util.h"
@@ -47,7 +63,7 @@ struct DryRunCommandRunner : public CommandRunner {
   virtual ~DryRunCommandRunner() {}
 
   // Overridden from CommandRunner:
-  virtual bool CanRunMore();
+  virtual bool CanRunMore(const Edge* edge);
   virtual bool StartCommand(Edge* edge);
   virtual bool WaitForCommand(Result* result);
 
@@ -55,7 +71,7 @@ struct DryRunCommandRunner : public CommandRunner {
   queue<Edge*> finished_;
 };
 
-bool DryRunCommandRunner::CanRunMore() {
+bool DryRunCommandRunner::CanRunMore(const Edge* edge) {
   return true;
 }
 
@@ -74,53 +90,174 @@ bool DryRunCommandRunner::WaitForCommand(Result* result) {
    return true;
 }
 
+/// Parses the /showIncludes lines out of the output of a deps = msvc
+/// command as it is read, so that only what is printed is kept.
+struct ShowIncludesFilter : public OutputFilter {
+  ShowIncludesFilter(CLIncludeCache* cache, const string& deps_prefix)
+      : parser_(cache), deps_prefix_(deps_prefix) {}
+
+  virtual void Filter(const char* data, size_t size, string* kept) {
+    // After a failure, keep everything for the error to show.
+    if (!err_.empty() ||
+        !parser_.Feed(data, size, deps_prefix_, kept, &err_))
+      kept->append(data, size);
+  }
+
+  virtual void Finish(string* kept) {
+    if (err_.empty())
+      parser_.Finish(deps_prefix_, kept, &err_);
+  }
+
+  CLParser parser_;
+  string deps_prefix_;
+  string err_;
+};
+
 }  // namespace
 
+bool SimulatedCommandRunner::CanRunMore(const Edge* edge) {
+  // As in RealCommandRunner, an edge heavier than -j runs on its own.
+  return running_weight_ == 0 ||
+      edge->weight() <= config_.parallelism - running_weight_;
+}
+
+bool SimulatedCommandRunner::StartCommand(Edge* edge) {
+  // Plan::PrepareQueue() took the duration from the build log, or the
+  // average of those it has for an edge that isn't in it.
+  Running command;
+  command.end = now_ + max<int64_t>(0, edge->expected_duration());
+  command.order = started_++;
+  command.edge = edge;
+  running_.push(command);
+  running_weight_ += edge->weight();
+  return true;
+}
+
+bool SimulatedCommandRunner::WaitForCommand(Result* result) {
+  if (running_.empty())
+    return false;
+
+  Running command = running_.top();
+  running_.pop();
+  now_ = max(now_, command.end);
+  running_weight_ -= command.edge->weight();
+  result->status = ExitSuccess;
+  result->edge = command.edge;
+  return true;
+}
+
+vector<Edge*> SimulatedCommandRunner::GetActiveEdges() {
+  priority_queue<Running, vector<Running>, greater<Running> > running =
+      running_;
+  vector<Edge*> edges;
+  for (; !running.empty(); running.pop())
+    edges.push_back(running.top().edge);
+  return edges;
+}
+
+void SimulatedCommandRunner::Abort() {
+  running_ = priority_queue<Running, vector<Running>, greater<Running> >();
+  running_weight_ = 0;
+}
+
 BuildStatus::BuildStatus(const BuildConfig& config)
     : config_(config),
       start_time_millis_(GetTimeMillis()),
       started_edges_(0), finished_edges_(0), total_edges_(0),
-      progress_status_format_(NULL),
+      work_done_(0), remaining_work_(0), events_(NULL),
+      frame_millis_(config.status_fps > 0 ? 1000 / config.status_fps : 0),
+      last_frame_(-1000), pending_edge_(NULL), pending_status_(kEdgeStarted),
       overall_rate_(), current_rate_(config.parallelism) {
 
   // Don't do anything fancy in verbose mode.
   if (config_.verbosity != BuildConfig::NORMAL)
     printer_.set_smart_terminal(false);
 
-  progress_status_format_ = getenv("NINJA_STATUS");
-  if (!progress_status_format_)
-    progress_status_format_ = "[%f/%t] ";
+  const char* progress_status_format = getenv("NINJA_STATUS");
+  if (!progress_status_format)
+    progress_status_format = "[%f/%t] ";
+  string err;
+  if (!progress_status_format_.Parse(progress_status_format, &err))
+    Fatal("%s", err.c_str());
+
+  if (config_.events_fd >= 0)
+    events_ = new BuildEventStream(config_.events_fd);
+}
+
+BuildStatus::~BuildStatus() {
+  delete events_;
 }
 
 void BuildStatus::PlanHasTotalEdges(int total) {
   total_edges_ = total;
+  if (events_)
+    events_->TotalEdges(total);
+}
+
+void BuildStatus::PlanHasRemainingWork(int64_t millis) {
+  remaining_work_ = millis;
 }
 
 void BuildStatus::BuildEdgeStarted(Edge* edge) {
   int start_time = (int)(GetTimeMillis() - start_time_millis_);
   running_edges_.insert(make_pair(edge, start_time));
   ++started_edges_;
+  if (events_)
+    events_->EdgeStarted(edge, start_time);
+  if (config_.observer)
+    config_.observer->EdgeStarted(edge);
 
+  // A console edge gets the terminal: its status comes before it does.
   if (edge->use_console() || printer_.is_smart_terminal())
-    PrintStatus(edge, kEdgeStarted);
+    PrintStatus(edge, kEdgeStarted, edge->use_console());
 
   if (edge->use_console())
     printer_.SetConsoleLocked(true);
 }
 
+void BuildStatus::BuildLoadDyndeps() {
+  // The DependencyScan calls EXPLAIN() to print lines explaining why
+  // it considers a portion of the graph to be out of date.  Normally
+  // this is done before the build starts, but our caller is about to
+  // load a dyndep file during the build.  Doing so may generate more
+  // explanation lines (via fprintf directly to stderr), but in an
+  // interactive console the cursor is currently at the end of a status
+  // line.  Start a new line so that the first explanation does not
+  // append to the status line.  After the explanations are done a
+  // new build status line will appear.
+  if (g_explaining)
+    printer_.PrintOnNewLine("");
+}
+
 void BuildStatus::BuildEdgeFinished(Edge* edge,
-                                    bool success,
-                                    const string& output,
+                                    const CommandRunner::Result& result,
                                     int* start_time,
                                     int* end_time) {
   int64_t now = GetTimeMillis();
+  bool success = result.success();
+  const string& output = result.output;
 
   ++finished_edges_;
+  // Until the plan says otherwise, the edge is all the work it did.
+  if (success && edge->expected_duration() > 0) {
+    work_done_ += edge->expected_duration();
+    remaining_work_ = max<int64_t>(0,
+                                   remaining_work_ - edge->expected_duration());
+  }
 
   RunningEdgeMap::iterator i = running_edges_.find(edge);
   *start_time = i->second;
   *end_time = (int)(now - start_time_millis_);
   running_edges_.erase(i);
+  if (events_) {
+    events_->EdgeFinished(edge, *end_time, result.status, output,
+                          result.usage);
+    int64_t done, total;
+    EstimateWork(*end_time, &done, &total);
+    events_->Progress(done, total, EstimateRemainingTime(*end_time));
+  }
+  if (config_.observer)
+    config_.observer->EdgeFinished(edge, result);
 
   if (edge->use_console())
     printer_.SetConsoleLocked(false);
@@ -128,18 +265,20 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
+  // The status line of an edge that printed something comes before what it
+  // printed, rather than with the next frame.
   if (!edge->use_console())
-    PrintStatus(edge, kEdgeFinished);
+    PrintStatus(edge, kEdgeFinished, !success || !output.empty());
 
   // Print the command that is spewing before printing its output.
   if (!success) {
     string outputs;
     for (vector<Node*>::const_iterator o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o)
-      outputs += (*o)->path() + " ";
+      outputs += (*o)->path().AsString() + " ";
 
     printer_.PrintOnNewLine("FAILED: " + outputs + "\n");
-    printer_.PrintOnNewLine(edge->EvaluateCommand() + "\n");
+    printer_.PrintOnNewLine(edge->GetCommand() + "\n");
   }
 
   if (!output.empty()) {
@@ -179,135 +318,335 @@ void BuildStatus::BuildStarted() {
 }
 
 void BuildStatus::BuildFinished() {
+  FlushStatus();
   printer_.SetConsoleLocked(false);
   printer_.PrintOnNewLine("");
+  if (events_)
+    events_->BuildFinished();
+}
+
+bool ProgressStatusFormat::Parse(const char* format, string* err) {
+  ops_.clear();
+  text_.clear();
+  for (const char* s = format; *s != '\0'; ++s) {
+    Op op;
+    if (*s != '%' || s[1] == '%') {
+      // Text, which continues the previous op if that's text as well.
+      if (*s == '%')
+        ++s;
+      text_.push_back(*s);
+      if (!ops_.empty() && ops_.back().field == kText) {
+        ops_.back().end = text_.size();
+        continue;
+      }
+      op.field = kText;
+      op.begin = text_.size() - 1;
+      op.end = text_.size();
+      ops_.push_back(op);
+      continue;
+    }
+
+    ++s;
+    switch (*s) {
+    case 's': op.field = kStarted; break;
+    case 't': op.field = kTotal; break;
+    case 'r': op.field = kRunning; break;
+    case 'u': op.field = kUnstarted; break;
+    case 'f': op.field = kFinished; break;
+    case 'o': op.field = kOverallRate; break;
+    case 'c': op.field = kCurrentRate; break;
+    case 'p': op.field = kPercent; break;
+    case 'e': op.field = kElapsed; break;
+    case 'P': op.field = kWorkPercent; break;
+    case 'E': op.field = kRemainingTime; break;
+    default:
+      *err = string("unknown placeholder '%") + *s + "' in $NINJA_STATUS";
+      return false;
+    }
+    op.begin = op.end = 0;
+    ops_.push_back(op);
+  }
+  return true;
+}
+
+namespace {
+
+/// Append |value| in decimal to |out|, padded with spaces to |width|.
+void AppendInt(int value, size_t width, string* out) {
+  char buf[16];
+  char* end = buf + sizeof(buf);
+  char* p = end;
+  unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+  do {
+    *--p = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+    *--p = '-';
+  size_t size = end - p;
+  if (size < width)
+    out->append(width - size, ' ');
+  out->append(p, size);
 }
 
+}  // anonymous namespace
+
 string BuildStatus::FormatProgressStatus(
     const char* progress_status_format, EdgeStatus status) const {
+  ProgressStatusFormat format;
+  string err;
+  if (!format.Parse(progress_status_format, &err)) {
+    Fatal("%s", err.c_str());
+    return "";
+  }
   string out;
+  FormatProgressStatus(format, status, &out);
+  return out;
+}
+
+void BuildStatus::FormatProgressStatus(const ProgressStatusFormat& format,
+                                       EdgeStatus status, string* out) const {
   char buf[32];
-  int percent;
-  for (const char* s = progress_status_format; *s != '\0'; ++s) {
-    if (*s == '%') {
-      ++s;
-      switch (*s) {
-      case '%':
-        out.push_back('%');
-        break;
+  for (vector<ProgressStatusFormat::Op>::const_iterator op =
+           format.ops_.begin();
+       op != format.ops_.end(); ++op) {
+    switch (op->field) {
+    case ProgressStatusFormat::kText:
+      out->append(format.text_, op->begin, op->end - op->begin);
+      break;
 
-        // Started edges.
-      case 's':
-        snprintf(buf, sizeof(buf), "%d", started_edges_);
-        out += buf;
-        break;
+    case ProgressStatusFormat::kStarted:
+      AppendInt(started_edges_, 0, out);
+      break;
 
-        // Total edges.
-      case 't':
-        snprintf(buf, sizeof(buf), "%d", total_edges_);
-        out += buf;
-        break;
+    case ProgressStatusFormat::kTotal:
+      AppendInt(total_edges_, 0, out);
+      break;
 
-        // Running edges.
-      case 'r': {
-        int running_edges = started_edges_ - finished_edges_;
-        // count the edge that just finished as a running edge
-        if (status == kEdgeFinished)
-          running_edges++;
-        snprintf(buf, sizeof(buf), "%d", running_edges);
-        out += buf;
-        break;
-      }
+    case ProgressStatusFormat::kRunning: {
+      int running_edges = started_edges_ - finished_edges_;
+      // count the edge that just finished as a running edge
+      if (status == kEdgeFinished)
+        running_edges++;
+      AppendInt(running_edges, 0, out);
+      break;
+    }
 
-        // Unstarted edges.
-      case 'u':
-        snprintf(buf, sizeof(buf), "%d", total_edges_ - started_edges_);
-        out += buf;
-        break;
+    case ProgressStatusFormat::kUnstarted:
+      AppendInt(total_edges_ - started_edges_, 0, out);
+      break;
 
-        // Finished edges.
-      case 'f':
-        snprintf(buf, sizeof(buf), "%d", finished_edges_);
-        out += buf;
-        break;
+    case ProgressStatusFormat::kFinished:
+      AppendInt(finished_edges_, 0, out);
+      break;
 
-        // Overall finished edges per second.
-      case 'o':
-        overall_rate_.UpdateRate(finished_edges_);
-        SnprintfRate(overall_rate_.rate(), buf, "%.1f");
-        out += buf;
-        break;
+      // Overall finished edges per second.
+    case ProgressStatusFormat::kOverallRate:
+      overall_rate_.UpdateRate(finished_edges_);
+      SnprintfRate(overall_rate_.rate(), buf, "%.1f");
+      out->append(buf);
+      break;
 
-        // Current rate, average over the last '-j' jobs.
-      case 'c':
-        current_rate_.UpdateRate(finished_edges_);
-        SnprintfRate(current_rate_.rate(), buf, "%.1f");
-        out += buf;
-        break;
+      // Current rate, average over the last '-j' jobs.
+    case ProgressStatusFormat::kCurrentRate:
+      current_rate_.UpdateRate(finished_edges_);
+      SnprintfRate(current_rate_.rate(), buf, "%.1f");
+      out->append(buf);
+      break;
 
-        // Percentage
-      case 'p':
-        percent = (100 * finished_edges_) / total_edges_;
-        snprintf(buf, sizeof(buf), "%3i%%", percent);
-        out += buf;
-        break;
+    case ProgressStatusFormat::kPercent:
+      AppendInt((100 * finished_edges_) / total_edges_, 3, out);
+      out->push_back('%');
+      break;
 
-      case 'e': {
-        double elapsed = overall_rate_.Elapsed();
-        snprintf(buf, sizeof(buf), "%.3f", elapsed);
-        out += buf;
-        break;
-      }
+    case ProgressStatusFormat::kElapsed:
+      snprintf(buf, sizeof(buf), "%.3f", overall_rate_.Elapsed());
+      out->append(buf);
+      break;
 
-      default:
-        Fatal("unknown placeholder '%%%c' in $NINJA_STATUS", *s);
-        return "";
-      }
-    } else {
-      out.push_back(*s);
+    case ProgressStatusFormat::kWorkPercent: {
+      int64_t done, total;
+      EstimateWork((int)(GetTimeMillis() - start_time_millis_), &done,
+                   &total);
+      AppendInt(total > 0 ? (int)(100 * done / total) : 0, 3, out);
+      out->push_back('%');
+      break;
+    }
+
+    case ProgressStatusFormat::kRemainingTime: {
+      int64_t remaining =
+          EstimateRemainingTime((int)(GetTimeMillis() - start_time_millis_));
+      SnprintfRate(remaining < 0 ? -1 : remaining / 1e3, buf, "%.1f");
+      out->append(buf);
+      break;
+    }
     }
   }
+}
 
-  return out;
+namespace {
+
+/// Orders running edges by when they started, and then by id.
+struct StartedEarlier {
+  bool operator()(const pair<Edge*, int>& a, const pair<Edge*, int>& b) const {
+    if (a.second != b.second)
+      return a.second < b.second;
+    return a.first->id_ < b.first->id_;
+  }
+};
+
+}  // anonymous namespace
+
+void BuildStatus::EstimateWork(int now, int64_t* done,
+                               int64_t* total) const {
+  *done = work_done_;
+  *total = work_done_ + remaining_work_;
+  for (RunningEdgeMap::const_iterator i = running_edges_.begin();
+       i != running_edges_.end(); ++i) {
+    *done += max<int64_t>(0, min<int64_t>(now - i->second,
+                                          i->first->expected_duration()));
+  }
+  *done = min(*done, *total);
+}
+
+int64_t BuildStatus::EstimateRemainingTime(int now) const {
+  int64_t done, total;
+  EstimateWork(now, &done, &total);
+  if (done <= 0 || now <= 0)
+    return -1;
+  // The commands' durations in the log say how far the build got, and how
+  // long that took says how fast it goes, e.g. how many commands run at
+  // once and how much slower than in the log they are.
+  return (total - done) * now / done;
+}
+
+vector<string> BuildStatus::FormatRunningEdges(size_t count, int now) const {
+  vector<pair<Edge*, int> > running(running_edges_.begin(),
+                                    running_edges_.end());
+  count = min(count, running.size());
+  partial_sort(running.begin(), running.begin() + count, running.end(),
+               StartedEarlier());
+
+  vector<string> lines;
+  for (size_t i = 0; i < count; ++i) {
+    Edge* edge = running[i].first;
+    string description = edge->GetBinding(VarNames::kDescription);
+    if (description.empty())
+      description = edge->GetBinding(VarNames::kCommand);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%6.1fs ", (now - running[i].second) / 1e3);
+    lines.push_back(buf + description);
+  }
+  return lines;
 }
 
-void BuildStatus::PrintStatus(Edge* edge, EdgeStatus status) {
+void BuildStatus::PrintStatus(Edge* edge, EdgeStatus status, bool force) {
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
+  // Only a smart terminal overprints its status line, so only there can
+  // updates be left out.
+  int now = (int)(GetTimeMillis() - start_time_millis_);
+  if (!force && frame_millis_ && printer_.is_smart_terminal() &&
+      now - last_frame_ < frame_millis_) {
+    pending_edge_ = edge;
+    pending_status_ = status;
+    return;
+  }
+  last_frame_ = now;
+  pending_edge_ = NULL;
+  DrawStatus(edge, status);
+}
+
+void BuildStatus::FlushStatus() {
+  if (!pending_edge_)
+    return;
+  last_frame_ = (int)(GetTimeMillis() - start_time_millis_);
+  Edge* edge = pending_edge_;
+  pending_edge_ = NULL;
+  DrawStatus(edge, pending_status_);
+}
+
+void BuildStatus::DrawStatus(Edge* edge, EdgeStatus status) {
   bool force_full_command = config_.verbosity == BuildConfig::VERBOSE;
 
-  string to_print = edge->GetBinding("description");
-  if (to_print.empty() || force_full_command)
-    to_print = edge->GetBinding("command");
+  string description = edge->GetBinding(VarNames::kDescription);
+  if (description.empty() || force_full_command)
+    description = edge->GetBinding(VarNames::kCommand);
 
-  to_print = FormatProgressStatus(progress_status_format_, status) + to_print;
+  status_line_.clear();
+  FormatProgressStatus(progress_status_format_, status, &status_line_);
+  status_line_ += description;
 
-  printer_.Print(to_print,
+  if (config_.status_lines > 0 && printer_.is_smart_terminal()) {
+    printer_.PrintWithExtraLines(
+        status_line_, FormatRunningEdges(config_.status_lines, last_frame_));
+    return;
+  }
+  printer_.Print(status_line_,
                  force_full_command ? LinePrinter::FULL : LinePrinter::ELIDE);
 }
 
-Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
+Plan::Plan(Builder* builder)
+    : scheduled_(NULL), builder_(builder), command_edges_(0),
+      wanted_edges_(0), remaining_work_(0), default_duration_(1) {}
 
 void Plan::Reset() {
   command_edges_ = 0;
   wanted_edges_ = 0;
-  ready_.clear();
+  remaining_work_ = 0;
+  ready_ = EdgePriorityQueue();
+  shared_pools_.clear();
   want_.clear();
+  planned_edges_.clear();
 }
 
 bool Plan::AddTarget(Node* node, string* err) {
-  return AddSubTarget(node, NULL, err);
+  return AddSubTarget(node, NULL, err, NULL);
+}
+
+bool Plan::AddSubTarget(Node* node, Node* dependent, string* err,
+                        set<Edge*>* dyndep_walk) {
+  bool newly_added;
+  if (!AddNode(node, dependent, err, dyndep_walk, &newly_added))
+    return false;
+  if (!newly_added)
+    return true;  // We've already processed the inputs.
+
+  // The inputs are added depth first with an explicit stack of the nodes
+  // whose inputs are being added, each with the index of its next input,
+  // rather than recursion, as chains of edges may be deeper than a
+  // thread's stack allows.
+  vector<pair<Node*, size_t> > stack(1, make_pair(node, (size_t)0));
+  while (!stack.empty()) {
+    Node* top = stack.back().first;
+    size_t input = stack.back().second++;
+    if (input == top->in_edge()->inputs_.size()) {
+      stack.pop_back();
+      continue;
+    }
+    Node* in = top->in_edge()->inputs_[input];
+    if (!AddNode(in, top, err, dyndep_walk, &newly_added)) {
+      if (!err->empty())
+        return false;
+      continue;
+    }
+    if (newly_added)
+      stack.push_back(make_pair(in, (size_t)0));
+  }
+  return true;
 }
 
-bool Plan::AddSubTarget(Node* node, Node* dependent, string* err) {
+bool Plan::AddNode(Node* node, Node* dependent, string* err,
+                   set<Edge*>* dyndep_walk, bool* newly_added) {
+  *newly_added = false;
   Edge* edge = node->in_edge();
   if (!edge) {  // Leaf node.
     if (node->dirty()) {
       string referenced;
       if (dependent)
-        referenced = ", needed by '" + dependent->path() + "',";
-      *err = "'" + node->path() + "'" + referenced + " missing "
+        referenced = ", needed by '" + dependent->path().AsString() + "',";
+      *err = "'" + node->path().AsString() + "'" + referenced + " missing "
              "and no known rule to make it";
     }
     return false;
@@ -318,68 +657,245 @@ bool Plan::AddSubTarget(Node* node, Node* dependent, string* err) {
 
   // If an entry in want_ does not already exist for edge, create an entry which
   // maps to kWantNothing, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, Want>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, kWantNothing));
-  Want& want = want_ins.first->second;
+  if (edge->id_ >= want_.size())
+    want_.resize(edge->id_ + 1, kWantNotInPlan);
+  Want& want = want_[edge->id_];
+  *newly_added = want == kWantNotInPlan;
+  if (*newly_added) {
+    want = kWantNothing;
+    planned_edges_.push_back(edge);
+    // An edge that a dyndep file brought into the plan mid-build runs
+    // with the priority of the edge that needs it.
+    if (dyndep_walk && dependent && dependent->in_edge()) {
+      edge->critical_path_weight_ =
+          dependent->in_edge()->critical_path_weight_;
+      edge->scheduling_priority_ =
+          max(edge->priority_, dependent->in_edge()->scheduling_priority_);
+    }
+  }
+
+  if (dyndep_walk && want == kWantToFinish)
+    return false;  // Don't need to do anything with already-scheduled edge.
 
   // If we do need to build edge and we haven't already marked it as wanted,
   // mark it now.
   if (node->dirty() && want == kWantNothing) {
     want = kWantToStart;
-    ++wanted_edges_;
-    if (edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
-    if (!edge->is_phony())
-      ++command_edges_;
+    EdgeWanted(edge);
   }
 
-  if (!want_ins.second)
-    return true;  // We've already processed the inputs.
+  if (dyndep_walk)
+    dyndep_walk->insert(edge);
 
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    if (!AddSubTarget(*i, node, err) && !err->empty())
-      return false;
+  return true;
+}
+
+void Plan::PrepareQueue(BuildLog* build_log, const FailureLog* failures) {
+  ComputeCriticalPath(build_log, failures);
+  ScheduleInitialEdges();
+}
+
+void Plan::ComputeCriticalPath(BuildLog* build_log,
+                               const FailureLog* failures) {
+  METRIC_RECORD("ComputeCriticalPath");
+
+  // Edge::critical_path_weight_ doubles as the visit mark of the sort:
+  // -1 means "not yet visited".
+  for (vector<Edge*>::iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e) {
+    (*e)->critical_path_weight_ = -1;
+    (*e)->scheduling_priority_ = (*e)->priority_;
+    // Above any priority in the manifest, and passed on to what the edge
+    // depends on like one.
+    if (failures && failures->Failed(*e))
+      (*e)->scheduling_priority_ = INT_MAX;
+  }
+  vector<Edge*> order;
+  order.reserve(planned_edges_.size());
+  for (vector<Edge*>::iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e)
+    TopologicalSort(*e, &order);
+
+  // Look up how long each edge took the last time it ran.  Edges that
+  // never ran are assumed to take as long as the average edge that did.
+  vector<int64_t> durations(order.size(), -1);
+  int64_t total_duration = 0;
+  int known_durations = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    Edge* edge = order[i];
+    if (edge->is_phony()) {
+      durations[i] = 0;
+      continue;
+    }
+    if (!build_log)
+      continue;
+    BuildLog::LogEntry* entry =
+        build_log->LookupByOutput(edge->outputs_[0]->path());
+    if (!entry || entry->end_time < entry->start_time)
+      continue;
+    durations[i] = entry->end_time - entry->start_time;
+    total_duration += durations[i];
+    ++known_durations;
+  }
+  default_duration_ = 1;
+  if (known_durations > 0)
+    default_duration_ = max<int64_t>(1, total_duration / known_durations);
+  remaining_work_ = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    Edge* edge = order[i];
+    edge->expected_duration_ =
+        durations[i] >= 0 ? durations[i] : default_duration_;
+    Want want = GetWant(edge);
+    if (!edge->is_phony() && (want == kWantToStart || want == kWantToFinish))
+      remaining_work_ += edge->expected_duration_;
   }
 
-  return true;
+  // Walk from the consumers towards the producers.  By the time an edge is
+  // reached, critical_path_weight_ holds the heaviest path among its wanted
+  // consumers; add the edge's own duration and propagate it to its inputs,
+  // along with the highest priority among the consumers.
+  for (size_t i = order.size(); i-- > 0; ) {
+    Edge* edge = order[i];
+    edge->critical_path_weight_ += edge->expected_duration_;
+    for (vector<Node*>::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      Edge* producer = (*in)->in_edge();
+      if (!producer || GetWant(producer) == kWantNotInPlan)
+        continue;
+      if (producer->critical_path_weight_ < edge->critical_path_weight_)
+        producer->critical_path_weight_ = edge->critical_path_weight_;
+      // Phony edges only group targets: unless they have a priority, they
+      // leave the one of their inputs alone.
+      bool pass_priority =
+          !edge->is_phony() || edge->scheduling_priority_ != 0;
+      if (pass_priority &&
+          producer->scheduling_priority_ < edge->scheduling_priority_)
+        producer->scheduling_priority_ = edge->scheduling_priority_;
+    }
+  }
+}
+
+void Plan::TopologicalSort(Edge* edge, vector<Edge*>* order) {
+  if (edge->critical_path_weight_ != -1)
+    return;
+  // Depth first with an explicit stack of the edges being visited, each
+  // with the index of its next input, rather than recursion, as chains of
+  // edges may be deeper than a thread's stack allows.
+  vector<pair<Edge*, size_t> > stack;
+  edge->critical_path_weight_ = 0;
+  stack.push_back(make_pair(edge, (size_t)0));
+  while (!stack.empty()) {
+    Edge* top = stack.back().first;
+    size_t input = stack.back().second++;
+    if (input == top->inputs_.size()) {
+      order->push_back(top);
+      stack.pop_back();
+      continue;
+    }
+    Edge* producer = top->inputs_[input]->in_edge();
+    if (producer && producer->critical_path_weight_ == -1 &&
+        GetWant(producer) != kWantNotInPlan) {
+      producer->critical_path_weight_ = 0;
+      stack.push_back(make_pair(producer, (size_t)0));
+    }
+  }
+}
+
+void Plan::ScheduleInitialEdges() {
+  vector<Edge*> ready;
+  for (vector<Edge*>::iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e) {
+    if (GetWant(*e) == kWantToStart && (*e)->AllInputsReady())
+      ready.push_back(*e);
+  }
+  // Pools let edges in as they are scheduled, so schedule the edges that
+  // should run first first.
+  sort(ready.begin(), ready.end(), EdgePriorityLess());
+  for (vector<Edge*>::reverse_iterator e = ready.rbegin(); e != ready.rend();
+       ++e) {
+    ScheduleWork(*e);
+  }
 }
 
 Edge* Plan::FindWork() {
   if (ready_.empty())
     return NULL;
-  set<Edge*>::iterator e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  Edge* edge = ready_.top();
+  ready_.pop();
   return edge;
 }
 
-void Plan::ScheduleWork(map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+void Plan::GetWantedEdges(vector<Edge*>* edges) const {
+  for (vector<Edge*>::const_iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e) {
+    Want want = GetWant(*e);
+    if ((want == kWantToStart || want == kWantToFinish) && !(*e)->is_phony())
+      edges->push_back(*e);
+  }
+}
+
+Edge* Plan::PeekWork() const {
+  return ready_.empty() ? NULL : ready_.top();
+}
+
+void Plan::ScheduleWork(Edge* edge) {
+  Want& want = want_[edge->id_];
+  if (want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see https://github.com/ninja-build/ninja/pull/519).
     // Avoid scheduling the work again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(want == kWantToStart);
+  want = kWantToFinish;
+  if (scheduled_)
+    scheduled_->push_back(edge);
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
+  if (pool->shared())
+    shared_pools_.insert(pool);
   if (pool->ShouldDelayEdge()) {
     pool->DelayEdge(edge);
     pool->RetrieveReadyEdges(&ready_);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push(edge);
+  }
+}
+
+void Plan::RetrySharedPools() {
+  for (set<Pool*>::iterator p = shared_pools_.begin();
+       p != shared_pools_.end(); ++p) {
+    if ((*p)->has_delayed_edges())
+      (*p)->RetrieveReadyEdges(&ready_);
+  }
+}
+
+bool Plan::WaitsForSharedPools() const {
+  for (set<Pool*>::const_iterator p = shared_pools_.begin();
+       p != shared_pools_.end(); ++p) {
+    if ((*p)->has_delayed_edges())
+      return true;
+  }
+  return false;
+}
+
+void Plan::EdgeWanted(Edge* edge) {
+  ++wanted_edges_;
+  if (!edge->is_phony()) {
+    ++command_edges_;
+    // ComputeCriticalPath() overrides this for the edges wanted before it;
+    // those a dyndep file adds later keep it.
+    edge->expected_duration_ = default_duration_;
+    remaining_work_ += edge->expected_duration_;
   }
 }
 
-void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
-  map<Edge*, Want>::iterator e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+bool Plan::EdgeFinished(Edge* edge, EdgeResult result, string* err) {
+  Want want = GetWant(edge);
+  assert(want != kWantNotInPlan);
+  bool directly_wanted = want != kWantNothing;
 
   // See if this job frees up any delayed jobs.
   if (directly_wanted)
@@ -388,49 +904,69 @@ void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
 
   // The rest of this function only applies to successful commands.
   if (result != kEdgeSucceeded)
-    return;
+    return true;
 
-  if (directly_wanted)
+  if (directly_wanted) {
     --wanted_edges_;
-  want_.erase(e);
+    if (!edge->is_phony())
+      remaining_work_ -= edge->expected_duration_;
+  }
+  want_[edge->id_] = kWantNotInPlan;
   edge->outputs_ready_ = true;
 
   // Check off any nodes we were waiting for with this edge.
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    NodeFinished(*o);
+    if (!NodeFinished(*o, err))
+      return false;
   }
+  return true;
 }
 
-void Plan::NodeFinished(Node* node) {
+bool Plan::NodeFinished(Node* node, string* err) {
+  // If this node provides dyndep info, load it now.
+  if (node->dyndep_pending()) {
+    assert(builder_ && "dyndep requires Plan to have a Builder");
+    // Load the now-clean dyndep file.  This will also update the
+    // build plan and schedule any new work that is ready.
+    return builder_->LoadDyndeps(node, err);
+  }
+
   // See if we we want any edges from this node.
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+  for (EdgeSpan::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    if (GetWant(*oe) == kWantNotInPlan)
       continue;
 
     // See if the edge is now ready.
-    if ((*oe)->AllInputsReady()) {
-      if (want_e->second != kWantNothing) {
-        ScheduleWork(want_e);
-      } else {
-        // We do not need to build this edge, but we might need to build one of
-        // its dependents.
-        EdgeFinished(*oe, kEdgeSucceeded);
-      }
+    if (!EdgeMaybeReady(*oe, err))
+      return false;
+  }
+  return true;
+}
+
+bool Plan::EdgeMaybeReady(Edge* edge, string* err) {
+  if (edge->AllInputsReady()) {
+    if (GetWant(edge) != kWantNothing) {
+      ScheduleWork(edge);
+    } else {
+      // We do not need to build this edge, but we might need to build one of
+      // its dependents.
+      if (!EdgeFinished(edge, kEdgeSucceeded, err))
+        return false;
     }
   }
+  return true;
 }
 
 bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
   node->set_dirty(false);
 
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+  for (EdgeSpan::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     // Don't process edges that we don't actually want.
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    Want want = GetWant(*oe);
+    if (want == kWantNotInPlan || want == kWantNothing)
       continue;
 
     // Don't attempt to clean an edge if it failed to load deps.
@@ -470,103 +1006,1268 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
             return false;
         }
 
-        want_e->second = kWantNothing;
+        want_[(*oe)->id_] = kWantNothing;
         --wanted_edges_;
-        if (!(*oe)->is_phony())
+        if (!(*oe)->is_phony()) {
           --command_edges_;
+          remaining_work_ -= (*oe)->expected_duration_;
+        }
       }
     }
   }
   return true;
 }
 
-void Plan::Dump() {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, Want>::iterator e = want_.begin(); e != want_.end(); ++e) {
-    if (e->second != kWantNothing)
-      printf("want ");
-    e->first->Dump();
-  }
-  printf("ready: %d\n", (int)ready_.size());
-}
+bool Plan::DyndepsLoaded(DependencyScan* scan, Node* node,
+                         const DyndepFile& ddf, string* err) {
+  // Recompute the dirty state of all our direct and indirect dependents now
+  // that our dyndep information has been loaded.
+  if (!RefreshDyndepDependents(scan, node, err))
+    return false;
 
-struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
-  virtual ~RealCommandRunner() {}
-  virtual bool CanRunMore();
-  virtual bool StartCommand(Edge* edge);
-  virtual bool WaitForCommand(Result* result);
-  virtual vector<Edge*> GetActiveEdges();
-  virtual void Abort();
+  // We loaded dyndep information for those out_edges of the dyndep node that
+  // specify the node in a dyndep binding, but they may not be in the plan.
+  // Starting with those already in the plan, walk newly-reachable portion
+  // of the graph through the dyndep-discovered dependencies.
 
-  const BuildConfig& config_;
-  SubprocessSet subprocs_;
-  map<Subprocess*, Edge*> subproc_to_edge_;
-};
+  // Find edges in the the build plan for which we have new dyndep info.
+  vector<DyndepFile::const_iterator> dyndep_roots;
+  for (DyndepFile::const_iterator oe = ddf.begin(); oe != ddf.end(); ++oe) {
+    Edge* edge = oe->first;
 
-vector<Edge*> RealCommandRunner::GetActiveEdges() {
-  vector<Edge*> edges;
-  for (map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.begin();
-       e != subproc_to_edge_.end(); ++e)
-    edges.push_back(e->second);
-  return edges;
-}
+    // If the edge outputs are ready we do not need to consider it here.
+    if (edge->outputs_ready())
+      continue;
 
-void RealCommandRunner::Abort() {
-  subprocs_.Clear();
-}
+    // If the edge has not been encountered before then nothing already in the
+    // plan depends on it so we do not need to consider the edge yet either.
+    if (GetWant(edge) == kWantNotInPlan)
+      continue;
 
-bool RealCommandRunner::CanRunMore() {
-  size_t subproc_number =
-      subprocs_.running_.size() + subprocs_.finished_.size();
-  return (int)subproc_number < config_.parallelism
-    && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
-        || GetLoadAverage() < config_.max_load_average);
-}
+    // This edge is already in the plan so queue it for the walk.
+    dyndep_roots.push_back(oe);
+  }
 
-bool RealCommandRunner::StartCommand(Edge* edge) {
-  string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command, edge->use_console());
-  if (!subproc)
-    return false;
-  subproc_to_edge_.insert(make_pair(subproc, edge));
+  // Walk dyndep-discovered portion of the graph to add it to the build plan.
+  set<Edge*> dyndep_walk;
+  for (vector<DyndepFile::const_iterator>::iterator
+       oei = dyndep_roots.begin(); oei != dyndep_roots.end(); ++oei) {
+    DyndepFile::const_iterator oe = *oei;
+    for (vector<Node*>::const_iterator i = oe->second.implicit_inputs_.begin();
+         i != oe->second.implicit_inputs_.end(); ++i) {
+      if (!AddSubTarget(*i, oe->first->outputs_[0], err, &dyndep_walk) &&
+          !err->empty())
+        return false;
+    }
+  }
 
-  return true;
-}
+  // Add out edges from this node that are in the plan (just as
+  // Plan::NodeFinished would have without taking the dyndep code path).
+  for (EdgeSpan::const_iterator oe = node->out_edges().begin();
+       oe != node->out_edges().end(); ++oe) {
+    if (GetWant(*oe) != kWantNotInPlan)
+      dyndep_walk.insert(*oe);
+  }
 
-bool RealCommandRunner::WaitForCommand(Result* result) {
-  Subprocess* subproc;
-  while ((subproc = subprocs_.NextFinished()) == NULL) {
-    bool interrupted = subprocs_.DoWork();
-    if (interrupted)
+  // See if any encountered edges are now ready.
+  for (set<Edge*>::iterator wi = dyndep_walk.begin();
+       wi != dyndep_walk.end(); ++wi) {
+    if (GetWant(*wi) == kWantNotInPlan)
+      continue;
+    if (!EdgeMaybeReady(*wi, err))
       return false;
   }
 
-  result->status = subproc->Finish();
-  result->output = subproc->GetOutput();
+  return true;
+}
 
-  map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.find(subproc);
-  result->edge = e->second;
-  subproc_to_edge_.erase(e);
+bool Plan::RefreshDyndepDependents(DependencyScan* scan, Node* node,
+                                   string* err) {
+  // Collect the transitive closure of dependents and mark their edges
+  // as not yet visited by RecomputeDirty.
+  set<Node*> dependents;
+  UnmarkDependents(node, &dependents);
+
+  // Update the dirty state of all dependents and check if their edges
+  // have become wanted.
+  for (set<Node*>::iterator i = dependents.begin();
+       i != dependents.end(); ++i) {
+    Node* n = *i;
+
+    // Check if this dependent node is now dirty.  Also checks for new cycles.
+    if (!scan->RecomputeDirty(n, err))
+      return false;
+    if (!n->dirty())
+      continue;
 
-  delete subproc;
+    // This edge was encountered before.  However, we may not have wanted to
+    // build it if the outputs were not known to be dirty.  With dyndep
+    // information an output is now known to be dirty, so we want the edge.
+    Edge* edge = n->in_edge();
+    assert(edge && !edge->outputs_ready());
+    assert(GetWant(edge) != kWantNotInPlan);
+    if (want_[edge->id_] == kWantNothing) {
+      want_[edge->id_] = kWantToStart;
+      EdgeWanted(edge);
+    }
+  }
   return true;
 }
 
-Builder::Builder(State* state, const BuildConfig& config,
-                 BuildLog* build_log, DepsLog* deps_log,
-                 DiskInterface* disk_interface)
-    : state_(state), config_(config), disk_interface_(disk_interface),
-      scan_(state, build_log, deps_log, disk_interface) {
-  status_ = new BuildStatus(config);
-}
+void Plan::UnmarkDependents(Node* node, set<Node*>* dependents) {
+  for (EdgeSpan::const_iterator oe = node->out_edges().begin();
+       oe != node->out_edges().end(); ++oe) {
+    Edge* edge = *oe;
 
-Builder::~Builder() {
-  Cleanup();
+    if (GetWant(edge) == kWantNotInPlan)
+      continue;
+
+    if (edge->mark_ != Edge::VisitNone) {
+      edge->mark_ = Edge::VisitNone;
+      for (vector<Node*>::iterator o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o) {
+        if (dependents->insert(*o).second)
+          UnmarkDependents(*o, dependents);
+      }
+    }
+  }
 }
 
-void Builder::Cleanup() {
-  if (command_runner_.get()) {
+void Plan::Dump() {
+  int pending = 0;
+  for (vector<Edge*>::iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e) {
+    if (GetWant(*e) != kWantNotInPlan)
+      ++pending;
+  }
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::iterator e = planned_edges_.begin();
+       e != planned_edges_.end(); ++e) {
+    Want want = GetWant(*e);
+    if (want == kWantNotInPlan)
+      continue;
+    if (want != kWantNothing)
+      printf("want ");
+    (*e)->Dump();
+  }
+  printf("ready: %d\n", (int)ready_.size());
+}
+
+void AdaptiveParallelism::AddSample(Source source, double percent,
+                                    int64_t now_ms) {
+  last_sample_ms_ = now_ms;
+  if (percent < 0)
+    return;
+  double low = source == kPressureStall ? 5.0 : 90.0;
+  double high = source == kPressureStall ? 20.0 : 98.0;
+  if (percent > high)
+    limit_ = max(1, limit_ - max(1, limit_ / 4));
+  else if (percent < low)
+    limit_ = min(max_, limit_ + 1);
+}
+
+CpuPlacement::CpuPlacement(const vector<vector<int> >& nodes) {
+  if (nodes.size() >= 2)
+    nodes_ = nodes;
+  weights_.resize(nodes_.size());
+}
+
+int CpuPlacement::Place(int weight, const vector<int>& pool_cpus,
+                        vector<int>* cpus) {
+  int best = -1;
+  vector<int> best_cpus;
+  for (size_t node = 0; node < nodes_.size(); ++node) {
+    vector<int> node_cpus;
+    if (pool_cpus.empty()) {
+      node_cpus = nodes_[node];
+    } else {
+      set_intersection(nodes_[node].begin(), nodes_[node].end(),
+                       pool_cpus.begin(), pool_cpus.end(),
+                       back_inserter(node_cpus));
+      if (node_cpus.empty())
+        continue;
+    }
+    // Compare the weight per processor of the node, without dividing.
+    if (best < 0 || (int64_t)weights_[node] * best_cpus.size() <
+                    (int64_t)weights_[best] * node_cpus.size()) {
+      best = node;
+      best_cpus.swap(node_cpus);
+    }
+  }
+  if (best < 0) {
+    *cpus = pool_cpus;
+    return -1;
+  }
+  weights_[best] += weight;
+  cpus->swap(best_cpus);
+  return best;
+}
+
+void CpuPlacement::Release(int node, int weight) {
+  if (node >= 0)
+    weights_[node] -= weight;
+}
+
+void CpuPlacement::Reset() {
+  fill(weights_.begin(), weights_.end(), 0);
+}
+
+/// Runs commands through a remote execution client, --remote-exec, which
+/// gets what each of them reads and writes in a file.  The client sends
+/// the command to the remote service, brings the outputs back and exits
+/// with the command's exit code, or asks for the command to run here
+/// instead.  Commands in pools with "remote = 0" and console commands
+/// always run here.
+struct RemoteCommandRunner : public RealCommandRunner {
+  RemoteCommandRunner(const BuildConfig& config, BuildLog* build_log);
+  virtual bool CanRunMore(const Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+ private:
+  bool RunsRemotely(const Edge* edge) const;
+  /// The file describing what |edge| does, for the client.
+  static string ActionPath(const Edge* edge);
+
+  /// The running clients, which don't count against -j, -l or -m.
+  map<Subprocess*, Edge*> remote_;
+  /// The commands that the client gave back, waiting to run here.
+  deque<Edge*> fallbacks_;
+  /// The running twins of clients.
+  int remote_twins_;
+
+  virtual bool ReserveTwin(const Edge* edge);
+  virtual void ReleaseTwin(const Edge* edge);
+  virtual void Rekey(Subprocess* subproc, Subprocess* twin);
+};
+
+/// Runs commands on the --hosts machines over ssh, leaving the build
+/// directory to a filesystem they share with this one.  Each host has its
+/// own slots, and only takes edges of the pools it lists; -j, -l and -m
+/// only limit the commands that run here, which are those that no host
+/// takes, console commands and those in pools with "remote = 0".
+///
+/// The first command for a host waits for a master connection, which ssh
+/// keeps open for the following ones and later builds.  A host that ssh
+/// can't reach (exit code 255) takes no more commands, and its commands
+/// run somewhere else.
+struct SshCommandRunner : public RealCommandRunner {
+  SshCommandRunner(const BuildConfig& config, BuildLog* build_log);
+  virtual bool CanRunMore(const Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+ private:
+  struct Host {
+    Host(const WorkerHost* config)
+        : config(config), state(kUnconnected), used_slots(0) {}
+
+    const WorkerHost* config;
+    enum { kUnconnected, kConnecting, kUp, kDown } state;
+    /// The weight of its running commands and of those waiting for it to
+    /// connect.
+    int used_slots;
+    vector<Edge*> waiting;
+  };
+
+  /// Whether any host that is up or may be takes |edge|.
+  bool HostsTake(const Edge* edge) const;
+  /// The host with the most free slots for |edge|, or -1.
+  int PickHost(const Edge* edge) const;
+  /// What runs |command| on |host| with the persistent connection.
+  string SshCommand(const Host& host, const string& command) const;
+  bool Launch(Edge* edge, int host);
+  /// Stop sending commands to |host|, and run those waiting for it
+  /// elsewhere.
+  void HostDown(int host, const string& output);
+
+  vector<Host> hosts_;
+  /// The directory commands run in, on every host.
+  string cwd_;
+  /// The running commands, with their hosts.
+  map<Subprocess*, pair<Edge*, int> > remote_;
+  /// The running connection checks, with their hosts.
+  map<Subprocess*, int> connecting_;
+  /// The commands of hosts that went down, waiting to run again.
+  deque<Edge*> requeued_;
+};
+
+RealCommandRunner::RealCommandRunner(const BuildConfig& config,
+                                     BuildLog* build_log)
+    : config_(config), build_log_(build_log), running_weight_(0),
+      running_memory_(0), tokens_(0), adaptive_(config.parallelism),
+      placement_(config.numa_placement ? GetNumaNodeCpus()
+                                       : vector<vector<int> >()) {
+  JobserverConfig jobserver_config;
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags &&
+      JobserverConfig::ParseMakeFlags(makeflags, &jobserver_config)) {
+    string err;
+    if (!jobserver_.Connect(jobserver_config, &err))
+      Warning("%s; ignoring jobserver", err.c_str());
+  }
+}
+
+RealCommandRunner::~RealCommandRunner() {
+  ReleaseTokens(0);
+}
+
+int64_t RealCommandRunner::EstimateMemory(const Edge* edge) const {
+  if (config_.max_memory <= 0)
+    return 0;
+  // The build log is only updated once the command has finished, so this
+  // returns the same value when the command is started and when it's reaped.
+  if (build_log_) {
+    BuildLog::LogEntry* entry =
+        build_log_->LookupByOutput(edge->outputs_[0]->path());
+    if (entry && entry->usage.max_rss_kb > 0)
+      return (int64_t)entry->usage.max_rss_kb * 1024;
+  }
+  // Without a better estimate, every job slot gets an equal share.
+  return config_.max_memory / config_.parallelism * edge->weight();
+}
+
+void RealCommandRunner::ReleaseTokens(size_t needed) {
+  for (; tokens_ > needed; --tokens_)
+    jobserver_.Release();
+}
+
+void RealCommandRunner::ReleaseUnusedTokens() {
+  ReleaseTokens(running_weight_ > 0 ? running_weight_ - 1 : 0);
+}
+
+vector<Edge*> RealCommandRunner::GetActiveEdges() {
+  vector<Edge*> edges;
+  for (map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.begin();
+       e != subproc_to_edge_.end(); ++e)
+    edges.push_back(e->second);
+  return edges;
+}
+
+void RealCommandRunner::Abort() {
+  subprocs_.Clear();
+  hedges_.clear();
+  twins_.clear();
+  running_weight_ = 0;
+  running_memory_ = 0;
+  placement_.Reset();
+  subproc_to_node_.clear();
+  ReleaseTokens(0);
+}
+
+bool RealCommandRunner::CanRunMore(const Edge* edge) {
+  // An edge heavier than -j still gets to run, but only on its own.
+  if (running_weight_ > 0 &&
+      edge->weight() > config_.parallelism - running_weight_)
+    return false;
+  if (!subprocs_.running_.empty() && config_.max_load_average > 0.0f &&
+      GetLoadAverage() >= config_.max_load_average)
+    return false;
+  if (config_.adaptive_parallelism) {
+    int64_t now = GetTimeMillis();
+    if (adaptive_.NeedsSample(now)) {
+      double stall = GetPressureStall();
+      if (stall >= 0) {
+        adaptive_.AddSample(AdaptiveParallelism::kPressureStall, stall, now);
+      } else {
+        adaptive_.AddSample(AdaptiveParallelism::kCpuUtilization,
+                            GetCpuUtilization(), now);
+      }
+    }
+    if (running_weight_ > 0 &&
+        edge->weight() > adaptive_.limit() - running_weight_)
+      return false;
+  }
+  // The memory of commands that just started may not show up as used yet,
+  // so charge their estimates against the budget as well as checking what
+  // the system has left.
+  if (running_weight_ > 0 && config_.max_memory > 0) {
+    int64_t memory = EstimateMemory(edge);
+    if (memory > config_.max_memory - running_memory_)
+      return false;
+    int64_t available = GetAvailableMemory();
+    if (available >= 0 && memory > available)
+      return false;
+  }
+
+  // The implicit token covers one slot; every other one needs a token from
+  // the jobserver.  Tokens taken for an edge that can't start yet are kept
+  // until the next WaitForCommand().  With nothing running the edge starts
+  // anyway, so that the build always makes progress.
+  size_t needed = running_weight_ + edge->weight() - 1;
+  while (jobserver_.connected() && tokens_ < needed) {
+    if (!jobserver_.TryAcquire())
+      return running_weight_ == 0;
+    ++tokens_;
+  }
+  return true;
+}
+
+bool RealCommandRunner::StartCommand(Edge* edge) {
+  // The deps of a deps = gcc depfile go to the deps log, so nothing else
+  // reads the file.
+  MemoryFile* depfile = NULL;
+  string command;
+  if (edge->GetBindingBool(VarNames::kDepfileInMemory) &&
+      edge->GetBinding(VarNames::kDeps) == "gcc") {
+    depfile = new MemoryFile;
+    if (depfile->Create()) {
+      command = edge->EvaluateCommandWithDepfile(depfile->path());
+    } else {
+      delete depfile;
+      depfile = NULL;
+    }
+  }
+  vector<int> cpus;
+  int node = placement_.Place(edge->weight(), edge->pool()->cpus(), &cpus);
+  Subprocess* subproc = subprocs_.Add(
+      depfile ? command : edge->GetCommand(), edge->use_console(),
+      edge->GetBindingBool(VarNames::kDirectExec), depfile, &cpus);
+  if (!subproc) {
+    placement_.Release(node, edge->weight());
+    return false;
+  }
+  if (node >= 0)
+    subproc_to_node_.insert(make_pair(subproc, node));
+  CollectOutput(subproc, edge);
+  subproc_to_edge_.insert(make_pair(subproc, edge));
+  running_weight_ += edge->weight();
+  running_memory_ += EstimateMemory(edge);
+  // A depfile in memory is only there for one of the two.
+  if (!depfile && !edge->use_console()) {
+    AllowHedge(subproc, edge, edge->GetCommand(),
+               edge->GetBindingBool(VarNames::kDirectExec));
+  }
+
+  return true;
+}
+
+bool RealCommandRunner::WaitForCommand(Result* result) {
+  // Don't sit on a spare token while waiting, other processes may need it.
+  ReleaseUnusedTokens();
+
+  Subprocess* subproc = WaitForSubprocess();
+  if (!subproc)
+    return false;
+  ReapCommand(subproc, result);
+  return true;
+}
+
+bool RealCommandRunner::Sleep(int ms) {
+#ifdef _WIN32
+  ::Sleep(ms);
+  return true;
+#else
+  // SubprocessSet keeps the interruption signals blocked but for DoWork(),
+  // so one that came in meanwhile is pending.
+  usleep(ms * 1000);
+  SubprocessSet::HandlePendingInterruption();
+  return !SubprocessSet::IsInterrupted();
+#endif
+}
+
+Subprocess* RealCommandRunner::WaitForSubprocess() {
+  Subprocess* subproc;
+  while ((subproc = subprocs_.NextFinished()) == NULL) {
+    bool interrupted = subprocs_.DoWork(StartTwins());
+    if (interrupted)
+      return NULL;
+  }
+
+  map<Subprocess*, Subprocess*>::iterator t = twins_.find(subproc);
+  if (t != twins_.end()) {
+    METRIC_COUNT("hedges won", 1);
+    Subprocess* original = t->second;
+    twins_.erase(t);
+    map<Subprocess*, Hedge>::iterator h = hedges_.find(original);
+    Edge* edge = h->second.edge;
+    hedges_.erase(h);
+    Rekey(original, subproc);
+    subprocs_.Kill(original);
+    ReleaseTwin(edge);
+    return subproc;
+  }
+  map<Subprocess*, Hedge>::iterator h = hedges_.find(subproc);
+  if (h != hedges_.end()) {
+    if (Subprocess* twin = h->second.twin) {
+      twins_.erase(twin);
+      subprocs_.Kill(twin);
+      ReleaseTwin(h->second.edge);
+    }
+    hedges_.erase(h);
+  }
+  return subproc;
+}
+
+void RealCommandRunner::AllowHedge(Subprocess* subproc, Edge* edge,
+                                   const string& command, bool direct_exec) {
+  if (config_.hedge_factor <= 0 || !build_log_ ||
+      !edge->GetBindingBool(VarNames::kHedge))
+    return;
+  BuildLog::LogEntry* entry =
+      build_log_->LookupByOutput(edge->outputs_[0]->path());
+  if (!entry || entry->end_time <= entry->start_time)
+    return;
+  // Commands that take a moment are left alone, as their time varies the
+  // most and a copy of them would win little.
+  const int64_t kMinHedgeDelayMs = 1000;
+  Hedge hedge;
+  hedge.edge = edge;
+  hedge.command = command;
+  hedge.direct_exec = direct_exec;
+  hedge.deadline = Now() +
+      max(kMinHedgeDelayMs,
+          (int64_t)(config_.hedge_factor *
+                    (entry->end_time - entry->start_time)));
+  hedge.twin = NULL;
+  hedges_.insert(make_pair(subproc, hedge));
+}
+
+int RealCommandRunner::StartTwins() {
+  if (hedges_.empty())
+    return -1;
+  int64_t now = Now();
+  int64_t next = -1;
+  for (map<Subprocess*, Hedge>::iterator h = hedges_.begin();
+       h != hedges_.end(); ++h) {
+    Hedge& hedge = h->second;
+    if (hedge.twin)
+      continue;
+    if (hedge.deadline > now) {
+      if (next < 0 || hedge.deadline < next)
+        next = hedge.deadline;
+      continue;
+    }
+    // Without room, it's tried again once a command finishes.
+    if (!ReserveTwin(hedge.edge))
+      continue;
+    Subprocess* twin = subprocs_.Add(hedge.command, false, hedge.direct_exec);
+    if (!twin) {
+      ReleaseTwin(hedge.edge);
+      hedge.deadline = numeric_limits<int64_t>::max();
+      continue;
+    }
+    METRIC_COUNT("hedges started", 1);
+    CollectOutput(twin, hedge.edge);
+    hedge.twin = twin;
+    twins_.insert(make_pair(twin, h->first));
+  }
+  return next < 0 ? -1 : (int)(next - now);
+}
+
+bool RealCommandRunner::ReserveTwin(const Edge* edge) {
+  if (!RealCommandRunner::CanRunMore(edge))
+    return false;
+  // A twin is another command in the pool, as much as the original.
+  if (!edge->pool()->ScheduleCopy(*edge))
+    return false;
+  running_weight_ += edge->weight();
+  running_memory_ += EstimateMemory(edge);
+  return true;
+}
+
+void RealCommandRunner::ReleaseTwin(const Edge* edge) {
+  edge->pool()->EdgeFinished(*edge);
+  running_weight_ -= edge->weight();
+  running_memory_ -= EstimateMemory(edge);
+}
+
+void RealCommandRunner::Rekey(Subprocess* subproc, Subprocess* twin) {
+  map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.find(subproc);
+  if (e != subproc_to_edge_.end()) {
+    subproc_to_edge_.insert(make_pair(twin, e->second));
+    subproc_to_edge_.erase(e);
+  }
+  map<Subprocess*, int>::iterator node = subproc_to_node_.find(subproc);
+  if (node != subproc_to_node_.end()) {
+    subproc_to_node_.insert(make_pair(twin, node->second));
+    subproc_to_node_.erase(node);
+  }
+}
+
+void RealCommandRunner::CollectOutput(Subprocess* subproc, Edge* edge) {
+  // /showIncludes lines can be anywhere in the output, so they are filtered
+  // out before the limit applies.
+  if (edge->GetBinding(VarNames::kDeps) == "msvc") {
+    subproc->SetOutputFilter(new ShowIncludesFilter(
+        &includes_cache_, edge->GetBinding(VarNames::kMsvcDepsPrefix)));
+  }
+  subproc->SetOutputLimit((size_t)config_.max_output);
+}
+
+void RealCommandRunner::TakeOutput(Subprocess* subproc, Result* result) {
+  result->output = subproc->GetOutput();
+  // The only filter there is.
+  ShowIncludesFilter* filter =
+      static_cast<ShowIncludesFilter*>(subproc->GetOutputFilter());
+  if (filter) {
+    result->includes_parsed = true;
+    result->includes.swap(filter->parser_.includes_);
+    result->includes_err = filter->err_;
+  }
+}
+
+void RealCommandRunner::ReapCommand(Subprocess* subproc, Result* result) {
+  result->status = subproc->Finish();
+  TakeOutput(subproc, result);
+  result->usage = subproc->GetResourceUsage();
+  if (const MemoryFile* depfile = subproc->GetMemoryFile())
+    result->depfile_in_memory = depfile->Read(&result->depfile);
+
+  map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.find(subproc);
+  result->edge = e->second;
+  subproc_to_edge_.erase(e);
+  running_weight_ -= result->edge->weight();
+  running_memory_ -= EstimateMemory(result->edge);
+  map<Subprocess*, int>::iterator node = subproc_to_node_.find(subproc);
+  if (node != subproc_to_node_.end()) {
+    placement_.Release(node->second, result->edge->weight());
+    subproc_to_node_.erase(node);
+  }
+
+  delete subproc;
+  // The finished command's token goes back to the jobserver right away.
+  ReleaseUnusedTokens();
+}
+
+/// Exit code with which the client asks for a command to run locally, e.g.
+/// because the remote service is unreachable; EX_TEMPFAIL in <sysexits.h>.
+const int kRemoteFallbackExitCode = 75;
+
+RemoteCommandRunner::RemoteCommandRunner(const BuildConfig& config,
+                                         BuildLog* build_log)
+    : RealCommandRunner(config, build_log), remote_twins_(0) {}
+
+bool RemoteCommandRunner::RunsRemotely(const Edge* edge) const {
+  return !edge->use_console() && edge->pool()->remote();
+}
+
+bool RemoteCommandRunner::CanRunMore(const Edge* edge) {
+  if (!RunsRemotely(edge))
+    return RealCommandRunner::CanRunMore(edge);
+  return (int)remote_.size() + remote_twins_ < config_.remote_jobs;
+}
+
+bool RemoteCommandRunner::StartCommand(Edge* edge) {
+  if (!RunsRemotely(edge))
+    return RealCommandRunner::StartCommand(edge);
+
+  // The client finds out what to do from a file next to the first output.
+  string action = "# ninja action v1\n";
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+    action += "input " + (*i)->path().AsString() + "\n";
+  }
+  string rspfile = edge->GetUnescapedRspfile();
+  if (!rspfile.empty())
+    action += "input " + rspfile + "\n";
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    action += "output " + (*o)->path().AsString() + "\n";
+  }
+  string depfile = edge->GetUnescapedDepfile();
+  if (!depfile.empty())
+    action += "output " + depfile + "\n";
+  action += "command\n" + edge->GetCommand() + "\n";
+
+  string action_path = ActionPath(edge);
+  FILE* f = fopen(action_path.c_str(), "wb");
+  if (!f || fwrite(action.data(), 1, action.size(), f) != action.size()) {
+    Error("writing %s: %s", action_path.c_str(), strerror(errno));
+    if (f)
+      fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  string command = config_.remote_exec + " ";
+#ifdef _WIN32
+  GetWin32EscapedString(action_path, &command);
+#else
+  GetShellEscapedString(action_path, &command);
+#endif
+  Subprocess* subproc = subprocs_.Add(command);
+  if (!subproc)
+    return false;
+  CollectOutput(subproc, edge);
+  remote_.insert(make_pair(subproc, edge));
+  // The copy is another request to the service, which may well run it on
+  // another machine.
+  AllowHedge(subproc, edge, command, false);
+  return true;
+}
+
+bool RemoteCommandRunner::ReserveTwin(const Edge* edge) {
+  if (!RunsRemotely(edge))
+    return RealCommandRunner::ReserveTwin(edge);
+  if (!CanRunMore(edge) || !edge->pool()->ScheduleCopy(*edge))
+    return false;
+  ++remote_twins_;
+  return true;
+}
+
+void RemoteCommandRunner::ReleaseTwin(const Edge* edge) {
+  if (!RunsRemotely(edge)) {
+    RealCommandRunner::ReleaseTwin(edge);
+  } else {
+    edge->pool()->EdgeFinished(*edge);
+    --remote_twins_;
+  }
+}
+
+void RemoteCommandRunner::Rekey(Subprocess* subproc, Subprocess* twin) {
+  map<Subprocess*, Edge*>::iterator r = remote_.find(subproc);
+  if (r != remote_.end()) {
+    remote_.insert(make_pair(twin, r->second));
+    remote_.erase(r);
+  }
+  RealCommandRunner::Rekey(subproc, twin);
+}
+
+bool RemoteCommandRunner::WaitForCommand(Result* result) {
+  ReleaseUnusedTokens();
+
+  for (;;) {
+    // Run what the client gave back once there's room for it here, or right
+    // away if nothing runs here, so that the build moves on.
+    while (!fallbacks_.empty() &&
+           (running_weight_ == 0 ||
+            RealCommandRunner::CanRunMore(fallbacks_.front()))) {
+      Edge* edge = fallbacks_.front();
+      fallbacks_.pop_front();
+      if (!RealCommandRunner::StartCommand(edge)) {
+        result->edge = edge;
+        result->status = ExitFailure;
+        result->output = "couldn't run '" + edge->GetCommand() + "' locally";
+        return true;
+      }
+    }
+
+    Subprocess* subproc = WaitForSubprocess();
+    if (!subproc)
+      return false;
+    map<Subprocess*, Edge*>::iterator r = remote_.find(subproc);
+    if (r == remote_.end()) {
+      ReapCommand(subproc, result);
+      return true;
+    }
+
+    Edge* edge = r->second;
+    remote_.erase(r);
+    ExitStatus status = subproc->Finish();
+    unlink(ActionPath(edge).c_str());
+    if (status == ExitFailure &&
+        subproc->GetExitCode() == kRemoteFallbackExitCode) {
+      delete subproc;
+      fallbacks_.push_back(edge);
+      continue;
+    }
+
+    // The resources that the client used say nothing about the command's.
+    result->edge = edge;
+    result->status = status;
+    TakeOutput(subproc, result);
+    delete subproc;
+    return true;
+  }
+}
+
+vector<Edge*> RemoteCommandRunner::GetActiveEdges() {
+  vector<Edge*> edges = RealCommandRunner::GetActiveEdges();
+  for (map<Subprocess*, Edge*>::iterator e = remote_.begin();
+       e != remote_.end(); ++e) {
+    edges.push_back(e->second);
+  }
+  return edges;
+}
+
+void RemoteCommandRunner::Abort() {
+  for (map<Subprocess*, Edge*>::iterator e = remote_.begin();
+       e != remote_.end(); ++e) {
+    unlink(ActionPath(e->second).c_str());
+  }
+  remote_.clear();
+  fallbacks_.clear();
+  remote_twins_ = 0;
+  RealCommandRunner::Abort();
+}
+
+// static
+string RemoteCommandRunner::ActionPath(const Edge* edge) {
+  return edge->outputs_[0]->path().AsString() + ".ninja-action";
+}
+
+bool WorkerHost::AllowsPool(const string& pool) const {
+  return pools.empty() || find(pools.begin(), pools.end(), pool) != pools.end();
+}
+
+bool ParseWorkerHosts(const string& contents, vector<WorkerHost>* hosts,
+                      string* err) {
+  hosts->clear();
+  size_t start = 0;
+  for (int line = 1; start < contents.size(); ++line) {
+    size_t end = contents.find('\n', start);
+    if (end == string::npos)
+      end = contents.size();
+    vector<string> words;
+    size_t pos = start;
+    while (pos < end) {
+      size_t word = contents.find_first_not_of(" \t\r", pos);
+      if (word == string::npos || word >= end)
+        break;
+      pos = contents.find_first_of(" \t\r", word);
+      if (pos == string::npos || pos > end)
+        pos = end;
+      words.push_back(contents.substr(word, pos - word));
+    }
+    start = end + 1;
+    if (words.empty() || words[0][0] == '#')
+      continue;
+
+    char where[32];
+    snprintf(where, sizeof(where), "line %d: ", line);
+    char* slots_end = NULL;
+    long slots = words.size() >= 2 ? strtol(words[1].c_str(), &slots_end, 10)
+                                   : 0;
+    if (slots <= 0 || *slots_end != 0) {
+      *err = string(where) + "expected 'NAME SLOTS [POOL...]'";
+      return false;
+    }
+    for (vector<WorkerHost>::iterator h = hosts->begin(); h != hosts->end();
+         ++h) {
+      if (h->name == words[0]) {
+        *err = string(where) + "duplicate host '" + words[0] + "'";
+        return false;
+      }
+    }
+    hosts->push_back(WorkerHost());
+    hosts->back().name = words[0];
+    hosts->back().slots = (int)slots;
+    hosts->back().pools.assign(words.begin() + 2, words.end());
+  }
+  if (hosts->empty()) {
+    *err = "no hosts";
+    return false;
+  }
+  return true;
+}
+
+SshCommandRunner::SshCommandRunner(const BuildConfig& config,
+                                   BuildLog* build_log)
+    : RealCommandRunner(config, build_log) {
+  for (vector<WorkerHost>::const_iterator h = config.hosts.begin();
+       h != config.hosts.end(); ++h) {
+    hosts_.push_back(Host(&*h));
+  }
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)))
+    cwd_ = cwd;
+#ifndef _WIN32
+  // Every ssh client holds a pipe, and there may be many thousands of them.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#endif
+}
+
+bool SshCommandRunner::HostsTake(const Edge* edge) const {
+  if (edge->use_console() || !edge->pool()->remote())
+    return false;
+  for (vector<Host>::const_iterator h = hosts_.begin(); h != hosts_.end();
+       ++h) {
+    if (h->state != Host::kDown && h->config->AllowsPool(edge->pool()->name()))
+      return true;
+  }
+  return false;
+}
+
+int SshCommandRunner::PickHost(const Edge* edge) const {
+  int best = -1;
+  int best_free = 0;
+  for (size_t i = 0; i < hosts_.size(); ++i) {
+    const Host& host = hosts_[i];
+    if (host.state == Host::kDown ||
+        !host.config->AllowsPool(edge->pool()->name()))
+      continue;
+    // An edge heavier than a host still gets to run there, but only on its
+    // own.
+    int free = host.config->slots - host.used_slots;
+    if (free < edge->weight() && host.used_slots > 0)
+      continue;
+    if (best == -1 || free > best_free) {
+      best = (int)i;
+      best_free = free;
+    }
+  }
+  return best;
+}
+
+bool SshCommandRunner::CanRunMore(const Edge* edge) {
+  if (!HostsTake(edge))
+    return RealCommandRunner::CanRunMore(edge);
+  return PickHost(edge) != -1;
+}
+
+bool SshCommandRunner::StartCommand(Edge* edge) {
+  int host = HostsTake(edge) ? PickHost(edge) : -1;
+  if (host == -1)
+    return RealCommandRunner::StartCommand(edge);
+
+  Host& h = hosts_[host];
+  h.used_slots += edge->weight();
+  if (h.state == Host::kUp)
+    return Launch(edge, host);
+  h.waiting.push_back(edge);
+  if (h.state == Host::kUnconnected) {
+    // Commands started together would each open a connection of their
+    // own, so they wait for this one to be the master.
+    Subprocess* subproc = subprocs_.Add(SshCommand(h, "true"));
+    if (!subproc)
+      return false;
+    connecting_.insert(make_pair(subproc, host));
+    h.state = Host::kConnecting;
+  }
+  return true;
+}
+
+string SshCommandRunner::SshCommand(const Host& host,
+                                    const string& command) const {
+  string remote = "cd ";
+  GetShellEscapedString(cwd_, &remote);
+  remote += " && " + command;
+  string ssh = "ssh -T -o BatchMode=yes -o ControlMaster=auto "
+               "-o ControlPersist=10m -o ControlPath=~/.ssh/ninja-%C ";
+  GetShellEscapedString(host.config->name, &ssh);
+  ssh += " ";
+  GetShellEscapedString(remote, &ssh);
+  return ssh;
+}
+
+bool SshCommandRunner::Launch(Edge* edge, int host) {
+  Subprocess* subproc = subprocs_.Add(SshCommand(hosts_[host],
+                                                 edge->GetCommand()));
+  if (!subproc)
+    return false;
+  CollectOutput(subproc, edge);
+  remote_.insert(make_pair(subproc, make_pair(edge, host)));
+  return true;
+}
+
+void SshCommandRunner::HostDown(int host, const string& output) {
+  Host& h = hosts_[host];
+  if (h.state != Host::kDown) {
+    string message = output;
+    if (!message.empty() && message[message.size() - 1] == '\n')
+      message.resize(message.size() - 1);
+    Warning("can't reach %s, running its commands elsewhere:\n%s",
+            h.config->name.c_str(), message.c_str());
+  }
+  h.state = Host::kDown;
+  for (vector<Edge*>::iterator e = h.waiting.begin(); e != h.waiting.end();
+       ++e) {
+    h.used_slots -= (*e)->weight();
+    requeued_.push_back(*e);
+  }
+  h.waiting.clear();
+}
+
+bool SshCommandRunner::WaitForCommand(Result* result) {
+  ReleaseUnusedTokens();
+
+  for (;;) {
+    // Commands of a host that went down go to the other hosts, or here once
+    // there's room, or right away if nothing runs at all.
+    while (!requeued_.empty() &&
+           (CanRunMore(requeued_.front()) || subprocs_.running_.empty())) {
+      Edge* edge = requeued_.front();
+      requeued_.pop_front();
+      if (!StartCommand(edge)) {
+        result->edge = edge;
+        result->status = ExitFailure;
+        result->output = "couldn't run '" + edge->GetCommand() + "'";
+        return true;
+      }
+    }
+
+    Subprocess* subproc = WaitForSubprocess();
+    if (!subproc)
+      return false;
+
+    map<Subprocess*, int>::iterator c = connecting_.find(subproc);
+    if (c != connecting_.end()) {
+      int host = c->second;
+      connecting_.erase(c);
+      ExitStatus status = subproc->Finish();
+      string output = subproc->GetOutput();
+      delete subproc;
+      if (status == ExitInterrupted)
+        return false;
+      if (status != ExitSuccess) {
+        HostDown(host, output);
+        continue;
+      }
+      Host& h = hosts_[host];
+      h.state = Host::kUp;
+      vector<Edge*> waiting;
+      waiting.swap(h.waiting);
+      for (vector<Edge*>::iterator e = waiting.begin(); e != waiting.end();
+           ++e) {
+        if (!Launch(*e, host)) {
+          h.used_slots -= (*e)->weight();
+          result->edge = *e;
+          result->status = ExitFailure;
+          result->output = "couldn't run '" + (*e)->GetCommand() + "' on " +
+                           h.config->name;
+          return true;
+        }
+      }
+      continue;
+    }
+
+    map<Subprocess*, pair<Edge*, int> >::iterator r = remote_.find(subproc);
+    if (r == remote_.end()) {
+      ReapCommand(subproc, result);
+      return true;
+    }
+
+    Edge* edge = r->second.first;
+    int host = r->second.second;
+    remote_.erase(r);
+    hosts_[host].used_slots -= edge->weight();
+    ExitStatus status = subproc->Finish();
+    if (status == ExitFailure && subproc->GetExitCode() == 255) {
+      HostDown(host, subproc->GetOutput());
+      delete subproc;
+      requeued_.push_back(edge);
+      continue;
+    }
+
+    // The resources that ssh used say nothing about the command's.
+    result->edge = edge;
+    result->status = status;
+    TakeOutput(subproc, result);
+    delete subproc;
+    return true;
+  }
+}
+
+vector<Edge*> SshCommandRunner::GetActiveEdges() {
+  vector<Edge*> edges = RealCommandRunner::GetActiveEdges();
+  for (map<Subprocess*, pair<Edge*, int> >::iterator e = remote_.begin();
+       e != remote_.end(); ++e) {
+    edges.push_back(e->second.first);
+  }
+  return edges;
+}
+
+void SshCommandRunner::Abort() {
+  remote_.clear();
+  connecting_.clear();
+  requeued_.clear();
+  for (vector<Host>::iterator h = hosts_.begin(); h != hosts_.end(); ++h) {
+    h->used_slots = 0;
+    h->waiting.clear();
+  }
+  RealCommandRunner::Abort();
+}
+
+// static
+bool EdgePreparer::WriteRspfile(DiskInterface* disk_interface,
+                                const string& rspfile,
+                                const string& content) {
+  // An rspfile kept by -d keeprsp or by a failed command usually holds what
+  // it would be rewritten with, and link rspfiles can be megabytes.
+  string existing, err;
+  if (disk_interface->ReadFile(rspfile, &existing, &err) ==
+          FileReader::Okay &&
+      existing == content) {
+    return true;
+  }
+  return disk_interface->WriteFile(rspfile, content);
+}
+
+bool EdgePreparer::Start(Edge* edge, DiskInterface* disk_interface) {
+  assert(!edge_);
+  edge_ = edge;
+  disk_interface_ = disk_interface;
+  rspfile_ = edge->GetUnescapedRspfile();
+  content_ = edge->GetBinding(VarNames::kRspfileContent);
+  if (!thread_.Start(Run, this)) {
+    edge_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+Edge* EdgePreparer::Finish(bool* ok) {
+  thread_.Join();
+  Edge* edge = edge_;
+  edge_ = NULL;
+  *ok = ok_;
+  string().swap(content_);
+  return edge;
+}
+
+// static
+void EdgePreparer::Run(void* arg) {
+  EdgePreparer* preparer = static_cast<EdgePreparer*>(arg);
+  preparer->ok_ = WriteRspfile(preparer->disk_interface_, preparer->rspfile_,
+                               preparer->content_);
+}
+
+InputPrefetcher::InputPrefetcher() : stopping_(false) {
+#ifndef _WIN32
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&wake_, NULL);
+#endif
+}
+
+InputPrefetcher::~InputPrefetcher() {
+  Stop();
+#ifndef _WIN32
+  pthread_cond_destroy(&wake_);
+  pthread_mutex_destroy(&lock_);
+#endif
+}
+
+// static
+bool InputPrefetcher::Supported() {
+#ifdef POSIX_FADV_WILLNEED
+  return true;
+#else
+  return false;
+#endif
+}
+
+void InputPrefetcher::Add(Edge* edge) {
+  if (!Supported())
+    return;
+  // Order-only inputs are only there to be built first, not to be read.
+  vector<Node*>::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+  vector<string> paths;
+  for (vector<Node*>::iterator i = edge->inputs_.begin(); i != end; ++i) {
+    if (seen_.insert(*i).second)
+      paths.push_back((*i)->path().AsString());
+  }
+  if (paths.empty())
+    return;
+  if (!thread_.started()) {
+    stopping_ = false;
+    if (!thread_.Start(RunThread, this))
+      return;
+  }
+
+  Lock();
+  bool was_empty = queue_.empty();
+  queue_.insert(queue_.end(), paths.begin(), paths.end());
+#ifndef _WIN32
+  if (was_empty)
+    pthread_cond_signal(&wake_);
+#endif
+  Unlock();
+}
+
+void InputPrefetcher::Stop() {
+  if (!thread_.started())
+    return;
+  Lock();
+  stopping_ = true;
+  queue_.clear();
+#ifndef _WIN32
+  pthread_cond_signal(&wake_);
+#endif
+  Unlock();
+  thread_.Join();
+}
+
+// static
+void InputPrefetcher::RunThread(void* prefetcher) {
+  static_cast<InputPrefetcher*>(prefetcher)->Run();
+}
+
+void InputPrefetcher::Run() {
+#ifndef _WIN32
+  vector<string> paths;
+  Lock();
+  for (;;) {
+    while (queue_.empty() && !stopping_)
+      pthread_cond_wait(&wake_, &lock_);
+    if (stopping_)
+      break;
+    paths.swap(queue_);
+    Unlock();
+    for (vector<string>::iterator p = paths.begin(); p != paths.end(); ++p)
+      Prefetch(*p);
+    paths.clear();
+    Lock();
+  }
+  Unlock();
+#endif
+}
+
+// static
+void InputPrefetcher::Prefetch(const string& path) {
+#ifdef POSIX_FADV_WILLNEED
+  // Commands are spawned while this runs, so the descriptor mustn't leak
+  // into them.
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#endif
+}
+
+void InputPrefetcher::Lock() {
+#ifndef _WIN32
+  pthread_mutex_lock(&lock_);
+#endif
+}
+
+void InputPrefetcher::Unlock() {
+#ifndef _WIN32
+  pthread_mutex_unlock(&lock_);
+#endif
+}
+
+Builder::Builder(State* state, const BuildConfig& config,
+                 BuildLog* build_log, DepsLog* deps_log,
+                 DiskInterface* disk_interface)
+    : state_(state), config_(config), plan_(this),
+      disk_interface_(disk_interface),
+      scan_(state, build_log, deps_log, disk_interface), action_cache_(NULL),
+      failure_log_(NULL), dirs_(disk_interface) {
+  status_ = new BuildStatus(config);
+}
+
+Builder::~Builder() {
+  Cleanup();
+  delete action_cache_;
+}
+
+void Builder::Cleanup() {
+  if (g_slot_usage)
+    g_slot_usage->Finish(GetTimeMillis());
+  prefetcher_.Stop();
+  speculations_.clear();
+  speculation_candidates_.clear();
+  speculated_results_.clear();
+
+  // An edge that was prepared but never started leaves no rspfile behind.
+  bool prepared;
+  if (preparer_.Finish(&prepared) && !preparer_.rspfile().empty() &&
+      !g_keep_rsp) {
+    disk_interface_->RemoveFile(preparer_.rspfile());
+  }
+
+  if (command_runner_.get()) {
     vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
 
@@ -583,11 +2284,13 @@ void Builder::Cleanup() {
         // mentioned in a depfile, and the command touches its depfile
         // but is interrupted before it touches its output file.)
         string err;
-        TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), &err);
+        StatAudit::Scope audit(StatAudit::kClean);
+        TimeStamp new_mtime =
+            disk_interface_->Stat((*o)->path().AsString(), &err);
         if (new_mtime == -1)  // Log and ignore Stat() errors.
           Error("%s", err.c_str());
         if (!depfile.empty() || (*o)->mtime() != new_mtime)
-          disk_interface_->RemoveFile((*o)->path());
+          disk_interface_->RemoveFile((*o)->path().AsString());
       }
       if (!depfile.empty())
         disk_interface_->RemoveFile(depfile);
@@ -636,51 +2339,157 @@ bool Builder::Build(string* err) {
   if (!command_runner_.get()) {
     if (config_.dry_run)
       command_runner_.reset(new DryRunCommandRunner);
+    else if (!config_.hosts.empty())
+      command_runner_.reset(new SshCommandRunner(config_, scan_.build_log()));
+    else if (!config_.remote_exec.empty())
+      command_runner_.reset(new RemoteCommandRunner(config_,
+                                                    scan_.build_log()));
     else
-      command_runner_.reset(new RealCommandRunner(config_));
+      command_runner_.reset(new RealCommandRunner(config_, scan_.build_log()));
+  }
+  // A dry run doesn't take the slots of shared pools from other builds.
+  if (config_.dry_run) {
+    for (map<string, Pool*>::iterator p = state_->pools_.begin();
+         p != state_->pools_.end(); ++p) {
+      p->second->set_shared(false);
+    }
+  }
+  if (!action_cache_ && !config_.action_cache_dir.empty() &&
+      !config_.dry_run) {
+    action_cache_ = new ActionCache(config_.action_cache_dir, state_,
+                                    disk_interface_);
   }
 
+  // The prefetcher reads files from a thread, behind the disk interface's
+  // back.
+  if (config_.readahead && !config_.dry_run &&
+      disk_interface_->AllowsConcurrentWrites() &&
+      InputPrefetcher::Supported()) {
+    plan_.set_scheduled(&scheduled_edges_);
+  }
+  plan_.PrepareQueue(scan_.build_log(), failure_log_);
+  status_->PlanHasRemainingWork(plan_.remaining_work());
+
+  // Find the output directories that exist already in one batch.
+  vector<Edge*> wanted;
+  plan_.GetWantedEdges(&wanted);
+  vector<string> outputs;
+  for (vector<Edge*>::iterator e = wanted.begin(); e != wanted.end(); ++e) {
+    for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+         o != (*e)->outputs_.end(); ++o) {
+      outputs.push_back((*o)->path().AsString());
+    }
+  }
+  dirs_.Prefetch(outputs);
+
   // We are about to start the build process.
   status_->BuildStarted();
+  if (g_slot_usage)
+    g_slot_usage->Start(config_.parallelism, GetTimeMillis());
+
+  // The last reaped command, if it hasn't been through FinishCommand() yet.
+  CommandRunner::Result result;
+  bool have_result = false;
 
   // This main loop runs the entire build process.
   // It is structured like this:
   // First, we attempt to start as many commands as allowed by the
   // command runner.
-  // Second, we attempt to wait for / reap the next finished command.
+  // Second, we post-process the last finished command, now that the
+  // capacity it used has been handed out again.
+  // Third, we attempt to wait for / reap the next finished command.
   while (plan_.more_to_do()) {
-    // See if we can start any more commands.
-    if (failures_allowed && command_runner_->CanRunMore()) {
-      if (Edge* edge = plan_.FindWork()) {
-        if (!StartEdge(edge, err)) {
+    // See if we can start any more commands.  Phony edges don't need
+    // any capacity from the command runner.  An edge that doesn't fit
+    // holds back the ones behind it, like a pool does, so that lighter
+    // edges can't keep taking the slots it waits for.
+    Edge* edge = failures_allowed ? plan_.PeekWork() : NULL;
+    if (edge && (edge->is_phony() || command_runner_->CanRunMore(edge))) {
+      plan_.FindWork();
+      if (!StartEdge(edge, err)) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+
+      if (edge->is_phony()) {
+        if (!plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, err)) {
           Cleanup();
           status_->BuildFinished();
           return false;
         }
-
-        if (edge->is_phony()) {
-          plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
-        } else {
-          ++pending_commands;
-        }
-
-        // We made some progress; go back to the main loop.
-        continue;
+      } else {
+        ++pending_commands;
       }
+
+      // We made some progress; go back to the main loop.
+      continue;
     }
 
     // See if we can reap any finished commands.
-    if (pending_commands) {
-      CommandRunner::Result result;
-      if (!command_runner_->WaitForCommand(&result) ||
-          result.status == ExitInterrupted) {
+    if (pending_commands && !have_result && !restored_edges_.empty()) {
+      result = CommandRunner::Result();
+      result.edge = restored_edges_.back();
+      restored_edges_.pop_back();
+      --pending_commands;
+      have_result = true;
+      if (g_trace)
+        g_trace->CommandFinished(result.edge);
+    } else if (pending_commands && !have_result &&
+               !speculated_results_.empty()) {
+      result = speculated_results_.back();
+      speculated_results_.pop_back();
+      --pending_commands;
+      have_result = true;
+      if (g_trace)
+        g_trace->CommandFinished(result.edge);
+    } else if (pending_commands && !have_result) {
+      if (edge)
+        PrepareAhead(edge);
+      else if (config_.speculation > 0)
+        Speculate();
+      PrefetchScheduled();
+      // Another process may have given back a slot of a shared pool.
+      if (!edge && failures_allowed) {
+        plan_.RetrySharedPools();
+        if (plan_.PeekWork())
+          continue;
+      }
+      result = CommandRunner::Result();
+      UpdateSlotUsage(true, edge);
+      bool waited = command_runner_->WaitForCommand(&result);
+      UpdateSlotUsage(false, NULL);
+      if (!waited || result.status == ExitInterrupted) {
         Cleanup();
         status_->BuildFinished();
         *err = "interrupted by user";
         return false;
       }
 
+      // A command run ahead only counts once the plan gets to its edge.
+      bool is_result = true;
+      if (!speculations_.empty() &&
+          !SpeculationFinished(&result, &is_result, err)) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+      if (!is_result)
+        continue;
+
       --pending_commands;
+      have_result = true;
+      if (g_trace)
+        g_trace->CommandFinished(result.edge);
+      // Restat, depfile parsing and log writes can wait until the freed
+      // capacity is in use again.  A failure may stop the build, though, so
+      // it is handled right away.
+      if (result.success())
+        continue;
+    }
+
+    if (have_result) {
+      have_result = false;
       if (!FinishCommand(&result, err)) {
         Cleanup();
         status_->BuildFinished();
@@ -696,7 +2505,21 @@ bool Builder::Build(string* err) {
       continue;
     }
 
+    // Nothing runs, but shared pools wait for the other processes.
+    if (failures_allowed && plan_.WaitsForSharedPools()) {
+      if (!command_runner_->Sleep(kSharedPoolRetryMs)) {
+        Cleanup();
+        status_->BuildFinished();
+        *err = "interrupted by user";
+        return false;
+      }
+      plan_.RetrySharedPools();
+      continue;
+    }
+
     // If we get here, we cannot make any more progress.
+    if (g_slot_usage)
+      g_slot_usage->Finish(GetTimeMillis());
     status_->BuildFinished();
     if (failures_allowed == 0) {
       if (config_.failures_allowed > 1)
@@ -711,40 +2534,269 @@ bool Builder::Build(string* err) {
     return false;
   }
 
+  prefetcher_.Stop();
+  FinishSpeculations();
+  if (g_slot_usage)
+    g_slot_usage->Finish(GetTimeMillis());
   status_->BuildFinished();
   return true;
 }
 
+void Builder::UpdateSlotUsage(bool waiting, const Edge* next) {
+  if (!g_slot_usage)
+    return;
+  int busy = 0;
+  vector<Edge*> active = command_runner_->GetActiveEdges();
+  for (vector<Edge*>::iterator e = active.begin(); e != active.end(); ++e)
+    busy += (*e)->weight();
+  SlotUsage::State idle = SlotUsage::kNinjaLimited;
+  if (waiting) {
+    idle = next ? SlotUsage::kResourceLimited : SlotUsage::kGraphLimited;
+    for (map<string, Pool*>::const_iterator p = state_->pools_.begin();
+         p != state_->pools_.end(); ++p) {
+      if (p->second->has_delayed_edges())
+        idle = SlotUsage::kResourceLimited;
+    }
+  }
+  g_slot_usage->Update(GetTimeMillis(), busy, idle);
+}
+
 bool Builder::StartEdge(Edge* edge, string* err) {
   METRIC_RECORD("StartEdge");
   if (edge->is_phony())
     return true;
 
   status_->BuildEdgeStarted(edge);
+  if (g_trace) {
+    g_trace->CommandStarted(edge, edge->outputs_[0]->path().AsString(),
+                            edge->rule().name());
+  }
 
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (!disk_interface_->MakeDirs((*o)->path()))
-      return false;
+  // The command may have run ahead already, see Speculate().  Its result is
+  // the edge's if the restat edge left its outputs as they were.
+  map<Edge*, Speculation>::iterator s = speculations_.find(edge);
+  if (s != speculations_.end()) {
+    bool written;
+    if (preparer_.edge() == edge)
+      preparer_.Finish(&written);
+    bool unchanged = true;
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      if ((*i)->in_edge() == s->second.restat_edge && (*i)->dirty())
+        unchanged = false;
+    }
+    if (!s->second.finished) {
+      s->second.adopted = true;
+      s->second.rerun = !unchanged;
+      return true;
+    }
+    if (unchanged) {
+      METRIC_COUNT("speculations kept", 1);
+      speculated_results_.push_back(s->second.result);
+      speculations_.erase(s);
+      return true;
+    }
+    speculations_.erase(s);
   }
 
-  // Create response file, if needed
-  // XXX: this may also block; do we care?
-  string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty()) {
-    string content = edge->GetBinding("rspfile_content");
-    if (!disk_interface_->WriteFile(rspfile, content))
-      return false;
+  // Create directories necessary for outputs, and the response file, if
+  // needed, unless that was done while waiting for the last command.
+  if (!MakeOutputDirs(edge))
+    return false;
+  bool written;
+  if (preparer_.edge() == edge) {
+    preparer_.Finish(&written);
+  } else {
+    string rspfile = edge->GetUnescapedRspfile();
+    written = rspfile.empty() ||
+        EdgePreparer::WriteRspfile(
+            disk_interface_, rspfile,
+            edge->GetBinding(VarNames::kRspfileContent));
+  }
+  if (!written)
+    return false;
+
+  // The outputs may not need the command at all.
+  vector<Node*> deps_nodes;
+  if (action_cache_ && action_cache_->Restore(edge, &deps_nodes)) {
+    restored_edges_.push_back(edge);
+    restored_deps_[edge].swap(deps_nodes);
+    return true;
   }
 
   // start command computing and run it
   if (!command_runner_->StartCommand(edge)) {
-    err->assign("command '" + edge->EvaluateCommand() + "' failed.");
+    err->assign("command '" + edge->GetCommand() + "' failed.");
+    return false;
+  }
+
+  if (config_.speculation > 0 && edge->GetBindingBool(VarNames::kRestat)) {
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      for (EdgeSpan::const_iterator oe = (*o)->out_edges().begin();
+           oe != (*o)->out_edges().end(); ++oe) {
+        speculation_candidates_.push_back(make_pair(*oe, edge));
+      }
+    }
+  }
+
+  return true;
+}
+
+namespace {
+
+struct HeavierCandidate {
+  bool operator()(const pair<Edge*, Edge*>& a,
+                  const pair<Edge*, Edge*>& b) const {
+    return a.first->critical_path_weight() > b.first->critical_path_weight();
+  }
+};
+
+}  // namespace
+
+void Builder::Speculate() {
+  if (speculation_candidates_.empty() || config_.dry_run)
+    return;
+  int allowed = max(1, config_.parallelism * config_.speculation / 100);
+  for (map<Edge*, Speculation>::iterator s = speculations_.begin();
+       s != speculations_.end(); ++s) {
+    if (!s->second.finished && !s->second.adopted)
+      --allowed;
+  }
+
+  // The edges with the longest way to go after them first.
+  sort(speculation_candidates_.begin(), speculation_candidates_.end(),
+       HeavierCandidate());
+  vector<pair<Edge*, Edge*> > waiting;
+  for (vector<pair<Edge*, Edge*> >::iterator c =
+           speculation_candidates_.begin();
+       c != speculation_candidates_.end(); ++c) {
+    Edge* edge = c->first;
+    if (c->second->outputs_ready() || !plan_.IsWaiting(edge) ||
+        speculations_.count(edge)) {
+      continue;  // Too late, or already running.
+    }
+    if (allowed <= 0 || !CanSpeculate(edge, c->second) ||
+        !command_runner_->CanRunMore(edge)) {
+      waiting.push_back(*c);
+      continue;
+    }
+
+    string rspfile = edge->GetUnescapedRspfile();
+    if (!MakeOutputDirs(edge) ||
+        (!rspfile.empty() &&
+         !EdgePreparer::WriteRspfile(
+             disk_interface_, rspfile,
+             edge->GetBinding(VarNames::kRspfileContent))) ||
+        !command_runner_->StartCommand(edge)) {
+      continue;  // The plan gets to report it.
+    }
+    METRIC_COUNT("speculations", 1);
+    speculations_[edge].restat_edge = c->second;
+    --allowed;
+  }
+  speculation_candidates_.swap(waiting);
+}
+
+bool Builder::CanSpeculate(Edge* edge, Edge* running) {
+  // Pools and the console are for edges that mustn't run alongside others,
+  // and dyndep files can change the inputs.
+  if (edge->is_phony() || edge->pool() != &State::kDefaultPool ||
+      edge->dyndep_ || edge->deps_missing_) {
+    return false;
+  }
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (in_edge && in_edge != running && !in_edge->outputs_ready())
+      return false;
+  }
+
+  // As Plan::CleanNode() would find if the restat edge left its outputs
+  // alone: an edge that would then be clean only runs if they change, and
+  // then not with them as they are now.
+  vector<Node*>::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+  Node* most_recent_input = NULL;
+  for (vector<Node*>::iterator i = edge->inputs_.begin(); i != end; ++i) {
+    if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime())
+      most_recent_input = *i;
+  }
+  bool dirty = false;
+  string err;
+  return scan_.RecomputeOutputsDirty(edge, most_recent_input, &dirty,
+                                     &err) && dirty;
+}
+
+bool Builder::SpeculationFinished(CommandRunner::Result* result,
+                                  bool* is_result, string* err) {
+  map<Edge*, Speculation>::iterator s = speculations_.find(result->edge);
+  if (s == speculations_.end())
+    return true;
+  if (!s->second.adopted) {
+    // Kept until the plan gets to the edge.
+    s->second.finished = true;
+    s->second.result = *result;
+    *is_result = false;
+    return true;
+  }
+
+  bool rerun = s->second.rerun;
+  speculations_.erase(s);
+  if (!rerun) {
+    METRIC_COUNT("speculations kept", 1);
+    return true;
+  }
+  *is_result = false;
+  if (!command_runner_->StartCommand(result->edge)) {
+    err->assign("command '" + result->edge->GetCommand() + "' failed.");
     return false;
   }
+  return true;
+}
+
+void Builder::FinishSpeculations() {
+  // The plan found out that the edges didn't need to run after all.
+  for (map<Edge*, Speculation>::iterator s = speculations_.begin();
+       s != speculations_.end(); ++s) {
+    while (!s->second.finished) {
+      CommandRunner::Result result;
+      if (!command_runner_->WaitForCommand(&result))
+        break;
+      map<Edge*, Speculation>::iterator r = speculations_.find(result.edge);
+      if (r != speculations_.end())
+        r->second.finished = true;
+    }
+  }
+  speculations_.clear();
+  speculation_candidates_.clear();
+}
+
+void Builder::PrepareAhead(Edge* edge) {
+  // A thread is only worth it for an rspfile, and the disk interface has
+  // to be safe to use from one.
+  if (preparer_.edge() || edge->is_phony() ||
+      !disk_interface_->AllowsConcurrentWrites() ||
+      edge->GetUnescapedRspfile().empty() || !MakeOutputDirs(edge)) {
+    return;
+  }
+  preparer_.Start(edge, disk_interface_);
+}
+
+void Builder::PrefetchScheduled() {
+  for (vector<Edge*>::iterator e = scheduled_edges_.begin();
+       e != scheduled_edges_.end(); ++e) {
+    if (!(*e)->is_phony())
+      prefetcher_.Add(*e);
+  }
+  scheduled_edges_.clear();
+}
 
+bool Builder::MakeOutputDirs(Edge* edge) {
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    if (!dirs_.MakeDirs((*o)->path().AsString()))
+      return false;
+  }
   return true;
 }
 
@@ -759,9 +2811,14 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   // extraction itself can fail, which makes the command fail from a
   // build perspective.
   vector<Node*> deps_nodes;
-  string deps_type = edge->GetBinding("deps");
-  const string deps_prefix = edge->GetBinding("msvc_deps_prefix");
-  if (!deps_type.empty()) {
+  string deps_type = edge->GetBinding(VarNames::kDeps);
+  const string deps_prefix = edge->GetBinding(VarNames::kMsvcDepsPrefix);
+  map<Edge*, vector<Node*> >::iterator restored = restored_deps_.find(edge);
+  bool was_restored = restored != restored_deps_.end();
+  if (was_restored) {
+    deps_nodes.swap(restored->second);
+    restored_deps_.erase(restored);
+  } else if (!deps_type.empty()) {
     string extract_err;
     if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
                      &extract_err) &&
@@ -774,26 +2831,60 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   }
 
   int start_time, end_time;
-  status_->BuildEdgeFinished(edge, result->success(), result->output,
-                             &start_time, &end_time);
+  status_->BuildEdgeFinished(edge, *result, &start_time, &end_time);
+  if (failure_log_ && result->status != ExitInterrupted)
+    failure_log_->EdgeFinished(edge, result->success());
 
   // The rest of this function only applies to successful commands.
   if (!result->success()) {
-    plan_.EdgeFinished(edge, Plan::kEdgeFailed);
+    if (!plan_.EdgeFinished(edge, Plan::kEdgeFailed, err))
+      return false;
     return true;
   }
 
   // Restat the edge outputs
   TimeStamp output_mtime = 0;
-  bool restat = edge->GetBindingBool("restat");
+  // The mtime of the first output, reused for the deps log entry.
+  TimeStamp first_output_mtime = 0;
+  bool restat = edge->GetBindingBool(VarNames::kRestat);
+  // "restat = content" also cleans the outputs that the command rewrote
+  // with the same contents as the last time, going by the build log.
+  bool content_restat = restat && scan_.build_log() &&
+      edge->GetBinding(VarNames::kRestat) == "content";
+  vector<uint64_t> content_hashes;
   if (!config_.dry_run) {
     bool node_cleaned = false;
 
+    if (content_restat) {
+      vector<string> paths(edge->outputs_.size());
+      vector<const string*> path_ptrs(paths.size());
+      for (size_t i = 0; i < paths.size(); ++i) {
+        paths[i] = edge->outputs_[i]->path().AsString();
+        path_ptrs[i] = &paths[i];
+      }
+      disk_interface_->HashFiles(path_ptrs, &content_hashes);
+    }
+
+    StatAudit::Scope audit(StatAudit::kOutputs);
     for (vector<Node*>::iterator o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o) {
-      TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), err);
+      TimeStamp new_mtime = disk_interface_->Stat((*o)->path().AsString(), err);
       if (new_mtime == -1)
         return false;
+      if (content_restat && new_mtime != (*o)->mtime() && (*o)->mtime() > 0) {
+        TimeStamp old_mtime = (*o)->mtime();
+        uint64_t hash = content_hashes[o - edge->outputs_.begin()];
+        BuildLog::LogEntry* entry =
+            scan_.build_log()->LookupByOutput((*o)->path());
+        // Put the old mtime back, so that what depends on the output stays
+        // clean in later builds too, like it would after a plain restat.
+        if (hash && entry && entry->content_hash == hash &&
+            disk_interface_->SetMTime((*o)->path().AsString(), old_mtime)) {
+          new_mtime = old_mtime;
+        }
+      }
+      if (o == edge->outputs_.begin())
+        first_output_mtime = new_mtime;
       if (new_mtime > output_mtime)
         output_mtime = new_mtime;
       if ((*o)->mtime() == new_mtime && restat) {
@@ -807,12 +2898,14 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
     }
 
     if (node_cleaned) {
+      StatAudit::Scope audit(StatAudit::kRestat);
       TimeStamp restat_mtime = 0;
       // If any output was cleaned, find the most recent mtime of any
       // (existing) non-order-only input or the depfile.
       for (vector<Node*>::iterator i = edge->inputs_.begin();
            i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
-        TimeStamp input_mtime = disk_interface_->Stat((*i)->path(), err);
+        TimeStamp input_mtime =
+            disk_interface_->Stat((*i)->path().AsString(), err);
         if (input_mtime == -1)
           return false;
         if (input_mtime > restat_mtime)
@@ -836,28 +2929,33 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
     }
   }
 
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  if (!plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, err))
+    return false;
+  // A restat may have cleaned what depends on the edge.
+  status_->PlanHasRemainingWork(plan_.remaining_work());
 
   // Delete any left over response file.
   string rspfile = edge->GetUnescapedRspfile();
   if (!rspfile.empty() && !g_keep_rsp)
     disk_interface_->RemoveFile(rspfile);
 
+  if (action_cache_ && !was_restored)
+    action_cache_->Store(edge, deps_nodes);
+
   if (scan_.build_log()) {
-    if (!scan_.build_log()->RecordCommand(edge, start_time, end_time,
-                                          output_mtime)) {
+    if (!scan_.build_log()->RecordCommand(
+            edge, start_time, end_time, output_mtime, result->usage,
+            content_hashes.empty() ? NULL : &content_hashes)) {
       *err = string("Error writing to build log: ") + strerror(errno);
       return false;
     }
   }
+  edge->ReleaseCommand();
 
   if (!deps_type.empty() && !config_.dry_run) {
     assert(edge->outputs_.size() == 1 && "should have been rejected by parser");
     Node* out = edge->outputs_[0];
-    TimeStamp deps_mtime = disk_interface_->Stat(out->path(), err);
-    if (deps_mtime == -1)
-      return false;
-    if (!scan_.deps_log()->RecordDeps(out, deps_mtime, deps_nodes)) {
+    if (!scan_.deps_log()->RecordDeps(out, first_output_mtime, deps_nodes)) {
       *err = string("Error writing to deps log: ") + strerror(errno);
       return false;
     }
@@ -865,6 +2963,29 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   return true;
 }
 
+bool Builder::LoadDyndeps(Node* node, string* err) {
+  status_->BuildLoadDyndeps();
+
+  // A dry run doesn't write the dyndep file.  If there is none from an
+  // earlier build, go on without the dependencies it would add.
+  DyndepFile ddf;
+  if (config_.dry_run && !node->exists()) {
+    node->set_dyndep_pending(false);
+  } else if (!scan_.LoadDyndeps(node, &ddf, err)) {
+    return false;
+  }
+
+  // Update the build plan to account for dyndep modifications to the graph.
+  if (!plan_.DyndepsLoaded(&scan_, node, ddf, err))
+    return false;
+
+  // New command edges may have been added to the plan.
+  status_->PlanHasTotalEdges(plan_.command_edge_count());
+  status_->PlanHasRemainingWork(plan_.remaining_work());
+
+  return true;
+}
+
 bool Builder::ExtractDeps(CommandRunner::Result* result,
                           const string& deps_type,
                           const string& deps_prefix,
@@ -872,10 +2993,18 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
                           string* err) {
   if (deps_type == "msvc") {
     CLParser parser;
-    string output;
-    if (!parser.Parse(result->output, deps_prefix, &output, err))
-      return false;
-    result->output = output;
+    if (result->includes_parsed) {
+      if (!result->includes_err.empty()) {
+        *err = result->includes_err;
+        return false;
+      }
+      parser.includes_.swap(result->includes);
+    } else {
+      string output;
+      if (!parser.Parse(result->output, deps_prefix, &output, err))
+        return false;
+      result->output = output;
+    }
     for (set<string>::iterator i = parser.includes_.begin();
          i != parser.includes_.end(); ++i) {
       // ~0 is assuming that with MSVC-parsed headers, it's ok to always make
@@ -892,17 +3021,27 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       return false;
     }
 
-    // Read depfile content.  Treat a missing depfile as empty.
+    // Read depfile content.  Treat a missing depfile as empty.  A command
+    // that doesn't use $depfile writes it to disk even if it could have
+    // written it to memory.
     string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
-    case DiskInterface::Okay:
-      break;
-    case DiskInterface::NotFound:
-      err->clear();
-      break;
-    case DiskInterface::OtherError:
-      return false;
+    bool on_disk = !result->depfile_in_memory || result->depfile.empty();
+    if (!on_disk) {
+      content.swap(result->depfile);
+      if (g_keep_depfile)
+        disk_interface_->WriteFile(depfile, content);
+    } else {
+      switch (disk_interface_->ReadFile(depfile, &content, err)) {
+      case DiskInterface::Okay:
+        break;
+      case DiskInterface::NotFound:
+        err->clear();
+        break;
+      case DiskInterface::OtherError:
+        return false;
+      }
     }
+    METRIC_COUNT("depfile bytes", content.size());
     if (content.empty())
       return true;
 
@@ -914,14 +3053,13 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
     deps_nodes->reserve(deps.ins_.size());
     for (vector<StringPiece>::iterator i = deps.ins_.begin();
          i != deps.ins_.end(); ++i) {
-      uint64_t slash_bits;
-      if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
-                            err))
+      Node* node = state_->GetDepfileNode(*i, err);
+      if (!node)
         return false;
-      deps_nodes->push_back(state_->GetNode(*i, slash_bits));
+      deps_nodes->push_back(node);
     }
 
-    if (!g_keep_depfile) {
+    if (on_disk && !g_keep_depfile) {
       if (disk_interface_->RemoveFile(depfile) < 0) {
         *err = string("deleting depfile: ") + strerror(errno) + string("\n");
         return false;
@@ -23,33 +23,64 @@
 #include <string>
 #include <vector>
 
+#include "clparser.h"
+#include "disk_interface.h"
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "exit_status.h"
+#include "jobserver.h"
+#include "resource_usage.h"
 #include "line_printer.h"
+#include "log_writer.h"
 #include "metrics.h"
+#include "subprocess.h"
 #include "util.h"  // int64_t
 
+struct ActionCache;
 struct BuildLog;
+struct BuildEventStream;
+struct FailureLog;
 struct BuildStatus;
+struct Builder;
 struct DiskInterface;
+struct DyndepFile;
 struct Edge;
 struct Node;
+struct Pool;
 struct State;
 
 /// Plan stores the state of a build plan: what we intend to build,
 /// which steps we're ready to execute.
 struct Plan {
-  Plan();
+  Plan(Builder* builder = NULL);
 
   /// Add a target to our plan (including all its dependencies).
   /// Returns false if we don't need to build this target; may
   /// fill in |err| with an error message if there's a problem.
   bool AddTarget(Node* node, string* err);
 
-  // Pop a ready edge off the queue of edges to build.
+  /// Compute the critical path of every wanted edge and hand the edges
+  /// that are ready to run to the scheduler.  Must be called once after all
+  /// targets have been added and before the first call to FindWork().
+  /// Historical durations are taken from |build_log|, which may be NULL.
+  /// The edges that |failures| says failed the last time, if it isn't NULL,
+  /// go first, along with what they depend on.
+  void PrepareQueue(BuildLog* build_log, const FailureLog* failures = NULL);
+
+  // Pop a ready edge off the queue of edges to build.  Edges with the
+  // heaviest critical path are returned first.
   // Returns NULL if there's no work to do.
   Edge* FindWork();
 
+  /// Returns the edge FindWork() would return next, without removing it
+  /// from the queue; NULL if there's no work to do.
+  Edge* PeekWork() const;
+
+  /// Whether the plan wants to build |edge| but is still waiting for some
+  /// of its inputs.
+  bool IsWaiting(const Edge* edge) const {
+    return GetWant(edge) == kWantToStart;
+  }
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_ > 0 && command_edges_ > 0; }
 
@@ -62,7 +93,10 @@ struct Plan {
   };
 
   /// Mark an edge as done building (whether it succeeded or failed).
-  void EdgeFinished(Edge* edge, EdgeResult result);
+  /// If any of the edge's outputs are dyndep bindings of their dependents,
+  /// this loads dynamic dependencies from the nodes' paths.
+  /// Returns 'false' if loading dyndep info fails and 'true' otherwise.
+  bool EdgeFinished(Edge* edge, EdgeResult result, string* err);
 
   /// Clean the given node during the build.
   /// Return false on error.
@@ -71,16 +105,59 @@ struct Plan {
   /// Number of edges with commands to run.
   int command_edge_count() const { return command_edges_; }
 
+  /// The expected duration in milliseconds of the commands the plan still
+  /// has to run, from the build log; see Edge::expected_duration_.
+  int64_t remaining_work() const { return remaining_work_; }
+
+  /// Append the edges with commands that the plan wants to run, and hasn't
+  /// finished, to |edges|.
+  void GetWantedEdges(vector<Edge*>* edges) const;
+
   /// Reset state.  Clears want and ready sets.
   void Reset();
 
+  /// Append each edge that becomes ready to run from now on to |scheduled|,
+  /// if it isn't NULL, for the builder to look at before it runs.
+  void set_scheduled(vector<Edge*>* scheduled) { scheduled_ = scheduled; }
+
+  /// Schedule the edges that shared pools held back, if the other ninja
+  /// processes gave back slots since.
+  void RetrySharedPools();
+
+  /// Whether shared pools hold back edges for the slots the other ninja
+  /// processes have.
+  bool WaitsForSharedPools() const;
+
+  /// Update the build plan to account for modifications made to the graph
+  /// by information loaded from a dyndep file.
+  bool DyndepsLoaded(DependencyScan* scan, Node* node,
+                     const DyndepFile& ddf, string* err);
 private:
-  bool AddSubTarget(Node* node, Node* dependent, string* err);
-  void NodeFinished(Node* node);
+  bool RefreshDyndepDependents(DependencyScan* scan, Node* node, string* err);
+  void UnmarkDependents(Node* node, set<Node*>* dependents);
+  /// |dyndep_walk|, if not NULL, collects the edges reached by a walk of
+  /// what a dyndep file added to the graph.
+  bool AddSubTarget(Node* node, Node* dependent, string* err,
+                    set<Edge*>* dyndep_walk);
+  /// Add the edge of |node|, needed by |dependent|, to the plan for
+  /// AddSubTarget(), wanting it if |node| is dirty, but not its inputs:
+  /// those are for the caller to add if |*newly_added|.  Returns false if
+  /// there's nothing to add, filling |err| if that's an error.
+  bool AddNode(Node* node, Node* dependent, string* err,
+               set<Edge*>* dyndep_walk, bool* newly_added);
+
+  /// Update plan with knowledge that the given node is up to date.
+  /// If the node is a dyndep binding on any of its dependents, this
+  /// loads dynamic dependencies from the node's path.
+  /// Returns 'false' if loading dyndep info fails and 'true' otherwise.
+  bool NodeFinished(Node* node, string* err);
 
   /// Enumerate possible steps we want for an edge.
   enum Want
   {
+    /// The edge is not part of the plan: we do not want to build it or any
+    /// of its dependents.
+    kWantNotInPlan,
     /// We do not want to build the edge, but we might want to build one of
     /// its dependents.
     kWantNothing,
@@ -91,24 +168,61 @@ private:
     kWantToFinish
   };
 
+  /// Set Edge::critical_path_weight_ of every wanted edge to the expected
+  /// duration of the longest chain of wanted edges that starts with it.
+  void ComputeCriticalPath(BuildLog* build_log, const FailureLog* failures);
+
+  /// Visit the wanted producers of |edge|'s inputs and then |edge| itself,
+  /// appending them to |order| so that producers precede their consumers.
+  void TopologicalSort(Edge* edge, vector<Edge*>* order);
+
+  /// Schedule all wanted edges whose inputs are already ready.
+  void ScheduleInitialEdges();
+
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(map<Edge*, Want>::iterator want_e);
+  void ScheduleWork(Edge* edge);
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If it does contain an entry, the enumeration indicates what
-  /// we want for the edge.
-  map<Edge*, Want> want_;
+  /// Schedule |edge| if its inputs are ready, or finish it right away if
+  /// it is only in the plan for its dependents.
+  bool EdgeMaybeReady(Edge* edge, string* err);
 
-  set<Edge*> ready_;
+  /// Count |edge|, which the plan now wants to build, as wanted.
+  void EdgeWanted(Edge* edge);
+
+  /// What we want for |edge|; kWantNotInPlan if it was never added.
+  Want GetWant(const Edge* edge) const {
+    return edge->id_ < want_.size() ? want_[edge->id_] : kWantNotInPlan;
+  }
+
+  /// Keep track of which edges we want to build in this plan, indexed by
+  /// Edge::id_.  Edges past the end of the vector are not in the plan.
+  /// Keeping this dense rather than in a map makes planning a large build
+  /// a linear walk through memory.
+  vector<Want> want_;
+
+  /// Every edge that has been added to the plan, in the order it was added.
+  vector<Edge*> planned_edges_;
+
+  EdgePriorityQueue ready_;
+  /// The shared pools that edges were scheduled in.
+  set<Pool*> shared_pools_;
+  /// See set_scheduled().
+  vector<Edge*>* scheduled_;
+
+  Builder* builder_;
 
   /// Total number of edges that have commands (not phony).
   int command_edges_;
 
   /// Total remaining number of wanted edges.
   int wanted_edges_;
+
+  /// See remaining_work().
+  int64_t remaining_work_;
+  /// The expected duration of an edge that never ran.
+  int64_t default_duration_;
 };
 
 /// CommandRunner is an interface that wraps running the build
@@ -116,15 +230,30 @@ private:
 /// RealCommandRunner is an implementation that actually runs commands.
 struct CommandRunner {
   virtual ~CommandRunner() {}
-  virtual bool CanRunMore() = 0;
+  /// Returns true if |edge| fits in the remaining capacity, which is
+  /// charged with the weight of every running edge.  Builder::Build() asks
+  /// only about the next edge in the plan, and waits for it to fit.
+  virtual bool CanRunMore(const Edge* edge) = 0;
   virtual bool StartCommand(Edge* edge) = 0;
 
   /// The result of waiting for a command.
   struct Result {
-    Result() : edge(NULL) {}
+    Result() : edge(NULL), status(ExitSuccess), includes_parsed(false),
+               depfile_in_memory(false) {}
     Edge* edge;
     ExitStatus status;
     string output;
+    ResourceUsage usage;
+    /// Whether the /showIncludes lines of a deps = msvc command were parsed
+    /// out of |output| as it was read, into |includes|, or failed to with
+    /// |includes_err|.
+    bool includes_parsed;
+    set<string> includes;
+    string includes_err;
+    /// Whether the command of a depfile_in_memory edge wrote its depfile
+    /// to memory, and what it wrote.
+    bool depfile_in_memory;
+    string depfile;
     bool success() const { return status == ExitSuccess; }
   };
   /// Wait for a command to complete, or return false if interrupted.
@@ -132,12 +261,55 @@ struct CommandRunner {
 
   virtual vector<Edge*> GetActiveEdges() { return vector<Edge*>(); }
   virtual void Abort() {}
+
+  /// Wait |ms| milliseconds with nothing to do, for shared pools.  Returns
+  /// false if interrupted.
+  virtual bool Sleep(int ms) { return true; }
+};
+
+/// A machine that runs commands over ssh, with --hosts.  It sees the build
+/// directory at the same path as this one does.
+struct WorkerHost {
+  WorkerHost() : slots(0) {}
+
+  /// What ssh connects to, e.g. "user@build1".
+  string name;
+  /// How many commands it runs at once, in units of edge weight.
+  int slots;
+  /// The pools whose edges it runs; empty means any pool.
+  vector<string> pools;
+
+  bool AllowsPool(const string& pool) const;
+};
+
+/// Parse the contents of a --hosts file: a "NAME SLOTS [POOL...]" line per
+/// host, with blank lines and lines starting with '#' ignored.
+bool ParseWorkerHosts(const string& contents, vector<WorkerHost>* hosts,
+                      string* err);
+
+/// Told about the edges of a build as they start and finish, for programs
+/// that embed Ninja; see ninja_api.h.
+struct BuildObserver {
+  virtual ~BuildObserver() {}
+  virtual void EdgeStarted(Edge* edge) = 0;
+  virtual void EdgeFinished(Edge* edge,
+                            const CommandRunner::Result& result) = 0;
 };
 
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  failures_allowed(1), max_load_average(-0.0f) {}
+                  failures_allowed(1), max_load_average(-0.0f),
+                  adaptive_parallelism(false),
+                  max_memory(0), max_output(16 << 20), binary_log(false),
+                  remote_jobs(0),
+                  events_fd(-1), observer(NULL), status_fps(0),
+                  status_lines(0),
+                  readahead(false), speculation(0), numa_placement(false),
+                  simulate(false), hedge_factor(0) {
+    log_commit.max_records = 256;
+    log_commit.max_delay_ms = 100;
+  }
 
   enum Verbosity {
     NORMAL,
@@ -151,6 +323,323 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// Whether to use fewer than |parallelism| job slots while the machine is
+  /// short of resources; see AdaptiveParallelism.
+  bool adaptive_parallelism;
+  /// The memory budget in bytes for the running commands. Zero means that
+  /// we do not have any limit.
+  int64_t max_memory;
+  /// How much of each command's output to keep in memory; beyond that only
+  /// its beginning and end are printed.  Zero means no limit.
+  int64_t max_output;
+  /// How the build and deps logs commit what the build records.
+  LogCommitPolicy log_commit;
+  /// Whether to convert the build log to, or start it in, the binary
+  /// format; see BuildLog::set_binary().
+  bool binary_log;
+  /// Where to keep the outputs of commands for reuse, if anywhere; see
+  /// ActionCache.
+  string action_cache_dir;
+  /// The client that runs commands remotely, if any, and how many of them
+  /// may run at once; see RemoteCommandRunner.
+  string remote_exec;
+  int remote_jobs;
+  /// The machines that run commands over ssh, if any; see SshCommandRunner.
+  vector<WorkerHost> hosts;
+  /// Where to write the events of the build, if anywhere; see
+  /// BuildEventStream.
+  int events_fd;
+  /// What else to tell about the edges as they start and finish, if
+  /// anything.
+  BuildObserver* observer;
+  /// How many times a second a smart terminal's status line may be redrawn
+  /// at most.  Zero redraws it for every command started and finished.
+  int status_fps;
+  /// How many of the commands running the longest to show below the status
+  /// line on a smart terminal.
+  int status_lines;
+  /// Whether to read the inputs of edges that are ready to run into the
+  /// page cache ahead of running them; see InputPrefetcher.
+  bool readahead;
+  /// The share of -j, in percent, that commands may use to run ahead of a
+  /// restat edge they depend on; see Builder::Speculate().  Zero never runs
+  /// any ahead.
+  int speculation;
+  /// Whether to spread the commands over the NUMA nodes and pin them to
+  /// one each; see CpuPlacement.
+  bool numa_placement;
+  /// Whether to replay the durations of the build log on a virtual clock
+  /// rather than run the commands; see SimulatedCommandRunner.  Implies
+  /// |dry_run|.
+  bool simulate;
+  /// How many times as long as the build log says it took a command of an
+  /// edge with "hedge = 1" may run before a second copy of it starts, if
+  /// there is room, the first to finish standing for both.  Zero never
+  /// starts one.
+  double hedge_factor;
+};
+
+/// A CommandRunner that runs nothing, but finishes each command after as
+/// long as it took the last time, from the build log, on a virtual clock.
+/// The plan, the pools and -j schedule the commands as in a real build, so
+/// the time the build ends at says how long it would take, in the time
+/// the bookkeeping takes.
+struct SimulatedCommandRunner : public CommandRunner {
+  explicit SimulatedCommandRunner(const BuildConfig& config)
+      : config_(config), now_(0), started_(0), running_weight_(0) {}
+  virtual ~SimulatedCommandRunner() {}
+
+  // Overridden from CommandRunner:
+  virtual bool CanRunMore(const Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+  /// The milliseconds since the build started, on the virtual clock.
+  int64_t now() const { return now_; }
+
+ private:
+  /// A running command, which finishes at |end|; |order| breaks ties in
+  /// the order the commands started.
+  struct Running {
+    int64_t end;
+    int64_t order;
+    Edge* edge;
+    bool operator>(const Running& other) const {
+      return end != other.end ? end > other.end : order > other.order;
+    }
+  };
+
+  const BuildConfig& config_;
+  int64_t now_;
+  int64_t started_;
+  int running_weight_;
+  priority_queue<Running, vector<Running>, greater<Running> > running_;
+};
+
+/// Adjusts how many job slots a build uses, up to -j, from samples of how
+/// short of resources the machine is: it gives back a quarter of them when
+/// it's under pressure and takes one more when it isn't, which reacts
+/// within seconds where the load average takes a minute.
+struct AdaptiveParallelism {
+  explicit AdaptiveParallelism(int max_parallelism)
+      : max_(max_parallelism), limit_(max_parallelism),
+        last_sample_ms_(-kSampleIntervalMs) {}
+
+  /// Where a sample comes from.  Pressure stalls of a few percent are
+  /// already a sign of overload, while the processors only are overloaded
+  /// when they are always busy.
+  enum Source {
+    kPressureStall,
+    kCpuUtilization
+  };
+
+  /// Linux updates its pressure averages every two seconds.
+  static const int64_t kSampleIntervalMs = 2000;
+
+  /// Whether it's time to take another sample, at |now_ms|.
+  bool NeedsSample(int64_t now_ms) const {
+    return now_ms - last_sample_ms_ >= kSampleIntervalMs;
+  }
+
+  /// Take in a sample of |percent| from |source| at |now_ms|; a negative
+  /// one, when the value isn't known, leaves the limit as it is.
+  void AddSample(Source source, double percent, int64_t now_ms);
+
+  /// The number of job slots to use now.
+  int limit() const { return limit_; }
+
+ private:
+  int max_;
+  int limit_;
+  int64_t last_sample_ms_;
+};
+
+/// Spreads the commands of a build over the NUMA nodes of the machine, so
+/// that each runs on the processors of one node, with its memory, rather
+/// than migrating between them.  A command goes to the node with the least
+/// running weight per processor, among those that have processors of its
+/// pool, if the pool has any.
+struct CpuPlacement {
+  /// Place on |nodes|, the processors of each node; with fewer than two
+  /// there is nothing to balance, and only pools pin their commands.
+  explicit CpuPlacement(const vector<vector<int> >& nodes);
+
+  /// Choose the processors for a command of |weight| in a pool with
+  /// |pool_cpus|, if any, into |cpus|, which is left empty if it may run
+  /// anywhere.  Returns the node it is placed on, or -1.
+  int Place(int weight, const vector<int>& pool_cpus, vector<int>* cpus);
+  /// Take a command of |weight| that Place() put on |node| off it.
+  void Release(int node, int weight);
+  void Reset();
+
+ private:
+  vector<vector<int> > nodes_;
+  /// The running weight on each node.
+  vector<int> weights_;
+};
+
+/// Runs the commands of a build as subprocesses of this one, within the
+/// limits of -j, -l and -m and of a jobserver it's a client of.
+struct RealCommandRunner : public CommandRunner {
+  RealCommandRunner(const BuildConfig& config, BuildLog* build_log);
+  virtual ~RealCommandRunner();
+  virtual bool CanRunMore(const Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+  virtual bool Sleep(int ms);
+
+  /// The memory |edge| is expected to need while it runs, charged against
+  /// the -m budget.
+  int64_t EstimateMemory(const Edge* edge) const;
+
+  /// Give back the jobserver tokens beyond the first |needed| ones.
+  void ReleaseTokens(size_t needed);
+  /// Give back the jobserver tokens not used by the running commands.
+  void ReleaseUnusedTokens();
+
+  /// The time in GetTimeMillis() terms, which hedging goes by.
+  virtual int64_t Now() const { return GetTimeMillis(); }
+
+  const BuildConfig& config_;
+  /// Peak memory of earlier runs, for EstimateMemory().  May be NULL.
+  BuildLog* build_log_;
+  SubprocessSet subprocs_;
+  map<Subprocess*, Edge*> subproc_to_edge_;
+  /// Total weight of the running commands.
+  int running_weight_;
+  /// Total estimated memory of the running commands.
+  int64_t running_memory_;
+  JobserverClient jobserver_;
+  /// Number of jobserver tokens held, on top of the implicit one.
+  size_t tokens_;
+  /// The job slots to use while the machine is busy, with -l auto.
+  AdaptiveParallelism adaptive_;
+  /// The processors the commands run on.
+  CpuPlacement placement_;
+  /// The node of each running command that placement_ put on one.
+  map<Subprocess*, int> subproc_to_node_;
+
+  /// A running command that gets a second copy, its twin, once it runs
+  /// past |deadline|; see BuildConfig::hedge_factor.
+  struct Hedge {
+    Edge* edge;
+    string command;
+    bool direct_exec;
+    /// In GetTimeMillis() time.
+    int64_t deadline;
+    Subprocess* twin;
+  };
+  /// The running commands that may be hedged, by subprocess.
+  map<Subprocess*, Hedge> hedges_;
+  /// The running twins, with the command each is a copy of.
+  map<Subprocess*, Subprocess*> twins_;
+
+ protected:
+  /// Wait for any of |subprocs_| to finish; returns NULL if interrupted.
+  /// Of a command and its twin, the first to finish stands for both and
+  /// the other is killed.
+  Subprocess* WaitForSubprocess();
+  /// Let |subproc|, which runs |command| for |edge|, be hedged if its edge
+  /// allows it and the build log says how long it takes.
+  void AllowHedge(Subprocess* subproc, Edge* edge, const string& command,
+                  bool direct_exec);
+  /// Start the twins that are due, if there's room for them.  Returns the
+  /// milliseconds until the next one is due, or -1.
+  int StartTwins();
+  /// Take room for a twin of |edge| in the job slots and in the pool of
+  /// |edge|, if there is some, or give it back.
+  virtual bool ReserveTwin(const Edge* edge);
+  virtual void ReleaseTwin(const Edge* edge);
+  /// Have |twin| stand for |subproc| in what is kept by subprocess, as it
+  /// finished first.
+  virtual void Rekey(Subprocess* subproc, Subprocess* twin);
+  /// Fill in |result| from a command started by StartCommand(), and free
+  /// what it used.
+  void ReapCommand(Subprocess* subproc, Result* result);
+  /// Set up how |subproc| collects the output of |edge|.
+  void CollectOutput(Subprocess* subproc, Edge* edge);
+  /// Move the output that |subproc| collected into |result|.
+  void TakeOutput(Subprocess* subproc, Result* result);
+
+  /// The normalized /showIncludes paths, shared by all the commands.
+  CLIncludeCache includes_cache_;
+};
+
+/// Writes the rspfile of an edge on a thread, so that the build can have it
+/// done while it waits for commands, before StartEdge() needs it.  One edge
+/// is prepared at a time, once the directories of its outputs exist.
+struct EdgePreparer {
+  EdgePreparer() : edge_(NULL), disk_interface_(NULL), ok_(false) {}
+  ~EdgePreparer() { thread_.Join(); }
+
+  /// Write |content| to |rspfile|, unless it holds that already.
+  static bool WriteRspfile(DiskInterface* disk_interface,
+                           const string& rspfile, const string& content);
+  /// Write the rspfile of |edge| on the thread.  Its content is evaluated
+  /// here first.  Returns false if no thread could be started.
+  bool Start(Edge* edge, DiskInterface* disk_interface);
+  /// Wait for the edge being prepared, if any, and return it, with whether
+  /// it succeeded in |ok|.
+  Edge* Finish(bool* ok);
+
+  /// The edge being prepared, if any.
+  Edge* edge() const { return edge_; }
+  const string& rspfile() const { return rspfile_; }
+
+ private:
+  static void Run(void* preparer);
+
+  Edge* edge_;
+  DiskInterface* disk_interface_;
+  string rspfile_;
+  string content_;
+  bool ok_;
+  Thread thread_;
+};
+
+/// Warms the page cache with the inputs of edges that are ready to run,
+/// from a thread of its own, so that a cold cache is read while the
+/// commands already running are busy rather than when the next ones start.
+/// Each file is only asked for once.
+struct InputPrefetcher {
+  InputPrefetcher();
+  ~InputPrefetcher();
+
+  /// Whether the platform can be asked to read a file ahead.
+  static bool Supported();
+
+  /// Queue the inputs of |edge|, including those from depfiles and the
+  /// deps log, starting the thread if it isn't running.
+  void Add(Edge* edge);
+
+  /// Drop what is still queued and wait for the thread.
+  void Stop();
+
+ private:
+  static void RunThread(void* prefetcher);
+  void Run();
+  /// Ask the kernel to read |path| into the page cache.
+  static void Prefetch(const string& path);
+
+  void Lock();
+  void Unlock();
+
+  Thread thread_;
+  /// The inputs queued before, on the main thread only.
+  set<Node*> seen_;
+
+  /// The state shared with the thread, under the lock.
+  vector<string> queue_;
+  bool stopping_;
+
+#ifndef _WIN32
+  pthread_mutex_t lock_;
+  pthread_cond_t wake_;
+#endif
 };
 
 /// Builder wraps the build process: starting commands, updating status.
@@ -169,6 +658,12 @@ struct Builder {
   /// @return false on error.
   bool AddTarget(Node* target, string* err);
 
+  /// Stat the files that the given targets depend on in one batch, so that
+  /// the AddTarget() calls for them don't have to.
+  void PrefetchStats(const vector<Node*>& targets) {
+    scan_.PrefetchStats(targets);
+  }
+
   /// Returns true if the build targets are already up to date.
   bool AlreadyUpToDate() const;
 
@@ -187,6 +682,17 @@ struct Builder {
     scan_.set_build_log(log);
   }
 
+  /// Start with the edges that failed the last time, and record which fail
+  /// now in |log|, which may be NULL.
+  void SetFailureLog(FailureLog* log) { failure_log_ = log; }
+
+  /// Load the dyndep information provided by the given node.
+  bool LoadDyndeps(Node* node, string* err);
+
+  /// How long to wait before trying to take the slots of shared pools
+  /// again, with nothing running.
+  static const int kSharedPoolRetryMs = 100;
+
   State* state_;
   const BuildConfig& config_;
   Plan plan_;
@@ -201,21 +707,127 @@ struct Builder {
    bool ExtractDeps(CommandRunner::Result* result, const string& deps_type,
                     const string& deps_prefix, vector<Node*>* deps_nodes,
                     string* err);
+  /// Have |preparer_| write the rspfile of |edge|, the next edge to start,
+  /// while the build waits for a command, if it can.
+  void PrepareAhead(Edge* edge);
+  /// Create the directories of the outputs of |edge|.
+  bool MakeOutputDirs(Edge* edge);
+  /// Hand the inputs of the edges scheduled since the last call to
+  /// |prefetcher_|.
+  void PrefetchScheduled();
+
+  /// Start the commands of edges that only wait for running restat edges,
+  /// and that will run whether or not those change their outputs, on the
+  /// slots the plan has nothing ready for.  Each runs with the outputs as
+  /// they are; if they turn out to be unchanged the plan takes the result
+  /// when it gets to the edge, otherwise the edge runs again.
+  void Speculate();
+  /// Whether |edge| is worth running ahead of |running|, one of its inputs'
+  /// restat edges.
+  bool CanSpeculate(Edge* edge, Edge* running);
+  /// Handle |result| if it is from a command that Speculate() started.
+  /// Sets |is_result| if it is the result of its edge as far as the plan is
+  /// concerned.  Returns false on error.
+  bool SpeculationFinished(CommandRunner::Result* result, bool* is_result,
+                           string* err);
+  /// Wait for the commands started ahead that the plan never got to.
+  void FinishSpeculations();
+
+  /// Tell '-d slots' how busy the slots are from now on, and if the build
+  /// is |waiting| for a command, whether |next|, the edge that is ready to
+  /// run if any, or a pool holds commands back.
+  void UpdateSlotUsage(bool waiting, const Edge* next);
 
   DiskInterface* disk_interface_;
   DependencyScan scan_;
 
+  /// Set up by Build() if the config asks for it.
+  ActionCache* action_cache_;
+  FailureLog* failure_log_;
+  /// The edges whose outputs StartEdge() restored from |action_cache_|,
+  /// waiting for FinishCommand(), with the dependencies that were recorded
+  /// for them.
+  vector<Edge*> restored_edges_;
+  map<Edge*, vector<Node*> > restored_deps_;
+
+  /// A command started by Speculate().
+  struct Speculation {
+    Speculation() : restat_edge(NULL), finished(false), adopted(false),
+                    rerun(false) {}
+    /// The edge it ran ahead of.  Its outputs are only clean after it ran
+    /// if it left them alone.
+    Edge* restat_edge;
+    /// Whether the command finished, with |result|.
+    bool finished;
+    CommandRunner::Result result;
+    /// Whether the plan got to the edge while the command was running, and
+    /// whether it has to run again because its inputs changed.
+    bool adopted;
+    bool rerun;
+  };
+  map<Edge*, Speculation> speculations_;
+  /// The dependents of the running restat edges, which Speculate() may run.
+  vector<pair<Edge*, Edge*> > speculation_candidates_;
+  /// The results of speculative commands that the plan took, waiting for
+  /// FinishCommand().
+  vector<CommandRunner::Result> speculated_results_;
+  /// Prepares the next edge to start while commands run.
+  EdgePreparer preparer_;
+  /// Reads the inputs of ready edges ahead if the config asks for it, with
+  /// the edges that became ready since it last looked.
+  InputPrefetcher prefetcher_;
+  vector<Edge*> scheduled_edges_;
+  /// The output directories known to exist.
+  DirectoryMaker dirs_;
+
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder &other);        // DO NOT IMPLEMENT
   void operator=(const Builder &other); // DO NOT IMPLEMENT
 };
 
+/// A progress status format, as in NINJA_STATUS, split once into the text
+/// and the placeholders to fill in, rather than for every update.
+struct ProgressStatusFormat {
+  /// Split |format|.  Returns false and fills |err| on an unknown
+  /// placeholder.
+  bool Parse(const char* format, string* err);
+
+  enum Field {
+    kText,
+    kStarted,
+    kTotal,
+    kRunning,
+    kUnstarted,
+    kFinished,
+    kOverallRate,
+    kCurrentRate,
+    kPercent,
+    kElapsed,
+    kWorkPercent,
+    kRemainingTime,
+  };
+
+  /// A placeholder, or with kText, the text from |text_| between |begin|
+  /// and |end|.
+  struct Op {
+    Field field;
+    size_t begin, end;
+  };
+
+  vector<Op> ops_;
+  string text_;
+};
+
 /// Tracks the status of a build: completion fraction, printing updates.
 struct BuildStatus {
   explicit BuildStatus(const BuildConfig& config);
+  ~BuildStatus();
   void PlanHasTotalEdges(int total);
+  /// The plan expects its commands to run for |millis| more, in total.
+  void PlanHasRemainingWork(int64_t millis);
   void BuildEdgeStarted(Edge* edge);
-  void BuildEdgeFinished(Edge* edge, bool success, const string& output,
+  void BuildLoadDyndeps();
+  void BuildEdgeFinished(Edge* edge, const CommandRunner::Result& result,
                          int* start_time, int* end_time);
   void BuildStarted();
   void BuildFinished();
@@ -233,8 +845,32 @@ struct BuildStatus {
   string FormatProgressStatus(const char* progress_status_format,
                               EdgeStatus status) const;
 
+  /// Append the progress status of a format split already to |out|.
+  void FormatProgressStatus(const ProgressStatusFormat& format,
+                            EdgeStatus status, string* out) const;
+
+  /// Describe the |count| edges that have been running the longest, as of
+  /// |now| milliseconds into the build, longest first.
+  vector<string> FormatRunningEdges(size_t count, int now) const;
+
+  /// The expected duration of the commands that have run, counting the
+  /// running ones as far as they got by |now|, and of all of them, in
+  /// milliseconds.
+  void EstimateWork(int now, int64_t* done, int64_t* total) const;
+  /// How long the build is expected to take from |now| on, at the pace it
+  /// went so far, in milliseconds, or -1 if that isn't known yet.
+  int64_t EstimateRemainingTime(int now) const;
+
  private:
-  void PrintStatus(Edge* edge, EdgeStatus status);
+  /// Print the status line for |edge|, or if a frame was drawn too recently
+  /// and not |force|, leave it pending for the next frame.
+  void PrintStatus(Edge* edge, EdgeStatus status, bool force = false);
+
+  /// Draw the status line, and the running edges below it if wanted.
+  void DrawStatus(Edge* edge, EdgeStatus status);
+
+  /// Draw the status line that PrintStatus() left pending, if any.
+  void FlushStatus();
 
   const BuildConfig& config_;
 
@@ -243,6 +879,10 @@ struct BuildStatus {
 
   int started_edges_, finished_edges_, total_edges_;
 
+  /// The expected duration of the commands that have finished, and of
+  /// those that haven't; see EstimateWork().
+  int64_t work_done_, remaining_work_;
+
   /// Map of running edge to time the edge started running.
   typedef map<Edge*, int> RunningEdgeMap;
   RunningEdgeMap running_edges_;
@@ -250,8 +890,22 @@ struct BuildStatus {
   /// Prints progress output.
   LinePrinter printer_;
 
+  /// Where the events of the build go as well, if anywhere.
+  BuildEventStream* events_;
+
   /// The custom progress status format to use.
-  const char* progress_status_format_;
+  ProgressStatusFormat progress_status_format_;
+
+  /// The status line being drawn, kept to reuse its buffer.
+  string status_line_;
+
+  /// The shortest time between two frames, from config_.status_fps, or 0.
+  int frame_millis_;
+  /// When the last frame was drawn, in milliseconds into the build.
+  int last_frame_;
+  /// The edge and status of the latest update not drawn yet, if any.
+  Edge* pending_edge_;
+  EdgeStatus pending_status_;
 
   template<size_t S>
   void SnprintfRate(double rate, char(&buf)[S], const char* format) const {
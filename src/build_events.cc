@@ -0,0 +1,150 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_events.h"
+
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+
+namespace {
+
+/// The protobuf wire types that the events use.
+enum WireType {
+  kVarint = 0,
+  kLengthDelimited = 2
+};
+
+void AppendVarint(uint64_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back((char)value);
+}
+
+void AppendNumber(int field, uint64_t value, string* out) {
+  AppendVarint(field << 3 | kVarint, out);
+  AppendVarint(value, out);
+}
+
+void AppendBytes(int field, const char* data, size_t size, string* out) {
+  AppendVarint(field << 3 | kLengthDelimited, out);
+  AppendVarint(size, out);
+  out->append(data, size);
+}
+
+void AppendBytes(int field, const string& value, string* out) {
+  AppendBytes(field, value.data(), value.size(), out);
+}
+
+void AppendPaths(int field, const vector<Node*>& nodes, string* out) {
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
+    AppendBytes(field, (*n)->path().str_, (*n)->path().len_, out);
+}
+
+}  // anonymous namespace
+
+BuildEventStream::BuildEventStream(int fd) : fd_(fd), failed_(false) {
+#ifndef _WIN32
+  // The commands have no business writing to it.
+  fcntl(fd_, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+void BuildEventStream::TotalEdges(int total_edges) {
+  event_.clear();
+  AppendNumber(1, total_edges, &event_);
+  Write(1, event_);
+}
+
+void BuildEventStream::EdgeStarted(Edge* edge, int start_time) {
+  event_.clear();
+  AppendNumber(1, edge->id_, &event_);
+  AppendNumber(2, start_time, &event_);
+  AppendPaths(3, edge->inputs_, &event_);
+  AppendPaths(4, edge->outputs_, &event_);
+  string description = edge->GetBinding(VarNames::kDescription);
+  if (!description.empty())
+    AppendBytes(5, description, &event_);
+  AppendBytes(6, edge->GetCommand(), &event_);
+  if (edge->use_console())
+    AppendNumber(7, 1, &event_);
+  Write(2, event_);
+}
+
+void BuildEventStream::EdgeFinished(const Edge* edge, int end_time,
+                                    ExitStatus status, const string& output,
+                                    const ResourceUsage& usage) {
+  event_.clear();
+  AppendNumber(1, edge->id_, &event_);
+  AppendNumber(2, end_time, &event_);
+  AppendNumber(3, status, &event_);
+  if (!output.empty())
+    AppendBytes(4, output, &event_);
+  AppendNumber(5, usage.user_time_ms, &event_);
+  AppendNumber(6, usage.system_time_ms, &event_);
+  AppendNumber(7, usage.max_rss_kb, &event_);
+  Write(3, event_);
+}
+
+void BuildEventStream::Progress(int64_t done, int64_t total,
+                                int64_t remaining_time) {
+  event_.clear();
+  AppendNumber(1, done, &event_);
+  AppendNumber(2, total, &event_);
+  if (remaining_time >= 0)
+    AppendNumber(3, remaining_time, &event_);
+  Write(5, event_);
+}
+
+void BuildEventStream::BuildFinished() {
+  Write(4, string());
+}
+
+void BuildEventStream::Write(int field, const string& event) {
+  if (failed_)
+    return;
+  // The size of the BuildEvent, then the BuildEvent itself: its one field.
+  message_.clear();
+  AppendBytes(field, event, &message_);
+  string size;
+  AppendVarint(message_.size(), &size);
+  message_.insert(0, size);
+
+  const char* data = message_.data();
+  size_t left = message_.size();
+  while (left > 0) {
+#ifdef _WIN32
+    int written = _write(fd_, data, (unsigned)left);
+#else
+    ssize_t written = write(fd_, data, left);
+#endif
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      failed_ = true;
+      return;
+    }
+    data += written;
+    left -= written;
+  }
+}
@@ -0,0 +1,57 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILD_EVENTS_H_
+#define NINJA_BUILD_EVENTS_H_
+
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+#include "exit_status.h"
+#include "resource_usage.h"
+
+struct Edge;
+
+/// Writes what happens during a build to a file descriptor, for frontends
+/// that show it their own way, as the messages of misc/build_events.proto
+/// each preceded by its size.  Encoding them costs next to nothing compared
+/// to formatting the status line.
+struct BuildEventStream {
+  /// The descriptor stays owned by the caller.
+  explicit BuildEventStream(int fd);
+
+  void TotalEdges(int total_edges);
+  void EdgeStarted(Edge* edge, int start_time);
+  void EdgeFinished(const Edge* edge, int end_time, ExitStatus status,
+                    const string& output, const ResourceUsage& usage);
+  /// How much of the expected duration of the commands has been run, of
+  /// |total| milliseconds, and how long the rest is expected to take, or
+  /// -1 if that isn't known.
+  void Progress(int64_t done, int64_t total, int64_t remaining_time);
+  void BuildFinished();
+
+ private:
+  /// Write the BuildEvent with |event| as its field |field|.
+  void Write(int field, const string& event);
+
+  int fd_;
+  /// Whether writing failed, e.g. because the frontend went away; the
+  /// build goes on without it then.
+  bool failed_;
+  string event_;
+  string message_;
+};
+
+#endif  // NINJA_BUILD_EVENTS_H_
@@ -0,0 +1,86 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_events.h"
+
+#include <stdio.h>
+
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+struct BuildEventStreamTest : public StateTestWithBuiltinRules {
+  BuildEventStreamTest() : file_(tmpfile()) {}
+  ~BuildEventStreamTest() { fclose(file_); }
+
+  /// Everything written to |file_| so far.
+  string Written() {
+    fflush(file_);
+    rewind(file_);
+    string written;
+    char buf[256];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), file_)) > 0)
+      written.append(buf, len);
+    return written;
+  }
+
+  FILE* file_;
+};
+
+TEST_F(BuildEventStreamTest, Framing) {
+  BuildEventStream events(fileno(file_));
+  events.TotalEdges(300);
+  events.BuildFinished();
+  // Sizes first, then field 1 or 4 of the BuildEvent, holding the varint
+  // 300 as field 1 for TotalEdges and nothing for BuildFinished.
+  EXPECT_EQ(string("\x05\x0a\x03\x08\xac\x02" "\x02\x22\x00", 9), Written());
+}
+
+TEST_F(BuildEventStreamTest, Progress) {
+  BuildEventStream events(fileno(file_));
+  events.Progress(5, 20, -1);
+  events.Progress(10, 20, 7);
+  // The remaining time is left out until it's known.
+  EXPECT_EQ(string("\x06\x2a\x04\x08\x05\x10\x14"
+                   "\x08\x2a\x06\x08\x0a\x10\x14\x18\x07", 16), Written());
+}
+
+TEST_F(BuildEventStreamTest, Edges) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in1 in2\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  BuildEventStream events(fileno(file_));
+  events.EdgeStarted(edge, 7);
+  ResourceUsage usage;
+  usage.user_time_ms = 5;
+  events.EdgeFinished(edge, 9, ExitFailure, string(200, 'x'), usage);
+
+  string written = Written();
+  string started = string("\x08") + (char)edge->id_ + "\x10\x07"
+      "\x1a\x03in1" "\x1a\x03in2" "\x22\x03out" "\x32\x11" "cat in1 in2 > out";
+  started = "\x12" + string(1, (char)started.size()) + started;
+  ASSERT_LE(started.size() + 1, written.size());
+  EXPECT_EQ((char)started.size(), written[0]);
+  EXPECT_EQ(started, written.substr(1, started.size()));
+
+  // The output makes for sizes of two bytes.
+  string finished = written.substr(1 + started.size());
+  string output = string("\x22\xc8\x01", 3) + string(200, 'x');
+  EXPECT_NE(string::npos, finished.find(string("\x18\x01", 2) + output +
+                                        string("\x28\x05\x30\x00\x38\x00", 6)));
+}
+
+}  // anonymous namespace
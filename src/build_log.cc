@@ -32,12 +32,11 @@
 #endif
 
 #include "build.h"
+#include "disk_interface.h"
 #include "graph.h"
+#include "memory_stats.h"
 #include "metrics.h"
 #include "util.h"
-#if defined(_MSC_VER) && (_MSC_VER < 1800)
-#define strtoll _strtoi64
-#endif
 
 // Implementation details:
 // Each run's log appends to the log file.
@@ -45,12 +44,22 @@
 // older runs.
 // Once the number of redundant entries exceeds a threshold, we write
 // out a new file and replace the existing one with it.
+//
+// A binary log starts with a BinaryHeader, then the slots of an index of
+// the outputs, then records, each a multiple of 8 bytes long.  An output
+// record is a uint32_t with kOutputRecord set and the length of the output
+// in the rest, then the output, padded with NULs.  Its offset divided by 8
+// is the output's path id.  An entry record is a BinaryEntry, which starts
+// with the path id of an earlier output record.  Recompaction writes each
+// output record right before the one entry of its output, and indexes
+// them by output; builds then append their records after those, which
+// loading has to read.
 
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
+const int kCurrentVersion = 6;
 
 // 64bit MurmurHash2, by Austin Appleby
 #if defined(_MSC_VER)
@@ -100,218 +109,361 @@ uint64_t MurmurHash64A(const void* key, size_t len) {
 }
 #undef BIG_CONSTANT
 
+const char kBinarySignature[] = "# ninja log bin\n";
+const uint32_t kBinaryVersion = 1;
+const uint32_t kOutputRecord = 1u << 31;
+
+struct BinaryHeader {
+  char signature[16];
+  uint32_t version;
+  /// The number of entries that the index covers.
+  uint32_t indexed_count;
+  /// Where the records that the index covers end.
+  uint64_t indexed_end;
+};
+
+struct BinaryEntry {
+  uint32_t path_id;
+  int32_t start_time;
+  int32_t end_time;
+  int32_t user_time_ms;
+  int32_t system_time_ms;
+  int32_t max_rss_kb;
+  int64_t mtime;
+  uint64_t command_hash;
+  uint64_t content_hash;
+};
+
+/// An open-addressing hash table slot, at the hash of the output or after
+/// it.
+struct IndexSlot {
+  /// The high half of the hash of the output, which rules out most other
+  /// outputs without reading them.
+  uint32_t tag;
+  /// The path id of the output, or 0 if the slot is empty.
+  uint32_t path_id;
+};
+
+/// The number of index slots for \a count entries, which keeps the table
+/// at most half full.
+uint32_t IndexSize(uint32_t count) {
+  uint32_t size = count ? 2 : 0;
+  while (size < 2 * count)
+    size <<= 1;
+  return size;
+}
+
+size_t OutputRecordSize(size_t len) {
+  return (sizeof(uint32_t) + len + 7) & ~(size_t)7;
+}
+
+/// Read the output with path id \a id from a binary log whose first
+/// \a size bytes are at \a data.
+bool ReadOutput(const char* data, size_t size, uint32_t id,
+                StringPiece* output) {
+  size_t offset = (size_t)id * 8;
+  uint32_t header;
+  if (offset < sizeof(BinaryHeader) || offset + sizeof(header) > size)
+    return false;
+  memcpy(&header, data + offset, sizeof(header));
+  if (!(header & kOutputRecord))
+    return false;
+  size_t len = header & ~kOutputRecord;
+  if (offset + OutputRecordSize(len) > size)
+    return false;
+  *output = StringPiece(data + offset + sizeof(header), len);
+  return true;
+}
+
+void AppendOutputRecord(StringPiece output, string* out) {
+  uint32_t header = kOutputRecord | (uint32_t)output.len_;
+  out->append((const char*)&header, sizeof(header));
+  out->append(output.str_, output.len_);
+  out->resize(out->size() + OutputRecordSize(output.len_) -
+              sizeof(header) - output.len_, '\0');
+}
+
+void AppendEntryRecord(const BuildLog::LogEntry& entry, string* out) {
+  BinaryEntry record;
+  record.path_id = entry.path_id;
+  record.start_time = entry.start_time;
+  record.end_time = entry.end_time;
+  record.user_time_ms = entry.usage.user_time_ms;
+  record.system_time_ms = entry.usage.system_time_ms;
+  record.max_rss_kb = entry.usage.max_rss_kb;
+  record.mtime = entry.mtime;
+  record.command_hash = entry.command_hash;
+  record.content_hash = entry.content_hash;
+  out->append((const char*)&record, sizeof(record));
+}
+
+void ReadEntryRecord(const BinaryEntry& record, BuildLog::LogEntry* entry) {
+  entry->path_id = record.path_id;
+  entry->start_time = record.start_time;
+  entry->end_time = record.end_time;
+  entry->usage.user_time_ms = record.user_time_ms;
+  entry->usage.system_time_ms = record.system_time_ms;
+  entry->usage.max_rss_kb = record.max_rss_kb;
+  entry->mtime = record.mtime;
+  entry->command_hash = record.command_hash;
+  entry->content_hash = record.content_hash;
+}
+
+bool WriteBinaryHeader(FILE* f, uint32_t indexed_count, uint64_t indexed_end) {
+  BinaryHeader header;
+  memcpy(header.signature, kBinarySignature, sizeof(header.signature));
+  header.version = kBinaryVersion;
+  header.indexed_count = indexed_count;
+  header.indexed_end = indexed_end;
+  return fwrite(&header, sizeof(header), 1, f) == 1;
+}
 
 }  // namespace
 
+void BuildLogUser::ArePathsDead(const vector<StringPiece>& paths,
+                                vector<bool>* dead) const {
+  dead->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*dead)[i] = IsPathDead(paths[i]);
+}
+
 // static
 uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
   return MurmurHash64A(command.str_, command.len_);
 }
 
-BuildLog::LogEntry::LogEntry(const string& output)
-  : output(output) {}
+BuildLog::LogEntry::LogEntry(StringPiece output)
+  : output(output), content_hash(0), path_id(0) {}
 
-BuildLog::LogEntry::LogEntry(const string& output, uint64_t command_hash,
+BuildLog::LogEntry::LogEntry(StringPiece output, uint64_t command_hash,
   int start_time, int end_time, TimeStamp restat_mtime)
   : output(output), command_hash(command_hash),
-    start_time(start_time), end_time(end_time), mtime(restat_mtime)
+    start_time(start_time), end_time(end_time), mtime(restat_mtime),
+    content_hash(0), path_id(0)
 {}
 
 BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+  : log_file_(NULL), needs_recompaction_(false), compaction_(NULL),
+    binary_(false), index_(NULL), index_size_(0), indexed_end_(0),
+    log_size_(0) {}
 
 BuildLog::~BuildLog() {
   Close();
+  for (vector<string*>::iterator i = owned_outputs_.begin();
+       i != owned_outputs_.end(); ++i) {
+    delete *i;
+  }
 }
 
 bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
                             string* err) {
-  if (needs_recompaction_) {
-    if (!Recompact(path, user, err))
-      return false;
-  }
-
   log_file_ = fopen(path.c_str(), "ab");
   if (!log_file_) {
     *err = strerror(errno);
     return false;
   }
-  setvbuf(log_file_, NULL, _IOLBF, BUFSIZ);
+  // The writer flushes whole entries.
+  setvbuf(log_file_, NULL, _IOFBF, BUFSIZ);
   SetCloseOnExec(fileno(log_file_));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
   fseek(log_file_, 0, SEEK_END);
 
-  if (ftell(log_file_) == 0) {
+  long log_size = ftell(log_file_);
+  if (log_size == 0 && binary_) {
+    // Path ids of a log that was removed since mean nothing anymore.
+    LoadIndexedEntries();
+    for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+      i->second->path_id = 0;
+    if (!WriteBinaryHeader(log_file_, 0, sizeof(BinaryHeader))) {
+      *err = strerror(errno);
+      return false;
+    }
+    log_size = sizeof(BinaryHeader);
+  } else if (log_size == 0) {
     if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
       *err = strerror(errno);
       return false;
     }
   }
+  log_size_ = log_size;
 
+  if (needs_recompaction_) {
+    needs_recompaction_ = false;
+    // The records appended to a binary log refer to earlier ones by their
+    // offset, so they can't be copied over to a log recompacted meanwhile.
+    if (binary_ || !StartRecompaction(path, user, log_size)) {
+      // Fall back to recompacting right away.
+      if (!Recompact(path, user, err))
+        return false;
+      return OpenForWrite(path, user, err);
+    }
+  }
+
+  writer_.Start(log_file_, commit_policy_);
   return true;
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
-  string command = edge->EvaluateCommand(true);
-  uint64_t command_hash = LogEntry::HashCommand(command);
+                             TimeStamp mtime, const ResourceUsage& usage,
+                             const vector<uint64_t>* content_hashes) {
+  uint64_t command_hash = edge->GetCommandHash();
+  string record;
   for (vector<Node*>::iterator out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
-    const string& path = (*out)->path();
-    Entries::iterator i = entries_.find(path);
-    LogEntry* log_entry;
-    if (i != entries_.end()) {
-      log_entry = i->second;
-    } else {
-      log_entry = new LogEntry(path);
+    StringPiece path = (*out)->path();
+    LogEntry* log_entry = LookupByOutput(path);
+    if (!log_entry) {
+      owned_outputs_.push_back(new string(path.AsString()));
+      log_entry = new LogEntry(*owned_outputs_.back());
       entries_.insert(Entries::value_type(log_entry->output, log_entry));
     }
     log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
-
-    if (log_file_) {
-      if (!WriteEntry(log_file_, *log_entry))
-        return false;
-      if (fflush(log_file_) != 0) {
-          return false;
-      }
-    }
+    log_entry->usage = usage;
+    log_entry->content_hash =
+        content_hashes ? (*content_hashes)[out - edge->outputs_.begin()] : 0;
+
+    if (log_file_ && binary_)
+      FormatBinaryEntry(log_entry, &record);
+    else if (log_file_)
+      FormatEntry(*log_entry, &record);
   }
-  return true;
+  log_size_ += record.size();
+  return !log_file_ || writer_.Append(record);
 }
 
 void BuildLog::Close() {
+  if (!writer_.Stop())
+    Warning("writing build log: %s", strerror(errno));
+  if (compaction_)
+    FinishRecompaction();
   if (log_file_)
     fclose(log_file_);
   log_file_ = NULL;
 }
 
-struct LineReader {
-  explicit LineReader(FILE* file)
-    : file_(file), buf_end_(buf_), line_start_(buf_), line_end_(NULL) {
-      memset(buf_, 0, sizeof(buf_));
-  }
-
-  // Reads a \n-terminated line from the file passed to the constructor.
-  // On return, *line_start points to the beginning of the next line, and
-  // *line_end points to the \n at the end of the line. If no newline is seen
-  // in a fixed buffer size, *line_end is set to NULL. Returns false on EOF.
-  bool ReadLine(char** line_start, char** line_end) {
-    if (line_start_ >= buf_end_ || !line_end_) {
-      // Buffer empty, refill.
-      size_t size_read = fread(buf_, 1, sizeof(buf_), file_);
-      if (!size_read)
-        return false;
-      line_start_ = buf_;
-      buf_end_ = buf_ + size_read;
-    } else {
-      // Advance to next line in buffer.
-      line_start_ = line_end_ + 1;
-    }
+namespace {
 
-    line_end_ = (char*)memchr(line_start_, '\n', buf_end_ - line_start_);
-    if (!line_end_) {
-      // No newline. Move rest of data to start of buffer, fill rest.
-      size_t already_consumed = line_start_ - buf_;
-      size_t size_rest = (buf_end_ - buf_) - already_consumed;
-      memmove(buf_, line_start_, size_rest);
-
-      size_t read = fread(buf_ + size_rest, 1, sizeof(buf_) - size_rest, file_);
-      buf_end_ = buf_ + size_rest + read;
-      line_start_ = buf_;
-      line_end_ = (char*)memchr(line_start_, '\n', buf_end_ - line_start_);
-    }
+/// Parse the decimal number at the start of [\a p, \a end), like atoi()
+/// but without needing a terminator.  Advances \a p past it.
+int64_t ParseDecimal(const char** p, const char* end) {
+  const char* s = *p;
+  bool negative = s < end && *s == '-';
+  if (negative)
+    ++s;
+  int64_t value = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s)
+    value = value * 10 + (*s - '0');
+  *p = s;
+  return negative ? -value : value;
+}
 
-    *line_start = line_start_;
-    *line_end = line_end_;
-    return true;
+/// Parse the hexadecimal number at the start of [\a p, \a end), like
+/// strtoull(..., 16).  Advances \a p past it.
+uint64_t ParseHex(const char** p, const char* end) {
+  const char* s = *p;
+  uint64_t value = 0;
+  for (; s < end; ++s) {
+    char c = *s;
+    if (c >= '0' && c <= '9')
+      value = (value << 4) | (c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value = (value << 4) | (c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      value = (value << 4) | (c - 'A' + 10);
+    else
+      break;
   }
+  *p = s;
+  return value;
+}
 
- private:
-  FILE* file_;
-  char buf_[256 << 10];
-  char* buf_end_;  // Points one past the last valid byte in |buf_|.
-
-  char* line_start_;
-  // Points at the next \n in buf_ after line_start, or NULL.
-  char* line_end_;
-};
+}  // anonymous namespace
 
 bool BuildLog::Load(const string& path, string* err) {
   METRIC_RECORD(".ninja_log load");
-  FILE* file = fopen(path.c_str(), "r");
-  if (!file) {
-    if (errno == ENOENT)
-      return true;
-    *err = strerror(errno);
+  // Entries from an earlier load may point into the old mapping.
+  CopyMappedOutputs();
+  int ret = mapped_log_.Map(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
+  }
+  if (ret < 0)
     return false;
+
+  const char* p = mapped_log_.data();
+  const char* end = p + mapped_log_.size();
+  if (p == end)
+    return true; // file was empty
+
+  const size_t kBinarySignatureSize = sizeof(kBinarySignature) - 1;
+  if ((size_t)(end - p) >= kBinarySignatureSize &&
+      memcmp(p, kBinarySignature, kBinarySignatureSize) == 0) {
+    return LoadBinary(path, err);
   }
 
+  // The first line is the signature, "# ninja log v<version>".
   int log_version = 0;
+  const char kSignaturePrefix[] = "# ninja log v";
+  const size_t kSignaturePrefixSize = sizeof(kSignaturePrefix) - 1;
+  if ((size_t)(end - p) > kSignaturePrefixSize &&
+      memcmp(p, kSignaturePrefix, kSignaturePrefixSize) == 0) {
+    const char* version = p + kSignaturePrefixSize;
+    log_version = (int)ParseDecimal(&version, end);
+  }
+  if (log_version < kOldestSupportedVersion) {
+    *err = ("build log version invalid, perhaps due to being too old; "
+            "starting over");
+    mapped_log_.Unmap();
+    unlink(path.c_str());
+    // Don't report this as a failure.  An empty build log will cause
+    // us to rebuild the outputs anyway.
+    return true;
+  }
+
   int unique_entry_count = 0;
   int total_entry_count = 0;
 
-  LineReader reader(file);
-  char* line_start = 0;
-  char* line_end = 0;
-  while (reader.ReadLine(&line_start, &line_end)) {
-    if (!log_version) {
-      sscanf(line_start, kFileSignature, &log_version);
-
-      if (log_version < kOldestSupportedVersion) {
-        *err = ("build log version invalid, perhaps due to being too old; "
-                "starting over");
-        fclose(file);
-        unlink(path.c_str());
-        // Don't report this as a failure.  An empty build log will cause
-        // us to rebuild the outputs anyway.
-        return true;
-      }
-    }
-
-    // If no newline was found in this chunk, read the next.
-    if (!line_end)
-      continue;
-
-    const char kFieldSeparator = '\t';
-
-    char* start = line_start;
-    char* end = (char*)memchr(start, kFieldSeparator, line_end - start);
-    if (!end)
+  // Split each line into its tab-separated fields in one pass, without
+  // copying anything but the outputs that haven't been seen before.
+  const char kFieldSeparator = '\t';
+  const char* line_end = (const char*)memchr(p, '\n', end - p);
+  for (; line_end; line_end = (const char*)memchr(p, '\n', end - p)) {
+    const char* start = p;
+    p = line_end + 1;
+    // Logs written in text mode on Windows have CRLF line endings.
+    if (line_end > start && line_end[-1] == '\r')
+      --line_end;
+
+    const char* field_end =
+        (const char*)memchr(start, kFieldSeparator, line_end - start);
+    if (!field_end)
       continue;
-    *end = 0;
+    int start_time = (int)ParseDecimal(&start, field_end);
+    start = field_end + 1;
 
-    int start_time = 0, end_time = 0;
-    TimeStamp restat_mtime = 0;
-
-    start_time = atoi(start);
-    start = end + 1;
-
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
-    if (!end)
+    field_end = (const char*)memchr(start, kFieldSeparator, line_end - start);
+    if (!field_end)
       continue;
-    *end = 0;
-    end_time = atoi(start);
-    start = end + 1;
+    int end_time = (int)ParseDecimal(&start, field_end);
+    start = field_end + 1;
 
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
-    if (!end)
+    field_end = (const char*)memchr(start, kFieldSeparator, line_end - start);
+    if (!field_end)
       continue;
-    *end = 0;
-    restat_mtime = strtoll(start, NULL, 10);
-    start = end + 1;
+    TimeStamp restat_mtime = ParseDecimal(&start, field_end);
+    start = field_end + 1;
 
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
-    if (!end)
+    field_end = (const char*)memchr(start, kFieldSeparator, line_end - start);
+    if (!field_end)
       continue;
-    string output = string(start, end - start);
-
-    start = end + 1;
-    end = line_end;
+    StringPiece output(start, field_end - start);
+    start = field_end + 1;
 
     LogEntry* entry;
     Entries::iterator i = entries_.find(output);
@@ -327,27 +479,43 @@ bool BuildLog::Load(const string& path, string* err) {
     entry->start_time = start_time;
     entry->end_time = end_time;
     entry->mtime = restat_mtime;
-    if (log_version >= 5) {
-      char c = *end; *end = '\0';
-      entry->command_hash = (uint64_t)strtoull(start, NULL, 16);
-      *end = c;
+    entry->usage = ResourceUsage();
+    entry->content_hash = 0;
+    if (log_version >= 6) {
+      // The hash is followed by the user and system CPU times and the peak
+      // RSS of the command, then by the hash of the output's contents if it
+      // has one.
+      entry->command_hash = ParseHex(&start, line_end);
+      if (start < line_end && *start == kFieldSeparator) {
+        ++start;
+        entry->usage.user_time_ms = (int)ParseDecimal(&start, line_end);
+      }
+      if (start < line_end && *start == kFieldSeparator) {
+        ++start;
+        entry->usage.system_time_ms = (int)ParseDecimal(&start, line_end);
+      }
+      if (start < line_end && *start == kFieldSeparator) {
+        ++start;
+        entry->usage.max_rss_kb = (int)ParseDecimal(&start, line_end);
+      }
+      if (start < line_end && *start == kFieldSeparator) {
+        ++start;
+        entry->content_hash = ParseHex(&start, line_end);
+      }
+    } else if (log_version >= 5) {
+      entry->command_hash = ParseHex(&start, line_end);
     } else {
       entry->command_hash = LogEntry::HashCommand(StringPiece(start,
-                                                              end - start));
+                                                              line_end - start));
     }
   }
-  fclose(file);
-
-  if (!line_start) {
-    return true; // file was empty
-  }
 
   // Decide whether it's time to rebuild the log:
   // - if we're upgrading versions
   // - if it's getting large
   int kMinCompactionEntryCount = 100;
   int kCompactionRatio = 3;
-  if (log_version < kCurrentVersion) {
+  if (log_version < kCurrentVersion || binary_) {
     needs_recompaction_ = true;
   } else if (total_entry_count > kMinCompactionEntryCount &&
              total_entry_count > unique_entry_count * kCompactionRatio) {
@@ -357,17 +525,421 @@ bool BuildLog::Load(const string& path, string* err) {
   return true;
 }
 
-BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
+bool BuildLog::LoadBinary(const string& path, string* err) {
+  binary_ = true;
+  const char* data = mapped_log_.data();
+  size_t size = mapped_log_.size();
+  BinaryHeader header;
+  size_t records_begin = 0;
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    records_begin = sizeof(header) +
+        (size_t)IndexSize(header.indexed_count) * sizeof(IndexSlot);
+  }
+  if (size < sizeof(header) || header.version != kBinaryVersion ||
+      header.indexed_end < records_begin || header.indexed_end > size) {
+    *err = "build log version invalid or corrupt; starting over";
+    mapped_log_.Unmap();
+    unlink(path.c_str());
+    // Don't report this as a failure, like for an outdated text log.
+    return true;
+  }
+  index_size_ = IndexSize(header.indexed_count);
+  index_ = index_size_ ? data + sizeof(header) : NULL;
+  indexed_end_ = header.indexed_end;
+
+  // Read what builds appended since the log was indexed.
+  int appended_entry_count = 0;
+  size_t offset = indexed_end_;
+  while (offset + sizeof(uint32_t) <= size) {
+    uint32_t record_header;
+    memcpy(&record_header, data + offset, sizeof(record_header));
+    if (record_header & kOutputRecord) {
+      size_t record_size = OutputRecordSize(record_header & ~kOutputRecord);
+      if (offset + record_size > size)
+        break;
+      offset += record_size;
+      continue;
+    }
+    BinaryEntry record;
+    StringPiece output;
+    if (offset + sizeof(record) > size ||
+        !ReadOutput(data, offset, record_header, &output)) {
+      break;
+    }
+    memcpy(&record, data + offset, sizeof(record));
+    offset += sizeof(record);
+
+    LogEntry* entry;
+    Entries::iterator i = entries_.find(output);
+    if (i != entries_.end()) {
+      entry = i->second;
+    } else {
+      entry = new LogEntry(output);
+      entries_.insert(Entries::value_type(entry->output, entry));
+    }
+    ReadEntryRecord(record, entry);
+    ++appended_entry_count;
+  }
+
+  // A record that a crash cut short would misplace what gets appended
+  // after it, so rewrite the log.  Also rewrite it once reading what was
+  // appended takes a good part of what reading it all would.
+  int kMinCompactionEntryCount = 100;
+  int kCompactionRatio = 3;
+  if (offset != size) {
+    needs_recompaction_ = true;
+  } else if (appended_entry_count > kMinCompactionEntryCount &&
+             appended_entry_count * kCompactionRatio >
+                 (int)header.indexed_count) {
+    needs_recompaction_ = true;
+  }
+  return true;
+}
+
+BuildLog::LogEntry* BuildLog::LookupInIndex(StringPiece path) {
+  const char* data = mapped_log_.data();
+  uint64_t hash = MurmurHash64A(path.str_, path.len_);
+  uint32_t tag = (uint32_t)(hash >> 32);
+  uint32_t mask = index_size_ - 1;
+  uint32_t slot_index = (uint32_t)hash & mask;
+  for (uint32_t probes = 0; probes < index_size_; ++probes) {
+    IndexSlot slot;
+    memcpy(&slot, index_ + slot_index * sizeof(slot), sizeof(slot));
+    if (!slot.path_id)
+      return NULL;
+    slot_index = (slot_index + 1) & mask;
+    StringPiece output;
+    if (slot.tag != tag ||
+        !ReadOutput(data, indexed_end_, slot.path_id, &output) ||
+        output != path) {
+      continue;
+    }
+    size_t offset = (size_t)slot.path_id * 8 + OutputRecordSize(output.len_);
+    BinaryEntry record;
+    if (offset + sizeof(record) > indexed_end_)
+      return NULL;
+    memcpy(&record, data + offset, sizeof(record));
+    LogEntry* entry = new LogEntry(output);
+    ReadEntryRecord(record, entry);
+    entries_.insert(Entries::value_type(entry->output, entry));
+    return entry;
+  }
+  return NULL;
+}
+
+void BuildLog::LoadIndexedEntries() {
+  if (!index_)
+    return;
+  const char* data = mapped_log_.data();
+  size_t offset = sizeof(BinaryHeader) + index_size_ * sizeof(IndexSlot);
+  while (offset < indexed_end_) {
+    StringPiece output;
+    if (!ReadOutput(data, indexed_end_, (uint32_t)(offset / 8), &output))
+      break;
+    offset += OutputRecordSize(output.len_);
+    BinaryEntry record;
+    if (offset + sizeof(record) > indexed_end_)
+      break;
+    memcpy(&record, data + offset, sizeof(record));
+    offset += sizeof(record);
+    // What was looked up already, or appended later, is as new or newer.
+    if (entries_.find(output) != entries_.end())
+      continue;
+    LogEntry* entry = new LogEntry(output);
+    ReadEntryRecord(record, entry);
+    entries_.insert(Entries::value_type(entry->output, entry));
+  }
+  index_ = NULL;
+}
+
+void BuildLog::CopyMappedOutputs() {
+  const char* begin = mapped_log_.data();
+  if (!begin)
+    return;
+  LoadIndexedEntries();
+  const char* end = begin + mapped_log_.size();
+  Entries entries;
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+    LogEntry* entry = i->second;
+    if (entry->output.str_ >= begin && entry->output.str_ < end) {
+      owned_outputs_.push_back(new string(entry->output.AsString()));
+      entry->output = *owned_outputs_.back();
+    }
+    entries.insert(Entries::value_type(entry->output, entry));
+  }
+  entries_.swap(entries);
+  mapped_log_.Unmap();
+}
+
+BuildLog::LogEntry* BuildLog::LookupByOutput(StringPiece path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
+  if (index_)
+    return LookupInIndex(path);
   return NULL;
 }
 
 bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
-          entry.start_time, entry.end_time, entry.mtime,
-          entry.output.c_str(), entry.command_hash) > 0;
+  if (fprintf(f, "%d\t%d\t%" PRId64 "\t%.*s\t%" PRIx64 "\t%d\t%d\t%d",
+              entry.start_time, entry.end_time, entry.mtime,
+              (int)entry.output.len_, entry.output.str_, entry.command_hash,
+              entry.usage.user_time_ms, entry.usage.system_time_ms,
+              entry.usage.max_rss_kb) <= 0) {
+    return false;
+  }
+  if (entry.content_hash)
+    return fprintf(f, "\t%" PRIx64 "\n", entry.content_hash) > 0;
+  return fputc('\n', f) != EOF;
+}
+
+void BuildLog::FormatEntry(const LogEntry& entry, string* out) {
+  // The same as WriteEntry(), without the output, which may be long.
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%d\t%d\t%" PRId64 "\t",
+           entry.start_time, entry.end_time, entry.mtime);
+  out->append(buf);
+  out->append(entry.output.str_, entry.output.len_);
+  snprintf(buf, sizeof(buf), "\t%" PRIx64 "\t%d\t%d\t%d",
+           entry.command_hash, entry.usage.user_time_ms,
+           entry.usage.system_time_ms, entry.usage.max_rss_kb);
+  out->append(buf);
+  if (entry.content_hash) {
+    snprintf(buf, sizeof(buf), "\t%" PRIx64, entry.content_hash);
+    out->append(buf);
+  }
+  out->append(1, '\n');
+}
+
+void BuildLog::FormatBinaryEntry(LogEntry* entry, string* out) {
+  if (!entry->path_id) {
+    entry->path_id = (uint32_t)((log_size_ + out->size()) / 8);
+    AppendOutputRecord(entry->output, out);
+  }
+  AppendEntryRecord(*entry, out);
+}
+
+// static
+bool BuildLog::WriteBinary(FILE* f, const vector<LogEntry*>& entries) {
+  uint32_t index_size = IndexSize((uint32_t)entries.size());
+  vector<IndexSlot> index(index_size);
+  uint64_t offset = sizeof(BinaryHeader) + index_size * sizeof(IndexSlot);
+  for (vector<LogEntry*>::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    LogEntry* entry = *i;
+    entry->path_id = (uint32_t)(offset / 8);
+    offset += OutputRecordSize(entry->output.len_) + sizeof(BinaryEntry);
+    uint64_t hash = MurmurHash64A(entry->output.str_, entry->output.len_);
+    uint32_t slot = (uint32_t)hash & (index_size - 1);
+    while (index[slot].path_id)
+      slot = (slot + 1) & (index_size - 1);
+    index[slot].tag = (uint32_t)(hash >> 32);
+    index[slot].path_id = entry->path_id;
+  }
+
+  if (!WriteBinaryHeader(f, (uint32_t)entries.size(), offset) ||
+      (index_size &&
+       fwrite(&index[0], sizeof(IndexSlot), index_size, f) != index_size)) {
+    return false;
+  }
+  string records;
+  for (vector<LogEntry*>::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    records.clear();
+    AppendOutputRecord((*i)->output, &records);
+    AppendEntryRecord(**i, &records);
+    if (fwrite(records.data(), 1, records.size(), f) != records.size())
+      return false;
+  }
+  return true;
+}
+
+bool BuildLog::WriteText(FILE* f) {
+  if (fprintf(f, kFileSignature, kCurrentVersion) < 0)
+    return false;
+  const Entries& all = entries();
+  for (Entries::const_iterator i = all.begin(); i != all.end(); ++i) {
+    if (!WriteEntry(f, *i->second))
+      return false;
+  }
+  return true;
+}
+
+/// A recompaction running on a background thread.  It writes copies of the
+/// live entries to a new log while the build keeps appending to the old one.
+/// What was appended is then copied over verbatim, since later lines
+/// override earlier ones.
+struct BuildLog::Compaction {
+  string path;
+  string temp_path;
+  /// The size of the old log when the snapshot was taken.
+  long log_size;
+  vector<LogEntry> entries;
+  bool ok;
+  /// The errno of the thread's failure.
+  int error;
+  Thread thread;
+
+  static void Run(void* compaction) {
+    static_cast<Compaction*>(compaction)->Write();
+  }
+
+  void Write() {
+    FILE* f = fopen(temp_path.c_str(), "wb");
+    ok = f && fprintf(f, kFileSignature, kCurrentVersion) > 0;
+    for (vector<LogEntry>::iterator i = entries.begin();
+         ok && i != entries.end(); ++i) {
+      ok = WriteEntry(f, *i);
+    }
+    if (f)
+      ok = fclose(f) == 0 && ok;
+    error = errno;
+  }
+
+  /// Append what was written to the old log since the snapshot.
+  bool AppendTail() {
+    FILE* from = fopen(path.c_str(), "rb");
+    if (!from)
+      return false;
+    FILE* to = fopen(temp_path.c_str(), "ab");
+    bool success = to && fseek(from, log_size, SEEK_SET) == 0;
+    char buf[64 << 10];
+    size_t len;
+    while (success && (len = fread(buf, 1, sizeof(buf), from)) > 0)
+      success = fwrite(buf, 1, len, to) == len;
+    success = success && !ferror(from);
+    fclose(from);
+    if (to)
+      success = fclose(to) == 0 && success;
+    return success;
+  }
+};
+
+void BuildLog::FindDeadOutputs(const BuildLogUser& user, vector<bool>* dead) {
+  METRIC_RECORD(".ninja_log find dead outputs");
+  vector<StringPiece> outputs;
+  outputs.reserve(entries_.size());
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    outputs.push_back(i->first);
+  user.ArePathsDead(outputs, dead);
+}
+
+bool BuildLog::StartRecompaction(const string& path, const BuildLogUser& user,
+                                 long log_size) {
+  METRIC_RECORD(".ninja_log recompact start");
+  Compaction* compaction = new Compaction;
+  compaction->path = path;
+  compaction->temp_path = path + ".recompact";
+  compaction->log_size = log_size;
+  // Deciding what's dead needs the graph, which the build changes, so do
+  // it here.
+  compaction->entries.reserve(entries_.size());
+  vector<bool> dead;
+  FindDeadOutputs(user, &dead);
+  vector<StringPiece> dead_outputs;
+  size_t n = 0;
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+    if (dead[n++])
+      dead_outputs.push_back(i->first);
+    else
+      compaction->entries.push_back(*i->second);
+  }
+  if (!compaction->thread.Start(Compaction::Run, compaction)) {
+    delete compaction;
+    return false;
+  }
+  for (size_t i = 0; i < dead_outputs.size(); ++i)
+    entries_.erase(dead_outputs[i]);
+  compaction_ = compaction;
+  return true;
+}
+
+void BuildLog::FinishRecompaction() {
+  METRIC_RECORD(".ninja_log recompact finish");
+  Compaction* compaction = compaction_;
+  compaction_ = NULL;
+  compaction->thread.Join();
+
+  // Everything the build recorded is in the old log, so on failure it's
+  // simply kept.
+  if (log_file_)
+    fclose(log_file_);
+  log_file_ = NULL;
+  bool success = compaction->ok;
+  if (!success)
+    errno = compaction->error;
+  else
+    success = compaction->AppendTail();
+#ifdef _WIN32
+  // The old log can't be removed while it's mapped.
+  if (success) {
+    CopyMappedOutputs();
+    unlink(compaction->path.c_str());
+  }
+#endif
+  if (success &&
+      rename(compaction->temp_path.c_str(), compaction->path.c_str()) < 0) {
+    success = false;
+  }
+  if (!success) {
+    Warning("recompacting %s: %s; keeping the old log",
+            compaction->path.c_str(), strerror(errno));
+    unlink(compaction->temp_path.c_str());
+  }
+  delete compaction;
+}
+
+void BuildLog::ReportMemory(MemoryStats* stats) const {
+  stats->Add("build log entries", entries_.size(),
+             entries_.size() * sizeof(LogEntry));
+  size_t output_bytes = MemoryStats::VectorBytes(owned_outputs_);
+  for (vector<string*>::const_iterator i = owned_outputs_.begin();
+       i != owned_outputs_.end(); ++i) {
+    output_bytes += sizeof(string) + MemoryStats::StringBytes(**i);
+  }
+  stats->Add("build log paths", owned_outputs_.size(), output_bytes);
+  stats->Add("hash tables", 1, entries_.memory_bytes());
+  stats->Add("mapped logs", mapped_log_.data() ? 1 : 0, mapped_log_.size());
+}
+
+int BuildLog::Restat(const DiskInterface& disk_interface,
+                     const vector<string>& outputs) {
+  METRIC_RECORD(".ninja_log restat");
+  vector<LogEntry*> restatted;
+  vector<string> paths;
+  if (outputs.empty()) {
+    LoadIndexedEntries();
+    for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+      restatted.push_back(i->second);
+      paths.push_back(i->second->output.AsString());
+    }
+  } else {
+    for (vector<string>::const_iterator o = outputs.begin();
+         o != outputs.end(); ++o) {
+      if (LogEntry* entry = LookupByOutput(*o)) {
+        restatted.push_back(entry);
+        paths.push_back(*o);
+      }
+    }
+  }
+
+  vector<const string*> path_ptrs;
+  for (vector<string>::const_iterator p = paths.begin(); p != paths.end();
+       ++p) {
+    path_ptrs.push_back(&*p);
+  }
+  vector<TimeStamp> mtimes;
+  disk_interface.StatMany(path_ptrs, &mtimes);
+
+  int changed = 0;
+  for (size_t i = 0; i < restatted.size(); ++i) {
+    if (mtimes[i] <= 0 || mtimes[i] == restatted[i]->mtime)
+      continue;
+    restatted[i]->mtime = mtimes[i];
+    ++changed;
+  }
+  return changed;
 }
 
 bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
@@ -375,6 +947,7 @@ bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
   METRIC_RECORD(".ninja_log recompact");
 
   Close();
+  LoadIndexedEntries();
   string temp_path = path + ".recompact";
   FILE* f = fopen(temp_path.c_str(), "wb");
   if (!f) {
@@ -382,30 +955,43 @@ bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
     return false;
   }
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
+  if (!binary_ && fprintf(f, kFileSignature, kCurrentVersion) < 0) {
     *err = strerror(errno);
     fclose(f);
     return false;
   }
 
+  vector<bool> dead;
+  FindDeadOutputs(user, &dead);
   vector<StringPiece> dead_outputs;
+  vector<LogEntry*> live_entries;
+  size_t n = 0;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
-    if (user.IsPathDead(i->first)) {
+    if (dead[n++]) {
       dead_outputs.push_back(i->first);
       continue;
     }
 
-    if (!WriteEntry(f, *i->second)) {
+    if (binary_) {
+      live_entries.push_back(i->second);
+    } else if (!WriteEntry(f, *i->second)) {
       *err = strerror(errno);
       fclose(f);
       return false;
     }
   }
+  if (binary_ && !WriteBinary(f, live_entries)) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
+  }
 
   for (size_t i = 0; i < dead_outputs.size(); ++i)
     entries_.erase(dead_outputs[i]);
 
   fclose(f);
+  // The old log can't be removed while it's mapped on Windows.
+  CopyMappedOutputs();
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
@@ -16,20 +16,31 @@
 #define NINJA_BUILD_LOG_H_
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 using namespace std;
 
 #include "hash_map.h"
+#include "log_writer.h"
+#include "resource_usage.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
+struct DiskInterface;
 struct Edge;
+struct MemoryStats;
 
 /// Can answer questions about the manifest for the BuildLog.
 struct BuildLogUser {
   /// Return if a given output is no longer part of the build manifest.
   /// This is only called during recompaction and doesn't have to be fast.
   virtual bool IsPathDead(StringPiece s) const = 0;
+
+  /// Set (*dead)[i] to IsPathDead(paths[i]) for each of |paths|, which a
+  /// recompaction asks about all at once.  The default asks about each in
+  /// turn; a user that checks the disk can batch the stat() calls.
+  virtual void ArePathsDead(const vector<StringPiece>& paths,
+                            vector<bool>* dead) const;
 };
 
 /// Store a log of every command ran for every build.
@@ -39,24 +50,62 @@ struct BuildLogUser {
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+/// 4) CPU time and peak memory of the commands, for scheduling decisions
+/// 5) hashes of the contents of the outputs of "restat = content" rules
+///
+/// The log is text by default.  A binary log has fixed-size records and an
+/// index of the outputs that lookups use in place, through the mapping, so
+/// that loading it only reads what was appended since it was last
+/// recompacted.
 struct BuildLog {
   BuildLog();
   ~BuildLog();
 
+  /// Open |path| for appending entries.  If Load() found that the log needs
+  /// recompaction, the live entries are written to a new log on a
+  /// background thread in the meantime, and Close() swaps it in.
   bool OpenForWrite(const string& path, const BuildLogUser& user, string* err);
+  /// |content_hashes|, if given, holds the hash of each output of |edge|,
+  /// as DiskInterface::HashFiles() gives it.
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0,
+                     const ResourceUsage& usage = ResourceUsage(),
+                     const vector<uint64_t>* content_hashes = NULL);
+  /// Close the log, committing what was recorded.  A background
+  /// recompaction is waited for, completed with the entries appended since
+  /// it started, and atomically renamed over the log; if that fails, the
+  /// old log is kept.
   void Close();
 
-  /// Load the on-disk log.
+  /// How OpenForWrite() has RecordCommand() commit entries to disk.
+  void set_commit_policy(const LogCommitPolicy& policy) {
+    commit_policy_ = policy;
+  }
+
+  /// Whether OpenForWrite() starts a new log in the binary format, and
+  /// converts a text one to it.  A log that is binary already stays so
+  /// regardless, since Load() sets this.
+  void set_binary(bool binary) { binary_ = binary; }
+  bool binary() const { return binary_; }
+
+  /// Load the on-disk log.  The log stays mapped into memory, and the
+  /// outputs of the entries point into it.  The entries of a binary log
+  /// that are indexed are only read when looked up.
   bool Load(const string& path, string* err);
 
   struct LogEntry {
-    string output;
+    /// Points into the mapped log, or into a copy that the BuildLog owns.
+    StringPiece output;
     uint64_t command_hash;
     int start_time;
     int end_time;
     TimeStamp mtime;
+    ResourceUsage usage;
+    /// The hash of the contents of the output, or 0 if it wasn't hashed.
+    uint64_t content_hash;
+    /// Where a binary log has a record of the output, in units of 8 bytes,
+    /// or 0 if it has none yet.
+    uint32_t path_id;
 
     static uint64_t HashCommand(StringPiece command);
 
@@ -64,30 +113,102 @@ struct BuildLog {
     bool operator==(const LogEntry& o) {
       return output == o.output && command_hash == o.command_hash &&
           start_time == o.start_time && end_time == o.end_time &&
-          mtime == o.mtime;
+          mtime == o.mtime && usage.user_time_ms == o.usage.user_time_ms &&
+          usage.system_time_ms == o.usage.system_time_ms &&
+          usage.max_rss_kb == o.usage.max_rss_kb &&
+          content_hash == o.content_hash;
     }
 
-    explicit LogEntry(const string& output);
-    LogEntry(const string& output, uint64_t command_hash,
+    explicit LogEntry(StringPiece output);
+    LogEntry(StringPiece output, uint64_t command_hash,
              int start_time, int end_time, TimeStamp restat_mtime);
   };
 
   /// Lookup a previously-run command by its output path.
-  LogEntry* LookupByOutput(const string& path);
+  LogEntry* LookupByOutput(StringPiece path);
 
   /// Serialize an entry into a log file.
-  bool WriteEntry(FILE* f, const LogEntry& entry);
+  static bool WriteEntry(FILE* f, const LogEntry& entry);
+  /// Serialize an entry at the end of |out|.
+  static void FormatEntry(const LogEntry& entry, string* out);
+  /// Write all the entries to |f| as a text log, for '-t buildlog'.
+  bool WriteText(FILE* f);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const string& path, const BuildLogUser& user, string* err);
 
+  /// Set the mtime of the entries of |outputs|, or of all of them if it is
+  /// empty, to the one their output has on disk, stat()ing them all in one
+  /// batch.  Entries whose output is missing keep theirs.  Returns the
+  /// number of entries changed; Recompact() then writes them out.
+  int Restat(const DiskInterface& disk_interface,
+             const vector<string>& outputs);
+
+  /// Count the memory of the entries in |stats|, for '-d memstats'.
+  void ReportMemory(MemoryStats* stats) const;
+
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
-  const Entries& entries() const { return entries_; }
+  /// All the entries, including those of a binary log that nothing looked
+  /// up yet.
+  const Entries& entries() {
+    LoadIndexedEntries();
+    return entries_;
+  }
 
  private:
+  /// Copy the outputs that point into |mapped_log_|, so that it can be
+  /// unmapped.
+  void CopyMappedOutputs();
+
+  /// Load() for a binary log: read the records after the indexed ones.
+  bool LoadBinary(const string& path, string* err);
+  /// Look |path| up in the index of |mapped_log_|, adding its entry to
+  /// entries_ if it has one.
+  LogEntry* LookupInIndex(StringPiece path);
+  /// Add the indexed entries that no lookup added yet to entries_, after
+  /// which the index isn't used anymore.
+  void LoadIndexedEntries();
+  /// Serialize an entry as binary records at the end of |out|, which will
+  /// be appended to the log at |log_size_|.  The output gets a record of
+  /// its own first if it has no path id yet.
+  void FormatBinaryEntry(LogEntry* entry, string* out);
+  /// Write |entries| to |f| as an indexed binary log.
+  static bool WriteBinary(FILE* f, const vector<LogEntry*>& entries);
+
+  /// Ask |user| which of the outputs of entries_ are dead, in the order
+  /// of entries_.
+  void FindDeadOutputs(const BuildLogUser& user, vector<bool>* dead);
+
+  struct Compaction;
+  /// Snapshot the live entries and start writing them out on a thread, with
+  /// the old log being |log_size| bytes.  Returns false if no thread could
+  /// be started.
+  bool StartRecompaction(const string& path, const BuildLogUser& user,
+                         long log_size);
+  void FinishRecompaction();
+
   Entries entries_;
   FILE* log_file_;
+  LogCommitPolicy commit_policy_;
+  /// Appends the entries that RecordCommand() formats to |log_file_|.
+  LogWriter writer_;
   bool needs_recompaction_;
+  /// The recompaction running in the background, if any.
+  Compaction* compaction_;
+  /// The log that Load() read.
+  MappedFile mapped_log_;
+  /// The outputs that entries_ point to when they aren't in |mapped_log_|.
+  vector<string*> owned_outputs_;
+
+  bool binary_;
+  /// The slots of the index of |mapped_log_| if it is binary and has
+  /// entries that aren't in entries_ yet, or NULL.
+  const char* index_;
+  uint32_t index_size_;
+  /// Where the records that the index covers end in |mapped_log_|.
+  size_t indexed_end_;
+  /// Where the next binary record will be in the log open for writing.
+  uint64_t log_size_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
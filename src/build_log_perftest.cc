@@ -12,8 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "build_log.h"
 #include "graph.h"
@@ -95,6 +97,30 @@ bool WriteTestData(string* err) {
                       /*mtime=*/0);
   }
 
+  // Logs that haven't been recompacted for a while hold many runs of the
+  // same commands.  Append more runs, for 1.2M lines in total.
+  log.Close();
+  FILE* log_file = fopen(kTestFilename, "ab");
+  if (!log_file) {
+    *err = strerror(errno);
+    return false;
+  }
+  const int kNumRuns = 40;
+  for (int run = 1; run < kNumRuns; ++run) {
+    for (int i = 0; i < kNumCommands; ++i) {
+      BuildLog::LogEntry* entry =
+          log.LookupByOutput(state.edges_[i]->outputs_[0]->path());
+      entry->start_time += 1000 * kNumCommands;
+      entry->end_time += 1000 * kNumCommands;
+      if (!log.WriteEntry(log_file, *entry)) {
+        *err = strerror(errno);
+        fclose(log_file);
+        return false;
+      }
+    }
+  }
+  fclose(log_file);
+
   return true;
 }
 
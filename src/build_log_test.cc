@@ -66,7 +66,117 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(e2);
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
-  ASSERT_EQ("out", e1->output);
+  ASSERT_EQ("out", e1->output.AsString());
+}
+
+TEST_F(BuildLogTest, GroupCommit) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  LogCommitPolicy policy;
+  policy.max_records = 1000;
+  policy.max_delay_ms = 10;
+  policy.sync = true;
+  log1.set_commit_policy(policy);
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[0], 15, 18));
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[1], 20, 25));
+
+  // The entries are committed soon enough, without waiting for more.
+  bool committed = false;
+  for (int i = 0; i < 500 && !committed; ++i) {
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    committed = log2.entries().size() == 2u;
+#ifdef _WIN32
+    Sleep(10);
+#else
+    usleep(10 * 1000);
+#endif
+  }
+  EXPECT_TRUE(committed);
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[0], 30, 35));
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log2.entries().size());
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(30, e->start_time);
+  e = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(20, e->start_time);
+}
+
+TEST_F(BuildLogTest, WriteReadResourceUsage) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  ResourceUsage usage;
+  usage.user_time_ms = 1200;
+  usage.system_time_ms = 34;
+  usage.max_rss_kb = 567890;
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, usage);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_TRUE(*e == *log1.LookupByOutput("out"));
+  ASSERT_EQ(1200, e->usage.user_time_ms);
+  ASSERT_EQ(34, e->usage.system_time_ms);
+  ASSERT_EQ(567890, e->usage.max_rss_kb);
+
+  e = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(0, e->usage.max_rss_kb);
+}
+
+TEST_F(BuildLogTest, WriteReadContentHash) {
+  AssertParse(&state_,
+"build out1 out2: cat in\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  vector<uint64_t> hashes;
+  hashes.push_back(0x123456789abcdef0ULL);
+  hashes.push_back(0);  // Not hashed.
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, ResourceUsage(), &hashes);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  BuildLog::LogEntry* e = log2.LookupByOutput("out1");
+  ASSERT_TRUE(e);
+  ASSERT_TRUE(*e == *log1.LookupByOutput("out1"));
+  ASSERT_EQ(0x123456789abcdef0ULL, e->content_hash);
+  e = log2.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(0u, e->content_hash);
+  e = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(0u, e->content_hash);
 }
 
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
@@ -185,6 +295,26 @@ TEST_F(BuildLogTest, SpacesInOutputV4) {
   ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
 }
 
+TEST_F(BuildLogTest, UpgradeV5) {
+  // Version 5 logs have no resource usage after the hash.
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  fprintf(f, "123\t456\t456\tout\t1234abcd\n");
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_EQ(0x1234abcdu, e->command_hash);
+  ASSERT_EQ(0, e->usage.user_time_ms);
+  ASSERT_EQ(0, e->usage.max_rss_kb);
+}
+
 TEST_F(BuildLogTest, DuplicateVersionHeader) {
   // Old versions of ninja accidentally wrote multiple version headers to the
   // build log on Windows. This shouldn't crash, and the second version header
@@ -217,8 +347,8 @@ TEST_F(BuildLogTest, DuplicateVersionHeader) {
 }
 
 TEST_F(BuildLogTest, VeryLongInputLine) {
-  // Ninja's build log buffer is currently 256kB. Lines longer than that are
-  // silently ignored, but don't affect parsing of other lines.
+  // The log is read in place, so lines longer than any buffer (ninja used to
+  // read 256kB at a time and skip longer lines) load like the others.
   FILE* f = fopen(kTestFilename, "wb");
   fprintf(f, "# ninja log v4\n");
   fprintf(f, "123\t456\t456\tout\tcommand start");
@@ -234,7 +364,9 @@ TEST_F(BuildLogTest, VeryLongInputLine) {
   ASSERT_EQ("", err);
 
   BuildLog::LogEntry* e = log.LookupByOutput("out");
-  ASSERT_EQ(NULL, e);
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(456, e->end_time);
 
   e = log.LookupByOutput("out2");
   ASSERT_TRUE(e);
@@ -256,14 +388,189 @@ TEST_F(BuildLogTest, MultiTargetEdge) {
   ASSERT_TRUE(e1);
   BuildLog::LogEntry* e2 = log.LookupByOutput("out.d");
   ASSERT_TRUE(e2);
-  ASSERT_EQ("out", e1->output);
-  ASSERT_EQ("out.d", e2->output);
+  ASSERT_EQ("out", e1->output.AsString());
+  ASSERT_EQ("out.d", e2->output.AsString());
   ASSERT_EQ(21, e1->start_time);
   ASSERT_EQ(21, e2->start_time);
   ASSERT_EQ(22, e2->end_time);
   ASSERT_EQ(22, e2->end_time);
 }
 
+TEST_F(BuildLogTest, Restat) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build missing: cat in\n");
+
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.RecordCommand(state_.edges_[0], 15, 18, 1);
+  log.RecordCommand(state_.edges_[1], 15, 18, 1);
+  log.RecordCommand(state_.edges_[2], 15, 18, 1);
+  log.Close();
+
+  VirtualFileSystem fs;
+  fs.Tick();
+  fs.Create("out", "");
+  fs.Create("out2", "");
+
+  // Only the output asked for.
+  vector<string> outputs(1, "out");
+  ASSERT_EQ(1, log.Restat(fs, outputs));
+  ASSERT_EQ(2, log.LookupByOutput("out")->mtime);
+  ASSERT_EQ(1, log.LookupByOutput("out2")->mtime);
+
+  // All of them, leaving alone those up to date or missing.
+  ASSERT_EQ(1, log.Restat(fs, vector<string>()));
+  ASSERT_EQ(2, log.LookupByOutput("out2")->mtime);
+  ASSERT_EQ(1, log.LookupByOutput("missing")->mtime);
+
+  EXPECT_TRUE(log.Recompact(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2, log2.LookupByOutput("out")->mtime);
+  ASSERT_EQ(2, log2.LookupByOutput("out2")->mtime);
+  ASSERT_EQ(1, log2.LookupByOutput("missing")->mtime);
+}
+
+TEST_F(BuildLogTest, BinaryWriteRead) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid out2: cat in\n");
+
+  BuildLog log1;
+  log1.set_binary(true);
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  ResourceUsage usage;
+  usage.user_time_ms = 7;
+  vector<uint64_t> hashes(2, 0x1234);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 20, 25, 3, usage, &hashes);
+  log1.RecordCommand(state_.edges_[0], 30, 31);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.binary());
+  ASSERT_EQ(3u, log2.entries().size());
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(31, e->end_time);
+  e = log2.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_TRUE(*e == *log1.LookupByOutput("out2"));
+  ASSERT_EQ(7, e->usage.user_time_ms);
+  ASSERT_EQ(0x1234u, e->content_hash);
+}
+
+TEST_F(BuildLogTest, BinaryIndex) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build out3: cat in\n");
+
+  BuildLog log1;
+  log1.set_binary(true);
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 21, 22);
+  log1.Close();
+  EXPECT_TRUE(log1.Recompact(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+
+  // Append to the indexed log.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, *this, &err));
+  log2.RecordCommand(state_.edges_[1], 30, 31);
+  log2.RecordCommand(state_.edges_[2], 40, 41);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(18, e->end_time);
+  e = log3.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(31, e->end_time);
+  ASSERT_FALSE(log3.LookupByOutput("missing"));
+  ASSERT_EQ(3u, log3.entries().size());
+  ASSERT_EQ(31, log3.LookupByOutput("out2")->end_time);
+}
+
+TEST_F(BuildLogTest, ConvertToBinary) {
+  AssertParse(&state_,
+"build out: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.Close();
+
+  BuildLog log2;
+  log2.set_binary(true);
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log3.binary());
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(18, e->end_time);
+}
+
+TEST_F(BuildLogTest, BinaryTruncate) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n");
+
+  BuildLog log1;
+  log1.set_binary(true);
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 21, 22);
+  log1.Close();
+
+  // A crash cut the last record short; the next write goes after the
+  // first one.
+  struct stat statbuf;
+  ASSERT_EQ(0, stat(kTestFilename, &statbuf));
+  ASSERT_TRUE(Truncate(kTestFilename, statbuf.st_size - 5, &err));
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(log2.LookupByOutput("out"));
+  ASSERT_FALSE(log2.LookupByOutput("out2"));
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, *this, &err));
+  log2.RecordCommand(state_.edges_[1], 30, 31);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(18, log3.LookupByOutput("out")->end_time);
+  ASSERT_EQ(31, log3.LookupByOutput("out2")->end_time);
+}
+
 struct BuildLogRecompactTest : public BuildLogTest {
   virtual bool IsPathDead(StringPiece s) const { return s == "out2"; }
 };
@@ -304,4 +611,83 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   ASSERT_FALSE(log2.LookupByOutput("out2"));
 }
 
+/// A user that only answers for all the outputs at once.
+struct BatchedDeadUser : public BuildLogUser {
+  BatchedDeadUser() : batches(0), single(0) {}
+  virtual bool IsPathDead(StringPiece s) const {
+    ++single;
+    return false;
+  }
+  virtual void ArePathsDead(const vector<StringPiece>& paths,
+                            vector<bool>* dead) const {
+    ++batches;
+    dead->resize(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+      (*dead)[i] = paths[i] != "out";
+  }
+  mutable int batches;
+  mutable int single;
+};
+
+TEST_F(BuildLogTest, RecompactAsksInOneBatch) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build out3: cat in\n");
+
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  for (size_t i = 0; i < state_.edges_.size(); ++i)
+    log.RecordCommand(state_.edges_[i], 15, 18);
+  log.Close();
+
+  BatchedDeadUser user;
+  EXPECT_TRUE(log.Recompact(kTestFilename, user, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1, user.batches);
+  EXPECT_EQ(0, user.single);
+  ASSERT_EQ(1u, log.entries().size());
+  EXPECT_TRUE(log.LookupByOutput("out"));
+}
+
+TEST_F(BuildLogRecompactTest, RecordDuringRecompaction) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build out3: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  for (int i = 0; i < 200; ++i)
+    log1.RecordCommand(state_.edges_[0], 15, 18 + i);
+  log1.RecordCommand(state_.edges_[1], 21, 22);
+  log1.Close();
+
+  // Record while the log is being recompacted.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log2.RecordCommand(state_.edges_[0], 30, 31);
+  log2.RecordCommand(state_.edges_[2], 40, 41);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log3.entries().size());
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(31, e->end_time);
+  e = log3.LookupByOutput("out3");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(41, e->end_time);
+  ASSERT_FALSE(log3.LookupByOutput("out2"));
+}
+
 }  // anonymous namespace
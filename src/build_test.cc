@@ -17,8 +17,11 @@
 #include <assert.h>
 
 #include "build_log.h"
+#include "content_hash.h"
+#include "debug_flags.h"
 #include "deps_log.h"
 #include "graph.h"
+#include "shared_pool.h"
 #include "test.h"
 
 /// Fixture for tests involving Plan.
@@ -33,7 +36,8 @@ struct PlanTest : public StateTestWithBuiltinRules {
   void FindWorkSorted(deque<Edge*>* ret, int count) {
     struct CompareEdgesByOutput {
       static bool cmp(const Edge* a, const Edge* b) {
-        return a->outputs_[0]->path() < b->outputs_[0]->path();
+        return a->outputs_[0]->path().AsString() <
+               b->outputs_[0]->path().AsString();
       }
     };
 
@@ -59,6 +63,7 @@ TEST_F(PlanTest, Basic) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -68,20 +73,55 @@ TEST_F(PlanTest, Basic) {
 
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
   ASSERT_EQ("mid", edge->inputs_[0]->path());
   ASSERT_EQ("out", edge->outputs_[0]->path());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   ASSERT_FALSE(plan_.more_to_do());
   edge = plan_.FindWork();
   ASSERT_EQ(0, edge);
 }
 
+// Edges are reported as they become ready, for the builder to read their
+// inputs ahead.
+TEST_F(PlanTest, ReportsScheduledEdges) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid1 mid2\n"
+"build mid1: cat in\n"
+"build mid2: cat in\n"));
+  GetNode("mid1")->MarkDirty();
+  GetNode("mid2")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  vector<Edge*> scheduled;
+  plan_.set_scheduled(&scheduled);
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+  ASSERT_EQ(2u, scheduled.size());
+  scheduled.clear();
+
+  Edge* edge = plan_.FindWork();
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(scheduled.empty());
+
+  edge = plan_.FindWork();
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, scheduled.size());
+  EXPECT_EQ("out", scheduled[0]->outputs_[0]->path());
+}
+
 // Test that two outputs from one rule can be handled as inputs to the next.
 TEST_F(PlanTest, DoubleOutputDirect) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -94,16 +134,19 @@ TEST_F(PlanTest, DoubleOutputDirect) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat in
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat mid1 mid2
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_FALSE(edge);  // done
@@ -124,24 +167,29 @@ TEST_F(PlanTest, DoubleOutputIndirect) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat in
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat a1
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat a2
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat b1 b2
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_FALSE(edge);  // done
@@ -162,24 +210,29 @@ TEST_F(PlanTest, DoubleDependent) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat in
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat mid
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat mid
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);  // cat a1 a2
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_FALSE(edge);  // done
@@ -194,6 +247,7 @@ void PlanTest::TestPoolWithDepthOne(const char* test_case) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -204,7 +258,9 @@ void PlanTest::TestPoolWithDepthOne(const char* test_case) {
   // This will be false since poolcat is serialized
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
@@ -213,7 +269,9 @@ void PlanTest::TestPoolWithDepthOne(const char* test_case) {
 
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   ASSERT_FALSE(plan_.more_to_do());
   edge = plan_.FindWork();
@@ -231,6 +289,55 @@ TEST_F(PlanTest, PoolWithDepthOne) {
 "build out2: poolcat in\n");
 }
 
+#ifndef _WIN32
+TEST_F(PlanTest, SharedPool) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("PlanTest-SharedPool");
+  setenv("NINJA_SHARED_POOL_DIR", ".", 1);
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool link\n"
+"  depth = 1\n"
+"  shared = 1\n"
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"build out1: link in\n"
+"build out2: link in\n"
+"build all: phony out1 out2\n"));
+  unsetenv("NINJA_SHARED_POOL_DIR");
+  GetNode("out1")->MarkDirty();
+  GetNode("out2")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  // Another ninja process runs a link.
+  SharedPoolSlots other(".", "link", 1);
+  ASSERT_TRUE(other.Acquire(1));
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+  EXPECT_FALSE(plan_.FindWork());
+  EXPECT_TRUE(plan_.WaitsForSharedPools());
+  plan_.RetrySharedPools();
+  EXPECT_FALSE(plan_.FindWork());
+
+  other.ReleaseAll();
+  plan_.RetrySharedPools();
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_FALSE(plan_.FindWork());
+  // Now this process has the slot.
+  EXPECT_FALSE(other.Acquire(1));
+
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(plan_.FindWork());
+  EXPECT_FALSE(plan_.WaitsForSharedPools());
+  temp_dir.Cleanup();
+}
+#endif
+
 TEST_F(PlanTest, ConsolePool) {
   TestPoolWithDepthOne(
 "rule poolcat\n"
@@ -271,6 +378,7 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("allTheThings"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
 
   deque<Edge*> edges;
   FindWorkSorted(&edges, 5);
@@ -289,7 +397,8 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
   ASSERT_EQ("outb3", edge->outputs_[0]->path());
 
   // finish out1
-  plan_.EdgeFinished(edges.front(), Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edges.front(), Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
   edges.pop_front();
 
   // out3 should be available
@@ -300,24 +409,80 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
 
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(out3, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(out3, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   ASSERT_FALSE(plan_.FindWork());
 
   for (deque<Edge*>::iterator it = edges.begin(); it != edges.end(); ++it) {
-    plan_.EdgeFinished(*it, Plan::kEdgeSucceeded);
+    plan_.EdgeFinished(*it, Plan::kEdgeSucceeded, &err);
+    ASSERT_EQ("", err);
   }
 
   Edge* last = plan_.FindWork();
   ASSERT_TRUE(last);
   ASSERT_EQ("allTheThings", last->outputs_[0]->path());
 
-  plan_.EdgeFinished(last, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(last, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
 
   ASSERT_FALSE(plan_.more_to_do());
   ASSERT_FALSE(plan_.FindWork());
 }
 
+TEST_F(PlanTest, PoolWithWeights) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool foobar\n"
+"  depth = 3\n"
+"rule poolcat\n"
+"  command = cat $in > $out\n"
+"  pool = foobar\n"
+"build heavy: poolcat in\n"
+"  weight = 2\n"
+"build light1: poolcat in\n"
+"build light2: poolcat in\n"
+"build all: cat heavy light1 light2\n"));
+  GetNode("heavy")->MarkDirty();
+  GetNode("light1")->MarkDirty();
+  GetNode("light2")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+
+  // The heavy edge takes two of the three slots, which leaves room for
+  // only one of the light ones.
+  deque<Edge*> edges;
+  FindWorkSorted(&edges, 2);
+  ASSERT_EQ("heavy", edges[0]->outputs_[0]->path());
+  ASSERT_EQ(2, edges[0]->weight());
+  ASSERT_EQ("light1", edges[1]->outputs_[0]->path());
+
+  plan_.EdgeFinished(edges[1], Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("light2", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+
+  ASSERT_EQ("", err);
+  plan_.EdgeFinished(edges[0], Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("all", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
 TEST_F(PlanTest, PoolWithRedundantEdges) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
     "pool compile\n"
@@ -345,6 +510,7 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = NULL;
@@ -354,7 +520,8 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
 
   edge = initial_edges[1];  // Foo first
   ASSERT_EQ("foo.cpp", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
@@ -362,11 +529,13 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   ASSERT_EQ("foo.cpp", edge->inputs_[0]->path());
   ASSERT_EQ("foo.cpp", edge->inputs_[1]->path());
   ASSERT_EQ("foo.cpp.obj", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = initial_edges[0];  // Now for bar
   ASSERT_EQ("bar.cpp", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
@@ -374,7 +543,8 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   ASSERT_EQ("bar.cpp", edge->inputs_[0]->path());
   ASSERT_EQ("bar.cpp", edge->inputs_[1]->path());
   ASSERT_EQ("bar.cpp.obj", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
@@ -382,14 +552,16 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   ASSERT_EQ("foo.cpp.obj", edge->inputs_[0]->path());
   ASSERT_EQ("bar.cpp.obj", edge->inputs_[1]->path());
   ASSERT_EQ("libfoo.a", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
   ASSERT_FALSE(plan_.FindWork());
   ASSERT_EQ("libfoo.a", edge->inputs_[0]->path());
   ASSERT_EQ("all", edge->outputs_[0]->path());
-  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_FALSE(edge);
@@ -412,6 +584,7 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -422,7 +595,9 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   // This will be false since poolcat is serialized
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeFailed);
+  plan_.EdgeFinished(edge, Plan::kEdgeFailed, &err);
+
+  ASSERT_EQ("", err);
 
   edge = plan_.FindWork();
   ASSERT_TRUE(edge);
@@ -431,20 +606,202 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
 
   ASSERT_FALSE(plan_.FindWork());
 
-  plan_.EdgeFinished(edge, Plan::kEdgeFailed);
+  plan_.EdgeFinished(edge, Plan::kEdgeFailed, &err);
+
+  ASSERT_EQ("", err);
 
   ASSERT_TRUE(plan_.more_to_do()); // Jobs have failed
   edge = plan_.FindWork();
   ASSERT_EQ(0, edge);
 }
 
+TEST_F(PlanTest, CriticalPathFromBuildLog) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build short: cat in\n"
+"build long: cat in\n"
+"build chain1: cat in\n"
+"build chain2: cat chain1\n"
+"build all: phony short long chain2\n"));
+  GetNode("short")->MarkDirty();
+  GetNode("long")->MarkDirty();
+  GetNode("chain1")->MarkDirty();
+  GetNode("chain2")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  BuildLog log;
+  log.RecordCommand(GetNode("short")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("long")->in_edge(), 0, 500);
+  log.RecordCommand(GetNode("chain1")->in_edge(), 0, 300);
+  log.RecordCommand(GetNode("chain2")->in_edge(), 0, 300);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log);
+
+  EXPECT_EQ(600, GetNode("chain1")->in_edge()->critical_path_weight());
+  EXPECT_EQ(500, GetNode("long")->in_edge()->critical_path_weight());
+  EXPECT_EQ(10, GetNode("short")->in_edge()->critical_path_weight());
+
+  // The head of the longest chain runs first, even though it comes later in
+  // the manifest.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("chain1", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("long", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("short", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+// Chains far longer than a thread's stack would allow recursing through.
+TEST_F(PlanTest, CriticalPathOfDeepChain) {
+  const int kDepth = 200000;
+  string manifest;
+  char line[64];
+  for (int i = 0; i < kDepth; ++i) {
+    snprintf(line, sizeof(line), "build n%d: cat n%d\n", i, i + 1);
+    manifest += line;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  for (int i = 0; i < kDepth; ++i) {
+    snprintf(line, sizeof(line), "n%d", i);
+    GetNode(line)->MarkDirty();
+  }
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("n0"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+
+  // Each edge that never ran is taken to take 1ms, and the one furthest
+  // from the target heads the longest chain.
+  EXPECT_EQ(1, GetNode("n0")->in_edge()->critical_path_weight());
+  snprintf(line, sizeof(line), "n%d", kDepth - 1);
+  EXPECT_EQ(kDepth, GetNode(line)->in_edge()->critical_path_weight());
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ(line, edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, CriticalPathDefaultsToAverageDuration) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in\n"
+"build b: cat in\n"
+"build c: cat in\n"
+"build all: phony a b c\n"));
+  GetNode("a")->MarkDirty();
+  GetNode("b")->MarkDirty();
+  GetNode("c")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  // Only "b" and "c" ran before; "a" gets their average duration.
+  BuildLog log;
+  log.RecordCommand(GetNode("b")->in_edge(), 0, 100);
+  log.RecordCommand(GetNode("c")->in_edge(), 0, 300);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log);
+
+  EXPECT_EQ(200, GetNode("a")->in_edge()->critical_path_weight());
+  EXPECT_EQ(0, GetNode("all")->in_edge()->critical_path_weight());
+  EXPECT_EQ(600, plan_.remaining_work());
+
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("c", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, PriorityBeforeCriticalPath) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build docs: cat in\n"
+"build test.o: cat in\n"
+"build test: cat test.o\n"
+"  priority = 1\n"
+"build all: phony docs test\n"));
+  GetNode("docs")->MarkDirty();
+  GetNode("test.o")->MarkDirty();
+  GetNode("test")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  BuildLog log;
+  log.RecordCommand(GetNode("docs")->in_edge(), 0, 500);
+  log.RecordCommand(GetNode("test.o")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("test")->in_edge(), 0, 10);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log);
+
+  // What the edge with a priority needs gets its priority too.
+  EXPECT_EQ(1, GetNode("test.o")->in_edge()->scheduling_priority());
+  EXPECT_EQ(0, GetNode("test.o")->in_edge()->priority());
+  EXPECT_EQ(0, GetNode("docs")->in_edge()->scheduling_priority());
+
+  // The longer critical path of "docs" comes second.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("test.o", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("docs", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, PriorityInPool) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool foobar\n"
+"  depth = 1\n"
+"rule poolcat\n"
+"  command = cat $in > $out\n"
+"  pool = foobar\n"
+"build low: poolcat in\n"
+"  priority = -1\n"
+"build mid: poolcat in\n"
+"build high: poolcat in\n"
+"  priority = 2\n"
+"build all: phony low mid high\n"));
+  GetNode("low")->MarkDirty();
+  GetNode("mid")->MarkDirty();
+  GetNode("high")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+
+  // The pool lets its delayed edges out by priority, one at a time.
+  const char* expected[] = { "high", "mid", "low" };
+  for (int i = 0; i < 3; ++i) {
+    Edge* edge = plan_.FindWork();
+    ASSERT_TRUE(edge);
+    EXPECT_EQ(expected[i], edge->outputs_[0]->path());
+    ASSERT_FALSE(plan_.FindWork());
+    plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+    ASSERT_EQ("", err);
+  }
+}
+
 /// Fake implementation of CommandRunner, useful for tests.
 struct FakeCommandRunner : public CommandRunner {
   explicit FakeCommandRunner(VirtualFileSystem* fs) :
       last_command_(NULL), fs_(fs) {}
 
   // CommandRunner impl
-  virtual bool CanRunMore();
+  virtual bool CanRunMore(const Edge* edge);
   virtual bool StartCommand(Edge* edge);
   virtual bool WaitForCommand(Result* result);
   virtual vector<Edge*> GetActiveEdges();
@@ -542,7 +899,7 @@ void BuildTest::RebuildTarget(const string& target, const char* manifest,
   builder.command_runner_.release();
 }
 
-bool FakeCommandRunner::CanRunMore() {
+bool FakeCommandRunner::CanRunMore(const Edge* edge) {
   // Only run one at a time.
   return last_command_ == NULL;
 }
@@ -559,8 +916,16 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
       edge->rule().name() == "touch-fail-tick2") {
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      fs_->Create((*out)->path(), "");
+      fs_->Create((*out)->path().AsString(), "");
     }
+  } else if (edge->rule().name() == "cp") {
+    assert(!edge->inputs_.empty());
+    assert(edge->outputs_.size() == 1);
+    string content;
+    string err;
+    if (fs_->ReadFile(edge->inputs_[0]->path().AsString(), &content, &err) ==
+        DiskInterface::Okay)
+      fs_->WriteFile(edge->outputs_[0]->path().AsString(), content);
   } else if (edge->rule().name() == "true" ||
              edge->rule().name() == "fail" ||
              edge->rule().name() == "interrupt" ||
@@ -875,7 +1240,7 @@ TEST_F(BuildTest, EncounterReadyTwice) {
 "build b: touch || c\n"
 "build a: touch | b || c\n"));
 
-  vector<Edge*> c_out = GetNode("c")->out_edges();
+  EdgeSpan c_out = GetNode("c")->out_edges();
   ASSERT_EQ(2u, c_out.size());
   EXPECT_EQ("b", c_out[0]->outputs_[0]->path());
   EXPECT_EQ("a", c_out[1]->outputs_[0]->path());
@@ -1296,6 +1661,208 @@ TEST_F(BuildWithLogTest, RebuildWithNoInputs) {
   EXPECT_EQ(1u, command_runner_.commands_ran_.size());
 }
 
+/// Runs two commands at once, finishing the last one started first.
+struct TwoSlotCommandRunner : public CommandRunner {
+  explicit TwoSlotCommandRunner(VirtualFileSystem* fs) : fs_(fs) {}
+
+  virtual bool CanRunMore(const Edge* edge) { return running_.size() < 2; }
+  virtual bool StartCommand(Edge* edge) {
+    started_.push_back(edge->outputs_[0]->path().AsString());
+    if (edge->rule().name() != "true")
+      fs_->Create(edge->outputs_[0]->path().AsString(), "");
+    running_.push_back(edge);
+    return true;
+  }
+  virtual bool WaitForCommand(Result* result) {
+    if (running_.empty())
+      return false;
+    result->edge = running_.back();
+    running_.pop_back();
+    return true;
+  }
+  virtual vector<Edge*> GetActiveEdges() { return running_; }
+  virtual void Abort() { running_.clear(); }
+
+  VirtualFileSystem* fs_;
+  vector<Edge*> running_;
+  vector<string> started_;
+};
+
+/// Runs commands up to a total weight of |parallelism| at once, finishing
+/// the oldest first.
+struct WeightedCommandRunner : public CommandRunner {
+  WeightedCommandRunner(VirtualFileSystem* fs, int parallelism)
+      : fs_(fs), parallelism_(parallelism), running_weight_(0) {}
+
+  virtual bool CanRunMore(const Edge* edge) {
+    return running_weight_ == 0 ||
+        running_weight_ + edge->weight() <= parallelism_;
+  }
+  virtual bool StartCommand(Edge* edge) {
+    string path = edge->outputs_[0]->path().AsString();
+    started_.push_back(path);
+    running_at_start_.push_back(running_.size());
+    fs_->Create(path, "");
+    running_.push_back(edge);
+    running_weight_ += edge->weight();
+    return true;
+  }
+  virtual bool WaitForCommand(Result* result) {
+    if (running_.empty())
+      return false;
+    result->edge = running_.front();
+    running_.erase(running_.begin());
+    running_weight_ -= result->edge->weight();
+    return true;
+  }
+  virtual vector<Edge*> GetActiveEdges() { return running_; }
+  virtual void Abort() { running_.clear(); }
+
+  VirtualFileSystem* fs_;
+  int parallelism_;
+  int running_weight_;
+  vector<Edge*> running_;
+  vector<string> started_;
+  /// How many commands were running as each one started.
+  vector<size_t> running_at_start_;
+};
+
+// An edge waiting for enough of -j to free up holds back the lighter
+// edges behind it, which would otherwise take the slots as they free up.
+TEST_F(BuildTest, HeavyEdgeHoldsBackLighterOnes) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build first: cat in1\n"
+"  priority = 2\n"
+"build heavy: cat in1\n"
+"  priority = 1\n"
+"  weight = 4\n"
+"build light1: cat in1\n"
+"build light2: cat in1\n"));
+  WeightedCommandRunner runner(&fs_, 4);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("first", &err));
+  EXPECT_TRUE(builder_.AddTarget("heavy", &err));
+  EXPECT_TRUE(builder_.AddTarget("light1", &err));
+  EXPECT_TRUE(builder_.AddTarget("light2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(4u, runner.started_.size());
+  EXPECT_EQ("first", runner.started_[0]);
+  // Three slots were free, but the light edges waited with the heavy one.
+  EXPECT_EQ("heavy", runner.started_[1]);
+  EXPECT_EQ(0u, runner.running_at_start_[1]);
+  EXPECT_EQ("light1", runner.started_[2]);
+  EXPECT_EQ("light2", runner.started_[3]);
+  EXPECT_EQ(1u, runner.running_at_start_[3]);
+
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&command_runner_);
+}
+
+// A command that has to run anyway runs alongside the restat edge it
+// depends on, and only runs again if the restat edge changed its input.
+TEST_F(BuildTest, SpeculateAheadOfRestat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"  restat = 1\n"
+"rule touch-restat\n"
+"  command = touch $out\n"
+"  restat = 1\n"
+"build gen.h: true gen.in\n"
+"build touched.h: touch-restat gen.in\n"
+"build obj: cat gen.h src\n"
+"build obj2: cat touched.h src\n"));
+  fs_.Create("gen.h", "");
+  fs_.Create("touched.h", "");
+  fs_.Create("obj", "");
+  fs_.Create("obj2", "");
+  fs_.Tick();
+  fs_.Create("gen.in", "");
+  fs_.Create("src", "");
+
+  config_.parallelism = 2;
+  config_.speculation = 50;
+  TwoSlotCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("obj", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, runner.started_.size());
+  EXPECT_EQ("gen.h", runner.started_[0]);
+  EXPECT_EQ("obj", runner.started_[1]);
+
+  state_.Reset();
+  runner.started_.clear();
+  fs_.Tick();
+  fs_.Create("gen.in", "");
+  fs_.Create("src", "");
+  EXPECT_TRUE(builder_.AddTarget("obj2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, runner.started_.size());
+  EXPECT_EQ("touched.h", runner.started_[0]);
+  EXPECT_EQ("obj2", runner.started_[1]);
+  EXPECT_EQ("obj2", runner.started_[2]);
+
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&command_runner_);
+}
+
+/// Records, as each command starts, which of the commands started before
+/// it went through FinishCommand() already, seen from whether their outputs
+/// are ready.
+struct FinishOrderCommandRunner : public FakeCommandRunner {
+  explicit FinishOrderCommandRunner(VirtualFileSystem* fs)
+      : FakeCommandRunner(fs) {}
+
+  virtual bool StartCommand(Edge* edge) {
+    string finished;
+    for (vector<Edge*>::iterator e = started_.begin(); e != started_.end();
+         ++e) {
+      finished += (*e)->outputs_ready() ? '1' : '0';
+    }
+    finished_at_start_.push_back(finished);
+    started_.push_back(edge);
+    return FakeCommandRunner::StartCommand(edge);
+  }
+
+  vector<Edge*> started_;
+  vector<string> finished_at_start_;
+};
+
+// The slot a successful command frees is handed out again before its
+// outputs are restat and its deps recorded.
+TEST_F(BuildTest, RefillSlotBeforeFinishCommand) {
+  FinishOrderCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("cat1", &err));
+  EXPECT_TRUE(builder_.AddTarget("cat2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, runner.started_.size());
+  EXPECT_EQ("", runner.finished_at_start_[0]);
+  EXPECT_EQ("0", runner.finished_at_start_[1]);
+  EXPECT_TRUE(runner.started_[0]->outputs_ready());
+  EXPECT_TRUE(runner.started_[1]->outputs_ready());
+
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&command_runner_);
+}
+
 TEST_F(BuildWithLogTest, RestatTest) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule true\n"
@@ -1361,41 +1928,98 @@ TEST_F(BuildWithLogTest, RestatTest) {
   ASSERT_EQ(2u, command_runner_.commands_ran_.size());
 }
 
-TEST_F(BuildWithLogTest, RestatMissingFile) {
-  // If a restat rule doesn't create its output, and the output didn't
-  // exist before the rule was run, consider that behavior equivalent
-  // to a rule that doesn't modify its existent output file.
-
+TEST_F(BuildWithLogTest, RestatContent) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
-"rule true\n"
-"  command = true\n"
-"  restat = 1\n"
 "rule cc\n"
 "  command = cc\n"
-"build out1: true in\n"
-"build out2: cc out1\n"));
+"  restat = content\n"
+"build out1: cc in\n"
+"build out2: cat out1\n"));
 
   fs_.Create("in", "");
-  fs_.Create("out2", "");
 
-  // Do a pre-build so that there's commands in the log for the outputs,
-  // otherwise, the lack of an entry in the build log will cause out2 to rebuild
-  // regardless of restat.
+  // The first build records the hash of what "cc" writes.
   string err;
   EXPECT_TRUE(builder_.AddTarget("out2", &err));
   ASSERT_EQ("", err);
   EXPECT_TRUE(builder_.Build(&err));
   ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  BuildLog::LogEntry* entry = build_log_.LookupByOutput("out1");
+  ASSERT_TRUE(entry);
+  EXPECT_EQ(ContentHash::Hash("", 0), entry->content_hash);
   command_runner_.commands_ran_.clear();
   state_.Reset();
 
   fs_.Tick();
   fs_.Create("in", "");
-  fs_.Create("out2", "");
+  TimeStamp out1_mtime = fs_.files_["out1"].mtime;
 
-  // Run a build, expect only the first command to run.
-  // It doesn't touch its output (due to being the "true" command), so
-  // we shouldn't run the dependent build.
+  // "cc" rewrites out1 with the same contents, so out2 is cleaned and out1
+  // gets its old mtime back.
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ(out1_mtime, fs_.files_["out1"].mtime);
+
+  // Nothing is left to do, thanks to the restat mtime in the log.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+
+  // Different contents than the last time go through as usual.
+  fs_.Tick();
+  fs_.Create("in", "");
+  build_log_.LookupByOutput("out1")->content_hash = 1;
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ(fs_.now_, fs_.files_["out1"].mtime);
+}
+
+TEST_F(BuildWithLogTest, RestatMissingFile) {
+  // If a restat rule doesn't create its output, and the output didn't
+  // exist before the rule was run, consider that behavior equivalent
+  // to a rule that doesn't modify its existent output file.
+
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"  restat = 1\n"
+"rule cc\n"
+"  command = cc\n"
+"build out1: true in\n"
+"build out2: cc out1\n"));
+
+  fs_.Create("in", "");
+  fs_.Create("out2", "");
+
+  // Do a pre-build so that there's commands in the log for the outputs,
+  // otherwise, the lack of an entry in the build log will cause out2 to rebuild
+  // regardless of restat.
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+
+  fs_.Tick();
+  fs_.Create("in", "");
+  fs_.Create("out2", "");
+
+  // Run a build, expect only the first command to run.
+  // It doesn't touch its output (due to being the "true" command), so
+  // we shouldn't run the dependent build.
   EXPECT_TRUE(builder_.AddTarget("out2", &err));
   ASSERT_EQ("", err);
   EXPECT_TRUE(builder_.Build(&err));
@@ -1531,6 +2155,38 @@ TEST_F(BuildDryRun, AllCommandsShown) {
   ASSERT_EQ(3u, command_runner_.commands_ran_.size());
 }
 
+TEST_F(BuildDryRun, Simulate) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool serial\n"
+"  depth = 1\n"
+"build long: cat in1\n"
+"build short1: cat in1\n"
+"  pool = serial\n"
+"build short2: cat in1\n"
+"  pool = serial\n"
+"build out: cat long short1 short2\n"));
+  build_log_.RecordCommand(GetNode("long")->in_edge(), 0, 300);
+  build_log_.RecordCommand(GetNode("short1")->in_edge(), 0, 200);
+  build_log_.RecordCommand(GetNode("short2")->in_edge(), 0, 200);
+  build_log_.RecordCommand(GetNode("out")->in_edge(), 0, 50);
+
+  config_.parallelism = 3;
+  SimulatedCommandRunner simulator(config_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&simulator);
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&command_runner_);
+
+  // The pool runs the short commands one after the other, alongside the
+  // long one, before the last one.
+  EXPECT_EQ(400 + 50, simulator.now());
+  EXPECT_TRUE(command_runner_.commands_ran_.empty());
+}
+
 // Test that RSP files are created when & where appropriate and deleted after
 // successful execution.
 TEST_F(BuildTest, RspFileSuccess)
@@ -1622,6 +2278,59 @@ TEST_F(BuildTest, RspFileFailure) {
   ASSERT_EQ("Another very long command", fs_.files_["out.rsp"].contents);
 }
 
+TEST_F(BuildTest, RspFileUnchangedIsNotRewritten) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+    "rule cat_rsp\n"
+    "  command = cat $rspfile > $out\n"
+    "  rspfile = $out.rsp\n"
+    "  rspfile_content = $long_command\n"
+    "build out1: cat_rsp in\n"
+    "  long_command = Some very long command\n"
+    "build out2: cat_rsp in\n"
+    "  long_command = Another very long command\n"));
+
+  // As a failed build leaves them.
+  fs_.Create("out1.rsp", "Some very long command");
+  fs_.Create("out2.rsp", "What the command was before");
+  TimeStamp before = fs_.now_;
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out1", &err));
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  g_keep_rsp = true;
+  EXPECT_TRUE(builder_.Build(&err));
+  g_keep_rsp = false;
+  ASSERT_EQ("", err);
+
+  EXPECT_EQ(before, fs_.files_["out1.rsp"].mtime);
+  EXPECT_GT(fs_.files_["out2.rsp"].mtime, before);
+  EXPECT_EQ("Another very long command", fs_.files_["out2.rsp"].contents);
+}
+
+TEST_F(BuildTest, EdgePreparer) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+    "rule cat_rsp\n"
+    "  command = cat $rspfile > $out\n"
+    "  rspfile = $out.rsp\n"
+    "  rspfile_content = $in\n"
+    "build out/a: cat_rsp in1 in2\n"));
+  Edge* edge = state_.LookupNode("out/a")->in_edge();
+
+  EdgePreparer preparer;
+  bool ok = false;
+  EXPECT_EQ(NULL, preparer.Finish(&ok));
+  ASSERT_TRUE(preparer.Start(edge, &fs_));
+  EXPECT_EQ(edge, preparer.edge());
+  EXPECT_EQ(edge, preparer.Finish(&ok));
+  EXPECT_TRUE(ok);
+  EXPECT_EQ(NULL, preparer.edge());
+  EXPECT_EQ("out/a.rsp", preparer.rspfile());
+  EXPECT_EQ("in1 in2", fs_.files_["out/a.rsp"].contents);
+}
+
 // Test that contents of the RSP file behaves like a regular part of
 // command line, i.e. triggers a rebuild if changed
 TEST_F(BuildWithLogTest, RspFileCmdLineChange) {
@@ -1777,6 +2486,70 @@ TEST_F(BuildTest, StatusFormatReplacePlaceholder) {
                 BuildStatus::kEdgeStarted));
 }
 
+TEST_F(BuildTest, StatusFormatSplitOnce) {
+  ProgressStatusFormat format;
+  string err;
+  EXPECT_TRUE(format.Parse("[%%%s/%t %p]%% ", &err));
+  // The text on either side of the placeholders is one op each.
+  EXPECT_EQ(7u, format.ops_.size());
+
+  status_.PlanHasTotalEdges(20);
+  string out = "kept ";
+  status_.FormatProgressStatus(format, BuildStatus::kEdgeStarted, &out);
+  EXPECT_EQ("kept [%0/20   0%]% ", out);
+
+  EXPECT_FALSE(format.Parse("[%x]", &err));
+  EXPECT_EQ("unknown placeholder '%x' in $NINJA_STATUS", err);
+}
+
+TEST_F(BuildTest, StatusRunningEdges) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out1: cat in1\n"
+"build out2: cat in2\n"
+"  description = CAT out2\n"
+"build out3: cat in3\n"));
+
+  status_.BuildStarted();
+  for (size_t i = state_.edges_.size() - 3; i < state_.edges_.size(); ++i)
+    status_.BuildEdgeStarted(state_.edges_[i]);
+
+  // The edges that started first have been running the longest.
+  vector<string> lines = status_.FormatRunningEdges(2, 10000);
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_EQ("  10.0s cat in1 > out1", lines[0]);
+  EXPECT_EQ("  10.0s CAT out2", lines[1]);
+
+  EXPECT_EQ(3u, status_.FormatRunningEdges(5, 10000).size());
+}
+
+TEST_F(BuildTest, StatusEstimatesWork) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out1: cat in1\n"
+"build out2: cat in2\n"));
+  Edge* edge = GetNode("out2")->in_edge();
+  edge->expected_duration_ = 100;
+
+  status_.BuildStarted();
+  status_.PlanHasRemainingWork(400);
+  EXPECT_EQ(-1, status_.EstimateRemainingTime(1000));
+
+  status_.BuildEdgeStarted(edge);
+  CommandRunner::Result result;
+  result.edge = edge;
+  result.status = ExitSuccess;
+  int start_time, end_time;
+  status_.BuildEdgeFinished(edge, result, &start_time, &end_time);
+
+  int64_t done, total;
+  status_.EstimateWork(1000, &done, &total);
+  EXPECT_EQ(100, done);
+  EXPECT_EQ(400, total);
+  // A quarter of the work took a second, so the rest takes three more.
+  EXPECT_EQ(3000, status_.EstimateRemainingTime(1000));
+  EXPECT_EQ(" 25%", status_.FormatProgressStatus("%P",
+                                                 BuildStatus::kEdgeFinished));
+}
+
 TEST_F(BuildTest, FailedDepsParse) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "build bad_deps.o: cat in1\n"
@@ -1985,6 +2758,54 @@ TEST_F(BuildWithDepsLogTest, DepsIgnoredInDryRun) {
   builder.command_runner_.release();
 }
 
+/// Check that the action cache restores outputs and their deps, but only
+/// while the discovered dependencies still hold the same contents.
+TEST_F(BuildWithDepsLogTest, ActionCache) {
+  const char* manifest =
+      "build out: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n";
+  config_.action_cache_dir = "cache";
+
+  // in2 is only known through the deps; each build makes out dirty again.
+  const char* kIn2Contents[] = { "v1", "v2", "v1", "v2", "v3" };
+  const size_t kCommandsRan[] = { 1, 1, 0, 0, 1 };
+  for (int i = 0; i < 5; ++i) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    fs_.Tick();
+    fs_.Create("in2", kIn2Contents[i]);
+    fs_.Create("in1.d", "out: in2");
+
+    string err;
+    DepsLog deps_log;
+    ASSERT_TRUE(deps_log.Load("ninja_deps", &state, &err));
+    ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    command_runner_.commands_ran_.clear();
+    EXPECT_TRUE(builder.AddTarget("out", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+    EXPECT_EQ(kCommandsRan[i], command_runner_.commands_ran_.size());
+
+    // Restored or not, out is newer than its inputs and has its deps.
+    EXPECT_EQ(fs_.now_, fs_.Stat("out", &err));
+    DepsLog::Deps* deps = deps_log.GetDeps(state.LookupNode("out"));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(1, deps->node_count);
+    EXPECT_EQ("in2", deps->nodes[0]->path());
+
+    deps_log.Close();
+    builder.command_runner_.release();
+  }
+}
+
 /// Check that a restat rule generating a header cancels compilations correctly.
 TEST_F(BuildTest, RestatDepfileDependency) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -2308,3 +3129,793 @@ TEST_F(BuildTest, Console) {
   EXPECT_EQ("", err);
   ASSERT_EQ(1u, command_runner_.commands_ran_.size());
 }
+
+TEST_F(BuildTest, DyndepMissingAndNoRule) {
+  // Verify that we can diagnose when a dyndep file is missing and
+  // has no rule to build it.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+
+  string err;
+  EXPECT_FALSE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("loading 'dd': No such file or directory", err);
+}
+
+TEST_F(BuildTest, DyndepReadyImplicitConnection) {
+  // Verify that a dyndep file can be loaded immediately to discover
+  // that one edge has an implicit output that is also an implicit
+  // input of another edge.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"build tmp: touch || dd\n"
+"  dyndep = dd\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out | out.imp: dyndep | tmp.imp\n"
+"build tmp | tmp.imp: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch tmp tmp.imp", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[1]);
+}
+
+TEST_F(BuildTest, DyndepBuild) {
+  // Verify that a dyndep file can be built and loaded to discover nothing.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+
+  size_t files_created = fs_.files_created_.size();
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out", command_runner_.commands_ran_[1]);
+  ASSERT_EQ(2u, fs_.files_read_.size());
+  EXPECT_EQ("dd-in", fs_.files_read_[0]);
+  EXPECT_EQ("dd", fs_.files_read_[1]);
+  ASSERT_EQ(2u + files_created, fs_.files_created_.size());
+  EXPECT_EQ(1u, fs_.files_created_.count("dd"));
+  EXPECT_EQ(1u, fs_.files_created_.count("out"));
+}
+
+TEST_F(BuildTest, DyndepBuildSyntaxError) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // and reject a syntax error.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("dd-in",
+"build out: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("dd:1: expected 'ninja_dyndep_version = ...'\n", err);
+}
+
+TEST_F(BuildTest, DyndepBuildUnrelatedOutput) {
+  // Verify that a dyndep file can have dependents that do not specify
+  // it as their dyndep binding.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build unrelated: touch || dd\n"
+"build out: touch unrelated || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+);
+  fs_.Tick();
+  fs_.Create("out", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch unrelated", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch out", command_runner_.commands_ran_[2]);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverNewOutput) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // a new output of an edge.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out: touch in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("in", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out | out.imp: dyndep\n"
+);
+  fs_.Tick();
+  fs_.Create("out", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[1]);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverNewOutputWithMultipleRules) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // a new output of an edge that is already the output of another edge.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out1 | out-twice.imp: touch in\n"
+"build out2: touch in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("in", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out2 | out-twice.imp: dyndep\n"
+);
+  fs_.Tick();
+  fs_.Create("out1", "");
+  fs_.Create("out2", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out1", &err));
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("multiple rules generate out-twice.imp", err);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverNewInput) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // a new input to an edge.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build in: touch\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep | in\n"
+);
+  fs_.Tick();
+  fs_.Create("out", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch in", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch out", command_runner_.commands_ran_[2]);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverImplicitConnection) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // that one edge has an implicit output that is also an implicit
+  // input of another edge.  This is the module case: "out" needs the
+  // module interface that "tmp" writes, and runs only once it is there.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build tmp: touch || dd\n"
+"  dyndep = dd\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out | out.imp: dyndep | tmp.imp\n"
+"build tmp | tmp.imp: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch tmp tmp.imp", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[2]);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverOutputAndDepfileInput) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // that one edge has an implicit output that is also reported by
+  // a depfile as an input of another edge.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build tmp: touch || dd\n"
+"  dyndep = dd\n"
+"build out: cp tmp\n"
+"  depfile = out.d\n"
+));
+  fs_.Create("out.d", "out: tmp.imp\n");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build tmp | tmp.imp: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+
+  // Loading the depfile gave tmp.imp a phony input edge.
+  Edge* phony_edge = GetNode("tmp.imp")->in_edge();
+  ASSERT_TRUE(phony_edge);
+  ASSERT_TRUE(phony_edge->is_phony());
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+
+  // Loading the dyndep file gave tmp.imp a real input edge, in place of
+  // the phony one.
+  ASSERT_FALSE(GetNode("tmp.imp")->in_edge()->is_phony());
+  EXPECT_TRUE(phony_edge->outputs_.empty());
+
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch tmp tmp.imp", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("cp tmp out", command_runner_.commands_ran_[2]);
+  EXPECT_EQ(1u, fs_.files_created_.count("tmp.imp"));
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverNowWantEdge) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // that an edge is actually wanted due to a missing implicit output.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out $out.imp\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build tmp: touch || dd\n"
+"  dyndep = dd\n"
+"build out: touch tmp || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("tmp", "");
+  fs_.Create("out", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"build tmp | tmp.imp: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch tmp tmp.imp", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[2]);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverCycle) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // and reject a cycle.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out: touch in || dd\n"
+"  dyndep = dd\n"
+"build in: touch | circ\n"
+  ));
+  fs_.Create("circ", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out | circ: dyndep\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("dependency cycle: circ -> in -> circ", err);
+}
+
+TEST_F(BuildTest, DyndepBuildDiscoverSelfInput) {
+  // Verify that a dyndep file can name itself as an implicit input of
+  // the edge that it is the dyndep binding of.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out: touch in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("in", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out | out.imp: dyndep | dd\n"
+);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out", command_runner_.commands_ran_[1]);
+}
+
+TEST_F(BuildWithLogTest, DyndepBuildDiscoverRestat) {
+  // Verify that a dyndep file can be built and loaded to discover
+  // that an edge has a restat binding.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build out1: true in || dd\n"
+"  dyndep = dd\n"
+"build out2: cat out1\n"));
+
+  fs_.Create("out1", "");
+  fs_.Create("out2", "");
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out1: dyndep\n"
+"  restat = 1\n"
+);
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  // Do a pre-build so that there's commands in the log for the outputs,
+  // otherwise, the lack of an entry in the build log will cause "out2" to
+  // rebuild regardless of restat.
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp dd-in dd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("true", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("cat out1 > out2", command_runner_.commands_ran_[2]);
+
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  // We touched "in", so we should build "out1".  But because "true" does not
+  // touch "out1", we should cancel the build of "out2".
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("true", command_runner_.commands_ran_[0]);
+}
+
+TEST_F(BuildDryRun, DyndepNotBuiltYet) {
+  // A dry run doesn't write the dyndep file, so it goes on without what
+  // the file would add rather than failing to load it.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule true\n"
+"  command = true\n"
+"build dd: true dd-in\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"
+));
+  fs_.Create("dd-in", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("true", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out", command_runner_.commands_ran_[1]);
+  EXPECT_EQ(0u, fs_.files_read_.size());
+}
+
+TEST(WorkerHostsTest, Parse) {
+  vector<WorkerHost> hosts;
+  string err;
+  EXPECT_TRUE(ParseWorkerHosts(
+"# Name, slots and pools.\n"
+"build1 64\n"
+"\n"
+"  user@build2\t8 link  cc \r\n", &hosts, &err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, hosts.size());
+  EXPECT_EQ("build1", hosts[0].name);
+  EXPECT_EQ(64, hosts[0].slots);
+  EXPECT_TRUE(hosts[0].AllowsPool("link"));
+  EXPECT_TRUE(hosts[0].AllowsPool(""));
+  EXPECT_EQ("user@build2", hosts[1].name);
+  EXPECT_EQ(8, hosts[1].slots);
+  ASSERT_EQ(2u, hosts[1].pools.size());
+  EXPECT_TRUE(hosts[1].AllowsPool("cc"));
+  EXPECT_FALSE(hosts[1].AllowsPool(""));
+}
+
+TEST(WorkerHostsTest, Errors) {
+  vector<WorkerHost> hosts;
+  string err;
+  EXPECT_FALSE(ParseWorkerHosts("build1 4\nbuild2\n", &hosts, &err));
+  EXPECT_EQ("line 2: expected 'NAME SLOTS [POOL...]'", err);
+  EXPECT_FALSE(ParseWorkerHosts("build1 0\n", &hosts, &err));
+  EXPECT_EQ("line 1: expected 'NAME SLOTS [POOL...]'", err);
+  EXPECT_FALSE(ParseWorkerHosts("build1 4x\n", &hosts, &err));
+  EXPECT_EQ("line 1: expected 'NAME SLOTS [POOL...]'", err);
+  EXPECT_FALSE(ParseWorkerHosts("build1 4\nbuild1 2\n", &hosts, &err));
+  EXPECT_EQ("line 2: duplicate host 'build1'", err);
+  EXPECT_FALSE(ParseWorkerHosts("# nothing\n", &hosts, &err));
+  EXPECT_EQ("no hosts", err);
+}
+
+TEST(AdaptiveParallelismTest, FollowsPressure) {
+  AdaptiveParallelism adaptive(8);
+  EXPECT_EQ(8, adaptive.limit());
+  EXPECT_TRUE(adaptive.NeedsSample(0));
+
+  // Under pressure, a quarter of the slots go at every sample, down to one.
+  adaptive.AddSample(AdaptiveParallelism::kPressureStall, 50.0, 0);
+  EXPECT_EQ(6, adaptive.limit());
+  EXPECT_FALSE(adaptive.NeedsSample(1000));
+  EXPECT_TRUE(adaptive.NeedsSample(2000));
+  adaptive.AddSample(AdaptiveParallelism::kPressureStall, 50.0, 2000);
+  EXPECT_EQ(5, adaptive.limit());
+  for (int i = 2; i < 10; ++i)
+    adaptive.AddSample(AdaptiveParallelism::kPressureStall, 50.0, i * 2000);
+  EXPECT_EQ(1, adaptive.limit());
+
+  // Some pressure keeps the limit, none takes slots back one by one, up to
+  // -j.  Unknown values change nothing.
+  adaptive.AddSample(AdaptiveParallelism::kPressureStall, 10.0, 20000);
+  EXPECT_EQ(1, adaptive.limit());
+  adaptive.AddSample(AdaptiveParallelism::kPressureStall, -1.0, 22000);
+  EXPECT_EQ(1, adaptive.limit());
+  EXPECT_FALSE(adaptive.NeedsSample(23000));
+  for (int i = 0; i < 10; ++i)
+    adaptive.AddSample(AdaptiveParallelism::kPressureStall, 0.0, 24000 + i);
+  EXPECT_EQ(8, adaptive.limit());
+}
+
+TEST(AdaptiveParallelismTest, FollowsCpuUtilization) {
+  AdaptiveParallelism adaptive(4);
+  // Busy processors are only a problem when they are busy all the time.
+  adaptive.AddSample(AdaptiveParallelism::kCpuUtilization, 50.0, 0);
+  EXPECT_EQ(4, adaptive.limit());
+  adaptive.AddSample(AdaptiveParallelism::kCpuUtilization, 99.5, 2000);
+  EXPECT_EQ(3, adaptive.limit());
+  adaptive.AddSample(AdaptiveParallelism::kCpuUtilization, 95.0, 4000);
+  EXPECT_EQ(3, adaptive.limit());
+  adaptive.AddSample(AdaptiveParallelism::kCpuUtilization, 80.0, 6000);
+  EXPECT_EQ(4, adaptive.limit());
+}
+
+TEST(CpuPlacementTest, BalancesNodes) {
+  vector<vector<int> > nodes(2);
+  for (int cpu = 0; cpu < 4; ++cpu) {
+    nodes[0].push_back(cpu);
+    nodes[1].push_back(cpu + 4);
+  }
+  CpuPlacement placement(nodes);
+  vector<int> cpus;
+  EXPECT_EQ(0, placement.Place(1, vector<int>(), &cpus));
+  EXPECT_EQ(nodes[0], cpus);
+  EXPECT_EQ(1, placement.Place(1, vector<int>(), &cpus));
+  EXPECT_EQ(nodes[1], cpus);
+  EXPECT_EQ(0, placement.Place(2, vector<int>(), &cpus));
+  EXPECT_EQ(1, placement.Place(1, vector<int>(), &cpus));
+  placement.Release(0, 2);
+  EXPECT_EQ(0, placement.Place(1, vector<int>(), &cpus));
+
+  // A pool keeps its commands on its processors' nodes.
+  vector<int> pool_cpus;
+  pool_cpus.push_back(6);
+  pool_cpus.push_back(7);
+  EXPECT_EQ(1, placement.Place(1, pool_cpus, &cpus));
+  EXPECT_EQ(pool_cpus, cpus);
+  pool_cpus.assign(1, 9);
+  EXPECT_EQ(-1, placement.Place(1, pool_cpus, &cpus));
+  EXPECT_EQ(pool_cpus, cpus);
+}
+
+TEST(CpuPlacementTest, OneNode) {
+  CpuPlacement placement(vector<vector<int> >(1, vector<int>(1, 0)));
+  vector<int> cpus;
+  EXPECT_EQ(-1, placement.Place(1, vector<int>(), &cpus));
+  EXPECT_TRUE(cpus.empty());
+}
+
+#ifndef _WIN32
+struct MemoryBudgetTest : public StateTestWithBuiltinRules {};
+
+TEST_F(MemoryBudgetTest, HoldsBackHeavyEdges) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"build heavy1: true\n"
+"build heavy2: true\n"
+"build light: true\n"
+"build new: true\n"));
+  Edge* heavy1 = GetNode("heavy1")->in_edge();
+  Edge* heavy2 = GetNode("heavy2")->in_edge();
+  Edge* light = GetNode("light")->in_edge();
+  Edge* new_edge = GetNode("new")->in_edge();
+
+  // The peak memory of the last runs, in KB.
+  BuildLog build_log;
+  ResourceUsage usage;
+  usage.max_rss_kb = 2048;
+  build_log.RecordCommand(heavy1, 0, 10, 0, usage);
+  build_log.RecordCommand(heavy2, 0, 10, 0, usage);
+  usage.max_rss_kb = 512;
+  build_log.RecordCommand(light, 0, 10, 0, usage);
+
+  BuildConfig config;
+  config.parallelism = 4;
+  config.max_memory = 3 << 20;
+  RealCommandRunner runner(config, &build_log);
+  EXPECT_EQ(2 << 20, runner.EstimateMemory(heavy1));
+  EXPECT_EQ(512 << 10, runner.EstimateMemory(light));
+  // An edge that never ran gets a job slot's share.
+  EXPECT_EQ(768 << 10, runner.EstimateMemory(new_edge));
+
+  ASSERT_TRUE(runner.CanRunMore(heavy1));
+  ASSERT_TRUE(runner.StartCommand(heavy1));
+  EXPECT_EQ(2 << 20, runner.running_memory_);
+  EXPECT_FALSE(runner.CanRunMore(heavy2));
+  EXPECT_TRUE(runner.CanRunMore(light));
+  ASSERT_TRUE(runner.StartCommand(light));
+  EXPECT_FALSE(runner.CanRunMore(new_edge));
+
+  // The memory of a finished command is given back.
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ(0, runner.running_memory_);
+  EXPECT_TRUE(runner.CanRunMore(heavy2));
+}
+
+/// A RealCommandRunner whose clock the test sets, running real commands.
+struct ClockedCommandRunner : public RealCommandRunner {
+  ClockedCommandRunner(const BuildConfig& config, BuildLog* build_log)
+      : RealCommandRunner(config, build_log), now_(0) {}
+  virtual int64_t Now() const { return now_; }
+  using RealCommandRunner::StartTwins;
+
+  /// Wait for the killed subprocesses to be reaped.
+  bool ReapKilled() {
+    for (int i = 0; i < 500 && !subprocs_.killed_.empty(); ++i)
+      subprocs_.DoWork(10);
+    return subprocs_.killed_.empty();
+  }
+
+  int64_t now_;
+};
+
+struct HedgeTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("HedgeTest");
+    config_.parallelism = 2;
+    config_.hedge_factor = 2;
+    config_.max_memory = 1 << 30;
+  }
+  virtual void TearDown() { temp_dir_.Cleanup(); }
+
+  /// Parse a build of "out" by a command that runs |first| the first time
+  /// and |second| after that, in |pool|, which took 100ms and 1MB before.
+  Edge* ParseOut(const string& first, const string& second,
+                 const string& pool = "") {
+    AssertParse(&state_, (
+"pool link\n"
+"  depth = 1\n"
+"pool wide\n"
+"  depth = 2\n"
+"rule hedged\n"
+"  command = if mkdir lock 2>/dev/null; then " + first + "; else " +
+    second + "; fi\n"
+"  hedge = 1\n"
+"build out: hedged\n"
+"  pool = " + pool + "\n").c_str());
+    Edge* edge = GetNode("out")->in_edge();
+    ResourceUsage usage;
+    usage.max_rss_kb = 1024;
+    build_log_.RecordCommand(edge, 0, 100, 0, usage);
+    return edge;
+  }
+
+  BuildConfig config_;
+  BuildLog build_log_;
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(HedgeTest, TwinWins) {
+  Edge* edge = ParseOut("sleep 10", "echo twin");
+  ClockedCommandRunner runner(config_, &build_log_);
+  ASSERT_TRUE(runner.StartCommand(edge));
+
+  // Twice the 100ms it took, but at least a second.
+  runner.now_ = 999;
+  EXPECT_EQ(1, runner.StartTwins());
+  EXPECT_TRUE(runner.twins_.empty());
+  runner.now_ = 1000;
+  EXPECT_EQ(-1, runner.StartTwins());
+  EXPECT_EQ(1u, runner.twins_.size());
+  EXPECT_EQ(2, runner.running_weight_);
+  EXPECT_EQ(2 << 20, runner.running_memory_);
+
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ(edge, result.edge);
+  EXPECT_TRUE(result.success());
+  EXPECT_EQ("twin\n", result.output);
+
+  // The original is killed, and everything it held is given back.
+  EXPECT_EQ(0, runner.running_weight_);
+  EXPECT_EQ(0, runner.running_memory_);
+  EXPECT_TRUE(runner.hedges_.empty());
+  EXPECT_TRUE(runner.twins_.empty());
+  EXPECT_TRUE(runner.GetActiveEdges().empty());
+  EXPECT_TRUE(runner.subprocs_.running_.empty());
+  EXPECT_TRUE(runner.ReapKilled());
+}
+
+TEST_F(HedgeTest, OriginalWins) {
+  Edge* edge = ParseOut("sleep 0.5; echo original", "sleep 10");
+  ClockedCommandRunner runner(config_, &build_log_);
+  ASSERT_TRUE(runner.StartCommand(edge));
+  runner.now_ = 1000;
+  runner.StartTwins();
+  ASSERT_EQ(1u, runner.twins_.size());
+
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ(edge, result.edge);
+  EXPECT_TRUE(result.success());
+  EXPECT_EQ("original\n", result.output);
+
+  EXPECT_EQ(0, runner.running_weight_);
+  EXPECT_EQ(0, runner.running_memory_);
+  EXPECT_TRUE(runner.hedges_.empty());
+  EXPECT_TRUE(runner.twins_.empty());
+  EXPECT_TRUE(runner.subprocs_.running_.empty());
+  EXPECT_TRUE(runner.ReapKilled());
+}
+
+TEST_F(HedgeTest, JobsFull) {
+  Edge* edge = ParseOut("echo original", "echo twin");
+  config_.parallelism = 1;
+  ClockedCommandRunner runner(config_, &build_log_);
+  ASSERT_TRUE(runner.StartCommand(edge));
+  runner.now_ = 1000;
+  EXPECT_EQ(-1, runner.StartTwins());
+  EXPECT_TRUE(runner.twins_.empty());
+
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ("original\n", result.output);
+}
+
+TEST_F(HedgeTest, PoolIsFull) {
+  Edge* edge = ParseOut("echo original", "echo twin", "link");
+  ClockedCommandRunner runner(config_, &build_log_);
+  // As the plan does when it schedules the edge.
+  edge->pool()->EdgeScheduled(*edge);
+  ASSERT_TRUE(runner.StartCommand(edge));
+  runner.now_ = 1000;
+  runner.StartTwins();
+  EXPECT_TRUE(runner.twins_.empty());
+  EXPECT_EQ(1, edge->pool()->current_use());
+
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ("original\n", result.output);
+  edge->pool()->EdgeFinished(*edge);
+  EXPECT_EQ(0, edge->pool()->current_use());
+}
+
+TEST_F(HedgeTest, TwinTakesPoolRoom) {
+  Edge* edge = ParseOut("sleep 10", "echo twin", "wide");
+  ClockedCommandRunner runner(config_, &build_log_);
+  edge->pool()->EdgeScheduled(*edge);
+  ASSERT_TRUE(runner.StartCommand(edge));
+  runner.now_ = 1000;
+  runner.StartTwins();
+  EXPECT_EQ(1u, runner.twins_.size());
+  EXPECT_EQ(2, edge->pool()->current_use());
+
+  CommandRunner::Result result;
+  ASSERT_TRUE(runner.WaitForCommand(&result));
+  EXPECT_EQ("twin\n", result.output);
+  EXPECT_EQ(1, edge->pool()->current_use());
+  edge->pool()->EdgeFinished(*edge);
+  EXPECT_TRUE(runner.ReapKilled());
+}
+#endif  // _WIN32
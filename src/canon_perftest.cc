@@ -18,24 +18,37 @@
 #include "util.h"
 #include "metrics.h"
 
-const char kPath[] =
-    "../../third_party/WebKit/Source/WebCore/"
-    "platform/leveldb/LevelDBWriteBatch.cpp";
+// Paths like those of a generated manifest and of the depfiles it reads:
+// nearly all canonical already.
+const char* kPaths[] = {
+  "../../third_party/WebKit/Source/WebCore/"
+  "platform/leveldb/LevelDBWriteBatch.cpp",
+  "obj/third_party/WebKit/Source/WebCore/webcore_platform.LevelDBWriteBatch.o",
+  "gen/components/policy/policy/cloud_policy_generated.cc",
+  "/usr/include/x86_64-linux-gnu/bits/types.h",
+  "../../base/memory/ref_counted.h",
+  "foo.o",
+  "obj/chrome/browser/../../chrome/browser/ui/./views/frame/browser_view.o",
+  "../../third_party/llvm-build/Release+Asserts/lib/clang/include/stddef.h",
+};
 
 int main() {
   vector<int> times;
   string err;
 
+  const size_t kNumPaths = sizeof(kPaths) / sizeof(kPaths[0]);
   char buf[200];
-  size_t len = strlen(kPath);
-  strcpy(buf, kPath);
 
   for (int j = 0; j < 5; ++j) {
-    const int kNumRepetitions = 2000000;
+    const int kNumRepetitions = 2000000 / kNumPaths;
     int64_t start = GetTimeMillis();
     uint64_t slash_bits;
     for (int i = 0; i < kNumRepetitions; ++i) {
-      CanonicalizePath(buf, &len, &slash_bits, &err);
+      for (size_t p = 0; p < kNumPaths; ++p) {
+        size_t len = strlen(kPaths[p]);
+        memcpy(buf, kPaths[p], len + 1);
+        CanonicalizePath(buf, &len, &slash_bits, &err);
+      }
     }
     int delta = (int)(GetTimeMillis() - start);
     times.push_back(delta);
@@ -19,6 +19,7 @@
 
 #include "disk_interface.h"
 #include "graph.h"
+#include "stat_audit.h"
 #include "state.h"
 #include "util.h"
 
@@ -29,7 +30,8 @@ Cleaner::Cleaner(State* state, const BuildConfig& config)
     cleaned_(),
     cleaned_files_count_(0),
     disk_interface_(new RealDiskInterface),
-    status_(0) {
+    status_(0),
+    dyndep_loader_(state, disk_interface_) {
 }
 
 Cleaner::Cleaner(State* state,
@@ -41,14 +43,12 @@ Cleaner::Cleaner(State* state,
     cleaned_(),
     cleaned_files_count_(0),
     disk_interface_(disk_interface),
-    status_(0) {
-}
-
-int Cleaner::RemoveFile(const string& path) {
-  return disk_interface_->RemoveFile(path);
+    status_(0),
+    dyndep_loader_(state, disk_interface) {
 }
 
 bool Cleaner::FileExists(const string& path) {
+  StatAudit::Scope audit(StatAudit::kClean);
   string err;
   TimeStamp mtime = disk_interface_->Stat(path, &err);
   if (mtime == -1)
@@ -63,24 +63,24 @@ void Cleaner::Report(const string& path) {
 }
 
 void Cleaner::Remove(const string& path) {
-  if (!IsAlreadyRemoved(path)) {
-    removed_.insert(path);
-    if (config_.dry_run) {
-      if (FileExists(path))
-        Report(path);
-    } else {
-      int ret = RemoveFile(path);
-      if (ret == 0)
-        Report(path);
-      else if (ret == -1)
-        status_ = 1;
-    }
+  if (!config_.dry_run) {
+    pending_.push_back(path);
+    return;
   }
+  if (removed_.insert(path).second && FileExists(path))
+    Report(path);
 }
 
-bool Cleaner::IsAlreadyRemoved(const string& path) {
-  set<string>::iterator i = removed_.find(path);
-  return (i != removed_.end());
+void Cleaner::RemovePending() {
+  vector<int> results;
+  disk_interface_->RemoveFiles(pending_, &results);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (results[i] == 0)
+      Report(pending_[i]);
+    else if (results[i] == -1)
+      status_ = 1;
+  }
+  pending_.clear();
 }
 
 void Cleaner::RemoveEdgeFiles(Edge* edge) {
@@ -113,21 +113,23 @@ void Cleaner::PrintFooter() {
 int Cleaner::CleanAll(bool generator) {
   Reset();
   PrintHeader();
+  LoadDyndeps();
   for (vector<Edge*>::iterator e = state_->edges_.begin();
        e != state_->edges_.end(); ++e) {
     // Do not try to remove phony targets
     if ((*e)->is_phony())
       continue;
     // Do not remove generator's files unless generator specified.
-    if (!generator && (*e)->GetBindingBool("generator"))
+    if (!generator && (*e)->GetBindingBool(VarNames::kGenerator))
       continue;
     for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
-      Remove((*out_node)->path());
+      Remove((*out_node)->path().AsString());
     }
 
     RemoveEdgeFiles(*e);
   }
+  RemovePending();
   PrintFooter();
   return status_;
 }
@@ -136,7 +138,7 @@ void Cleaner::DoCleanTarget(Node* target) {
   if (Edge* e = target->in_edge()) {
     // Do not try to remove phony targets
     if (!e->is_phony()) {
-      Remove(target->path());
+      Remove(target->path().AsString());
       RemoveEdgeFiles(e);
     }
     for (vector<Node*>::iterator n = e->inputs_.begin(); n != e->inputs_.end();
@@ -158,7 +160,9 @@ int Cleaner::CleanTarget(Node* target) {
 
   Reset();
   PrintHeader();
+  LoadDyndeps();
   DoCleanTarget(target);
+  RemovePending();
   PrintFooter();
   return status_;
 }
@@ -180,6 +184,7 @@ int Cleaner::CleanTarget(const char* target) {
 int Cleaner::CleanTargets(int target_count, char* targets[]) {
   Reset();
   PrintHeader();
+  LoadDyndeps();
   for (int i = 0; i < target_count; ++i) {
     string target_name = targets[i];
     uint64_t slash_bits;
@@ -199,6 +204,7 @@ int Cleaner::CleanTargets(int target_count, char* targets[]) {
       }
     }
   }
+  RemovePending();
   PrintFooter();
   return status_;
 }
@@ -211,9 +217,9 @@ void Cleaner::DoCleanRule(const Rule* rule) {
     if ((*e)->rule().name() == rule->name()) {
       for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
-        Remove((*out_node)->path());
-        RemoveEdgeFiles(*e);
+        Remove((*out_node)->path().AsString());
       }
+      RemoveEdgeFiles(*e);
     }
   }
 }
@@ -223,7 +229,9 @@ int Cleaner::CleanRule(const Rule* rule) {
 
   Reset();
   PrintHeader();
+  LoadDyndeps();
   DoCleanRule(rule);
+  RemovePending();
   PrintFooter();
   return status_;
 }
@@ -247,6 +255,7 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
 
   Reset();
   PrintHeader();
+  LoadDyndeps();
   for (int i = 0; i < rule_count; ++i) {
     const char* rule_name = rules[i];
     const Rule* rule = state_->bindings_.LookupRule(rule_name);
@@ -259,13 +268,28 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
       status_ = 1;
     }
   }
+  RemovePending();
   PrintFooter();
   return status_;
 }
 
+void Cleaner::LoadDyndeps() {
+  for (vector<Edge*>::iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    Node* dyndep = (*e)->dyndep_;
+    if (!dyndep || !dyndep->dyndep_pending())
+      continue;
+    // Clean as much of the graph as is known: a dyndep file that is missing
+    // or broken adds nothing to it.
+    string err;
+    dyndep_loader_.LoadDyndeps(dyndep, &err);
+  }
+}
+
 void Cleaner::Reset() {
   status_ = 0;
   cleaned_files_count_ = 0;
   removed_.clear();
+  pending_.clear();
   cleaned_.clear();
 }
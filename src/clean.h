@@ -17,8 +17,10 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 #include "build.h"
+#include "dyndep.h"
 
 using namespace std;
 
@@ -74,17 +76,15 @@ struct Cleaner {
   }
 
  private:
-  /// Remove the file @a path.
-  /// @return whether the file has been removed.
-  int RemoveFile(const string& path);
   /// @returns whether the file @a path exists.
   bool FileExists(const string& path);
   void Report(const string& path);
 
-  /// Remove the given @a path file only if it has not been already removed.
+  /// Remove the given @a path file, at the latest by RemovePending().  A dry
+  /// run reports every path once.
   void Remove(const string& path);
-  /// @return whether the given @a path has already been removed.
-  bool IsAlreadyRemoved(const string& path);
+  /// Remove the files that Remove() was given, all at once.
+  void RemovePending();
   /// Remove the depfile and rspfile for an Edge.
   void RemoveEdgeFiles(Edge* edge);
 
@@ -95,13 +95,22 @@ struct Cleaner {
   void DoCleanRule(const Rule* rule);
   void Reset();
 
+  /// Load dyndep files that exist, before they are cleaned, for the outputs
+  /// they add.
+  void LoadDyndeps();
+
   State* state_;
   const BuildConfig& config_;
+  /// The paths reported by a dry run.  Real runs need no such bookkeeping:
+  /// once a file is removed, removing it again finds nothing.
   set<string> removed_;
+  /// The paths waiting for RemovePending().
+  vector<string> pending_;
   set<Node*> cleaned_;
   int cleaned_files_count_;
   DiskInterface* disk_interface_;
   int status_;
+  DyndepLoader dyndep_loader_;
 };
 
 #endif  // NINJA_CLEAN_H_
@@ -73,54 +73,127 @@ bool CLParser::FilterInputFilename(string line) {
       EndsWith(line, ".cpp");
 }
 
-// static
-bool CLParser::Parse(const string& output, const string& deps_prefix,
-                     string* filtered_output, string* err) {
-  METRIC_RECORD("CLParser::Parse");
+CLIncludeCache::CLIncludeCache(bool remember) : remember_(remember) {
+#ifdef _WIN32
+  normalizer_ = NULL;
+#endif
+}
 
-  // Loop over all lines in the output to process them.
-  assert(&output != filtered_output);
-  size_t start = 0;
+CLIncludeCache::~CLIncludeCache() {
 #ifdef _WIN32
-  IncludesNormalize normalizer(".");
+  delete normalizer_;
 #endif
+}
 
-  while (start < output.size()) {
-    size_t end = output.find_first_of("\r\n", start);
-    if (end == string::npos)
-      end = output.size();
-    string line = output.substr(start, end - start);
+bool CLIncludeCache::Normalize(const string& include, string* normalized,
+                               string* err) {
+  if (remember_) {
+    map<string, string>::iterator i = paths_.find(include);
+    if (i != paths_.end()) {
+      *normalized = i->second;
+      return true;
+    }
+  }
 
-    string include = FilterShowIncludes(line, deps_prefix);
-    if (!include.empty()) {
-      string normalized;
 #ifdef _WIN32
-      if (!normalizer.Normalize(include, &normalized, err))
-        return false;
+  // Relative to the directory ninja runs in, which doesn't change.
+  if (!normalizer_)
+    normalizer_ = new IncludesNormalize(".");
+  if (!normalizer_->Normalize(include, normalized, err))
+    return false;
 #else
-      // TODO: should this make the path relative to cwd?
-      normalized = include;
-      uint64_t slash_bits;
-      if (!CanonicalizePath(&normalized, &slash_bits, err))
-        return false;
+  // TODO: should this make the path relative to cwd?
+  *normalized = include;
+  uint64_t slash_bits;
+  if (!CanonicalizePath(normalized, &slash_bits, err))
+    return false;
 #endif
-      if (!IsSystemInclude(normalized))
-        includes_.insert(normalized);
-    } else if (FilterInputFilename(line)) {
-      // Drop it.
-      // TODO: if we support compiling multiple output files in a single
-      // cl.exe invocation, we should stash the filename.
+  if (CLParser::IsSystemInclude(*normalized))
+    normalized->clear();
+  if (remember_)
+    paths_.insert(make_pair(include, *normalized));
+  return true;
+}
+
+bool CLParser::Parse(const string& output, const string& deps_prefix,
+                     string* filtered_output, string* err) {
+  METRIC_RECORD("CLParser::Parse");
+
+  assert(&output != filtered_output);
+  return Feed(output.data(), output.size(), deps_prefix, filtered_output,
+              err) &&
+         Finish(deps_prefix, filtered_output, err);
+}
+
+bool CLParser::Feed(const char* data, size_t size, const string& deps_prefix,
+                    string* filtered_output, string* err) {
+  const char* end = data + size;
+  // The '\n' of a "\r\n" split between two chunks.
+  if (pending_cr_ && data < end) {
+    if (*data == '\n')
+      ++data;
+    pending_cr_ = false;
+  }
+
+  // Loop over all lines in the output to process them.
+  string line;
+  while (data < end) {
+    const char* eol = data;
+    while (eol < end && *eol != '\r' && *eol != '\n')
+      ++eol;
+    if (eol == end) {
+      partial_.append(data, end - data);
+      break;
+    }
+
+    if (partial_.empty()) {
+      line.assign(data, eol - data);
     } else {
-      filtered_output->append(line);
-      filtered_output->append("\n");
+      partial_.append(data, eol - data);
+      line.swap(partial_);
+      partial_.clear();
     }
+    if (!ParseLine(line, deps_prefix, filtered_output, err))
+      return false;
 
-    if (end < output.size() && output[end] == '\r')
-      ++end;
-    if (end < output.size() && output[end] == '\n')
-      ++end;
-    start = end;
+    if (*eol == '\r') {
+      ++eol;
+      if (eol == end)
+        pending_cr_ = true;
+    }
+    if (eol < end && *eol == '\n')
+      ++eol;
+    data = eol;
   }
+  return true;
+}
+
+bool CLParser::Finish(const string& deps_prefix, string* filtered_output,
+                      string* err) {
+  pending_cr_ = false;
+  if (partial_.empty())
+    return true;
+  string line;
+  line.swap(partial_);
+  return ParseLine(line, deps_prefix, filtered_output, err);
+}
 
+bool CLParser::ParseLine(const string& line, const string& deps_prefix,
+                         string* filtered_output, string* err) {
+  string include = FilterShowIncludes(line, deps_prefix);
+  if (!include.empty()) {
+    string normalized;
+    if (!cache_->Normalize(include, &normalized, err))
+      return false;
+    if (!normalized.empty())
+      includes_.insert(normalized);
+  } else if (FilterInputFilename(line)) {
+    // Drop it.
+    // TODO: if we support compiling multiple output files in a single
+    // cl.exe invocation, we should stash the filename.
+  } else {
+    filtered_output->append(line);
+    filtered_output->append("\n");
+  }
   return true;
 }
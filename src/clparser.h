@@ -15,15 +15,43 @@
 #ifndef NINJA_CLPARSER_H_
 #define NINJA_CLPARSER_H_
 
+#include <map>
 #include <set>
 #include <string>
 using namespace std;
 
+struct IncludesNormalize;
+
+/// Remembers how the includes printed by cl.exe normalize, so that the
+/// headers every compile includes are only normalized once per build.
+struct CLIncludeCache {
+  /// Without |remember|, the includes are normalized every time.
+  explicit CLIncludeCache(bool remember = true);
+  ~CLIncludeCache();
+
+  /// Normalize |include| into |normalized|, which is left empty for a
+  /// system include.  Returns false with |err| filled if it doesn't
+  /// normalize; that is not remembered.
+  bool Normalize(const string& include, string* normalized, string* err);
+
+ private:
+  bool remember_;
+  map<string, string> paths_;
+#ifdef _WIN32
+  IncludesNormalize* normalizer_;
+#endif
+};
+
 /// Visual Studio's cl.exe requires some massaging to work with Ninja;
 /// for example, it emits include information on stderr in a funny
 /// format when building with /showIncludes.  This class parses this
 /// output.
 struct CLParser {
+  CLParser() : own_cache_(false), cache_(&own_cache_), pending_cr_(false) {}
+  /// Normalize the includes through |cache|, which outlives the parser.
+  explicit CLParser(CLIncludeCache* cache)
+      : own_cache_(false), cache_(cache), pending_cr_(false) {}
+
   /// Parse a line of cl.exe output and extract /showIncludes info.
   /// If a dependency is extracted, returns a nonempty string.
   /// Exposed for testing.
@@ -46,7 +74,29 @@ struct CLParser {
   bool Parse(const string& output, const string& deps_prefix,
              string* filtered_output, string* err);
 
+  /// Parse the next |size| bytes of the output of cl, as it comes: the
+  /// lines are handled once they are complete.  Returns false with err
+  /// filled on failure, after which the parser shouldn't be fed more.
+  bool Feed(const char* data, size_t size, const string& deps_prefix,
+            string* filtered_output, string* err);
+
+  /// Handle the last line of the output, once there's no more of it.
+  bool Finish(const string& deps_prefix, string* filtered_output,
+              string* err);
+
   set<string> includes_;
+
+ private:
+  bool ParseLine(const string& line, const string& deps_prefix,
+                 string* filtered_output, string* err);
+
+  CLIncludeCache own_cache_;
+  CLIncludeCache* cache_;
+  /// The start of a line that the next Feed() completes.
+  string partial_;
+  /// Whether a chunk ended with '\r', so that a '\n' starting the next one
+  /// ends the same line.
+  bool pending_cr_;
 };
 
 #endif  // NINJA_CLPARSER_H_
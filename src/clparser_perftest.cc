@@ -15,6 +15,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "clparser.h"
 #include "metrics.h"
 
@@ -131,25 +133,45 @@ int main(int argc, char* argv[]) {
       "Note: including file:         C:\\Program Files (x86)\\Microsoft Visual Studio 14.0\\VC\\INCLUDE\\cerrno\r\n"
       "Note: including file:        C:\\Program Files (x86)\\Windows Kits\\10\\include\\10.0.10240.0\\ucrt\\share.h\r\n";
 
-  for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
-    int64_t start = GetTimeMillis();
-    for (int rep = 0; rep < limit; ++rep) {
-      string output;
-      string err;
+  // Parse each time from scratch, then as the output of commands is read,
+  // in pipe-sized chunks, with the includes normalized once for the build.
+  for (int streaming = 0; streaming < 2; ++streaming) {
+    CLIncludeCache cache;
+    for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
+      int64_t start = GetTimeMillis();
+      for (int rep = 0; rep < limit; ++rep) {
+        string output;
+        string err;
 
-      CLParser parser;
-      if (!parser.Parse(perf_testdata, "", &output, &err)) {
-        printf("%s\n", err.c_str());
-        return 1;
+        bool ok;
+        if (!streaming) {
+          CLParser parser;
+          ok = parser.Parse(perf_testdata, "", &output, &err);
+        } else {
+          const size_t kChunk = 4096;
+          CLParser parser(&cache);
+          ok = true;
+          for (size_t i = 0; ok && i < perf_testdata.size(); i += kChunk) {
+            ok = parser.Feed(perf_testdata.data() + i,
+                             min(kChunk, perf_testdata.size() - i), "",
+                             &output, &err);
+          }
+          ok = ok && parser.Finish("", &output, &err);
+        }
+        if (!ok) {
+          printf("%s\n", err.c_str());
+          return 1;
+        }
       }
-    }
-    int64_t end = GetTimeMillis();
+      int64_t end = GetTimeMillis();
 
-    if (end - start > 2000) {
-      int delta_ms = (int)(end - start);
-      printf("Parse %d times in %dms avg %.1fus\n",
-             limit, delta_ms, float(delta_ms * 1000) / limit);
-      break;
+      if (end - start > 2000) {
+        int delta_ms = (int)(end - start);
+        printf("%s %d times in %dms avg %.1fus\n",
+               streaming ? "Feed with a shared cache" : "Parse",
+               limit, delta_ms, float(delta_ms * 1000) / limit);
+        break;
+      }
     }
   }
 
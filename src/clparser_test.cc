@@ -115,3 +115,49 @@ TEST(CLParserTest, DuplicatedHeaderPathConverted) {
   ASSERT_EQ("", output);
   ASSERT_EQ(2u, parser.includes_.size());
 }
+
+TEST(CLParserTest, Feed) {
+  const string kInput =
+      "foo.cc\r\n"
+      "Note: including file: foo.h\r\n"
+      "cl: warning\r"
+      "\n"
+      "Note: including file: bar.h\n"
+      "\r\n"
+      "last line";
+
+  CLParser whole;
+  string expected, err;
+  ASSERT_TRUE(whole.Parse(kInput, "", &expected, &err));
+  ASSERT_EQ("cl: warning\n\nlast line\n", expected);
+
+  // However the output splits into chunks, even between '\r' and '\n',
+  // it parses the same.
+  for (size_t chunk = 1; chunk <= kInput.size(); ++chunk) {
+    CLParser parser;
+    string output;
+    for (size_t i = 0; i < kInput.size(); i += chunk) {
+      size_t size = min(chunk, kInput.size() - i);
+      ASSERT_TRUE(parser.Feed(kInput.data() + i, size, "", &output, &err));
+    }
+    ASSERT_TRUE(parser.Finish("", &output, &err));
+    EXPECT_EQ(expected, output);
+    EXPECT_EQ(whole.includes_, parser.includes_);
+  }
+}
+
+TEST(CLParserTest, SharedCache) {
+  CLIncludeCache cache;
+  for (int i = 0; i < 2; ++i) {
+    CLParser parser(&cache);
+    string output, err;
+    ASSERT_TRUE(parser.Parse(
+        "Note: including file: sub/./foo.h\r\n"
+        "Note: including file: c:\\Program Files\\foo.h\r\n",
+        "", &output, &err));
+    ASSERT_EQ("", output);
+    // The system include stays dropped once it is cached.
+    ASSERT_EQ(1u, parser.includes_.size());
+    EXPECT_EQ("sub/foo.h", *parser.includes_.begin());
+  }
+}
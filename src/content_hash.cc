@@ -0,0 +1,163 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "content_hash.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t Rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// The data is read as little-endian words, as on the machines ninja
+// mostly runs on; the hashes only ever get compared with ones made by
+// the same machine.
+inline uint64_t Read64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline unsigned Read32(const unsigned char* p) {
+  unsigned v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = Rotl(acc, 31);
+  return acc * kPrime1;
+}
+
+inline uint64_t MergeRound(uint64_t acc, uint64_t val) {
+  acc ^= Round(0, val);
+  return acc * kPrime1 + kPrime4;
+}
+
+}  // anonymous namespace
+
+ContentHash::ContentHash() : buf_size_(0), total_size_(0) {
+  acc_[0] = kPrime1 + kPrime2;
+  acc_[1] = kPrime2;
+  acc_[2] = 0;
+  acc_[3] = 0 - kPrime1;
+}
+
+void ContentHash::Update(const void* data, size_t size) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  const unsigned char* end = p + size;
+  total_size_ += size;
+
+  if (buf_size_ > 0) {
+    size_t fill = min(size, sizeof(buf_) - buf_size_);
+    memcpy(buf_ + buf_size_, p, fill);
+    buf_size_ += fill;
+    p += fill;
+    if (buf_size_ < sizeof(buf_))
+      return;
+    for (int i = 0; i < 4; ++i)
+      acc_[i] = Round(acc_[i], Read64(buf_ + i * 8));
+    buf_size_ = 0;
+  }
+
+  // The bulk of the data goes through here, a 32-byte stripe at a time.
+  uint64_t a0 = acc_[0], a1 = acc_[1], a2 = acc_[2], a3 = acc_[3];
+  for (; end - p >= 32; p += 32) {
+    a0 = Round(a0, Read64(p));
+    a1 = Round(a1, Read64(p + 8));
+    a2 = Round(a2, Read64(p + 16));
+    a3 = Round(a3, Read64(p + 24));
+  }
+  acc_[0] = a0; acc_[1] = a1; acc_[2] = a2; acc_[3] = a3;
+
+  memcpy(buf_, p, end - p);
+  buf_size_ = end - p;
+}
+
+uint64_t ContentHash::Finish() const {
+  uint64_t h;
+  if (total_size_ >= 32) {
+    h = Rotl(acc_[0], 1) + Rotl(acc_[1], 7) + Rotl(acc_[2], 12) +
+        Rotl(acc_[3], 18);
+    for (int i = 0; i < 4; ++i)
+      h = MergeRound(h, acc_[i]);
+  } else {
+    h = kPrime5;
+  }
+  h += total_size_;
+
+  const unsigned char* p = buf_;
+  const unsigned char* end = buf_ + buf_size_;
+  for (; end - p >= 8; p += 8) {
+    h ^= Round(0, Read64(p));
+    h = Rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (end - p >= 4) {
+    h ^= (uint64_t)Read32(p) * kPrime1;
+    h = Rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * kPrime5;
+    h = Rotl(h, 11) * kPrime1;
+  }
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+// static
+uint64_t ContentHash::Hash(const void* data, size_t size) {
+  ContentHash hash;
+  hash.Update(data, size);
+  return hash.Finish();
+}
+
+bool HashFileContents(const string& path, uint64_t* hash, string* err) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  ContentHash content;
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    content.Update(buf, len);
+  if (ferror(f)) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+  *hash = content.Finish();
+  return true;
+}
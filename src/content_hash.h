@@ -0,0 +1,51 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CONTENT_HASH_H_
+#define NINJA_CONTENT_HASH_H_
+
+#include <stddef.h>
+
+#include <string>
+using namespace std;
+
+#include "util.h"  // uint64_t
+
+/// A fast 64-bit hash of what a file holds, for telling whether a command
+/// rewrote an output with the same contents.  This is the XXH64 algorithm,
+/// so that the data can be fed in pieces of any size.
+struct ContentHash {
+  ContentHash();
+
+  void Update(const void* data, size_t size);
+
+  /// The hash of everything fed so far.
+  uint64_t Finish() const;
+
+  /// The hash of |size| bytes at |data| in one go.
+  static uint64_t Hash(const void* data, size_t size);
+
+ private:
+  uint64_t acc_[4];
+  /// The bytes of a stripe that isn't complete yet.
+  unsigned char buf_[32];
+  size_t buf_size_;
+  uint64_t total_size_;
+};
+
+/// Hash the contents of |path|, reading it in pieces.  Returns false and
+/// fills |err| if it can't be read.
+bool HashFileContents(const string& path, uint64_t* hash, string* err);
+
+#endif  // NINJA_CONTENT_HASH_H_
@@ -0,0 +1,65 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "content_hash.h"
+
+#include "test.h"
+
+TEST(ContentHashTest, KnownValues) {
+  // The reference XXH64 values, with a seed of 0.
+  EXPECT_EQ(0xEF46DB3751D8E999ULL, ContentHash::Hash("", 0));
+  EXPECT_EQ(0xD24EC4F1A98C6E5BULL, ContentHash::Hash("a", 1));
+  EXPECT_EQ(0x44BC2CF5AD770999ULL, ContentHash::Hash("abc", 3));
+}
+
+TEST(ContentHashTest, Pieces) {
+  string data;
+  for (int i = 0; i < 1000; ++i)
+    data += (char)(i * 7);
+  uint64_t whole = ContentHash::Hash(data.data(), data.size());
+
+  // Any split of the data gives the same hash.
+  static const size_t kPieces[] = { 1, 3, 31, 32, 33, 100 };
+  for (size_t i = 0; i < sizeof(kPieces) / sizeof(kPieces[0]); ++i) {
+    ContentHash hash;
+    for (size_t pos = 0; pos < data.size(); pos += kPieces[i])
+      hash.Update(data.data() + pos, min(kPieces[i], data.size() - pos));
+    EXPECT_EQ(whole, hash.Finish());
+  }
+
+  data[500] ^= 1;
+  EXPECT_NE(whole, ContentHash::Hash(data.data(), data.size()));
+}
+
+TEST(ContentHashTest, File) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("NinjaContentHashTest");
+
+  string contents(100000, 'x');
+  FILE* f = fopen("file", "wb");
+  ASSERT_TRUE(f);
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+
+  uint64_t hash = 0;
+  string err;
+  EXPECT_TRUE(HashFileContents("file", &hash, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(ContentHash::Hash(contents.data(), contents.size()), hash);
+
+  EXPECT_FALSE(HashFileContents("nonexistent", &hash, &err));
+  EXPECT_NE("", err);
+
+  temp_dir.Cleanup();
+}
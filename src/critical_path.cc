@@ -0,0 +1,215 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+
+CriticalPathAnalysis::CriticalPathAnalysis(BuildLog* build_log)
+    : build_log_(build_log), critical_path_duration_(0), total_duration_(0),
+      command_count_(0), unknown_count_(0), default_duration_(1) {}
+
+void CriticalPathAnalysis::AddTarget(Node* target) {
+  if (Edge* edge = target->in_edge())
+    AddEdge(edge);
+}
+
+void CriticalPathAnalysis::AddEdge(Edge* edge) {
+  if (index_.find(edge) != index_.end())
+    return;
+  // Marks the edge as visited; a cycle would have failed loading.
+  index_[edge] = -1;
+  vector<int> producers;
+  for (vector<Node*>::iterator in = edge->inputs_.begin();
+       in != edge->inputs_.end(); ++in) {
+    Edge* producer = (*in)->in_edge();
+    if (!producer)
+      continue;
+    AddEdge(producer);
+    producers.push_back(index_[producer]);
+  }
+  sort(producers.begin(), producers.end());
+  producers.erase(unique(producers.begin(), producers.end()),
+                  producers.end());
+  index_[edge] = (int)edges_.size();
+  edges_.push_back(edge);
+  producers_.push_back(producers);
+}
+
+void CriticalPathAnalysis::Analyze() {
+  // Look up how long each command took the last time it ran; those that
+  // never ran are assumed to take as long as the average one that did, as
+  // when ninja schedules them.
+  int n = (int)edges_.size();
+  durations_.assign(n, 0);
+  vector<bool> known(n, true);
+  int64_t known_total = 0;
+  command_count_ = unknown_count_ = 0;
+  for (int i = 0; i < n; ++i) {
+    Edge* edge = edges_[i];
+    if (edge->is_phony())
+      continue;
+    ++command_count_;
+    BuildLog::LogEntry* entry = build_log_ ?
+        build_log_->LookupByOutput(edge->outputs_[0]->path()) : NULL;
+    if (!entry || entry->end_time < entry->start_time) {
+      known[i] = false;
+      ++unknown_count_;
+      continue;
+    }
+    durations_[i] = entry->end_time - entry->start_time;
+    known_total += durations_[i];
+  }
+  int known_count = command_count_ - unknown_count_;
+  default_duration_ =
+      known_count > 0 ? max<int64_t>(1, known_total / known_count) : 1;
+  total_duration_ = known_total + unknown_count_ * default_duration_;
+  for (int i = 0; i < n; ++i) {
+    if (!known[i])
+      durations_[i] = default_duration_;
+  }
+
+  // The earliest each edge can finish, and the producer that it waits on
+  // the longest for.
+  vector<int64_t> finish(n, 0);
+  vector<int> slowest(n, -1);
+  int last = -1;
+  for (int i = 0; i < n; ++i) {
+    int64_t start = 0;
+    for (vector<int>::iterator p = producers_[i].begin();
+         p != producers_[i].end(); ++p) {
+      if (slowest[i] == -1 || finish[*p] > start) {
+        start = finish[*p];
+        slowest[i] = *p;
+      }
+    }
+    finish[i] = start + durations_[i];
+    if (last == -1 || finish[i] > finish[last])
+      last = i;
+  }
+  critical_path_.clear();
+  critical_path_duration_ = last == -1 ? 0 : finish[last];
+  for (int i = last; i != -1; i = slowest[i]) {
+    if (edges_[i]->is_phony())
+      continue;
+    Step step = { edges_[i], durations_[i], known[i] };
+    critical_path_.push_back(step);
+  }
+  reverse(critical_path_.begin(), critical_path_.end());
+
+  // Walk from the consumers towards the producers for the weights.
+  weights_.assign(n, 0);
+  for (int i = n; i-- > 0; ) {
+    weights_[i] += durations_[i];
+    for (vector<int>::iterator p = producers_[i].begin();
+         p != producers_[i].end(); ++p) {
+      weights_[*p] = max(weights_[*p], weights_[i]);
+    }
+  }
+}
+
+int64_t CriticalPathAnalysis::Simulate(int parallelism, int buckets,
+                                       vector<double>* profile) const {
+  int n = (int)edges_.size();
+  vector<vector<int> > consumers(n);
+  vector<int> waiting(n);
+  // Heaviest first, then in the order the edges were added.
+  priority_queue<pair<int64_t, int> > ready;
+  for (int i = 0; i < n; ++i) {
+    waiting[i] = (int)producers_[i].size();
+    for (vector<int>::const_iterator p = producers_[i].begin();
+         p != producers_[i].end(); ++p) {
+      consumers[*p].push_back(i);
+    }
+    if (!waiting[i])
+      ready.push(make_pair(weights_[i], -i));
+  }
+
+  typedef priority_queue<pair<int64_t, int>, vector<pair<int64_t, int> >,
+                         greater<pair<int64_t, int> > > RunningQueue;
+  RunningQueue running;
+  map<const Pool*, int> pool_use;
+  map<const Pool*, vector<int> > delayed;
+  vector<pair<int64_t, int64_t> > intervals;
+  int64_t now = 0;
+  int jobs = 0;
+  for (;;) {
+    while (jobs < parallelism && !ready.empty()) {
+      int i = -ready.top().second;
+      ready.pop();
+      if (edges_[i]->is_phony()) {
+        // Takes no time and no job.
+        running.push(make_pair(now, i));
+        continue;
+      }
+      const Pool* pool = edges_[i]->pool();
+      if (pool && pool->depth() > 0) {
+        if (pool_use[pool] == pool->depth()) {
+          delayed[pool].push_back(i);
+          continue;
+        }
+        ++pool_use[pool];
+      }
+      ++jobs;
+      running.push(make_pair(now + durations_[i], i));
+      intervals.push_back(make_pair(now, now + durations_[i]));
+    }
+    if (running.empty())
+      break;
+
+    now = running.top().first;
+    int i = running.top().second;
+    running.pop();
+    const Pool* pool = edges_[i]->pool();
+    if (!edges_[i]->is_phony())
+      --jobs;
+    if (!edges_[i]->is_phony() && pool && pool->depth() > 0) {
+      --pool_use[pool];
+      vector<int>& pool_delayed = delayed[pool];
+      for (vector<int>::iterator d = pool_delayed.begin();
+           d != pool_delayed.end(); ++d) {
+        ready.push(make_pair(weights_[*d], -*d));
+      }
+      pool_delayed.clear();
+    }
+    for (vector<int>::iterator c = consumers[i].begin();
+         c != consumers[i].end(); ++c) {
+      if (--waiting[*c] == 0)
+        ready.push(make_pair(weights_[*c], -*c));
+    }
+  }
+
+  if (profile) {
+    profile->assign(buckets, 0);
+    double width = now / (double)buckets;
+    for (vector<pair<int64_t, int64_t> >::iterator i = intervals.begin();
+         width > 0 && i != intervals.end(); ++i) {
+      int first = min(buckets - 1, (int)(i->first / width));
+      int last = min(buckets - 1, (int)(i->second / width));
+      for (int b = first; b <= last; ++b) {
+        double overlap = min((double)i->second, (b + 1) * width) -
+                         max((double)i->first, b * width);
+        if (overlap > 0)
+          (*profile)[b] += overlap / width;
+      }
+    }
+  }
+  return now;
+}
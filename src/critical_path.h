@@ -0,0 +1,95 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CRITICAL_PATH_H_
+#define NINJA_CRITICAL_PATH_H_
+
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BuildLog;
+struct Edge;
+struct Node;
+
+/// Works out what a clean build of some targets costs, from how long each
+/// command took the last time it ran according to the build log: the
+/// critical path, that is the chain of commands waiting on each other that
+/// takes the longest, and how close to it a number of jobs gets.  Used by
+/// '-t critpath'.
+struct CriticalPathAnalysis {
+  /// |build_log| may be NULL, in which case all commands take as long.
+  explicit CriticalPathAnalysis(BuildLog* build_log);
+
+  /// Add the edges that building |target| takes.
+  void AddTarget(Node* target);
+
+  /// Work out the durations and the critical path of the edges added.
+  void Analyze();
+
+  struct Step {
+    Edge* edge;
+    /// In milliseconds.
+    int64_t duration;
+    /// Whether |duration| comes from the build log, rather than being the
+    /// average of the durations that do.
+    bool known;
+  };
+
+  /// The commands of the critical path, from the first to the last.
+  const vector<Step>& critical_path() const { return critical_path_; }
+  int64_t critical_path_duration() const { return critical_path_duration_; }
+
+  /// The durations of all the commands added up: what one job takes.
+  int64_t total_duration() const { return total_duration_; }
+  int command_count() const { return command_count_; }
+  /// How many of the commands the build log doesn't know, and what they
+  /// are assumed to take.
+  int unknown_count() const { return unknown_count_; }
+  int64_t default_duration() const { return default_duration_; }
+
+  /// Schedule the build on |parallelism| jobs like ninja does, heaviest
+  /// critical path first and within the depths of the pools, and return
+  /// how long it takes.  If |profile| isn't NULL, it gets the average
+  /// number of commands running during each of |buckets| equal slices of
+  /// that time.
+  int64_t Simulate(int parallelism, int buckets,
+                   vector<double>* profile) const;
+
+ private:
+  /// Add |edge| after the edges that produce its inputs.
+  void AddEdge(Edge* edge);
+
+  BuildLog* build_log_;
+  /// The edges added, producers first, and where they are in there.
+  vector<Edge*> edges_;
+  map<Edge*, int> index_;
+  /// The distinct producers of the inputs of each edge.
+  vector<vector<int> > producers_;
+  vector<int64_t> durations_;
+  /// The heaviest path from each edge to a target, itself included, which
+  /// is what ninja schedules by.
+  vector<int64_t> weights_;
+
+  vector<Step> critical_path_;
+  int64_t critical_path_duration_;
+  int64_t total_duration_;
+  int command_count_;
+  int unknown_count_;
+  int64_t default_duration_;
+};
+
+#endif  // NINJA_CRITICAL_PATH_H_
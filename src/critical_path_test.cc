@@ -0,0 +1,112 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+struct CriticalPathTest : public StateTestWithBuiltinRules {
+  /// Record that the edge building |output| took |duration| ms.
+  void Took(const char* output, int duration) {
+    log_.RecordCommand(GetNode(output)->in_edge(), 0, duration);
+  }
+
+  BuildLog log_;
+};
+
+TEST_F(CriticalPathTest, Path) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat src\n"
+"build b: cat src\n"
+"build c: cat a b\n"
+"build d: cat src\n"
+"build all: phony c d\n"));
+  Took("a", 10);
+  Took("b", 30);
+  Took("c", 5);
+  Took("d", 20);
+
+  CriticalPathAnalysis analysis(&log_);
+  analysis.AddTarget(GetNode("all"));
+  analysis.Analyze();
+  EXPECT_EQ(4, analysis.command_count());
+  EXPECT_EQ(0, analysis.unknown_count());
+  EXPECT_EQ(65, analysis.total_duration());
+  EXPECT_EQ(35, analysis.critical_path_duration());
+  ASSERT_EQ(2u, analysis.critical_path().size());
+  EXPECT_EQ("b", analysis.critical_path()[0].edge->outputs_[0]->path());
+  EXPECT_EQ(30, analysis.critical_path()[0].duration);
+  EXPECT_EQ("c", analysis.critical_path()[1].edge->outputs_[0]->path());
+
+  // One job runs everything one after the other...
+  EXPECT_EQ(65, analysis.Simulate(1, 1, NULL));
+  // ... two start with the heaviest, b and then d or a, and finish c at
+  // 35...
+  vector<double> profile;
+  EXPECT_EQ(35, analysis.Simulate(2, 7, &profile));
+  ASSERT_EQ(7u, profile.size());
+  EXPECT_EQ(2.0, profile[0]);
+  EXPECT_EQ(1.0, profile[6]);
+  // ... and more can't beat the critical path.
+  EXPECT_EQ(35, analysis.Simulate(10, 1, NULL));
+}
+
+TEST_F(CriticalPathTest, Unknown) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat src\n"
+"build b: cat a\n"
+"build c: cat b\n"));
+  Took("a", 10);
+  Took("c", 30);
+
+  CriticalPathAnalysis analysis(&log_);
+  analysis.AddTarget(GetNode("c"));
+  analysis.Analyze();
+  // b gets the average.
+  EXPECT_EQ(1, analysis.unknown_count());
+  EXPECT_EQ(20, analysis.default_duration());
+  EXPECT_EQ(60, analysis.critical_path_duration());
+  ASSERT_EQ(3u, analysis.critical_path().size());
+  EXPECT_FALSE(analysis.critical_path()[1].known);
+  EXPECT_EQ(20, analysis.critical_path()[1].duration);
+}
+
+TEST_F(CriticalPathTest, Pools) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool link\n"
+"  depth = 1\n"
+"rule link\n"
+"  command = link $out\n"
+"  pool = link\n"
+"build a: link src\n"
+"build b: link src\n"
+"build c: cat src\n"
+"build all: phony a b c\n"));
+  Took("a", 10);
+  Took("b", 10);
+  Took("c", 10);
+
+  CriticalPathAnalysis analysis(&log_);
+  analysis.AddTarget(GetNode("all"));
+  analysis.Analyze();
+  EXPECT_EQ(10, analysis.critical_path_duration());
+  // The links take turns, whatever the parallelism.
+  EXPECT_EQ(20, analysis.Simulate(3, 1, NULL));
+}
+
+}  // anonymous namespace
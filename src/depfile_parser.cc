@@ -29,7 +29,7 @@
 // otherwise they are passed through verbatim.
 // If anyone actually has depfiles that rely on the more complicated
 // behavior we can adjust this.
-bool DepfileParser::Parse(string* content, string* err) {
+bool DepfileParser::ParseRe2c(string* content, string* err) {
   // in: current parser input point.
   // end: end of input.
   // parsing_targets: whether we are parsing targets or dependencies.
@@ -175,24 +175,8 @@ yy15:
 
     }
 
-    int len = (int)(out - filename);
-    const bool is_target = parsing_targets;
-    if (len > 0 && filename[len - 1] == ':') {
-      len--;  // Strip off trailing colon, if any.
-      parsing_targets = false;
-    }
-
-    if (len == 0)
-      continue;
-
-    if (!is_target) {
-      ins_.push_back(StringPiece(filename, len));
-    } else if (!out_.str_) {
-      out_ = StringPiece(filename, len);
-    } else if (out_ != StringPiece(filename, len)) {
-      *err = "depfile has multiple output paths";
+    if (!AddPath(filename, (int)(out - filename), &parsing_targets, err))
       return false;
-    }
   }
   if (parsing_targets) {
     *err = "expected ':' in depfile";
@@ -200,3 +184,25 @@ yy15:
   }
   return true;
 }
+
+bool DepfileParser::AddPath(const char* path, int len, bool* parsing_targets,
+                            string* err) {
+  const bool is_target = *parsing_targets;
+  if (len > 0 && path[len - 1] == ':') {
+    len--;  // Strip off trailing colon, if any.
+    *parsing_targets = false;
+  }
+
+  if (len == 0)
+    return true;
+
+  if (!is_target) {
+    ins_.push_back(StringPiece(path, len));
+  } else if (!out_.str_) {
+    out_ = StringPiece(path, len);
+  } else if (out_ != StringPiece(path, len)) {
+    *err = "depfile has multiple output paths";
+    return false;
+  }
+  return true;
+}
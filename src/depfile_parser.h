@@ -26,10 +26,22 @@ struct DepfileParser {
   /// Parse an input file.  Input must be NUL-terminated.
   /// Warning: may mutate the content in-place and parsed StringPieces are
   /// pointers within it.
+  /// Skips runs of plain path characters 16 bytes at a time where SSE2 or
+  /// NEON is available.
   bool Parse(string* content, string* err);
 
+  /// The same as Parse(), with the byte-at-a-time scanner that re2c
+  /// generates from depfile_parser.in.cc.  Kept as the reference that
+  /// Parse() is tested against.
+  bool ParseRe2c(string* content, string* err);
+
   StringPiece out_;
   vector<StringPiece> ins_;
+
+ private:
+  /// Record the path of |len| bytes at |path|, an output until one ends
+  /// with a colon and an input after that.
+  bool AddPath(const char* path, int len, bool* parsing_targets, string* err);
 };
 
 #endif // NINJA_DEPFILE_PARSER_H_
@@ -16,62 +16,122 @@
 #include <stdlib.h>
 
 #include "depfile_parser.h"
+#include "state.h"
 #include "util.h"
 #include "metrics.h"
 
+/// Microseconds that |parse| takes over |contents|, which it parses a copy
+/// of; or -1 if it fails.
+float TimeParse(bool (DepfileParser::*parse)(string*, string*),
+                const string& contents, string* err) {
+  for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
+    int64_t start = GetTimeMillis();
+    for (int rep = 0; rep < limit; ++rep) {
+      string buf = contents;
+      DepfileParser parser;
+      if (!(parser.*parse)(&buf, err))
+        return -1;
+    }
+    int64_t end = GetTimeMillis();
+
+    if (end - start > 100)
+      return (end - start) * 1000 / (float)limit;
+  }
+  return (float)(1 << 20);
+}
+
+/// Microseconds that parsing |contents| and getting the nodes of its inputs
+/// takes, in a State that has seen it before; through
+/// State::GetDepfileNode() if |remembered|, or by canonicalizing each path
+/// for State::GetNode() otherwise.  Returns -1 if it fails.
+float TimeNodes(bool remembered, const string& contents, string* err) {
+  State state;
+  for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
+    int64_t start = GetTimeMillis();
+    for (int rep = 0; rep < limit; ++rep) {
+      string buf = contents;
+      DepfileParser parser;
+      if (!parser.Parse(&buf, err))
+        return -1;
+      for (vector<StringPiece>::iterator i = parser.ins_.begin();
+           i != parser.ins_.end(); ++i) {
+        if (remembered) {
+          if (!state.GetDepfileNode(*i, err))
+            return -1;
+        } else {
+          uint64_t slash_bits;
+          if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_,
+                                &slash_bits, err))
+            return -1;
+          state.GetNode(*i, slash_bits);
+        }
+      }
+    }
+    int64_t end = GetTimeMillis();
+
+    if (end - start > 100)
+      return (end - start) * 1000 / (float)limit;
+  }
+  return (float)(1 << 20);
+}
+
+void PrintSummary(const char* name, const vector<float>& times) {
+  if (times.empty())
+    return;
+  float min = times[0];
+  float max = times[0];
+  float total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    else if (times[i] > max)
+      max = times[i];
+  }
+
+  printf("%s: min %.1fus  max %.1fus  avg %.1fus\n",
+         name, min, max, total / times.size());
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
     printf("usage: %s <file1> <file2...>\n", argv[0]);
     return 1;
   }
 
+  vector<float> re2c_times;
   vector<float> times;
+  vector<float> node_times;
+  vector<float> remembered_times;
   for (int i = 1; i < argc; ++i) {
     const char* filename = argv[i];
-
-    for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
-      int64_t start = GetTimeMillis();
-      for (int rep = 0; rep < limit; ++rep) {
-        string buf;
-        string err;
-        if (ReadFile(filename, &buf, &err) < 0) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
-
-        DepfileParser parser;
-        if (!parser.Parse(&buf, &err)) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
-      }
-      int64_t end = GetTimeMillis();
-
-      if (end - start > 100) {
-        int delta = (int)(end - start);
-        float time = delta*1000 / (float)limit;
-        printf("%s: %.1fus\n", filename, time);
-        times.push_back(time);
-        break;
-      }
+    string contents;
+    string err;
+    if (ReadFile(filename, &contents, &err) < 0) {
+      printf("%s: %s\n", filename, err.c_str());
+      return 1;
     }
-  }
 
-  if (!times.empty()) {
-    float min = times[0];
-    float max = times[0];
-    float total = 0;
-    for (size_t i = 0; i < times.size(); ++i) {
-      total += times[i];
-      if (times[i] < min)
-        min = times[i];
-      else if (times[i] > max)
-        max = times[i];
+    float re2c_time = TimeParse(&DepfileParser::ParseRe2c, contents, &err);
+    float time = TimeParse(&DepfileParser::Parse, contents, &err);
+    float node_time = TimeNodes(false, contents, &err);
+    float remembered_time = TimeNodes(true, contents, &err);
+    if (re2c_time < 0 || time < 0 || node_time < 0 || remembered_time < 0) {
+      printf("%s: %s\n", filename, err.c_str());
+      return 1;
     }
-
-    printf("min %.1fus  max %.1fus  avg %.1fus\n",
-           min, max, total / times.size());
+    printf("%s: re2c %.1fus  simd %.1fus  "
+           "nodes %.1fus  remembered %.1fus\n",
+           filename, re2c_time, time, node_time, remembered_time);
+    re2c_times.push_back(re2c_time);
+    times.push_back(time);
+    node_times.push_back(node_time);
+    remembered_times.push_back(remembered_time);
   }
 
+  PrintSummary("re2c", re2c_times);
+  PrintSummary("simd", times);
+  PrintSummary("nodes", node_times);
+  PrintSummary("remembered", remembered_times);
   return 0;
 }
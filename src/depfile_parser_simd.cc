@@ -0,0 +1,210 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "depfile_parser.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEPFILE_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DEPFILE_NEON
+#endif
+
+#include <string.h>
+
+namespace {
+
+/// The characters that ParseRe2c() copies as they are, in runs:
+/// [a-zA-Z0-9+,/_:.~()}{%@=!\x80-\xFF-].
+const bool kPlain[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 0, 0, 1, 0, 0, 1, 1, 0, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 0, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+#if defined(DEPFILE_SSE2) || defined(DEPFILE_NEON)
+/// The index of the first of the 16 bytes at |p| that isn't in the ranges
+/// most paths stick to, [+-:], [@-Z], _, [a-z] and [\x80-\xFF], or 16.
+/// The few other plain characters are left to kPlain.
+inline int FindUncommon(const char* p) {
+#ifdef DEPFILE_SSE2
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  const __m128i zero = _mm_setzero_si128();
+#define IN_RANGE(lo, hi) \
+  _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), \
+                               _mm_set1_epi8((hi) - (lo))), zero)
+  __m128i common = _mm_or_si128(
+      _mm_or_si128(IN_RANGE('+', ':'), IN_RANGE('@', 'Z')),
+      _mm_or_si128(IN_RANGE('a', 'z'), _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+#undef IN_RANGE
+  // The high bit is set in the bytes of multibyte characters.
+  unsigned uncommon =
+      ~(_mm_movemask_epi8(common) | _mm_movemask_epi8(v)) & 0xffff;
+  if (!uncommon)
+    return 16;
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, uncommon);
+  return (int)index;
+#else
+  return __builtin_ctz(uncommon);
+#endif
+#else
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+#define IN_RANGE(lo, hi) \
+  vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8((hi) - (lo)))
+  uint8x16_t common = vorrq_u8(
+      vorrq_u8(IN_RANGE('+', ':'), IN_RANGE('@', 'Z')),
+      vorrq_u8(vorrq_u8(IN_RANGE('a', 'z'), vceqq_u8(v, vdupq_n_u8('_'))),
+               vcgeq_u8(v, vdupq_n_u8(0x80))));
+#undef IN_RANGE
+  // Narrow to four bits per byte to find the first uncommon one.
+  uint8x8_t narrowed =
+      vshrn_n_u16(vreinterpretq_u16_u8(vmvnq_u8(common)), 4);
+  uint64_t uncommon = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+  if (!uncommon)
+    return 16;
+  return __builtin_ctzll(uncommon) >> 2;
+#endif
+}
+#endif
+
+/// The end of the run of plain characters at |in|, up to |end|.
+inline char* SkipPlain(char* in, char* end) {
+  if (in == end || !kPlain[(unsigned char)*in])
+    return in;
+  for (;;) {
+#if defined(DEPFILE_SSE2) || defined(DEPFILE_NEON)
+    while (end - in >= 16) {
+      int common = FindUncommon(in);
+      in += common;
+      if (common < 16)
+        break;
+    }
+#endif
+    if (in == end || !kPlain[(unsigned char)*in])
+      return in;
+    ++in;
+  }
+}
+
+bool IsNewline(char c) {
+  return c == '\n' || c == '\r';
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || IsNewline(c);
+}
+
+/// The characters that a backslash escapes; see ParseRe2c().
+bool IsEscaped(char c) {
+  switch (c) {
+    case ' ':
+    case '\\':
+    case '#':
+    case '*':
+    case '[':
+    case '|':
+    case ']':
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+bool DepfileParser::Parse(string* content, string* err) {
+  // This follows the rules of ParseRe2c() exactly, see there.  Input is
+  // NUL-terminated, so looking one byte past a backslash or a dollar is
+  // fine.
+  char* in = &(*content)[0];
+  char* end = in + content->size();
+  bool parsing_targets = true;
+  while (in < end) {
+    // Whitespace and line continuations would each end an empty path, with
+    // no effect; skip them all at once.
+    while (in < end && (IsSpace(*in) || (*in == '\\' && IsNewline(in[1]))))
+      ++in;
+    if (in == end)
+      break;
+
+    char* out = in;
+    char* filename = out;
+    for (;;) {
+      char* run_end = SkipPlain(in, end);
+      if (run_end != in) {
+        size_t len = run_end - in;
+        // Need to shift it over if we're overwriting backslashes.
+        if (out < in)
+          memmove(out, in, len);
+        out += len;
+        in = run_end;
+        continue;
+      }
+
+      char c = in[0];
+      char next = in < end ? in[1] : '\0';
+      if (c == '\\' && IsEscaped(next)) {
+        // De-escape backslashed character.
+        *out++ = next;
+        in += 2;
+        continue;
+      }
+      if (c == '$' && next == '$') {
+        // De-escape dollar character.
+        *out++ = '$';
+        in += 2;
+        continue;
+      }
+      if (c == '\\' && next != '\0' && next != '\r' && next != '\n') {
+        // Let backslash before other characters through verbatim.
+        *out++ = '\\';
+        *out++ = next;
+        in += 2;
+        continue;
+      }
+      // Anything else (e.g. whitespace) ends the path.
+      ++in;
+      break;
+    }
+
+    if (!AddPath(filename, (int)(out - filename), &parsing_targets, err))
+      return false;
+  }
+  if (parsing_targets) {
+    *err = "expected ':' in depfile";
+    return false;
+  }
+  return true;
+}
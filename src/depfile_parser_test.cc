@@ -158,3 +158,39 @@ TEST_F(DepfileParserTest, RejectMultipleDifferentOutputs) {
   EXPECT_FALSE(Parse("foo bar: x y z", &err));
   ASSERT_EQ("depfile has multiple output paths", err);
 }
+
+TEST_F(DepfileParserTest, SameAsRe2c) {
+  // Parse() and ParseRe2c() must agree on everything, wherever the special
+  // characters fall relative to the 16-byte blocks Parse() looks at.
+  const char kChars[] = "aZ09_./-+:~()%@=!{}\x80\xff \t\r\n\\$#*[]|&\"';<>?^`";
+  unsigned seed = 1;
+  for (int i = 0; i < 20000; ++i) {
+    string input;
+    seed = seed * 1103515245 + 12345;
+    size_t len = (seed >> 16) % 80;
+    for (size_t j = 0; j < len; ++j) {
+      seed = seed * 1103515245 + 12345;
+      // Mostly plain characters, like real depfiles.
+      size_t c = (seed >> 16) % 4 ? (seed >> 20) % 18
+                                  : (seed >> 20) % (sizeof(kChars) - 1);
+      input += kChars[c];
+    }
+
+    string fast_input = input;
+    string fast_err;
+    DepfileParser fast;
+    bool fast_ok = fast.Parse(&fast_input, &fast_err);
+
+    string re2c_input = input;
+    string re2c_err;
+    DepfileParser re2c;
+    bool re2c_ok = re2c.ParseRe2c(&re2c_input, &re2c_err);
+
+    ASSERT_EQ(re2c_ok, fast_ok);
+    ASSERT_EQ(re2c_err, fast_err);
+    ASSERT_EQ(re2c.out_.AsString(), fast.out_.AsString());
+    ASSERT_EQ(re2c.ins_.size(), fast.ins_.size());
+    for (size_t j = 0; j < re2c.ins_.size(); ++j)
+      ASSERT_EQ(re2c.ins_[j].AsString(), fast.ins_[j].AsString());
+  }
+}
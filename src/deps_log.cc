@@ -25,7 +25,14 @@ typedef __int32 int32_t;
 typedef unsigned __int32 uint32_t;
 #endif
 
+#include <algorithm>
+#include <new>
+#include <set>
+
+#include "content_hash.h"
+#include "disk_interface.h"
 #include "graph.h"
+#include "memory_stats.h"
 #include "metrics.h"
 #include "state.h"
 #include "util.h"
@@ -33,29 +40,341 @@ typedef unsigned __int32 uint32_t;
 // The version is stored as 4 bytes after the signature and also serves as a
 // byte order mark. Signature and version combined are 16 bytes long.
 const char kFileSignature[] = "# ninjadeps\n";
-const int kCurrentVersion = 4;
+const int kOldestSupportedVersion = 4;
+const int kCurrentVersion = 5;
 
 // Record size is currently limited to less than the full 32 bit, due to
 // internal buffers having to have this size.
 const unsigned kMaxRecordSize = (1 << 19) - 1;
 
+// The reverse index is the signature, a version, the size of the log it
+// was written for, a hash of that log's last kIndexCheckSize bytes and the
+// number of inputs N, then N + 1 indices into a list of output ids at
+// which the outputs of each input start, then that list.
+const char kIndexSignature[] = "# ninjardeps\n";
+const int kIndexVersion = 1;
+const size_t kIndexHeaderSize = sizeof(kIndexSignature) - 1 + 4 + 8 + 8 + 4;
+const size_t kIndexCheckSize = 4096;
+
+namespace {
+
+/// The number of deps in the deps record whose data (after the size) starts
+/// at |deps_data|.
+int RecordDepsCount(const int* deps_data) {
+  unsigned size;
+  memcpy(&size, deps_data - 1, 4);
+  return ((size & 0x7FFFFFFF) / 4) - 3;
+}
+
+/// The output mtime of the deps record whose data starts at |deps_data|.
+TimeStamp RecordDepsMtime(const int* deps_data) {
+  return (TimeStamp)(((uint64_t)(unsigned int)deps_data[2] << 32) |
+                     (uint64_t)(unsigned int)deps_data[1]);
+}
+
+void AppendVarint(string* out, uint64_t value) {
+  for (; value >= 0x80; value >>= 7)
+    out->push_back((char)(value | 0x80));
+  out->push_back((char)value);
+}
+
+/// Read the varint at |*p|, advancing past it.  Returns false if it doesn't
+/// end before |end|.
+bool ReadVarint(const unsigned char** p, const unsigned char* end,
+                uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// The varints of the version 5 deps record at |deps_data|, or if it
+/// shares the list of an earlier record, that record's.  The caller
+/// checked that the record is well-formed.
+void RecordIdList(const int* deps_data, const unsigned char** begin,
+                  const unsigned char** end) {
+  for (;;) {
+    unsigned size;
+    memcpy(&size, deps_data - 1, 4);
+    *begin = reinterpret_cast<const unsigned char*>(deps_data) + 12;
+    *end = reinterpret_cast<const unsigned char*>(deps_data) +
+        (size & 0x7FFFFFFF);
+    const unsigned char* p = *begin;
+    uint64_t header = 0, distance = 0;
+    ReadVarint(&p, *end, &header);
+    if (!(header & 1))
+      return;
+    ReadVarint(&p, *end, &distance);
+    deps_data = reinterpret_cast<const int*>(
+        reinterpret_cast<const char*>(deps_data - 1) - distance) + 1;
+  }
+}
+
+/// Check the id list of the version 5 deps record of |size| bytes at
+/// |offset| in |data|: that its ids fit in it, or that it refers back to
+/// a deps record that has its own list.
+bool ValidateIdList(const char* data, size_t offset, unsigned size) {
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(data + offset + 4 + 12);
+  const unsigned char* end =
+      reinterpret_cast<const unsigned char*>(data + offset + 4 + size);
+  uint64_t header;
+  if (!ReadVarint(&p, end, &header))
+    return false;
+  if (!(header & 1))
+    return (header >> 1) <= (uint64_t)(end - p);
+  uint64_t distance;
+  if (!ReadVarint(&p, end, &distance) || distance == 0 || distance % 4 ||
+      distance > offset)
+    return false;
+  size_t shared = offset - distance;
+  unsigned shared_size;
+  memcpy(&shared_size, data + shared, 4);
+  if (!(shared_size >> 31) || (shared_size & 0x7FFFFFFF) < 13 ||
+      (shared_size & 0x7FFFFFFF) > distance - 4)
+    return false;
+  p = reinterpret_cast<const unsigned char*>(data + shared + 4 + 12);
+  end = reinterpret_cast<const unsigned char*>(data + shared + 4 +
+                                               (shared_size & 0x7FFFFFFF));
+  uint64_t shared_header;
+  return ReadVarint(&p, end, &shared_header) && shared_header == header - 1 &&
+         (shared_header >> 1) <= (uint64_t)(end - p);
+}
+
+string DependentsPath(const string& log_path) {
+  return log_path + ".rdeps";
+}
+
+uint64_t HashLogEnd(const char* data, uint64_t size) {
+  uint64_t start = size > kIndexCheckSize ? size - kIndexCheckSize : 0;
+  return ContentHash::Hash(data + start, size - start);
+}
+
+uint32_t Read4(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, 4);
+  return value;
+}
+
+bool NodeIdLess(const Node* a, const Node* b) {
+  return a->id() < b->id();
+}
+
+bool WriteHeader(FILE* f) {
+  return fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) == 1 &&
+      fwrite(&kCurrentVersion, 4, 1, f) == 1;
+}
+
+void Append4(string* out, const void* data) {
+  out->append(static_cast<const char*>(data), 4);
+}
+
+/// Append the record giving |path| the id |id| to |out|.
+bool FormatPathRecord(string* out, StringPiece path, int id) {
+  int path_size = path.size();
+  int padding = (4 - path_size % 4) % 4;  // Pad path to 4 byte boundary.
+
+  unsigned size = path_size + padding + 4;
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+  Append4(out, &size);
+  out->append(path.str_, path_size);
+  out->append(padding, '\0');
+  unsigned checksum = ~(unsigned)id;
+  Append4(out, &checksum);
+  return true;
+}
+
+/// Append the record giving the output with id |out_id| the deps |ids| to
+/// |out|, in the format of |version|.  If |shared| isn't 0, the record
+/// shares the list of the record that starts |shared| bytes before it.
+bool FormatDepsRecord(string* out, int version, int out_id, TimeStamp mtime,
+                      int node_count, const int* ids, uint64_t shared) {
+  string list;
+  if (version >= 5) {
+    AppendVarint(&list, (uint64_t)node_count * 2 + (shared ? 1 : 0));
+    if (shared) {
+      AppendVarint(&list, shared);
+    } else {
+      int64_t previous = 0;
+      for (int i = 0; i < node_count; ++i) {
+        int64_t delta = ids[i] - previous;
+        AppendVarint(&list, (uint64_t)((delta << 1) ^ (delta >> 63)));
+        previous = ids[i];
+      }
+    }
+    list.append((4 - list.size() % 4) % 4, '\0');
+  } else if (node_count) {
+    list.assign(reinterpret_cast<const char*>(ids), 4 * node_count);
+  }
+  unsigned size = 4 * (1 + 2) + list.size();
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+  size |= 0x80000000;  // Deps record: set high bit.
+  Append4(out, &size);
+  Append4(out, &out_id);
+  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
+  Append4(out, &mtime_part);
+  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
+  Append4(out, &mtime_part);
+  out->append(list);
+  return true;
+}
+
+bool WriteRecord(FILE* f, const string& record) {
+  return fwrite(record.data(), 1, record.size(), f) == record.size();
+}
+
+/// Write the record giving |path| the id |id|.
+bool WritePathRecord(FILE* f, StringPiece path, int id) {
+  string record;
+  return FormatPathRecord(&record, path, id) && WriteRecord(f, record);
+}
+
+/// Write the record giving the output with id |out_id| the deps |ids|,
+/// sharing a list of |shared_lists| if one is the same.
+bool WriteDepsRecord(FILE* f, int out_id, TimeStamp mtime, int node_count,
+                     const int* ids, SharedDepsLists* shared_lists) {
+  long offset = ftell(f);
+  if (offset < 0)
+    return false;
+  uint64_t shared = shared_lists->Share(node_count, ids, offset);
+  string record;
+  return FormatDepsRecord(&record, kCurrentVersion, out_id, mtime,
+                          node_count, ids, shared) &&
+         WriteRecord(f, record);
+}
+
+}  // anonymous namespace
+
+uint64_t SharedDepsLists::Share(int node_count, const int* ids,
+                                uint64_t offset) {
+  // A reference takes a few bytes, as do a few ids.
+  const int kMinSharedCount = 4;
+  if (node_count < kMinSharedCount)
+    return 0;
+  // 64-bit FNV-1a.
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < node_count; ++i) {
+    hash ^= (uint32_t)ids[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= (uint32_t)node_count;
+  hash *= 1099511628211ULL;
+  pair<map<uint64_t, uint64_t>::iterator, bool> inserted =
+      offsets_.insert(make_pair(hash, offset));
+  return inserted.second ? 0 : offset - inserted.first->second;
+}
+
+/// A recompaction running on a background thread.  It writes the live
+/// entries of a snapshot of the log to a new file, numbering the nodes
+/// afresh, while the build keeps appending to the old file.  Only paths and
+/// the ids the snapshot's nodes already have are read from the graph, and
+/// neither changes while the thread runs.
+struct DepsLog::Compaction {
+  string path;
+  string temp_path;
+
+  /// The snapshot, indexed by old id.  Dead entries are NULL.  The deps
+  /// that the build replaces stay in the log's arena, so these stay valid.
+  vector<Node*> nodes;
+  vector<Deps*> deps;
+
+  /// Filled in by the thread: the nodes by new id, and the new id of each
+  /// old one, or -1 if it was dropped.
+  vector<Node*> new_nodes;
+  vector<int> new_ids;
+  bool ok;
+  /// The errno of the thread's failure.
+  int error;
+
+  /// The outputs whose deps were recorded during the build.
+  vector<Node*> recorded;
+
+  /// The lists the new log has.
+  SharedDepsLists shared_lists;
+
+  Thread thread;
+
+  static void Run(void* compaction) {
+    static_cast<Compaction*>(compaction)->Write();
+  }
+
+  void Write() {
+    new_ids.assign(nodes.size(), -1);
+    FILE* f = fopen(temp_path.c_str(), "wb");
+    ok = f && WriteHeader(f) && WriteRecords(f);
+    if (f)
+      ok = fclose(f) == 0 && ok;
+    error = errno;
+  }
+
+  bool WriteRecords(FILE* f) {
+    vector<int> ids;
+    for (size_t old_id = 0; old_id < deps.size(); ++old_id) {
+      Deps* entry = deps[old_id];
+      if (!entry)
+        continue;
+      if (new_ids[old_id] < 0 && !AssignId(f, old_id))
+        return false;
+      ids.resize(entry->node_count);
+      for (int i = 0; i < entry->node_count; ++i) {
+        int dep_id = entry->nodes[i]->id();
+        if (new_ids[dep_id] < 0 && !AssignId(f, dep_id))
+          return false;
+        ids[i] = new_ids[dep_id];
+      }
+      if (!WriteDepsRecord(f, new_ids[old_id], entry->mtime,
+                           entry->node_count, ids.empty() ? NULL : &ids[0],
+                           &shared_lists)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Give the node with the old id |old_id| the next new id.
+  bool AssignId(FILE* f, int old_id) {
+    new_ids[old_id] = new_nodes.size();
+    new_nodes.push_back(nodes[old_id]);
+    return WritePathRecord(f, nodes[old_id]->path(), new_ids[old_id]);
+  }
+};
+
+DepsLog::DepsLog()
+    : needs_recompaction_(false), file_(NULL), compaction_(NULL),
+      stale_deps_(0), version_(kCurrentVersion), log_size_(0),
+      dependents_(NULL), dependents_count_(0) {}
+
 DepsLog::~DepsLog() {
   Close();
 }
 
 bool DepsLog::OpenForWrite(const string& path, string* err) {
   if (needs_recompaction_) {
-    if (!Recompact(path, err))
+    needs_recompaction_ = false;
+    if (!StartRecompaction(path) && !Recompact(path, err))
       return false;
   }
-  
+
+
   file_ = fopen(path.c_str(), "ab");
   if (!file_) {
     *err = strerror(errno);
     return false;
   }
-  // Set the buffer size to this and flush the file buffer after every record
-  // to make sure records aren't written partially.
+  // Set the buffer size to this and flush the file buffer after every commit
+  // to make sure records aren't written partially, as far as possible.
   setvbuf(file_, NULL, _IOFBF, kMaxRecordSize + 1);
   SetCloseOnExec(fileno(file_));
 
@@ -64,11 +383,8 @@ bool DepsLog::OpenForWrite(const string& path, string* err) {
   fseek(file_, 0, SEEK_END);
 
   if (ftell(file_) == 0) {
-    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, file_) < 1) {
-      *err = strerror(errno);
-      return false;
-    }
-    if (fwrite(&kCurrentVersion, 4, 1, file_) < 1) {
+    version_ = kCurrentVersion;
+    if (!WriteHeader(file_)) {
       *err = strerror(errno);
       return false;
     }
@@ -77,6 +393,9 @@ bool DepsLog::OpenForWrite(const string& path, string* err) {
     *err = strerror(errno);
     return false;
   }
+  log_size_ = ftell(file_);
+  shared_lists_.Clear();
+  writer_.Start(file_, commit_policy_);
   return true;
 }
 
@@ -90,16 +409,18 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
                          int node_count, Node** nodes) {
   // Track whether there's any new data to be recorded.
   bool made_change = false;
+  // The records to write, committed together.
+  string record;
 
   // Assign ids to all nodes that are missing one.
   if (node->id() < 0) {
-    if (!RecordId(node))
+    if (!RecordId(node, &record))
       return false;
     made_change = true;
   }
   for (int i = 0; i < node_count; ++i) {
     if (nodes[i]->id() < 0) {
-      if (!RecordId(nodes[i]))
+      if (!RecordId(nodes[i], &record))
         return false;
       made_change = true;
     }
@@ -127,41 +448,44 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
     return true;
 
   // Update on-disk representation.
-  unsigned size = 4 * (1 + 2 + node_count);
-  if (size > kMaxRecordSize) {
-    errno = ERANGE;
-    return false;
+  vector<int> ids(node_count);
+  for (int i = 0; i < node_count; ++i)
+    ids[i] = nodes[i]->id();
+  uint64_t shared = 0;
+  if (version_ >= 5) {
+    shared = shared_lists_.Share(node_count, ids.empty() ? NULL : &ids[0],
+                                 log_size_ + record.size());
   }
-  size |= 0x80000000;  // Deps record: set high bit.
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  int id = node->id();
-  if (fwrite(&id, 4, 1, file_) < 1)
+  if (!FormatDepsRecord(&record, version_, node->id(), mtime, node_count,
+                        ids.empty() ? NULL : &ids[0], shared) ||
+      !writer_.Append(record)) {
     return false;
-  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
-    return false;
-  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
-    return false;
-  for (int i = 0; i < node_count; ++i) {
-    id = nodes[i]->id();
-    if (fwrite(&id, 4, 1, file_) < 1)
-      return false;
   }
-  if (fflush(file_) != 0)
-    return false;
+  log_size_ += record.size();
 
   // Update in-memory representation.
-  Deps* deps = new Deps(mtime, node_count);
+  Deps* deps = NewDeps(&arena_, mtime, node_count);
   for (int i = 0; i < node_count; ++i)
     deps->nodes[i] = nodes[i];
   UpdateDeps(node->id(), deps);
+  if (compaction_)
+    compaction_->recorded.push_back(node);
+  if (dependents_) {
+    if (node->id() >= (int)recorded_outputs_.size())
+      recorded_outputs_.resize(node->id() + 1);
+    recorded_outputs_[node->id()] = true;
+    for (int i = 0; i < node_count; ++i)
+      recorded_dependents_[nodes[i]->id()].insert(node->id());
+  }
 
   return true;
 }
 
 void DepsLog::Close() {
+  if (!writer_.Stop())
+    Warning("writing deps log: %s", strerror(errno));
+  if (compaction_)
+    FinishRecompaction();
   if (file_)
     fclose(file_);
   file_ = NULL;
@@ -169,85 +493,95 @@ void DepsLog::Close() {
 
 bool DepsLog::Load(const string& path, State* state, string* err) {
   METRIC_RECORD(".ninja_deps load");
-  char buf[kMaxRecordSize + 1];
-  FILE* f = fopen(path.c_str(), "rb");
-  if (!f) {
-    if (errno == ENOENT)
-      return true;
-    *err = strerror(errno);
-    return false;
+  // The deps of an earlier load can't stay in a file that's unmapped.
+  LoadAllDeps();
+  MappedFile& file = mapped_;
+  int ret = file.Map(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
   }
+  if (ret < 0)
+    return false;
 
-  bool valid_header = true;
+  const size_t kSignatureSize = sizeof(kFileSignature) - 1;
+  const size_t kHeaderSize = kSignatureSize + 4;
+  bool valid_header = file.size() >= kHeaderSize &&
+      memcmp(file.data(), kFileSignature, kSignatureSize) == 0;
   int version = 0;
-  if (!fgets(buf, sizeof(buf), f) || fread(&version, 4, 1, f) < 1)
-    valid_header = false;
+  if (valid_header)
+    memcpy(&version, file.data() + kSignatureSize, 4);
   // Note: For version differences, this should migrate to the new format.
   // But the v1 format could sometimes (rarely) end up with invalid data, so
   // don't migrate v1 to v3 to force a rebuild. (v2 only existed for a few days,
   // and there was no release with it, so pretend that it never happened.)
-  if (!valid_header || strcmp(buf, kFileSignature) != 0 ||
-      version != kCurrentVersion) {
+  // v4 logs are read, and recompacted into the current version.
+  if (!valid_header || version < kOldestSupportedVersion ||
+      version > kCurrentVersion) {
     if (version == 1)
       *err = "deps log version change; rebuilding";
     else
       *err = "bad deps log signature or version; starting over";
-    fclose(f);
+    file.Unmap();
     unlink(path.c_str());
+    version_ = kCurrentVersion;
     // Don't report this as a failure.  An empty deps log will cause
     // us to rebuild the outputs anyway.
     return true;
   }
+  version_ = version;
 
-  long offset;
+  // First find the path records and the last deps record for each output;
+  // the earlier ones are dead.  All records are a multiple of 4 bytes long,
+  // so the mapped data stays aligned for reading ints in place.
+  const char* data = file.data();
+  size_t offset = kHeaderSize;
   bool read_failed = false;
   int unique_dep_record_count = 0;
   int total_dep_record_count = 0;
-  for (;;) {
-    offset = ftell(f);
-
+  vector<const int*> latest_deps;
+  for (; offset < file.size(); ) {
     unsigned size;
-    if (fread(&size, 4, 1, f) < 1) {
-      if (!feof(f))
-        read_failed = true;
+    if (file.size() - offset < 4) {
+      read_failed = true;
       break;
     }
+    memcpy(&size, data + offset, 4);
     bool is_deps = (size >> 31) != 0;
     size = size & 0x7FFFFFFF;
 
-    if (size > kMaxRecordSize || fread(buf, size, 1, f) < 1) {
+    if (size > kMaxRecordSize || size % 4 != 0 ||
+        file.size() - offset - 4 < size) {
       read_failed = true;
       break;
     }
+    const char* record = data + offset + 4;
 
     if (is_deps) {
-      assert(size % 4 == 0);
-      int* deps_data = reinterpret_cast<int*>(buf);
-      int out_id = deps_data[0];
-      TimeStamp mtime;
-      mtime = (TimeStamp)(((uint64_t)(unsigned int)deps_data[2] << 32) |
-                          (uint64_t)(unsigned int)deps_data[1]);
-      deps_data += 3;
-      int deps_count = (size / 4) - 3;
-
-      Deps* deps = new Deps(mtime, deps_count);
-      for (int i = 0; i < deps_count; ++i) {
-        assert(deps_data[i] < (int)nodes_.size());
-        assert(nodes_[deps_data[i]]);
-        deps->nodes[i] = nodes_[deps_data[i]];
+      const int* deps_data = reinterpret_cast<const int*>(record);
+      if (size < 12 || deps_data[0] < 0 ||
+          (version >= 5 && !ValidateIdList(data, offset, size))) {
+        read_failed = true;
+        break;
       }
-
-      total_dep_record_count++;
-      if (!UpdateDeps(out_id, deps))
+      size_t out_id = deps_data[0];
+      if (out_id >= latest_deps.size())
+        latest_deps.resize(out_id + 1);
+      if (!latest_deps[out_id])
         ++unique_dep_record_count;
+      latest_deps[out_id] = deps_data;
+      total_dep_record_count++;
     } else {
       int path_size = size - 4;
-      assert(path_size > 0);  // CanonicalizePath() rejects empty paths.
+      if (path_size <= 0) {  // CanonicalizePath() rejects empty paths.
+        read_failed = true;
+        break;
+      }
       // There can be up to 3 bytes of padding.
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      StringPiece subpath(buf, path_size);
+      if (record[path_size - 1] == '\0') --path_size;
+      if (record[path_size - 1] == '\0') --path_size;
+      if (record[path_size - 1] == '\0') --path_size;
+      StringPiece subpath(record, path_size);
       // It is not necessary to pass in a correct slash_bits here. It will
       // either be a Node that's in the manifest (in which case it will already
       // have a correct slash_bits that GetNode will look up), or it is an
@@ -259,7 +593,8 @@ bool DepsLog::Load(const string& path, State* state, string* err) {
       // happen if two ninja processes write to the same deps log concurrently.
       // (This uses unary complement to make the checksum look less like a
       // dependency record entry.)
-      unsigned checksum = *reinterpret_cast<unsigned*>(buf + size - 4);
+      unsigned checksum;
+      memcpy(&checksum, record + size - 4, 4);
       int expected_id = ~checksum;
       int id = nodes_.size();
       if (id != expected_id) {
@@ -271,17 +606,30 @@ bool DepsLog::Load(const string& path, State* state, string* err) {
       node->set_id(id);
       nodes_.push_back(node);
     }
+    offset += 4 + size;
+  }
+
+  // Then remember where the live deps are, for GetDeps() to read them.
+  if (latest_deps.size() > deps_.size())
+    deps_.resize(latest_deps.size());
+  if (latest_deps.size() > unloaded_.size())
+    unloaded_.resize(latest_deps.size());
+  bool any_deps = false;
+  for (size_t out_id = 0; out_id < latest_deps.size(); ++out_id) {
+    if (!latest_deps[out_id])
+      continue;
+    UpdateDeps(out_id, NULL);
+    unloaded_[out_id] = latest_deps[out_id];
+    any_deps = true;
   }
+  if (!any_deps)
+    file.Unmap();
 
   if (read_failed) {
     // An error occurred while loading; try to recover by truncating the
     // file to the last fully-read record.
-    if (ferror(f)) {
-      *err = strerror(ferror(f));
-    } else {
-      *err = "premature end of file";
-    }
-    fclose(f);
+    *err = "premature end of file";
+    LoadAllDeps();
 
     if (!Truncate(path, offset, err))
       return false;
@@ -292,12 +640,13 @@ bool DepsLog::Load(const string& path, State* state, string* err) {
     return true;
   }
 
-  fclose(f);
-
-  // Rebuild the log if there are too many dead records.
+  // Rebuild the log if it's in an older format or if there are too many
+  // dead records.
   int kMinCompactionEntryCount = 1000;
   int kCompactionRatio = 3;
-  if (total_dep_record_count > kMinCompactionEntryCount &&
+  if (version < kCurrentVersion) {
+    needs_recompaction_ = true;
+  } else if (total_dep_record_count > kMinCompactionEntryCount &&
       total_dep_record_count > unique_dep_record_count * kCompactionRatio) {
     needs_recompaction_ = true;
   }
@@ -308,14 +657,115 @@ bool DepsLog::Load(const string& path, State* state, string* err) {
 DepsLog::Deps* DepsLog::GetDeps(Node* node) {
   // Abort if the node has no id (never referenced in the deps) or if
   // there's no deps recorded for the node.
-  if (node->id() < 0 || node->id() >= (int)deps_.size())
+  int id = node->id();
+  if (id < 0 || id >= (int)deps_.size())
     return NULL;
-  return deps_[node->id()];
+  if (!deps_[id] && id < (int)unloaded_.size() && unloaded_[id])
+    return LoadDeps(id);
+  return deps_[id];
+}
+
+DepsLog::Deps* DepsLog::LoadDeps(int out_id) {
+  const int* deps_data = unloaded_[out_id];
+  unloaded_[out_id] = NULL;
+  Deps* deps;
+  if (version_ >= 5) {
+    const unsigned char* p;
+    const unsigned char* end;
+    RecordIdList(deps_data, &p, &end);
+    uint64_t header = 0;
+    ReadVarint(&p, end, &header);
+    int deps_count = (int)(header >> 1);
+    deps = NewDeps(&arena_, RecordDepsMtime(deps_data), deps_count);
+    int64_t id = 0;
+    for (int i = 0; i < deps_count; ++i) {
+      uint64_t delta = 0;
+      ReadVarint(&p, end, &delta);
+      id += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+      assert(id >= 0 && id < (int64_t)nodes_.size());
+      assert(nodes_[id]);
+      deps->nodes[i] = nodes_[id];
+    }
+  } else {
+    int deps_count = RecordDepsCount(deps_data);
+    deps = NewDeps(&arena_, RecordDepsMtime(deps_data), deps_count);
+    deps_data += 3;
+    for (int i = 0; i < deps_count; ++i) {
+      assert(deps_data[i] < (int)nodes_.size());
+      assert(nodes_[deps_data[i]]);
+      deps->nodes[i] = nodes_[deps_data[i]];
+    }
+  }
+  deps_[out_id] = deps;
+  return deps;
+}
+
+void DepsLog::LoadAllDeps() {
+  for (size_t out_id = 0; out_id < unloaded_.size(); ++out_id) {
+    if (unloaded_[out_id])
+      LoadDeps(out_id);
+  }
+  unloaded_.clear();
+  mapped_.Unmap();
+}
+
+void DepsLog::ReportMemory(MemoryStats* stats) const {
+  // The deps not read yet are still in the mapped log.
+  // The replaced deps are counted with the live ones, which they share the
+  // arena with.
+  size_t count = stale_deps_;
+  for (vector<Deps*>::const_iterator i = deps_.begin(); i != deps_.end();
+       ++i) {
+    if (*i)
+      ++count;
+  }
+  stats->Add("deps log deps", count, arena_.bytes_allocated());
+  stats->Add("deps log index", nodes_.size(),
+             MemoryStats::VectorBytes(nodes_) +
+             MemoryStats::VectorBytes(deps_) +
+             MemoryStats::VectorBytes(unloaded_));
+  stats->Add("mapped logs", mapped_.data() ? 1 : 0, mapped_.size());
+}
+
+int DepsLog::Restat(const DiskInterface& disk_interface,
+                    const vector<string>& outputs) {
+  METRIC_RECORD(".ninja_deps restat");
+  LoadAllDeps();
+  set<string> wanted(outputs.begin(), outputs.end());
+  vector<Deps*> restatted;
+  vector<string> paths;
+  for (int id = 0; id < (int)deps_.size(); ++id) {
+    if (!deps_[id] || !IsDepsEntryLiveFor(nodes_[id]))
+      continue;
+    string path = nodes_[id]->path().AsString();
+    if (!wanted.empty() && wanted.find(path) == wanted.end())
+      continue;
+    restatted.push_back(deps_[id]);
+    paths.push_back(path);
+  }
+
+  vector<const string*> path_ptrs;
+  for (vector<string>::const_iterator p = paths.begin(); p != paths.end();
+       ++p) {
+    path_ptrs.push_back(&*p);
+  }
+  vector<TimeStamp> mtimes;
+  disk_interface.StatMany(path_ptrs, &mtimes);
+
+  int changed = 0;
+  for (size_t i = 0; i < restatted.size(); ++i) {
+    if (mtimes[i] <= 0 || mtimes[i] == restatted[i]->mtime)
+      continue;
+    restatted[i]->mtime = mtimes[i];
+    ++changed;
+  }
+  return changed;
 }
 
 bool DepsLog::Recompact(const string& path, string* err) {
   METRIC_RECORD(".ninja_deps recompact");
 
+  LoadAllDeps();
   Close();
   string temp_path = path + ".recompact";
 
@@ -349,9 +799,15 @@ bool DepsLog::Recompact(const string& path, string* err) {
 
   new_log.Close();
 
-  // All nodes now have ids that refer to new_log, so steal its data.
+  // All nodes now have ids that refer to new_log, so steal its data.  Its
+  // arena has the live deps only.
   deps_.swap(new_log.deps_);
   nodes_.swap(new_log.nodes_);
+  arena_.Swap(&new_log.arena_);
+  stale_deps_ = 0;
+  version_ = kCurrentVersion;
+  ClearDependents();
+  unlink(DependentsPath(path).c_str());
 
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
@@ -366,6 +822,127 @@ bool DepsLog::Recompact(const string& path, string* err) {
   return true;
 }
 
+bool DepsLog::StartRecompaction(const string& path) {
+  METRIC_RECORD(".ninja_deps recompact start");
+  LoadAllDeps();
+  Compaction* compaction = new Compaction;
+  compaction->path = path;
+  compaction->temp_path = path + ".recompact";
+  compaction->nodes = nodes_;
+  compaction->deps.resize(deps_.size());
+  for (size_t id = 0; id < deps_.size(); ++id) {
+    if (deps_[id] && IsDepsEntryLiveFor(nodes_[id]))
+      compaction->deps[id] = deps_[id];
+  }
+  if (!compaction->thread.Start(Compaction::Run, compaction)) {
+    delete compaction;
+    return false;
+  }
+  compaction_ = compaction;
+  return true;
+}
+
+void DepsLog::FinishRecompaction() {
+  METRIC_RECORD(".ninja_deps recompact finish");
+  Compaction* compaction = compaction_;
+  compaction_ = NULL;
+  compaction->thread.Join();
+
+  // Everything the build recorded is in the old log, so on failure it's
+  // simply kept.
+  if (file_)
+    fclose(file_);
+  file_ = NULL;
+  if (!compaction->ok)
+    errno = compaction->error;
+  if (!compaction->ok || !SwapInRecompaction(compaction)) {
+    Warning("recompacting %s: %s; keeping the old log",
+            compaction->path.c_str(), strerror(errno));
+    unlink(compaction->temp_path.c_str());
+  }
+  delete compaction;
+}
+
+bool DepsLog::SwapInRecompaction(Compaction* compaction) {
+  // Append the deps that the build recorded to the new log, giving ids
+  // to the nodes the compacted log doesn't have yet.
+  vector<Node*>& new_nodes = compaction->new_nodes;
+  vector<int>& new_ids = compaction->new_ids;
+  new_ids.resize(nodes_.size(), -1);
+  vector<bool> recorded(nodes_.size());
+  FILE* f = fopen(compaction->temp_path.c_str(), "ab");
+  if (!f)
+    return false;
+  // The shared lists refer back by offset, so ftell() must be right.
+  fseek(f, 0, SEEK_END);
+  vector<int> ids;
+  for (vector<Node*>::iterator i = compaction->recorded.begin();
+       i != compaction->recorded.end(); ++i) {
+    int out_id = (*i)->id();
+    if (recorded[out_id])
+      continue;
+    recorded[out_id] = true;
+    Deps* deps = deps_[out_id];
+    ids.resize(deps->node_count + 1);
+    for (int n = 0; n <= deps->node_count; ++n) {
+      Node* node = n < deps->node_count ? deps->nodes[n] : *i;
+      int& new_id = new_ids[node->id()];
+      if (new_id < 0) {
+        new_id = new_nodes.size();
+        new_nodes.push_back(node);
+        if (!WritePathRecord(f, node->path(), new_id)) {
+          fclose(f);
+          return false;
+        }
+      }
+      ids[n] = new_id;
+    }
+    if (!WriteDepsRecord(f, ids.back(), deps->mtime, deps->node_count,
+                         &ids[0], &compaction->shared_lists)) {
+      fclose(f);
+      return false;
+    }
+  }
+  if (fclose(f) != 0)
+    return false;
+
+#ifdef _WIN32
+  unlink(compaction->path.c_str());
+#endif
+  if (rename(compaction->temp_path.c_str(), compaction->path.c_str()) < 0)
+    return false;
+
+  // Switch the in-memory log over to the new ids, copying what the new log
+  // has into a fresh arena and dropping the rest.
+  vector<Deps*> new_deps(new_nodes.size());
+  Arena new_arena;
+  for (size_t old_id = 0; old_id < deps_.size(); ++old_id) {
+    Deps* deps = deps_[old_id];
+    if (!deps)
+      continue;
+    bool kept = recorded[old_id] ||
+        (old_id < compaction->deps.size() && compaction->deps[old_id]);
+    if (!kept)
+      continue;
+    Deps* copy = NewDeps(&new_arena, deps->mtime, deps->node_count);
+    for (int i = 0; i < deps->node_count; ++i)
+      copy->nodes[i] = deps->nodes[i];
+    new_deps[new_ids[old_id]] = copy;
+  }
+  for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
+    (*i)->set_id(-1);
+  for (size_t id = 0; id < new_nodes.size(); ++id)
+    new_nodes[id]->set_id(id);
+  nodes_.swap(new_nodes);
+  deps_.swap(new_deps);
+  arena_.Swap(&new_arena);
+  stale_deps_ = 0;
+  version_ = kCurrentVersion;
+  ClearDependents();
+  unlink(DependentsPath(compaction->path).c_str());
+  return true;
+}
+
 bool DepsLog::IsDepsEntryLiveFor(Node* node) {
   // Skip entries that don't have in-edges or whose edges don't have a
   // "deps" attribute. They were in the deps log from previous builds, but
@@ -373,42 +950,210 @@ bool DepsLog::IsDepsEntryLiveFor(Node* node) {
   // entries are no longer needed.
   // (Without the check for "deps", a chain of two or more nodes that each
   // had deps wouldn't be collected in a single recompaction.)
-  return node->in_edge() && !node->in_edge()->GetBinding("deps").empty();
+  return node->in_edge() &&
+      !node->in_edge()->GetBinding(VarNames::kDeps).empty();
+}
+
+bool DepsLog::LoadDependents(const string& path, string* err) {
+  METRIC_RECORD(".ninja_deps index load");
+  ClearDependents();
+
+  MappedFile log;
+  int ret = log.Map(path, err);
+  if (ret < 0 && ret != -ENOENT)
+    return false;
+  err->clear();
+
+  // Check that the index was written for the log as it was up to some
+  // point, and find the outputs recorded since.
+  string index_path = DependentsPath(path);
+  MappedFile& index = dependents_file_;
+  bool valid = false;
+  int count = 0;
+  vector<bool> stale;
+  string index_err;
+  const size_t kSignatureSize = sizeof(kIndexSignature) - 1;
+  if (log.size() > 0 && index.Map(index_path, &index_err) >= 0 &&
+      index.size() >= kIndexHeaderSize &&
+      memcmp(index.data(), kIndexSignature, kSignatureSize) == 0) {
+    const char* header = index.data() + kSignatureSize;
+    uint64_t log_size, log_hash;
+    memcpy(&log_size, header + 4, 8);
+    memcpy(&log_hash, header + 12, 8);
+    count = (int)Read4(header + 20);
+    uint64_t lists_size = 4 * ((uint64_t)count + 1);
+    valid = (int)Read4(header) == kIndexVersion && count >= 0 &&
+        count <= (int)nodes_.size() && log_size <= log.size() &&
+        HashLogEnd(log.data(), log_size) == log_hash &&
+        index.size() - kIndexHeaderSize >= lists_size &&
+        index.size() - kIndexHeaderSize - lists_size ==
+            4 * (uint64_t)Read4(index.data() + kIndexHeaderSize + 4 * count);
+    for (uint64_t offset = log_size; valid && offset + 4 <= log.size(); ) {
+      unsigned size = Read4(log.data() + offset);
+      bool is_deps = (size >> 31) != 0;
+      size &= 0x7FFFFFFF;
+      if (log.size() - offset - 4 < size)
+        break;
+      int out_id = is_deps && size >= 4 ?
+          (int)Read4(log.data() + offset + 4) : -1;
+      if (out_id >= 0) {
+        if (out_id >= (int)stale.size())
+          stale.resize(out_id + 1);
+        stale[out_id] = true;
+      }
+      offset += 4 + size;
+    }
+    if (valid && stale.empty()) {
+      dependents_ = index.data();
+      dependents_count_ = count;
+      return true;
+    }
+  }
+
+  // Otherwise rebuild it: from the deps of the recorded outputs and the
+  // rest of the old index, or from all the deps.
+  vector<vector<int> > lists(nodes_.size());
+  vector<bool> unsorted(nodes_.size());
+  if (valid) {
+    const char* starts = index.data() + kIndexHeaderSize;
+    const char* outs = starts + 4 * (count + 1);
+    for (int in = 0; in < count; ++in) {
+      for (uint32_t i = Read4(starts + 4 * in);
+           i < Read4(starts + 4 * (in + 1)); ++i) {
+        int out = (int)Read4(outs + 4 * i);
+        if (out >= 0 && out < (int)nodes_.size() &&
+            !(out < (int)stale.size() && stale[out])) {
+          lists[in].push_back(out);
+        }
+      }
+    }
+  }
+  for (int out = 0; out < (int)deps_.size(); ++out) {
+    if (valid && !(out < (int)stale.size() && stale[out]))
+      continue;
+    Deps* deps = GetDeps(nodes_[out]);
+    if (!deps)
+      continue;
+    for (int i = 0; i < deps->node_count; ++i) {
+      int in = deps->nodes[i]->id();
+      lists[in].push_back(out);
+      unsorted[in] = valid;
+    }
+  }
+
+  string& data = dependents_data_;
+  data.assign(kIndexSignature, kSignatureSize);
+  Append4(&data, &kIndexVersion);
+  uint64_t log_size = log.size();
+  uint64_t log_hash = HashLogEnd(log.data(), log_size);
+  data.append(reinterpret_cast<const char*>(&log_size), 8);
+  data.append(reinterpret_cast<const char*>(&log_hash), 8);
+  uint32_t list_start = lists.size();
+  Append4(&data, &list_start);
+  list_start = 0;
+  for (size_t in = 0; in < lists.size(); ++in) {
+    Append4(&data, &list_start);
+    list_start += lists[in].size();
+  }
+  Append4(&data, &list_start);
+  for (size_t in = 0; in < lists.size(); ++in) {
+    if (unsorted[in])
+      sort(lists[in].begin(), lists[in].end());
+    for (size_t i = 0; i < lists[in].size(); ++i)
+      Append4(&data, &lists[in][i]);
+  }
+  dependents_ = data.data();
+  dependents_count_ = (int)lists.size();
+  index.Unmap();
+
+  // Keeping it is only an optimization, so a log in a read-only directory
+  // still answers.
+  string temp_path = index_path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  bool written = f && fwrite(data.data(), data.size(), 1, f) == 1;
+  if (f && fclose(f) != 0)
+    written = false;
+#ifdef _WIN32
+  if (written)
+    unlink(index_path.c_str());
+#endif
+  if (!written || rename(temp_path.c_str(), index_path.c_str()) < 0) {
+    *err = "writing " + index_path + ": " + strerror(errno);
+    unlink(temp_path.c_str());
+  }
+  return true;
+}
+
+void DepsLog::GetDependents(Node* node, vector<Node*>* outputs) {
+  int id = node->id();
+  if (!dependents_ || id < 0)
+    return;
+  size_t start = outputs->size();
+  if (id < dependents_count_) {
+    const char* starts = dependents_ + kIndexHeaderSize;
+    const char* outs = starts + 4 * (dependents_count_ + 1);
+    for (uint32_t i = Read4(starts + 4 * id);
+         i < Read4(starts + 4 * (id + 1)); ++i) {
+      int out = (int)Read4(outs + 4 * i);
+      if (out < 0 || out >= (int)nodes_.size() ||
+          (out < (int)recorded_outputs_.size() && recorded_outputs_[out]))
+        continue;
+      outputs->push_back(nodes_[out]);
+    }
+  }
+
+  // The outputs recorded since are only its dependents if their latest
+  // deps still have it.
+  map<int, set<int> >::const_iterator recorded =
+      recorded_dependents_.find(id);
+  if (recorded == recorded_dependents_.end())
+    return;
+  for (set<int>::const_iterator out = recorded->second.begin();
+       out != recorded->second.end(); ++out) {
+    Deps* deps = deps_[*out];
+    if (deps && find(deps->nodes, deps->nodes + deps->node_count, node) !=
+        deps->nodes + deps->node_count) {
+      outputs->push_back(nodes_[*out]);
+    }
+  }
+  sort(outputs->begin() + start, outputs->end(), NodeIdLess);
+}
+
+void DepsLog::ClearDependents() {
+  dependents_ = NULL;
+  dependents_file_.Unmap();
+  dependents_data_.clear();
+  dependents_count_ = 0;
+  recorded_outputs_.clear();
+  recorded_dependents_.clear();
 }
 
 bool DepsLog::UpdateDeps(int out_id, Deps* deps) {
   if (out_id >= (int)deps_.size())
     deps_.resize(out_id + 1);
+  // A record read later replaces one not read yet.
+  if (out_id < (int)unloaded_.size())
+    unloaded_[out_id] = NULL;
 
-  bool delete_old = deps_[out_id] != NULL;
-  if (delete_old)
-    delete deps_[out_id];
+  bool replaced = deps_[out_id] != NULL;
+  if (replaced)
+    ++stale_deps_;
   deps_[out_id] = deps;
-  return delete_old;
+  return replaced;
 }
 
-bool DepsLog::RecordId(Node* node) {
-  int path_size = node->path().size();
-  int padding = (4 - path_size % 4) % 4;  // Pad path to 4 byte boundary.
+// static
+DepsLog::Deps* DepsLog::NewDeps(Arena* arena, TimeStamp mtime,
+                                int node_count) {
+  void* mem = arena->Alloc(sizeof(Deps) + node_count * sizeof(Node*));
+  Node** nodes = reinterpret_cast<Node**>(static_cast<char*>(mem) +
+                                          sizeof(Deps));
+  return new (mem) Deps(mtime, node_count, nodes);
+}
 
-  unsigned size = path_size + padding + 4;
-  if (size > kMaxRecordSize) {
-    errno = ERANGE;
-    return false;
-  }
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  if (fwrite(node->path().data(), path_size, 1, file_) < 1) {
-    assert(node->path().size() > 0);
-    return false;
-  }
-  if (padding && fwrite("\0\0", padding, 1, file_) < 1)
-    return false;
+bool DepsLog::RecordId(Node* node, string* record) {
   int id = nodes_.size();
-  unsigned checksum = ~(unsigned)id;
-  if (fwrite(&checksum, 4, 1, file_) < 1)
-    return false;
-  if (fflush(file_) != 0)
+  if (!FormatPathRecord(record, node->path(), id))
     return false;
 
   node->set_id(id);
@@ -15,17 +15,38 @@
 #ifndef NINJA_DEPS_LOG_H_
 #define NINJA_DEPS_LOG_H_
 
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 using namespace std;
 
 #include <stdio.h>
 
+#include "arena.h"
+#include "log_writer.h"
 #include "timestamp.h"
+#include "util.h"
 
+struct DiskInterface;
+struct MemoryStats;
 struct Node;
 struct State;
 
+/// The input lists written to a deps log, by a hash of their ids, so that
+/// records with the same list as an earlier one can refer to it.  Like the
+/// command hashes of the build log, the hashes are trusted to differ.
+struct SharedDepsLists {
+  /// How many bytes before |offset| a record with the same |ids| starts, or
+  /// 0 if none does, in which case the record at |offset| is remembered as
+  /// having them.  Short lists aren't worth sharing.
+  uint64_t Share(int node_count, const int* ids, uint64_t offset);
+  void Clear() { offsets_.clear(); }
+
+ private:
+  map<uint64_t, uint64_t> offsets_;
+};
+
 /// As build commands run they can output extra dependency information
 /// (e.g. header dependencies for C source) dynamically.  DepsLog collects
 /// that information at build time and uses it for subsequent builds.
@@ -36,7 +57,10 @@ struct State;
 /// - it can be read all at once on startup.  (Alternative designs, where
 ///   it contains indexing information, were considered and discarded as
 ///   too complicated to implement; if the file is small than reading it
-///   fully on startup is acceptable.)
+///   fully on startup is acceptable.)  Only the path records are read
+///   right away, though: the dependency lists are read from the mapped
+///   file as the build asks for them, so that a build of a few targets
+///   doesn't resolve the deps of all the others.
 /// Here are some stats from the Windows Chrome dependency files, to
 /// help guide the design space.  The total text in the files sums to
 /// 90mb so some compression is warranted to keep load-time fast.
@@ -56,40 +80,76 @@ struct State;
 ///      padding bytes to align on 4 byte boundaries, followed by the
 ///      one's complement of the expected index of the record (to detect
 ///      concurrent writes of multiple ninja processes to the log).
-///    dependency records are an array of 4-byte integers
+///    dependency records start with three 4-byte integers
 ///      [output path id,
-///       output path mtime (lower 4 bytes), output path mtime (upper 4 bytes),
-///       input path id, input path id...]
+///       output path mtime (lower 4 bytes), output path mtime (upper 4 bytes)]
 ///      (The mtime is compared against the on-disk output path mtime
 ///      to verify the stored data is up-to-date.)
+///      followed by varints, then zero padding to a 4 byte boundary:
+///      the number of inputs times 2, plus 1 if the record shares the
+///      input list of an earlier record, then either how many bytes
+///      before this one that record starts, or for each input the
+///      difference between its id and the previous one (or 0), zigzag
+///      encoded.  Sibling outputs often depend on the very same headers.
+///      (Version 4 logs, which are still read and written to until they
+///      are recompacted, have 4-byte input ids instead of the varints.)
 /// If two records reference the same output the latter one in the file
 /// wins, allowing updates to just be appended to the file.  A separate
 /// repacking step can run occasionally to remove dead records.
 struct DepsLog {
-  DepsLog() : needs_recompaction_(false), file_(NULL) {}
+  DepsLog();
   ~DepsLog();
 
   // Writing (build-time) interface.
+
+  /// Open |path| for appending records.  If Load() found that the log needs
+  /// recompaction, the compacted log is written on a background thread in
+  /// the meantime, and swapped in by Close().
   bool OpenForWrite(const string& path, string* err);
   bool RecordDeps(Node* node, TimeStamp mtime, const vector<Node*>& nodes);
   bool RecordDeps(Node* node, TimeStamp mtime, int node_count, Node** nodes);
+  /// Close the log, committing what was recorded.  A background
+  /// recompaction is waited for, completed with the records written since
+  /// it started, and atomically renamed over the log; if that fails, the
+  /// old log is kept.
   void Close();
 
+  /// How OpenForWrite() has RecordDeps() commit records to disk.
+  void set_commit_policy(const LogCommitPolicy& policy) {
+    commit_policy_ = policy;
+  }
+
   // Reading (startup-time) interface.
+  /// The deps of one output.  They live in the log's arena, with |nodes|
+  /// right after the header, until the log is recompacted.
   struct Deps {
-    Deps(int64_t mtime, int node_count)
-        : mtime(mtime), node_count(node_count), nodes(new Node*[node_count]) {}
-    ~Deps() { delete [] nodes; }
+    Deps(int64_t mtime, int node_count, Node** nodes)
+        : mtime(mtime), node_count(node_count), nodes(nodes) {}
     TimeStamp mtime;
     int node_count;
     Node** nodes;
   };
   bool Load(const string& path, State* state, string* err);
+  /// The deps of |node|, read from the loaded log the first time.
   Deps* GetDeps(Node* node);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const string& path, string* err);
 
+  /// Set the mtime of the live deps of |outputs|, or of all of them if it
+  /// is empty, to the one their output has on disk, stat()ing them all in
+  /// one batch.  Deps whose output is missing keep theirs.  Returns the
+  /// number of deps changed; Recompact() then writes them out.
+  int Restat(const DiskInterface& disk_interface,
+             const vector<string>& outputs);
+
+  /// Count the memory of the deps in |stats|, for '-d memstats'.
+  void ReportMemory(MemoryStats* stats) const;
+
+  /// Keep OpenForWrite() from recompacting the log, which would drop the
+  /// entries of the nodes that a partly loaded graph has no edges for.
+  void SkipRecompaction() { needs_recompaction_ = false; }
+
   /// Returns if the deps entry for a node is still reachable from the manifest.
   ///
   /// The deps log can contain deps entries for files that were built in the
@@ -98,24 +158,93 @@ struct DepsLog {
   /// it from code that runs on every build.
   bool IsDepsEntryLiveFor(Node* node);
 
+  // Reverse (tools) interface.
+
+  /// Read the reverse index of the log at |path|, which lists for each
+  /// input the outputs whose deps have it, from the file next to the log.
+  /// Only the deps recorded since the index was written are read, and the
+  /// index is rewritten with them; one that is missing or that belongs to
+  /// another log, e.g. from before a recompaction, is rebuilt from all the
+  /// deps.  RecordDeps() then keeps the index up to date.  A failure to
+  /// write the index is returned as a warning in |err|, like Load().
+  bool LoadDependents(const string& path, string* err);
+  /// Append to |outputs|, in id order, the outputs whose latest deps have
+  /// |node|, live or not.  Requires LoadDependents().
+  void GetDependents(Node* node, vector<Node*>* outputs);
+
   /// Used for tests.
   const vector<Node*>& nodes() const { return nodes_; }
-  const vector<Deps*>& deps() const { return deps_; }
+  const vector<Deps*>& deps() {
+    LoadAllDeps();
+    return deps_;
+  }
 
  private:
-  // Updates the in-memory representation.  Takes ownership of |deps|.
-  // Returns true if a prior deps record was deleted.
+  // Updates the in-memory representation.  Returns true if a prior deps
+  // record was replaced; it stays in |arena_| until the next recompaction.
   bool UpdateDeps(int out_id, Deps* deps);
-  // Write a node name record, assigning it an id.
-  bool RecordId(Node* node);
+  /// Allocate deps for |node_count| nodes in |arena|.
+  static Deps* NewDeps(Arena* arena, TimeStamp mtime, int node_count);
+  // Append a node name record to |record|, assigning the node an id.
+  bool RecordId(Node* node, string* record);
+  /// Read the deps of |out_id| from |mapped_|.
+  Deps* LoadDeps(int out_id);
+  /// Read all the deps not read yet, and let go of |mapped_|.
+  void LoadAllDeps();
+
+  struct Compaction;
+  /// Snapshot the live entries and start writing them out on a thread.
+  /// Returns false if no thread could be started.
+  bool StartRecompaction(const string& path);
+  void FinishRecompaction();
+  bool SwapInRecompaction(Compaction* compaction);
+  /// Forget the loaded reverse index, e.g. as a recompaction changes the
+  /// ids it has.
+  void ClearDependents();
 
   bool needs_recompaction_;
   FILE* file_;
+  LogCommitPolicy commit_policy_;
+  /// Appends the records that RecordDeps() formats to |file_|.
+  LogWriter writer_;
+  /// The recompaction running in the background, if any.
+  Compaction* compaction_;
 
   /// Maps id -> Node.
   vector<Node*> nodes_;
   /// Maps id -> deps of that id.
   vector<Deps*> deps_;
+  /// Holds every Deps in |deps_| and the ones replaced since the last
+  /// recompaction, which copies the live ones into a fresh arena.
+  Arena arena_;
+  /// The number of replaced deps in |arena_|.
+  size_t stale_deps_;
+  /// The log Load() read, which the deps not read yet are in.
+  MappedFile mapped_;
+  /// Maps id -> latest deps record of that id in |mapped_|, as long as
+  /// it hasn't been read.
+  vector<const int*> unloaded_;
+
+  /// The version of the log Load() read, which appended records have to
+  /// have as well.
+  int version_;
+  /// Where the next record will be in the log open for writing.
+  uint64_t log_size_;
+  /// The lists written since the log was opened for writing.
+  SharedDepsLists shared_lists_;
+
+  /// The reverse index LoadDependents() read, or NULL.  It is either
+  /// |dependents_file_| or, if it had to be rewritten, |dependents_data_|.
+  const char* dependents_;
+  MappedFile dependents_file_;
+  string dependents_data_;
+  /// The number of inputs |dependents_| has lists for.
+  int dependents_count_;
+  /// The outputs recorded since LoadDependents(), whose entries in
+  /// |dependents_| are stale, and the inputs each of them was recorded
+  /// with since.
+  vector<bool> recorded_outputs_;
+  map<int, set<int> > recorded_dependents_;
 
   friend struct DepsLogTest;
 };
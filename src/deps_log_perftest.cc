@@ -0,0 +1,258 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "deps_log.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "util.h"
+#include "metrics.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Writes a deps log like that of a large C++ project that has been built
+// several times since its last recompaction, and times recording it,
+// loading it, and recompacting it.
+
+const char kTestFilename[] = "DepsLogPerfTest-tempfile";
+
+// Every object includes the first kCommonHeaders headers, like those of
+// the standard library, and some more of the others, the early ones much
+// more often than the late ones.
+const int kHeaders = 20000;
+const int kCommonHeaders = 60;
+const int kMaxOtherHeaders = 200;
+// Builds recorded since the last recompaction.
+const int kRuns = 4;
+// The share of the objects that were removed from the manifest since.
+const int kDeadPercent = 10;
+
+/// Add an edge with deps for each of |objects| objects to |state|.
+bool MakeState(State* state, int objects, string* err) {
+  string manifest = "rule cxx\n  command = cxx -c $in -o $out\n  deps = gcc\n";
+  for (int i = 0; i < objects; ++i) {
+    char buf[120];
+    sprintf(buf, "build obj/project/module%d/file%d.o: cxx "
+                 "../../project/module%d/file%d.cc\n", i / 100, i, i / 100, i);
+    manifest += buf;
+  }
+  ManifestParser parser(state, NULL);
+  return parser.ParseTest(manifest, err);
+}
+
+string HeaderPath(int i) {
+  char buf[80];
+  if (i < kCommonHeaders)
+    sprintf(buf, "/usr/include/c++/v1/header%d", i);
+  else
+    sprintf(buf, "../../project/module%d/header%d.h", i / 50, i);
+  return buf;
+}
+
+/// Which headers each object includes.
+void ChooseDeps(int objects, vector<vector<int> >* deps) {
+  srand(1);
+  deps->resize(objects);
+  vector<int> seen(kHeaders, -1);
+  for (int i = 0; i < objects; ++i) {
+    vector<int>& headers = (*deps)[i];
+    for (int h = 0; h < kCommonHeaders; ++h)
+      headers.push_back(h);
+    int others = rand() % kMaxOtherHeaders;
+    for (int j = 0; j < others; ++j) {
+      double r = (double)rand() / RAND_MAX;
+      int h = kCommonHeaders +
+              (int)((kHeaders - kCommonHeaders - 1) * r * r * r);
+      if (seen[h] == i)
+        continue;
+      seen[h] = i;
+      headers.push_back(h);
+    }
+  }
+}
+
+long long FileSize(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0)
+    return -1;
+  return st.st_size;
+}
+
+/// The resident memory of the process, or -1 where it isn't known.
+long long ResidentKB() {
+#ifdef __linux__
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return -1;
+  long long size, resident;
+  int n = fscanf(f, "%lld %lld", &size, &resident);
+  fclose(f);
+  if (n != 2)
+    return -1;
+  return resident * sysconf(_SC_PAGESIZE) / 1024;
+#else
+  return -1;
+#endif
+}
+
+bool WriteTestData(int objects, string* err) {
+  State state;
+  int live = objects - objects * kDeadPercent / 100;
+  if (!MakeState(&state, live, err))
+    return false;
+  vector<Node*> outputs;
+  for (int i = 0; i < objects; ++i) {
+    char buf[80];
+    sprintf(buf, "obj/project/module%d/file%d.o", i / 100, i);
+    outputs.push_back(state.GetNode(buf, 0));
+  }
+  vector<Node*> headers;
+  for (int i = 0; i < kHeaders; ++i)
+    headers.push_back(state.GetNode(HeaderPath(i), 0));
+  vector<vector<int> > deps;
+  ChooseDeps(objects, &deps);
+
+  unlink(kTestFilename);
+  DepsLog log;
+  if (!log.OpenForWrite(kTestFilename, err))
+    return false;
+  int64_t start = GetTimeMillis();
+  long long records = 0;
+  vector<Node*> nodes;
+  for (int run = 0; run < kRuns; ++run) {
+    for (int i = 0; i < objects; ++i) {
+      nodes.clear();
+      for (size_t h = 0; h < deps[i].size(); ++h)
+        nodes.push_back(headers[deps[i][h]]);
+      if (!log.RecordDeps(outputs[i], run + 1, nodes)) {
+        *err = strerror(errno);
+        return false;
+      }
+      ++records;
+    }
+  }
+  log.Close();
+  int delta = (int)(GetTimeMillis() - start);
+
+  printf("record: %lld records in %dms, %.0f records/s, %.1f MB\n",
+         records, delta, records * 1000.0 / max(delta, 1),
+         FileSize(kTestFilename) / 1e6);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int objects = 100000;
+  if (argc > 1)
+    objects = atoi(argv[1]);
+  if (objects <= 0) {
+    fprintf(stderr, "usage: deps_log_perftest [OBJECTS]\n");
+    return 1;
+  }
+
+  string err;
+  int live = objects - objects * kDeadPercent / 100;
+  printf("%d objects, %d of them still built, %d builds\n", objects, live,
+         kRuns);
+  if (!WriteTestData(objects, &err)) {
+    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+    return 1;
+  }
+
+  {
+    // Read once to warm up disk cache.
+    State state;
+    DepsLog log;
+    if (!log.Load(kTestFilename, &state, &err)) {
+      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+      return 1;
+    }
+  }
+
+  const int kNumRepetitions = 5;
+  vector<int> times;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    State state;
+    if (!MakeState(&state, live, &err)) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+    long long resident = ResidentKB();
+    int64_t start = GetTimeMillis();
+    DepsLog log;
+    if (!log.Load(kTestFilename, &state, &err)) {
+      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+      return 1;
+    }
+    int load = (int)(GetTimeMillis() - start);
+    // Load() reads the deps of each output the first time they're asked
+    // for; a build that checks everything asks for all of them.
+    log.deps();
+    int all = (int)(GetTimeMillis() - start);
+    if (resident >= 0) {
+      printf("load %dms, with all deps %dms, +%.1f MB resident\n", load, all,
+             (ResidentKB() - resident) / 1024.0);
+    } else {
+      printf("load %dms, with all deps %dms\n", load, all);
+    }
+    times.push_back(all);
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    else if (times[i] > max)
+      max = times[i];
+  }
+  printf("load with all deps: min %dms  max %dms  avg %.1fms\n",
+         min, max, total / times.size());
+
+  {
+    State state;
+    if (!MakeState(&state, live, &err)) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+    DepsLog log;
+    if (!log.Load(kTestFilename, &state, &err)) {
+      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+      return 1;
+    }
+    long long before = FileSize(kTestFilename);
+    int64_t start = GetTimeMillis();
+    if (!log.Recompact(kTestFilename, &err)) {
+      fprintf(stderr, "Failed to recompact: %s\n", err.c_str());
+      return 1;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    printf("recompact: %dms, %.1f MB -> %.1f MB\n", delta, before / 1e6,
+           FileSize(kTestFilename) / 1e6);
+  }
+
+  unlink(kTestFilename);
+
+  return 0;
+}
@@ -20,23 +20,37 @@
 #endif
 
 #include "graph.h"
+#include "memory_stats.h"
 #include "util.h"
 #include "test.h"
 
 namespace {
 
 const char kTestFilename[] = "DepsLogTest-tempfile";
+const char kTestIndexFilename[] = "DepsLogTest-tempfile.rdeps";
 
 struct DepsLogTest : public testing::Test {
   virtual void SetUp() {
     // In case a crashing test left a stale file behind.
     unlink(kTestFilename);
+    unlink(kTestIndexFilename);
   }
   virtual void TearDown() {
     unlink(kTestFilename);
+    unlink(kTestIndexFilename);
   }
 };
 
+/// The paths of the dependents of |path| in |log|.
+string Dependents(DepsLog* log, State* state, const char* path) {
+  vector<Node*> outputs;
+  log->GetDependents(state->GetNode(path, 0), &outputs);
+  string result;
+  for (size_t i = 0; i < outputs.size(); ++i)
+    result += (i ? " " : "") + outputs[i]->path().AsString();
+  return result;
+}
+
 TEST_F(DepsLogTest, WriteRead) {
   State state1;
   DepsLog log1;
@@ -87,6 +101,198 @@ TEST_F(DepsLogTest, WriteRead) {
   ASSERT_EQ("bar2.h", log_deps->nodes[1]->path());
 }
 
+// Outputs with the same inputs share one list of them in the log.
+TEST_F(DepsLogTest, SharedLists) {
+  const int kNumOutputs = 50;
+
+  State state1;
+  DepsLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  vector<Node*> deps;
+  for (int i = 0; i < 20; ++i) {
+    char buf[32];
+    sprintf(buf, "header%d.h", i);
+    deps.push_back(state1.GetNode(buf, 0));
+  }
+  for (int i = 0; i < kNumOutputs; ++i) {
+    char buf[32];
+    sprintf(buf, "out%d.o", i);
+    log1.RecordDeps(state1.GetNode(buf, 0), i + 1, deps);
+  }
+  log1.Close();
+
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  // Far less than the 4 bytes per input of each output that it would take
+  // to repeat them.
+  EXPECT_LT(st.st_size, kNumOutputs * 20 * 4);
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  for (int i = 0; i < kNumOutputs; ++i) {
+    char buf[32];
+    sprintf(buf, "out%d.o", i);
+    DepsLog::Deps* log_deps = log2.GetDeps(state2.GetNode(buf, 0));
+    ASSERT_TRUE(log_deps);
+    EXPECT_EQ(i + 1, log_deps->mtime);
+    ASSERT_EQ(20, log_deps->node_count);
+    EXPECT_EQ("header0.h", log_deps->nodes[0]->path());
+    EXPECT_EQ("header19.h", log_deps->nodes[19]->path());
+  }
+}
+
+// A log with 4-byte input ids is still read, and recompacted.
+TEST_F(DepsLogTest, ReadVersion4) {
+  string contents("# ninjadeps\n");
+  int header[] = { 4 };
+  contents.append(reinterpret_cast<const char*>(header), sizeof(header));
+  // Paths "out.o", "foo.h" and "bar.h", then their deps record.
+  const char* paths[] = { "out.o", "foo.h", "bar.h" };
+  for (int id = 0; id < 3; ++id) {
+    int record[] = { 12, 0, 0, 0 };
+    memcpy(record + 1, paths[id], 5);
+    record[3] = ~id;
+    contents.append(reinterpret_cast<const char*>(record), sizeof(record));
+  }
+  int deps_record[] = { (int)(0x80000000u | 20), 0, 7, 0, 1, 2 };
+  contents.append(reinterpret_cast<const char*>(deps_record),
+                  sizeof(deps_record));
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"));
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* log_deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  EXPECT_EQ(7, log_deps->mtime);
+  ASSERT_EQ(2, log_deps->node_count);
+  EXPECT_EQ("foo.h", log_deps->nodes[0]->path());
+  EXPECT_EQ("bar.h", log_deps->nodes[1]->path());
+
+  // Opening it for writing brings it up to date.
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  log.Close();
+  f = fopen(kTestFilename, "rb");
+  ASSERT_TRUE(f);
+  char read_header[16];
+  ASSERT_EQ(sizeof(read_header), fread(read_header, 1, sizeof(read_header), f));
+  fclose(f);
+  int version;
+  memcpy(&version, read_header + 12, 4);
+  EXPECT_EQ(5, version);
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  log_deps = log2.GetDeps(state2.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(2, log_deps->node_count);
+  EXPECT_EQ("bar.h", log_deps->nodes[1]->path());
+}
+
+// The deps read from the log as they're asked for come out the same, even
+// after recording more.
+TEST_F(DepsLogTest, ReadOnDemand) {
+  string err;
+  {
+    State state;
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out2.o", 0), 2, deps);
+    log.RecordDeps(state.GetNode("out3.o", 0), 3, deps);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // Replacing deps that were never read doesn't read them.
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("baz.h", 0));
+  EXPECT_TRUE(log.RecordDeps(state.GetNode("out.o", 0), 4, deps));
+  DepsLog::Deps* log_deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(4, log_deps->mtime);
+  ASSERT_EQ(1, log_deps->node_count);
+  ASSERT_EQ("baz.h", log_deps->nodes[0]->path());
+
+  log_deps = log.GetDeps(state.GetNode("out2.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(2, log_deps->mtime);
+  ASSERT_EQ(2, log_deps->node_count);
+  ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
+  ASSERT_EQ("bar.h", log_deps->nodes[1]->path());
+  // Reading them again gives the same deps.
+  ASSERT_EQ(log_deps, log.GetDeps(state.GetNode("out2.o", 0)));
+  EXPECT_TRUE(log.GetDeps(state.GetNode("foo.h", 0)) == NULL);
+
+  // The ones not asked for are all still there.
+  int count = 0;
+  for (size_t i = 0; i < log.deps().size(); ++i)
+    count += log.deps()[i] != NULL;
+  EXPECT_EQ(3, count);
+  log_deps = log.GetDeps(state.GetNode("out3.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(3, log_deps->mtime);
+  log.Close();
+}
+
+TEST_F(DepsLogTest, GroupCommit) {
+  State state1;
+  DepsLog log1;
+  LogCommitPolicy policy;
+  policy.max_records = 2;
+  policy.max_delay_ms = 1000;
+  log1.set_commit_policy(policy);
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // Enough records to fill several commits, and some left waiting.
+  for (int i = 0; i < 5; ++i) {
+    vector<Node*> deps;
+    deps.push_back(state1.GetNode("foo.h", 0));
+    deps.push_back(state1.GetNode("bar.h", 0));
+    EXPECT_TRUE(log1.RecordDeps(state1.GetNode("out.o", 0), i + 1, deps));
+  }
+  log1.Close();
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, log2.nodes().size());
+  DepsLog::Deps* log_deps = log2.GetDeps(state2.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(5, log_deps->mtime);
+  ASSERT_EQ(2, log_deps->node_count);
+  ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
+}
+
 TEST_F(DepsLogTest, LotsOfDeps) {
   const int kNumDeps = 100000;  // More than 64k.
 
@@ -322,6 +528,184 @@ TEST_F(DepsLogTest, Recompact) {
   }
 }
 
+TEST_F(DepsLogTest, Restat) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n";
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("foo.h", 0));
+  log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+  log.RecordDeps(state.GetNode("other_out.o", 0), 1, deps);
+  // Not in the manifest anymore.
+  log.RecordDeps(state.GetNode("dead.o", 0), 1, deps);
+  log.Close();
+
+  VirtualFileSystem fs;
+  fs.Tick();
+  fs.Create("out.o", "");
+  fs.Create("dead.o", "");
+
+  ASSERT_EQ(1, log.Restat(fs, vector<string>()));
+  ASSERT_EQ(2, log.GetDeps(state.GetNode("out.o", 0))->mtime);
+  // Missing.
+  ASSERT_EQ(1, log.GetDeps(state.GetNode("other_out.o", 0))->mtime);
+  ASSERT_EQ(1, log.GetDeps(state.GetNode("dead.o", 0))->mtime);
+
+  ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  State state2;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state2, kManifest));
+  DepsLog log2;
+  ASSERT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2, log2.GetDeps(state2.GetNode("out.o", 0))->mtime);
+  ASSERT_EQ(1, log2.GetDeps(state2.GetNode("other_out.o", 0))->mtime);
+}
+
+// Replaced deps stay in the arena until a recompaction copies out the live
+// ones.
+TEST_F(DepsLogTest, RecompactReclaimsReplacedDeps) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n";
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  vector<Node*> deps;
+  for (int i = 0; i < 100; ++i)
+    deps.push_back(state.GetNode("in" + string(1, 'a' + i % 26) +
+                                 string(1, 'a' + i / 26) + ".h", 0));
+  for (int mtime = 1; mtime <= 1000; ++mtime)
+    ASSERT_TRUE(log.RecordDeps(state.GetNode("out.o", 0), mtime, deps));
+  log.Close();
+
+  MemoryStats before;
+  log.ReportMemory(&before);
+  ASSERT_EQ(1000u, before.count("deps log deps"));
+
+  ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  MemoryStats after;
+  log.ReportMemory(&after);
+  ASSERT_EQ(1u, after.count("deps log deps"));
+  ASSERT_GT(before.bytes("deps log deps"), after.bytes("deps log deps"));
+
+  DepsLog::Deps* out = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(out);
+  ASSERT_EQ(1000, out->mtime);
+  ASSERT_EQ(100, out->node_count);
+  for (int i = 0; i < 100; ++i)
+    ASSERT_EQ(deps[i], out->nodes[i]);
+}
+
+TEST_F(DepsLogTest, RecordDuringRecompaction) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n"
+"build new_out.o: cc\n";
+
+  // Write the deps of out.o over and over, so the next open recompacts.
+  int file_size;
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    for (int i = 0; i < 1100; ++i)
+      log.RecordDeps(state.GetNode("out.o", 0), i, deps);
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("other_out.o", 0), 1, deps);
+    log.Close();
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    file_size = (int)st.st_size;
+  }
+
+  // Record deps while the log is being recompacted.
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("new.h", 0));
+    log.RecordDeps(state.GetNode("new_out.o", 0), 5, deps);
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 6, deps);
+    log.Close();
+
+    // The in-memory deps should survive the swap.
+    DepsLog::Deps* out_deps = log.GetDeps(state.GetNode("out.o", 0));
+    ASSERT_TRUE(out_deps);
+    ASSERT_EQ(6, out_deps->mtime);
+    ASSERT_EQ(log.nodes()[state.LookupNode("new.h")->id()],
+              state.LookupNode("new.h"));
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    ASSERT_LT((int)st.st_size, file_size);
+  }
+
+  // Both the old live deps and the new ones should be there.
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(6, deps->mtime);
+    ASSERT_EQ(2, deps->node_count);
+    ASSERT_EQ("new.h", deps->nodes[0]->path());
+    ASSERT_EQ("foo.h", deps->nodes[1]->path());
+
+    deps = log.GetDeps(state.GetNode("other_out.o", 0));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(1, deps->mtime);
+    ASSERT_EQ(2, deps->node_count);
+    ASSERT_EQ("foo.h", deps->nodes[0]->path());
+    ASSERT_EQ("bar.h", deps->nodes[1]->path());
+
+    deps = log.GetDeps(state.GetNode("new_out.o", 0));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(5, deps->mtime);
+    ASSERT_EQ(1, deps->node_count);
+    ASSERT_EQ("new.h", deps->nodes[0]->path());
+  }
+}
+
 // Verify that invalid file headers cause a new build.
 TEST_F(DepsLogTest, InvalidHeader) {
   const char *kInvalidHeaders[] = {
@@ -476,4 +860,65 @@ TEST_F(DepsLogTest, TruncatedRecovery) {
   }
 }
 
+TEST_F(DepsLogTest, Dependents) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps[1] = state.GetNode("bar2.h", 0);
+    log.RecordDeps(state.GetNode("out2.o", 0), 1, deps);
+    log.Close();
+  }
+
+  // The index is built from all the deps and written out.
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.LoadDependents(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestIndexFilename, &st));
+    EXPECT_EQ("out.o out2.o", Dependents(&log, &state, "foo.h"));
+    EXPECT_EQ("out.o", Dependents(&log, &state, "bar.h"));
+    EXPECT_EQ("", Dependents(&log, &state, "out.o"));
+
+    // Deps recorded after it was loaded replace those in it.
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out3.o", 0), 2, deps);
+    deps[0] = state.GetNode("foo.h", 0);
+    log.RecordDeps(state.GetNode("out.o", 0), 2, deps);
+    log.Close();
+    EXPECT_EQ("out.o out2.o", Dependents(&log, &state, "foo.h"));
+    EXPECT_EQ("out3.o", Dependents(&log, &state, "bar.h"));
+  }
+
+  // The index catches up with the deps appended since it was written.
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.LoadDependents(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_EQ("out.o out2.o", Dependents(&log, &state, "foo.h"));
+    EXPECT_EQ("out3.o", Dependents(&log, &state, "bar.h"));
+    EXPECT_EQ("out2.o", Dependents(&log, &state, "bar2.h"));
+
+    // A recompaction renumbers the nodes, so the index goes.
+    ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+    struct stat st;
+    EXPECT_NE(0, stat(kTestIndexFilename, &st));
+    EXPECT_EQ("", Dependents(&log, &state, "foo.h"));
+  }
+}
+
 }  // anonymous namespace
@@ -26,13 +26,47 @@
 #include <sstream>
 #include <windows.h>
 #include <direct.h>  // _mkdir
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>  // FICLONE
+#include <sys/ioctl.h>
+#endif
+#ifndef NAME_MAX
+#define NAME_MAX 255
+#endif
+#endif
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>  // struct statx
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// IORING_OP_STATX came along with this feature flag, in Linux 5.6.
+#ifndef IORING_FEAT_RW_CUR_POS
+#undef USE_IO_URING
+#endif
 #endif
 
+#include <set>
+
+#include "arena.h"
+#include "content_hash.h"
+#include "debug_flags.h"
+#include "hash_map.h"
 #include "metrics.h"
+#include "stat_audit.h"
 #include "util.h"
 
 namespace {
 
+/// The files found in a directory, with their mtimes.
+typedef vector<pair<string, TimeStamp> > DirEntries;
+
 string DirName(const string& path) {
 #ifdef _WIN32
   static const char kPathSeparators[] = "\\/";
@@ -70,6 +104,7 @@ TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
 }
 
 TimeStamp StatSingleFile(const string& path, string* err) {
+  METRIC_COUNT("file stats", 1);
   WIN32_FILE_ATTRIBUTE_DATA attrs;
   if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrs)) {
     DWORD win_err = GetLastError();
@@ -91,46 +126,539 @@ bool IsWindows7OrLater() {
       &version_info, VER_MAJORVERSION | VER_MINORVERSION, comparison);
 }
 
-bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
-                       string* err) {
-  // FindExInfoBasic is 30% faster than FindExInfoStandard.
+/// Returns false and fills |err| if |dir| can't be read.
+bool StatAllFilesInDir(const string& dir, DirEntries* entries, string* err) {
+  METRIC_COUNT("directory listings", 1);
+  // FindExInfoBasic is 30% faster than FindExInfoStandard, and fetching the
+  // entries in large batches saves round trips, which add up on network
+  // drives.
   static bool can_use_basic_info = IsWindows7OrLater();
-  // This is not in earlier SDKs.
+  // These are not in earlier SDKs.
   const FINDEX_INFO_LEVELS kFindExInfoBasic =
       static_cast<FINDEX_INFO_LEVELS>(1);
+  const DWORD kFindFirstExLargeFetch = 2;
   FINDEX_INFO_LEVELS level =
       can_use_basic_info ? kFindExInfoBasic : FindExInfoStandard;
-  WIN32_FIND_DATAA ffd;
-  HANDLE find_handle = FindFirstFileExA((dir + "\\*").c_str(), level, &ffd,
-                                        FindExSearchNameMatch, NULL, 0);
+  DWORD flags = can_use_basic_info ? kFindFirstExLargeFetch : 0;
+
+  // The A functions convert each name from UTF-16 into a buffer of their
+  // own; with the W ones, the names are converted into one buffer here, from
+  // and to the same ANSI code page.
+  string pattern = dir + "\\*";
+  int wide_size =
+      MultiByteToWideChar(CP_ACP, 0, pattern.c_str(), -1, NULL, 0);
+  vector<wchar_t> wide_pattern(wide_size > 0 ? wide_size : 1);
+  MultiByteToWideChar(CP_ACP, 0, pattern.c_str(), -1, &wide_pattern[0],
+                      wide_size);
+  WIN32_FIND_DATAW ffd;
+  HANDLE find_handle = FindFirstFileExW(&wide_pattern[0], level, &ffd,
+                                        FindExSearchNameMatch, NULL, flags);
 
   if (find_handle == INVALID_HANDLE_VALUE) {
     DWORD win_err = GetLastError();
     if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
       return true;
-    *err = "FindFirstFileExA(" + dir + "): " + GetLastErrorString();
+    *err = "FindFirstFileExW(" + dir + "): " + GetLastErrorString();
     return false;
   }
+  // Up to MAX_PATH UTF-16 units, of up to 3 bytes each in UTF-8.
+  char name[3 * MAX_PATH + 1];
   do {
-    string lowername = ffd.cFileName;
-    if (lowername == "..") {
+    int size = WideCharToMultiByte(CP_ACP, 0, ffd.cFileName, -1, name,
+                                   sizeof(name), NULL, NULL);
+    if (size <= 0)
+      continue;
+    if (strcmp(name, "..") == 0) {
       // Seems to just copy the timestamp for ".." from ".", which is wrong.
       // This is the case at least on NTFS under Windows 7.
       continue;
     }
+    string lowername(name, size - 1);
     transform(lowername.begin(), lowername.end(), lowername.begin(), ::tolower);
-    stamps->insert(make_pair(lowername,
-                             TimeStampFromFileTime(ffd.ftLastWriteTime)));
-  } while (FindNextFileA(find_handle, &ffd));
+    entries->push_back(make_pair(lowername,
+                                 TimeStampFromFileTime(ffd.ftLastWriteTime)));
+  } while (FindNextFileW(find_handle, &ffd));
   FindClose(find_handle);
   return true;
 }
+
+/// Split |path| into the directory to read and the name to look up in it,
+/// as the stat cache keys them.
+bool SplitCachePath(const string& path, string* dir, string* base) {
+  *dir = DirName(path);
+  *base = path.substr(dir->size() ? dir->size() + 1 : 0);
+  if (base->empty())
+    return false;
+  if (*base == "..") {
+    // StatAllFilesInDir does not report any information for base = "..".
+    *base = ".";
+    *dir = path;
+  }
+  transform(dir->begin(), dir->end(), dir->begin(), ::tolower);
+  transform(base->begin(), base->end(), base->begin(), ::tolower);
+  return true;
+}
+#else  // _WIN32
+TimeStamp MTimeFromStat(const struct stat& st) {
+  // Some users (Flatpak) set mtime to 0, this should be harmless
+  // and avoids conflicting with our return value of 0 meaning
+  // that it doesn't exist.
+  if (st.st_mtime == 0)
+    return 1;
+#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+          st.st_mtimespec.tv_nsec);
+#elif (_POSIX_C_SOURCE >= 200809L || _XOPEN_SOURCE >= 700 || defined(_BSD_SOURCE) || defined(_SVID_SOURCE) || \
+       defined(__BIONIC__) || (defined (__SVR4) && defined (__sun)) || defined(__FreeBSD__))
+  // For glibc, see "Timestamp files" in the Notes of http://www.kernel.org/doc/man-pages/online/pages/man2/stat.2.html
+  // newlib, uClibc and musl follow the kernel (or Cygwin) headers and define the right macro values above.
+  // For bsd, see https://github.com/freebsd/freebsd/blob/master/sys/sys/stat.h and similar
+  // For bionic, C and POSIX API is always enabled.
+  // For solaris, see https://docs.oracle.com/cd/E88353_01/html/E37841/stat-2.html.
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#elif defined(_AIX)
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+#else
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+#endif
+}
+
+TimeStamp StatSingleFile(const string& path, string* err) {
+  METRIC_COUNT("file stats", 1);
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *err = "stat(" + path + "): " + strerror(errno);
+    return -1;
+  }
+  return MTimeFromStat(st);
+}
+
+/// Returns false if |dir| can't be listed, in which case its files have to
+/// be stat()ed one by one.  Only lists the files: they all get an mtime of
+/// -1, for the ones that are asked for to be stat()ed later, since that
+/// costs as much as stat()ing them by path.  Never fills |err|: what can't
+/// be read here is left to StatSingleFile().
+bool StatAllFilesInDir(const string& dir, DirEntries* entries, string*) {
+  METRIC_COUNT("directory listings", 1);
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    // A directory that doesn't exist has no files.
+    return errno == ENOENT || errno == ENOTDIR;
+  }
+  while (struct dirent* ent = readdir(d)) {
+    const char* name = ent->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
+    entries->push_back(make_pair(string(name), (TimeStamp)-1));
+  }
+  closedir(d);
+  return true;
+}
+
+bool SplitCachePath(const string& path, string* dir, string* base) {
+  *dir = DirName(path);
+  *base = path.substr(dir->size() ? dir->size() + 1 : 0);
+  // "." and ".." aren't listed, and a name too long to be listed is left to
+  // stat() to report.
+  return !base->empty() && *base != "." && *base != ".." &&
+         base->size() <= NAME_MAX;
+}
 #endif  // _WIN32
 
+#ifdef USE_IO_URING
+/// Runs statx() on batches of files through an io_uring, which takes a
+/// couple of syscalls per batch rather than one per file.
+struct StatRing {
+  /// The ring shared by the main thread, or NULL if -d iouring isn't given
+  /// or the kernel doesn't provide io_uring.
+  static StatRing* Get();
+
+  /// Set |mtimes| as StatSingleFile() would for |paths|, except for -1
+  /// where the caller has to call it to find out.
+  void StatMany(const vector<const char*>& paths, TimeStamp* mtimes);
+
+ private:
+  StatRing() : fd_(-1) {}
+  bool Init();
+
+  /// The number of statx() in flight at most.
+  static const unsigned kEntries = 256;
+
+  int fd_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  struct io_uring_sqe* sqes_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+  /// The result buffer of each entry, and the path it is for.
+  struct statx bufs_[kEntries];
+  size_t indices_[kEntries];
+};
+
+StatRing* StatRing::Get() {
+  if (!g_experimental_io_uring)
+    return NULL;
+  static StatRing* ring = NULL;
+  static bool tried = false;
+  if (!tried) {
+    tried = true;
+    ring = new StatRing;
+    if (!ring->Init()) {
+      delete ring;
+      ring = NULL;
+    }
+  }
+  return ring;
+}
+
+bool StatRing::Init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = (int)syscall(__NR_io_uring_setup, kEntries, &params);
+  if (fd_ < 0)
+    return false;
+  // Older kernels map the two rings separately, and may lack statx.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd_);
+    return false;
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = max(sq_size, cq_size);
+  char* ring = (char*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_SQES);
+  if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd_);
+    return false;
+  }
+  // The rings stay mapped for as long as ninja runs.
+  sq_tail_ = (unsigned*)(ring + params.sq_off.tail);
+  sq_mask_ = (unsigned*)(ring + params.sq_off.ring_mask);
+  sq_array_ = (unsigned*)(ring + params.sq_off.array);
+  sqes_ = (struct io_uring_sqe*)sqes;
+  cq_head_ = (unsigned*)(ring + params.cq_off.head);
+  cq_tail_ = (unsigned*)(ring + params.cq_off.tail);
+  cq_mask_ = (unsigned*)(ring + params.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+  return true;
+}
+
+void StatRing::StatMany(const vector<const char*>& paths,
+                        TimeStamp* mtimes) {
+  METRIC_COUNT("file stats", paths.size());
+  vector<unsigned> free_slots;
+  for (unsigned i = 0; i < kEntries; ++i)
+    free_slots.push_back(kEntries - 1 - i);
+  size_t next = 0;
+  size_t in_flight = 0;
+  while (next < paths.size() || in_flight > 0) {
+    // Queue up as many as there is room for...
+    unsigned tail = *sq_tail_;
+    unsigned queued = 0;
+    while (next < paths.size() && !free_slots.empty()) {
+      unsigned slot = free_slots.back();
+      free_slots.pop_back();
+      indices_[slot] = next;
+      struct io_uring_sqe* sqe = &sqes_[slot];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)paths[next];
+      sqe->len = STATX_MTIME;
+      sqe->off = (uintptr_t)&bufs_[slot];
+      sqe->user_data = slot;
+      sq_array_[(tail + queued) & *sq_mask_] = slot;
+      ++queued;
+      ++next;
+    }
+    __atomic_store_n(sq_tail_, tail + queued, __ATOMIC_RELEASE);
+    in_flight += queued;
+
+    // ... then wait for at least one of them.
+    if (syscall(__NR_io_uring_enter, fd_, queued, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 && errno != EINTR) {
+      Fatal("io_uring_enter: %s", strerror(errno));
+    }
+    unsigned head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; ++head) {
+      const struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+      unsigned slot = (unsigned)cqe->user_data;
+      TimeStamp& mtime = mtimes[indices_[slot]];
+      if (cqe->res == 0) {
+        const struct statx_timestamp& ts = bufs_[slot].stx_mtime;
+        // See StatSingleFile() about a zero mtime.
+        if (ts.tv_sec == 0)
+          mtime = 1;
+        else
+          mtime = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+      } else if (cqe->res == -ENOENT || cqe->res == -ENOTDIR) {
+        mtime = 0;
+      } else {
+        mtime = -1;
+      }
+      free_slots.push_back(slot);
+      --in_flight;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+}
+
+#endif  // USE_IO_URING
+
+/// Arguments of StatDirThread.
+struct StatDirArgs {
+  const vector<string>* dirs;
+  vector<DirEntries>* entries;
+  /// Whether each directory could be read, with the error if not.
+  vector<char>* ok;
+  vector<string>* errs;
+};
+
+void StatDirThread(void* arg, size_t index) {
+  StatDirArgs* args = static_cast<StatDirArgs*>(arg);
+  const string& dir = (*args->dirs)[index];
+  (*args->ok)[index] = StatAllFilesInDir(dir.empty() ? "." : dir,
+                                         &(*args->entries)[index],
+                                         &(*args->errs)[index]);
+}
+
+/// Arguments of StatManyThread.
+struct StatManyArgs {
+  const vector<const string*>* paths;
+  vector<TimeStamp>* mtimes;
+};
+
+void StatManyThread(void* arg, size_t index) {
+  StatManyArgs* args = static_cast<StatManyArgs*>(arg);
+  string err;
+  (*args->mtimes)[index] = StatSingleFile(*(*args->paths)[index], &err);
+}
+
+// stat() is mostly waiting on the filesystem, so use more threads than
+// there are processors, but don't bother with them for small batches.
+const int kMaxThreads = 16;
+const size_t kPathsPerThread = 256;
+
+/// RealDiskInterface::StatMany() without the stat cache.
+void StatFiles(const vector<const string*>& paths, vector<TimeStamp>* mtimes) {
+  mtimes->resize(paths.size());
+  if (paths.empty())
+    return;
+#ifdef USE_IO_URING
+  if (StatRing* ring = StatRing::Get()) {
+    vector<const char*> cpaths(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+      cpaths[i] = paths[i]->c_str();
+    ring->StatMany(cpaths, &(*mtimes)[0]);
+    string err;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if ((*mtimes)[i] < 0)
+        (*mtimes)[i] = StatSingleFile(*paths[i], &err);
+    }
+    return;
+  }
+#endif
+  int threads = (int)min(paths.size() / kPathsPerThread + 1,
+                         (size_t)kMaxThreads);
+  StatManyArgs args = { &paths, mtimes };
+  ParallelFor(paths.size(), threads, StatManyThread, &args);
+}
+
+/// Keep 0 for the files that couldn't be hashed.
+uint64_t NonzeroHash(uint64_t hash) {
+  return hash ? hash : 1;
+}
+
+/// Arguments of HashFilesThread.
+struct HashFilesArgs {
+  const vector<const string*>* paths;
+  vector<uint64_t>* hashes;
+};
+
+void HashFilesThread(void* arg, size_t index) {
+  HashFilesArgs* args = static_cast<HashFilesArgs*>(arg);
+  uint64_t hash;
+  string err;
+  (*args->hashes)[index] = HashFileContents(*(*args->paths)[index], &hash,
+                                            &err) ? NonzeroHash(hash) : 0;
+}
+
+/// Some of the files of a RemoveFiles() batch that are in the same
+/// directory, as indices into the batch.
+struct RemoveChunk {
+  string dir;
+  vector<size_t> files;
+};
+
+/// Arguments of RemoveFilesThread.
+struct RemoveFilesArgs {
+  const vector<string>* paths;
+  const vector<RemoveChunk>* chunks;
+  /// The errno of removing each file, or 0.
+  vector<int>* errors;
+};
+
+void RemoveFilesThread(void* arg, size_t index) {
+  RemoveFilesArgs* args = static_cast<RemoveFilesArgs*>(arg);
+  const RemoveChunk& chunk = (*args->chunks)[index];
+#ifndef _WIN32
+  // Names relative to the open directory save the kernel from walking the
+  // path again for every file, which adds up on network filesystems.
+  int dir_fd = open(chunk.dir.empty() ? "." : chunk.dir.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+  for (vector<size_t>::const_iterator i = chunk.files.begin();
+       i != chunk.files.end(); ++i) {
+    const string& path = (*args->paths)[*i];
+    int& error = (*args->errors)[*i];
+#ifndef _WIN32
+    string::size_type slash = path.rfind('/');
+    const char* name = path.c_str() + (slash == string::npos ? 0 : slash + 1);
+    if (dir_fd >= 0 && *name) {
+      error = unlinkat(dir_fd, name, 0) < 0 ? errno : 0;
+      // remove() also takes empty directories.
+      if (error == EISDIR || error == EPERM) {
+        if (unlinkat(dir_fd, name, AT_REMOVEDIR) == 0)
+          error = 0;
+        else if (errno != ENOTDIR)
+          error = errno;
+      }
+      continue;
+    }
+#endif
+    error = remove(path.c_str()) < 0 ? errno : 0;
+  }
+#ifndef _WIN32
+  if (dir_fd >= 0)
+    close(dir_fd);
+#endif
+}
+
 }  // namespace
 
+/// The directories read by the stat cache, keyed by their name as
+/// SplitCachePath() gives it.
+struct RealDiskInterface::StatCache {
+  /// The mtimes of the files in a directory.
+  typedef ExternalStringHashMap<TimeStamp>::Type Dir;
+  /// A NULL Dir stands for a directory that can't be listed.
+  typedef ExternalStringHashMap<Dir*>::Type Dirs;
+
+  ~StatCache() {
+    for (Dirs::iterator i = dirs.begin(); i != dirs.end(); ++i)
+      delete i->second;
+  }
+
+  Dir* Find(const string& dir, bool* found) {
+    Dirs::iterator i = dirs.find(dir);
+    *found = i != dirs.end();
+    return *found ? i->second : NULL;
+  }
+
+  /// Remember what's in |dir|, or that it can't be listed if |entries| is
+  /// NULL.
+  Dir* Add(const string& dir, const DirEntries* entries) {
+    Dir* files = NULL;
+    if (entries) {
+      files = new Dir;
+      for (DirEntries::const_iterator i = entries->begin();
+           i != entries->end(); ++i) {
+        (*files)[CopyString(i->first)] = i->second;
+      }
+    }
+    dirs[CopyString(dir)] = files;
+    return files;
+  }
+
+  StringPiece CopyString(const string& str) {
+    return names_.CopyString(str);
+  }
+
+  Dirs dirs;
+
+ private:
+  /// The storage of the keys of the maps.
+  Arena names_;
+};
+
 // DiskInterface ---------------------------------------------------------------
 
+void DiskInterface::StatMany(const vector<const string*>& paths,
+                             vector<TimeStamp>* mtimes) const {
+  mtimes->resize(paths.size());
+  string err;
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*mtimes)[i] = Stat(*paths[i], &err);
+}
+
+void DiskInterface::RemoveFiles(const vector<string>& paths,
+                                vector<int>* results) {
+  results->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*results)[i] = RemoveFile(paths[i]);
+}
+
+void DiskInterface::HashFiles(const vector<const string*>& paths,
+                              vector<uint64_t>* hashes) {
+  hashes->resize(paths.size());
+  string contents, err;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (ReadFile(*paths[i], &contents, &err) == Okay) {
+      (*hashes)[i] =
+          NonzeroHash(ContentHash::Hash(contents.data(), contents.size()));
+    } else {
+      (*hashes)[i] = 0;
+    }
+  }
+}
+
+void DirectoryMaker::Prefetch(const vector<string>& paths) {
+  set<string> dirs;
+  for (vector<string>::const_iterator p = paths.begin(); p != paths.end();
+       ++p) {
+    string dir = DirName(*p);
+    if (!dir.empty() && known_.find(dir) == known_.end())
+      dirs.insert(dir);
+  }
+  vector<const string*> dir_ptrs;
+  for (set<string>::const_iterator d = dirs.begin(); d != dirs.end(); ++d)
+    dir_ptrs.push_back(&*d);
+  vector<TimeStamp> mtimes;
+  disk_interface_->StatMany(dir_ptrs, &mtimes);
+  for (size_t i = 0; i < dir_ptrs.size(); ++i) {
+    if (mtimes[i] > 0)
+      known_.insert(*dir_ptrs[i]);
+  }
+}
+
+bool DirectoryMaker::MakeDirs(const string& path) {
+  string dir = DirName(path);
+  if (dir.empty() || known_.find(dir) != known_.end())
+    return true;
+  string err;
+  TimeStamp mtime = disk_interface_->Stat(dir, &err);
+  if (mtime < 0) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  // Create the parent first if this doesn't exist yet.
+  if (mtime == 0 && (!MakeDirs(dir) || !disk_interface_->MakeDir(dir)))
+    return false;
+  known_.insert(dir);
+  return true;
+}
+
 bool DiskInterface::MakeDirs(const string& path) {
   string dir = DirName(path);
   if (dir.empty())
@@ -153,8 +681,14 @@ bool DiskInterface::MakeDirs(const string& path) {
 
 // RealDiskInterface -----------------------------------------------------------
 
+RealDiskInterface::~RealDiskInterface() {
+  delete cache_;
+}
+
 TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
   METRIC_RECORD("node stat");
+  if (g_stat_audit)
+    g_stat_audit->Record(path);
 #ifdef _WIN32
   // MSDN: "Naming Files, Paths, and Namespaces"
   // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365247(v=vs.85).aspx
@@ -165,60 +699,124 @@ TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
     *err = err_stream.str();
     return -1;
   }
-  if (!use_cache_)
+#endif
+  string dir, base;
+  if (!cache_ || !SplitCachePath(path, &dir, &base))
     return StatSingleFile(path, err);
 
-  string dir = DirName(path);
-  string base(path.substr(dir.size() ? dir.size() + 1 : 0));
-  if (base == "..") {
-    // StatAllFilesInDir does not report any information for base = "..".
-    base = ".";
-    dir = path;
+  bool found;
+  StatCache::Dir* files = cache_->Find(dir, &found);
+  if (!found) {
+    DirEntries entries;
+    bool ok = StatAllFilesInDir(dir.empty() ? "." : dir, &entries, err);
+    if (!ok && !err->empty())
+      return -1;
+    files = cache_->Add(dir, ok ? &entries : NULL);
   }
+  if (!files)
+    return StatSingleFile(path, err);
+  StatCache::Dir::iterator i = files->find(base);
+  if (i == files->end()) {
+#ifdef __APPLE__
+    // The filesystem may well be case-insensitive.
+    return StatSingleFile(path, err);
+#else
+    return 0;
+#endif
+  }
+  if (i->second < 0) {
+    // Listed, but not stat()ed yet.
+    TimeStamp mtime = StatSingleFile(path, err);
+    if (mtime >= 0)
+      i->second = mtime;
+    return mtime;
+  }
+  return i->second;
+}
 
-  transform(dir.begin(), dir.end(), dir.begin(), ::tolower);
-  transform(base.begin(), base.end(), base.begin(), ::tolower);
+void RealDiskInterface::StatMany(const vector<const string*>& paths,
+                                 vector<TimeStamp>* mtimes) const {
+  METRIC_RECORD("node stat batch");
+  if (g_stat_audit) {
+    for (size_t i = 0; i < paths.size(); ++i)
+      g_stat_audit->Record(*paths[i]);
+  }
+  if (!cache_) {
+    StatFiles(paths, mtimes);
+    return;
+  }
 
-  Cache::iterator ci = cache_.find(dir);
-  if (ci == cache_.end()) {
-    ci = cache_.insert(make_pair(dir, DirCache())).first;
-    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &ci->second, err)) {
-      cache_.erase(ci);
-      return -1;
-    }
+  // Read the directories that aren't cached yet in parallel...
+  vector<string> dirs(paths.size()), bases(paths.size());
+  vector<char> cacheable(paths.size());
+  vector<string> new_dirs;
+  ExternalStringHashMap<bool>::Type seen;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    cacheable[i] = SplitCachePath(*paths[i], &dirs[i], &bases[i]);
+    if (!cacheable[i])
+      continue;
+    bool found;
+    cache_->Find(dirs[i], &found);
+    if (!found && seen.insert(make_pair(StringPiece(dirs[i]), true)).second)
+      new_dirs.push_back(dirs[i]);
   }
-  DirCache::iterator di = ci->second.find(base);
-  return di != ci->second.end() ? di->second : 0;
-#else
-  struct stat st;
-  if (stat(path.c_str(), &st) < 0) {
-    if (errno == ENOENT || errno == ENOTDIR)
-      return 0;
-    *err = "stat(" + path + "): " + strerror(errno);
-    return -1;
+  vector<DirEntries> entries(new_dirs.size());
+  vector<char> ok(new_dirs.size());
+  vector<string> errs(new_dirs.size());
+  StatDirArgs args = { &new_dirs, &entries, &ok, &errs };
+  // Listing a directory is worth a few stat() calls.
+  int threads = (int)min(new_dirs.size() * 8 / kPathsPerThread + 1,
+                         (size_t)kMaxThreads);
+  ParallelFor(new_dirs.size(), threads, StatDirThread, &args);
+  for (size_t i = 0; i < new_dirs.size(); ++i) {
+    // Those that failed are retried by Stat(), which reports the error.
+    if (ok[i] || errs[i].empty())
+      cache_->Add(new_dirs[i], ok[i] ? &entries[i] : NULL);
   }
-  // Some users (Flatpak) set mtime to 0, this should be harmless
-  // and avoids conflicting with our return value of 0 meaning
-  // that it doesn't exist.
-  if (st.st_mtime == 0)
-    return 1;
-#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
-  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
-          st.st_mtimespec.tv_nsec);
-#elif (_POSIX_C_SOURCE >= 200809L || _XOPEN_SOURCE >= 700 || defined(_BSD_SOURCE) || defined(_SVID_SOURCE) || \
-       defined(__BIONIC__) || (defined (__SVR4) && defined (__sun)) || defined(__FreeBSD__))
-  // For glibc, see "Timestamp files" in the Notes of http://www.kernel.org/doc/man-pages/online/pages/man2/stat.2.html
-  // newlib, uClibc and musl follow the kernel (or Cygwin) headers and define the right macro values above.
-  // For bsd, see https://github.com/freebsd/freebsd/blob/master/sys/sys/stat.h and similar
-  // For bionic, C and POSIX API is always enabled.
-  // For solaris, see https://docs.oracle.com/cd/E88353_01/html/E37841/stat-2.html.
-  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
-#elif defined(_AIX)
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+
+  // ... stat() all at once the files that are listed but weren't stat()ed
+  // yet, and those the cache can't answer for...
+  mtimes->resize(paths.size());
+  vector<TimeStamp*> found_mtimes(paths.size());
+  vector<const string*> to_stat;
+  vector<TimeStamp*> to_stat_mtimes;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    bool found = false;
+    StatCache::Dir* files =
+        cacheable[i] ? cache_->Find(dirs[i], &found) : NULL;
+    if (!files) {
+      to_stat.push_back(paths[i]);
+      to_stat_mtimes.push_back(&(*mtimes)[i]);
+      continue;
+    }
+    StatCache::Dir::iterator file = files->find(bases[i]);
+    if (file == files->end()) {
+#ifdef __APPLE__
+      // The filesystem may well be case-insensitive.
+      to_stat.push_back(paths[i]);
+      to_stat_mtimes.push_back(&(*mtimes)[i]);
 #else
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
-#endif
+      (*mtimes)[i] = 0;
 #endif
+      continue;
+    }
+    found_mtimes[i] = &file->second;
+    if (file->second == -1) {
+      file->second = -2;  // Only once, however many times it's asked for.
+      to_stat.push_back(paths[i]);
+      to_stat_mtimes.push_back(&file->second);
+    }
+  }
+  vector<TimeStamp> results;
+  StatFiles(to_stat, &results);
+  for (size_t i = 0; i < to_stat.size(); ++i)
+    *to_stat_mtimes[i] = results[i];
+
+  // ... and answer from the cache.
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (found_mtimes[i])
+      (*mtimes)[i] = *found_mtimes[i];
+  }
 }
 
 bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
@@ -245,6 +843,139 @@ bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
   return true;
 }
 
+void RealDiskInterface::HashFiles(const vector<const string*>& paths,
+                                  vector<uint64_t>* hashes) {
+  METRIC_RECORD("hash files");
+  hashes->resize(paths.size());
+  if (paths.empty())
+    return;
+  // Hashing is bound by the processors once the files are in the page
+  // cache, which they are right after being written.
+  int threads = (int)min(paths.size(), (size_t)max(GetProcessorCount(), 1));
+  HashFilesArgs args = { &paths, hashes };
+  ParallelFor(paths.size(), threads, HashFilesThread, &args);
+}
+
+bool RealDiskInterface::SetMTime(const string& path, TimeStamp mtime) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+                            NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    Error("SetMTime(%s): %s", path.c_str(),
+          GetLastErrorString().c_str());
+    return false;
+  }
+  // The reverse of TimeStampFromFileTime().
+  uint64_t filetime = (uint64_t)mtime + 12622770400LL * (1000000000LL / 100);
+  FILETIME write_time;
+  write_time.dwLowDateTime = (DWORD)filetime;
+  write_time.dwHighDateTime = (DWORD)(filetime >> 32);
+  bool ok = SetFileTime(file, NULL, NULL, &write_time) != 0;
+  if (!ok)
+    Error("SetMTime(%s): %s", path.c_str(), GetLastErrorString().c_str());
+  CloseHandle(file);
+#else
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = mtime / 1000000000LL;
+  times[1].tv_nsec = mtime % 1000000000LL;
+  bool ok = utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+  if (!ok)
+    Error("utimensat(%s): %s", path.c_str(), strerror(errno));
+#endif
+  string dir, base;
+  if (ok && cache_ && SplitCachePath(path, &dir, &base)) {
+    // Have Stat() look at the file again.
+    bool found;
+    if (StatCache::Dir* files = cache_->Find(dir, &found)) {
+      StatCache::Dir::iterator i = files->find(base);
+      if (i != files->end())
+        i->second = -1;
+    }
+  }
+  return ok;
+}
+
+bool RealDiskInterface::CloneFile(const string& from, const string& to) {
+#ifdef _WIN32
+  FILE* in = fopen(from.c_str(), "rb");
+  if (!in) {
+    Error("CloneFile(%s): %s", from.c_str(), strerror(errno));
+    return false;
+  }
+  FILE* out = fopen(to.c_str(), "wb");
+  if (!out) {
+    Error("CloneFile(%s): %s", to.c_str(), strerror(errno));
+    fclose(in);
+    return false;
+  }
+  char buf[64 << 10];
+  size_t len;
+  bool ok = true;
+  while (ok && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, len, out) == len;
+  ok = ok && !ferror(in);
+  fclose(in);
+  ok = fclose(out) == 0 && ok;
+  if (!ok)
+    Error("CloneFile(%s): %s", to.c_str(), strerror(errno));
+  return ok;
+#else
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0) {
+    Error("open(%s): %s", from.c_str(), strerror(errno));
+    return false;
+  }
+  // Keep the permissions, so that executables stay executable.
+  struct stat st;
+  if (fstat(in, &st) < 0) {
+    Error("stat(%s): %s", from.c_str(), strerror(errno));
+    close(in);
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out < 0) {
+    Error("open(%s): %s", to.c_str(), strerror(errno));
+    close(in);
+    return false;
+  }
+  bool ok = false;
+#ifdef FICLONE
+  ok = ioctl(out, FICLONE, in) == 0;
+#endif
+  if (!ok) {
+    ok = true;
+    char buf[64 << 10];
+    ssize_t len;
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+      if (len < 0) {
+        ok = errno == EINTR;
+        continue;
+      }
+      for (ssize_t done = 0; ok && done < len; ) {
+        ssize_t written = write(out, buf + done, len - done);
+        if (written >= 0)
+          done += written;
+        else
+          ok = errno == EINTR;
+      }
+    }
+  }
+  if (!ok)
+    Error("copying %s to %s: %s", from.c_str(), to.c_str(), strerror(errno));
+  close(in);
+  if (close(out) < 0 && ok) {
+    Error("close(%s): %s", to.c_str(), strerror(errno));
+    ok = false;
+  }
+  return ok;
+#endif
+}
+
 bool RealDiskInterface::MakeDir(const string& path) {
   if (::MakeDir(path) < 0) {
     if (errno == EEXIST) {
@@ -256,6 +987,17 @@ bool RealDiskInterface::MakeDir(const string& path) {
   return true;
 }
 
+bool RealDiskInterface::MapFile(const string& path, MappedFile* file) {
+  string err;
+  if (file->Map(path, &err) < 0)
+    return false;
+  if (!file->nul_terminated()) {
+    file->Unmap();
+    return false;
+  }
+  return true;
+}
+
 FileReader::Status RealDiskInterface::ReadFile(const string& path,
                                                string* contents,
                                                string* err) {
@@ -280,10 +1022,65 @@ int RealDiskInterface::RemoveFile(const string& path) {
   }
 }
 
-void RealDiskInterface::AllowStatCache(bool allow) {
+void RealDiskInterface::RemoveFiles(const vector<string>& paths,
+                                    vector<int>* results) {
+  METRIC_RECORD("remove files");
+  results->resize(paths.size());
+  if (paths.empty())
+    return;
+
+  // Group the files by directory, in chunks small enough to spread a big
+  // directory over several threads.  Of a file named twice, only one
+  // removal succeeds, wherever the two end up.
+  vector<RemoveChunk> chunks;
+  map<string, size_t> open_chunks;
+  for (size_t i = 0; i < paths.size(); ++i) {
 #ifdef _WIN32
-  use_cache_ = allow;
-  if (!use_cache_)
-    cache_.clear();
+    string::size_type slash = paths[i].find_last_of("\\/");
+#else
+    string::size_type slash = paths[i].rfind('/');
 #endif
+    string dir = slash == string::npos ? string() :
+        slash == 0 ? paths[i].substr(0, 1) : paths[i].substr(0, slash);
+    map<string, size_t>::iterator chunk = open_chunks.find(dir);
+    if (chunk == open_chunks.end()) {
+      chunk = open_chunks.insert(make_pair(dir, chunks.size())).first;
+      chunks.push_back(RemoveChunk());
+      chunks.back().dir = dir;
+    } else if (chunks[chunk->second].files.size() == kPathsPerThread) {
+      chunk->second = chunks.size();
+      chunks.push_back(RemoveChunk());
+      chunks.back().dir = dir;
+    }
+    chunks[chunk->second].files.push_back(i);
+  }
+
+  vector<int> errors(paths.size());
+  int threads = (int)min(chunks.size(), (size_t)kMaxThreads);
+  RemoveFilesArgs args = { &paths, &chunks, &errors };
+  ParallelFor(chunks.size(), threads, RemoveFilesThread, &args);
+
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (errors[i] == 0) {
+      (*results)[i] = 0;
+    } else if (errors[i] == ENOENT) {
+      (*results)[i] = 1;
+    } else {
+      Error("remove(%s): %s", paths[i].c_str(), strerror(errors[i]));
+      (*results)[i] = -1;
+    }
+  }
+}
+
+bool RealDiskInterface::AllowsConcurrentWrites() const {
+  return !cache_ && !g_stat_audit;
+}
+
+void RealDiskInterface::AllowStatCache(bool allow) {
+  if (allow && !cache_) {
+    cache_ = new StatCache;
+  } else if (!allow) {
+    delete cache_;
+    cache_ = NULL;
+  }
 }
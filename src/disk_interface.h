@@ -16,10 +16,13 @@
 #define NINJA_DISK_INTERFACE_H_
 
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 using namespace std;
 
 #include "timestamp.h"
+#include "util.h"  // uint64_t
 
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
@@ -37,6 +40,12 @@ struct FileReader {
   /// On error, return another Status and fill |err|.
   virtual Status ReadFile(const string& path, string* contents,
                           string* err) = 0;
+
+  /// Map the file at |path| into |file| to read it in place, if the reader
+  /// can, and if a NUL can be read right after its end.  Returns false
+  /// otherwise, and the caller uses ReadFile() instead, which reports the
+  /// errors.  The default implementation never maps.
+  virtual bool MapFile(const string& path, MappedFile* file) { return false; }
 };
 
 /// Interface for accessing the disk.
@@ -48,6 +57,26 @@ struct DiskInterface: public FileReader {
   /// other errors.
   virtual TimeStamp Stat(const string& path, string* err) const = 0;
 
+  /// stat() each of |paths| like Stat() does, storing the results in
+  /// |mtimes|.  Errors are stored as -1 without a message; callers find
+  /// them again with Stat().  The default implementation calls Stat() on
+  /// each path in turn.
+  virtual void StatMany(const vector<const string*>& paths,
+                        vector<TimeStamp>* mtimes) const;
+
+  /// Hash the contents of each of |paths| with ContentHash, storing the
+  /// results in |hashes|.  A file that can't be read gets 0, which no
+  /// hash is.  The default implementation reads each file in turn.
+  virtual void HashFiles(const vector<const string*>& paths,
+                         vector<uint64_t>* hashes);
+
+  /// Set the mtime of an existing file, returning false on failure.
+  virtual bool SetMTime(const string& path, TimeStamp mtime) = 0;
+
+  /// Copy the contents of |from| to a new file |to|, which gets a fresh
+  /// mtime.  Returns false on failure.
+  virtual bool CloneFile(const string& from, const string& to) = 0;
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const string& path) = 0;
 
@@ -62,39 +91,81 @@ struct DiskInterface: public FileReader {
   ///          -1 if an error occurs.
   virtual int RemoveFile(const string& path) = 0;
 
+  /// Remove each of |paths| like RemoveFile() does, storing the results in
+  /// |results|.  The default implementation calls RemoveFile() on each path
+  /// in turn.
+  virtual void RemoveFiles(const vector<string>& paths, vector<int>* results);
+
   /// Create all the parent directories for path; like mkdir -p
   /// `basename path`.
   bool MakeDirs(const string& path);
+
+  /// Whether ReadFile() and WriteFile() can be called from another thread
+  /// while this one keeps using the interface.
+  virtual bool AllowsConcurrentWrites() const { return false; }
+};
+
+/// Creates the parent directories of files like DiskInterface::MakeDirs(),
+/// but remembers the directories it found or made, so that the outputs of
+/// a build only stat() each of their directories once.
+struct DirectoryMaker {
+  explicit DirectoryMaker(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+
+  /// Stat the parent directories of |paths| in one batch, remembering the
+  /// ones that exist.
+  void Prefetch(const vector<string>& paths);
+
+  /// Create all the parent directories of |path| that aren't known to
+  /// exist.
+  bool MakeDirs(const string& path);
+
+  /// Used for tests.
+  size_t known_count() const { return known_.size(); }
+
+ private:
+  DiskInterface* disk_interface_;
+  set<string> known_;
 };
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  RealDiskInterface()
-#ifdef _WIN32
-                      : use_cache_(false)
-#endif
-                      {}
-  virtual ~RealDiskInterface() {}
+  RealDiskInterface() : cache_(NULL) {}
+  virtual ~RealDiskInterface();
   virtual TimeStamp Stat(const string& path, string* err) const;
+  /// Issues the stat() calls from several threads, which hides the latency
+  /// of network and overlay filesystems.
+  virtual void StatMany(const vector<const string*>& paths,
+                        vector<TimeStamp>* mtimes) const;
+  /// Hashes the files from as many threads as there are processors.
+  virtual void HashFiles(const vector<const string*>& paths,
+                         vector<uint64_t>* hashes);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  /// Clones the file where the filesystem can share its blocks.
+  virtual bool CloneFile(const string& from, const string& to);
   virtual bool MakeDir(const string& path);
   virtual bool WriteFile(const string& path, const string& contents);
   virtual Status ReadFile(const string& path, string* contents, string* err);
+  virtual bool MapFile(const string& path, MappedFile* file);
   virtual int RemoveFile(const string& path);
-
-  /// Whether stat information can be cached.  Only has an effect on Windows.
+  /// Removes the files from several threads, each of them relative to an
+  /// open descriptor of the file's directory on POSIX systems.  Errors are
+  /// reported in the order of |paths|.
+  virtual void RemoveFiles(const vector<string>& paths, vector<int>* results);
+
+  /// Whether stat information can be cached.  While it can, Stat() reads
+  /// the whole directory of a file once and answers for all the files in
+  /// it from memory.  Disallowing it drops what was cached.
   void AllowStatCache(bool allow);
 
+  /// True while neither the stat cache nor '-d stataudit', which only the
+  /// main thread may use, is on.
+  virtual bool AllowsConcurrentWrites() const;
+
  private:
-#ifdef _WIN32
-  /// Whether stat information can be cached.
-  bool use_cache_;
-
-  typedef map<string, TimeStamp> DirCache;
-  // TODO: Neither a map nor a hashmap seems ideal here.  If the statcache
-  // works out, come up with a better data structure.
-  typedef map<string, DirCache> Cache;
-  mutable Cache cache_;
-#endif
+  struct StatCache;
+  /// The directories read so far, if stat information can be cached.
+  StatCache* cache_;
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
@@ -19,6 +19,7 @@
 #include <windows.h>
 #endif
 
+#include "debug_flags.h"
 #include "disk_interface.h"
 #include "graph.h"
 #include "test.h"
@@ -83,6 +84,42 @@ TEST_F(DiskInterfaceTest, StatExistingFile) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(DiskInterfaceTest, StatMany) {
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(Touch("file2"));
+  string file1 = "file1", file2 = "file2", missing = "nosuchfile";
+  string missing_parent = "nosuchdir/nosuchfile";
+  vector<const string*> paths;
+  // Enough paths to make several threads do the work.
+  for (int i = 0; i < 1000; ++i) {
+    paths.push_back(&file1);
+    paths.push_back(&missing);
+    paths.push_back(&file2);
+    paths.push_back(&missing_parent);
+  }
+  string too_long_name(512, 'x');
+  paths.push_back(&too_long_name);
+
+  string err;
+  TimeStamp mtime1 = disk_.Stat("file1", &err);
+  TimeStamp mtime2 = disk_.Stat("file2", &err);
+  // With and without io_uring, where it is available.
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    g_experimental_io_uring = io_uring;
+    vector<TimeStamp> mtimes;
+    disk_.StatMany(paths, &mtimes);
+    ASSERT_EQ(paths.size(), mtimes.size());
+    for (size_t i = 0; i + 1 < paths.size(); i += 4) {
+      EXPECT_EQ(mtime1, mtimes[i]);
+      EXPECT_EQ(0, mtimes[i + 1]);
+      EXPECT_EQ(mtime2, mtimes[i + 2]);
+      EXPECT_EQ(0, mtimes[i + 3]);
+    }
+    EXPECT_EQ(-1, mtimes.back());
+  }
+  g_experimental_io_uring = false;
+}
+
 TEST_F(DiskInterfaceTest, StatExistingDir) {
   string err;
   ASSERT_TRUE(disk_.MakeDir("subdir"));
@@ -164,6 +201,60 @@ TEST_F(DiskInterfaceTest, StatCache) {
   EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile", &err));
   EXPECT_EQ("", err);
 }
+#else
+TEST_F(DiskInterfaceTest, StatCache) {
+  string err;
+
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(disk_.MakeDir("subdir/subsubdir"));
+  ASSERT_TRUE(Touch("subdir/subfile1"));
+  ASSERT_TRUE(Touch("notadir"));
+
+  disk_.AllowStatCache(false);
+  TimeStamp file1_uncached = disk_.Stat("file1", &err);
+  TimeStamp subdir_uncached = disk_.Stat("subdir", &err);
+  disk_.AllowStatCache(true);
+
+  EXPECT_EQ(file1_uncached, disk_.Stat("file1", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir", &err));
+  EXPECT_EQ("", err);
+  EXPECT_GT(disk_.Stat("subdir/subfile1", &err), 1);
+  EXPECT_EQ("", err);
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir/subsubdir/..", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(disk_.Stat("subdir/subsubdir", &err),
+            disk_.Stat("subdir/subsubdir/.", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_EQ(0, disk_.Stat("nosuchfile", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("notadir/nosuchfile", &err));
+  EXPECT_EQ("", err);
+
+  // Files that appear once a directory is cached are only seen once the
+  // cache is dropped.
+  ASSERT_TRUE(Touch("subdir/subfile2"));
+  vector<const string*> paths;
+  string file2("subdir/subfile2");
+  paths.push_back(&file2);
+  vector<TimeStamp> mtimes;
+  disk_.StatMany(paths, &mtimes);
+  ASSERT_EQ(1u, mtimes.size());
+  EXPECT_EQ(0, mtimes[0]);
+  disk_.AllowStatCache(false);
+  disk_.AllowStatCache(true);
+  disk_.StatMany(paths, &mtimes);
+  EXPECT_GT(mtimes[0], 1);
+
+  // Errors are still reported.
+  string too_long_name(512, 'x');
+  EXPECT_EQ(-1, disk_.Stat(too_long_name, &err));
+  EXPECT_NE("", err);
+}
 #endif
 
 TEST_F(DiskInterfaceTest, ReadFile) {
@@ -203,6 +294,29 @@ TEST_F(DiskInterfaceTest, MakeDirs) {
 #endif
 }
 
+TEST_F(DiskInterfaceTest, DirectoryMaker) {
+  ASSERT_TRUE(disk_.MakeDir("exists"));
+  DirectoryMaker dirs(&disk_);
+  vector<string> paths;
+  paths.push_back("exists/a");
+  paths.push_back("exists/b");
+  paths.push_back("new/c");
+  dirs.Prefetch(paths);
+  EXPECT_EQ(1u, dirs.known_count());
+
+  EXPECT_TRUE(dirs.MakeDirs("new/sub/c"));
+  EXPECT_EQ(3u, dirs.known_count());
+  string err;
+  EXPECT_GT(disk_.Stat("new/sub", &err), 0);
+  ASSERT_EQ("", err);
+
+  // Siblings find their directories known.
+  EXPECT_TRUE(dirs.MakeDirs("new/sub/d"));
+  EXPECT_TRUE(dirs.MakeDirs("exists/e"));
+  EXPECT_TRUE(dirs.MakeDirs("top-level"));
+  EXPECT_EQ(3u, dirs.known_count());
+}
+
 TEST_F(DiskInterfaceTest, RemoveFile) {
   const char* kFileName = "file-to-remove";
   ASSERT_TRUE(Touch(kFileName));
@@ -211,12 +325,54 @@ TEST_F(DiskInterfaceTest, RemoveFile) {
   EXPECT_EQ(1, disk_.RemoveFile("does not exist"));
 }
 
+TEST_F(DiskInterfaceTest, RemoveFiles) {
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(disk_.MakeDir("subdir/empty"));
+  vector<string> paths;
+  // Enough files in one directory to need several chunks.
+  for (int i = 0; i < 600; ++i) {
+    char name[32];
+    sprintf(name, "subdir/file%d", i);
+    ASSERT_TRUE(Touch(name));
+    paths.push_back(name);
+  }
+  ASSERT_TRUE(Touch("top"));
+  paths.push_back("top");
+  paths.push_back("top");
+  paths.push_back("does not exist");
+  paths.push_back("subdir/empty");
+
+  vector<int> results;
+  disk_.RemoveFiles(paths, &results);
+  ASSERT_EQ(paths.size(), results.size());
+  for (int i = 0; i < 600; ++i)
+    EXPECT_EQ(0, results[i]);
+  // Only one of the two removals of the same file finds it.
+  EXPECT_EQ(1, results[600] + results[601]);
+  EXPECT_EQ(1, results[602]);
+  // Like remove(), empty directories go too.
+  EXPECT_EQ(0, results[603]);
+
+  string err;
+  EXPECT_EQ(0, disk_.Stat("subdir/file0", &err));
+  EXPECT_EQ(0, disk_.Stat("top", &err));
+  EXPECT_EQ(0, disk_.Stat("subdir/empty", &err));
+}
+
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
   StatTest() : scan_(&state_, NULL, NULL, this) {}
 
   // DiskInterface implementation.
   virtual TimeStamp Stat(const string& path, string* err) const;
+  virtual bool SetMTime(const string& path, TimeStamp mtime) {
+    assert(false);
+    return false;
+  }
+  virtual bool CloneFile(const string& from, const string& to) {
+    assert(false);
+    return false;
+  }
   virtual bool WriteFile(const string& path, const string& contents) {
     assert(false);
     return true;
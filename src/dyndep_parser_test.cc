@@ -0,0 +1,309 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "dyndep_parser.h"
+
+#include <map>
+#include <vector>
+
+#include "dyndep.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+struct DyndepParserTest : public testing::Test {
+  void AssertParse(const char* input) {
+    DyndepParser parser(&state_, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_TRUE(parser.ParseTest(input, &err));
+    ASSERT_EQ("", err);
+  }
+
+  virtual void SetUp() {
+    ::AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"build out otherout: touch\n");
+  }
+
+  State state_;
+  VirtualFileSystem fs_;
+  DyndepFile dyndep_file_;
+};
+
+TEST_F(DyndepParserTest, Empty) {
+  const char kInput[] =
+"";
+  DyndepParser parser(&state_, &fs_, &dyndep_file_);
+  string err;
+  EXPECT_FALSE(parser.ParseTest(kInput, &err));
+  EXPECT_EQ("input:1: expected 'ninja_dyndep_version = ...'\n", err);
+}
+
+TEST_F(DyndepParserTest, Version1) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"));
+}
+
+TEST_F(DyndepParserTest, Version1Extra) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1-extra\n"));
+}
+
+TEST_F(DyndepParserTest, Version1_0) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1.0\n"));
+}
+
+TEST_F(DyndepParserTest, CommentVersion) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"# comment\n"
+"ninja_dyndep_version = 1\n"));
+}
+
+TEST_F(DyndepParserTest, BlankLineVersion) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"\n"
+"ninja_dyndep_version = 1\n"));
+}
+
+TEST_F(DyndepParserTest, VersionCRLF) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\r\n"));
+}
+
+TEST_F(DyndepParserTest, Errors) {
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("foo", &err));
+    EXPECT_EQ("input:1: expected '=', got eof\n"
+              "foo\n"
+              "   ^ near here"
+              , err);
+  }
+
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("x = 1\n", &err));
+    EXPECT_EQ("input:1: expected 'ninja_dyndep_version = ...'\n"
+              "x = 1\n"
+              "     ^ near here", err);
+  }
+
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 0\n", &err));
+    EXPECT_EQ("input:1: unsupported 'ninja_dyndep_version = 0'\n"
+              "ninja_dyndep_version = 0\n"
+              "                        ^ near here", err);
+  }
+
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1.1\n", &err));
+    EXPECT_EQ("input:1: unsupported 'ninja_dyndep_version = 1.1'\n"
+              "ninja_dyndep_version = 1.1\n"
+              "                          ^ near here", err);
+  }
+
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "ninja_dyndep_version = 1\n", &err));
+    EXPECT_EQ("input:2: unexpected identifier\n", err);
+  }
+
+  {
+    State state;
+    DyndepParser parser(&state, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("build out: dyndep\n", &err));
+    EXPECT_EQ("input:1: expected 'ninja_dyndep_version = ...'\n", err);
+  }
+}
+
+TEST_F(DyndepParserTest, EdgeErrors) {
+  {
+    DyndepParser parser(&state_, &fs_, &dyndep_file_);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build missing: dyndep\n", &err));
+    EXPECT_EQ("input:2: no build statement exists for 'missing'\n"
+              "build missing: dyndep\n"
+              "             ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out: dyndep\n"
+                                  "build out: dyndep\n", &err));
+    EXPECT_EQ("input:3: multiple statements for 'out'\n"
+              "build out: dyndep\n"
+              "         ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out otherout: dyndep\n", &err));
+    EXPECT_EQ("input:2: explicit outputs not supported\n"
+              "build out otherout: dyndep\n"
+              "                  ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out: touch\n", &err));
+    EXPECT_EQ("input:2: expected build command name 'dyndep'\n"
+              "build out: touch\n"
+              "           ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out: dyndep in\n", &err));
+    EXPECT_EQ("input:2: explicit inputs not supported\n"
+              "build out: dyndep in\n"
+              "                    ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out: dyndep || in\n", &err));
+    EXPECT_EQ("input:2: order-only inputs not supported\n"
+              "build out: dyndep || in\n"
+              "                  ^ near here", err);
+  }
+
+  {
+    DyndepFile dyndep_file;
+    DyndepParser parser(&state_, &fs_, &dyndep_file);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("ninja_dyndep_version = 1\n"
+                                  "build out: dyndep\n"
+                                  "  not_restat = 1\n", &err));
+    EXPECT_EQ("input:3: binding is not 'restat'\n"
+              "  not_restat = 1\n"
+              "                ^ near here", err);
+  }
+}
+
+TEST_F(DyndepParserTest, NoImplicit) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"));
+
+  EXPECT_EQ(1u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+  EXPECT_EQ(false, i->second.restat_);
+  EXPECT_EQ(0u, i->second.implicit_outputs_.size());
+  EXPECT_EQ(0u, i->second.implicit_inputs_.size());
+}
+
+TEST_F(DyndepParserTest, ImplicitInAndOut) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build out | impout: dyndep | impin\n"));
+
+  EXPECT_EQ(1u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+  EXPECT_EQ(false, i->second.restat_);
+  ASSERT_EQ(1u, i->second.implicit_outputs_.size());
+  EXPECT_EQ("impout", i->second.implicit_outputs_[0]->path());
+  ASSERT_EQ(1u, i->second.implicit_inputs_.size());
+  EXPECT_EQ("impin", i->second.implicit_inputs_[0]->path());
+}
+
+TEST_F(DyndepParserTest, CanonicalizePaths) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build ./out | ./impout: dyndep | sub/../impin\n"));
+
+  EXPECT_EQ(1u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+  ASSERT_EQ(1u, i->second.implicit_outputs_.size());
+  EXPECT_EQ("impout", i->second.implicit_outputs_[0]->path());
+  ASSERT_EQ(1u, i->second.implicit_inputs_.size());
+  EXPECT_EQ("impin", i->second.implicit_inputs_[0]->path());
+}
+
+TEST_F(DyndepParserTest, Restat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"  restat = 1\n"));
+
+  EXPECT_EQ(1u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+  EXPECT_EQ(true, i->second.restat_);
+}
+
+TEST_F(DyndepParserTest, OtherOutput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build otherout: dyndep\n"));
+
+  EXPECT_EQ(1u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+}
+
+TEST_F(DyndepParserTest, MultipleEdges) {
+  ::AssertParse(&state_,
+"build out2: touch\n");
+  ASSERT_EQ(2u, state_.edges_.size());
+
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"build out2: dyndep\n"
+"  restat = 1\n"));
+
+  EXPECT_EQ(2u, dyndep_file_.size());
+  DyndepFile::iterator i = dyndep_file_.find(state_.edges_[0]);
+  ASSERT_NE(i, dyndep_file_.end());
+  EXPECT_EQ(false, i->second.restat_);
+  i = dyndep_file_.find(state_.edges_[1]);
+  ASSERT_NE(i, dyndep_file_.end());
+  EXPECT_EQ(true, i->second.restat_);
+}
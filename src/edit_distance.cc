@@ -14,6 +14,8 @@
 
 #include "edit_distance.h"
 
+#include <stdlib.h>
+
 #include <algorithm>
 #include <vector>
 
@@ -33,26 +35,57 @@ int EditDistance(const StringPiece& s1,
   // only the entries to the left, top, and top-left are needed.  The left
   // entry is in row[x-1], the top entry is what's in row[x] from the last
   // iteration, and the top-left entry is stored in previous.
+  //
+  // With a |max_edit_distance|, only the band of cells within that distance
+  // of the diagonal can matter: the others are further away than that, so
+  // they are left at |max_edit_distance| + 1.
   int m = s1.len_;
   int n = s2.len_;
+  if (max_edit_distance && abs(m - n) > max_edit_distance)
+    return max_edit_distance + 1;
+
+  // A common prefix or suffix doesn't change the distance, and the paths
+  // that get compared often share long ones.
+  const char* a = s1.str_;
+  const char* b = s2.str_;
+  while (m > 0 && n > 0 && *a == *b) {
+    ++a;
+    ++b;
+    --m;
+    --n;
+  }
+  while (m > 0 && n > 0 && a[m - 1] == b[n - 1]) {
+    --m;
+    --n;
+  }
 
-  vector<int> row(n + 1);
-  for (int i = 1; i <= n; ++i)
-    row[i] = i;
+  int band = max_edit_distance ? max_edit_distance : max(m, n);
+  int too_far = band + 1;
+  int short_row[128];
+  vector<int> long_row;
+  int* row = short_row;
+  if (n + 1 > 128) {
+    long_row.resize(n + 1);
+    row = &long_row[0];
+  }
+  for (int i = 0; i <= n; ++i)
+    row[i] = i <= band ? i : too_far;
 
   for (int y = 1; y <= m; ++y) {
-    row[0] = y;
-    int best_this_row = row[0];
+    int first = max(1, y - band);
+    int last = min(n, y + band);
+    int previous = row[first - 1];
+    row[first - 1] = first == 1 ? y : too_far;
+    int best_this_row = row[first - 1];
 
-    int previous = y - 1;
-    for (int x = 1; x <= n; ++x) {
+    for (int x = first; x <= last; ++x) {
       int old_row = row[x];
       if (allow_replacements) {
-        row[x] = min(previous + (s1.str_[y - 1] == s2.str_[x - 1] ? 0 : 1),
+        row[x] = min(previous + (a[y - 1] == b[x - 1] ? 0 : 1),
                      min(row[x - 1], row[x]) + 1);
       }
       else {
-        if (s1.str_[y - 1] == s2.str_[x - 1])
+        if (a[y - 1] == b[x - 1])
           row[x] = previous;
         else
           row[x] = min(row[x - 1], row[x]) + 1;
@@ -62,8 +95,8 @@ int EditDistance(const StringPiece& s1,
     }
 
     if (max_edit_distance && best_this_row > max_edit_distance)
-      return max_edit_distance + 1;
+      return too_far;
   }
 
-  return row[n];
+  return min(row[n], too_far);
 }
@@ -17,6 +17,9 @@
 
 #include "string_piece.h"
 
+/// The Levenshtein distance between |s1| and |s2|.  With a nonzero
+/// |max_edit_distance|, anything further than that is reported as
+/// |max_edit_distance| + 1, which is quicker to find.
 int EditDistance(const StringPiece& s1,
                  const StringPiece& s2,
                  bool allow_replacements = true,
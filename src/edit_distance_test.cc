@@ -14,6 +14,8 @@
 
 #include "edit_distance.h"
 
+#include <algorithm>
+
 #include "test.h"
 
 TEST(EditDistanceTest, TestEmpty) {
@@ -46,3 +48,35 @@ TEST(EditDistanceTest, TestBasics) {
   EXPECT_EQ(1, EditDistance("browser_test", "browser_tests"));
   EXPECT_EQ(1, EditDistance("browser_tests", "browser_test"));
 }
+
+TEST(EditDistanceTest, TestBounded) {
+  const char* kWords[] = {
+    "", "a", "ninja", "njnja", "ninja_test", "ninja_tests", "build/ninja.o",
+    "build/ninja_test.o", "out/obj/lib1/src/dir2/file3.o",
+    "out/obj/lib1/src/dir2/file13.o", "out/obj/lib2/src/dir1/file3.o",
+    "out/obj/lib1/src/dir2/file3.obj", NULL
+  };
+  for (const char** a = kWords; *a; ++a) {
+    for (const char** b = kWords; *b; ++b) {
+      for (int replacements = 0; replacements < 2; ++replacements) {
+        int distance = EditDistance(*a, *b, replacements != 0);
+        for (int max_distance = 1; max_distance < 5; ++max_distance) {
+          EXPECT_EQ(min(distance, max_distance + 1),
+                    EditDistance(*a, *b, replacements != 0, max_distance));
+        }
+      }
+    }
+  }
+}
+
+TEST(EditDistanceTest, TestLong) {
+  string a(300, 'a');
+  string b = a;
+  b[10] = 'b';
+  b[290] = 'b';
+  b.insert(150, "c");
+  EXPECT_EQ(3, EditDistance(a, b));
+  EXPECT_EQ(3, EditDistance(a, b, true, 3));
+  EXPECT_EQ(3, EditDistance(a, b, true, 2));
+  EXPECT_EQ(5, EditDistance(a, b, false));
+}
@@ -15,18 +15,97 @@
 #include <assert.h>
 
 #include "eval_env.h"
+#include "content_hash.h"
+#include "hash_map.h"
+#include "memory_stats.h"
 
-string BindingEnv::LookupVariable(const string& var) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
+namespace {
+
+/// The names of the variables with fixed ids, in VarNames::Builtin order.
+const char* const kBuiltinNames[] = {
+  "in",
+  "in_newline",
+  "out",
+  "command",
+  "depfile",
+  "description",
+  "deps",
+  "generator",
+  "pool",
+  "restat",
+  "weight",
+  "rspfile",
+  "rspfile_content",
+  "msvc_deps_prefix",
+  "direct_exec",
+  "depfile_in_memory",
+  "dyndep",
+  "priority",
+  "hedge",
+};
+
+struct InternedNames {
+  InternedNames() {
+    for (size_t i = 0; i < sizeof(kBuiltinNames) / sizeof(kBuiltinNames[0]);
+         ++i) {
+      Add(kBuiltinNames[i]);
+    }
+    assert(names.size() == VarNames::kBuiltinCount);
+  }
+
+  int Add(StringPiece name) {
+    // The names are never freed, so the keys can point into them.
+    string* copy = new string(name.AsString());
+    int var = names.size();
+    names.push_back(copy);
+    ids[*copy] = var;
+    return var;
+  }
+
+  ExternalStringHashMap<int>::Type ids;
+  vector<const string*> names;
+};
+
+InternedNames& Interned() {
+  static InternedNames* interned = new InternedNames;
+  return *interned;
+}
+
+}  // anonymous namespace
+
+// static
+int VarNames::Intern(StringPiece name) {
+  InternedNames& interned = Interned();
+  ExternalStringHashMap<int>::Type::iterator i = interned.ids.find(name);
+  if (i != interned.ids.end())
     return i->second;
-  if (parent_)
-    return parent_->LookupVariable(var);
+  return interned.Add(name);
+}
+
+// static
+const string& VarNames::Name(int var) {
+  return *Interned().names[var];
+}
+
+string BindingEnv::LookupVariable(int var) {
+  for (BindingEnv* env = this; env; env = env->parent_) {
+    if (const string* value = env->bindings_.Find(var))
+      return *value;
+  }
   return "";
 }
 
+void BindingEnv::AppendVariable(int var, string* result) {
+  for (BindingEnv* env = this; env; env = env->parent_) {
+    if (const string* value = env->bindings_.Find(var)) {
+      result->append(*value);
+      return;
+    }
+  }
+}
+
 void BindingEnv::AddBinding(const string& key, const string& val) {
-  bindings_[key] = val;
+  bindings_[VarNames::Intern(key)] = val;
 }
 
 void BindingEnv::AddRule(const Rule* rule) {
@@ -51,14 +130,14 @@ const Rule* BindingEnv::LookupRule(const string& rule_name) {
 }
 
 void Rule::AddBinding(const string& key, const EvalString& val) {
-  bindings_[key] = val;
+  // Rules outlive the manifests they are parsed from.
+  EvalString& binding = bindings_[VarNames::Intern(key)];
+  binding = val;
+  binding.OwnText();
 }
 
 const EvalString* Rule::GetBinding(const string& key) const {
-  Bindings::const_iterator i = bindings_.find(key);
-  if (i == bindings_.end())
-    return NULL;
-  return &i->second;
+  return GetBinding(VarNames::Intern(key));
 }
 
 // static
@@ -70,63 +149,207 @@ bool Rule::IsReservedBinding(const string& var) {
       var == "generator" ||
       var == "pool" ||
       var == "restat" ||
+      var == "weight" ||
+      var == "priority" ||
       var == "rspfile" ||
       var == "rspfile_content" ||
-      var == "msvc_deps_prefix";
+      var == "msvc_deps_prefix" ||
+      var == "direct_exec" ||
+      var == "depfile_in_memory" ||
+      var == "dyndep" ||
+      var == "hedge";
+}
+
+void Rule::ReportMemory(MemoryStats* stats) const {
+  stats->Add("rules", 1,
+             sizeof(Rule) + MemoryStats::StringBytes(name_) +
+             MemoryStats::VectorBytes(bindings_.slots()));
+  const vector<Bindings::Slot>& slots = bindings_.slots();
+  for (vector<Bindings::Slot>::const_iterator i = slots.begin();
+       i != slots.end(); ++i) {
+    if (i->first >= 0)
+      stats->Add("eval strings", 1, i->second.HeapBytes());
+  }
+}
+
+void Rule::InternVariables() const {
+  const vector<Bindings::Slot>& slots = bindings_.slots();
+  for (vector<Bindings::Slot>::const_iterator i = slots.begin();
+       i != slots.end(); ++i) {
+    if (i->first >= 0)
+      i->second.InternVariables();
+  }
 }
 
 const map<string, const Rule*>& BindingEnv::GetRules() const {
   return rules_;
 }
 
-string BindingEnv::LookupWithFallback(const string& var,
-                                      const EvalString* eval,
+void BindingEnv::ReportMemory(MemoryStats* stats) const {
+  const vector<VarTable<string>::Slot>& slots = bindings_.slots();
+  size_t bytes = sizeof(BindingEnv) + MemoryStats::VectorBytes(slots);
+  for (vector<VarTable<string>::Slot>::const_iterator i = slots.begin();
+       i != slots.end(); ++i) {
+    bytes += MemoryStats::StringBytes(i->second);
+  }
+  stats->Add("bindings", bindings_.size(), bytes);
+  for (map<string, const Rule*>::const_iterator i = rules_.begin();
+       i != rules_.end(); ++i) {
+    i->second->ReportMemory(stats);
+  }
+}
+
+string BindingEnv::LookupWithFallback(int var, const EvalString* eval,
                                       Env* env) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
-    return i->second;
+  string result;
+  AppendWithFallback(var, eval, env, &result);
+  return result;
+}
 
-  if (eval)
-    return eval->Evaluate(env);
+void BindingEnv::AppendWithFallback(int var, const EvalString* eval,
+                                    Env* env, string* result) {
+  if (const string* value = bindings_.Find(var))
+    result->append(*value);
+  else if (eval)
+    eval->Evaluate(env, result);
+  else if (parent_)
+    parent_->AppendVariable(var, result);
+}
 
-  if (parent_)
-    return parent_->LookupVariable(var);
+EvalString::EvalString(const EvalString& other) : owned_(false) {
+  *this = other;
+}
 
-  return "";
+EvalString& EvalString::operator=(const EvalString& other) {
+  if (this == &other)
+    return *this;
+  parsed_ = other.parsed_;
+  text_ = other.text_;
+  owned_ = other.owned_;
+  // Owned tokens point into the other string's copy of the text.
+  if (owned_) {
+    for (TokenList::iterator i = parsed_.begin(); i != parsed_.end(); ++i)
+      i->text.str_ = text_.data() + (i->text.str_ - other.text_.data());
+  }
+  return *this;
 }
 
 string EvalString::Evaluate(Env* env) const {
   string result;
+  Evaluate(env, &result);
+  return result;
+}
+
+void EvalString::Evaluate(Env* env, string* result) const {
   for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
-    if (i->second == RAW)
-      result.append(i->first);
-    else
-      result.append(env->LookupVariable(i->first));
+    if (i->type == RAW) {
+      result->append(i->text.str_, i->text.len_);
+    } else {
+      if (i->var < 0)
+        i->var = VarNames::Intern(i->text);
+      env->AppendVariable(i->var, result);
+    }
   }
-  return result;
 }
 
 void EvalString::AddText(StringPiece text) {
-  // Add it to the end of an existing RAW token if possible.
-  if (!parsed_.empty() && parsed_.back().second == RAW) {
-    parsed_.back().first.append(text.str_, text.len_);
+  assert(!owned_);
+  // Add it to the end of an existing RAW token if it follows it in memory,
+  // as consecutive spans of the same manifest do.
+  if (!parsed_.empty() && parsed_.back().type == RAW &&
+      parsed_.back().text.str_ + parsed_.back().text.len_ == text.str_) {
+    parsed_.back().text.len_ += text.len_;
   } else {
-    parsed_.push_back(make_pair(text.AsString(), RAW));
+    parsed_.push_back(Token(text, RAW));
   }
 }
+
 void EvalString::AddSpecial(StringPiece text) {
-  parsed_.push_back(make_pair(text.AsString(), SPECIAL));
+  assert(!owned_);
+  parsed_.push_back(Token(text, SPECIAL));
+}
+
+void EvalString::OwnText() {
+  if (owned_)
+    return;
+  size_t size = 0;
+  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i)
+    size += i->text.len_;
+  text_.reserve(size);
+  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i)
+    text_.append(i->text.str_, i->text.len_);
+  // Only point into |text_| once it's complete.
+  size_t offset = 0;
+  for (TokenList::iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
+    i->text.str_ = text_.data() + offset;
+    offset += i->text.len_;
+  }
+  owned_ = true;
+}
+
+void EvalString::InternVariables() const {
+  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
+    if (i->type == SPECIAL && i->var < 0)
+      i->var = VarNames::Intern(i->text);
+  }
+}
+
+size_t EvalString::HeapBytes() const {
+  return parsed_.capacity() * sizeof(Token) + MemoryStats::StringBytes(text_);
 }
 
 string EvalString::Serialize() const {
   string result;
   for (TokenList::const_iterator i = parsed_.begin();
        i != parsed_.end(); ++i) {
-    result.append("[");
-    if (i->second == SPECIAL)
+    // Text split across tokens is shown as one.
+    bool continued = i != parsed_.begin() && i->type == RAW &&
+                     (i - 1)->type == RAW;
+    if (continued)
+      result.resize(result.size() - 1);
+    else
+      result.append("[");
+    if (i->type == SPECIAL)
       result.append("$");
-    result.append(i->first);
+    result.append(i->text.str_, i->text.len_);
     result.append("]");
   }
   return result;
 }
+
+BindingEnv* BindingEnvCache::Intern(BindingEnv* env) {
+  assert(env->rules_.empty());
+  // The slots of equal tables can be in different orders, so the hashes
+  // of the bindings are combined in a way that doesn't depend on it.
+  uint64_t hash = reinterpret_cast<uintptr_t>(env->parent_);
+  const vector<VarTable<string>::Slot>& slots = env->bindings_.slots();
+  for (vector<VarTable<string>::Slot>::const_iterator i = slots.begin();
+       i != slots.end(); ++i) {
+    if (i->first >= 0) {
+      hash += ContentHash::Hash(i->second.data(), i->second.size()) *
+              (2 * i->first + 1);
+    }
+  }
+
+  vector<BindingEnv*>& envs = envs_[hash];
+  for (vector<BindingEnv*>::iterator e = envs.begin(); e != envs.end(); ++e) {
+    BindingEnv* other = *e;
+    if (other->parent_ != env->parent_ ||
+        other->bindings_.size() != env->bindings_.size())
+      continue;
+    bool same = true;
+    for (vector<VarTable<string>::Slot>::const_iterator i = slots.begin();
+         same && i != slots.end(); ++i) {
+      if (i->first < 0)
+        continue;
+      const string* value = other->bindings_.Find(i->first);
+      same = value && *value == i->second;
+    }
+    if (same) {
+      delete env;
+      return other;
+    }
+  }
+  envs.push_back(env);
+  return env;
+}
@@ -15,6 +15,9 @@
 #ifndef NINJA_EVAL_ENV_H_
 #define NINJA_EVAL_ENV_H_
 
+#include <stdint.h>
+
+#include <algorithm>
 #include <map>
 #include <string>
 #include <vector>
@@ -22,33 +25,180 @@ using namespace std;
 
 #include "string_piece.h"
 
+struct MemoryStats;
 struct Rule;
 
+/// Variable names interned into small integer ids, so that looking up a
+/// variable hashes and compares an int rather than a string.  The variables
+/// ninja itself reads have fixed ids.  Only used from the main thread.
+struct VarNames {
+  enum Builtin {
+    kIn,
+    kInNewline,
+    kOut,
+    // The reserved rule bindings, see Rule::IsReservedBinding().
+    kCommand,
+    kDepfile,
+    kDescription,
+    kDeps,
+    kGenerator,
+    kPool,
+    kRestat,
+    kWeight,
+    kRspfile,
+    kRspfileContent,
+    kMsvcDepsPrefix,
+    kDirectExec,
+    kDepfileInMemory,
+    kDyndep,
+    kPriority,
+    kHedge,
+    kBuiltinCount
+  };
+
+  /// Return the id of |name|, assigning the next free one if it's new.
+  static int Intern(StringPiece name);
+
+  /// Return the name of the variable with id |var|.
+  static const string& Name(int var);
+};
+
+/// A flat open-addressing hash table from variable ids to values.  Scopes
+/// and rules hold a handful of bindings each, so a lookup usually touches
+/// a single slot.
+template<typename V>
+struct VarTable {
+  /// An id and its value; empty slots have a negative id.
+  typedef pair<int, V> Slot;
+
+  VarTable() : size_(0) {}
+
+  const V* Find(int var) const {
+    if (slots_.empty())
+      return NULL;
+    const Slot& slot = slots_[Probe(var)];
+    return slot.first == var ? &slot.second : NULL;
+  }
+
+  /// Return the value of |var|, inserting an empty one if it's missing.
+  V& operator[](int var) {
+    if ((size_ + 1) * 2 > slots_.size())
+      Grow();
+    Slot& slot = slots_[Probe(var)];
+    if (slot.first != var) {
+      slot.first = var;
+      ++size_;
+    }
+    return slot.second;
+  }
+
+  size_t size() const { return size_; }
+
+  /// All the slots, in no particular order, including the empty ones.
+  const vector<Slot>& slots() const { return slots_; }
+
+ private:
+  /// Return the index of the slot holding |var|, or of the empty slot where
+  /// it would go.  The table is never full.
+  size_t Probe(int var) const {
+    size_t mask = slots_.size() - 1;
+    size_t i = (static_cast<unsigned>(var) * 2654435761u) & mask;
+    while (slots_[i].first != var && slots_[i].first >= 0)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void Grow() {
+    vector<Slot> old(slots_.empty() ? 4 : slots_.size() * 2, Slot(-1, V()));
+    old.swap(slots_);
+    for (typename vector<Slot>::iterator i = old.begin(); i != old.end(); ++i) {
+      if (i->first >= 0)
+        swap(slots_[Probe(i->first)], *i);
+    }
+  }
+
+  vector<Slot> slots_;
+  size_t size_;
+};
+
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
-  virtual string LookupVariable(const string& var) = 0;
+
+  /// Look up the variable with the interned id |var|.
+  virtual string LookupVariable(int var) = 0;
+
+  string LookupVariable(const string& var) {
+    return LookupVariable(VarNames::Intern(var));
+  }
+
+  /// Append the value of the variable |var| to |result|.  Scopes that can
+  /// write it in place, without building a string of it first, override
+  /// this.
+  virtual void AppendVariable(int var, string* result) {
+    result->append(LookupVariable(var));
+  }
 };
 
 /// A tokenized string that contains variable references.
 /// Can be evaluated relative to an Env.
+///
+/// The tokens point into the text they were parsed from, usually the buffer
+/// of a manifest, rather than copying it; that text must outlive the
+/// EvalString unless OwnText() is called.
 struct EvalString {
+  EvalString() : owned_(false) {}
+  EvalString(const EvalString& other);
+  EvalString& operator=(const EvalString& other);
+
   string Evaluate(Env* env) const;
+  /// Append the evaluation to |result|, which can be reused across
+  /// evaluations, with the variables written into it directly.
+  void Evaluate(Env* env, string* result) const;
 
-  void Clear() { parsed_.clear(); }
+  void Clear() { parsed_.clear(); text_.clear(); owned_ = false; }
   bool empty() const { return parsed_.empty(); }
 
   void AddText(StringPiece text);
   void AddSpecial(StringPiece text);
 
+  /// Copy the text that the tokens point to into the EvalString, for one
+  /// that outlives what it was parsed from.  Nothing can be added after.
+  void OwnText();
+
   /// Construct a human-readable representation of the parsed state,
   /// for use in tests.
   string Serialize() const;
 
+  /// The heap bytes of the tokens and of the text they own, for
+  /// '-d memstats'.
+  size_t HeapBytes() const;
+
+  /// Intern the variables that the tokens refer to now, rather than on first
+  /// evaluation, after which the EvalString can be evaluated from several
+  /// threads at once.
+  void InternVariables() const;
+
 private:
+  // Allow the manifest cache to save and restore the tokens.
+  friend struct ManifestCache;
+
   enum TokenType { RAW, SPECIAL };
-  typedef vector<pair<string, TokenType> > TokenList;
+  struct Token {
+    Token(StringPiece text, TokenType type)
+        : text(text), type(type), var(-1) {}
+    StringPiece text;
+    TokenType type;
+    /// The interned id of a SPECIAL token's variable.  It is interned on
+    /// first evaluation rather than when parsed, since manifests are split
+    /// into tokens on several threads.
+    mutable int var;
+  };
+  typedef vector<Token> TokenList;
   TokenList parsed_;
+  /// The text of the tokens once OwnText() has been called.
+  string text_;
+  bool owned_;
 };
 
 /// An invokable build command and associated metadata (description, etc.).
@@ -62,13 +212,23 @@ struct Rule {
   static bool IsReservedBinding(const string& var);
 
   const EvalString* GetBinding(const string& key) const;
+  const EvalString* GetBinding(int var) const { return bindings_.Find(var); }
+
+  /// Count the rule and its bindings in |stats|.
+  void ReportMemory(MemoryStats* stats) const;
+
+  /// Intern the variables of all the bindings, so that edges of the rule
+  /// can be evaluated from several threads at once; see
+  /// EvalString::InternVariables().
+  void InternVariables() const;
 
  private:
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
+  friend struct ManifestCache;
 
   string name_;
-  typedef map<string, EvalString> Bindings;
+  typedef VarTable<EvalString> Bindings;
   Bindings bindings_;
 };
 
@@ -79,7 +239,9 @@ struct BindingEnv : public Env {
   explicit BindingEnv(BindingEnv* parent) : parent_(parent) {}
 
   virtual ~BindingEnv() {}
-  virtual string LookupVariable(const string& var);
+  using Env::LookupVariable;
+  virtual string LookupVariable(int var);
+  virtual void AppendVariable(int var, string* result);
 
   void AddRule(const Rule* rule);
   const Rule* LookupRule(const string& rule_name);
@@ -93,13 +255,39 @@ struct BindingEnv : public Env {
   /// 2) value set on rule, with expansion in the edge's scope
   /// 3) value set on enclosing scope of edge (edge_->env_->parent_)
   /// This function takes as parameters the necessary info to do (2).
-  string LookupWithFallback(const string& var, const EvalString* eval,
-                            Env* env);
+  string LookupWithFallback(int var, const EvalString* eval, Env* env);
+  /// Like LookupWithFallback(), but appends the value to |result|.
+  void AppendWithFallback(int var, const EvalString* eval, Env* env,
+                          string* result);
+
+  BindingEnv* parent() const { return parent_; }
+
+  /// Count the bindings and the rules of this scope in |stats|, not those
+  /// of its parents.
+  void ReportMemory(MemoryStats* stats) const;
 
 private:
-  map<string, string> bindings_;
+  friend struct BindingEnvCache;
+  friend struct ManifestCache;
+
+  VarTable<string> bindings_;
   map<string, const Rule*> rules_;
   BindingEnv* parent_;
 };
 
+/// Shares one scope between the build statements that bind the same
+/// variables to the same values in the same scope, e.g. the flags of every
+/// file of a target, so that each set of values is only kept once.  Shared
+/// scopes must not change; the manifest parser gives the edges that a
+/// dyndep file may add a binding to a copy of their own.
+struct BindingEnvCache {
+  /// Return a scope with the same parent and bindings as |env|, which has
+  /// no rules: |env| itself, kept from now on, if there's none yet, or the
+  /// one there is, in which case |env| is deleted.
+  BindingEnv* Intern(BindingEnv* env);
+
+ private:
+  map<uint64_t, vector<BindingEnv*> > envs_;
+};
+
 #endif  // NINJA_EVAL_ENV_H_
@@ -0,0 +1,92 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "graph.h"
+#include "util.h"
+
+bool FailureLog::Load(const string& path, string* err) {
+  path_ = path;
+  failed_.clear();
+  changed_ = false;
+
+  // One path per line.
+  string content;
+  if (ReadFile(path, &content, err) < 0) {
+    if (errno == ENOENT) {
+      err->clear();
+      return true;
+    }
+    return false;
+  }
+  string::size_type start = 0;
+  while (start < content.size()) {
+    string::size_type end = content.find('\n', start);
+    if (end == string::npos)
+      end = content.size();
+    if (end > start)
+      failed_.insert(content.substr(start, end - start));
+    start = end + 1;
+  }
+  return true;
+}
+
+void FailureLog::EdgeFinished(const Edge* edge, bool success) {
+  string path = edge->outputs_[0]->path().AsString();
+  if (success)
+    changed_ |= failed_.erase(path) > 0;
+  else
+    changed_ |= failed_.insert(path).second;
+}
+
+bool FailureLog::Failed(const Edge* edge) const {
+  return !failed_.empty() && !edge->outputs_.empty() &&
+      failed_.count(edge->outputs_[0]->path().AsString()) > 0;
+}
+
+bool FailureLog::Save(string* err) {
+  if (!changed_)
+    return true;
+  if (failed_.empty()) {
+    if (remove(path_.c_str()) < 0 && errno != ENOENT) {
+      *err = "removing " + path_ + ": " + strerror(errno);
+      return false;
+    }
+    changed_ = false;
+    return true;
+  }
+
+  string content;
+  for (set<string>::iterator f = failed_.begin(); f != failed_.end(); ++f)
+    content += *f + "\n";
+  FILE* file = fopen(path_.c_str(), "wb");
+  if (!file ||
+      fwrite(content.data(), 1, content.size(), file) != content.size()) {
+    *err = "writing " + path_ + ": " + strerror(errno);
+    if (file)
+      fclose(file);
+    return false;
+  }
+  if (fclose(file) != 0) {
+    *err = "writing " + path_ + ": " + strerror(errno);
+    return false;
+  }
+  changed_ = false;
+  return true;
+}
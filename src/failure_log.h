@@ -0,0 +1,53 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FAILURE_LOG_H_
+#define NINJA_FAILURE_LOG_H_
+
+#include <set>
+#include <string>
+using namespace std;
+
+struct Edge;
+
+/// The edges whose commands failed the last time they ran, by their first
+/// output, kept in .ninja_failures so that the next build can start with
+/// them: while fixing a compile error, the command that failed is the one
+/// whose result matters.
+struct FailureLog {
+  FailureLog() : changed_(false) {}
+
+  /// Read the log at |path|, which Save() writes back to.  A missing file
+  /// is an empty log.  Returns false and fills |err| on other errors.
+  bool Load(const string& path, string* err);
+
+  /// Record whether the command of |edge| succeeded.
+  void EdgeFinished(const Edge* edge, bool success);
+
+  /// Whether the command of |edge| failed the last time it ran.
+  bool Failed(const Edge* edge) const;
+
+  /// Write the log back if it changed, or remove it once it's empty.
+  /// Returns false and fills |err| on error.
+  bool Save(string* err);
+
+  size_t size() const { return failed_.size(); }
+
+ private:
+  string path_;
+  set<string> failed_;
+  bool changed_;
+};
+
+#endif  // NINJA_FAILURE_LOG_H_
@@ -0,0 +1,100 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#include "build.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "FailureLogTest-tempfile";
+
+struct FailureLogTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    StateTestWithBuiltinRules::SetUp();
+    remove(kTestFilename);
+  }
+  virtual void TearDown() { remove(kTestFilename); }
+};
+
+TEST_F(FailureLogTest, RoundTrip) {
+  AssertParse(&state_,
+"build out1: cat in\n"
+"build out2: cat in\n");
+  Edge* edge1 = GetNode("out1")->in_edge();
+  Edge* edge2 = GetNode("out2")->in_edge();
+
+  string err;
+  FailureLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(log.Failed(edge1));
+  log.EdgeFinished(edge1, false);
+  log.EdgeFinished(edge2, false);
+  EXPECT_TRUE(log.Save(&err));
+
+  FailureLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  EXPECT_TRUE(log2.Failed(edge1));
+  EXPECT_TRUE(log2.Failed(edge2));
+  log2.EdgeFinished(edge1, true);
+  EXPECT_TRUE(log2.Save(&err));
+
+  FailureLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  EXPECT_FALSE(log3.Failed(edge1));
+  EXPECT_TRUE(log3.Failed(edge2));
+
+  // The file goes away with the last failure.
+  log3.EdgeFinished(edge2, true);
+  EXPECT_TRUE(log3.Save(&err));
+  EXPECT_EQ(-1, remove(kTestFilename));
+}
+
+// An edge that failed goes first, and so does what it depends on.
+TEST_F(FailureLogTest, FailedEdgesFirst) {
+  AssertParse(&state_,
+"build a: cat in\n"
+"build b: cat in\n"
+"build b2: cat b\n"
+"build c: cat in\n"
+"build all: phony a b2 c\n");
+  GetNode("a")->MarkDirty();
+  GetNode("b")->MarkDirty();
+  GetNode("b2")->MarkDirty();
+  GetNode("c")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  string err;
+  FailureLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  log.EdgeFinished(GetNode("b2")->in_edge(), false);
+
+  Plan plan;
+  EXPECT_TRUE(plan.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan.PrepareQueue(NULL, &log);
+  Edge* edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+  plan.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b2", edge->outputs_[0]->path());
+}
+
+}  // namespace
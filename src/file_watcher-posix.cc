@@ -0,0 +1,151 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_watcher.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+FileWatcher::FileWatcher() : fd_(-1) {}
+
+FileWatcher::~FileWatcher() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+#ifdef __linux__
+
+bool FileWatcher::Start(string* err) {
+  fd_ = inotify_init1(IN_CLOEXEC);
+  if (fd_ < 0) {
+    *err = string("inotify_init1: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool FileWatcher::AddDirectory(const string& dir, string* err) {
+  // IN_ATTRIB catches touch(1) and IN_MOVED_TO editors saving through a
+  // rename.  IN_MODIFY isn't needed: writers close the file eventually.
+  const uint32_t kMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+  int wd = inotify_add_watch(fd_, dir.c_str(), kMask);
+  if (wd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return false;
+    if (errno == ENOSPC) {
+      *err = "too many directories to watch; raise "
+             "/proc/sys/fs/inotify/max_user_watches";
+    } else {
+      *err = "inotify_add_watch(" + dir + "): " + strerror(errno);
+    }
+    return false;
+  }
+  dirs_[wd] = dir;
+  return true;
+}
+
+bool FileWatcher::ReadEvents(vector<string>* paths, bool* overflow,
+                             string* err) {
+  char buf[16 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(fd_, buf, sizeof(buf));
+  if (len < 0) {
+    if (errno == EINTR)
+      return true;
+    *err = string("read: ") + strerror(errno);
+    return false;
+  }
+
+  for (char* p = buf; p < buf + len;) {
+    const inotify_event* event = reinterpret_cast<inotify_event*>(p);
+    p += sizeof(inotify_event) + event->len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      *overflow = true;
+      continue;
+    }
+    map<int, string>::iterator dir = dirs_.find(event->wd);
+    if (dir == dirs_.end())
+      continue;
+    if (event->mask & IN_IGNORED) {
+      // The directory went away, so nothing says when it comes back.
+      dirs_.erase(dir);
+      *overflow = true;
+      continue;
+    }
+    if (event->len == 0)
+      continue;  // About the directory itself.
+    if (dir->second == ".")
+      paths->push_back(event->name);
+    else
+      paths->push_back(dir->second + "/" + event->name);
+  }
+  return true;
+}
+
+bool FileWatcher::WaitForChanges(bool block, vector<string>* paths,
+                                 bool* overflow, string* err) {
+  // Wait for the first change, then keep collecting until nothing has
+  // happened for a moment.
+  const int kSettleMillis = 50;
+  int timeout = block ? -1 : 0;
+  for (;;) {
+    pollfd pfd = { fd_, POLLIN, 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      *err = string("poll: ") + strerror(errno);
+      return false;
+    }
+    if (ret == 0)
+      return true;
+    if (!ReadEvents(paths, overflow, err))
+      return false;
+    if (!paths->empty() || *overflow)
+      timeout = kSettleMillis;
+  }
+}
+
+#else  // __linux__
+
+bool FileWatcher::Start(string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+bool FileWatcher::AddDirectory(const string& dir, string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+bool FileWatcher::ReadEvents(vector<string>* paths, bool* overflow,
+                             string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+bool FileWatcher::WaitForChanges(bool block, vector<string>* paths,
+                                 bool* overflow, string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+#endif  // __linux__
@@ -0,0 +1,193 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_watcher.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "util.h"
+
+struct FileWatcher::Watch {
+  Watch() : dir(INVALID_HANDLE_VALUE), recursive(false) {
+    memset(&overlapped, 0, sizeof(overlapped));
+  }
+  ~Watch() {
+    if (dir != INVALID_HANDLE_VALUE) {
+      CancelIo(dir);
+      CloseHandle(dir);
+    }
+    if (overlapped.hEvent)
+      CloseHandle(overlapped.hEvent);
+  }
+
+  /// The directory as given to AddDirectory(), or "." for the working
+  /// directory's tree.
+  string path;
+  HANDLE dir;
+  bool recursive;
+  OVERLAPPED overlapped;
+  /// ReadDirectoryChangesW() needs DWORD alignment.
+  DWORD buffer[16 * 1024];
+};
+
+namespace {
+
+bool IsRelative(const string& path) {
+  return !(path.size() >= 2 && path[1] == ':') &&
+      !(!path.empty() && (path[0] == '/' || path[0] == '\\'));
+}
+
+}  // anonymous namespace
+
+FileWatcher::FileWatcher() {}
+
+FileWatcher::~FileWatcher() {
+  for (vector<Watch*>::iterator i = watches_.begin(); i != watches_.end(); ++i)
+    delete *i;
+}
+
+bool FileWatcher::Start(string* err) {
+  return true;
+}
+
+bool FileWatcher::Arm(Watch* watch, string* err) {
+  const DWORD kFilter = FILE_NOTIFY_CHANGE_FILE_NAME |
+      FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES |
+      FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+  ResetEvent(watch->overlapped.hEvent);
+  if (!ReadDirectoryChangesW(watch->dir, watch->buffer, sizeof(watch->buffer),
+                             watch->recursive, kFilter, NULL,
+                             &watch->overlapped, NULL)) {
+    *err = "ReadDirectoryChangesW(" + watch->path + "): " +
+        GetLastErrorString();
+    return false;
+  }
+  return true;
+}
+
+bool FileWatcher::AddDirectory(const string& dir, string* err) {
+  // Everything below the working directory shares one recursive watch.
+  bool recursive = IsRelative(dir);
+  string path = recursive ? "." : dir;
+  for (vector<Watch*>::iterator i = watches_.begin(); i != watches_.end(); ++i) {
+    if ((*i)->path == path)
+      return true;
+  }
+  if (recursive) {
+    // Make sure |dir| exists, like the other platforms report.
+    DWORD attributes = GetFileAttributesA(dir.c_str());
+    if (attributes == INVALID_FILE_ATTRIBUTES ||
+        !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      return false;
+    }
+  }
+  // WaitForMultipleObjects() takes a limited number of handles.
+  if (watches_.size() >= MAXIMUM_WAIT_OBJECTS) {
+    *err = "too many directories outside the build directory to watch";
+    return false;
+  }
+
+  Watch* watch = new Watch;
+  watch->path = path;
+  watch->recursive = recursive;
+  watch->dir = CreateFileA(path.c_str(), FILE_LIST_DIRECTORY,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE |
+                           FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                           NULL);
+  if (watch->dir == INVALID_HANDLE_VALUE) {
+    DWORD error = GetLastError();
+    delete watch;
+    if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+      return false;
+    *err = "CreateFile(" + path + "): " + GetLastErrorString();
+    return false;
+  }
+  watch->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (!watch->overlapped.hEvent || !Arm(watch, err)) {
+    if (err->empty())
+      *err = "CreateEvent: " + GetLastErrorString();
+    delete watch;
+    return false;
+  }
+  watches_.push_back(watch);
+  return true;
+}
+
+bool FileWatcher::Collect(Watch* watch, vector<string>* paths, bool* overflow,
+                          string* err) {
+  DWORD bytes;
+  if (!GetOverlappedResult(watch->dir, &watch->overlapped, &bytes, FALSE)) {
+    if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+      *err = "GetOverlappedResult(" + watch->path + "): " +
+          GetLastErrorString();
+      return false;
+    }
+    bytes = 0;
+  }
+  // No data means the changes didn't fit in the buffer.
+  if (bytes == 0)
+    *overflow = true;
+
+  const char* p = reinterpret_cast<const char*>(watch->buffer);
+  while (bytes > 0) {
+    const FILE_NOTIFY_INFORMATION* info =
+        reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+    int wide_len = info->FileNameLength / sizeof(WCHAR);
+    int len = WideCharToMultiByte(CP_ACP, 0, info->FileName, wide_len,
+                                  NULL, 0, NULL, NULL);
+    string name(len, '\0');
+    WideCharToMultiByte(CP_ACP, 0, info->FileName, wide_len, &name[0], len,
+                        NULL, NULL);
+    // Node paths use forward slashes.
+    replace(name.begin(), name.end(), '\\', '/');
+    paths->push_back(watch->path == "." ? name : watch->path + "/" + name);
+
+    if (info->NextEntryOffset == 0)
+      break;
+    p += info->NextEntryOffset;
+  }
+
+  return Arm(watch, err);
+}
+
+bool FileWatcher::WaitForChanges(bool block, vector<string>* paths,
+                                 bool* overflow, string* err) {
+  if (watches_.empty()) {
+    *err = "no directories to watch";
+    return false;
+  }
+  vector<HANDLE> events;
+  for (vector<Watch*>::iterator i = watches_.begin(); i != watches_.end(); ++i)
+    events.push_back((*i)->overlapped.hEvent);
+
+  // Wait for the first change, then keep collecting until nothing has
+  // happened for a moment.
+  const DWORD kSettleMillis = 50;
+  DWORD timeout = block ? INFINITE : 0;
+  for (;;) {
+    DWORD ret = WaitForMultipleObjects((DWORD)events.size(), &events[0],
+                                       FALSE, timeout);
+    if (ret == WAIT_TIMEOUT)
+      return true;
+    if (ret < WAIT_OBJECT_0 || ret >= WAIT_OBJECT_0 + events.size()) {
+      *err = "WaitForMultipleObjects: " + GetLastErrorString();
+      return false;
+    }
+    if (!Collect(watches_[ret - WAIT_OBJECT_0], paths, overflow, err))
+      return false;
+    timeout = kSettleMillis;
+  }
+}
@@ -0,0 +1,76 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FILE_WATCHER_H_
+#define NINJA_FILE_WATCHER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/// Reports the files that changed in a set of directories, using the
+/// operating system's change notifications (inotify on Linux,
+/// ReadDirectoryChangesW on Windows).  This lets a long-running ninja find
+/// out what to rebuild without stat()ing every file again.
+struct FileWatcher {
+  FileWatcher();
+  ~FileWatcher();
+
+  /// Start receiving notifications.  Returns false and fills |err| if
+  /// that's not possible, e.g. on a platform without support.
+  bool Start(string* err);
+
+  /// Report changes to the files directly inside |dir|.  Returns false and
+  /// fills |err| on error, or returns false with an empty |err| if |dir|
+  /// doesn't exist (yet).
+  bool AddDirectory(const string& dir, string* err);
+
+  /// Wait until files change (or, unless |block|, return at once if none
+  /// have), then append their paths to |paths|, waiting until things
+  /// quieten down so that a burst of changes comes back at once.  Paths are
+  /// relative to the working directory if the directory given to
+  /// AddDirectory() was.  Sets |overflow| if changes were lost, in which
+  /// case any file may have changed and the directories may need to be
+  /// added again.  Returns false and fills |err| on error.
+  bool WaitForChanges(bool block, vector<string>* paths, bool* overflow,
+                      string* err);
+
+ private:
+#ifdef _WIN32
+  struct Watch;
+  /// Queue the next read of changes for |watch|.
+  bool Arm(Watch* watch, string* err);
+  /// Append the changes reported to |watch| to |paths|, and arm it again.
+  bool Collect(Watch* watch, vector<string>* paths, bool* overflow,
+               string* err);
+
+  /// One handle per directory tree: everything below the working directory
+  /// shares a recursive watch, other directories get one each.
+  vector<Watch*> watches_;
+#else
+  /// Read the pending events, appending the changed paths to |paths|.
+  bool ReadEvents(vector<string>* paths, bool* overflow, string* err);
+
+  int fd_;
+  /// The directory for each inotify watch descriptor.
+  map<int, string> dirs_;
+#endif
+};
+
+#endif  // NINJA_FILE_WATCHER_H_
@@ -0,0 +1,88 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_watcher.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "disk_interface.h"
+#include "test.h"
+
+// Other platforms don't have an implementation.
+#if defined(__linux__) || defined(_WIN32)
+
+namespace {
+
+struct FileWatcherTest : public testing::Test {
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-FileWatcherTest");
+    string err;
+    ASSERT_TRUE(watcher_.Start(&err));
+    ASSERT_EQ("", err);
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  bool Touch(const char* path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+      return false;
+    return fclose(f) == 0;
+  }
+
+  ScopedTempDir temp_dir_;
+  FileWatcher watcher_;
+};
+
+TEST_F(FileWatcherTest, MissingDirectory) {
+  string err;
+  EXPECT_FALSE(watcher_.AddDirectory("nosuchdir", &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(FileWatcherTest, ReportsChanges) {
+  string err;
+  ASSERT_TRUE(watcher_.AddDirectory(".", &err));
+
+  vector<string> paths;
+  bool overflow = false;
+  ASSERT_TRUE(watcher_.WaitForChanges(false, &paths, &overflow, &err));
+  EXPECT_TRUE(paths.empty());
+
+  ASSERT_TRUE(Touch("foo"));
+  ASSERT_TRUE(watcher_.WaitForChanges(true, &paths, &overflow, &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(overflow);
+  EXPECT_TRUE(find(paths.begin(), paths.end(), "foo") != paths.end());
+}
+
+TEST_F(FileWatcherTest, ReportsSubdirectoryPaths) {
+  string err;
+  ASSERT_TRUE(RealDiskInterface().MakeDir("subdir"));
+  ASSERT_TRUE(watcher_.AddDirectory("subdir", &err));
+
+  ASSERT_TRUE(Touch("subdir/foo"));
+  vector<string> paths;
+  bool overflow = false;
+  ASSERT_TRUE(watcher_.WaitForChanges(true, &paths, &overflow, &err));
+  EXPECT_TRUE(find(paths.begin(), paths.end(), "subdir/foo") != paths.end());
+}
+
+}  // anonymous namespace
+
+#endif  // __linux__ || _WIN32
@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
+
 #include "build_log.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
@@ -24,20 +26,203 @@
 #include "disk_interface.h"
 #include "manifest_parser.h"
 #include "metrics.h"
+#include "stat_audit.h"
 #include "state.h"
 #include "util.h"
 
 bool Node::Stat(DiskInterface* disk_interface, string* err) {
-  return (mtime_ = disk_interface->Stat(path_, err)) != -1;
+  return (mtime_ = disk_interface->Stat(path_.AsString(), err)) != -1;
 }
 
+void DependencyScan::PrefetchStats(const vector<Node*>& targets) {
+  METRIC_RECORD("prefetch stats");
+  StatAudit::Scope audit(StatAudit::kDirtyScan);
+  DepsLog* deps_log = dep_loader_.deps_log();
+  vector<Node*> stack(targets.begin(), targets.end());
+  vector<bool> seen_edges;
+  vector<Node*> nodes;
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+    if (!node->status_known())
+      nodes.push_back(node);
+
+    Edge* edge = node->in_edge();
+    if (!edge)
+      continue;
+    if (edge->id_ >= seen_edges.size())
+      seen_edges.resize(edge->id_ + 1);
+    if (seen_edges[edge->id_])
+      continue;
+    seen_edges[edge->id_] = true;
+
+    stack.insert(stack.end(), edge->inputs_.begin(), edge->inputs_.end());
+    stack.insert(stack.end(), edge->outputs_.begin(), edge->outputs_.end());
+    if (deps_log && !edge->GetBinding(VarNames::kDeps).empty()) {
+      if (DepsLog::Deps* deps = deps_log->GetDeps(edge->outputs_[0]))
+        stack.insert(stack.end(), deps->nodes, deps->nodes + deps->node_count);
+    }
+  }
+
+  // Inputs shared by many edges were collected many times.
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+
+  vector<string> path_strings(nodes.size());
+  vector<const string*> paths(nodes.size());
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    path_strings[i] = nodes[i]->path().AsString();
+    paths[i] = &path_strings[i];
+  }
+  vector<TimeStamp> mtimes;
+  disk_interface_->StatMany(paths, &mtimes);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (mtimes[i] != -1)
+      nodes[i]->set_mtime(mtimes[i]);
+  }
+}
+
+/// An edge that RecomputeDirty() is in the middle of, reached through
+/// |node|, with how far it got.
+struct DependencyScan::ScanFrame {
+  enum Step {
+    /// Visit the pending dyndep file, if any.
+    kDyndep,
+    /// Load the dyndep file visited, if it is ready.
+    kLoadDyndep,
+    /// Stat the outputs and load the deps.
+    kLoadDeps,
+    /// Visit the input at |input|, or finish once they're all done.
+    kVisitInput,
+    /// Take in the state of the input at |input|, just visited.
+    kInputDone
+  };
+
+  ScanFrame(Node* node)
+      : node(node), step(kDyndep), input(0), most_recent_input(NULL),
+        dirty(false) {}
+
+  Node* node;
+  Step step;
+  size_t input;
+  Node* most_recent_input;
+  bool dirty;
+};
+
 bool DependencyScan::RecomputeDirty(Node* node, string* err) {
+  METRIC_RECORD("dirty scan");
+  StatAudit::Scope audit(StatAudit::kDirtyScan);
+  // The walk goes depth first with explicit stacks rather than recursion,
+  // as chains of edges may be deeper than a thread's stack allows.  |stack|
+  // is the path of nodes to the current edge, for reporting cycles, which
+  // are found through the edges' VisitInStack marks.
+  vector<ScanFrame> frames;
   vector<Node*> stack;
-  return RecomputeDirty(node, &stack, err);
+  if (!VisitNode(node, &frames, &stack, err))
+    return false;
+
+  while (!frames.empty()) {
+    // Visiting a node may push a frame, after which |frame| is invalid.
+    ScanFrame& frame = frames.back();
+    Edge* edge = frame.node->in_edge();
+    switch (frame.step) {
+    case ScanFrame::kDyndep:
+      // If there is a pending dyndep file, visit it now:
+      // * If the dyndep file is ready then load it now to get any
+      //   additional inputs and outputs for this and other edges.
+      //   Once the dyndep file is loaded it will no longer be pending
+      //   if any other edges encounter it, but they will already have
+      //   been updated.
+      // * If the dyndep file is not ready then since it is known to be an
+      //   input to this edge, the edge will not be considered ready below.
+      //   Later during the build the dyndep file will become ready and be
+      //   loaded to update this edge before it can possibly be scheduled.
+      if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
+        frame.step = ScanFrame::kLoadDyndep;
+        if (!VisitNode(edge->dyndep_, &frames, &stack, err))
+          return false;
+      } else {
+        frame.step = ScanFrame::kLoadDeps;
+      }
+      break;
+
+    case ScanFrame::kLoadDyndep:
+      if (!edge->dyndep_->in_edge() ||
+          edge->dyndep_->in_edge()->outputs_ready()) {
+        // The dyndep file is ready, so load it now.
+        if (!LoadDyndeps(edge->dyndep_, err))
+          return false;
+      }
+      frame.step = ScanFrame::kLoadDeps;
+      break;
+
+    case ScanFrame::kLoadDeps:
+      // Load output mtimes so we can compare them to the most recent input
+      // below.
+      for (vector<Node*>::iterator o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o) {
+        if (!(*o)->StatIfNecessary(disk_interface_, err))
+          return false;
+      }
+
+      if (!dep_loader_.LoadDeps(edge, err)) {
+        if (!err->empty())
+          return false;
+        // Failed to load dependency info: rebuild to regenerate it.
+        // LoadDeps() did EXPLAIN() already, no need to do it here.
+        frame.dirty = edge->deps_missing_ = true;
+      }
+      frame.step = ScanFrame::kVisitInput;
+      break;
+
+    case ScanFrame::kVisitInput:
+      // Visit all inputs; we're dirty if any of the inputs are dirty.
+      // They're indexed, as loading a dyndep file may add to them.
+      if (frame.input == edge->inputs_.size()) {
+        if (!FinishEdge(&frame, err))
+          return false;
+        assert(stack.back() == frame.node);
+        stack.pop_back();
+        frames.pop_back();
+        break;
+      }
+      frame.step = ScanFrame::kInputDone;
+      if (!VisitNode(edge->inputs_[frame.input], &frames, &stack, err))
+        return false;
+      break;
+
+    case ScanFrame::kInputDone: {
+      Node* input = edge->inputs_[frame.input];
+      // If an input is not ready, neither are our outputs.
+      if (Edge* in_edge = input->in_edge()) {
+        if (!in_edge->outputs_ready_)
+          edge->outputs_ready_ = false;
+      }
+
+      if (!edge->is_order_only(frame.input)) {
+        // If a regular input is dirty (or missing), we're dirty.
+        // Otherwise consider mtime.
+        if (input->dirty()) {
+          EXPLAIN("%s is dirty", input->path_c_str());
+          frame.dirty = true;
+        } else {
+          if (!frame.most_recent_input ||
+              input->mtime() > frame.most_recent_input->mtime()) {
+            frame.most_recent_input = input;
+          }
+        }
+      }
+      ++frame.input;
+      frame.step = ScanFrame::kVisitInput;
+      break;
+    }
+    }
+  }
+  return true;
 }
 
-bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
-                                    string* err) {
+bool DependencyScan::VisitNode(Node* node, vector<ScanFrame>* frames,
+                               vector<Node*>* stack, string* err) {
   Edge* edge = node->in_edge();
   if (!edge) {
     // If we already visited this leaf node then we are done.
@@ -47,7 +232,7 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
     if (!node->StatIfNecessary(disk_interface_, err))
       return false;
     if (!node->exists())
-      EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
+      EXPLAIN("%s has no in-edge and is missing", node->path_c_str());
     node->set_dirty(!node->exists());
     return true;
   }
@@ -56,65 +241,28 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
   if (edge->mark_ == Edge::VisitDone)
     return true;
 
-  // If we encountered this edge earlier in the call stack we have a cycle.
+  // If we encountered this edge earlier in the walk we have a cycle.
   if (!VerifyDAG(node, stack, err))
     return false;
 
-  // Mark the edge temporarily while in the call stack.
+  // Mark the edge temporarily while it is on the stack.
   edge->mark_ = Edge::VisitInStack;
   stack->push_back(node);
 
-  bool dirty = false;
   edge->outputs_ready_ = true;
   edge->deps_missing_ = false;
+  frames->push_back(ScanFrame(node));
+  return true;
+}
 
-  // Load output mtimes so we can compare them to the most recent input below.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (!(*o)->StatIfNecessary(disk_interface_, err))
-      return false;
-  }
-
-  if (!dep_loader_.LoadDeps(edge, err)) {
-    if (!err->empty())
-      return false;
-    // Failed to load dependency info: rebuild to regenerate it.
-    // LoadDeps() did EXPLAIN() already, no need to do it here.
-    dirty = edge->deps_missing_ = true;
-  }
-
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
-  Node* most_recent_input = NULL;
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    // Visit this input.
-    if (!RecomputeDirty(*i, stack, err))
-      return false;
-
-    // If an input is not ready, neither are our outputs.
-    if (Edge* in_edge = (*i)->in_edge()) {
-      if (!in_edge->outputs_ready_)
-        edge->outputs_ready_ = false;
-    }
-
-    if (!edge->is_order_only(i - edge->inputs_.begin())) {
-      // If a regular input is dirty (or missing), we're dirty.
-      // Otherwise consider mtime.
-      if ((*i)->dirty()) {
-        EXPLAIN("%s is dirty", (*i)->path().c_str());
-        dirty = true;
-      } else {
-        if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime()) {
-          most_recent_input = *i;
-        }
-      }
-    }
-  }
+bool DependencyScan::FinishEdge(ScanFrame* frame, string* err) {
+  Edge* edge = frame->node->in_edge();
+  bool dirty = frame->dirty;
 
   // We may also be dirty due to output state: missing outputs, out of
   // date outputs, etc.  Visit all outputs and determine whether they're dirty.
   if (!dirty)
-    if (!RecomputeOutputsDirty(edge, most_recent_input, &dirty, err))
+    if (!RecomputeOutputsDirty(edge, frame->most_recent_input, &dirty, err))
       return false;
 
   // Finally, visit each output and update their dirty state if necessary.
@@ -133,14 +281,20 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
     edge->outputs_ready_ = false;
 
   // Mark the edge as finished during this walk now that it will no longer
-  // be in the call stack.
+  // be on the stack.
   edge->mark_ = Edge::VisitDone;
-  assert(stack->back() == node);
-  stack->pop_back();
-
   return true;
 }
 
+bool DependencyScan::LoadDyndeps(Node* node, string* err) const {
+  return dyndep_loader_.LoadDyndeps(node, err);
+}
+
+bool DependencyScan::LoadDyndeps(Node* node, DyndepFile* ddf,
+                                 string* err) const {
+  return dyndep_loader_.LoadDyndeps(node, ddf, err);
+}
+
 bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   Edge* edge = node->in_edge();
   assert(edge != NULL);
@@ -166,10 +320,10 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   // Construct the error message rejecting the cycle.
   *err = "dependency cycle: ";
   for (vector<Node*>::const_iterator i = start; i != stack->end(); ++i) {
-    err->append((*i)->path());
+    err->append((*i)->path().AsString());
     err->append(" -> ");
   }
-  err->append((*start)->path());
+  err->append((*start)->path().AsString());
 
   if ((start + 1) == stack->end() && edge->maybe_phonycycle_diagnostic()) {
     // The manifest parser would have filtered out the self-referencing
@@ -182,27 +336,27 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
 
 bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
                                            bool* outputs_dirty, string* err) {
-  string command = edge->EvaluateCommand(/*incl_rsp_file=*/true);
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (RecomputeOutputDirty(edge, most_recent_input, command, *o)) {
+    if (RecomputeOutputDirty(edge, most_recent_input, *o)) {
       *outputs_dirty = true;
       return true;
     }
   }
+  // A clean edge doesn't run, so only its command hash is worth keeping.
+  edge->ReleaseCommand();
   return true;
 }
 
 bool DependencyScan::RecomputeOutputDirty(Edge* edge,
                                           Node* most_recent_input,
-                                          const string& command,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
     // there are no inputs and we're missing the output.
     if (edge->inputs_.empty() && !output->exists()) {
       EXPLAIN("output %s of phony edge with no inputs doesn't exist",
-              output->path().c_str());
+              output->path_c_str());
       return true;
     }
     return false;
@@ -212,7 +366,7 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
 
   // Dirty if we're missing the output.
   if (!output->exists()) {
-    EXPLAIN("output %s doesn't exist", output->path().c_str());
+    EXPLAIN("output %s doesn't exist", output->path_c_str());
     return true;
   }
 
@@ -225,7 +379,7 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
     // build log.  Use that mtime instead, so that the file will only be
     // considered dirty if an input was modified since the previous run.
     bool used_restat = false;
-    if (edge->GetBindingBool("restat") && build_log() &&
+    if (edge->GetBindingBool(VarNames::kRestat) && build_log() &&
         (entry = build_log()->LookupByOutput(output->path()))) {
       output_mtime = entry->mtime;
       used_restat = true;
@@ -234,22 +388,22 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
     if (output_mtime < most_recent_input->mtime()) {
       EXPLAIN("%soutput %s older than most recent input %s "
               "(%" PRId64 " vs %" PRId64 ")",
-              used_restat ? "restat of " : "", output->path().c_str(),
-              most_recent_input->path().c_str(),
+              used_restat ? "restat of " : "", output->path_c_str(),
+              most_recent_input->path_c_str(),
               output_mtime, most_recent_input->mtime());
       return true;
     }
   }
 
   if (build_log()) {
-    bool generator = edge->GetBindingBool("generator");
+    bool generator = edge->GetBindingBool(VarNames::kGenerator);
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
       if (!generator &&
-          BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+          edge->GetCommandHash() != entry->command_hash) {
         // May also be dirty due to the command changing since the last build.
         // But if this is a generator rule, the command changing does not make us
         // dirty.
-        EXPLAIN("command line changed for %s", output->path().c_str());
+        EXPLAIN("command line changed for %s", output->path_c_str());
         return true;
       }
       if (most_recent_input && entry->mtime < most_recent_input->mtime()) {
@@ -258,13 +412,13 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
         // on disk is newer if a previous run wrote to the output file but
         // exited with an error or was interrupted.
         EXPLAIN("recorded mtime of %s older than most recent input %s (%" PRId64 " vs %" PRId64 ")",
-                output->path().c_str(), most_recent_input->path().c_str(),
+                output->path_c_str(), most_recent_input->path_c_str(),
                 entry->mtime, most_recent_input->mtime());
         return true;
       }
     }
     if (!entry && !generator) {
-      EXPLAIN("command line not found in log for %s", output->path().c_str());
+      EXPLAIN("command line not found in log for %s", output->path_c_str());
       return true;
     }
   }
@@ -286,43 +440,65 @@ struct EdgeEnv : public Env {
   enum EscapeKind { kShellEscape, kDoNotEscape };
 
   EdgeEnv(Edge* edge, EscapeKind escape)
-      : edge_(edge), escape_in_out_(escape), recursive_(false) {}
-  virtual string LookupVariable(const string& var);
-
-  /// Given a span of Nodes, construct a list of paths suitable for a command
-  /// line.
-  string MakePathList(vector<Node*>::iterator begin,
+      : edge_(edge), escape_in_out_(escape), recursive_(false),
+        depfile_(NULL) {}
+  using Env::LookupVariable;
+  virtual string LookupVariable(int var);
+  virtual void AppendVariable(int var, string* result);
+
+  /// Given a span of Nodes, append a list of paths suitable for a command
+  /// line to |result|.
+  void AppendPathList(vector<Node*>::iterator begin,
                       vector<Node*>::iterator end,
-                      char sep);
+                      char sep, string* result);
+
+  /// Have $depfile expand to |depfile|, which is used as is.
+  void set_depfile(const string* depfile) { depfile_ = depfile; }
 
  private:
-  vector<string> lookups_;
+  vector<int> lookups_;
   Edge* edge_;
   EscapeKind escape_in_out_;
   bool recursive_;
+  const string* depfile_;
+#ifdef _WIN32
+  /// The path being escaped, with its backslashes put back.
+  string decanonicalized_;
+#endif
 };
 
-string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in" || var == "in_newline") {
+string EdgeEnv::LookupVariable(int var) {
+  string result;
+  AppendVariable(var, &result);
+  return result;
+}
+
+void EdgeEnv::AppendVariable(int var, string* result) {
+  if (var == VarNames::kIn || var == VarNames::kInNewline) {
     int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
       edge_->order_only_deps_;
-    return MakePathList(edge_->inputs_.begin(),
-                        edge_->inputs_.begin() + explicit_deps_count,
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
+    AppendPathList(edge_->inputs_.begin(),
+                   edge_->inputs_.begin() + explicit_deps_count,
+                   var == VarNames::kIn ? ' ' : '\n', result);
+    return;
+  } else if (var == VarNames::kOut) {
     int explicit_outs_count = edge_->outputs_.size() - edge_->implicit_outs_;
-    return MakePathList(edge_->outputs_.begin(),
-                        edge_->outputs_.begin() + explicit_outs_count,
-                        ' ');
+    AppendPathList(edge_->outputs_.begin(),
+                   edge_->outputs_.begin() + explicit_outs_count,
+                   ' ', result);
+    return;
+  } else if (var == VarNames::kDepfile && depfile_) {
+    result->append(*depfile_);
+    return;
   }
 
   if (recursive_) {
-    vector<string>::const_iterator it;
+    vector<int>::const_iterator it;
     if ((it = find(lookups_.begin(), lookups_.end(), var)) != lookups_.end()) {
       string cycle;
       for (; it != lookups_.end(); ++it)
-        cycle.append(*it + " -> ");
-      cycle.append(var);
+        cycle.append(VarNames::Name(*it) + " -> ");
+      cycle.append(VarNames::Name(var));
       Fatal(("cycle in rule variables: " + cycle).c_str());
     }
   }
@@ -335,69 +511,133 @@ string EdgeEnv::LookupVariable(const string& var) {
   // In practice, variables defined on rules never use another rule variable.
   // For performance, only start checking for cycles after the first lookup.
   recursive_ = true;
-  return edge_->env_->LookupWithFallback(var, eval, this);
+  edge_->env_->AppendWithFallback(var, eval, this, result);
 }
 
-string EdgeEnv::MakePathList(vector<Node*>::iterator begin,
+void EdgeEnv::AppendPathList(vector<Node*>::iterator begin,
                              vector<Node*>::iterator end,
-                             char sep) {
-  string result;
+                             char sep, string* result) {
   for (vector<Node*>::iterator i = begin; i != end; ++i) {
-    if (!result.empty())
-      result.push_back(sep);
-    const string& path = (*i)->PathDecanonicalized();
+    if (i != begin)
+      result->push_back(sep);
+#ifdef _WIN32
+    decanonicalized_.clear();
+    Node::AppendPathDecanonicalized((*i)->path(), (*i)->slash_bits(),
+                                    &decanonicalized_);
+    StringPiece path = decanonicalized_;
+#else
+    // Paths only differ from their decanonicalized form on Windows.
+    StringPiece path = (*i)->path();
+#endif
     if (escape_in_out_ == kShellEscape) {
 #if _WIN32
-      GetWin32EscapedString(path, &result);
+      GetWin32EscapedString(path, result);
 #else
-      GetShellEscapedString(path, &result);
+      GetShellEscapedString(path, result);
 #endif
     } else {
-      result.append(path);
+      result->append(path.str_, path.len_);
     }
   }
-  return result;
 }
 
 string Edge::EvaluateCommand(bool incl_rsp_file) {
-  string command = GetBinding("command");
+  string command;
+  EvaluateCommand(&command, incl_rsp_file);
+  return command;
+}
+
+void Edge::EvaluateCommand(string* command, bool incl_rsp_file) {
+  AppendBinding(VarNames::kCommand, command);
   if (incl_rsp_file) {
-    string rspfile_content = GetBinding("rspfile_content");
-    if (!rspfile_content.empty())
-      command += ";rspfile=" + rspfile_content;
+    size_t command_size = command->size();
+    command->append(";rspfile=");
+    size_t content_start = command->size();
+    AppendBinding(VarNames::kRspfileContent, command);
+    if (command->size() == content_start)
+      command->resize(command_size);
   }
+}
+
+string Edge::EvaluateCommandWithDepfile(const string& depfile) {
+  EdgeEnv env(this, EdgeEnv::kShellEscape);
+  env.set_depfile(&depfile);
+  string command;
+  env.AppendVariable(VarNames::kCommand, &command);
   return command;
 }
 
-string Edge::GetBinding(const string& key) {
+const string& Edge::GetCommand() {
+  if (!command_evaluated_) {
+    command_.clear();
+    EvaluateCommand(&command_);
+    command_evaluated_ = true;
+  }
+  return command_;
+}
+
+uint64_t Edge::GetCommandHash() {
+  if (!command_hash_known_) {
+    string rspfile_content = GetBinding(VarNames::kRspfileContent);
+    if (rspfile_content.empty()) {
+      command_hash_ = BuildLog::LogEntry::HashCommand(GetCommand());
+    } else {
+      command_hash_ = BuildLog::LogEntry::HashCommand(
+          GetCommand() + ";rspfile=" + rspfile_content);
+    }
+    command_hash_known_ = true;
+  }
+  return command_hash_;
+}
+
+void Edge::ReleaseCommand() {
+  string().swap(command_);
+  command_evaluated_ = false;
+}
+
+string Edge::GetBinding(int var) {
+  EdgeEnv env(this, EdgeEnv::kShellEscape);
+  return env.LookupVariable(var);
+}
+
+void Edge::AppendBinding(int var, string* result) {
   EdgeEnv env(this, EdgeEnv::kShellEscape);
-  return env.LookupVariable(key);
+  env.AppendVariable(var, result);
+}
+
+string Edge::GetBinding(const string& key) {
+  return GetBinding(VarNames::Intern(key));
 }
 
-bool Edge::GetBindingBool(const string& key) {
-  return !GetBinding(key).empty();
+bool Edge::GetBindingBool(int var) {
+  return !GetBinding(var).empty();
 }
 
 string Edge::GetUnescapedDepfile() {
   EdgeEnv env(this, EdgeEnv::kDoNotEscape);
-  return env.LookupVariable("depfile");
+  return env.LookupVariable(VarNames::kDepfile);
+}
+
+string Edge::GetUnescapedDyndep() {
+  EdgeEnv env(this, EdgeEnv::kDoNotEscape);
+  return env.LookupVariable(VarNames::kDyndep);
 }
 
 string Edge::GetUnescapedRspfile() {
   EdgeEnv env(this, EdgeEnv::kDoNotEscape);
-  return env.LookupVariable("rspfile");
+  return env.LookupVariable(VarNames::kRspfile);
 }
 
 void Edge::Dump(const char* prefix) const {
   printf("%s[ ", prefix);
   for (vector<Node*>::const_iterator i = inputs_.begin();
        i != inputs_.end() && *i != NULL; ++i) {
-    printf("%s ", (*i)->path().c_str());
+    printf("%s ", (*i)->path_c_str());
   }
   printf("--%s-> ", rule_->name().c_str());
   for (vector<Node*>::const_iterator i = outputs_.begin();
        i != outputs_.end() && *i != NULL; ++i) {
-    printf("%s ", (*i)->path().c_str());
+    printf("%s ", (*i)->path_c_str());
   }
   if (pool_) {
     if (!pool_->name().empty()) {
@@ -409,6 +649,18 @@ void Edge::Dump(const char* prefix) const {
   printf("] 0x%p\n", this);
 }
 
+void Edge::UnloadDeps() {
+  if (loaded_deps_ > 0) {
+    vector<Node*>::iterator end = inputs_.end() - order_only_deps_;
+    vector<Node*>::iterator begin = end - loaded_deps_;
+    for (vector<Node*>::iterator i = begin; i != end; ++i)
+      (*i)->RemoveOutEdge(this);
+    inputs_.erase(begin, end);
+    implicit_deps_ -= loaded_deps_;
+  }
+  loaded_deps_ = -1;
+}
+
 bool Edge::is_phony() const {
   return rule_ == &State::kPhonyRule;
 }
@@ -426,23 +678,35 @@ bool Edge::maybe_phonycycle_diagnostic() const {
 }
 
 // static
-string Node::PathDecanonicalized(const string& path, uint64_t slash_bits) {
-  string result = path;
+string Node::PathDecanonicalized(StringPiece path, uint64_t slash_bits) {
+  string result;
+  AppendPathDecanonicalized(path, slash_bits, &result);
+  return result;
+}
+
+// static
+void Node::AppendPathDecanonicalized(StringPiece path, uint64_t slash_bits,
+                                     string* result) {
+  size_t start = result->size();
+  result->append(path.str_, path.len_);
 #ifdef _WIN32
   uint64_t mask = 1;
-  for (char* c = &result[0]; (c = strchr(c, '/')) != NULL;) {
+  for (size_t i = start; i < result->size(); ++i) {
+    if ((*result)[i] != '/')
+      continue;
     if (slash_bits & mask)
-      *c = '\\';
-    c++;
+      (*result)[i] = '\\';
     mask <<= 1;
   }
+#else
+  (void)start;
+  (void)slash_bits;
 #endif
-  return result;
 }
 
 void Node::Dump(const char* prefix) const {
   printf("%s <%s 0x%p> mtime: %" PRId64 "%s, (:%s), ",
-         prefix, path().c_str(), this,
+         prefix, path_c_str(), this,
          mtime(), mtime() ? "" : " (:missing)",
          dirty() ? " dirty" : " clean");
   if (in_edge()) {
@@ -451,14 +715,51 @@ void Node::Dump(const char* prefix) const {
     printf("no in-edge\n");
   }
   printf(" out edges:\n");
-  for (vector<Edge*>::const_iterator e = out_edges().begin();
+  for (EdgeSpan::const_iterator e = out_edges().begin();
        e != out_edges().end() && *e != NULL; ++e) {
     (*e)->Dump(" +- ");
   }
 }
 
+void Node::AddOutEdge(Edge* edge) {
+  if (out_edge_count_ >= out_edge_capacity_) {
+    // Full, or packed: move to an array of our own that has room.
+    uint32_t capacity = max(out_edge_count_ * 2, 4u);
+    Edge** out_edges = new Edge*[capacity];
+    copy(out_edges_, out_edges_ + out_edge_count_, out_edges);
+    if (out_edge_capacity_)
+      delete [] out_edges_;
+    out_edges_ = out_edges;
+    out_edge_capacity_ = capacity;
+  }
+  out_edges_[out_edge_count_++] = edge;
+}
+
+void Node::RemoveOutEdge(Edge* edge) {
+  for (Edge** e = out_edges_ + out_edge_count_; e != out_edges_;) {
+    --e;
+    if (*e == edge) {
+      copy(e + 1, out_edges_ + out_edge_count_, e);
+      --out_edge_count_;
+      return;
+    }
+  }
+}
+
+void Node::PackOutEdges(Edge** storage) {
+  copy(out_edges_, out_edges_ + out_edge_count_, storage);
+  if (out_edge_capacity_)
+    delete [] out_edges_;
+  out_edges_ = out_edge_count_ ? storage : NULL;
+  out_edge_capacity_ = 0;
+}
+
 bool ImplicitDepLoader::LoadDeps(Edge* edge, string* err) {
-  string deps_type = edge->GetBinding("deps");
+  // Already loaded by an earlier scan of the graph.
+  if (edge->loaded_deps_ >= 0)
+    return true;
+
+  string deps_type = edge->GetBinding(VarNames::kDeps);
   if (!deps_type.empty())
     return LoadDepsFromLog(edge, err);
 
@@ -467,6 +768,7 @@ bool ImplicitDepLoader::LoadDeps(Edge* edge, string* err) {
     return LoadDepFile(edge, depfile, err);
 
   // No deps to load.
+  edge->loaded_deps_ = 0;
   return true;
 }
 
@@ -485,6 +787,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
     *err = "loading '" + path + "': " + *err;
     return false;
   }
+  METRIC_COUNT("depfile bytes", content.size());
   // On a missing depfile: return false and empty *err.
   if (content.empty()) {
     EXPLAIN("depfile '%s' is missing", path.c_str());
@@ -511,7 +814,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
   StringPiece opath = StringPiece(first_output->path());
   if (opath != depfile.out_) {
     EXPLAIN("expected depfile '%s' to mention '%s', got '%s'", path.c_str(),
-            first_output->path().c_str(), depfile.out_.AsString().c_str());
+            first_output->path_c_str(), depfile.out_.AsString().c_str());
     return false;
   }
 
@@ -522,12 +825,9 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
   // Add all its in-edges.
   for (vector<StringPiece>::iterator i = depfile.ins_.begin();
        i != depfile.ins_.end(); ++i, ++implicit_dep) {
-    uint64_t slash_bits;
-    if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
-                          err))
+    Node* node = state_->GetDepfileNode(*i, err);
+    if (!node)
       return false;
-
-    Node* node = state_->GetNode(*i, slash_bits);
     *implicit_dep = node;
     node->AddOutEdge(edge);
     CreatePhonyInEdge(node);
@@ -541,14 +841,14 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
   Node* output = edge->outputs_[0];
   DepsLog::Deps* deps = deps_log_->GetDeps(output);
   if (!deps) {
-    EXPLAIN("deps for '%s' are missing", output->path().c_str());
+    EXPLAIN("deps for '%s' are missing", output->path_c_str());
     return false;
   }
 
   // Deps are invalid if the output is newer than the deps.
   if (output->mtime() > deps->mtime) {
     EXPLAIN("stored deps info out of date for '%s' (%" PRId64 " vs %" PRId64 ")",
-            output->path().c_str(), deps->mtime, output->mtime());
+            output->path_c_str(), deps->mtime, output->mtime());
     return false;
   }
 
@@ -568,6 +868,7 @@ vector<Node*>::iterator ImplicitDepLoader::PreallocateSpace(Edge* edge,
   edge->inputs_.insert(edge->inputs_.end() - edge->order_only_deps_,
                        (size_t)count, 0);
   edge->implicit_deps_ += count;
+  edge->loaded_deps_ = count;
   return edge->inputs_.end() - edge->order_only_deps_ - count;
 }
 
@@ -576,6 +877,7 @@ void ImplicitDepLoader::CreatePhonyInEdge(Node* node) {
     return;
 
   Edge* phony_edge = state_->AddEdge(&State::kPhonyRule);
+  phony_edge->generated_by_dep_loader_ = true;
   node->set_in_edge(phony_edge);
   phony_edge->outputs_.push_back(node);
 
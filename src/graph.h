@@ -15,10 +15,12 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <queue>
 #include <string>
 #include <vector>
 using namespace std;
 
+#include "dyndep.h"
 #include "eval_env.h"
 #include "timestamp.h"
 #include "util.h"
@@ -31,20 +33,52 @@ struct Node;
 struct Pool;
 struct State;
 
+/// A read-only view of a contiguous array of edges.
+struct EdgeSpan {
+  typedef Edge* const* const_iterator;
+
+  EdgeSpan(Edge* const* begin, size_t size) : begin_(begin), size_(size) {}
+
+  const_iterator begin() const { return begin_; }
+  const_iterator end() const { return begin_ + size_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Edge* operator[](size_t i) const { return begin_[i]; }
+  Edge* back() const { return begin_[size_ - 1]; }
+
+ private:
+  Edge* const* begin_;
+  size_t size_;
+};
+
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
-  Node(const string& path, uint64_t slash_bits)
+  /// |path| must outlive the Node and be followed by a NUL; State keeps it
+  /// in its arena.
+  Node(StringPiece path, uint64_t slash_bits)
       : path_(path),
         slash_bits_(slash_bits),
         mtime_(-1),
         dirty_(false),
+        dyndep_pending_(false),
         in_edge_(NULL),
+        out_edges_(NULL),
+        out_edge_count_(0),
+        out_edge_capacity_(0),
         id_(-1) {}
+  ~Node() {
+    if (out_edge_capacity_)
+      delete [] out_edges_;
+  }
 
   /// Return false on error.
   bool Stat(DiskInterface* disk_interface, string* err);
 
+  /// Mark the Node as already-stat()ed, with an mtime found by a batched
+  /// DiskInterface::StatMany().
+  void set_mtime(TimeStamp mtime) { mtime_ = mtime; }
+
   /// Return false on error.
   bool StatIfNecessary(DiskInterface* disk_interface, string* err) {
     if (status_known())
@@ -71,13 +105,16 @@ struct Node {
     return mtime_ != -1;
   }
 
-  const string& path() const { return path_; }
+  StringPiece path() const { return path_; }
+  const char* path_c_str() const { return path_.str_; }
   /// Get |path()| but use slash_bits to convert back to original slash styles.
   string PathDecanonicalized() const {
     return PathDecanonicalized(path_, slash_bits_);
   }
-  static string PathDecanonicalized(const string& path,
-                                    uint64_t slash_bits);
+  static string PathDecanonicalized(StringPiece path, uint64_t slash_bits);
+  /// Like PathDecanonicalized(), but appends the path to |result|.
+  static void AppendPathDecanonicalized(StringPiece path, uint64_t slash_bits,
+                                        string* result);
   uint64_t slash_bits() const { return slash_bits_; }
 
   TimeStamp mtime() const { return mtime_; }
@@ -86,19 +123,36 @@ struct Node {
   void set_dirty(bool dirty) { dirty_ = dirty; }
   void MarkDirty() { dirty_ = true; }
 
+  bool dyndep_pending() const { return dyndep_pending_; }
+  void set_dyndep_pending(bool pending) { dyndep_pending_ = pending; }
+
   Edge* in_edge() const { return in_edge_; }
   void set_in_edge(Edge* edge) { in_edge_ = edge; }
 
   int id() const { return id_; }
   void set_id(int id) { id_ = id; }
 
-  const vector<Edge*>& out_edges() const { return out_edges_; }
-  void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
+  EdgeSpan out_edges() const {
+    return EdgeSpan(out_edges_, out_edge_count_);
+  }
+  void AddOutEdge(Edge* edge);
+  /// Remove the last occurrence of \a edge from the out edges.
+  void RemoveOutEdge(Edge* edge);
+  void ClearOutEdges() { out_edge_count_ = 0; }
+
+  /// Move the out edges to |storage|, which has room for them and outlives
+  /// the node; see State::PackOutEdges().
+  void PackOutEdges(Edge** storage);
+  /// The bytes of the array of out edges that the node owns, if it isn't
+  /// packed.
+  size_t out_edges_bytes() const {
+    return out_edge_capacity_ * sizeof(Edge*);
+  }
 
   void Dump(const char* prefix="") const;
 
 private:
-  string path_;
+  StringPiece path_;
 
   /// Set bits starting from lowest for backslashes that were normalized to
   /// forward slashes by CanonicalizePath. See |PathDecanonicalized|.
@@ -115,15 +169,28 @@ private:
   /// edges to build.
   bool dirty_;
 
+  /// Store whether dyndep information is expected from this node but
+  /// has not yet been loaded.
+  bool dyndep_pending_;
+
   /// The Edge that produces this Node, or NULL when there is no
   /// known edge to produce it.
   Edge* in_edge_;
 
-  /// All Edges that use this Node as an input.
-  vector<Edge*> out_edges_;
+  /// All Edges that use this Node as an input.  Either packed by
+  /// State::PackOutEdges() along with those of the other nodes, with no
+  /// capacity of their own, or, once more are added, in an array the node
+  /// owns.
+  Edge** out_edges_;
+  uint32_t out_edge_count_;
+  uint32_t out_edge_capacity_;
 
   /// A dense integer id for the node, assigned and used by DepsLog.
   int id_;
+
+  // Not copyable, as it may own its out edges.
+  Node(const Node&);
+  void operator=(const Node&);
 };
 
 /// An edge in the dependency graph; links between Nodes using Rules.
@@ -134,9 +201,15 @@ struct Edge {
     VisitDone
   };
 
-  Edge() : rule_(NULL), pool_(NULL), env_(NULL), mark_(VisitNone),
+  Edge() : rule_(NULL), pool_(NULL), dyndep_(NULL), env_(NULL),
+           mark_(VisitNone),
+           id_(0), weight_(1), priority_(0), scheduling_priority_(0),
+           critical_path_weight_(0), expected_duration_(-1),
            outputs_ready_(false), deps_missing_(false),
-           implicit_deps_(0), order_only_deps_(0), implicit_outs_(0) {}
+           generated_by_dep_loader_(false), loaded_deps_(-1),
+           implicit_deps_(0), order_only_deps_(0), implicit_outs_(0),
+           command_evaluated_(false), command_hash_(0),
+           command_hash_known_(false) {}
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -145,30 +218,96 @@ struct Edge {
   /// If incl_rsp_file is enabled, the string will also contain the
   /// full contents of a response file (if applicable)
   string EvaluateCommand(bool incl_rsp_file = false);
-
-  /// Returns the shell-escaped value of |key|.
+  /// Like EvaluateCommand(), but appends the command to |command|, whose
+  /// buffer can be reused from edge to edge.  The paths and variables are
+  /// escaped and written into it in place.
+  void EvaluateCommand(string* command, bool incl_rsp_file = false);
+  /// Like EvaluateCommand(), but with $depfile standing for |depfile|, for
+  /// a depfile that is written somewhere else than it says.
+  string EvaluateCommandWithDepfile(const string& depfile);
+
+  /// Like EvaluateCommand(), but the result is kept, so that the dirty scan,
+  /// the command runner and the build log share one evaluation.
+  const string& GetCommand();
+
+  /// The BuildLog::LogEntry::HashCommand() of EvaluateCommand(true), which
+  /// is what the build log records.  Computed once, and kept even when the
+  /// command is released.
+  uint64_t GetCommandHash();
+
+  /// Free the kept command once it's no longer needed, e.g. because the edge
+  /// turned out to be clean or has finished running.
+  void ReleaseCommand();
+
+  /// Returns the shell-escaped value of the variable with interned id |var|,
+  /// usually one of VarNames::Builtin.
+  string GetBinding(int var);
   string GetBinding(const string& key);
-  bool GetBindingBool(const string& key);
+  bool GetBindingBool(int var);
+  /// Like GetBinding(), but appends the value to |result|.
+  void AppendBinding(int var, string* result);
 
   /// Like GetBinding("depfile"), but without shell escaping.
   string GetUnescapedDepfile();
+  /// Like GetBinding("dyndep"), but without shell escaping.
+  string GetUnescapedDyndep();
   /// Like GetBinding("rspfile"), but without shell escaping.
   string GetUnescapedRspfile();
 
   void Dump(const char* prefix="") const;
 
+  /// Drop the inputs loaded from the deps log or a depfile, so that the
+  /// next scan loads them again.
+  void UnloadDeps();
+
   const Rule* rule_;
   Pool* pool_;
   vector<Node*> inputs_;
   vector<Node*> outputs_;
+  /// The file named by the 'dyndep' binding, if any, from which the
+  /// implicit inputs and outputs discovered at build time are loaded.
+  Node* dyndep_;
   BindingEnv* env_;
   VisitMark mark_;
+  /// A dense integer id for the edge, assigned by State::AddEdge in manifest
+  /// order.  Used to break ties between edges deterministically.
+  size_t id_;
+  /// The number of job slots this edge occupies while it runs, from the
+  /// 'weight' binding; charged against its pool and against -j.
+  int weight_;
+  /// The 'priority' binding: among the ready edges, those with a higher
+  /// priority run first, before the critical path is considered.
+  int priority_;
+  /// The highest priority of this edge and of the wanted edges that depend
+  /// on it, but for phony ones without a priority, so that what a
+  /// high-priority edge needs is built early too.
+  /// Computed by Plan::ComputeCriticalPath.
+  int scheduling_priority_;
+  /// The expected time in milliseconds from starting this edge until all of
+  /// the targets of the current build that depend on it are done, assuming
+  /// unlimited parallelism.  Computed by Plan::ComputeCriticalPath.
+  int64_t critical_path_weight_;
+  /// How long this edge is expected to run in milliseconds, from the build
+  /// log, or -1 if the plan hasn't wanted it yet.  Computed by
+  /// Plan::ComputeCriticalPath.
+  int64_t expected_duration_;
   bool outputs_ready_;
   bool deps_missing_;
+  /// Whether ImplicitDepLoader made up this phony edge for an input that
+  /// no other edge produces; a dyndep file may then name the real one.
+  bool generated_by_dep_loader_;
+  /// The number of implicit deps that ImplicitDepLoader added, right before
+  /// the order-only deps, or -1 if they haven't been loaded.  Loaded deps are
+  /// kept across scans of the same graph until UnloadDeps() is called.
+  int loaded_deps_;
 
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
-  int weight() const { return 1; }
+  int weight() const { return weight_; }
+  int priority() const { return priority_; }
+  int scheduling_priority() const { return scheduling_priority_; }
+  int64_t critical_path_weight() const { return critical_path_weight_; }
+  int64_t expected_duration() const { return expected_duration_; }
   bool outputs_ready() const { return outputs_ready_; }
 
   // There are three types of inputs.
@@ -202,8 +341,31 @@ struct Edge {
   bool is_phony() const;
   bool use_console() const;
   bool maybe_phonycycle_diagnostic() const;
+
+  /// The results of GetCommand() and GetCommandHash().
+  string command_;
+  bool command_evaluated_;
+  uint64_t command_hash_;
+  bool command_hash_known_;
 };
 
+/// Orders edges so that the edge with the highest priority comes first, then
+/// the one with the heaviest critical path, falling back to manifest order;
+/// see Plan::FindWork.
+struct EdgePriorityLess {
+  bool operator()(const Edge* e1, const Edge* e2) const {
+    if (e1->scheduling_priority() != e2->scheduling_priority())
+      return e1->scheduling_priority() < e2->scheduling_priority();
+    if (e1->critical_path_weight() != e2->critical_path_weight())
+      return e1->critical_path_weight() < e2->critical_path_weight();
+    return e1->id_ > e2->id_;
+  }
+};
+
+/// A queue of ready edges, with the edge to run next at the top.
+typedef priority_queue<Edge*, vector<Edge*>, EdgePriorityLess>
+    EdgePriorityQueue;
+
 
 /// ImplicitDepLoader loads implicit dependencies, as referenced via the
 /// "depfile" attribute in build files.
@@ -252,7 +414,8 @@ struct DependencyScan {
                  DiskInterface* disk_interface)
       : build_log_(build_log),
         disk_interface_(disk_interface),
-        dep_loader_(state, deps_log, disk_interface) {}
+        dep_loader_(state, deps_log, disk_interface),
+        dyndep_loader_(state, disk_interface) {}
 
   /// Update the |dirty_| state of the given node by inspecting its input edge.
   /// Examine inputs, outputs, and command lines to judge whether an edge
@@ -261,6 +424,12 @@ struct DependencyScan {
   /// Returns false on failure.
   bool RecomputeDirty(Node* node, string* err);
 
+  /// Stat every node that RecomputeDirty() would visit from |targets|,
+  /// including the inputs recorded in the deps log, as one batch.
+  /// RecomputeDirty() then only reads the known mtimes.  Stat errors are
+  /// left for RecomputeDirty() to report.
+  void PrefetchStats(const vector<Node*>& targets);
+
   /// Recompute whether any output of the edge is dirty, if so sets |*dirty|.
   /// Returns false on failure.
   bool RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
@@ -277,18 +446,34 @@ struct DependencyScan {
     return dep_loader_.deps_log();
   }
 
+  /// Load a dyndep file from the given node's path and update the
+  /// build graph with the new information.  One overload accepts
+  /// a caller-owned 'DyndepFile' object in which to store the
+  /// information loaded from the dyndep file.
+  bool LoadDyndeps(Node* node, string* err) const;
+  bool LoadDyndeps(Node* node, DyndepFile* ddf, string* err) const;
+
  private:
-  bool RecomputeDirty(Node* node, vector<Node*>* stack, string* err);
+  struct ScanFrame;
+  /// Start the scan of |node|: a leaf is done with right away, while an
+  /// edge not scanned yet gets a frame pushed on |frames| and its node on
+  /// |stack|.  Returns false on a cycle or a stat error.
+  bool VisitNode(Node* node, vector<ScanFrame>* frames, vector<Node*>* stack,
+                 string* err);
+  /// Work out the dirty state of the outputs of the edge of |frame| once
+  /// its inputs are all scanned.
+  bool FinishEdge(ScanFrame* frame, string* err);
   bool VerifyDAG(Node* node, vector<Node*>* stack, string* err);
 
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
-                            const string& command, Node* output);
+                            Node* output);
 
   BuildLog* build_log_;
   DiskInterface* disk_interface_;
   ImplicitDepLoader dep_loader_;
+  DyndepLoader dyndep_loader_;
 };
 
 #endif  // NINJA_GRAPH_H_
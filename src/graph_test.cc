@@ -14,6 +14,7 @@
 
 #include "graph.h"
 #include "build.h"
+#include "build_log.h"
 
 #include "test.h"
 
@@ -40,6 +41,36 @@ TEST_F(GraphTest, MissingImplicit) {
   EXPECT_TRUE(GetNode("out")->dirty());
 }
 
+TEST_F(GraphTest, PrefetchStats) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid1 mid2 | implicit || orderonly\n"
+"build mid1 mid2: cat in\n"));
+  fs_.Create("in", "");
+  fs_.Create("mid1", "");
+  fs_.Create("out", "");
+
+  vector<Node*> targets;
+  targets.push_back(GetNode("out"));
+  scan_.PrefetchStats(targets);
+
+  const char* kPaths[] = {
+    "out", "mid1", "mid2", "implicit", "orderonly", "in"
+  };
+  for (size_t i = 0; i < sizeof(kPaths) / sizeof(kPaths[0]); ++i)
+    EXPECT_TRUE(GetNode(kPaths[i])->status_known());
+  EXPECT_TRUE(GetNode("mid1")->exists());
+  EXPECT_FALSE(GetNode("mid2")->exists());
+
+  // Only the prefetched mtimes are used from here on.
+  fs_.Tick();
+  fs_.Create("mid2", "");
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(GetNode("mid2")->exists());
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
 TEST_F(GraphTest, ModifiedImplicit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "build out: cat in | implicit\n"));
@@ -208,7 +239,7 @@ TEST_F(GraphTest, RootNodes) {
   vector<Node*> root_nodes = state_.RootNodes(&err);
   EXPECT_EQ(4u, root_nodes.size());
   for (size_t i = 0; i < root_nodes.size(); ++i) {
-    string name = root_nodes[i]->path();
+    string name = root_nodes[i]->path().AsString();
     EXPECT_EQ("out", name.substr(0, 3));
   }
 }
@@ -281,6 +312,44 @@ TEST_F(GraphTest, RuleVariablesInScope) {
   EXPECT_EQ("depfile is x", edge->EvaluateCommand());
 }
 
+TEST_F(GraphTest, EvaluateCommandAppends) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  description = -x $in\n"
+"  command = cc $description -o $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build out: r in1 in$ 2\n"
+"build out2: r in3\n"));
+  string command = "prefix: ";
+  GetNode("out")->in_edge()->EvaluateCommand(&command, true);
+  EXPECT_EQ("prefix: cc -x in1 'in 2' -o out;rspfile=in1 'in 2'", command);
+
+  // The buffer is appended to, whatever it held.
+  GetNode("out2")->in_edge()->EvaluateCommand(&command);
+  EXPECT_EQ("prefix: cc -x in1 'in 2' -o out;rspfile=in1 'in 2'"
+            "cc -x in3 -o out2", command);
+}
+
+TEST_F(GraphTest, CommandIsKept) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = cat $rspfile > $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build out: r in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  EXPECT_EQ(edge->EvaluateCommand(), edge->GetCommand());
+  EXPECT_EQ(&edge->GetCommand(), &edge->GetCommand());
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(edge->EvaluateCommand(true)),
+            edge->GetCommandHash());
+
+  uint64_t hash = edge->GetCommandHash();
+  edge->ReleaseCommand();
+  EXPECT_EQ(hash, edge->GetCommandHash());
+  EXPECT_EQ("cat out.rsp > out", edge->GetCommand());
+}
+
 // Check that build statements can override rule builtins like depfile.
 TEST_F(GraphTest, DepfileOverride) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -347,6 +416,26 @@ TEST_F(GraphTest, DependencyCycle) {
   ASSERT_EQ("dependency cycle: out -> mid -> in -> pre -> out", err);
 }
 
+// Chains far longer than a thread's stack would allow recursing through.
+TEST_F(GraphTest, DeepChain) {
+  const int kDepth = 200000;
+  string manifest;
+  char line[64];
+  for (int i = 0; i < kDepth; ++i) {
+    snprintf(line, sizeof(line), "build n%d: cat n%d\n", i, i + 1);
+    manifest += line;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  snprintf(line, sizeof(line), "n%d", kDepth);
+  fs_.Create(line, "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("n0"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("n0")->dirty());
+  EXPECT_FALSE(GetNode("n0")->in_edge()->outputs_ready());
+}
+
 TEST_F(GraphTest, CycleInEdgesButNotInNodes1) {
   string err;
   AssertParse(&state_,
@@ -459,6 +548,288 @@ TEST_F(GraphTest, CycleWithLengthOneFromDepfileOneHopAway) {
   EXPECT_EQ("c", edge->inputs_[0]->path());
 }
 
+TEST_F(GraphTest, DyndepLoadTrivial) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+  );
+
+  string err;
+  ASSERT_TRUE(GetNode("dd")->dyndep_pending());
+  EXPECT_TRUE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(GetNode("dd")->dyndep_pending());
+
+  Edge* edge = GetNode("out")->in_edge();
+  ASSERT_EQ(1u, edge->outputs_.size());
+  EXPECT_EQ("out", edge->outputs_[0]->path());
+  ASSERT_EQ(2u, edge->inputs_.size());
+  EXPECT_EQ("in", edge->inputs_[0]->path());
+  EXPECT_EQ("dd", edge->inputs_[1]->path());
+  EXPECT_EQ(0, edge->implicit_deps_);
+  EXPECT_EQ(1, edge->order_only_deps_);
+  EXPECT_FALSE(edge->GetBindingBool(VarNames::kRestat));
+}
+
+TEST_F(GraphTest, DyndepLoadImplicit) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out1: r in || dd\n"
+"  dyndep = dd\n"
+"build out2: r in\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out1 | out3: dyndep | out2\n"
+"  restat = 1\n"
+  );
+
+  string err;
+  EXPECT_TRUE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("", err);
+
+  Edge* edge = GetNode("out1")->in_edge();
+  ASSERT_EQ(2u, edge->outputs_.size());
+  EXPECT_EQ("out1", edge->outputs_[0]->path());
+  EXPECT_EQ("out3", edge->outputs_[1]->path());
+  EXPECT_EQ(1, edge->implicit_outs_);
+  EXPECT_EQ(edge, GetNode("out3")->in_edge());
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("in", edge->inputs_[0]->path());
+  EXPECT_EQ("out2", edge->inputs_[1]->path());
+  EXPECT_EQ("dd", edge->inputs_[2]->path());
+  EXPECT_EQ(1, edge->implicit_deps_);
+  EXPECT_EQ(1, edge->order_only_deps_);
+  EXPECT_TRUE(edge->GetBindingBool(VarNames::kRestat));
+
+  // The binding stays on the edge that the dyndep file mentions.
+  EXPECT_FALSE(GetNode("out2")->in_edge()->GetBindingBool(VarNames::kRestat));
+}
+
+TEST_F(GraphTest, DyndepLoadBeforeLoadedDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"  depfile = out.d\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("in", "");
+  fs_.Create("out.d", "out: header\n");
+  fs_.Create("out", "");
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep | mod\n"
+  );
+
+  // Load the depfile first, as a scan of a graph without the dyndep
+  // binding would, then the dyndep file.
+  Edge* edge = GetNode("out")->in_edge();
+  GetNode("dd")->set_dyndep_pending(false);
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("", err);
+
+  ASSERT_EQ(4u, edge->inputs_.size());
+  EXPECT_EQ("in", edge->inputs_[0]->path());
+  EXPECT_EQ("mod", edge->inputs_[1]->path());
+  EXPECT_EQ("header", edge->inputs_[2]->path());
+  EXPECT_EQ("dd", edge->inputs_[3]->path());
+  EXPECT_EQ(2, edge->implicit_deps_);
+
+  // Dropping the loaded deps keeps what the dyndep file added.
+  edge->UnloadDeps();
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("mod", edge->inputs_[1]->path());
+  EXPECT_EQ(1, edge->implicit_deps_);
+}
+
+TEST_F(GraphTest, DyndepLoadMissingFile) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+  ));
+
+  string err;
+  EXPECT_FALSE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("loading 'dd': No such file or directory", err);
+}
+
+TEST_F(GraphTest, DyndepLoadMissingEntry) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+  );
+
+  string err;
+  EXPECT_FALSE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("'out' not mentioned in its dyndep file 'dd'", err);
+}
+
+TEST_F(GraphTest, DyndepLoadExtraEntry) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+"build out2: r in || dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"build out2: dyndep\n"
+  );
+
+  string err;
+  EXPECT_FALSE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("dyndep file 'dd' mentions output 'out2' whose build statement "
+            "does not have a dyndep binding for the file", err);
+}
+
+TEST_F(GraphTest, DyndepLoadOutputWithMultipleRules) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out1 | out-twice.imp: r in1\n"
+"build out2: r in2 || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out2 | out-twice.imp: dyndep\n"
+  );
+
+  string err;
+  EXPECT_FALSE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("multiple rules generate out-twice.imp", err);
+}
+
+TEST_F(GraphTest, DyndepFileMissing) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r || dd\n"
+"  dyndep = dd\n"
+  ));
+
+  string err;
+  EXPECT_FALSE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("loading 'dd': No such file or directory", err);
+}
+
+TEST_F(GraphTest, DyndepFileError) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+  );
+
+  string err;
+  EXPECT_FALSE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("'out' not mentioned in its dyndep file 'dd'", err);
+}
+
+TEST_F(GraphTest, DyndepImplicitInputNewer) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep | in\n"
+  );
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_FALSE(GetNode("in")->dirty());
+  EXPECT_FALSE(GetNode("dd")->dirty());
+
+  // "out" is dirty due to dyndep-specified implicit input
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
+TEST_F(GraphTest, DyndepFileReady) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build dd: r dd-in\n"
+"build out: r || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd-in", "");
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep | in\n"
+  );
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_FALSE(GetNode("in")->dirty());
+  EXPECT_FALSE(GetNode("dd")->dirty());
+  EXPECT_TRUE(GetNode("dd")->in_edge()->outputs_ready());
+
+  // "out" is dirty due to dyndep-specified implicit input
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
+TEST_F(GraphTest, DyndepFileNotClean) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build dd: r dd-in\n"
+"build out: r || dd\n"
+"  dyndep = dd\n"
+  ));
+  fs_.Create("dd", "this-should-not-be-loaded");
+  fs_.Tick();
+  fs_.Create("dd-in", "");
+  fs_.Create("out", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_TRUE(GetNode("dd")->dirty());
+  EXPECT_FALSE(GetNode("dd")->in_edge()->outputs_ready());
+
+  // "out" is clean but not ready since "dd" is not ready
+  EXPECT_FALSE(GetNode("out")->dirty());
+  EXPECT_FALSE(GetNode("out")->in_edge()->outputs_ready());
+  EXPECT_TRUE(GetNode("dd")->dyndep_pending());
+}
+
 #ifdef _WIN32
 TEST_F(GraphTest, Decanonicalize) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
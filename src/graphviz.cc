@@ -19,55 +19,115 @@
 
 #include "graph.h"
 
-void GraphViz::AddTarget(Node* node) {
-  if (visited_nodes_.find(node) != visited_nodes_.end())
-    return;
+namespace {
 
-  string pathstr = node->path();
-  replace(pathstr.begin(), pathstr.end(), '\\', '/');
-  printf("\"%p\" [label=\"%s\"]\n", node, pathstr.c_str());
-  visited_nodes_.insert(node);
+/// Print |str| as a quoted dot ID.
+void PrintQuoted(const string& str) {
+  putchar('"');
+  for (string::const_iterator c = str.begin(); c != str.end(); ++c) {
+    if (*c == '\\')
+      putchar('/');
+    else if (*c == '"')
+      fputs("\\\"", stdout);
+    else
+      putchar(*c);
+  }
+  putchar('"');
+}
 
-  Edge* edge = node->in_edge();
+}  // namespace
 
-  if (!edge) {
-    // Leaf node.
-    // Draw as a rect?
-    return;
-  }
+void GraphViz::AddTarget(Node* node) {
+  pending_.push(make_pair(node, 0));
+  while (!pending_.empty()) {
+    Node* node = pending_.front().first;
+    int depth = pending_.front().second;
+    pending_.pop();
 
-  if (visited_edges_.find(edge) != visited_edges_.end())
-    return;
-  visited_edges_.insert(edge);
+    Edge* edge = node->in_edge();
+    if (!edge) {
+      // Leaf node.  Targets are declared even so, as they might not be
+      // mentioned otherwise.
+      if (depth == 0 && !by_rule_) {
+        PrintNode(node);
+        printf("\n");
+      }
+      continue;
+    }
+    if (edge->id_ < visited_edges_.size() && visited_edges_[edge->id_])
+      continue;
+    if (edge->id_ >= visited_edges_.size())
+      visited_edges_.resize(edge->id_ + 1);
+    visited_edges_[edge->id_] = true;
+
+    // Breadth first, a node is first reached as close to the targets as it
+    // can be, so the depth cuts them all off at the same distance.
+    if (max_depth_ >= 0 && depth >= max_depth_) {
+      if (!by_rule_) {
+        PrintNode(node);
+        printf(" [style=dashed]\n");
+      }
+      continue;
+    }
+    AddEdge(edge, depth);
+  }
+}
 
-  if (edge->inputs_.size() == 1 && edge->outputs_.size() == 1) {
+void GraphViz::AddEdge(Edge* edge, int depth) {
+  if (by_rule_) {
+    AddRuleEdge(edge);
+  } else if (edge->inputs_.size() == 1 && edge->outputs_.size() == 1) {
     // Can draw simply.
     // Note extra space before label text -- this is cosmetic and feels
     // like a graphviz bug.
-    printf("\"%p\" -> \"%p\" [label=\" %s\"]\n",
-           edge->inputs_[0], edge->outputs_[0], edge->rule_->name().c_str());
+    PrintNode(edge->inputs_[0]);
+    printf(" -> ");
+    PrintNode(edge->outputs_[0]);
+    printf(" [label=\" %s\"]\n", edge->rule_->name().c_str());
   } else {
     printf("\"%p\" [label=\"%s\", shape=ellipse]\n",
            edge, edge->rule_->name().c_str());
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      printf("\"%p\" -> \"%p\"\n", edge, *out);
+      printf("\"%p\" -> ", edge);
+      PrintNode(*out);
+      printf("\n");
     }
     for (vector<Node*>::iterator in = edge->inputs_.begin();
          in != edge->inputs_.end(); ++in) {
       const char* order_only = "";
       if (edge->is_order_only(in - edge->inputs_.begin()))
         order_only = " style=dotted";
-      printf("\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge, order_only);
+      PrintNode(*in);
+      printf(" -> \"%p\" [arrowhead=none%s]\n", edge, order_only);
     }
   }
 
   for (vector<Node*>::iterator in = edge->inputs_.begin();
        in != edge->inputs_.end(); ++in) {
-    AddTarget(*in);
+    pending_.push(make_pair(*in, depth + 1));
   }
 }
 
+void GraphViz::AddRuleEdge(Edge* edge) {
+  const Rule* rule = edge->rule_;
+  ++rule_edges_[rule];
+  for (vector<Node*>::iterator in = edge->inputs_.begin();
+       in != edge->inputs_.end(); ++in) {
+    Edge* producer = (*in)->in_edge();
+    if (!producer)
+      continue;
+    // Rules only reached past the depth limit are drawn without a count.
+    rule_edges_.insert(make_pair(producer->rule_, 0));
+    if (rule_links_.insert(make_pair(producer->rule_, rule)).second)
+      printf("\"%p\" -> \"%p\"\n", producer->rule_, rule);
+  }
+}
+
+void GraphViz::PrintNode(Node* node) {
+  PrintQuoted(node->path().AsString());
+}
+
 void GraphViz::Start() {
   printf("digraph ninja {\n");
   printf("rankdir=\"LR\"\n");
@@ -76,5 +136,17 @@ void GraphViz::Start() {
 }
 
 void GraphViz::Finish() {
+  // The rules are labelled last, once all their edges are counted.
+  for (map<const Rule*, int>::const_iterator rule = rule_edges_.begin();
+       rule != rule_edges_.end(); ++rule) {
+    if (rule->second == 0) {
+      printf("\"%p\" [label=\"%s\", shape=ellipse, style=dashed]\n",
+             rule->first, rule->first->name().c_str());
+    } else {
+      printf("\"%p\" [label=\"%s\\n%d edge%s\", shape=ellipse]\n",
+             rule->first, rule->first->name().c_str(), rule->second,
+             rule->second == 1 ? "" : "s");
+    }
+  }
   printf("}\n");
 }
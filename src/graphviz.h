@@ -15,19 +15,49 @@
 #ifndef NINJA_GRAPHVIZ_H_
 #define NINJA_GRAPHVIZ_H_
 
+#include <map>
+#include <queue>
 #include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
-struct Node;
 struct Edge;
+struct Node;
+struct Rule;
 
 /// Runs the process of creating GraphViz .dot file output.
+/// The output is written as the graph is walked, breadth first from the
+/// targets: files are named by their path, so they never need declaring
+/// a second time, and only the edges that were written are remembered.
 struct GraphViz {
+  GraphViz() : max_depth_(-1), by_rule_(false) {}
+
   void Start();
   void AddTarget(Node* node);
   void Finish();
 
-  std::set<Node*> visited_nodes_;
-  std::set<Edge*> visited_edges_;
+  /// Only show the edges at most this many steps away from the targets,
+  /// or all of them if negative.  Targets whose edge is left out are
+  /// drawn dashed.
+  int max_depth_;
+
+  /// Collapse all the edges of each rule into one node of the rule,
+  /// linked to the rules producing their inputs; files are left out.
+  bool by_rule_;
+
+ private:
+  void AddEdge(Edge* edge, int depth);
+  void AddRuleEdge(Edge* edge);
+  void PrintNode(Node* node);
+
+  /// Indexed by Edge::id_.
+  std::vector<bool> visited_edges_;
+  /// The nodes whose edges are still to write, with their depth.
+  std::queue<std::pair<Node*, int> > pending_;
+  /// The number of edges of each rule, for by_rule_.
+  std::map<const Rule*, int> rule_edges_;
+  std::set<std::pair<const Rule*, const Rule*> > rule_links_;
 };
 
 #endif  // NINJA_GRAPHVIZ_H_
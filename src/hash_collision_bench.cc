@@ -15,11 +15,17 @@
 #include "build_log.h"
 
 #include <algorithm>
+#include <string>
+#include <vector>
 using namespace std;
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "hash_map.h"
+#include "metrics.h"
+
 int random(int low, int high) {
   return int(low + (rand() / double(RAND_MAX)) * (high - low) + 0.5);
 }
@@ -31,6 +37,76 @@ void RandomCommand(char** s) {
     (*s)[i] = (char)random(32, 127);
 }
 
+/// A path such as manifests have, deep in a tree of a few hundred
+/// directories.
+string RandomPath(int i) {
+  char path[128];
+  snprintf(path, sizeof(path), "out/obj/third_party/lib%d/src/dir%d/file%d.o",
+           random(0, 300), random(0, 20), i);
+  return path;
+}
+
+/// Time inserting |paths| into a |Map| and looking up each of |lookups|,
+/// then each of |misses|.
+template<typename Map>
+void TimeMap(const char* name, const vector<string>& paths,
+             const vector<string>& lookups, const vector<string>& misses) {
+  Map map;
+  int64_t start = GetTimeMillis();
+  for (size_t i = 0; i < paths.size(); ++i)
+    map[paths[i]] = (int)i;
+  int64_t inserted = GetTimeMillis();
+  size_t found = 0;
+  for (int rep = 0; rep < 5; ++rep) {
+    for (size_t i = 0; i < lookups.size(); ++i)
+      found += map.find(lookups[i]) != map.end();
+  }
+  int64_t hits = GetTimeMillis();
+  for (int rep = 0; rep < 5; ++rep) {
+    for (size_t i = 0; i < misses.size(); ++i)
+      found += map.find(misses[i]) != map.end();
+  }
+  int64_t end = GetTimeMillis();
+  printf("%-14s insert %4dms  5x hits %4dms  5x misses %4dms  (%u found)\n",
+         name, (int)(inserted - start), (int)(hits - inserted),
+         (int)(end - hits), (unsigned)found);
+}
+
+/// Compare the hash tables and hashes for paths, on 2M of them.
+void TimeLookups() {
+  const int kPaths = 2 * 1000 * 1000;
+  vector<string> paths, misses;
+  for (int i = 0; i < kPaths; ++i) {
+    paths.push_back(RandomPath(i));
+    misses.push_back(RandomPath(kPaths + i));
+  }
+  // Look them up in another order than inserted, like a build does.
+  vector<string> shuffled = paths;
+  for (int i = kPaths - 1; i > 0; --i)
+    swap(shuffled[i], shuffled[random(0, i)]);
+
+  int64_t start = GetTimeMillis();
+  unsigned int murmur = 0;
+  for (int rep = 0; rep < 5; ++rep) {
+    for (int i = 0; i < kPaths; ++i)
+      murmur += MurmurHash2(paths[i].data(), paths[i].size());
+  }
+  int64_t middle = GetTimeMillis();
+  uint64_t hash = 0;
+  for (int rep = 0; rep < 5; ++rep) {
+    for (int i = 0; i < kPaths; ++i)
+      hash += HashBytes(paths[i].data(), paths[i].size());
+  }
+  int64_t end = GetTimeMillis();
+  printf("5x hash of %d paths: MurmurHash2 %dms  HashBytes %dms  (%x)\n",
+         kPaths, (int)(middle - start), (int)(end - middle),
+         murmur ^ (unsigned)hash);
+
+  TimeMap<StdStringHashMap<int>::Type>("unordered_map", paths, shuffled,
+                                       misses);
+  TimeMap<FlatHashMap<int> >("FlatHashMap", paths, shuffled, misses);
+}
+
 int main() {
   const int N = 20 * 1000 * 1000;
 
@@ -60,4 +136,6 @@ int main() {
     }
   }
   printf("\n\n%d collisions after %d runs\n", collision_count, N);
+
+  TimeLookups();
 }
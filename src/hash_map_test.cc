@@ -0,0 +1,135 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_map.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "test.h"
+
+namespace {
+
+/// Keeps the strings that the keys of a map point to.
+struct Keys {
+  StringPiece Add(const string& key) {
+    keys_.push_back(new string(key));
+    return *keys_.back();
+  }
+  ~Keys() {
+    for (size_t i = 0; i < keys_.size(); ++i)
+      delete keys_[i];
+  }
+  vector<string*> keys_;
+};
+
+}  // anonymous namespace
+
+TEST(FlatHashMapTest, Basic) {
+  FlatHashMap<int> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_TRUE(map.begin() == map.end());
+  EXPECT_EQ(0u, map.erase("a"));
+
+  map["a"] = 1;
+  EXPECT_TRUE(map.insert(make_pair(StringPiece("b"), 2)).second);
+  EXPECT_FALSE(map.insert(make_pair(StringPiece("b"), 3)).second);
+  EXPECT_EQ(2u, map.size());
+  EXPECT_EQ(1, map.find("a")->second);
+  EXPECT_EQ(2, map["b"]);
+  EXPECT_EQ(1u, map.count("b"));
+  EXPECT_EQ(0u, map.count("c"));
+  // The empty string is a key like any other.
+  map[""] = 4;
+  EXPECT_EQ(4, map.find("")->second);
+
+  EXPECT_EQ(1u, map.erase("a"));
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_EQ(2u, map.size());
+
+  int total = 0;
+  for (FlatHashMap<int>::const_iterator i = map.begin(); i != map.end(); ++i)
+    total += i->second;
+  EXPECT_EQ(6, total);
+
+  map.clear();
+  EXPECT_EQ(0u, map.size());
+  EXPECT_TRUE(map.find("b") == map.end());
+}
+
+TEST(FlatHashMapTest, SameAsStdMap) {
+  // Grow, erase and reinsert many times over, against a map known to work.
+  Keys keys;
+  vector<StringPiece> names;
+  for (int i = 0; i < 5000; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "dir%d/file%d.h", i % 37, i);
+    names.push_back(keys.Add(name));
+  }
+
+  FlatHashMap<int> map;
+  std::map<string, int> expected;
+  unsigned int random = 1;
+  for (int step = 0; step < 100000; ++step) {
+    random = random * 1103515245 + 12345;
+    StringPiece name = names[(random >> 8) % names.size()];
+    switch ((random >> 4) % 4) {
+    case 0:
+      EXPECT_EQ(expected.erase(name.AsString()), map.erase(name));
+      break;
+    case 1:
+      EXPECT_EQ(expected.count(name.AsString()), map.count(name));
+      break;
+    default:
+      map[name] = step;
+      expected[name.AsString()] = step;
+      break;
+    }
+  }
+
+  ASSERT_EQ(expected.size(), map.size());
+  size_t seen = 0;
+  for (FlatHashMap<int>::iterator i = map.begin(); i != map.end(); ++i) {
+    EXPECT_EQ(expected[i->first.AsString()], i->second);
+    ++seen;
+  }
+  EXPECT_EQ(expected.size(), seen);
+
+  // A copy has the same contents.
+  FlatHashMap<int> copy(map);
+  EXPECT_EQ(map.size(), copy.size());
+  for (std::map<string, int>::iterator i = expected.begin();
+       i != expected.end(); ++i) {
+    FlatHashMap<int>::const_iterator found = copy.find(i->first);
+    ASSERT_TRUE(found != copy.end());
+    EXPECT_EQ(i->second, found->second);
+  }
+}
+
+TEST(FlatHashMapTest, Reserve) {
+  FlatHashMap<int> map;
+  map.reserve(1000);
+  size_t capacity = map.bucket_count();
+  EXPECT_GE(capacity, 1000u);
+  Keys keys;
+  for (int i = 0; i < 1000; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", i);
+    map[keys.Add(name)] = i;
+  }
+  EXPECT_EQ(capacity, map.bucket_count());
+  EXPECT_EQ(999, map.find("999")->second);
+}
@@ -0,0 +1,171 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace {
+
+/// Open a descriptor of our own on the pipe behind the inherited |fd|, so
+/// that it can be made non-blocking without affecting the other processes
+/// sharing the jobserver.  Falls back to a plain dup() where /proc isn't
+/// available.
+int ReopenPipe(int fd, int flags) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  int new_fd = open(path, flags | O_NONBLOCK);
+  if (new_fd < 0)
+    new_fd = dup(fd);
+  if (new_fd >= 0)
+    SetCloseOnExec(new_fd);
+  return new_fd;
+}
+
+}  // anonymous namespace
+
+JobserverClient::JobserverClient() : read_fd_(-1), write_fd_(-1) {}
+
+JobserverClient::~JobserverClient() {
+  while (!tokens_.empty())
+    Release();
+  if (write_fd_ >= 0 && write_fd_ != read_fd_)
+    close(write_fd_);
+  if (read_fd_ >= 0)
+    close(read_fd_);
+}
+
+bool JobserverClient::Connect(const JobserverConfig& config, string* err) {
+  switch (config.mode) {
+  case JobserverConfig::kModePipe:
+    // make closes the descriptors for commands it doesn't consider to be
+    // sub-makes.
+    if (fcntl(config.read_fd, F_GETFD) < 0 ||
+        fcntl(config.write_fd, F_GETFD) < 0) {
+      *err = "jobserver pipe is not available (mark the command with '+' "
+             "in the Makefile to share it)";
+      return false;
+    }
+    read_fd_ = ReopenPipe(config.read_fd, O_RDONLY);
+    write_fd_ = ReopenPipe(config.write_fd, O_WRONLY);
+    break;
+  case JobserverConfig::kModeFifo:
+    // O_RDWR so that opening doesn't wait for another end to show up.
+    read_fd_ = write_fd_ = open(config.name.c_str(), O_RDWR | O_NONBLOCK);
+    if (read_fd_ >= 0)
+      SetCloseOnExec(read_fd_);
+    break;
+  default:
+    *err = "unsupported jobserver '" + config.name + "'";
+    return false;
+  }
+
+  if (read_fd_ < 0 || write_fd_ < 0) {
+    *err = string("jobserver: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool JobserverClient::connected() const {
+  return read_fd_ >= 0;
+}
+
+bool JobserverClient::TryAcquire() {
+  // The descriptor may still be blocking if it had to be dup()ed, so check
+  // for a token first.  Another process may win the race for it, in which
+  // case the read() below waits for the next one.
+  pollfd pfd = { read_fd_, POLLIN, 0 };
+  if (poll(&pfd, 1, 0) <= 0)
+    return false;
+
+  char token;
+  ssize_t len;
+  do {
+    len = read(read_fd_, &token, 1);
+  } while (len < 0 && errno == EINTR);
+  if (len != 1)
+    return false;
+  tokens_.push_back(token);
+  return true;
+}
+
+void JobserverClient::Release() {
+  if (tokens_.empty())
+    return;
+  char token = tokens_[tokens_.size() - 1];
+  tokens_.resize(tokens_.size() - 1);
+  ssize_t len;
+  do {
+    len = write(write_fd_, &token, 1);
+  } while (len < 0 && errno == EINTR);
+  if (len != 1)
+    Warning("jobserver: could not return a token: %s", strerror(errno));
+}
+
+JobserverServer::JobserverServer() {
+  fds_[0] = fds_[1] = -1;
+}
+
+JobserverServer::~JobserverServer() {
+  if (fds_[0] >= 0)
+    close(fds_[0]);
+  if (fds_[1] >= 0)
+    close(fds_[1]);
+}
+
+bool JobserverServer::Create(int parallelism, string* err) {
+  // The tokens all sit in the pipe buffer, which is only guaranteed to hold
+  // a few kilobytes.
+  const int kMaxParallelism = 4096;
+  if (parallelism < 1 || parallelism > kMaxParallelism) {
+    *err = "jobserver: parallelism must be between 1 and 4096";
+    return false;
+  }
+
+  // The descriptors are deliberately inheritable: that's how the commands
+  // find the jobserver.
+  if (pipe(fds_) < 0) {
+    *err = string("jobserver: pipe: ") + strerror(errno);
+    return false;
+  }
+  // The implicit token of every process means one slot is never in the pipe.
+  string tokens(parallelism - 1, '+');
+  if (!tokens.empty() &&
+      write(fds_[1], tokens.data(), tokens.size()) != (ssize_t)tokens.size()) {
+    *err = string("jobserver: write: ") + strerror(errno);
+    return false;
+  }
+
+  string makeflags;
+  if (const char* old_makeflags = getenv("MAKEFLAGS"))
+    makeflags = string(old_makeflags) + " ";
+  char buf[128];
+  snprintf(buf, sizeof(buf), "-j%d --jobserver-fds=%d,%d --jobserver-auth=%d,%d",
+           parallelism, fds_[0], fds_[1], fds_[0], fds_[1]);
+  makeflags += buf;
+  if (setenv("MAKEFLAGS", makeflags.c_str(), 1) < 0) {
+    *err = string("jobserver: setenv: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
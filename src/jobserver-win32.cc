@@ -0,0 +1,94 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+JobserverClient::JobserverClient() : semaphore_(NULL) {}
+
+JobserverClient::~JobserverClient() {
+  if (semaphore_)
+    CloseHandle(semaphore_);
+}
+
+bool JobserverClient::Connect(const JobserverConfig& config, string* err) {
+  if (config.mode != JobserverConfig::kModeSemaphore) {
+    *err = "unsupported jobserver; only semaphores are supported on Windows";
+    return false;
+  }
+  semaphore_ = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE,
+                              config.name.c_str());
+  if (!semaphore_) {
+    *err = "jobserver: OpenSemaphore(" + config.name + "): " +
+        GetLastErrorString();
+    return false;
+  }
+  return true;
+}
+
+bool JobserverClient::connected() const {
+  return semaphore_ != NULL;
+}
+
+bool JobserverClient::TryAcquire() {
+  return WaitForSingleObject(semaphore_, 0) == WAIT_OBJECT_0;
+}
+
+void JobserverClient::Release() {
+  if (!ReleaseSemaphore(semaphore_, 1, NULL))
+    Warning("jobserver: could not return a token: %s",
+            GetLastErrorString().c_str());
+}
+
+JobserverServer::JobserverServer() : semaphore_(NULL) {}
+
+JobserverServer::~JobserverServer() {
+  if (semaphore_)
+    CloseHandle(semaphore_);
+}
+
+bool JobserverServer::Create(int parallelism, string* err) {
+  if (parallelism < 1) {
+    *err = "jobserver: parallelism must be at least 1";
+    return false;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "ninja_jobserver_%lu", GetCurrentProcessId());
+  // The implicit token of every process means one slot is never in the
+  // semaphore; it still needs a maximum count of at least one.
+  semaphore_ = CreateSemaphoreA(NULL, parallelism - 1,
+                                parallelism > 1 ? parallelism - 1 : 1, name);
+  if (!semaphore_) {
+    *err = string("jobserver: CreateSemaphore: ") + GetLastErrorString();
+    return false;
+  }
+
+  string makeflags;
+  if (const char* old_makeflags = getenv("MAKEFLAGS"))
+    makeflags = string(old_makeflags) + " ";
+  char buf[128];
+  snprintf(buf, sizeof(buf), "-j%d --jobserver-auth=%s", parallelism, name);
+  makeflags += buf;
+  // _putenv also updates the environment block inherited by CreateProcess.
+  if (_putenv(("MAKEFLAGS=" + makeflags).c_str()) != 0) {
+    *err = "jobserver: could not set MAKEFLAGS";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// static
+bool JobserverConfig::ParseMakeFlags(const string& makeflags,
+                                     JobserverConfig* config) {
+  // GNU make 4.2 and later use --jobserver-auth, older versions
+  // --jobserver-fds.  If the option appears several times the last one
+  // wins, like in make itself.
+  static const char* const kPrefixes[] = {
+    "--jobserver-auth=", "--jobserver-fds="
+  };
+  string value;
+  size_t pos = 0;
+  while (pos < makeflags.size()) {
+    size_t end = makeflags.find_first_of(" \t", pos);
+    if (end == string::npos)
+      end = makeflags.size();
+    string word = makeflags.substr(pos, end - pos);
+    for (size_t i = 0; i < sizeof(kPrefixes) / sizeof(kPrefixes[0]); ++i) {
+      size_t len = strlen(kPrefixes[i]);
+      if (word.compare(0, len, kPrefixes[i]) == 0)
+        value = word.substr(len);
+    }
+    pos = end + 1;
+  }
+  if (value.empty())
+    return false;
+
+  *config = JobserverConfig();
+  if (value.compare(0, 5, "fifo:") == 0) {
+    config->mode = kModeFifo;
+    config->name = value.substr(5);
+    return !config->name.empty();
+  }
+
+  int read_fd, write_fd;
+  char trailing;
+  if (sscanf(value.c_str(), "%d,%d%c", &read_fd, &write_fd, &trailing) == 2) {
+    // make uses negative descriptors to say that no jobserver is available.
+    if (read_fd < 0 || write_fd < 0)
+      return false;
+    config->mode = kModePipe;
+    config->read_fd = read_fd;
+    config->write_fd = write_fd;
+    return true;
+  }
+
+  config->mode = kModeSemaphore;
+  config->name = value;
+  return true;
+}
@@ -0,0 +1,103 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <string>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/// A GNU make jobserver, as advertised to child processes through the
+/// MAKEFLAGS environment variable.
+struct JobserverConfig {
+  enum Mode {
+    kModeNone,
+    /// --jobserver-auth=R,W: an inherited anonymous pipe.
+    kModePipe,
+    /// --jobserver-auth=fifo:PATH: a named pipe (GNU make 4.4 and later).
+    kModeFifo,
+    /// --jobserver-auth=NAME: a named semaphore (Windows).
+    kModeSemaphore
+  };
+
+  JobserverConfig() : mode(kModeNone), read_fd(-1), write_fd(-1) {}
+
+  /// Extract the jobserver description from the value of MAKEFLAGS.
+  /// Returns false if it doesn't describe a jobserver.
+  static bool ParseMakeFlags(const string& makeflags, JobserverConfig* config);
+
+  Mode mode;
+  int read_fd;
+  int write_fd;
+  /// The fifo path or the semaphore name.
+  string name;
+};
+
+/// The client side of the jobserver protocol.  Every process in the tree
+/// owns one implicit token, which lets it run a single job; each further
+/// concurrent job needs a token taken from the jobserver, and the token
+/// must be given back as soon as that job finishes.
+struct JobserverClient {
+  JobserverClient();
+  ~JobserverClient();
+
+  /// Connect to the jobserver described by |config|.
+  /// Returns false and fills |err| if it can't be used.
+  bool Connect(const JobserverConfig& config, string* err);
+
+  bool connected() const;
+
+  /// Take a token from the jobserver without blocking.
+  /// Returns false if none is available right now.
+  bool TryAcquire();
+
+  /// Give back a token previously taken with TryAcquire().
+  void Release();
+
+ private:
+#ifdef _WIN32
+  HANDLE semaphore_;
+#else
+  int read_fd_;
+  int write_fd_;
+  /// The bytes read from the jobserver; the protocol requires writing back
+  /// the same ones.
+  string tokens_;
+#endif
+};
+
+/// The server side of the jobserver protocol: a pool of tokens, exported
+/// in MAKEFLAGS so that the commands ninja runs (and ninja itself, through
+/// a JobserverClient) all draw from the same budget.
+struct JobserverServer {
+  JobserverServer();
+  ~JobserverServer();
+
+  /// Create a jobserver allowing |parallelism| concurrent jobs and
+  /// advertise it in MAKEFLAGS.  Returns false and fills |err| on error.
+  bool Create(int parallelism, string* err);
+
+ private:
+#ifdef _WIN32
+  HANDLE semaphore_;
+#else
+  int fds_[2];
+#endif
+};
+
+#endif  // NINJA_JOBSERVER_H_
@@ -0,0 +1,134 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include "test.h"
+
+#ifndef _WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+TEST(JobserverTest, ParseMakeFlags) {
+  JobserverConfig config;
+  EXPECT_FALSE(JobserverConfig::ParseMakeFlags("", &config));
+  EXPECT_FALSE(JobserverConfig::ParseMakeFlags("-k -j4", &config));
+  EXPECT_FALSE(JobserverConfig::ParseMakeFlags("--jobserver-auth=-2,-2",
+                                               &config));
+
+  EXPECT_TRUE(JobserverConfig::ParseMakeFlags(
+      "kw -j4 --jobserver-auth=3,4 -- FOO=bar", &config));
+  EXPECT_EQ(JobserverConfig::kModePipe, config.mode);
+  EXPECT_EQ(3, config.read_fd);
+  EXPECT_EQ(4, config.write_fd);
+
+  // Older makes spell it --jobserver-fds, and the last one wins.
+  EXPECT_TRUE(JobserverConfig::ParseMakeFlags(
+      "--jobserver-auth=3,4 --jobserver-fds=5,6", &config));
+  EXPECT_EQ(JobserverConfig::kModePipe, config.mode);
+  EXPECT_EQ(5, config.read_fd);
+  EXPECT_EQ(6, config.write_fd);
+
+  EXPECT_TRUE(JobserverConfig::ParseMakeFlags(
+      "-j8 --jobserver-auth=fifo:/tmp/GMfifo123", &config));
+  EXPECT_EQ(JobserverConfig::kModeFifo, config.mode);
+  EXPECT_EQ("/tmp/GMfifo123", config.name);
+  EXPECT_EQ(-1, config.read_fd);
+
+  EXPECT_TRUE(JobserverConfig::ParseMakeFlags(
+      "-j8 --jobserver-auth=gmake_semaphore_42", &config));
+  EXPECT_EQ(JobserverConfig::kModeSemaphore, config.mode);
+  EXPECT_EQ("gmake_semaphore_42", config.name);
+}
+
+#ifndef _WIN32
+TEST(JobserverTest, ClientOnPipe) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(2, write(fds[1], "+-", 2));
+
+  JobserverConfig config;
+  config.mode = JobserverConfig::kModePipe;
+  config.read_fd = fds[0];
+  config.write_fd = fds[1];
+  {
+    JobserverClient client;
+    string err;
+    EXPECT_TRUE(client.Connect(config, &err));
+    EXPECT_EQ("", err);
+    EXPECT_TRUE(client.TryAcquire());
+    EXPECT_TRUE(client.TryAcquire());
+    EXPECT_FALSE(client.TryAcquire());
+    client.Release();
+    EXPECT_TRUE(client.TryAcquire());
+    // The destructor gives back the tokens still held.
+  }
+
+  // The same bytes come back.
+  char buf[3];
+  EXPECT_EQ(2, read(fds[0], buf, sizeof(buf)));
+  EXPECT_TRUE((buf[0] == '+' && buf[1] == '-') ||
+              (buf[0] == '-' && buf[1] == '+'));
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(JobserverTest, ClientOnClosedPipe) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  close(fds[0]);
+  close(fds[1]);
+
+  JobserverConfig config;
+  config.mode = JobserverConfig::kModePipe;
+  config.read_fd = fds[0];
+  config.write_fd = fds[1];
+  JobserverClient client;
+  string err;
+  EXPECT_FALSE(client.Connect(config, &err));
+  EXPECT_NE("", err);
+  EXPECT_FALSE(client.connected());
+}
+
+TEST(JobserverTest, Server) {
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  string saved = old_makeflags ? old_makeflags : "";
+  unsetenv("MAKEFLAGS");
+
+  {
+    JobserverServer server;
+    string err;
+    EXPECT_TRUE(server.Create(3, &err));
+    EXPECT_EQ("", err);
+
+    JobserverConfig config;
+    ASSERT_TRUE(getenv("MAKEFLAGS"));
+    EXPECT_TRUE(JobserverConfig::ParseMakeFlags(getenv("MAKEFLAGS"), &config));
+    EXPECT_EQ(JobserverConfig::kModePipe, config.mode);
+
+    // One of the three slots is the implicit token.
+    JobserverClient client;
+    EXPECT_TRUE(client.Connect(config, &err));
+    EXPECT_TRUE(client.TryAcquire());
+    EXPECT_TRUE(client.TryAcquire());
+    EXPECT_FALSE(client.TryAcquire());
+  }
+
+  if (old_makeflags)
+    setenv("MAKEFLAGS", saved.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+#endif  // _WIN32
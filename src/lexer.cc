@@ -17,10 +17,99 @@
 
 #include <stdio.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LEXER_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LEXER_NEON
+#endif
+
 #include "eval_env.h"
 #include "util.h"
 
-bool Lexer::Error(const string& message, string* err) {
+namespace {
+
+#if defined(LEXER_SSE2) || defined(LEXER_NEON)
+/// The index of the first of the 16 bytes at |p| that ends a run of literal
+/// text in an eval string, one of "$ :|\r\n" or a NUL; or 16.  Only a
+/// newline or a NUL if |line_end|.
+inline int FindSpecial(const char* p, bool line_end) {
+#ifdef LEXER_SSE2
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  if (!line_end) {
+    special = _mm_or_si128(
+        special,
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('$')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('|')))));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  }
+  unsigned mask = _mm_movemask_epi8(special);
+  if (!mask)
+    return 16;
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+#else
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+  uint8x16_t special = vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)),
+                                vceqq_u8(v, vdupq_n_u8('\n')));
+  if (!line_end) {
+    special = vorrq_u8(
+        special,
+        vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('$')),
+                          vceqq_u8(v, vdupq_n_u8(' '))),
+                 vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                          vceqq_u8(v, vdupq_n_u8('|')))));
+    special = vorrq_u8(special, vceqq_u8(v, vdupq_n_u8('\r')));
+  }
+  // Narrow to four bits per byte to find the first special one.
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(special), 4);
+  uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+  if (!mask)
+    return 16;
+  return __builtin_ctzll(mask) >> 2;
+#endif
+}
+#endif
+
+/// The first byte from |p| on that FindSpecial() would find, or |end|.
+inline const char* SkipToSpecial(const char* p, const char* end,
+                                 bool line_end) {
+#if defined(LEXER_SSE2) || defined(LEXER_NEON)
+  while (end - p >= 16) {
+    int skip = FindSpecial(p, line_end);
+    p += skip;
+    if (skip < 16)
+      return p;
+  }
+#endif
+  for (; p < end; ++p) {
+    char c = *p;
+    if (c == '\n' || c == '\0')
+      return p;
+    if (!line_end &&
+        (c == '$' || c == ' ' || c == ':' || c == '|' || c == '\r'))
+      return p;
+  }
+  return p;
+}
+
+}  // namespace
+
+bool Lexer::Error(const string& message, string* err) const {
   // Compute line/column.
   int line = 1;
   const char* line_start = input_.str_;
@@ -120,6 +209,18 @@ Lexer::Token Lexer::ReadToken() {
   const char* start;
   Lexer::Token token;
   for (;;) {
+    // Comments can be long; find where they end many bytes at a time.
+    const char* comment = p;
+    while (*comment == ' ')
+      ++comment;
+    if (*comment == '#') {
+      const char* eol = SkipToSpecial(comment, input_.str_ + input_.len_,
+                                      true);
+      if (*eol == '\n') {
+        p = eol + 1;
+        continue;
+      }
+    }
     start = p;
     
 {
@@ -622,7 +723,15 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
   const char* p = ofs_;
   const char* q;
   const char* start;
+  const char* end = input_.str_ + input_.len_;
   for (;;) {
+    // Manifests are mostly long runs of literal text; find where this one
+    // ends many bytes at a time, rather than with the rules below.
+    const char* text_end = SkipToSpecial(p, end, false);
+    if (text_end != p) {
+      eval->AddText(StringPiece(p, text_end - p));
+      p = text_end;
+    }
     start = p;
     
 {
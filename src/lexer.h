@@ -87,7 +87,7 @@ struct Lexer {
   }
 
   /// Construct an error message with context.
-  bool Error(const string& message, string* err);
+  bool Error(const string& message, string* err) const;
 
 private:
   /// Skip past whitespace (called after each read token/ident/etc.).
@@ -37,6 +37,43 @@ TEST(Lexer, ReadEvalStringEscapes) {
             eval.Serialize());
 }
 
+TEST(Lexer, LongRuns) {
+  // Literal text is skipped 16 bytes at a time; put what ends it on either
+  // side of the blocks' edges.
+  for (size_t n = 0; n < 40; ++n) {
+    string text(n, 'a');
+    string input = "# " + text + "\n"
+                   "build " + text + "x|" + text + "y: r " + text + "$ z\n"
+                   "  v = " + text + "$:$$|" + text + "\n";
+    Lexer lexer(input.c_str());
+    string err;
+    ASSERT_EQ(Lexer::BUILD, lexer.ReadToken());
+    EvalString eval;
+    EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+    EXPECT_EQ("[" + text + "x]", eval.Serialize());
+    ASSERT_EQ(Lexer::PIPE, lexer.ReadToken());
+    eval.Clear();
+    EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+    EXPECT_EQ("[" + text + "y]", eval.Serialize());
+    ASSERT_EQ(Lexer::COLON, lexer.ReadToken());
+    string ident;
+    EXPECT_TRUE(lexer.ReadIdent(&ident));
+    EXPECT_EQ("r", ident);
+    eval.Clear();
+    EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+    EXPECT_EQ("[" + text + " z]", eval.Serialize());
+    ASSERT_EQ(Lexer::NEWLINE, lexer.ReadToken());
+    ASSERT_EQ(Lexer::INDENT, lexer.ReadToken());
+    EXPECT_TRUE(lexer.ReadIdent(&ident));
+    ASSERT_EQ(Lexer::EQUALS, lexer.ReadToken());
+    eval.Clear();
+    EXPECT_TRUE(lexer.ReadVarValue(&eval, &err));
+    EXPECT_EQ("[" + text + ":$|" + text + "]", eval.Serialize());
+    EXPECT_EQ("", err);
+    ASSERT_EQ(Lexer::TEOF, lexer.ReadToken());
+  }
+}
+
 TEST(Lexer, ReadIdent) {
   Lexer lexer("foo baR baz_123 foo-bar");
   string ident;
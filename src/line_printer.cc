@@ -27,7 +27,8 @@
 
 #include "util.h"
 
-LinePrinter::LinePrinter() : have_blank_line_(true), console_locked_(false) {
+LinePrinter::LinePrinter()
+    : have_blank_line_(true), extra_lines_(0), console_locked_(false) {
 #ifndef _WIN32
   const char* term = getenv("TERM");
   smart_terminal_ = isatty(1) && term && string(term) != "dumb";
@@ -91,7 +92,12 @@ void LinePrinter::Print(string to_print, LineType type) {
       to_print = ElideMiddle(to_print, size.ws_col);
     }
     printf("%s", to_print.c_str());
-    printf("\x1B[K");  // Clear to end of line.
+    if (extra_lines_) {
+      printf("\x1B[J");  // Clear to end of screen, with the lines below.
+      extra_lines_ = 0;
+    } else {
+      printf("\x1B[K");  // Clear to end of line.
+    }
     fflush(stdout);
 #endif
 
@@ -101,6 +107,42 @@ void LinePrinter::Print(string to_print, LineType type) {
   }
 }
 
+void LinePrinter::PrintWithExtraLines(const string& to_print,
+                                      const vector<string>& extra) {
+#ifndef _WIN32
+  if (smart_terminal_ && !console_locked_ && !extra.empty()) {
+    size_t width = 0;
+    winsize size;
+    if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) && size.ws_col)
+      width = size.ws_col;
+
+    // Write the whole frame at once, so that it doesn't flicker.
+    string frame = "\r";
+    frame += width ? ElideMiddle(to_print, width) : to_print;
+    frame += "\x1B[K";
+    for (vector<string>::const_iterator i = extra.begin(); i != extra.end();
+         ++i) {
+      frame += "\n";
+      frame += width ? ElideMiddle(*i, width) : *i;
+      frame += "\x1B[K";
+    }
+    // Clear what's left of a taller frame, and go back up to the current
+    // line.  Print() starts with a carriage return and PrintOnNewLine()
+    // with a newline, so the column doesn't matter.
+    char up[32];
+    snprintf(up, sizeof(up), "\x1B[J\x1B[%dA", (int)extra.size());
+    frame += up;
+    fwrite(frame.data(), 1, frame.size(), stdout);
+    fflush(stdout);
+
+    extra_lines_ = extra.size();
+    have_blank_line_ = false;
+    return;
+  }
+#endif
+  Print(to_print, ELIDE);
+}
+
 void LinePrinter::PrintOrBuffer(const char* data, size_t size) {
   if (console_locked_) {
     output_buffer_.append(data, size);
@@ -120,6 +162,11 @@ void LinePrinter::PrintOnNewLine(const string& to_print) {
   if (!have_blank_line_) {
     PrintOrBuffer("\n", 1);
   }
+  if (extra_lines_ && !console_locked_) {
+    // The newline went down to the first of the lines below; clear them.
+    PrintOrBuffer("\x1B[J", 3);
+    extra_lines_ = 0;
+  }
   if (!to_print.empty()) {
     PrintOrBuffer(&to_print[0], to_print.size());
   }
@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 #include <string>
+#include <vector>
 using namespace std;
 
 /// Prints lines of text, possibly overprinting previously printed lines
@@ -37,6 +38,13 @@ struct LinePrinter {
   /// one line.
   void Print(string to_print, LineType type);
 
+  /// Overprints the current line like Print() with ELIDE, and shows |extra|
+  /// on the lines below it, each elided to fit, in place of what was shown
+  /// there before.  Other output clears those lines first.  Terminals that
+  /// can't overprint, and the Windows console, only get the current line.
+  void PrintWithExtraLines(const string& to_print,
+                           const vector<string>& extra);
+
   /// Prints a string on a new line, not overprinting previous output.
   void PrintOnNewLine(const string& to_print);
 
@@ -54,6 +62,9 @@ struct LinePrinter {
   /// Whether the caret is at the beginning of a blank line.
   bool have_blank_line_;
 
+  /// The number of lines shown below the current line.
+  size_t extra_lines_;
+
   /// Whether console is locked.
   bool console_locked_;
 
@@ -0,0 +1,194 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log_writer.h"
+
+#include <assert.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>  // _commit
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+
+LogWriter::LogWriter()
+    : file_(NULL), pending_records_(0), stopping_(false), error_(0) {
+#ifdef _WIN32
+  InitializeCriticalSection(&lock_);
+  wake_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!wake_)
+    Win32Fatal("CreateEvent");
+#else
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&wake_, NULL);
+#endif
+}
+
+LogWriter::~LogWriter() {
+  Stop();
+#ifdef _WIN32
+  CloseHandle(wake_);
+  DeleteCriticalSection(&lock_);
+#else
+  pthread_cond_destroy(&wake_);
+  pthread_mutex_destroy(&lock_);
+#endif
+}
+
+void LogWriter::Start(FILE* file, const LogCommitPolicy& policy) {
+  assert(!file_);
+  file_ = file;
+  policy_ = policy;
+  stopping_ = false;
+  error_ = 0;
+  // Without a thread, Append() commits each record itself.
+  if (policy_.max_records > 1)
+    thread_.Start(RunThread, this);
+}
+
+bool LogWriter::Append(const string& record) {
+  if (!thread_.started()) {
+    int error = Commit(record);
+    if (error)
+      errno = error;
+    return error == 0;
+  }
+
+  Lock();
+  int error = error_;
+  bool was_empty = pending_.empty();
+  pending_ += record;
+  ++pending_records_;
+  // The thread waits for a first record, then for enough of them.
+  if (was_empty || pending_records_ == policy_.max_records)
+    Signal();
+  Unlock();
+  if (error)
+    errno = error;
+  return error == 0;
+}
+
+bool LogWriter::Stop() {
+  if (!file_)
+    return true;
+  if (thread_.started()) {
+    Lock();
+    stopping_ = true;
+    Signal();
+    Unlock();
+    thread_.Join();
+  }
+  if (policy_.sync && !error_) {
+    METRIC_RECORD("log sync");
+#ifdef _WIN32
+    if (_commit(_fileno(file_)) != 0)
+#else
+    if (fsync(fileno(file_)) != 0)
+#endif
+      error_ = errno;
+  }
+  file_ = NULL;
+  if (error_)
+    errno = error_;
+  return error_ == 0;
+}
+
+// static
+void LogWriter::RunThread(void* writer) {
+  static_cast<LogWriter*>(writer)->Run();
+}
+
+void LogWriter::Run() {
+  string writing;
+  Lock();
+  for (;;) {
+    if (pending_.empty()) {
+      if (stopping_)
+        break;
+      Wait(0);
+      continue;
+    }
+    // Let more records join this commit, up to a point.
+    if (!stopping_ && pending_records_ < policy_.max_records)
+      Wait(policy_.max_delay_ms);
+    writing.swap(pending_);
+    pending_records_ = 0;
+    Unlock();
+    int error = Commit(writing);
+    writing.clear();
+    Lock();
+    if (error && !error_)
+      error_ = error;
+  }
+  Unlock();
+}
+
+int LogWriter::Commit(const string& data) {
+  if (fwrite(data.data(), 1, data.size(), file_) != data.size() ||
+      fflush(file_) != 0) {
+    return errno ? errno : EIO;
+  }
+  return 0;
+}
+
+#ifdef _WIN32
+void LogWriter::Lock() {
+  EnterCriticalSection(&lock_);
+}
+
+void LogWriter::Unlock() {
+  LeaveCriticalSection(&lock_);
+}
+
+void LogWriter::Wait(int timeout_ms) {
+  // An auto-reset event remembers a Signal() made before the wait.
+  LeaveCriticalSection(&lock_);
+  WaitForSingleObject(wake_, timeout_ms > 0 ? timeout_ms : INFINITE);
+  EnterCriticalSection(&lock_);
+}
+
+void LogWriter::Signal() {
+  SetEvent(wake_);
+}
+#else
+void LogWriter::Lock() {
+  pthread_mutex_lock(&lock_);
+}
+
+void LogWriter::Unlock() {
+  pthread_mutex_unlock(&lock_);
+}
+
+void LogWriter::Wait(int timeout_ms) {
+  if (timeout_ms <= 0) {
+    pthread_cond_wait(&wake_, &lock_);
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  long long usec = now.tv_usec + timeout_ms * 1000LL;
+  struct timespec deadline;
+  deadline.tv_sec = now.tv_sec + usec / 1000000;
+  deadline.tv_nsec = (usec % 1000000) * 1000;
+  pthread_cond_timedwait(&wake_, &lock_, &deadline);
+}
+
+void LogWriter::Signal() {
+  pthread_cond_signal(&wake_);
+}
+#endif
@@ -0,0 +1,99 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_LOG_WRITER_H_
+#define NINJA_LOG_WRITER_H_
+
+#include <stdio.h>
+
+#include <string>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "util.h"
+
+/// How often a log commits what it records to disk.  Records not committed
+/// yet are lost if ninja crashes, which only means that the commands they
+/// are about run again.
+struct LogCommitPolicy {
+  LogCommitPolicy() : max_records(1), max_delay_ms(0), sync(false) {}
+
+  /// Commit once this many records are waiting, or |max_delay_ms| after
+  /// the first of them, whichever comes first.  One commits each record as
+  /// it comes, without a thread.
+  int max_records;
+  int max_delay_ms;
+  /// Whether to fsync() the log when closing it.
+  bool sync;
+};
+
+/// Appends the records of a log to its file from a thread of its own, so
+/// that the build doesn't wait on the filesystem for each of them.
+struct LogWriter {
+  LogWriter();
+  ~LogWriter();
+
+  /// Start appending to |file|, which stays owned by the caller.
+  void Start(FILE* file, const LogCommitPolicy& policy);
+
+  /// Whether Start() was called since the last Stop().
+  bool started() const { return file_ != NULL; }
+
+  /// Queue |record| to be written.  Returns false and sets errno if an
+  /// earlier commit failed, or if a record committed right away did.
+  bool Append(const string& record);
+
+  /// Commit everything queued, sync if the policy says so, and stop.
+  /// Returns false and sets errno if any commit failed.
+  bool Stop();
+
+ private:
+  static void RunThread(void* writer);
+  void Run();
+  /// Write out |data|; returns the errno of a failure, or 0.
+  int Commit(const string& data);
+
+  void Lock();
+  void Unlock();
+  /// Wait for Append() or Stop() to signal, up to |timeout_ms| if it is
+  /// positive.  The lock must be held.
+  void Wait(int timeout_ms);
+  void Signal();
+
+  FILE* file_;
+  LogCommitPolicy policy_;
+  Thread thread_;
+
+  /// The state shared with the thread, under the lock.
+  string pending_;
+  int pending_records_;
+  bool stopping_;
+  /// The errno of the first failed commit.
+  int error_;
+
+#ifdef _WIN32
+  CRITICAL_SECTION lock_;
+  HANDLE wake_;
+#else
+  pthread_mutex_t lock_;
+  pthread_cond_t wake_;
+#endif
+};
+
+#endif  // NINJA_LOG_WRITER_H_
@@ -0,0 +1,532 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#elif defined(_MSC_VER) && (_MSC_VER < 1900)
+typedef __int32 int32_t;
+typedef unsigned __int32 uint32_t;
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "metrics.h"
+#include "stat_audit.h"
+#include "state.h"
+#include "util.h"
+#include "version.h"
+
+namespace {
+
+// The version is stored as 4 bytes after the signature and also serves as a
+// byte order mark.
+const char kFileSignature[] = "# ninjagraph\n";
+const uint32_t kCurrentVersion = 5;
+
+// Stands for a missing index: the parent of the root scope, and the rule of
+// phony edges, which every State has already.
+const uint32_t kNone = 0xffffffff;
+
+void WriteU32(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteU64(string* out, uint64_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(string* out, const string& value) {
+  WriteU32(out, value.size());
+  out->append(value);
+}
+
+/// Reads back what the Write functions wrote, remembering in |ok_| whether
+/// everything was within the data.
+struct Reader {
+  explicit Reader(const string& data)
+      : p_(data.data()), end_(data.data() + data.size()), ok_(true) {}
+
+  void Read(void* value, size_t size) {
+    if (static_cast<size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return;
+    }
+    memcpy(value, p_, size);
+    p_ += size;
+  }
+
+  uint32_t U32() {
+    uint32_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  uint64_t U64() {
+    uint64_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  void String(string* value) {
+    uint32_t size = U32();
+    if (!ok_ || static_cast<size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return;
+    }
+    value->assign(p_, size);
+    p_ += size;
+  }
+
+  /// Like String(), but pointing into the data.
+  StringPiece Piece() {
+    uint32_t size = U32();
+    if (!ok_ || static_cast<size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return StringPiece();
+    }
+    StringPiece value(p_, size);
+    p_ += size;
+    return value;
+  }
+
+  /// Read the number of items that follow, which take at least |item_size|
+  /// bytes each.  Checking it first keeps corrupt counts from allocating.
+  uint32_t Count(size_t item_size) {
+    uint32_t count = U32();
+    if (count > static_cast<size_t>(end_ - p_) / item_size) {
+      ok_ = false;
+      return 0;
+    }
+    return count;
+  }
+
+  const char* p_;
+  const char* end_;
+  bool ok_;
+};
+
+}  // anonymous namespace
+
+FileReader::Status RecordingFileReader::ReadFile(const string& path,
+                                                string* contents,
+                                                string* err) {
+  string stat_err;
+  StatAudit::Scope audit(StatAudit::kManifest);
+  files_.push_back(ManifestFile(path, disk_interface_->Stat(path, &stat_err)));
+  return disk_interface_->ReadFile(path, contents, err);
+}
+
+bool RecordingFileReader::MapFile(const string& path, MappedFile* file) {
+  string stat_err;
+  TimeStamp mtime;
+  {
+    StatAudit::Scope audit(StatAudit::kManifest);
+    mtime = disk_interface_->Stat(path, &stat_err);
+  }
+  // If the file can't be mapped, ReadFile() records it instead.
+  if (!disk_interface_->MapFile(path, file))
+    return false;
+  files_.push_back(ManifestFile(path, mtime));
+  return true;
+}
+
+bool ManifestCache::Save(const string& path, const string& key,
+                         const State& state, const vector<ManifestFile>& files,
+                         string* err) {
+  METRIC_RECORD(".ninja_graph save");
+  string out(kFileSignature, sizeof(kFileSignature) - 1);
+  WriteU32(&out, kCurrentVersion);
+  WriteString(&out, kNinjaVersion);
+  WriteString(&out, key);
+  WriteU32(&out, files.size());
+  for (vector<ManifestFile>::const_iterator i = files.begin();
+       i != files.end(); ++i) {
+    WriteString(&out, i->path);
+    WriteU64(&out, i->mtime);
+  }
+
+  // Pools, apart from the built-in ones that every State has.
+  map<const Pool*, uint32_t> pool_ids;
+  pool_ids[&State::kDefaultPool] = 0;
+  pool_ids[&State::kConsolePool] = 1;
+  WriteU32(&out, state.pools_.size() - pool_ids.size());
+  for (map<string, Pool*>::const_iterator i = state.pools_.begin();
+       i != state.pools_.end(); ++i) {
+    if (pool_ids.count(i->second))
+      continue;
+    uint32_t id = pool_ids.size();
+    pool_ids[i->second] = id;
+    WriteString(&out, i->second->name());
+    WriteU32(&out, i->second->depth());
+    WriteU32(&out, i->second->remote());
+    WriteU32(&out, i->second->shared());
+    const vector<int>& cpus = i->second->cpus();
+    WriteU32(&out, cpus.size());
+    for (vector<int>::const_iterator c = cpus.begin(); c != cpus.end(); ++c)
+      WriteU32(&out, *c);
+  }
+
+  // Scopes, parents first, starting with the State's own.
+  vector<const BindingEnv*> envs(1, &state.bindings_);
+  map<const BindingEnv*, uint32_t> env_ids;
+  env_ids[&state.bindings_] = 0;
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    vector<const BindingEnv*> chain;
+    for (const BindingEnv* env = (*e)->env_; env && !env_ids.count(env);
+         env = env->parent_) {
+      chain.push_back(env);
+    }
+    for (vector<const BindingEnv*>::reverse_iterator env = chain.rbegin();
+         env != chain.rend(); ++env) {
+      env_ids[*env] = envs.size();
+      envs.push_back(*env);
+    }
+  }
+  // A rule that scopes share, e.g. from a file they all include, is written
+  // with each; its edges refer to the last copy.
+  map<const Rule*, uint32_t> rule_ids;
+  rule_ids[&State::kPhonyRule] = kNone;
+  uint32_t rules_written = 0;
+  WriteU32(&out, envs.size());
+  for (vector<const BindingEnv*>::iterator i = envs.begin(); i != envs.end();
+       ++i) {
+    const BindingEnv* env = *i;
+    WriteU32(&out, env->parent_ ? env_ids[env->parent_] : kNone);
+    WriteU32(&out, env->bindings_.size());
+    const vector<VarTable<string>::Slot>& slots = env->bindings_.slots();
+    for (vector<VarTable<string>::Slot>::const_iterator b = slots.begin();
+         b != slots.end(); ++b) {
+      if (b->first < 0)
+        continue;
+      WriteString(&out, VarNames::Name(b->first));
+      WriteString(&out, b->second);
+    }
+    uint32_t rule_count = 0;
+    for (map<string, const Rule*>::const_iterator r = env->rules_.begin();
+         r != env->rules_.end(); ++r) {
+      rule_count += r->second != &State::kPhonyRule;
+    }
+    WriteU32(&out, rule_count);
+    for (map<string, const Rule*>::const_iterator r = env->rules_.begin();
+         r != env->rules_.end(); ++r) {
+      const Rule* rule = r->second;
+      if (rule == &State::kPhonyRule)
+        continue;
+      rule_ids[rule] = rules_written++;
+      WriteString(&out, rule->name());
+      WriteU32(&out, rule->bindings_.size());
+      const vector<Rule::Bindings::Slot>& slots = rule->bindings_.slots();
+      for (vector<Rule::Bindings::Slot>::const_iterator b = slots.begin();
+           b != slots.end(); ++b) {
+        if (b->first < 0)
+          continue;
+        WriteString(&out, VarNames::Name(b->first));
+        const EvalString::TokenList& tokens = b->second.parsed_;
+        WriteU32(&out, tokens.size());
+        for (EvalString::TokenList::const_iterator t = tokens.begin();
+             t != tokens.end(); ++t) {
+          WriteU32(&out, t->type);
+          WriteString(&out, t->text.AsString());
+        }
+      }
+    }
+  }
+
+  map<const Node*, uint32_t> node_ids;
+  WriteU32(&out, state.paths_.size());
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    uint32_t id = node_ids.size();
+    node_ids[i->second] = id;
+    WriteString(&out, i->second->path().AsString());
+    WriteU64(&out, i->second->slash_bits());
+  }
+
+  WriteU32(&out, state.edges_.size());
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    const Edge* edge = *e;
+    map<const Rule*, uint32_t>::iterator rule = rule_ids.find(edge->rule_);
+    if (rule == rule_ids.end()) {
+      *err = "rule '" + edge->rule_->name() + "' isn't in scope";
+      return false;
+    }
+    WriteU32(&out, rule->second);
+    WriteU32(&out, pool_ids[edge->pool_]);
+    WriteU32(&out, env_ids[edge->env_]);
+    WriteU32(&out, edge->weight_);
+    WriteU32(&out, static_cast<uint32_t>(edge->priority_));
+    WriteU32(&out, edge->implicit_deps_);
+    WriteU32(&out, edge->order_only_deps_);
+    WriteU32(&out, edge->implicit_outs_);
+    WriteU32(&out, edge->dyndep_ ? node_ids[edge->dyndep_] : kNone);
+    WriteU32(&out, edge->inputs_.size());
+    for (vector<Node*>::const_iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      WriteU32(&out, node_ids[*i]);
+    }
+    WriteU32(&out, edge->outputs_.size());
+    for (vector<Node*>::const_iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      WriteU32(&out, node_ids[*o]);
+    }
+  }
+
+  WriteU32(&out, state.defaults_.size());
+  for (vector<Node*>::const_iterator i = state.defaults_.begin();
+       i != state.defaults_.end(); ++i) {
+    WriteU32(&out, node_ids[*i]);
+  }
+
+  // Write a temporary file first, so that the cache is never seen half
+  // written.
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(out.data(), 1, out.size(), f) < out.size()) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  // rename() doesn't replace existing files on Windows.
+  unlink(path.c_str());
+#endif
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+ManifestCache::LoadStatus ManifestCache::Load(const string& path,
+                                              const string& key,
+                                              DiskInterface* disk_interface,
+                                              State* state,
+                                              vector<ManifestFile>* files,
+                                              string* err) {
+  METRIC_RECORD(".ninja_graph load");
+  string data;
+  string read_err;
+  if (::ReadFile(path, &data, &read_err) < 0)
+    return LOAD_STALE;
+
+  const size_t kSignatureSize = sizeof(kFileSignature) - 1;
+  if (data.compare(0, kSignatureSize, kFileSignature) != 0)
+    return LOAD_STALE;
+  Reader in(data);
+  in.p_ += kSignatureSize;
+  if (in.U32() != kCurrentVersion)
+    return LOAD_STALE;
+  string version, saved_key;
+  in.String(&version);
+  in.String(&saved_key);
+  if (!in.ok_ || version != kNinjaVersion || saved_key != key)
+    return LOAD_STALE;
+
+  vector<ManifestFile> saved_files;
+  for (uint32_t count = in.Count(12); count > 0 && in.ok_; --count) {
+    string file_path;
+    in.String(&file_path);
+    TimeStamp mtime = in.U64();
+    saved_files.push_back(ManifestFile(file_path, mtime));
+  }
+  if (!in.ok_ || saved_files.empty())
+    return LOAD_STALE;
+  StatAudit::Scope audit(StatAudit::kManifest);
+  for (vector<ManifestFile>::iterator i = saved_files.begin();
+       i != saved_files.end(); ++i) {
+    string stat_err;
+    if (disk_interface->Stat(i->path, &stat_err) != i->mtime)
+      return LOAD_STALE;
+  }
+
+  // The cache is valid; from here on, reading it changes |state|.
+  files->swap(saved_files);
+
+  vector<Pool*> pools;
+  pools.push_back(&State::kDefaultPool);
+  pools.push_back(&State::kConsolePool);
+  for (uint32_t count = in.Count(8); count > 0 && in.ok_; --count) {
+    string name;
+    in.String(&name);
+    int depth = in.U32();
+    bool remote = in.U32() != 0;
+    bool shared = in.U32() != 0;
+    vector<int> cpus;
+    for (uint32_t n = in.Count(4); n > 0 && in.ok_; --n)
+      cpus.push_back(in.U32());
+    if (!in.ok_ || state->LookupPool(name)) {
+      in.ok_ = false;
+      break;
+    }
+    pools.push_back(new Pool(name, depth));
+    pools.back()->set_remote(remote);
+    pools.back()->set_cpus(cpus);
+    pools.back()->set_shared(shared);
+    state->AddPool(pools.back());
+  }
+
+  vector<BindingEnv*> envs;
+  vector<const Rule*> rules;
+  for (uint32_t count = in.Count(12); count > 0 && in.ok_; --count) {
+    uint32_t parent = in.U32();
+    BindingEnv* env;
+    if (envs.empty())
+      env = &state->bindings_;
+    else if (parent == kNone)
+      env = new BindingEnv;
+    else if (parent < envs.size())
+      env = new BindingEnv(envs[parent]);
+    else
+      in.ok_ = false;
+    if (!in.ok_)
+      break;
+    envs.push_back(env);
+
+    for (uint32_t n = in.Count(8); n > 0 && in.ok_; --n) {
+      string name;
+      in.String(&name);
+      in.String(&env->bindings_[VarNames::Intern(name)]);
+    }
+    for (uint32_t n = in.Count(8); n > 0 && in.ok_; --n) {
+      string name;
+      in.String(&name);
+      Rule* rule = new Rule(name);
+      for (uint32_t b = in.Count(8); b > 0 && in.ok_; --b) {
+        string binding;
+        in.String(&binding);
+        EvalString& value = rule->bindings_[VarNames::Intern(binding)];
+        for (uint32_t t = in.Count(8); t > 0 && in.ok_; --t) {
+          uint32_t type = in.U32();
+          if (type != EvalString::RAW && type != EvalString::SPECIAL)
+            in.ok_ = false;
+          value.parsed_.push_back(
+              EvalString::Token(in.Piece(), EvalString::TokenType(type)));
+        }
+        // The tokens point into |data| until then.
+        value.OwnText();
+      }
+      env->rules_[name] = rule;
+      rules.push_back(rule);
+    }
+  }
+  if (envs.empty())
+    in.ok_ = false;
+
+  vector<Node*> nodes;
+  uint32_t node_count = in.Count(12);
+  nodes.reserve(node_count);
+  for (; node_count > 0 && in.ok_; --node_count) {
+    string node_path;
+    in.String(&node_path);
+    uint64_t slash_bits = in.U64();
+    nodes.push_back(state->GetNode(node_path, slash_bits));
+  }
+
+  uint32_t edge_count = in.Count(44);
+  state->edges_.reserve(edge_count);
+  for (; edge_count > 0 && in.ok_; --edge_count) {
+    uint32_t rule_id = in.U32();
+    uint32_t pool_id = in.U32();
+    uint32_t env_id = in.U32();
+    uint32_t weight = in.U32();
+    int priority = static_cast<int>(in.U32());
+    uint32_t implicit_deps = in.U32();
+    uint32_t order_only_deps = in.U32();
+    uint32_t implicit_outs = in.U32();
+    uint32_t dyndep_id = in.U32();
+    const Rule* rule = rule_id == kNone ? &State::kPhonyRule :
+        rule_id < rules.size() ? rules[rule_id] : NULL;
+    if (!in.ok_ || !rule || pool_id >= pools.size() ||
+        env_id >= envs.size() ||
+        (dyndep_id != kNone && dyndep_id >= nodes.size())) {
+      in.ok_ = false;
+      break;
+    }
+
+    Edge* edge = state->AddEdge(rule);
+    edge->pool_ = pools[pool_id];
+    edge->env_ = envs[env_id];
+    edge->weight_ = weight;
+    edge->priority_ = priority;
+    edge->scheduling_priority_ = priority;
+    if (dyndep_id != kNone) {
+      edge->dyndep_ = nodes[dyndep_id];
+      edge->dyndep_->set_dyndep_pending(true);
+    }
+    uint32_t count = in.Count(4);
+    edge->inputs_.reserve(count);
+    for (; count > 0 && in.ok_; --count) {
+      uint32_t id = in.U32();
+      if (id >= nodes.size()) {
+        in.ok_ = false;
+        break;
+      }
+      edge->inputs_.push_back(nodes[id]);
+      nodes[id]->AddOutEdge(edge);
+    }
+    count = in.Count(4);
+    edge->outputs_.reserve(count);
+    for (; count > 0 && in.ok_; --count) {
+      uint32_t id = in.U32();
+      if (id >= nodes.size()) {
+        in.ok_ = false;
+        break;
+      }
+      edge->outputs_.push_back(nodes[id]);
+      nodes[id]->set_in_edge(edge);
+    }
+    if (edge->outputs_.empty() ||
+        implicit_deps + order_only_deps > edge->inputs_.size() ||
+        implicit_outs > edge->outputs_.size()) {
+      in.ok_ = false;
+    }
+    edge->implicit_deps_ = implicit_deps;
+    edge->order_only_deps_ = order_only_deps;
+    edge->implicit_outs_ = implicit_outs;
+  }
+  if (edge_count > 0)
+    in.ok_ = false;
+
+  for (uint32_t count = in.Count(4); count > 0 && in.ok_; --count) {
+    uint32_t id = in.U32();
+    if (id >= nodes.size())
+      in.ok_ = false;
+    else
+      state->defaults_.push_back(nodes[id]);
+  }
+
+  if (!in.ok_ || in.p_ != in.end_) {
+    *err = "premature end of file or corrupt data";
+    return LOAD_ERROR;
+  }
+  return LOAD_SUCCESS;
+}
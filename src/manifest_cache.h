@@ -0,0 +1,78 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_CACHE_H_
+#define NINJA_MANIFEST_CACHE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "timestamp.h"
+
+struct State;
+
+/// A file that the manifest was loaded from, with its mtime from before it
+/// was read.
+struct ManifestFile {
+  ManifestFile(const string& path, TimeStamp mtime)
+      : path(path), mtime(mtime) {}
+  string path;
+  TimeStamp mtime;
+};
+
+/// Remembers the files read while loading the manifest, with their mtimes
+/// from before reading them, so that the manifest cache and --watch know
+/// when to load it again.
+struct RecordingFileReader : public FileReader {
+  explicit RecordingFileReader(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+
+  virtual Status ReadFile(const string& path, string* contents, string* err);
+  virtual bool MapFile(const string& path, MappedFile* file);
+
+  DiskInterface* disk_interface_;
+  vector<ManifestFile> files_;
+};
+
+/// Saves the graph that loading the manifest produced to a binary file, and
+/// restores it without lexing or evaluating anything for as long as none of
+/// the manifest files change.  The file holds the pools, the scopes with
+/// their bindings and tokenized rules, the nodes, the edges and the
+/// defaults, each referring to the earlier ones by index.
+struct ManifestCache {
+  /// Write the graph in |state| to |path|.  It was loaded from |files|,
+  /// with the parser options summed up in |key|.
+  static bool Save(const string& path, const string& key, const State& state,
+                   const vector<ManifestFile>& files, string* err);
+
+  enum LoadStatus {
+    LOAD_ERROR,
+    LOAD_STALE,
+    LOAD_SUCCESS
+  };
+
+  /// Restore the graph saved in |path| into |state|, which must be fresh,
+  /// and store the manifest files it came from in |files|.  Returns
+  /// LOAD_STALE, without touching |state|, if there's no cache, if it was
+  /// saved with a different |key| or ninja version, or if the mtime of one
+  /// of its files changed.  Returns LOAD_ERROR and fills |err| if the cache
+  /// turned out to be corrupt after |state| was partially filled.
+  static LoadStatus Load(const string& path, const string& key,
+                         DiskInterface* disk_interface, State* state,
+                         vector<ManifestFile>* files, string* err);
+};
+
+#endif  // NINJA_MANIFEST_CACHE_H_
@@ -0,0 +1,232 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+const char kTestFilename[] = "ManifestCacheTest-tempfile";
+
+struct ManifestCacheTest : public testing::Test {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+
+    fs_.Create("build.ninja",
+"pool link\n"
+"  depth = 2\n"
+"  remote = 0\n"
+"cflags = -O2\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  depfile = $out.d\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  cflags = -g\n"
+"build gen: phony\n"
+"subninja sub.ninja\n"
+"default a.o\n");
+    fs_.Create("sub.ninja",
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"build b.o: cc b.c || b.dd\n"
+"  dyndep = b.dd\n"
+"build out | out.map: link a.o b.o\n"
+"  weight = 2\n"
+"  priority = -3\n");
+    ManifestParser parser(&state_, &fs_);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+    ASSERT_EQ("", err);
+    for (vector<string>::iterator i = fs_.files_read_.begin();
+         i != fs_.files_read_.end(); ++i) {
+      files_.push_back(ManifestFile(*i, fs_.Stat(*i, &err)));
+    }
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  State state_;
+  VirtualFileSystem fs_;
+  vector<ManifestFile> files_;
+};
+
+TEST_F(ManifestCacheTest, RoundTrip) {
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kTestFilename, "key", state_, files_, &err));
+  ASSERT_EQ("", err);
+
+  State state;
+  vector<ManifestFile> files;
+  EXPECT_EQ(ManifestCache::LOAD_SUCCESS,
+            ManifestCache::Load(kTestFilename, "key", &fs_, &state, &files,
+                                &err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, files.size());
+  EXPECT_EQ("build.ninja", files[0].path);
+  EXPECT_EQ("sub.ninja", files[1].path);
+
+  EXPECT_EQ("-O2", state.bindings_.LookupVariable("cflags"));
+  ASSERT_TRUE(state.LookupPool("link"));
+  EXPECT_FALSE(state.LookupPool("link")->remote());
+  EXPECT_EQ(state_.paths_.size(), state.paths_.size());
+  ASSERT_EQ(state_.edges_.size(), state.edges_.size());
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    Edge* expected = state_.edges_[i];
+    Edge* edge = state.edges_[i];
+    EXPECT_EQ(expected->EvaluateCommand(), edge->EvaluateCommand());
+    EXPECT_EQ(expected->GetBinding("depfile"), edge->GetBinding("depfile"));
+    EXPECT_EQ(expected->rule().name(), edge->rule().name());
+    EXPECT_EQ(expected->pool()->name(), edge->pool()->name());
+    EXPECT_EQ(expected->weight(), edge->weight());
+    EXPECT_EQ(expected->priority(), edge->priority());
+    EXPECT_EQ(expected->implicit_deps_, edge->implicit_deps_);
+    EXPECT_EQ(expected->order_only_deps_, edge->order_only_deps_);
+    EXPECT_EQ(expected->implicit_outs_, edge->implicit_outs_);
+    if (expected->dyndep_) {
+      ASSERT_TRUE(edge->dyndep_);
+      EXPECT_EQ(expected->dyndep_->path(), edge->dyndep_->path());
+      EXPECT_TRUE(edge->dyndep_->dyndep_pending());
+    } else {
+      EXPECT_FALSE(edge->dyndep_);
+    }
+    ASSERT_EQ(expected->inputs_.size(), edge->inputs_.size());
+    for (size_t j = 0; j < edge->inputs_.size(); ++j) {
+      EXPECT_EQ(expected->inputs_[j]->path(), edge->inputs_[j]->path());
+      EXPECT_EQ(edge, edge->inputs_[j]->out_edges().back());
+    }
+    ASSERT_EQ(expected->outputs_.size(), edge->outputs_.size());
+    for (size_t j = 0; j < edge->outputs_.size(); ++j) {
+      EXPECT_EQ(expected->outputs_[j]->path(), edge->outputs_[j]->path());
+      EXPECT_EQ(edge, edge->outputs_[j]->in_edge());
+    }
+  }
+  EXPECT_TRUE(state.edges_[1]->is_phony());
+  EXPECT_EQ(2, state.LookupPool("link")->depth());
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("a.o", state.defaults_[0]->path());
+}
+
+TEST_F(ManifestCacheTest, Stale) {
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kTestFilename, "key", state_, files_, &err));
+
+  // Different parser options.
+  State state1;
+  vector<ManifestFile> files;
+  EXPECT_EQ(ManifestCache::LOAD_STALE,
+            ManifestCache::Load(kTestFilename, "other", &fs_, &state1, &files,
+                                &err));
+  EXPECT_TRUE(state1.edges_.empty());
+
+  // A changed subninja.
+  fs_.Tick();
+  fs_.Create("sub.ninja", "");
+  State state2;
+  EXPECT_EQ(ManifestCache::LOAD_STALE,
+            ManifestCache::Load(kTestFilename, "key", &fs_, &state2, &files,
+                                &err));
+  EXPECT_TRUE(state2.edges_.empty());
+  EXPECT_TRUE(files.empty());
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ManifestCacheTest, Truncated) {
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kTestFilename, "key", state_, files_, &err));
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+
+  FILE* f = fopen(kTestFilename, "wb");
+  fwrite(contents.data(), 1, contents.size() - 1, f);
+  fclose(f);
+
+  State state;
+  vector<ManifestFile> files;
+  EXPECT_EQ(ManifestCache::LOAD_ERROR,
+            ManifestCache::Load(kTestFilename, "key", &fs_, &state, &files,
+                                &err));
+  EXPECT_EQ("premature end of file or corrupt data", err);
+}
+
+}  // anonymous namespace
+
+namespace {
+
+/// A VirtualFileSystem that counts the files it's asked to map, and maps
+/// none of them.
+struct MapCountingFileSystem : public VirtualFileSystem {
+  MapCountingFileSystem() : maps_(0) {}
+  virtual bool MapFile(const string& path, MappedFile* file) {
+    ++maps_;
+    return false;
+  }
+  int maps_;
+};
+
+}  // namespace
+
+TEST(RecordingFileReaderTest, RecordsAndMaps) {
+  MapCountingFileSystem fs;
+  fs.Create("build.ninja", "subninja sub.ninja\n");
+  fs.Tick();
+  fs.Create("sub.ninja", "build out: phony\n");
+
+  State state;
+  RecordingFileReader reader(&fs);
+  ManifestParser parser(&state, &reader);
+  string err;
+  ASSERT_TRUE(parser.Load("build.ninja", &err));
+  ASSERT_EQ("", err);
+
+  // Each file is offered to the disk to map before it's read.
+  EXPECT_EQ(2, fs.maps_);
+  ASSERT_EQ(2u, reader.files_.size());
+  EXPECT_EQ("build.ninja", reader.files_[0].path);
+  EXPECT_EQ(1, reader.files_[0].mtime);
+  EXPECT_EQ("sub.ninja", reader.files_[1].path);
+  EXPECT_EQ(2, reader.files_[1].mtime);
+}
+
+TEST(RecordingFileReaderTest, RecordsMappedFilesOnce) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-RecordingFileReaderTest");
+  FILE* f = fopen("build.ninja", "w");
+  ASSERT_TRUE(f != NULL);
+  fputs("build out: phony\n", f);
+  fclose(f);
+
+  RealDiskInterface disk;
+  State state;
+  RecordingFileReader reader(&disk);
+  ManifestParser parser(&state, &reader);
+  string err;
+  EXPECT_TRUE(parser.Load("build.ninja", &err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(1u, reader.files_.size());
+  EXPECT_EQ("build.ninja", reader.files_[0].path);
+  EXPECT_GT(reader.files_[0].mtime, 0);
+  temp_dir.Cleanup();
+}
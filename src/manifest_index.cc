@@ -0,0 +1,509 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_index.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <map>
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "hash_map.h"
+#include "metrics.h"
+#include "stat_audit.h"
+#include "state.h"
+#include "version.h"
+
+namespace {
+
+// The version is stored as 4 bytes after the signature and also serves as a
+// byte order mark.
+const char kFileSignature[] = "# ninjaindex\n";
+const uint32_t kCurrentVersion = 1;
+
+// Stands for a missing unit: the parent of unit 0, and the producer of a
+// path that no edge builds.
+const uint32_t kNone = 0xffffffff;
+
+void WriteU32(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteU64(string* out, uint64_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(string* out, const string& value) {
+  WriteU32(out, value.size());
+  out->append(value);
+}
+
+/// The |index|th of the uint32_ts at |p|, which needn't be aligned.
+uint32_t U32At(const char* p, size_t index) {
+  uint32_t value;
+  memcpy(&value, p + index * sizeof(value), sizeof(value));
+  return value;
+}
+
+/// Reads back what the Write functions wrote, remembering in |ok_| whether
+/// everything was within the data.
+struct Reader {
+  Reader(const char* data, size_t size)
+      : p_(data), end_(data + size), ok_(true) {}
+
+  void Read(void* value, size_t size) {
+    if (static_cast<size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return;
+    }
+    memcpy(value, p_, size);
+    p_ += size;
+  }
+
+  uint32_t U32() {
+    uint32_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  uint64_t U64() {
+    uint64_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  StringPiece Piece() {
+    uint32_t size = U32();
+    const char* value = Skip(size);
+    return value ? StringPiece(value, size) : StringPiece();
+  }
+
+  /// Step over |size| bytes, and return where they start.
+  const char* Skip(size_t size) {
+    if (!ok_ || static_cast<size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return NULL;
+    }
+    const char* start = p_;
+    p_ += size;
+    return start;
+  }
+
+  /// Read the number of items that follow, which take at least |item_size|
+  /// bytes each.  Checking it first keeps corrupt counts from allocating.
+  uint32_t Count(size_t item_size) {
+    uint32_t count = U32();
+    if (count > static_cast<size_t>(end_ - p_) / item_size) {
+      ok_ = false;
+      return 0;
+    }
+    return count;
+  }
+
+  const char* p_;
+  const char* end_;
+  bool ok_;
+};
+
+}  // anonymous namespace
+
+ManifestIndexBuilder::ManifestIndexBuilder(const string& manifest) {
+  units_.push_back(Unit());
+  units_.back().parent = kNone;
+  units_.back().files.push_back(manifest);
+}
+
+int ManifestIndexBuilder::AddSubninja(int parent, const string& path) {
+  units_.push_back(Unit());
+  units_.back().parent = parent;
+  units_.back().files.push_back(path);
+  return units_.size() - 1;
+}
+
+void ManifestIndexBuilder::AddInclude(int unit, const string& path) {
+  units_[unit].files.push_back(path);
+}
+
+void ManifestIndexBuilder::AddEdge(int unit, Edge* edge) {
+  units_[unit].edges.push_back(edge);
+}
+
+void ManifestIndexBuilder::AddPool(int unit, const string& name) {
+  units_[unit].pools.push_back(name);
+}
+
+bool ManifestIndexBuilder::Save(const string& path, const string& key,
+                                const State& state,
+                                const vector<ManifestFile>& files,
+                                string* err) const {
+  METRIC_RECORD(".ninja_index save");
+  map<string, TimeStamp> mtimes;
+  for (vector<ManifestFile>::const_iterator i = files.begin();
+       i != files.end(); ++i) {
+    mtimes[i->path] = i->mtime;
+  }
+
+  map<const Node*, uint32_t> node_ids;
+  vector<const Node*> nodes;
+  nodes.reserve(state.paths_.size());
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    node_ids[i->second] = nodes.size();
+    nodes.push_back(i->second);
+  }
+  vector<uint32_t> producers(nodes.size(), kNone);
+  for (size_t u = 0; u < units_.size(); ++u) {
+    for (vector<Edge*>::const_iterator e = units_[u].edges.begin();
+         e != units_[u].edges.end(); ++e) {
+      for (vector<Node*>::const_iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        producers[node_ids[*o]] = u;
+      }
+    }
+  }
+  map<string, uint32_t> pool_ids;
+  for (size_t u = 0; u < units_.size(); ++u) {
+    for (vector<string>::const_iterator p = units_[u].pools.begin();
+         p != units_[u].pools.end(); ++p) {
+      uint32_t id = pool_ids.size();
+      pool_ids[*p] = id;
+    }
+  }
+
+  string out(kFileSignature, sizeof(kFileSignature) - 1);
+  WriteU32(&out, kCurrentVersion);
+  WriteString(&out, kNinjaVersion);
+  WriteString(&out, key);
+
+  WriteU32(&out, units_.size());
+  for (size_t u = 0; u < units_.size(); ++u) {
+    const Unit& unit = units_[u];
+    WriteU32(&out, unit.parent);
+    WriteU32(&out, unit.files.size());
+    for (vector<string>::const_iterator f = unit.files.begin();
+         f != unit.files.end(); ++f) {
+      map<string, TimeStamp>::const_iterator mtime = mtimes.find(*f);
+      WriteString(&out, *f);
+      WriteU64(&out, mtime != mtimes.end() ? mtime->second : 0);
+    }
+    // Only the inputs built elsewhere can make other units needed.
+    vector<uint32_t> inputs;
+    set<string> pools;
+    for (vector<Edge*>::const_iterator e = unit.edges.begin();
+         e != unit.edges.end(); ++e) {
+      for (vector<Node*>::const_iterator i = (*e)->inputs_.begin();
+           i != (*e)->inputs_.end(); ++i) {
+        uint32_t id = node_ids[*i];
+        if (producers[id] != kNone && producers[id] != u)
+          inputs.push_back(id);
+      }
+      pools.insert((*e)->pool()->name());
+    }
+    sort(inputs.begin(), inputs.end());
+    inputs.erase(unique(inputs.begin(), inputs.end()), inputs.end());
+    WriteU32(&out, inputs.size());
+    for (vector<uint32_t>::iterator i = inputs.begin(); i != inputs.end(); ++i)
+      WriteU32(&out, *i);
+    vector<uint32_t> used_pools;
+    for (set<string>::iterator p = pools.begin(); p != pools.end(); ++p) {
+      map<string, uint32_t>::iterator id = pool_ids.find(*p);
+      if (id != pool_ids.end())  // Not a built-in pool.
+        used_pools.push_back(id->second);
+    }
+    WriteU32(&out, used_pools.size());
+    for (vector<uint32_t>::iterator p = used_pools.begin();
+         p != used_pools.end(); ++p) {
+      WriteU32(&out, *p);
+    }
+  }
+
+  WriteU32(&out, pool_ids.size());
+  for (size_t u = 0; u < units_.size(); ++u) {
+    for (vector<string>::const_iterator p = units_[u].pools.begin();
+         p != units_[u].pools.end(); ++p) {
+      WriteString(&out, *p);
+      WriteU32(&out, u);
+    }
+  }
+
+  // The paths, and an open-addressed table to find their ids by.
+  WriteU32(&out, nodes.size());
+  uint32_t offset = 0;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    WriteU32(&out, offset);
+    offset += nodes[i]->path().len_;
+  }
+  WriteU32(&out, offset);
+  for (size_t i = 0; i < nodes.size(); ++i)
+    WriteU32(&out, producers[i]);
+  uint32_t bucket_count = 2;
+  while (bucket_count < nodes.size() * 2)
+    bucket_count *= 2;
+  vector<uint32_t> buckets(bucket_count, kNone);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    StringPiece node_path = nodes[i]->path();
+    uint32_t b = HashBytes(node_path.str_, node_path.len_) &
+        (bucket_count - 1);
+    while (buckets[b] != kNone)
+      b = (b + 1) & (bucket_count - 1);
+    buckets[b] = i;
+  }
+  WriteU32(&out, bucket_count);
+  for (vector<uint32_t>::iterator b = buckets.begin(); b != buckets.end(); ++b)
+    WriteU32(&out, *b);
+  for (size_t i = 0; i < nodes.size(); ++i)
+    out.append(nodes[i]->path().str_, nodes[i]->path().len_);
+
+  // Write a temporary file first, so that the index is never seen half
+  // written.
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(out.data(), 1, out.size(), f) < out.size()) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  // rename() doesn't replace existing files on Windows.
+  unlink(path.c_str());
+#endif
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+ManifestIndex::ManifestIndex()
+    : path_count_(0), offsets_(NULL), producers_(NULL), bucket_count_(0),
+      buckets_(NULL), blob_(NULL) {}
+
+bool ManifestIndex::Load(const string& path, const string& key,
+                         string* err) {
+  METRIC_RECORD(".ninja_index load");
+  string map_err;
+  if (mapped_.Map(path, &map_err) < 0)
+    return false;
+
+  const size_t kSignatureSize = sizeof(kFileSignature) - 1;
+  if (mapped_.size() < kSignatureSize ||
+      memcmp(mapped_.data(), kFileSignature, kSignatureSize) != 0) {
+    return false;
+  }
+  Reader in(mapped_.data(), mapped_.size());
+  in.p_ += kSignatureSize;
+  if (in.U32() != kCurrentVersion)
+    return false;
+  StringPiece version = in.Piece();
+  StringPiece saved_key = in.Piece();
+  if (!in.ok_ || version != kNinjaVersion || saved_key != key)
+    return false;
+
+  for (uint32_t count = in.Count(16); count > 0 && in.ok_; --count) {
+    units_.push_back(Unit());
+    Unit* unit = &units_.back();
+    unit->parent = in.U32();
+    if (unit->parent != kNone && unit->parent >= units_.size() - 1)
+      in.ok_ = false;
+    for (uint32_t files = in.Count(12); files > 0 && in.ok_; --files) {
+      string file_path = in.Piece().AsString();
+      TimeStamp mtime = in.U64();
+      unit->files.push_back(ManifestFile(file_path, mtime));
+    }
+    unit->input_count = in.Count(4);
+    unit->inputs = in.Skip(unit->input_count * 4);
+    unit->pool_count = in.Count(4);
+    unit->pools = in.Skip(unit->pool_count * 4);
+  }
+  for (uint32_t count = in.Count(8); count > 0 && in.ok_; --count) {
+    StringPiece name = in.Piece();
+    pools_.push_back(make_pair(name, in.U32()));
+  }
+  path_count_ = in.Count(8);
+  offsets_ = in.Skip((path_count_ + 1) * 4);
+  producers_ = in.Skip(path_count_ * 4);
+  bucket_count_ = in.Count(4);
+  buckets_ = in.Skip(bucket_count_ * 4);
+  if (in.ok_) {
+    blob_ = in.p_;
+    if (bucket_count_ == 0 || (bucket_count_ & (bucket_count_ - 1)) != 0 ||
+        U32At(offsets_, path_count_) != static_cast<size_t>(in.end_ - in.p_)) {
+      in.ok_ = false;
+    }
+  }
+
+  // Check the ids, so that nothing reads past the data later on.
+  for (size_t u = 0; u < units_.size() && in.ok_; ++u) {
+    for (uint32_t i = 0; i < units_[u].input_count; ++i) {
+      if (U32At(units_[u].inputs, i) >= path_count_)
+        in.ok_ = false;
+    }
+    for (uint32_t i = 0; i < units_[u].pool_count; ++i) {
+      if (U32At(units_[u].pools, i) >= pools_.size())
+        in.ok_ = false;
+    }
+  }
+  for (size_t p = 0; p < pools_.size() && in.ok_; ++p) {
+    if (pools_[p].second >= units_.size())
+      in.ok_ = false;
+  }
+  for (uint32_t i = 0; i < path_count_ && in.ok_; ++i) {
+    uint32_t producer = U32At(producers_, i);
+    if ((producer != kNone && producer >= units_.size()) ||
+        U32At(offsets_, i) > U32At(offsets_, i + 1)) {
+      in.ok_ = false;
+    }
+  }
+  for (uint32_t b = 0; b < bucket_count_ && in.ok_; ++b) {
+    uint32_t id = U32At(buckets_, b);
+    if (id != kNone && id >= path_count_)
+      in.ok_ = false;
+  }
+  if (!in.ok_ || units_.empty()) {
+    *err = "premature end of file or corrupt data";
+    units_.clear();
+    mapped_.Unmap();
+    return false;
+  }
+  return true;
+}
+
+int64_t ManifestIndex::FindPath(StringPiece path) const {
+  uint32_t b = HashBytes(path.str_, path.len_) & (bucket_count_ - 1);
+  for (uint32_t probes = 0; probes < bucket_count_; ++probes) {
+    uint32_t id = U32At(buckets_, b);
+    if (id == kNone)
+      break;
+    uint32_t start = U32At(offsets_, id);
+    StringPiece candidate(blob_ + start, U32At(offsets_, id + 1) - start);
+    if (candidate == path)
+      return id;
+    b = (b + 1) & (bucket_count_ - 1);
+  }
+  return -1;
+}
+
+uint32_t ManifestIndex::Producer(uint32_t id) const {
+  return U32At(producers_, id);
+}
+
+bool ManifestIndex::FindSkippable(const vector<string>& targets,
+                                  const string& manifest,
+                                  DiskInterface* disk_interface,
+                                  set<string>* skip) {
+  METRIC_RECORD(".ninja_index plan");
+  needed_.assign(units_.size(), false);
+  vector<uint32_t> queue;
+
+  // Units are numbered as they're reached, so a parent comes before the
+  // units it holds.
+  vector<bool> changed(units_.size(), false);
+  for (size_t u = 0; u < units_.size(); ++u) {
+    const Unit& unit = units_[u];
+    if (unit.parent != kNone && changed[unit.parent]) {
+      changed[u] = true;
+      continue;
+    }
+    for (vector<ManifestFile>::const_iterator f = unit.files.begin();
+         f != unit.files.end() && !changed[u]; ++f) {
+      string err;
+      StatAudit::Scope audit(StatAudit::kManifest);
+      changed[u] = disk_interface->Stat(f->path, &err) != f->mtime;
+    }
+  }
+  // Nothing can be left out if the top-level manifest changed.
+  if (changed[0])
+    return false;
+  for (size_t u = 0; u < units_.size(); ++u) {
+    if (changed[u])
+      queue.push_back(u);
+  }
+  queue.push_back(0);
+
+  for (vector<string>::const_iterator t = targets.begin();
+       t != targets.end(); ++t) {
+    int64_t id = FindPath(*t);
+    if (id < 0 || Producer(id) == kNone)
+      return false;
+    queue.push_back(Producer(id));
+  }
+  int64_t manifest_id = FindPath(manifest);
+  if (manifest_id >= 0 && Producer(manifest_id) != kNone)
+    queue.push_back(Producer(manifest_id));
+
+  // A file that's a 'subninja' more than once is only skipped if all its
+  // units are.
+  map<string, vector<uint32_t> > units_by_path;
+  for (size_t u = 1; u < units_.size(); ++u)
+    units_by_path[units_[u].files[0].path].push_back(u);
+
+  while (!queue.empty()) {
+    uint32_t u = queue.back();
+    queue.pop_back();
+    if (needed_[u])
+      continue;
+    needed_[u] = true;
+    const Unit& unit = units_[u];
+    if (unit.parent != kNone)
+      queue.push_back(unit.parent);
+    for (uint32_t i = 0; i < unit.input_count; ++i)
+      queue.push_back(Producer(U32At(unit.inputs, i)));
+    for (uint32_t i = 0; i < unit.pool_count; ++i)
+      queue.push_back(pools_[U32At(unit.pools, i)].second);
+    if (u > 0) {
+      const vector<uint32_t>& same = units_by_path[unit.files[0].path];
+      queue.insert(queue.end(), same.begin(), same.end());
+    }
+  }
+
+  for (size_t u = 1; u < units_.size(); ++u) {
+    if (!needed_[u])
+      skip->insert(units_[u].files[0].path);
+  }
+  return true;
+}
+
+bool ManifestIndex::Covers(const State& state) const {
+  METRIC_RECORD(".ninja_index check");
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    int64_t id = FindPath(i->first);
+    if (id >= 0 && Producer(id) != kNone && !needed_[Producer(id)])
+      return false;
+  }
+  for (vector<pair<StringPiece, uint32_t> >::const_iterator p = pools_.begin();
+       p != pools_.end(); ++p) {
+    if (!needed_[p->second] && state.pools_.count(p->first.AsString()))
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,124 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_INDEX_H_
+#define NINJA_MANIFEST_INDEX_H_
+
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "manifest_cache.h"
+#include "string_piece.h"
+#include "util.h"
+
+struct DiskInterface;
+struct Edge;
+struct State;
+
+/// Records, while the whole manifest is parsed, which 'subninja' file each
+/// edge and pool comes from, and saves that as a ManifestIndex.
+///
+/// A 'subninja' file and the files it 'include's make up a unit; unit 0 is
+/// the top-level manifest with its own includes.
+struct ManifestIndexBuilder {
+  explicit ManifestIndexBuilder(const string& manifest);
+
+  /// Start the unit of a 'subninja' of |path| from |parent|, and return it.
+  int AddSubninja(int parent, const string& path);
+  void AddInclude(int unit, const string& path);
+  void AddEdge(int unit, Edge* edge);
+  void AddPool(int unit, const string& name);
+
+  /// Write the index for the graph in |state| to |path|.  |files| have the
+  /// mtimes of the manifest files, and |key| is as for ManifestCache.
+  bool Save(const string& path, const string& key, const State& state,
+            const vector<ManifestFile>& files, string* err) const;
+
+ private:
+  struct Unit {
+    int parent;
+    vector<string> files;
+    vector<Edge*> edges;
+    vector<string> pools;
+  };
+  vector<Unit> units_;
+};
+
+/// Tells which 'subninja' files a build of a few targets can do without,
+/// using what ManifestIndexBuilder saved after the last full parse.
+///
+/// A unit is needed if it defines one of the targets, one of the inputs or
+/// pools of a needed unit, or if it holds a needed unit.  So is a unit that
+/// changed since the index was saved, with all the units under it, whose
+/// paths may depend on its variables; Covers() then checks that it didn't
+/// start using what a skipped unit declares.  The units left out are
+/// unchanged, so the index is still right about them.
+///
+/// The file (native byte order) holds, after a signature and version, the
+/// ninja version and key, the units with their parent, files and mtimes
+/// and the ids of their inputs and pools, the pools with the unit that
+/// declares each, and the paths, each with the unit that builds it, along
+/// with a hash table to look them up in.
+struct ManifestIndex {
+  ManifestIndex();
+
+  /// Map the index at |path|.  Returns false if there's none, or if it was
+  /// saved for a different |key| or ninja version; |err| is only filled in
+  /// if the index is corrupt.
+  bool Load(const string& path, const string& key, string* err);
+
+  /// Fill |skip| with the paths, as the 'subninja' statements spell them,
+  /// of the files that building |targets|, and the |manifest| itself,
+  /// doesn't need.  |targets| and |manifest| are canonical.  Returns false if a target isn't an output in the index,
+  /// or if the top-level manifest changed.
+  bool FindSkippable(const vector<string>& targets, const string& manifest,
+                     DiskInterface* disk_interface, set<string>* skip);
+
+  /// Whether |state|, loaded without the files FindSkippable() found,
+  /// holds no node or pool that a skipped unit declares: if it does, the
+  /// loaded files changed in a way that the index doesn't know about.
+  bool Covers(const State& state) const;
+
+ private:
+  struct Unit {
+    uint32_t parent;
+    vector<ManifestFile> files;
+    /// Where the ids of the inputs and of the pools are in |mapped_|.
+    const char* inputs;
+    uint32_t input_count;
+    const char* pools;
+    uint32_t pool_count;
+  };
+
+  /// The id of |path|, or -1 if it isn't in the index.
+  int64_t FindPath(StringPiece path) const;
+  /// The unit that builds the path with id |id|, or kNone.
+  uint32_t Producer(uint32_t id) const;
+
+  MappedFile mapped_;
+  vector<Unit> units_;
+  vector<pair<StringPiece, uint32_t> > pools_;
+  uint32_t path_count_;
+  const char* offsets_;
+  const char* producers_;
+  uint32_t bucket_count_;
+  const char* buckets_;
+  const char* blob_;
+  /// Which units FindSkippable() found to be needed.
+  vector<bool> needed_;
+};
+
+#endif  // NINJA_MANIFEST_INDEX_H_
@@ -0,0 +1,202 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_index.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+const char kTestFilename[] = "ManifestIndexTest-tempfile";
+
+struct ManifestIndexTest : public testing::Test {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+
+    fs_.Create("build.ninja",
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"build gen.h: cc gen.in\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"subninja c.ninja\n"
+"subninja d.ninja\n");
+    fs_.Create("a.ninja",
+"build a.o: cc a.c | gen.h\n");
+    fs_.Create("b.ninja",
+"build b.o: cc b.c\n"
+"subninja b2.ninja\n");
+    fs_.Create("b2.ninja",
+"build b2.o: cc b2.c\n");
+    fs_.Create("c.ninja",
+"pool big\n"
+"  depth = 1\n"
+"build c.o: cc c.c\n");
+    fs_.Create("d.ninja",
+"build lib.a: cc a.o\n"
+"  pool = big\n");
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  /// Parse the whole manifest and save its index.
+  void SaveIndex() {
+    State state;
+    ManifestIndexBuilder builder("build.ninja");
+    ManifestParserOptions options;
+    options.index_ = &builder;
+    fs_.files_read_.clear();
+    ManifestParser parser(&state, &fs_, options);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+    vector<ManifestFile> files;
+    for (vector<string>::iterator i = fs_.files_read_.begin();
+         i != fs_.files_read_.end(); ++i) {
+      files.push_back(ManifestFile(*i, fs_.Stat(*i, &err)));
+    }
+    ASSERT_TRUE(builder.Save(kTestFilename, "key", state, files, &err));
+    ASSERT_EQ("", err);
+  }
+
+  /// The files that building |target| can skip, separated by spaces, or
+  /// "-" if the index can't tell.
+  string Skippable(const string& target) {
+    ManifestIndex index;
+    string err;
+    if (!index.Load(kTestFilename, "key", &err))
+      return "error: " + err;
+    vector<string> targets(1, target);
+    set<string> skip;
+    if (!index.FindSkippable(targets, "build.ninja", &fs_, &skip))
+      return "-";
+    string result;
+    for (set<string>::iterator i = skip.begin(); i != skip.end(); ++i)
+      result += (result.empty() ? "" : " ") + *i;
+    return result;
+  }
+
+  VirtualFileSystem fs_;
+};
+
+TEST_F(ManifestIndexTest, SkipsUnneeded) {
+  SaveIndex();
+  EXPECT_EQ("b.ninja b2.ninja c.ninja d.ninja", Skippable("a.o"));
+  EXPECT_EQ("a.ninja b.ninja b2.ninja c.ninja d.ninja", Skippable("gen.h"));
+  // The file that holds b2.ninja is needed too.
+  EXPECT_EQ("a.ninja c.ninja d.ninja", Skippable("b2.o"));
+  // An input built elsewhere and a pool declared elsewhere.
+  EXPECT_EQ("b.ninja b2.ninja", Skippable("lib.a"));
+
+  // Not built by anything.
+  EXPECT_EQ("-", Skippable("a.c"));
+  EXPECT_EQ("-", Skippable("unknown"));
+}
+
+TEST_F(ManifestIndexTest, LoadsWithoutSkipped) {
+  SaveIndex();
+  ManifestIndex index;
+  string err;
+  ASSERT_TRUE(index.Load(kTestFilename, "key", &err));
+  vector<string> targets(1, "a.o");
+  set<string> skip;
+  ASSERT_TRUE(index.FindSkippable(targets, "build.ninja", &fs_, &skip));
+
+  State state;
+  ManifestParserOptions options;
+  options.skip_subninjas_ = &skip;
+  fs_.files_read_.clear();
+  ManifestParser parser(&state, &fs_, options);
+  ASSERT_TRUE(parser.Load("build.ninja", &err));
+  ASSERT_EQ(2u, fs_.files_read_.size());
+  EXPECT_EQ("a.ninja", fs_.files_read_[1]);
+  ASSERT_TRUE(state.LookupNode("a.o"));
+  EXPECT_TRUE(state.LookupNode("gen.h")->in_edge());
+  EXPECT_FALSE(state.LookupNode("lib.a"));
+  EXPECT_TRUE(index.Covers(state));
+}
+
+TEST_F(ManifestIndexTest, Changed) {
+  SaveIndex();
+
+  // Changed files are needed, with the files they hold.
+  fs_.Tick();
+  fs_.Create("c.ninja", "pool big\n  depth = 2\n");
+  EXPECT_EQ("b.ninja b2.ninja d.ninja", Skippable("a.o"));
+  SaveIndex();
+  fs_.Tick();
+  fs_.Create("b.ninja", "subninja b2.ninja\n");
+  EXPECT_EQ("c.ninja d.ninja", Skippable("a.o"));
+  SaveIndex();
+  fs_.Tick();
+  fs_.Create("b2.ninja", "");
+  EXPECT_EQ("c.ninja d.ninja", Skippable("a.o"));
+
+  // Nothing is skipped if the top-level manifest changed.
+  fs_.Tick();
+  fs_.Create("build.ninja", "");
+  EXPECT_EQ("-", Skippable("a.o"));
+
+  // Another key.
+  ManifestIndex index;
+  string err;
+  EXPECT_FALSE(index.Load(kTestFilename, "other", &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ManifestIndexTest, NotCovered) {
+  SaveIndex();
+  fs_.Tick();
+  fs_.Create("a.ninja", "build a.o: cc a.c | gen.h c.o\n");
+  ManifestIndex index;
+  string err;
+  ASSERT_TRUE(index.Load(kTestFilename, "key", &err));
+  vector<string> targets(1, "a.o");
+  set<string> skip;
+  ASSERT_TRUE(index.FindSkippable(targets, "build.ninja", &fs_, &skip));
+  EXPECT_EQ(1u, skip.count("c.ninja"));
+
+  // The changed file now uses an output of a skipped one.
+  State state;
+  ManifestParserOptions options;
+  options.skip_subninjas_ = &skip;
+  ManifestParser parser(&state, &fs_, options);
+  ASSERT_TRUE(parser.Load("build.ninja", &err));
+  EXPECT_FALSE(index.Covers(state));
+}
+
+TEST_F(ManifestIndexTest, Truncated) {
+  SaveIndex();
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+
+  FILE* f = fopen(kTestFilename, "wb");
+  fwrite(contents.data(), 1, contents.size() - 1, f);
+  fclose(f);
+
+  ManifestIndex index;
+  EXPECT_FALSE(index.Load(kTestFilename, "key", &err));
+  EXPECT_EQ("premature end of file or corrupt data", err);
+}
+
+}  // anonymous namespace
@@ -14,107 +14,325 @@
 
 #include "manifest_parser.h"
 
+#include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <map>
+#include <set>
 #include <vector>
 
+#include "content_hash.h"
 #include "disk_interface.h"
 #include "graph.h"
+#include "manifest_index.h"
 #include "metrics.h"
 #include "state.h"
 #include "util.h"
 #include "version.h"
 
-ManifestParser::ManifestParser(State* state, FileReader* file_reader,
-                               ManifestParserOptions options)
-    : state_(state), file_reader_(file_reader),
-      options_(options), quiet_(false) {
-  env_ = &state->bindings_;
-}
+/// A 'name = value' line inside a pool, rule or build statement.
+struct ManifestBinding {
+  string key;
+  EvalString value;
+  /// Positioned after the value, for errors about it.
+  Lexer lexer;
+};
 
-bool ManifestParser::Load(const string& filename, string* err, Lexer* parent) {
-  METRIC_RECORD(".ninja parse");
+/// One statement of a .ninja file, split into its parts but not evaluated.
+struct ManifestStatement {
+  explicit ManifestStatement(Lexer::Token type)
+      : type(type), complete(false), implicit_outs(0), implicit(0),
+        order_only(0) {}
+
+  /// The keyword starting the statement; IDENT for a variable binding, or
+  /// ERROR for a syntax error, whose message is in |name|.
+  Lexer::Token type;
+  /// False if a syntax error cut the statement short.  The parts that were
+  /// read are still checked, so that errors come out in the same order as
+  /// if the file was evaluated while reading it.
+  bool complete;
+  /// The pool or rule name, the rule of a build statement, or the variable
+  /// name of a binding.
+  string name;
+  /// The value of a binding, or the path of an include.
+  EvalString value;
+  vector<ManifestBinding> bindings;
+  /// The outputs of a build statement.
+  vector<EvalString> outs;
+  /// The inputs of a build statement, or the targets of a default statement.
+  vector<EvalString> ins;
+  /// For default statements, positioned after each of |ins|.
+  vector<Lexer> in_lexers;
+  int implicit_outs;
+  int implicit;
+  int order_only;
+  /// Positioned after the name.
+  Lexer name_lexer;
+  /// Positioned at the end of the statement.
+  Lexer lexer;
+};
+
+/// The statements of one file.  The lexers in the statements point into
+/// |filename| and |text|, so a ParsedManifest stays where it's created.
+struct ParsedManifest {
+  ParsedManifest() : parsed(false), hash(0) {}
+
+  string filename;
+  /// The text of the file, followed by a NUL: either |mapped| or
+  /// |contents|.
+  StringPiece text;
+  MappedFile mapped;
   string contents;
-  string read_err;
-  if (file_reader_->ReadFile(filename, &contents, &read_err) != FileReader::Okay) {
-    *err = "loading '" + filename + "': " + read_err;
-    if (parent)
-      parent->Error(string(*err), err);
-    return false;
+  vector<ManifestStatement> statements;
+  /// Whether |statements| were split from |text| already.
+  bool parsed;
+  /// The ContentHash of |text|, if it's to be kept in a ManifestReuse.
+  uint64_t hash;
+};
+
+ParsedManifest* ManifestReuse::Take(const string& path, uint64_t hash) {
+  map<string, ParsedManifest*>::iterator i = manifests_.find(path);
+  if (i == manifests_.end())
+    return NULL;
+  ParsedManifest* manifest = i->second;
+  manifests_.erase(i);
+  if (manifest->hash != hash) {
+    delete manifest;
+    return NULL;
   }
+  ++reused_;
+  return manifest;
+}
 
-  // The lexer needs a nul byte at the end of its input, to know when it's done.
-  // It takes a StringPiece, and StringPiece's string constructor uses
-  // string::data().  data()'s return value isn't guaranteed to be
-  // null-terminated (although in practice - libc++, libstdc++, msvc's stl --
-  // it is, and C++11 demands that too), so add an explicit nul byte.
-  contents.resize(contents.size() + 1);
+void ManifestReuse::Keep(ParsedManifest* manifest) {
+  ParsedManifest*& kept = manifests_[manifest->filename];
+  if (kept != manifest)
+    delete kept;
+  kept = manifest;
+}
 
-  return Parse(filename, contents, err);
+void ManifestReuse::Clear() {
+  for (map<string, ParsedManifest*>::iterator i = manifests_.begin();
+       i != manifests_.end(); ++i) {
+    delete i->second;
+  }
+  manifests_.clear();
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
-                           string* err) {
-  lexer_.Start(filename, input);
+/// Files read and parsed ahead of time, by path.
+struct ManifestPrefetch {
+  ~ManifestPrefetch() {
+    for (map<string, ParsedManifest*>::iterator i = manifests_.begin();
+         i != manifests_.end(); ++i) {
+      delete i->second;
+    }
+    for (vector<BindingEnv*>::iterator i = scopes_.begin();
+         i != scopes_.end(); ++i) {
+      delete *i;
+    }
+  }
+
+  /// Hand over the file at |path|, or return NULL if it wasn't parsed.
+  ParsedManifest* Take(const string& path) {
+    map<string, ParsedManifest*>::iterator i = manifests_.find(path);
+    if (i == manifests_.end())
+      return NULL;
+    ParsedManifest* manifest = i->second;
+    manifests_.erase(i);
+    return manifest;
+  }
+
+  map<string, ParsedManifest*> manifests_;
+  /// The scopes used to guess the paths of included files.
+  vector<BindingEnv*> scopes_;
+};
+
+/// What a file included into a scope defines.
+struct IncludedManifest {
+  IncludedManifest() : manifest(NULL), replayable(false) {}
+
+  /// A rule, or a variable and its value.
+  struct Definition {
+    const ManifestStatement* stmt;
+    const Rule* rule;
+    string value;
+  };
+
+  ParsedManifest* manifest;
+  /// Whether the file only defines rules and variables whose values only
+  /// use the variables it defined before, so that including it again only
+  /// needs to add |definitions| to the scope, rather than evaluate it.
+  bool replayable;
+  vector<Definition> definitions;
+};
+
+/// The files read by 'include' statements so far, by path.  Generators
+/// often include the same file of rules and flags into every subninja; it
+/// is only read and split into statements once per load.  Across loads,
+/// the ManifestReuse takes the contents into account.
+struct ManifestIncludes {
+  explicit ManifestIncludes(ManifestReuse* reuse) : reuse_(reuse) {}
+  ~ManifestIncludes() {
+    for (map<string, IncludedManifest>::iterator i = files_.begin();
+         i != files_.end(); ++i) {
+      if (reuse_)
+        reuse_->Keep(i->second.manifest);
+      else
+        delete i->second.manifest;
+    }
+  }
 
+  /// Return the file at |path|, or NULL if it wasn't included yet.
+  const IncludedManifest* Find(const string& path) const {
+    map<string, IncludedManifest>::const_iterator i = files_.find(path);
+    return i == files_.end() ? NULL : &i->second;
+  }
+
+  /// Keep |manifest|, which was just included into |env|, and record what
+  /// it defined there.
+  void Add(ParsedManifest* manifest, BindingEnv* env);
+
+ private:
+  map<string, IncludedManifest> files_;
+  ManifestReuse* reuse_;
+};
+
+namespace {
+
+/// The scope that ManifestIncludes evaluates the variables of a file in, to
+/// tell whether their values depend on where it's included: it only has
+/// the variables the file defined before.
+struct IncludeScope : public Env {
+  IncludeScope() : outside_(false) {}
+
+  using Env::LookupVariable;
+  virtual string LookupVariable(int var) {
+    if (const string* value = bindings_.Find(var))
+      return *value;
+    outside_ = true;
+    return string();
+  }
+
+  VarTable<string> bindings_;
+  /// Whether a variable the file didn't define was looked up.
+  bool outside_;
+};
+
+}  // anonymous namespace
+
+void ManifestIncludes::Add(ParsedManifest* manifest, BindingEnv* env) {
+  IncludedManifest* file = &files_[manifest->filename];
+  file->manifest = manifest;
+  IncludeScope scope;
+  const vector<ManifestStatement>& statements = manifest->statements;
+  for (vector<ManifestStatement>::const_iterator stmt = statements.begin();
+       stmt != statements.end(); ++stmt) {
+    IncludedManifest::Definition definition;
+    definition.stmt = &*stmt;
+    definition.rule = NULL;
+    if (stmt->complete && stmt->type == Lexer::RULE) {
+      // Rules aren't evaluated until an edge uses them, so the scope's is
+      // the same everywhere.
+      definition.rule = env->LookupRuleCurrentScope(stmt->name);
+    } else if (stmt->complete && stmt->type == Lexer::IDENT) {
+      definition.value = stmt->value.Evaluate(&scope);
+      scope.bindings_[VarNames::Intern(stmt->name)] = definition.value;
+    }
+    if ((!definition.rule && stmt->type != Lexer::IDENT) ||
+        !stmt->complete || scope.outside_) {
+      file->definitions.clear();
+      return;
+    }
+    file->definitions.push_back(definition);
+  }
+  file->replayable = true;
+}
+
+namespace {
+
+/// Splits the text of a file into statements.  This doesn't look at the
+/// State, so several files can be split at once.
+struct StatementParser {
+  explicit StatementParser(ParsedManifest* manifest) : manifest_(manifest) {}
+
+  /// Split the whole file.  A syntax error ends the statements with an
+  /// ERROR statement.
+  void Parse();
+
+ private:
+  bool ParsePool(string* err);
+  bool ParseRule(string* err);
+  bool ParseLet(string* key, EvalString* val, string* err);
+  bool ParseEdge(string* err);
+  bool ParseDefault(string* err);
+  bool ParseFileInclude(Lexer::Token type, string* err);
+
+  /// If the next token is not \a expected, produce an error string
+  /// saying "expectd foo, got bar".
+  bool ExpectToken(Lexer::Token expected, string* err);
+
+  ManifestStatement* AddStatement(Lexer::Token type) {
+    manifest_->statements.push_back(ManifestStatement(type));
+    return &manifest_->statements.back();
+  }
+
+  ParsedManifest* manifest_;
+  Lexer lexer_;
+};
+
+void StatementParser::Parse() {
+  manifest_->parsed = true;
+  lexer_.Start(manifest_->filename, manifest_->text);
+
+  string err;
   for (;;) {
+    bool success = true;
     Lexer::Token token = lexer_.ReadToken();
     switch (token) {
     case Lexer::POOL:
-      if (!ParsePool(err))
-        return false;
+      success = ParsePool(&err);
       break;
     case Lexer::BUILD:
-      if (!ParseEdge(err))
-        return false;
+      success = ParseEdge(&err);
       break;
     case Lexer::RULE:
-      if (!ParseRule(err))
-        return false;
+      success = ParseRule(&err);
       break;
     case Lexer::DEFAULT:
-      if (!ParseDefault(err))
-        return false;
+      success = ParseDefault(&err);
       break;
     case Lexer::IDENT: {
       lexer_.UnreadToken();
-      string name;
-      EvalString let_value;
-      if (!ParseLet(&name, &let_value, err))
-        return false;
-      string value = let_value.Evaluate(env_);
-      // Check ninja_required_version immediately so we can exit
-      // before encountering any syntactic surprises.
-      if (name == "ninja_required_version")
-        CheckNinjaVersion(value);
-      env_->AddBinding(name, value);
+      ManifestStatement* stmt = AddStatement(Lexer::IDENT);
+      success = ParseLet(&stmt->name, &stmt->value, &err);
+      stmt->complete = success;
       break;
     }
     case Lexer::INCLUDE:
-      if (!ParseFileInclude(false, err))
-        return false;
-      break;
     case Lexer::SUBNINJA:
-      if (!ParseFileInclude(true, err))
-        return false;
+      success = ParseFileInclude(token, &err);
+      break;
+    case Lexer::ERROR:
+      success = lexer_.Error(lexer_.DescribeLastError(), &err);
       break;
-    case Lexer::ERROR: {
-      return lexer_.Error(lexer_.DescribeLastError(), err);
-    }
     case Lexer::TEOF:
-      return true;
+      return;
     case Lexer::NEWLINE:
       break;
     default:
-      return lexer_.Error(string("unexpected ") + Lexer::TokenName(token),
-                          err);
+      success = lexer_.Error(string("unexpected ") + Lexer::TokenName(token),
+                             &err);
+      break;
+    }
+    if (!success) {
+      AddStatement(Lexer::ERROR)->name = err;
+      return;
     }
   }
-  return false;  // not reached
 }
 
-
-bool ManifestParser::ParsePool(string* err) {
+bool StatementParser::ParsePool(string* err) {
   string name;
   if (!lexer_.ReadIdent(&name))
     return lexer_.Error("expected pool name", err);
@@ -122,36 +340,28 @@ bool ManifestParser::ParsePool(string* err) {
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  if (state_->LookupPool(name) != NULL)
-    return lexer_.Error("duplicate pool '" + name + "'", err);
-
-  int depth = -1;
+  ManifestStatement* stmt = AddStatement(Lexer::POOL);
+  stmt->name = name;
+  stmt->name_lexer = lexer_;
 
   while (lexer_.PeekToken(Lexer::INDENT)) {
-    string key;
-    EvalString value;
-    if (!ParseLet(&key, &value, err))
+    ManifestBinding binding;
+    if (!ParseLet(&binding.key, &binding.value, err))
       return false;
+    binding.lexer = lexer_;
+    stmt->bindings.push_back(binding);
 
-    if (key == "depth") {
-      string depth_string = value.Evaluate(env_);
-      depth = atol(depth_string.c_str());
-      if (depth < 0)
-        return lexer_.Error("invalid pool depth", err);
-    } else {
-      return lexer_.Error("unexpected variable '" + key + "'", err);
-    }
+    if (binding.key != "depth" && binding.key != "remote" &&
+        binding.key != "cpus" && binding.key != "shared")
+      return lexer_.Error("unexpected variable '" + binding.key + "'", err);
   }
 
-  if (depth < 0)
-    return lexer_.Error("expected 'depth =' line", err);
-
-  state_->AddPool(new Pool(name, depth));
+  stmt->lexer = lexer_;
+  stmt->complete = true;
   return true;
 }
 
-
-bool ManifestParser::ParseRule(string* err) {
+bool StatementParser::ParseRule(string* err) {
   string name;
   if (!lexer_.ReadIdent(&name))
     return lexer_.Error("expected rule name", err);
@@ -159,40 +369,29 @@ bool ManifestParser::ParseRule(string* err) {
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  if (env_->LookupRuleCurrentScope(name) != NULL)
-    return lexer_.Error("duplicate rule '" + name + "'", err);
-
-  Rule* rule = new Rule(name);  // XXX scoped_ptr
+  ManifestStatement* stmt = AddStatement(Lexer::RULE);
+  stmt->name = name;
+  stmt->name_lexer = lexer_;
 
   while (lexer_.PeekToken(Lexer::INDENT)) {
-    string key;
-    EvalString value;
-    if (!ParseLet(&key, &value, err))
+    ManifestBinding binding;
+    if (!ParseLet(&binding.key, &binding.value, err))
       return false;
 
-    if (Rule::IsReservedBinding(key)) {
-      rule->AddBinding(key, value);
-    } else {
+    if (!Rule::IsReservedBinding(binding.key)) {
       // Die on other keyvals for now; revisit if we want to add a
       // scope here.
-      return lexer_.Error("unexpected variable '" + key + "'", err);
+      return lexer_.Error("unexpected variable '" + binding.key + "'", err);
     }
+    stmt->bindings.push_back(binding);
   }
 
-  if (rule->bindings_["rspfile"].empty() !=
-      rule->bindings_["rspfile_content"].empty()) {
-    return lexer_.Error("rspfile and rspfile_content need to be "
-                        "both specified", err);
-  }
-
-  if (rule->bindings_["command"].empty())
-    return lexer_.Error("expected 'command =' line", err);
-
-  env_->AddRule(rule);
+  stmt->lexer = lexer_;
+  stmt->complete = true;
   return true;
 }
 
-bool ManifestParser::ParseLet(string* key, EvalString* value, string* err) {
+bool StatementParser::ParseLet(string* key, EvalString* value, string* err) {
   if (!lexer_.ReadIdent(key))
     return lexer_.Error("expected variable name", err);
   if (!ExpectToken(Lexer::EQUALS, err))
@@ -202,21 +401,17 @@ bool ManifestParser::ParseLet(string* key, EvalString* value, string* err) {
   return true;
 }
 
-bool ManifestParser::ParseDefault(string* err) {
+bool StatementParser::ParseDefault(string* err) {
   EvalString eval;
   if (!lexer_.ReadPath(&eval, err))
     return false;
   if (eval.empty())
     return lexer_.Error("expected target name", err);
 
+  ManifestStatement* stmt = AddStatement(Lexer::DEFAULT);
   do {
-    string path = eval.Evaluate(env_);
-    string path_err;
-    uint64_t slash_bits;  // Unused because this only does lookup.
-    if (!CanonicalizePath(&path, &slash_bits, &path_err))
-      return lexer_.Error(path_err, err);
-    if (!state_->AddDefault(path, &path_err))
-      return lexer_.Error(path_err, err);
+    stmt->ins.push_back(eval);
+    stmt->in_lexers.push_back(lexer_);
 
     eval.Clear();
     if (!lexer_.ReadPath(&eval, err))
@@ -226,11 +421,12 @@ bool ManifestParser::ParseDefault(string* err) {
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
+  stmt->complete = true;
   return true;
 }
 
-bool ManifestParser::ParseEdge(string* err) {
-  vector<EvalString> ins, outs;
+bool StatementParser::ParseEdge(string* err) {
+  vector<EvalString> outs;
 
   {
     EvalString out;
@@ -251,7 +447,7 @@ bool ManifestParser::ParseEdge(string* err) {
     for (;;) {
       EvalString out;
       if (!lexer_.ReadPath(&out, err))
-        return err;
+        return false;
       if (out.empty())
         break;
       outs.push_back(out);
@@ -269,9 +465,11 @@ bool ManifestParser::ParseEdge(string* err) {
   if (!lexer_.ReadIdent(&rule_name))
     return lexer_.Error("expected build command name", err);
 
-  const Rule* rule = env_->LookupRule(rule_name);
-  if (!rule)
-    return lexer_.Error("unknown build rule '" + rule_name + "'", err);
+  ManifestStatement* stmt = AddStatement(Lexer::BUILD);
+  stmt->name = rule_name;
+  stmt->name_lexer = lexer_;
+  stmt->outs.swap(outs);
+  stmt->implicit_outs = implicit_outs;
 
   for (;;) {
     // XXX should we require one path here?
@@ -280,25 +478,23 @@ bool ManifestParser::ParseEdge(string* err) {
       return false;
     if (in.empty())
       break;
-    ins.push_back(in);
+    stmt->ins.push_back(in);
   }
 
   // Add all implicit deps, counting how many as we go.
-  int implicit = 0;
   if (lexer_.PeekToken(Lexer::PIPE)) {
     for (;;) {
       EvalString in;
       if (!lexer_.ReadPath(&in, err))
-        return err;
+        return false;
       if (in.empty())
         break;
-      ins.push_back(in);
-      ++implicit;
+      stmt->ins.push_back(in);
+      ++stmt->implicit;
     }
   }
 
   // Add all order-only deps, counting how many as we go.
-  int order_only = 0;
   if (lexer_.PeekToken(Lexer::PIPE2)) {
     for (;;) {
       EvalString in;
@@ -306,49 +502,437 @@ bool ManifestParser::ParseEdge(string* err) {
         return false;
       if (in.empty())
         break;
-      ins.push_back(in);
-      ++order_only;
+      stmt->ins.push_back(in);
+      ++stmt->order_only;
     }
   }
 
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  // Bindings on edges are rare, so allocate per-edge envs only when needed.
-  bool has_indent_token = lexer_.PeekToken(Lexer::INDENT);
-  BindingEnv* env = has_indent_token ? new BindingEnv(env_) : env_;
-  while (has_indent_token) {
-    string key;
-    EvalString val;
-    if (!ParseLet(&key, &val, err))
+  while (lexer_.PeekToken(Lexer::INDENT)) {
+    ManifestBinding binding;
+    if (!ParseLet(&binding.key, &binding.value, err))
       return false;
+    stmt->bindings.push_back(binding);
+  }
+
+  stmt->lexer = lexer_;
+  stmt->complete = true;
+  return true;
+}
 
-    env->AddBinding(key, val.Evaluate(env_));
-    has_indent_token = lexer_.PeekToken(Lexer::INDENT);
+bool StatementParser::ParseFileInclude(Lexer::Token type, string* err) {
+  EvalString eval;
+  if (!lexer_.ReadPath(&eval, err))
+    return false;
+
+  ManifestStatement* stmt = AddStatement(type);
+  stmt->value = eval;
+  stmt->lexer = lexer_;
+
+  if (!ExpectToken(Lexer::NEWLINE, err))
+    return false;
+
+  stmt->complete = true;
+  return true;
+}
+
+bool StatementParser::ExpectToken(Lexer::Token expected, string* err) {
+  Lexer::Token token = lexer_.ReadToken();
+  if (token != expected) {
+    string message = string("expected ") + Lexer::TokenName(expected);
+    message += string(", got ") + Lexer::TokenName(token);
+    message += Lexer::TokenErrorHint(expected);
+    return lexer_.Error(message, err);
+  }
+  return true;
+}
+
+/// Read the file at |filename|, without splitting it into statements yet.
+/// If |reuse| kept the file with the same contents, return that instead,
+/// already split.
+ParsedManifest* ReadManifest(FileReader* file_reader, const string& filename,
+                             ManifestReuse* reuse, string* err) {
+  ParsedManifest* manifest = new ParsedManifest;
+  manifest->filename = filename;
+  // A mapped file is read straight from the page cache, rather than copied.
+  if (file_reader->MapFile(filename, &manifest->mapped)) {
+    manifest->text = StringPiece(manifest->mapped.data(),
+                                 manifest->mapped.size() + 1);
+  } else if (file_reader->ReadFile(filename, &manifest->contents, err) !=
+             FileReader::Okay) {
+    delete manifest;
+    return NULL;
+  } else {
+    // The lexer needs a nul byte at the end of its input, to know when it's
+    // done.  It takes a StringPiece, and StringPiece's string constructor
+    // uses string::data().  data()'s return value isn't guaranteed to be
+    // null-terminated (although in practice - libc++, libstdc++, msvc's stl
+    // -- it is, and C++11 demands that too), so add an explicit nul byte.
+    manifest->contents.resize(manifest->contents.size() + 1);
+    manifest->text = manifest->contents;
   }
+  if (!reuse)
+    return manifest;
+
+  // Generators often rewrite files they didn't change, so it's the contents
+  // that tell whether the kept statements still hold, not the mtime.  A
+  // kept file that was mapped then has the same bytes in its mapping.
+  manifest->hash = ContentHash::Hash(manifest->text.str_, manifest->text.len_);
+  ParsedManifest* kept = reuse->Take(filename, manifest->hash);
+  if (!kept)
+    return manifest;
+  delete manifest;
+  return kept;
+}
+
+void ParseManifestThread(void* arg, size_t index) {
+  ParsedManifest* manifest = (*static_cast<vector<ParsedManifest*>*>(arg))[index];
+  StatementParser(manifest).Parse();
+}
+
+}  // anonymous namespace
+
+ManifestParser::ManifestParser(State* state, FileReader* file_reader,
+                               ManifestParserOptions options)
+    : state_(state), file_reader_(file_reader),
+      options_(options), quiet_(false), prefetch_(NULL), includes_(NULL),
+      edge_envs_(NULL), unit_(0) {
+  env_ = &state->bindings_;
+}
+
+ParsedManifest* ManifestParser::Read(const string& filename, string* err,
+                                     const Lexer* parent) {
+  string read_err;
+  ParsedManifest* manifest = ReadManifest(file_reader_, filename,
+                                          options_.reuse_, &read_err);
+  if (!manifest) {
+    *err = "loading '" + filename + "': " + read_err;
+    if (parent)
+      parent->Error(string(*err), err);
+    return NULL;
+  }
+  if (!manifest->parsed)
+    StatementParser(manifest).Parse();
+  return manifest;
+}
+
+bool ManifestParser::Load(const string& filename, string* err,
+                          const Lexer* parent) {
+  METRIC_RECORD(".ninja parse");
+  ParsedManifest* manifest = Read(filename, err, parent);
+  if (!manifest)
+    return false;
+
+  ManifestIncludes includes(options_.reuse_);
+  BindingEnvCache edge_envs;
+  if (!includes_) {
+    includes_ = &includes;
+    edge_envs_ = &edge_envs;
+  }
+  bool success;
+  if (!prefetch_ && options_.parallelism_ > 1) {
+    ManifestPrefetch prefetch;
+    prefetch_ = &prefetch;
+    Prefetch(*manifest);
+    success = Apply(*manifest, err);
+    prefetch_ = NULL;
+  } else {
+    success = Apply(*manifest, err);
+  }
+  if (includes_ == &includes) {
+    includes_ = NULL;
+    edge_envs_ = NULL;
+  }
+  Release(manifest);
+  return success;
+}
+
+bool ManifestParser::Parse(const string& filename, const string& input,
+                           string* err) {
+  ParsedManifest manifest;
+  manifest.filename = filename;
+  manifest.contents = input;
+  manifest.text = manifest.contents;
+  StatementParser(&manifest).Parse();
+  ManifestIncludes includes(options_.reuse_);
+  BindingEnvCache edge_envs;
+  if (!includes_) {
+    includes_ = &includes;
+    edge_envs_ = &edge_envs;
+  }
+  bool success = Apply(manifest, err);
+  if (includes_ == &includes) {
+    includes_ = NULL;
+    edge_envs_ = NULL;
+  }
+  return success;
+}
+
+void ManifestParser::Release(ParsedManifest* manifest) {
+  if (options_.reuse_)
+    options_.reuse_->Keep(manifest);
+  else
+    delete manifest;
+}
+
+void ManifestParser::Prefetch(const ParsedManifest& manifest) {
+  METRIC_RECORD(".ninja parse ahead");
+  // Included paths usually don't depend on variables, but if they do, guess
+  // them using the bindings seen so far.  A wrong guess only means parsing
+  // something that isn't used: ApplyFileInclude() parses the right file
+  // when it doesn't find it here.
+  vector<pair<const ParsedManifest*, BindingEnv*> > level;
+  level.push_back(make_pair(&manifest, env_));
+  set<string> seen;
+  seen.insert(manifest.filename);
+  while (!level.empty()) {
+    // Reading is left to this thread, so that the FileReader doesn't need
+    // to be thread-safe.
+    vector<ParsedManifest*> batch;
+    vector<BindingEnv*> batch_scopes;
+    vector<ParsedManifest*> to_parse;
+    for (size_t i = 0; i < level.size(); ++i) {
+      BindingEnv* scope = new BindingEnv(level[i].second);
+      prefetch_->scopes_.push_back(scope);
+      const vector<ManifestStatement>& statements = level[i].first->statements;
+      for (vector<ManifestStatement>::const_iterator stmt = statements.begin();
+           stmt != statements.end(); ++stmt) {
+        if (stmt->type == Lexer::IDENT && stmt->complete) {
+          scope->AddBinding(stmt->name, stmt->value.Evaluate(scope));
+        } else if (stmt->type == Lexer::INCLUDE ||
+                   stmt->type == Lexer::SUBNINJA) {
+          string path = stmt->value.Evaluate(scope);
+          if (!seen.insert(path).second || IsSkipped(*stmt, path))
+            continue;
+          string err;
+          ParsedManifest* included = ReadManifest(file_reader_, path,
+                                                  options_.reuse_, &err);
+          if (!included)
+            continue;  // Reported when the statement is applied.
+          if (!included->parsed)
+            to_parse.push_back(included);
+          batch.push_back(included);
+          batch_scopes.push_back(scope);
+        }
+      }
+    }
+
+    ParallelFor(to_parse.size(), options_.parallelism_, ParseManifestThread,
+                &to_parse);
+
+    level.clear();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      prefetch_->manifests_[batch[i]->filename] = batch[i];
+      level.push_back(make_pair(batch[i], batch_scopes[i]));
+    }
+  }
+}
+
+bool ManifestParser::Apply(const ParsedManifest& manifest, string* err) {
+  const vector<ManifestStatement>& statements = manifest.statements;
+  for (vector<ManifestStatement>::const_iterator stmt = statements.begin();
+       stmt != statements.end(); ++stmt) {
+    switch (stmt->type) {
+    case Lexer::POOL:
+      if (!ApplyPool(*stmt, err))
+        return false;
+      break;
+    case Lexer::BUILD:
+      if (!ApplyEdge(*stmt, err))
+        return false;
+      break;
+    case Lexer::RULE:
+      if (!ApplyRule(*stmt, err))
+        return false;
+      break;
+    case Lexer::DEFAULT:
+      if (!ApplyDefault(*stmt, err))
+        return false;
+      break;
+    case Lexer::IDENT:
+      if (stmt->complete)
+        ApplyLet(*stmt);
+      break;
+    case Lexer::INCLUDE:
+      if (!ApplyFileInclude(*stmt, false, err))
+        return false;
+      break;
+    case Lexer::SUBNINJA:
+      if (!ApplyFileInclude(*stmt, true, err))
+        return false;
+      break;
+    case Lexer::ERROR:
+      *err = stmt->name;
+      return false;
+    default:
+      assert(false);
+    }
+  }
+  return true;
+}
+
+
+bool ManifestParser::ApplyPool(const ManifestStatement& stmt, string* err) {
+  if (state_->LookupPool(stmt.name) != NULL)
+    return stmt.name_lexer.Error("duplicate pool '" + stmt.name + "'", err);
+
+  int depth = -1;
+  bool remote = true;
+  bool shared = false;
+  vector<int> cpus;
+
+  for (vector<ManifestBinding>::const_iterator i = stmt.bindings.begin();
+       i != stmt.bindings.end(); ++i) {
+    if (i->key == "depth") {
+      string depth_string = i->value.Evaluate(env_);
+      depth = atol(depth_string.c_str());
+      if (depth < 0)
+        return i->lexer.Error("invalid pool depth", err);
+    } else if (i->key == "remote") {
+      string remote_string = i->value.Evaluate(env_);
+      if (remote_string != "0" && remote_string != "1")
+        return i->lexer.Error("expected 'remote = 0' or 'remote = 1'", err);
+      remote = remote_string == "1";
+    } else if (i->key == "cpus") {
+      if (!ParseCpuList(i->value.Evaluate(env_), &cpus))
+        return i->lexer.Error("invalid cpu list", err);
+    } else if (i->key == "shared") {
+      string shared_string = i->value.Evaluate(env_);
+      if (shared_string != "0" && shared_string != "1")
+        return i->lexer.Error("expected 'shared = 0' or 'shared = 1'", err);
+      shared = shared_string == "1";
+    }
+  }
+  if (!stmt.complete)
+    return true;
+
+  if (depth < 0)
+    return stmt.lexer.Error("expected 'depth =' line", err);
+  if (shared && depth == 0)
+    return stmt.lexer.Error("a shared pool needs a depth", err);
+
+  Pool* pool = new Pool(stmt.name, depth);
+  pool->set_remote(remote);
+  pool->set_cpus(cpus);
+  pool->set_shared(shared);
+  state_->AddPool(pool);
+  if (options_.index_)
+    options_.index_->AddPool(unit_, stmt.name);
+  return true;
+}
+
+
+bool ManifestParser::ApplyRule(const ManifestStatement& stmt, string* err) {
+  if (env_->LookupRuleCurrentScope(stmt.name) != NULL)
+    return stmt.name_lexer.Error("duplicate rule '" + stmt.name + "'", err);
+  if (!stmt.complete)
+    return true;
+
+  Rule* rule = new Rule(stmt.name);  // XXX scoped_ptr
+  for (vector<ManifestBinding>::const_iterator i = stmt.bindings.begin();
+       i != stmt.bindings.end(); ++i) {
+    rule->AddBinding(i->key, i->value);
+  }
+
+  if (rule->bindings_[VarNames::kRspfile].empty() !=
+      rule->bindings_[VarNames::kRspfileContent].empty()) {
+    return stmt.lexer.Error("rspfile and rspfile_content need to be "
+                            "both specified", err);
+  }
+
+  if (rule->bindings_[VarNames::kCommand].empty())
+    return stmt.lexer.Error("expected 'command =' line", err);
+
+  env_->AddRule(rule);
+  return true;
+}
+
+void ManifestParser::ApplyLet(const ManifestStatement& stmt) {
+  string value = stmt.value.Evaluate(env_);
+  // Check ninja_required_version immediately so we can exit
+  // before encountering any syntactic surprises.
+  if (stmt.name == "ninja_required_version")
+    CheckNinjaVersion(value);
+  env_->AddBinding(stmt.name, value);
+}
+
+bool ManifestParser::ApplyDefault(const ManifestStatement& stmt, string* err) {
+  for (size_t i = 0; i < stmt.ins.size(); ++i) {
+    string path = stmt.ins[i].Evaluate(env_);
+    string path_err;
+    uint64_t slash_bits;  // Unused because this only does lookup.
+    if (!CanonicalizePath(&path, &slash_bits, &path_err))
+      return stmt.in_lexers[i].Error(path_err, err);
+    if (!state_->AddDefault(path, &path_err))
+      return stmt.in_lexers[i].Error(path_err, err);
+  }
+  return true;
+}
+
+bool ManifestParser::ApplyEdge(const ManifestStatement& stmt, string* err) {
+  const Rule* rule = env_->LookupRule(stmt.name);
+  if (!rule)
+    return stmt.name_lexer.Error("unknown build rule '" + stmt.name + "'", err);
+  if (!stmt.complete)
+    return true;
+
+  // Bindings on edges are rare, so allocate per-edge envs only when needed.
+  // The edges with the same bindings in a scope then share one.
+  BindingEnv* env = !stmt.bindings.empty() ? new BindingEnv(env_) : env_;
+  for (vector<ManifestBinding>::const_iterator i = stmt.bindings.begin();
+       i != stmt.bindings.end(); ++i) {
+    env->AddBinding(i->key, i->value.Evaluate(env_));
+  }
+  if (env != env_ && edge_envs_)
+    env = edge_envs_->Intern(env);
 
   Edge* edge = state_->AddEdge(rule);
   edge->env_ = env;
 
-  string pool_name = edge->GetBinding("pool");
+  string pool_name = edge->GetBinding(VarNames::kPool);
   if (!pool_name.empty()) {
     Pool* pool = state_->LookupPool(pool_name);
     if (pool == NULL)
-      return lexer_.Error("unknown pool name '" + pool_name + "'", err);
+      return stmt.lexer.Error("unknown pool name '" + pool_name + "'", err);
     edge->pool_ = pool;
   }
 
-  edge->outputs_.reserve(outs.size());
-  for (size_t i = 0, e = outs.size(); i != e; ++i) {
-    string path = outs[i].Evaluate(env);
+  string weight = edge->GetBinding(VarNames::kWeight);
+  if (!weight.empty()) {
+    char* end;
+    long value = strtol(weight.c_str(), &end, 10);
+    if (*end != 0 || value < 1 || value > INT_MAX)
+      return stmt.lexer.Error("invalid weight '" + weight + "'", err);
+    edge->weight_ = value;
+    if (edge->pool_->depth() != 0 && edge->weight_ > edge->pool_->depth())
+      return stmt.lexer.Error("weight " + weight + " exceeds depth of pool '" +
+                              edge->pool_->name() + "'", err);
+  }
+
+  string priority = edge->GetBinding(VarNames::kPriority);
+  if (!priority.empty()) {
+    char* end;
+    long value = strtol(priority.c_str(), &end, 10);
+    if (*end != 0 || value < INT_MIN || value > INT_MAX)
+      return stmt.lexer.Error("invalid priority '" + priority + "'", err);
+    edge->priority_ = value;
+    edge->scheduling_priority_ = value;
+  }
+
+  int implicit_outs = stmt.implicit_outs;
+  edge->outputs_.reserve(stmt.outs.size());
+  for (size_t i = 0, e = stmt.outs.size(); i != e; ++i) {
+    string path = stmt.outs[i].Evaluate(env);
     string path_err;
     uint64_t slash_bits;
     if (!CanonicalizePath(&path, &slash_bits, &path_err))
-      return lexer_.Error(path_err, err);
+      return stmt.lexer.Error(path_err, err);
     if (!state_->AddOut(edge, path, slash_bits)) {
       if (options_.dupe_edge_action_ == kDupeEdgeActionError) {
-        lexer_.Error("multiple rules generate " + path + " [-w dupbuild=err]",
-                     err);
+        stmt.lexer.Error("multiple rules generate " + path +
+                         " [-w dupbuild=err]", err);
         return false;
       } else {
         if (!quiet_) {
@@ -365,23 +949,23 @@ bool ManifestParser::ParseEdge(string* err) {
   if (edge->outputs_.empty()) {
     // All outputs of the edge are already created by other edges. Don't add
     // this edge.  Do this check before input nodes are connected to the edge.
-    state_->edges_.pop_back();
-    delete edge;
+    state_->RemoveLastEdge();
     return true;
   }
   edge->implicit_outs_ = implicit_outs;
 
-  edge->inputs_.reserve(ins.size());
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
+  edge->inputs_.reserve(stmt.ins.size());
+  for (vector<EvalString>::const_iterator i = stmt.ins.begin();
+       i != stmt.ins.end(); ++i) {
     string path = i->Evaluate(env);
     string path_err;
     uint64_t slash_bits;
     if (!CanonicalizePath(&path, &slash_bits, &path_err))
-      return lexer_.Error(path_err, err);
+      return stmt.lexer.Error(path_err, err);
     state_->AddIn(edge, path, slash_bits);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
+  edge->implicit_deps_ = stmt.implicit;
+  edge->order_only_deps_ = stmt.order_only;
 
   if (options_.phony_cycle_action_ == kPhonyCycleActionWarn &&
       edge->maybe_phonycycle_diagnostic()) {
@@ -397,51 +981,118 @@ bool ManifestParser::ParseEdge(string* err) {
       if (!quiet_) {
         Warning("phony target '%s' names itself as an input; "
                 "ignoring [-w phonycycle=warn]",
-                out->path().c_str());
+                out->path_c_str());
       }
     }
   }
 
   // Multiple outputs aren't (yet?) supported with depslog.
-  string deps_type = edge->GetBinding("deps");
+  string deps_type = edge->GetBinding(VarNames::kDeps);
   if (!deps_type.empty() && edge->outputs_.size() > 1) {
-    return lexer_.Error("multiple outputs aren't (yet?) supported by depslog; "
-                        "bring this up on the mailing list if it affects you",
-                        err);
+    return stmt.lexer.Error("multiple outputs aren't (yet?) supported by "
+                            "depslog; bring this up on the mailing list if "
+                            "it affects you", err);
+  }
+
+  // Lookup, validate, and save any dyndep binding.  It will be used later
+  // to load generated dependency information dynamically, but it must
+  // be one of our manifest-specified inputs.
+  string dyndep = edge->GetUnescapedDyndep();
+  if (!dyndep.empty()) {
+    string path_err;
+    uint64_t slash_bits;
+    if (!CanonicalizePath(&dyndep, &slash_bits, &path_err))
+      return stmt.lexer.Error(path_err, err);
+    edge->dyndep_ = state_->GetNode(dyndep, slash_bits);
+    edge->dyndep_->set_dyndep_pending(true);
+    if (find(edge->inputs_.begin(), edge->inputs_.end(), edge->dyndep_) ==
+        edge->inputs_.end()) {
+      return stmt.lexer.Error("dyndep '" + dyndep + "' is not an input", err);
+    }
+    // The dyndep file may add a restat binding to the edge, which must not
+    // reach the other edges of the scope, or those with the same bindings.
+    if (edge->env_ == env_)
+      edge->env_ = new BindingEnv(env_);
+    else if (edge_envs_)
+      edge->env_ = new BindingEnv(*edge->env_);
   }
 
+  if (options_.index_)
+    options_.index_->AddEdge(unit_, edge);
   return true;
 }
 
-bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
-    return false;
-  string path = eval.Evaluate(env_);
+bool ManifestParser::ApplyFileInclude(const ManifestStatement& stmt,
+                                      bool new_scope, string* err) {
+  string path = stmt.value.Evaluate(env_);
+  if (IsSkipped(stmt, path))
+    return true;
 
   ManifestParser subparser(state_, file_reader_, options_);
+  subparser.prefetch_ = prefetch_;
   if (new_scope) {
     subparser.env_ = new BindingEnv(env_);
   } else {
     subparser.env_ = env_;
   }
+  subparser.unit_ = unit_;
+  if (options_.index_) {
+    if (new_scope)
+      subparser.unit_ = options_.index_->AddSubninja(unit_, path);
+    else
+      options_.index_->AddInclude(unit_, path);
+  }
 
-  if (!subparser.Load(path, err, &lexer_))
-    return false;
+  subparser.includes_ = includes_;
+  subparser.edge_envs_ = edge_envs_;
+  if (!new_scope && includes_) {
+    if (const IncludedManifest* file = includes_->Find(path))
+      return subparser.Replay(*file, err);
+    ParsedManifest* manifest = prefetch_ ? prefetch_->Take(path) : NULL;
+    if (!manifest && !(manifest = Read(path, err, &stmt.lexer)))
+      return false;
+    bool success = subparser.Apply(*manifest, err);
+    includes_->Add(manifest, env_);
+    return success;
+  }
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+  ParsedManifest* manifest = prefetch_ ? prefetch_->Take(path) : NULL;
+  if (manifest) {
+    bool success = subparser.Apply(*manifest, err);
+    Release(manifest);
+    if (!success)
+      return false;
+  } else if (!subparser.Load(path, err, &stmt.lexer)) {
     return false;
+  }
 
   return true;
 }
 
-bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
-  Lexer::Token token = lexer_.ReadToken();
-  if (token != expected) {
-    string message = string("expected ") + Lexer::TokenName(expected);
-    message += string(", got ") + Lexer::TokenName(token);
-    message += Lexer::TokenErrorHint(expected);
-    return lexer_.Error(message, err);
+bool ManifestParser::Replay(const IncludedManifest& file, string* err) {
+  if (!file.replayable)
+    return Apply(*file.manifest, err);
+
+  for (vector<IncludedManifest::Definition>::const_iterator i =
+           file.definitions.begin(); i != file.definitions.end(); ++i) {
+    const ManifestStatement& stmt = *i->stmt;
+    if (!i->rule) {
+      // As ApplyLet() does.
+      if (stmt.name == "ninja_required_version")
+        CheckNinjaVersion(i->value);
+      env_->AddBinding(stmt.name, i->value);
+      continue;
+    }
+    // The same Rule is shared by the scopes, as nothing changes it.
+    if (env_->LookupRuleCurrentScope(stmt.name) != NULL)
+      return stmt.name_lexer.Error("duplicate rule '" + stmt.name + "'", err);
+    env_->AddRule(i->rule);
   }
   return true;
 }
+
+bool ManifestParser::IsSkipped(const ManifestStatement& stmt,
+                               const string& path) const {
+  return stmt.type == Lexer::SUBNINJA && options_.skip_subninjas_ &&
+      options_.skip_subninjas_->count(path);
+}
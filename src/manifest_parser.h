@@ -15,15 +15,26 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <map>
+#include <set>
 #include <string>
 
 using namespace std;
 
 #include "lexer.h"
+#include "util.h"  // uint64_t
 
 struct BindingEnv;
+struct BindingEnvCache;
 struct EvalString;
 struct FileReader;
+struct IncludedManifest;
+struct ManifestIncludes;
+struct ManifestIndexBuilder;
+struct ManifestPrefetch;
+struct ManifestReuse;
+struct ManifestStatement;
+struct ParsedManifest;
 struct State;
 
 enum DupeEdgeAction {
@@ -39,18 +50,61 @@ enum PhonyCycleAction {
 struct ManifestParserOptions {
   ManifestParserOptions()
       : dupe_edge_action_(kDupeEdgeActionWarn),
-        phony_cycle_action_(kPhonyCycleActionWarn) {}
+        phony_cycle_action_(kPhonyCycleActionWarn),
+        parallelism_(1), index_(NULL), skip_subninjas_(NULL),
+        reuse_(NULL) {}
   DupeEdgeAction dupe_edge_action_;
   PhonyCycleAction phony_cycle_action_;
+  /// Number of threads parsing the files reached through 'subninja' and
+  /// 'include' ahead of time.  1 parses each file when it's reached.
+  int parallelism_;
+  /// Where to record which 'subninja' file each edge and pool comes from,
+  /// if anywhere.
+  ManifestIndexBuilder* index_;
+  /// The 'subninja' files to leave out, for a build that doesn't need them.
+  const set<string>* skip_subninjas_;
+  /// Where to keep the files split into statements, and to take back the
+  /// ones that didn't change since the last load, if anywhere.
+  ManifestReuse* reuse_;
 };
 
-/// Parses .ninja files.
+/// The files that loading a manifest split into statements, kept for the
+/// next load.  When a generator rewrites the manifest, loading it again only
+/// splits the files whose contents changed, and evaluates the statements
+/// kept here for the others.
+struct ManifestReuse {
+  ManifestReuse() : reused_(0) {}
+  ~ManifestReuse() { Clear(); }
+
+  /// Hand over the file kept for |path| if its contents hashed to |hash|,
+  /// or return NULL.  A file with other contents is dropped.
+  ParsedManifest* Take(const string& path, uint64_t hash);
+
+  /// Keep |manifest|, replacing any file kept for the same path.
+  void Keep(ParsedManifest* manifest);
+
+  /// Drop all the files kept.
+  void Clear();
+
+  size_t size() const { return manifests_.size(); }
+
+  /// The number of files taken back so far.
+  int reused() const { return reused_; }
+
+ private:
+  map<string, ParsedManifest*> manifests_;
+  int reused_;
+};
+
+/// Parses .ninja files.  Each file is first split into statements, which
+/// only needs the file's text, and the statements are then evaluated and
+/// added to the State in order.
 struct ManifestParser {
   ManifestParser(State* state, FileReader* file_reader,
                  ManifestParserOptions options = ManifestParserOptions());
 
   /// Load and parse a file.
-  bool Load(const string& filename, string* err, Lexer* parent = NULL);
+  bool Load(const string& filename, string* err, const Lexer* parent = NULL);
 
   /// Parse a text string of input.  Used by tests.
   bool ParseTest(const string& input, string* err) {
@@ -62,26 +116,51 @@ private:
   /// Parse a file, given its contents as a string.
   bool Parse(const string& filename, const string& input, string* err);
 
-  /// Parse various statement types.
-  bool ParsePool(string* err);
-  bool ParseRule(string* err);
-  bool ParseLet(string* key, EvalString* val, string* err);
-  bool ParseEdge(string* err);
-  bool ParseDefault(string* err);
+  /// Add the statements of a parsed file to the state, in order.
+  bool Apply(const ParsedManifest& manifest, string* err);
+
+  /// Apply the various statement types.
+  bool ApplyPool(const ManifestStatement& stmt, string* err);
+  bool ApplyRule(const ManifestStatement& stmt, string* err);
+  void ApplyLet(const ManifestStatement& stmt);
+  bool ApplyEdge(const ManifestStatement& stmt, string* err);
+  bool ApplyDefault(const ManifestStatement& stmt, string* err);
+
+  /// Apply either a 'subninja' or 'include' line.
+  bool ApplyFileInclude(const ManifestStatement& stmt, bool new_scope,
+                        string* err);
+
+  /// Add what a file that was included before defines to the scope again.
+  bool Replay(const IncludedManifest& file, string* err);
+
+  /// Read the file at |filename| and split it into statements, or return
+  /// NULL.  |parent| is the statement including it, if any, for errors.
+  ParsedManifest* Read(const string& filename, string* err,
+                       const Lexer* parent);
+
+  /// Whether |stmt|, which reaches |path|, is a 'subninja' to leave out.
+  bool IsSkipped(const ManifestStatement& stmt, const string& path) const;
 
-  /// Parse either a 'subninja' or 'include' line.
-  bool ParseFileInclude(bool new_scope, string* err);
+  /// Hand |manifest| over to options_.reuse_ if there is one, or delete it.
+  void Release(ParsedManifest* manifest);
 
-  /// If the next token is not \a expected, produce an error string
-  /// saying "expectd foo, got bar".
-  bool ExpectToken(Lexer::Token expected, string* err);
+  /// Read and parse the files |manifest| includes, and the files those
+  /// include, using options_.parallelism_ threads.
+  void Prefetch(const ParsedManifest& manifest);
 
   State* state_;
   BindingEnv* env_;
   FileReader* file_reader_;
-  Lexer lexer_;
   ManifestParserOptions options_;
   bool quiet_;
+  /// Files parsed ahead of time, shared with the parsers of included files.
+  ManifestPrefetch* prefetch_;
+  /// The files included so far, shared with the parsers of included files.
+  ManifestIncludes* includes_;
+  /// The scopes of the build statements with bindings, shared likewise.
+  BindingEnvCache* edge_envs_;
+  /// The unit of options_.index_ that the statements belong to.
+  int unit_;
 };
 
 #endif  // NINJA_MANIFEST_PARSER_H_
@@ -31,7 +31,9 @@
 #endif
 
 #include "disk_interface.h"
+#include "eval_env.h"
 #include "graph.h"
+#include "lexer.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
@@ -52,11 +54,77 @@ bool WriteFakeManifests(const string& dir, string* err) {
   return exit_code == 0;
 }
 
-int LoadManifests(bool measure_command_evaluation) {
+/// Run the lexer alone over |filename| and the files it includes, making
+/// the calls that the parser would.  Returns the number of bytes lexed.
+int64_t LexManifest(const string& filename) {
+  string contents, err;
+  if (ReadFile(filename, &contents, &err) < 0)
+    Fatal("%s: %s", filename.c_str(), err.c_str());
+  int64_t bytes = contents.size();
+
+  Lexer lexer;
+  lexer.Start(filename, contents);
+  BindingEnv env;
+  EvalString eval;
+  string ident;
+  for (;;) {
+    Lexer::Token token = lexer.ReadToken();
+    switch (token) {
+    case Lexer::TEOF:
+      return bytes;
+    case Lexer::BUILD:
+    case Lexer::DEFAULT:
+      // Lists of paths, separated by '|', '||' and ': rule'.
+      for (;;) {
+        eval.Clear();
+        if (!lexer.ReadPath(&eval, &err))
+          Fatal("%s", err.c_str());
+        if (!eval.empty())
+          continue;
+        token = lexer.ReadToken();
+        if (token == Lexer::COLON)
+          lexer.ReadIdent(&ident);
+        else if (token != Lexer::PIPE && token != Lexer::PIPE2)
+          break;
+      }
+      break;
+    case Lexer::RULE:
+    case Lexer::POOL:
+      lexer.ReadIdent(&ident);
+      break;
+    case Lexer::INCLUDE:
+    case Lexer::SUBNINJA:
+      eval.Clear();
+      if (!lexer.ReadPath(&eval, &err))
+        Fatal("%s", err.c_str());
+      bytes += LexManifest(eval.Evaluate(&env));
+      break;
+    case Lexer::IDENT:
+      lexer.UnreadToken();
+      // A top-level "name = value".
+      NINJA_FALLTHROUGH;
+    case Lexer::INDENT:
+      lexer.ReadIdent(&ident);
+      lexer.ReadToken();
+      eval.Clear();
+      if (!lexer.ReadVarValue(&eval, &err))
+        Fatal("%s", err.c_str());
+      break;
+    case Lexer::ERROR:
+      Fatal("%s: lexing error", filename.c_str());
+    default:
+      break;
+    }
+  }
+}
+
+int LoadManifests(bool measure_command_evaluation, int parallelism) {
   string err;
   RealDiskInterface disk_interface;
   State state;
-  ManifestParser parser(&state, &disk_interface);
+  ManifestParserOptions options;
+  options.parallelism_ = parallelism;
+  ManifestParser parser(&state, &disk_interface, options);
   if (!parser.Load("build.ninja", &err)) {
     fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
     exit(1);
@@ -73,19 +141,24 @@ int LoadManifests(bool measure_command_evaluation) {
 
 int main(int argc, char* argv[]) {
   bool measure_command_evaluation = true;
+  int parallelism = GetProcessorCount();
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("fh"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("fj:h"))) != -1) {
     switch (opt) {
     case 'f':
       measure_command_evaluation = false;
       break;
+    case 'j':
+      parallelism = atoi(optarg);
+      break;
     case 'h':
     default:
       printf("usage: manifest_parser_perftest\n"
 "\n"
 "options:\n"
 "  -f     only measure manifest load time, not command evaluation time\n"
-             );
+"  -j N   also measure parsing subninjas with N threads [default=%d]\n",
+             GetProcessorCount());
     return 1;
     }
   }
@@ -101,18 +174,39 @@ int main(int argc, char* argv[]) {
   if (chdir(kManifestDir) < 0)
     Fatal("chdir: %s", strerror(errno));
 
+  // Lexing on its own first, to tell it apart from the rest of parsing.
   const int kNumRepetitions = 5;
-  vector<int> times;
+  int64_t bytes = 0;
+  vector<int> lex_times;
   for (int i = 0; i < kNumRepetitions; ++i) {
     int64_t start = GetTimeMillis();
-    int optimization_guard = LoadManifests(measure_command_evaluation);
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms (hash: %x)\n", delta, optimization_guard);
-    times.push_back(delta);
+    bytes = LexManifest("build.ninja");
+    lex_times.push_back((int)(GetTimeMillis() - start));
   }
+  int lex_min = *min_element(lex_times.begin(), lex_times.end());
+  printf("lexing: min %dms for %.1fMB (%.0fMB/s)\n", lex_min,
+         bytes / 1e6, lex_min > 0 ? bytes / 1e3 / lex_min : 0.0);
 
-  int min = *min_element(times.begin(), times.end());
-  int max = *max_element(times.begin(), times.end());
-  float total = accumulate(times.begin(), times.end(), 0.0f);
-  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+  // Measure a serial parse first, then the parallel one to compare with.
+  vector<int> thread_counts(1, 1);
+  if (parallelism > 1)
+    thread_counts.push_back(parallelism);
+
+  for (size_t j = 0; j < thread_counts.size(); ++j) {
+    printf("%d thread%s:\n", thread_counts[j], thread_counts[j] > 1 ? "s" : "");
+    vector<int> times;
+    for (int i = 0; i < kNumRepetitions; ++i) {
+      int64_t start = GetTimeMillis();
+      int optimization_guard =
+          LoadManifests(measure_command_evaluation, thread_counts[j]);
+      int delta = (int)(GetTimeMillis() - start);
+      printf("%dms (hash: %x)\n", delta, optimization_guard);
+      times.push_back(delta);
+    }
+
+    int min = *min_element(times.begin(), times.end());
+    int max = *max_element(times.begin(), times.end());
+    float total = accumulate(times.begin(), times.end(), 0.0f);
+    printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+  }
 }
@@ -63,13 +63,52 @@ TEST_F(ParserTest, RuleAttributes) {
 "  depfile = a\n"
 "  deps = a\n"
 "  description = a\n"
+"  dyndep = a\n"
 "  generator = a\n"
+"  priority = a\n"
 "  restat = a\n"
 "  rspfile = a\n"
 "  rspfile_content = a\n"
 ));
 }
 
+TEST_F(ParserTest, PoolRemote) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 1\n"
+"  remote = 0\n"
+"pool compile\n"
+"  depth = 4\n"
+));
+  EXPECT_FALSE(state.LookupPool("link")->remote());
+  EXPECT_TRUE(state.LookupPool("compile")->remote());
+}
+
+TEST_F(ParserTest, PoolCpus) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 1\n"
+"  cpus = 0-2,8\n"
+));
+  const vector<int>& cpus = state.LookupPool("link")->cpus();
+  ASSERT_EQ(4u, cpus.size());
+  EXPECT_EQ(0, cpus[0]);
+  EXPECT_EQ(2, cpus[2]);
+  EXPECT_EQ(8, cpus[3]);
+}
+
+TEST_F(ParserTest, PoolShared) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 2\n"
+"  shared = 1\n"
+"pool compile\n"
+"  depth = 4\n"
+));
+  EXPECT_TRUE(state.LookupPool("link")->shared());
+  EXPECT_FALSE(state.LookupPool("compile")->shared());
+}
+
 TEST_F(ParserTest, IgnoreIndentedComments) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "  #indented comment\n"
@@ -85,8 +124,8 @@ TEST_F(ParserTest, IgnoreIndentedComments) {
   const Rule* rule = state.bindings_.GetRules().begin()->second;
   EXPECT_EQ("cat", rule->name());
   Edge* edge = state.GetNode("result", 0)->in_edge();
-  EXPECT_TRUE(edge->GetBindingBool("restat"));
-  EXPECT_FALSE(edge->GetBindingBool("generator"));
+  EXPECT_TRUE(edge->GetBindingBool(VarNames::kRestat));
+  EXPECT_FALSE(edge->GetBindingBool(VarNames::kGenerator));
 }
 
 TEST_F(ParserTest, IgnoreIndentedBlankLines) {
@@ -823,6 +862,56 @@ TEST_F(ParserTest, Errors) {
               , err);
   }
 
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 1\n"
+                                  "  remote = yes\n", &err));
+    EXPECT_EQ("input:3: expected 'remote = 0' or 'remote = 1'\n"
+              "  remote = yes\n"
+              "              ^ near here"
+              , err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 1\n"
+                                  "  cpus = 3-1\n", &err));
+    EXPECT_EQ("input:3: invalid cpu list\n"
+              "  cpus = 3-1\n"
+              "            ^ near here"
+              , err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 1\n"
+                                  "  shared = yes\n", &err));
+    EXPECT_EQ("input:3: expected 'shared = 0' or 'shared = 1'\n"
+              "  shared = yes\n"
+              "              ^ near here"
+              , err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 0\n"
+                                  "  shared = 1\n", &err));
+    EXPECT_EQ("input:4: a shared pool needs a depth\n",
+              err.substr(0, err.find('\n') + 1));
+  }
+
   {
     State local_state;
     ManifestParser parser(&local_state, NULL);
@@ -834,6 +923,42 @@ TEST_F(ParserTest, Errors) {
                                   "build out: run in\n", &err));
     EXPECT_EQ("input:5: unknown pool name 'unnamed_pool'\n", err);
   }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  weight = 0\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: invalid weight '0'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  priority = high\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: invalid priority 'high'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool link\n"
+                                  "  depth = 2\n"
+                                  "rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = link\n"
+                                  "build out: run in\n"
+                                  "  weight = 3\n", &err));
+    EXPECT_EQ("input:8: weight 3 exceeds depth of pool 'link'\n", err);
+  }
 }
 
 TEST_F(ParserTest, MissingInput) {
@@ -890,6 +1015,123 @@ TEST_F(ParserTest, SubNinja) {
   EXPECT_EQ("varref outer", state.edges_[2]->EvaluateCommand());
 }
 
+TEST_F(ParserTest, ParallelSubNinja) {
+  fs_.Create("build.ninja",
+"rule varref\n"
+"  command = varref $var\n"
+"var = top\n"
+"build out0: varref\n"
+"dir = sub\n"
+"subninja $dir/one.ninja\n"
+"dir = wrongguess\n"
+"subninja sub/two.ninja\n"
+"build out3: varref\n");
+  fs_.Create("sub/one.ninja",
+"var = one\n"
+"build out1: varref\n"
+"include sub/common.ninja\n");
+  fs_.Create("sub/two.ninja",
+"var = two\n"
+"include sub/common.ninja\n"
+"build out2: varref\n");
+  fs_.Create("sub/common.ninja",
+"build out_$var: varref\n");
+
+  ManifestParserOptions options;
+  options.parallelism_ = 4;
+  ManifestParser parser(&state, &fs_, options);
+  string err;
+  EXPECT_TRUE(parser.Load("build.ninja", &err));
+  ASSERT_EQ("", err);
+  VerifyGraph(state);
+
+  // Edges come in the order of a serial parse.
+  ASSERT_EQ(6u, state.edges_.size());
+  const char* kOutputs[] = {
+    "out0", "out1", "out_one", "out_two", "out2", "out3"
+  };
+  const char* kCommands[] = {
+    "varref top", "varref one", "varref one", "varref two", "varref two",
+    "varref top"
+  };
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    EXPECT_EQ(kOutputs[i], state.edges_[i]->outputs_[0]->path());
+    EXPECT_EQ(kCommands[i], state.edges_[i]->EvaluateCommand());
+  }
+}
+
+TEST_F(ParserTest, ParallelSubNinjaError) {
+  fs_.Create("build.ninja",
+"rule cat\n"
+"  command = cat\n"
+"subninja one.ninja\n"
+"build $\n");
+  fs_.Create("one.ninja",
+"build out: nosuchrule\n");
+
+  ManifestParserOptions options;
+  options.parallelism_ = 4;
+  ManifestParser parser(&state, &fs_, options);
+  string err;
+  // The error in the subninja comes first, as it would in a serial parse.
+  EXPECT_FALSE(parser.Load("build.ninja", &err));
+  EXPECT_EQ("one.ninja:1: unknown build rule 'nosuchrule'\n"
+            "build out: nosuchrule\n"
+            "           ^ near here"
+            , err);
+}
+
+TEST_F(ParserTest, ReuseUnchangedFiles) {
+  fs_.Create("build.ninja",
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja one.ninja\n"
+"subninja two.ninja\n");
+  fs_.Create("one.ninja", "build one: cat in1\n");
+  fs_.Create("two.ninja", "build two: cat in2\n");
+
+  for (int parallelism = 1; parallelism <= 4; parallelism += 3) {
+    ManifestReuse reuse;
+    ManifestParserOptions options;
+    options.parallelism_ = parallelism;
+    options.reuse_ = &reuse;
+    {
+      State state;
+      ManifestParser parser(&state, &fs_, options);
+      string err;
+      EXPECT_TRUE(parser.Load("build.ninja", &err));
+      ASSERT_EQ("", err);
+    }
+    EXPECT_EQ(3u, reuse.size());
+    EXPECT_EQ(0, reuse.reused());
+
+    // A generator rewrites every file, but only changes one of them.
+    fs_.Tick();
+    fs_.Create("build.ninja",
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja one.ninja\n"
+"subninja two.ninja\n");
+    fs_.Create("one.ninja", "build one: cat in1\n");
+    fs_.Create("two.ninja", "build two: cat in2 in3\n");
+
+    State state;
+    ManifestParser parser(&state, &fs_, options);
+    string err;
+    EXPECT_TRUE(parser.Load("build.ninja", &err));
+    ASSERT_EQ("", err);
+    VerifyGraph(state);
+    EXPECT_EQ(2, reuse.reused());
+    EXPECT_EQ(3u, reuse.size());
+
+    ASSERT_EQ(2u, state.edges_.size());
+    EXPECT_EQ("cat in1 > one", state.edges_[0]->EvaluateCommand());
+    EXPECT_EQ("cat in2 in3 > two", state.edges_[1]->EvaluateCommand());
+
+    fs_.Create("two.ninja", "build two: cat in2\n");
+  }
+}
+
 TEST_F(ParserTest, MissingSubNinja) {
   ManifestParser parser(&state, &fs_);
   string err;
@@ -935,6 +1177,84 @@ TEST_F(ParserTest, Include) {
   EXPECT_EQ("inner", state.bindings_.LookupVariable("var"));
 }
 
+TEST_F(ParserTest, IncludeReadOnce) {
+  fs_.Create("rules.ninja",
+"cc = gcc\n"
+"cflags = -O2\n"
+"ccflags = $cc $cflags\n"
+"rule cc\n"
+"  command = $ccflags -c $in -o $out\n");
+  fs_.Create("depends.ninja",
+"flags = $base -g\n");
+  fs_.Create("a.ninja",
+"base = a\n"
+"include rules.ninja\n"
+"include depends.ninja\n"
+"build a.o: cc a.c\n"
+"  extra = $flags\n");
+  fs_.Create("b.ninja",
+"base = b\n"
+"include depends.ninja\n"
+"include rules.ninja\n"
+"build b.o: cc b.c\n"
+"  extra = $flags\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"subninja a.ninja\n"
+"subninja b.ninja\n"));
+
+  // Each included file is only read once.
+  EXPECT_EQ(4u, fs_.files_read_.size());
+  Edge* a = state.GetNode("a.o", 0)->in_edge();
+  Edge* b = state.GetNode("b.o", 0)->in_edge();
+  EXPECT_EQ("gcc -O2 -c a.c -o a.o", a->EvaluateCommand());
+  EXPECT_EQ("gcc -O2 -c b.c -o b.o", b->EvaluateCommand());
+  EXPECT_EQ(&a->rule(), &b->rule());
+  // A file whose variables depend on the scope is evaluated again.
+  EXPECT_EQ("a -g", a->GetBinding("extra"));
+  EXPECT_EQ("b -g", b->GetBinding("extra"));
+}
+
+TEST_F(ParserTest, IncludeDuplicateRule) {
+  fs_.Create("rules.ninja",
+"rule cat\n"
+"  command = cat\n");
+  ManifestParser parser(&state, &fs_);
+  string err;
+  EXPECT_FALSE(parser.ParseTest("include rules.ninja\n"
+                                "include rules.ninja\n", &err));
+  EXPECT_EQ("rules.ninja:1: duplicate rule 'cat'\n"
+            "rule cat\n"
+            "        ^ near here"
+            , err);
+}
+
+TEST_F(ParserTest, SharedEdgeBindings) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cc\n"
+"  command = cc $cflags $in -o $out\n"
+"flags = -O2\n"
+"build a.o: cc a.c\n"
+"  cflags = $flags -g\n"
+"build b.o: cc b.c\n"
+"  cflags = -O2 -g\n"
+"build c.o: cc c.c\n"
+"  cflags = -O0\n"
+"build d.o: cc d.c || d.dd\n"
+"  cflags = -O2 -g\n"
+"  dyndep = d.dd\n"));
+
+  Edge* a = state.GetNode("a.o", 0)->in_edge();
+  Edge* b = state.GetNode("b.o", 0)->in_edge();
+  Edge* c = state.GetNode("c.o", 0)->in_edge();
+  Edge* d = state.GetNode("d.o", 0)->in_edge();
+  EXPECT_EQ(a->env_, b->env_);
+  EXPECT_NE(a->env_, c->env_);
+  EXPECT_EQ("cc -O0 c.c -o c.o", c->EvaluateCommand());
+  // A dyndep file may add to the bindings of its edges.
+  EXPECT_NE(a->env_, d->env_);
+  EXPECT_EQ("cc -O2 -g d.c -o d.o", d->EvaluateCommand());
+}
+
 TEST_F(ParserTest, BrokenInclude) {
   fs_.Create("include.ninja", "build\n");
   ManifestParser parser(&state, &fs_);
@@ -1063,6 +1383,81 @@ TEST_F(ParserTest, DefaultStatements) {
   EXPECT_EQ("c", nodes[2]->path());
 }
 
+TEST_F(ParserTest, DyndepNotSpecified) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build result: cat in\n"));
+  Edge* edge = state.GetNode("result", 0)->in_edge();
+  ASSERT_FALSE(edge->dyndep_);
+}
+
+TEST_F(ParserTest, DyndepNotInput) {
+  State lstate;
+  ManifestParser parser(&lstate, NULL);
+  string err;
+  EXPECT_FALSE(parser.ParseTest(
+"rule touch\n"
+"  command = touch $out\n"
+"build result: touch\n"
+"  dyndep = notin\n",
+                               &err));
+  EXPECT_EQ("input:5: dyndep 'notin' is not an input\n", err);
+}
+
+TEST_F(ParserTest, DyndepExplicitInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build result: cat in\n"
+"  dyndep = in\n"));
+  Edge* edge = state.GetNode("result", 0)->in_edge();
+  ASSERT_TRUE(edge->dyndep_);
+  EXPECT_TRUE(edge->dyndep_->dyndep_pending());
+  EXPECT_EQ(edge->dyndep_->path(), "in");
+}
+
+TEST_F(ParserTest, DyndepImplicitInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build result: cat in | dd\n"
+"  dyndep = dd\n"));
+  Edge* edge = state.GetNode("result", 0)->in_edge();
+  ASSERT_TRUE(edge->dyndep_);
+  EXPECT_TRUE(edge->dyndep_->dyndep_pending());
+  EXPECT_EQ(edge->dyndep_->path(), "dd");
+}
+
+TEST_F(ParserTest, DyndepOrderOnlyInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build result: cat in || dd\n"
+"  dyndep = dd\n"));
+  Edge* edge = state.GetNode("result", 0)->in_edge();
+  ASSERT_TRUE(edge->dyndep_);
+  EXPECT_TRUE(edge->dyndep_->dyndep_pending());
+  EXPECT_EQ(edge->dyndep_->path(), "dd");
+}
+
+TEST_F(ParserTest, DyndepRuleInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $in > $out\n"
+"  dyndep = $in\n"
+"build result: cat in\n"
+"build other: cat in\n"));
+  Edge* edge = state.GetNode("result", 0)->in_edge();
+  ASSERT_TRUE(edge->dyndep_);
+  EXPECT_TRUE(edge->dyndep_->dyndep_pending());
+  EXPECT_EQ(edge->dyndep_->path(), "in");
+
+  // Each edge gets a scope of its own for what the dyndep file adds.
+  EXPECT_NE(edge->env_, &state.bindings_);
+  EXPECT_NE(edge->env_, state.GetNode("other", 0)->in_edge()->env_);
+}
+
 TEST_F(ParserTest, UTF8) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "rule utf8\n"
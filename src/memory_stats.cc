@@ -0,0 +1,137 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "memory_stats.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+bool MoreBytes(const pair<size_t, string>& a, const pair<size_t, string>& b) {
+  return a.first > b.first;
+}
+
+string FormatBytes(size_t bytes) {
+  char buf[32];
+  if (bytes >= 10 * 1024 * 1024)
+    snprintf(buf, sizeof(buf), "%.1f MB", bytes / (1024.0 * 1024.0));
+  else if (bytes >= 10 * 1024)
+    snprintf(buf, sizeof(buf), "%.1f KB", bytes / 1024.0);
+  else
+    snprintf(buf, sizeof(buf), "%d B", (int)bytes);
+  return buf;
+}
+
+}  // anonymous namespace
+
+void MemoryStats::Add(const char* category, size_t count, size_t bytes) {
+  for (vector<Category>::iterator i = categories_.begin();
+       i != categories_.end(); ++i) {
+    if (i->name == category) {
+      i->count += count;
+      i->bytes += bytes;
+      return;
+    }
+  }
+  Category c = { category, count, bytes };
+  categories_.push_back(c);
+}
+
+const MemoryStats::Category* MemoryStats::Find(const char* name) const {
+  for (vector<Category>::const_iterator i = categories_.begin();
+       i != categories_.end(); ++i) {
+    if (i->name == name)
+      return &*i;
+  }
+  return NULL;
+}
+
+size_t MemoryStats::count(const char* category) const {
+  const Category* c = Find(category);
+  return c ? c->count : 0;
+}
+
+size_t MemoryStats::bytes(const char* category) const {
+  const Category* c = Find(category);
+  return c ? c->bytes : 0;
+}
+
+size_t MemoryStats::total_bytes() const {
+  size_t total = 0;
+  for (vector<Category>::const_iterator i = categories_.begin();
+       i != categories_.end(); ++i) {
+    total += i->bytes;
+  }
+  return total;
+}
+
+void MemoryStats::Report() const {
+  vector<pair<size_t, string> > order;
+  for (size_t i = 0; i < categories_.size(); ++i)
+    order.push_back(make_pair(categories_[i].bytes, categories_[i].name));
+  stable_sort(order.begin(), order.end(), MoreBytes);
+
+  size_t total = total_bytes();
+  printf("%-22s\t%10s\t%10s\t%s\n", "memory", "count", "size", "share");
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Category* c = Find(order[i].second.c_str());
+    printf("%-22s\t%10d\t%10s\t%5.1f%%\n", c->name.c_str(), (int)c->count,
+           FormatBytes(c->bytes).c_str(),
+           total ? 100.0 * c->bytes / total : 0.0);
+  }
+  printf("%-22s\t%10s\t%10s\n", "total", "", FormatBytes(total).c_str());
+  if (size_t peak_kb = PeakRSSKB()) {
+    printf("%-22s\t%10s\t%10s\n", "peak RSS", "",
+           FormatBytes(peak_kb * 1024).c_str());
+  }
+}
+
+// static
+size_t MemoryStats::StringBytes(const string& str) {
+  // Short strings are kept in the string itself.
+  const char* data = str.data();
+  const char* self = reinterpret_cast<const char*>(&str);
+  if (data >= self && data < self + sizeof(str))
+    return 0;
+  return str.capacity() + 1;
+}
+
+// static
+size_t MemoryStats::PeakRSSKB() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize / 1024;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;  // In bytes on macOS.
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
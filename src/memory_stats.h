@@ -0,0 +1,62 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_MEMORY_STATS_H_
+#define NINJA_MEMORY_STATS_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Adds up the memory that ninja's data structures take, by what they
+/// hold, for '-d memstats'.  The sizes are those of the objects and of the
+/// heap blocks they own, as far as they can be told from the outside,
+/// without what malloc() itself takes on top.
+struct MemoryStats {
+  /// Count |count| more objects of |category|, taking |bytes| in all.
+  void Add(const char* category, size_t count, size_t bytes);
+
+  size_t count(const char* category) const;
+  size_t bytes(const char* category) const;
+  size_t total_bytes() const;
+
+  /// Print the categories, largest first, with the peak RSS.
+  void Report() const;
+
+  /// The heap block that |str| owns, if any.
+  static size_t StringBytes(const string& str);
+
+  template<typename T>
+  static size_t VectorBytes(const vector<T>& v) {
+    return v.capacity() * sizeof(T);
+  }
+
+  /// The peak resident set size of ninja in kilobytes, or 0 if unknown.
+  static size_t PeakRSSKB();
+
+ private:
+  struct Category {
+    string name;
+    size_t count;
+    size_t bytes;
+  };
+  const Category* Find(const char* name) const;
+
+  vector<Category> categories_;
+};
+
+#endif  // NINJA_MEMORY_STATS_H_
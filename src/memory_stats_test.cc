@@ -0,0 +1,66 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "memory_stats.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+TEST(MemoryStats, Categories) {
+  MemoryStats stats;
+  stats.Add("a", 1, 10);
+  stats.Add("b", 2, 20);
+  stats.Add("a", 3, 30);
+  EXPECT_EQ(4u, stats.count("a"));
+  EXPECT_EQ(40u, stats.bytes("a"));
+  EXPECT_EQ(20u, stats.bytes("b"));
+  EXPECT_EQ(0u, stats.bytes("c"));
+  EXPECT_EQ(60u, stats.total_bytes());
+}
+
+TEST(MemoryStats, StringBytes) {
+  string empty;
+  EXPECT_LE(MemoryStats::StringBytes(empty), 1u);
+  string big(1000, 'x');
+  EXPECT_LE(1001u, MemoryStats::StringBytes(big));
+}
+
+TEST(MemoryStats, State) {
+  State state;
+  AssertParse(&state,
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build out: cat in1 in2\n"
+"  foo = bar\n"
+"build out2: cat out\n");
+
+  MemoryStats stats;
+  state.ReportMemory(&stats);
+  EXPECT_EQ(4u, stats.count("nodes"));
+  EXPECT_EQ(4 * sizeof(Node), stats.bytes("nodes"));
+  EXPECT_EQ(strlen("out") + strlen("in1") + strlen("in2") + strlen("out2") + 4,
+            stats.bytes("paths"));
+  EXPECT_EQ(2u, stats.count("edges"));
+  // phony and cat, the command of cat and the empty rspfile bindings the
+  // parser checks, and the binding of the first edge.
+  EXPECT_EQ(2u, stats.count("rules"));
+  EXPECT_EQ(3u, stats.count("eval strings"));
+  EXPECT_EQ(1u, stats.count("bindings"));
+  EXPECT_EQ(0u, stats.count("commands"));
+  // All the nodes, edges and paths are in the arena.
+  EXPECT_LE(stats.bytes("nodes") + stats.bytes("paths") +
+            2 * sizeof(Edge), state.arena_.bytes_allocated());
+}
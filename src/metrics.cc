@@ -15,7 +15,9 @@
 #include "metrics.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef _WIN32
@@ -29,6 +31,7 @@
 #include "util.h"
 
 Metrics* g_metrics = NULL;
+Trace* g_trace = NULL;
 
 namespace {
 
@@ -72,29 +75,173 @@ int64_t TimerToMicros(int64_t dt) {
 }
 #endif
 
+/// Append |value| to |out| as the contents of a JSON string.
+void AppendJSONString(const string& value, string* out) {
+  for (string::const_iterator c = value.begin(); c != value.end(); ++c) {
+    if (*c == '"' || *c == '\\') {
+      out->push_back('\\');
+      out->push_back(*c);
+    } else if ((unsigned char)*c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+      out->append(escaped);
+    } else {
+      out->push_back(*c);
+    }
+  }
+}
+
+void CloseTrace() {
+  if (g_trace)
+    g_trace->Close();
+}
+
+// Metrics may be recorded from several threads at once; none of them waits
+// for the others, and the report is only made once they are all done.
+#ifdef _MSC_VER
+void AtomicAdd(int64_t* value, int64_t delta) {
+  InterlockedExchangeAdd64((volatile LONGLONG*)value, delta);
+}
+
+void AtomicMax(int64_t* value, int64_t candidate) {
+  int64_t seen = *(volatile int64_t*)value;
+  while (seen < candidate) {
+    int64_t previous = InterlockedCompareExchange64(
+        (volatile LONGLONG*)value, candidate, seen);
+    if (previous == seen)
+      break;
+    seen = previous;
+  }
+}
+#else
+void AtomicAdd(int64_t* value, int64_t delta) {
+  __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
+
+void AtomicMax(int64_t* value, int64_t candidate) {
+  int64_t seen = __atomic_load_n(value, __ATOMIC_RELAXED);
+  while (seen < candidate &&
+         !__atomic_compare_exchange_n(value, &seen, candidate, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+#endif
+
 }  // anonymous namespace
 
 
-ScopedMetric::ScopedMetric(Metric* metric) {
+ScopedMetric::ScopedMetric(Metric* metric, const char* name) {
   metric_ = metric;
-  if (!metric_)
-    return;
-  start_ = HighResTimer();
+  name_ = name;
+  start_ = metric_ || g_trace ? HighResTimer() : 0;
 }
 ScopedMetric::~ScopedMetric() {
-  if (!metric_)
+  if (!start_)
     return;
-  metric_->count++;
-  int64_t dt = TimerToMicros(HighResTimer() - start_);
-  metric_->sum += dt;
+  int64_t end = HighResTimer();
+  if (g_trace && name_)
+    g_trace->AddScope(name_, start_, end);
+  if (metric_)
+    metric_->Add(TimerToMicros(end - start_));
+}
+
+Metric::Metric(const string& name, bool is_counter)
+    : name(name), is_counter(is_counter), count(0), sum(0), max(0) {
+  memset(histogram, 0, sizeof(histogram));
+}
+
+void Metric::Add(int64_t value) {
+  AtomicAdd(&count, 1);
+  AtomicAdd(&sum, value);
+  AtomicMax(&max, value);
+  AtomicAdd(&histogram[Bucket(value)], 1);
+}
+
+int64_t Metric::Percentile(double fraction) const {
+  int64_t rank = (int64_t)(fraction * count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  int64_t seen = 0;
+  for (int bucket = 0; bucket < kBuckets; ++bucket) {
+    seen += histogram[bucket];
+    if (seen >= rank)
+      return std::min(BucketEnd(bucket), max);
+  }
+  return max;
+}
+
+// static
+int Metric::Bucket(int64_t value) {
+  if (value < kSubBuckets)
+    return value < 0 ? 0 : (int)value;
+  // Values in [2^power, 2^(power+1)) split into kSubBuckets buckets.
+  int power = 3;  // log2(kSubBuckets)
+  while (value >> (power + 1))
+    ++power;
+  if (power >= kBuckets / kSubBuckets + 2)
+    return kBuckets - 1;  // Over 2^62, which no time or size comes near.
+  int sub_bucket = (int)(value >> (power - 3)) - kSubBuckets;
+  return (power - 2) * kSubBuckets + sub_bucket;
+}
+
+// static
+int64_t Metric::BucketEnd(int bucket) {
+  if (bucket < kSubBuckets)
+    return bucket;
+  int power = bucket / kSubBuckets + 2;
+  int64_t sub_bucket = bucket % kSubBuckets;
+  return ((kSubBuckets + sub_bucket + 1) << (power - 3)) - 1;
+}
+
+Metrics::Metrics() {
+#ifdef _WIN32
+  InitializeCriticalSection(&lock_);
+#else
+  pthread_mutex_init(&lock_, NULL);
+#endif
+}
+
+Metrics::~Metrics() {
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    delete *i;
+  }
+#ifdef _WIN32
+  DeleteCriticalSection(&lock_);
+#else
+  pthread_mutex_destroy(&lock_);
+#endif
 }
 
 Metric* Metrics::NewMetric(const string& name) {
-  Metric* metric = new Metric;
-  metric->name = name;
-  metric->count = 0;
-  metric->sum = 0;
-  metrics_.push_back(metric);
+  return Get(name, false);
+}
+
+Metric* Metrics::NewCounter(const string& name) {
+  return Get(name, true);
+}
+
+Metric* Metrics::Get(const string& name, bool is_counter) {
+#ifdef _WIN32
+  EnterCriticalSection(&lock_);
+#else
+  pthread_mutex_lock(&lock_);
+#endif
+  Metric* metric = NULL;
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end() && !metric; ++i) {
+    if ((*i)->name == name && (*i)->is_counter == is_counter)
+      metric = *i;
+  }
+  if (!metric) {
+    metric = new Metric(name, is_counter);
+    metrics_.push_back(metric);
+  }
+#ifdef _WIN32
+  LeaveCriticalSection(&lock_);
+#else
+  pthread_mutex_unlock(&lock_);
+#endif
   return metric;
 }
 
@@ -105,16 +252,191 @@ void Metrics::Report() {
     width = max((int)(*i)->name.size(), width);
   }
 
-  printf("%-*s\t%-6s\t%-9s\t%s\n", width,
-         "metric", "count", "avg (us)", "total (ms)");
+  printf("%-*s\t%-6s\t%-9s\t%-10s\t%-8s\t%-8s\t%-8s\t%s\n", width,
+         "metric", "count", "avg (us)", "total (ms)", "p50 (us)", "p90 (us)",
+         "p99 (us)", "max (us)");
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
     Metric* metric = *i;
+    if (metric->is_counter)
+      continue;
     double total = metric->sum / (double)1000;
     double avg = metric->sum / (double)metric->count;
-    printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+    printf("%-*s\t%-6" PRId64 "\t%-8.1f\t%-10.1f\t%-8" PRId64 "\t%-8" PRId64
+           "\t%-8" PRId64 "\t%" PRId64 "\n",
+           width, metric->name.c_str(), metric->count, avg, total,
+           metric->Percentile(0.5), metric->Percentile(0.9),
+           metric->Percentile(0.99), metric->max);
+  }
+
+  bool header = false;
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    Metric* metric = *i;
+    if (!metric->is_counter)
+      continue;
+    if (!header) {
+      printf("\n%-*s\t%-6s\t%s\n", width, "counter", "count", "total");
+      header = true;
+    }
+    printf("%-*s\t%-6" PRId64 "\t%" PRId64 "\n", width, metric->name.c_str(),
+           metric->count, metric->sum);
+  }
+}
+
+bool Metrics::ReportJSON(const string& path, string* err) {
+  string json = "{\"metrics\":[";
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    Metric* metric = *i;
+    if (i != metrics_.begin())
+      json += ",";
+    json += "\n{\"name\":\"";
+    AppendJSONString(metric->name, &json);
+    char fields[256];
+    if (metric->is_counter) {
+      snprintf(fields, sizeof(fields),
+               "\",\"type\":\"counter\",\"count\":%" PRId64
+               ",\"total\":%" PRId64 "}",
+               metric->count, metric->sum);
+    } else {
+      snprintf(fields, sizeof(fields),
+               "\",\"type\":\"time\",\"count\":%" PRId64
+               ",\"total_us\":%" PRId64 ",\"p50_us\":%" PRId64
+               ",\"p90_us\":%" PRId64 ",\"p99_us\":%" PRId64
+               ",\"max_us\":%" PRId64 "}",
+               metric->count, metric->sum, metric->Percentile(0.5),
+               metric->Percentile(0.9), metric->Percentile(0.99),
+               metric->max);
+    }
+    json += fields;
+  }
+  json += "\n]}\n";
+
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file || fwrite(json.data(), 1, json.size(), file) != json.size()) {
+    *err = strerror(errno);
+    if (file)
+      fclose(file);
+    return false;
+  }
+  if (fclose(file) != 0) {
+    *err = strerror(errno);
+    return false;
   }
+  return true;
+}
+
+Trace::Trace() : file_(NULL), start_(0), first_event_(true) {
+#ifdef _WIN32
+  thread_ = GetCurrentThreadId();
+#else
+  thread_ = pthread_self();
+#endif
+}
+
+Trace::~Trace() {
+  Close();
+}
+
+bool Trace::Open(const string& path, string* err) {
+  file_ = fopen(path.c_str(), "w");
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  start_ = HighResTimer();
+  // The array format doesn't need its closing bracket, which a ninja that
+  // gets killed never writes.
+  fputs("[\n", file_);
+  NameTrack(0, "ninja");
+  // ninja exit()s from all over; finish the file then.
+  atexit(CloseTrace);
+  return true;
+}
+
+void Trace::AddScope(const char* name, int64_t start, int64_t end) {
+  const int64_t kMinScopeMicros = 10;
+#ifdef _WIN32
+  bool other_thread = GetCurrentThreadId() != thread_;
+#else
+  bool other_thread = !pthread_equal(pthread_self(), thread_);
+#endif
+  if (!file_ || other_thread || TimerToMicros(end - start) < kMinScopeMicros)
+    return;
+  WriteEvent(name, "ninja", 0, start, end);
+}
+
+void Trace::CommandStarted(const void* command, const string& name,
+                           const string& category) {
+  if (!file_)
+    return;
+  Command* started = &running_[command];
+  started->slot = find(slots_.begin(), slots_.end(), false) - slots_.begin();
+  if (started->slot == (int)slots_.size())
+    slots_.push_back(true);
+  else
+    slots_[started->slot] = true;
+  started->start = HighResTimer();
+  started->name = name;
+  started->category = category;
+}
+
+void Trace::CommandFinished(const void* command) {
+  map<const void*, Command>::iterator i = running_.find(command);
+  if (!file_ || i == running_.end())
+    return;
+  Command& finished = i->second;
+  char track_name[32];
+  snprintf(track_name, sizeof(track_name), "slot %d", finished.slot + 1);
+  NameTrack(finished.slot + 1, track_name);
+  WriteEvent(finished.name, finished.category, finished.slot + 1,
+             finished.start, HighResTimer());
+  slots_[finished.slot] = false;
+  running_.erase(i);
+}
+
+void Trace::Close() {
+  if (!file_)
+    return;
+  fputs("\n]\n", file_);
+  fclose(file_);
+  file_ = NULL;
+}
+
+void Trace::WriteEvent(const string& name, const string& category,
+                       int track, int64_t start, int64_t end) {
+  string event = first_event_ ? "" : ",\n";
+  first_event_ = false;
+  event += "{\"name\":\"";
+  AppendJSONString(name, &event);
+  event += "\",\"cat\":\"";
+  AppendJSONString(category, &event);
+  char fields[128];
+  snprintf(fields, sizeof(fields),
+           "\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+           ",\"pid\":1,\"tid\":%d}",
+           TimerToMicros(start - start_), TimerToMicros(end - start), track);
+  event += fields;
+  fputs(event.c_str(), file_);
+}
+
+void Trace::NameTrack(int track, const string& name) {
+  if ((int)named_tracks_.size() <= track)
+    named_tracks_.resize(track + 1, false);
+  if (named_tracks_[track])
+    return;
+  named_tracks_[track] = true;
+  string event = first_event_ ? "" : ",\n";
+  first_event_ = false;
+  char fields[128];
+  snprintf(fields, sizeof(fields),
+           "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+           "\"tid\":%d,\"args\":{\"name\":\"", track);
+  event += fields;
+  AppendJSONString(name, &event);
+  event += "\"}}";
+  fputs(event.c_str(), file_);
 }
 
 uint64_t Stopwatch::Now() const {
@@ -15,33 +15,70 @@
 #ifndef NINJA_METRICS_H_
 #define NINJA_METRICS_H_
 
+#include <stdio.h>
+
+#include <map>
 #include <string>
 #include <vector>
 using namespace std;
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 #include "util.h"  // For int64_t.
 
 /// The Metrics module is used for the debug mode that dumps timing stats of
-/// various actions.  To use, see METRIC_RECORD below.
+/// various actions.  To use, see METRIC_RECORD and METRIC_COUNT below.
+/// Metrics can be recorded from any thread.
 
-/// A single metrics we're tracking, like "depfile load time".
+/// A single metrics we're tracking, like "depfile load time", or a counter,
+/// like "depfile bytes".
 struct Metric {
+  /// The histogram has this many buckets for each power of two, so
+  /// percentiles are within 1/8 of the real value.
+  static const int kSubBuckets = 8;
+  static const int kBuckets = 60 * kSubBuckets;
+
+  Metric(const string& name, bool is_counter);
+
+  /// Record one run of the code path, or one addition to the counter.
+  void Add(int64_t value);
+
+  /// The smallest value at least |fraction| of the recorded values are no
+  /// greater than, rounded up to the end of its bucket.
+  int64_t Percentile(double fraction) const;
+
+  /// The bucket of the histogram that |value| falls into.
+  static int Bucket(int64_t value);
+  /// The largest value that falls into |bucket|.
+  static int64_t BucketEnd(int bucket);
+
   string name;
-  /// Number of times we've hit the code path.
-  int count;
-  /// Total time (in micros) we've spent on the code path.
+  /// Whether the values are amounts added to a counter rather than times.
+  bool is_counter;
+  /// Number of times we've hit the code path, or added to the counter.
+  int64_t count;
+  /// Total time (in micros) we've spent on the code path, or the total
+  /// added to the counter.
   int64_t sum;
+  /// The largest value recorded.
+  int64_t max;
+  /// How many of the values fall into each bucket.
+  int64_t histogram[kBuckets];
 };
 
 
 /// A scoped object for recording a metric across the body of a function.
 /// Used by the METRIC_RECORD macro.
 struct ScopedMetric {
-  explicit ScopedMetric(Metric* metric);
+  explicit ScopedMetric(Metric* metric, const char* name = NULL);
   ~ScopedMetric();
 
 private:
   Metric* metric_;
+  /// What to call the scope in the trace, if there is one.
+  const char* name_;
   /// Timestamp when the measurement started.
   /// Value is platform-dependent.
   int64_t start_;
@@ -49,15 +86,89 @@ private:
 
 /// The singleton that stores metrics and prints the report.
 struct Metrics {
+  Metrics();
+  ~Metrics();
+
+  /// The metric or counter called |name|, which the sites that use the
+  /// same name share.
   Metric* NewMetric(const string& name);
+  Metric* NewCounter(const string& name);
 
   /// Print a summary report to stdout.
   void Report();
 
+  /// Write the metrics to |path| as JSON, for tools to keep track of.
+  bool ReportJSON(const string& path, string* err);
+
 private:
+  Metric* Get(const string& name, bool is_counter);
+
   vector<Metric*> metrics_;
+  /// Guards |metrics_|, for the metrics first hit on another thread.
+#ifdef _WIN32
+  CRITICAL_SECTION lock_;
+#else
+  pthread_mutex_t lock_;
+#endif
+};
+
+/// Writes what ninja does over time as Chrome trace events, which
+/// chrome://tracing and Perfetto show, for '-d trace=FILE': the scopes of
+/// METRIC_RECORD on one track, and the commands on one track per slot of
+/// parallelism that they take up.
+struct Trace {
+  Trace();
+  ~Trace();
+
+  /// Start writing to |path|.
+  bool Open(const string& path, string* err);
+
+  /// Record a METRIC_RECORD scope, given the HighResTimer() values of its
+  /// start and end.  Those from threads other than the one that opened the
+  /// trace are left out, and so are the shortest, so that the lookups done
+  /// by the million don't drown the rest.
+  void AddScope(const char* name, int64_t start, int64_t end);
+
+  /// The command identified by |command| started: take up the first free
+  /// slot with it.  |category| groups commands, like by rule.
+  void CommandStarted(const void* command, const string& name,
+                      const string& category);
+  /// Record the slice of a command that CommandStarted() was called for.
+  void CommandFinished(const void* command);
+
+  /// Finish the file.
+  void Close();
+
+ private:
+  struct Command {
+    int slot;
+    int64_t start;
+    string name;
+    string category;
+  };
+
+  void WriteEvent(const string& name, const string& category, int track,
+                  int64_t start, int64_t end);
+  /// Name the |track|, the first time it's used.
+  void NameTrack(int track, const string& name);
+
+  FILE* file_;
+  /// The HighResTimer() value that the trace's timestamps count from.
+  int64_t start_;
+  bool first_event_;
+  map<const void*, Command> running_;
+  /// Which slots are taken up by a command.
+  vector<bool> slots_;
+  vector<bool> named_tracks_;
+#ifdef _WIN32
+  unsigned long thread_;
+#else
+  pthread_t thread_;
+#endif
 };
 
+extern Trace* g_trace;
+
 /// Get the current time as relative to some epoch.
 /// Epoch varies between platforms; only useful for measuring elapsed time.
 int64_t GetTimeMillis();
@@ -85,7 +196,16 @@ struct Stopwatch {
 #define METRIC_RECORD(name)                                             \
   static Metric* metrics_h_metric =                                     \
       g_metrics ? g_metrics->NewMetric(name) : NULL;                    \
-  ScopedMetric metrics_h_scoped(metrics_h_metric);
+  ScopedMetric metrics_h_scoped(metrics_h_metric, name);
+
+/// Add |value| to the counter called |name|, like the number of bytes read.
+#define METRIC_COUNT(name, value)                                       \
+  do {                                                                  \
+    static Metric* metrics_h_counter =                                  \
+        g_metrics ? g_metrics->NewCounter(name) : NULL;                 \
+    if (metrics_h_counter)                                              \
+      metrics_h_counter->Add(value);                                    \
+  } while (0)
 
 extern Metrics* g_metrics;
 
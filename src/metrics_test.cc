@@ -0,0 +1,82 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+
+#include "test.h"
+
+TEST(Metrics, Buckets) {
+  // Small values have a bucket each...
+  for (int64_t value = 0; value < Metric::kSubBuckets; ++value) {
+    EXPECT_EQ(value, Metric::Bucket(value));
+    EXPECT_EQ(value, Metric::BucketEnd(Metric::Bucket(value)));
+  }
+  // ... and larger ones share buckets that are 1/8 of their power of two
+  // wide.
+  EXPECT_EQ(Metric::Bucket(1024), Metric::Bucket(1024 + 127));
+  EXPECT_EQ(Metric::Bucket(1024) + 1, Metric::Bucket(1024 + 128));
+  EXPECT_EQ(1024 + 127, Metric::BucketEnd(Metric::Bucket(1024)));
+  for (int64_t value = 8; value < (int64_t)1 << 40; value = value * 3 + 1) {
+    int bucket = Metric::Bucket(value);
+    EXPECT_LE(value, Metric::BucketEnd(bucket));
+    EXPECT_LT(Metric::BucketEnd(bucket - 1), value);
+  }
+  EXPECT_EQ(Metric::kBuckets - 1, Metric::Bucket(INT64_MAX));
+}
+
+TEST(Metrics, Percentiles) {
+  Metric metric("test", false);
+  for (int64_t value = 1; value <= 1000; ++value)
+    metric.Add(value);
+  EXPECT_EQ(1000, metric.count);
+  EXPECT_EQ(500500, metric.sum);
+  EXPECT_EQ(1000, metric.max);
+  // Rounded up to the end of the bucket, by 1/8 at most.
+  EXPECT_LE(500, metric.Percentile(0.5));
+  EXPECT_GE(500 + 500 / 8, metric.Percentile(0.5));
+  EXPECT_LE(900, metric.Percentile(0.9));
+  EXPECT_GE(900 + 900 / 8, metric.Percentile(0.9));
+  // Never more than the largest value.
+  EXPECT_EQ(1000, metric.Percentile(1.0));
+  EXPECT_EQ(1, metric.Percentile(0.0));
+}
+
+TEST(Metrics, SharedName) {
+  Metrics metrics;
+  Metric* metric = metrics.NewMetric("load");
+  EXPECT_EQ(metric, metrics.NewMetric("load"));
+  EXPECT_NE(metric, metrics.NewMetric("parse"));
+  EXPECT_NE(metric, metrics.NewCounter("load"));
+}
+
+namespace {
+
+void AddThread(void* arg, size_t index) {
+  static_cast<Metric*>(arg)->Add(index);
+}
+
+}  // anonymous namespace
+
+TEST(Metrics, Threads) {
+  Metric metric("test", true);
+  const size_t kCount = 100000;
+  ParallelFor(kCount, 8, AddThread, &metric);
+  EXPECT_EQ((int64_t)kCount, metric.count);
+  EXPECT_EQ((int64_t)(kCount * (kCount - 1) / 2), metric.sum);
+  EXPECT_EQ((int64_t)kCount - 1, metric.max);
+  int64_t total = 0;
+  for (int bucket = 0; bucket < Metric::kBuckets; ++bucket)
+    total += metric.histogram[bucket];
+  EXPECT_EQ((int64_t)kCount, total);
+}
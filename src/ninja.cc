@@ -35,13 +35,25 @@
 #include "build_log.h"
 #include "deps_log.h"
 #include "clean.h"
+#include "content_hash.h"
+#include "critical_path.h"
 #include "debug_flags.h"
 #include "disk_interface.h"
+#include "failure_log.h"
+#include "file_watcher.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "jobserver.h"
+#include "manifest_cache.h"
+#include "manifest_index.h"
 #include "manifest_parser.h"
+#include "memory_stats.h"
 #include "metrics.h"
+#include "server.h"
+#include "slot_usage.h"
+#include "stat_audit.h"
 #include "state.h"
+#include "subprocess.h"
 #include "util.h"
 #include "version.h"
 
@@ -57,6 +69,14 @@ namespace {
 
 struct Tool;
 
+/// Where --cache-graph caches the graph loaded from the manifest.  Unlike
+/// the logs, it can't go in $builddir, which is only known after loading the
+/// manifest.
+const char kManifestCachePath[] = ".ninja_graph";
+
+/// Where the 'subninja' files that each output comes from are indexed.
+const char kManifestIndexPath[] = ".ninja_index";
+
 /// Command-line options.
 struct Options {
   /// Build file to load.
@@ -73,13 +93,44 @@ struct Options {
 
   /// Whether phony cycles should warn or print an error.
   bool phony_cycle_should_err;
+
+  /// Whether to provide a jobserver to the commands being run.
+  bool jobserver;
+
+  /// Whether to keep running and rebuild whenever files change.
+  bool watch;
+
+  /// Whether to keep running and build for the ninja invocations that
+  /// forward their command lines to us.
+  bool server;
+
+  /// Whether to save the graph loaded from the manifest, and load it from
+  /// there while the manifest is unchanged.
+  bool cache_graph;
+
+  /// The comma-separated directories to run ninja in, in parallel, if any.
+  const char* dirs;
+
+  /// What --dirs passes on to each build in place of the arguments that
+  /// hold --dirs itself and -C, which it applies before starting them.
+  /// An empty string drops the argument.
+  map<const char*, string> dirs_rewrites;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
 /// to poke into these, so store them as fields on an object.
+/// What -t query prints of each target.
+struct QueryOptions {
+  QueryOptions()
+      : transitive_inputs(false), transitive_outputs(false), json(false) {}
+  bool transitive_inputs;
+  bool transitive_outputs;
+  bool json;
+};
+
 struct NinjaMain : public BuildLogUser {
   NinjaMain(const char* ninja_command, const BuildConfig& config) :
-      ninja_command_(ninja_command), config_(config) {}
+      ninja_command_(ninja_command), config_(config), partial_graph_(false) {}
 
   /// Command line used to run Ninja.
   const char* ninja_command_;
@@ -90,6 +141,10 @@ struct NinjaMain : public BuildLogUser {
   /// Loaded state (rules, nodes).
   State state_;
 
+  /// Whether |state_| only holds the part of the manifest that the targets
+  /// need, so that what isn't in it can't be told dead.
+  bool partial_graph_;
+
   /// Functions for accesssing the disk.
   RealDiskInterface disk_interface_;
 
@@ -113,23 +168,54 @@ struct NinjaMain : public BuildLogUser {
   // The various subcommands, run via "-t XXX".
   int ToolGraph(const Options* options, int argc, char* argv[]);
   int ToolQuery(const Options* options, int argc, char* argv[]);
+  /// Print the inputs and outputs of \a target, for -t query.
+  bool QueryTarget(const char* target, const QueryOptions& query,
+                   DyndepLoader* dyndep_loader, string* err);
+  /// Append to \a inputs everything \a node depends on, through the
+  /// edges and the deps log.
+  void CollectTransitiveInputs(Node* node, DyndepLoader* dyndep_loader,
+                               vector<Node*>* inputs);
+  /// Append to \a outputs everything that depends on \a node, through the
+  /// edges and the reverse index of the deps log.
+  void CollectTransitiveOutputs(Node* node, DyndepLoader* dyndep_loader,
+                                vector<Node*>* outputs);
+  /// Append to \a outputs the outputs whose live deps log entries list
+  /// \a node.
+  void CollectDepsDependents(Node* node, vector<Node*>* outputs);
+  /// Load the reverse index of the deps log.  @return false on error.
+  bool LoadDepsDependents();
   int ToolDeps(const Options* options, int argc, char* argv[]);
+  int ToolRdeps(const Options* options, int argc, char* argv[]);
   int ToolBrowse(const Options* options, int argc, char* argv[]);
   int ToolMSVC(const Options* options, int argc, char* argv[]);
   int ToolTargets(const Options* options, int argc, char* argv[]);
   int ToolCommands(const Options* options, int argc, char* argv[]);
+  int ToolCritPath(const Options* options, int argc, char* argv[]);
   int ToolClean(const Options* options, int argc, char* argv[]);
   int ToolCompilationDatabase(const Options* options, int argc, char* argv[]);
   int ToolRecompact(const Options* options, int argc, char* argv[]);
+  int ToolRestat(const Options* options, int argc, char* argv[]);
+  int ToolBuildLog(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
 
   /// Open the build log.
   /// @return false on error.
-  bool OpenBuildLog(bool recompact_only = false);
+  /// If \a restat_outputs, refresh the mtimes of those outputs, or of all
+  /// of them if it is empty, before recompacting.
+  bool OpenBuildLog(bool recompact_only = false,
+                    const vector<string>* restat_outputs = NULL);
+
+  /// The path of the deps log, in the build directory.
+  string DepsLogPath() const;
 
   /// Open the deps log: load it, then open for writing.
   /// @return false on error.
-  bool OpenDepsLog(bool recompact_only = false);
+  bool OpenDepsLog(bool recompact_only = false,
+                   const vector<string>* restat_outputs = NULL);
+
+  /// Close the build and deps logs, finishing any recompaction running in
+  /// the background.  Needed before exit(), which doesn't destroy us.
+  void CloseLogs();
 
   /// Ensure the build directory exists, creating it if necessary.
   /// @return false on error.
@@ -144,9 +230,46 @@ struct NinjaMain : public BuildLogUser {
   /// @return an exit code.
   int RunBuild(int argc, char** argv);
 
+  /// Build \a targets, filling \a planned (if given) with the edges the
+  /// build was going to run.  Doesn't report an up-to-date build if
+  /// \a quiet.
+  /// @return an exit code.
+  int BuildTargets(const vector<Node*>& targets, bool quiet,
+                   vector<Edge*>* planned);
+
+  /// Build the targets listed on the command line, then build them again
+  /// whenever files they depend on change, finding out which through a
+  /// FileWatcher rather than by stat()ing every file.  Returns with
+  /// \a reload set when one of \a manifest_files changes, so that the
+  /// manifest can be loaded again.
+  /// @return an exit code.
+  int RunWatch(int argc, char** argv, const char* input_file,
+               const vector<ManifestFile>& manifest_files, bool* reload);
+
+  /// Serve the clients connecting to \a server, keeping the graph and the
+  /// logs loaded in between and, where possible, only checking the files
+  /// that changed since the previous build.  Starts with \a request if it's
+  /// pending.  Returns with \a reload set when a manifest changes; the
+  /// request that noticed is then still pending, with its stdio in use.
+  /// @return an exit code.
+  int RunServer(Server* server, ServerRequest* request, BuildConfig* config,
+                const char* input_file,
+                const vector<ManifestFile>& manifest_files, bool* reload);
+
+  /// Run the build or tool that \a request asks for, parsing its flags
+  /// into \a config and filling \a planned with the edges the build was
+  /// going to run.  Sets \a reload if the manifest was rebuilt first.
+  /// @return an exit code, or -1 if the client should go ahead by itself.
+  int ServeRequest(const ServerRequest& request, BuildConfig* config,
+                   const char* input_file, vector<Edge*>* planned,
+                   bool* reload);
+
   /// Dump the output requested by '-d stats'.
   void DumpMetrics();
 
+  /// Dump the output requested by '-d memstats'.
+  void DumpMemoryStats();
+
   virtual bool IsPathDead(StringPiece s) const {
     Node* n = state_.LookupNode(s);
     if (!n || !n->in_edge())
@@ -161,13 +284,50 @@ struct NinjaMain : public BuildLogUser {
     // Do keep entries around for files which still exist on disk, for
     // generators that want to use this information.
     string err;
+    StatAudit::Scope audit(StatAudit::kRecompact);
     TimeStamp mtime = disk_interface_.Stat(s.AsString(), &err);
     if (mtime == -1)
       Error("%s", err.c_str());  // Log and ignore Stat() errors.
     return mtime == 0;
   }
+
+  /// Like IsPathDead(), with the stat() calls in one parallel batch.
+  virtual void ArePathsDead(const vector<StringPiece>& paths,
+                            vector<bool>* dead) const;
 };
 
+void NinjaMain::ArePathsDead(const vector<StringPiece>& paths,
+                             vector<bool>* dead) const {
+  dead->assign(paths.size(), false);
+  vector<string> outputs;
+  vector<size_t> indices;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    Node* n = state_.LookupNode(paths[i]);
+    if (!n || !n->in_edge())
+      continue;
+    outputs.push_back(paths[i].AsString());
+    indices.push_back(i);
+  }
+  vector<const string*> stat_paths(outputs.size());
+  for (size_t i = 0; i < outputs.size(); ++i)
+    stat_paths[i] = &outputs[i];
+
+  StatAudit::Scope audit(StatAudit::kRecompact);
+  vector<TimeStamp> mtimes;
+  disk_interface_.StatMany(stat_paths, &mtimes);
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    TimeStamp mtime = mtimes[i];
+    if (mtime == -1) {
+      // Stat() again for the message.
+      string err;
+      mtime = disk_interface_.Stat(outputs[i], &err);
+      if (mtime == -1)
+        Error("%s", err.c_str());  // Log and ignore Stat() errors.
+    }
+    (*dead)[indices[i]] = mtime == 0;
+  }
+}
+
 /// Subtools, accessible via "-t foo".
 struct Tool {
   /// Short name of the tool.
@@ -205,12 +365,46 @@ void Usage(const BuildConfig& config) {
 "\n"
 "  -C DIR   change to DIR before doing anything else\n"
 "  -f FILE  specify input build file [default=build.ninja]\n"
+"  --cache-graph  save the graph loaded from the build file to .ninja_graph,\n"
+"           and load it from there while the build files are unchanged\n"
 "\n"
 "  -j N     run N jobs in parallel (0 means infinity) [default=%d, derived from CPUs available]\n"
 "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
 "  -l N     do not start new jobs if the load average is greater than N\n"
+"  -l auto  use fewer than -j jobs while the CPUs, memory or I/O are under\n"
+"           pressure\n"
+"  -m SIZE  do not start new jobs if they would need more than SIZE bytes\n"
+"           of memory in total (K, M and G suffixes are accepted)\n"
+"  --max-output=SIZE  only keep the beginning and end of a command's\n"
+"           output past SIZE bytes (0 means no limit) [default=16M]\n"
+"  --log-commit=N,MS[,sync]  write to the build and deps logs once N records\n"
+"           are waiting or after MS milliseconds, and fsync them at exit\n"
+"           with ',sync' [default=256,100]\n"
+"  --binary-log  keep the build log in the indexed binary format\n"
+"  --action-cache=DIR  reuse the outputs of commands that already ran with\n"
+"           the same inputs, keeping copies of them in DIR\n"
+"  --remote-exec=PROGRAM  run commands through a remote execution client\n"
+"  --remote-jobs=N  run N commands remotely in parallel [default=-j value]\n"
+"  --hosts=FILE  run commands over ssh on the hosts listed in FILE\n"
+"  --hedge=N  run a second copy of a command with 'hedge = 1' once it takes\n"
+"           N times as long as it did before, keeping the first to finish\n"
 "  -n       dry run (don't run commands but act like they succeeded)\n"
+"  --simulate  dry run taking as long as the build log says each command\n"
+"           takes, on a virtual clock, and print how long the build takes\n"
+"  --jobserver  share the -j budget with commands through a GNU make jobserver\n"
+"  --watch  keep running, rebuilding whenever input files change\n"
+"  --server  keep running, building for ninja invocations in this directory\n"
 "  -v, --verbose  show all command lines while building\n"
+"  --events-fd=N  also write the events of the build to file descriptor N,\n"
+"           as described in misc/build_events.proto\n"
+"  --status-fps=N  redraw the status line at most N times a second\n"
+"  --status-lines=N  also show the N commands running the longest\n"
+"  --readahead  read the inputs of commands about to run into the page cache\n"
+"  --speculate=N  use up to N%% of the jobs to run commands ahead of restat\n"
+"                 edges they depend on\n"
+"  --dirs=DIR,...  run ninja in each of these directories in parallel,\n"
+"           sharing -j\n"
+"  --numa   spread commands over the NUMA nodes, pinning each to one\n"
 "\n"
 "  -d MODE  enable debugging (use '-d list' to list modes)\n"
 "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
@@ -303,7 +497,7 @@ Node* NinjaMain::CollectTarget(const char* cpath, string* err) {
     } else {
       Node* suggestion = state_.SpellcheckNode(path);
       if (suggestion) {
-        *err += ", did you mean '" + suggestion->path() + "'?";
+        *err += ", did you mean '" + suggestion->path().AsString() + "'?";
       }
     }
     return NULL;
@@ -327,6 +521,42 @@ bool NinjaMain::CollectTargetsFromArgs(int argc, char* argv[],
 }
 
 int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
+  // The graph tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "graph".
+  ++argc;
+  --argv;
+
+  GraphViz graph;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hd:r"))) != -1) {
+    switch (opt) {
+    case 'd': {
+      char* end;
+      graph.max_depth_ = strtol(optarg, &end, 10);
+      if (*end != 0 || graph.max_depth_ < 0) {
+        Error("invalid -d parameter");
+        return 1;
+      }
+      break;
+    }
+    case 'r':
+      graph.by_rule_ = true;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t graph [options] [targets]\n"
+"\n"
+"options:\n"
+"  -d DEPTH  only show the edges at most DEPTH steps away from the targets\n"
+"  -r        show one node per rule instead of the files and edges\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
   vector<Node*> nodes;
   string err;
   if (!CollectTargetsFromArgs(argc, argv, &nodes, &err)) {
@@ -334,7 +564,6 @@ int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
     return 1;
   }
 
-  GraphViz graph;
   graph.Start();
   for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
     graph.AddTarget(*n);
@@ -343,22 +572,160 @@ int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
-int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
-  if (argc == 0) {
-    Error("expected a target to query");
-    return 1;
+void EncodeJSONString(const char* str, string* out) {
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      out->push_back('\\');
+    out->push_back(*str);
   }
+}
 
-  for (int i = 0; i < argc; ++i) {
-    string err;
-    Node* node = CollectTarget(argv[i], &err);
-    if (!node) {
-      Error("%s", err.c_str());
-      return 1;
+/// Load the dyndep file \a edge depends on if it hasn't been, so that
+/// the query sees all of its inputs and outputs.
+void LoadPendingDyndep(Edge* edge, DyndepLoader* dyndep_loader) {
+  if (!edge->dyndep_ || !edge->dyndep_->dyndep_pending())
+    return;
+  string err;
+  if (!dyndep_loader->LoadDyndeps(edge->dyndep_, &err))
+    Warning("%s", err.c_str());
+}
+
+const char* InputType(Edge* edge, size_t index) {
+  if (edge->is_implicit(index))
+    return "implicit";
+  if (edge->is_order_only(index))
+    return "order-only";
+  return "explicit";
+}
+
+void AppendJSONPaths(const char* name, const vector<Node*>& nodes,
+                     string* out) {
+  *out += ",\"";
+  *out += name;
+  *out += "\":[";
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end();
+       ++n) {
+    if (n != nodes.begin())
+      out->push_back(',');
+    out->push_back('"');
+    EncodeJSONString((*n)->path_c_str(), out);
+    out->push_back('"');
+  }
+  out->push_back(']');
+}
+
+void PrintPaths(const char* name, const vector<Node*>& nodes) {
+  printf("  %s:\n", name);
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
+    printf("    %s\n", (*n)->path_c_str());
+}
+
+void NinjaMain::CollectTransitiveInputs(Node* node,
+                                        DyndepLoader* dyndep_loader,
+                                        vector<Node*>* inputs) {
+  set<Node*> seen;
+  seen.insert(node);
+  vector<Node*> stack(1, node);
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+    vector<Node*> found;
+    if (Edge* edge = n->in_edge()) {
+      LoadPendingDyndep(edge, dyndep_loader);
+      found = edge->inputs_;
+    }
+    // What the depfiles of the last build found, like headers.
+    if (DepsLog::Deps* deps = deps_log_.GetDeps(n))
+      found.insert(found.end(), deps->nodes, deps->nodes + deps->node_count);
+    for (vector<Node*>::iterator in = found.begin(); in != found.end(); ++in) {
+      if (seen.insert(*in).second) {
+        inputs->push_back(*in);
+        stack.push_back(*in);
+      }
+    }
+  }
+}
+
+void NinjaMain::CollectDepsDependents(Node* node, vector<Node*>* outputs) {
+  vector<Node*> dependents;
+  deps_log_.GetDependents(node, &dependents);
+  for (vector<Node*>::iterator out = dependents.begin();
+       out != dependents.end(); ++out) {
+    if (deps_log_.IsDepsEntryLiveFor(*out))
+      outputs->push_back(*out);
+  }
+}
+
+bool NinjaMain::LoadDepsDependents() {
+  string err;
+  if (!deps_log_.LoadDependents(DepsLogPath(), &err)) {
+    Error("loading deps log %s: %s", DepsLogPath().c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+  return true;
+}
+
+void NinjaMain::CollectTransitiveOutputs(Node* node,
+                                         DyndepLoader* dyndep_loader,
+                                         vector<Node*>* outputs) {
+  set<Node*> seen;
+  seen.insert(node);
+  vector<Node*> stack(1, node);
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+    // Copied, as loading a dyndep file may add to them.
+    vector<Edge*> out_edges(n->out_edges().begin(), n->out_edges().end());
+    for (vector<Edge*>::iterator edge = out_edges.begin();
+         edge != out_edges.end(); ++edge) {
+      LoadPendingDyndep(*edge, dyndep_loader);
+      for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
+           out != (*edge)->outputs_.end(); ++out) {
+        if (seen.insert(*out).second) {
+          outputs->push_back(*out);
+          stack.push_back(*out);
+        }
+      }
+    }
+    vector<Node*> dependents;
+    CollectDepsDependents(n, &dependents);
+    for (vector<Node*>::const_iterator out = dependents.begin();
+         out != dependents.end(); ++out) {
+      if (seen.insert(*out).second) {
+        outputs->push_back(*out);
+        stack.push_back(*out);
+      }
     }
+  }
+}
+
+bool NinjaMain::QueryTarget(const char* target, const QueryOptions& query,
+                            DyndepLoader* dyndep_loader, string* err) {
+  Node* node = CollectTarget(target, err);
+  if (!node)
+    return false;
 
-    printf("%s:\n", node->path().c_str());
-    if (Edge* edge = node->in_edge()) {
+  Edge* edge = node->in_edge();
+  if (edge)
+    LoadPendingDyndep(edge, dyndep_loader);
+  vector<Node*> outputs;
+  for (EdgeSpan::const_iterator e = node->out_edges().begin();
+       e != node->out_edges().end(); ++e) {
+    outputs.insert(outputs.end(), (*e)->outputs_.begin(),
+                   (*e)->outputs_.end());
+  }
+  vector<Node*> transitive_inputs;
+  if (query.transitive_inputs)
+    CollectTransitiveInputs(node, dyndep_loader, &transitive_inputs);
+  vector<Node*> transitive_outputs;
+  if (query.transitive_outputs)
+    CollectTransitiveOutputs(node, dyndep_loader, &transitive_outputs);
+
+  if (!query.json) {
+    printf("%s:\n", node->path_c_str());
+    if (edge) {
       printf("  input: %s\n", edge->rule_->name().c_str());
       for (int in = 0; in < (int)edge->inputs_.size(); in++) {
         const char* label = "";
@@ -366,18 +733,141 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
           label = "| ";
         else if (edge->is_order_only(in))
           label = "|| ";
-        printf("    %s%s\n", label, edge->inputs_[in]->path().c_str());
+        printf("    %s%s\n", label, edge->inputs_[in]->path_c_str());
       }
     }
-    printf("  outputs:\n");
-    for (vector<Edge*>::const_iterator edge = node->out_edges().begin();
-         edge != node->out_edges().end(); ++edge) {
-      for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
-           out != (*edge)->outputs_.end(); ++out) {
-        printf("    %s\n", (*out)->path().c_str());
-      }
+    PrintPaths("outputs", outputs);
+    if (query.transitive_inputs)
+      PrintPaths("transitive inputs", transitive_inputs);
+    if (query.transitive_outputs)
+      PrintPaths("transitive outputs", transitive_outputs);
+    return true;
+  }
+
+  string out = "{\"target\":\"";
+  EncodeJSONString(node->path_c_str(), &out);
+  out += "\"";
+  if (edge) {
+    out += ",\"rule\":\"";
+    EncodeJSONString(edge->rule_->name().c_str(), &out);
+    out += "\",\"inputs\":[";
+    for (size_t in = 0; in < edge->inputs_.size(); ++in) {
+      if (in > 0)
+        out.push_back(',');
+      out += "{\"path\":\"";
+      EncodeJSONString(edge->inputs_[in]->path_c_str(), &out);
+      out += "\",\"type\":\"";
+      out += InputType(edge, in);
+      out += "\"}";
+    }
+    out.push_back(']');
+  }
+  AppendJSONPaths("outputs", outputs, &out);
+  if (query.transitive_inputs)
+    AppendJSONPaths("transitive_inputs", transitive_inputs, &out);
+  if (query.transitive_outputs)
+    AppendJSONPaths("transitive_outputs", transitive_outputs, &out);
+  out += "}\n";
+  fputs(out.c_str(), stdout);
+  return true;
+}
+
+/// Print \a err as the answer to a query of \a target.
+void PrintQueryError(const char* target, const QueryOptions& query,
+                     const string& err) {
+  if (!query.json) {
+    printf("ninja: error: %s\n", err.c_str());
+    return;
+  }
+  string out = "{\"target\":\"";
+  EncodeJSONString(target, &out);
+  out += "\",\"error\":\"";
+  EncodeJSONString(err.c_str(), &out);
+  out += "\"}\n";
+  fputs(out.c_str(), stdout);
+}
+
+int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
+  // The query tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "query".
+  ++argc;
+  --argv;
+
+  QueryOptions query;
+  bool interactive = false;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hiIjR"))) != -1) {
+    switch (opt) {
+    case 'i':
+      interactive = true;
+      break;
+    case 'I':
+      query.transitive_inputs = true;
+      break;
+    case 'j':
+      query.json = true;
+      break;
+    case 'R':
+      query.transitive_outputs = true;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t query [options] targets\n"
+"\n"
+"options:\n"
+"  -i     read the targets from stdin, one per line, and answer each in\n"
+"         turn, ending the answer with an empty line\n"
+"  -I     also list all the inputs the targets depend on, transitively,\n"
+"         including those found by depfiles\n"
+"  -R     also list all the outputs that depend on the targets, transitively\n"
+"  -j     answer each target with one line of JSON\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  if (argc == 0 && !interactive) {
+    Error("expected a target to query");
+    return 1;
+  }
+
+  if (query.transitive_outputs && !LoadDepsDependents())
+    return 1;
+
+  DyndepLoader dyndep_loader(&state_, &disk_interface_);
+
+  for (int i = 0; i < argc; ++i) {
+    string err;
+    if (!QueryTarget(argv[i], query, &dyndep_loader, &err)) {
+      Error("%s", err.c_str());
+      return 1;
     }
   }
+  if (!interactive)
+    return 0;
+
+  // The graph stays loaded for as long as targets come, so that each costs
+  // a lookup rather than loading the manifest and logs again.  Errors are
+  // answers too, and don't end the session.
+  fflush(stdout);
+  char line[4096];
+  while (fgets(line, sizeof(line), stdin)) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len > 0 && line[len - 1] == '\r')
+      line[--len] = '\0';
+    string err;
+    if (!QueryTarget(line, query, &dyndep_loader, &err))
+      PrintQueryError(line, query, err);
+    // A JSON answer is a single line already.
+    if (!query.json)
+      printf("\n");
+    fflush(stdout);
+  }
   return 0;
 }
 
@@ -405,18 +895,37 @@ int NinjaMain::ToolMSVC(const Options* options, int argc, char* argv[]) {
 #endif
 
 int ToolTargetsList(const vector<Node*>& nodes, int depth, int indent) {
-  for (vector<Node*>::const_iterator n = nodes.begin();
-       n != nodes.end();
-       ++n) {
-    for (int i = 0; i < indent; ++i)
+  // Walked with a stack rather than recursion, as the tree can be as deep
+  // as the graph.  Each node is there with its depth and indent.
+  struct Pending {
+    Node* node;
+    int depth;
+    int indent;
+  };
+  vector<Pending> stack;
+  for (vector<Node*>::const_reverse_iterator n = nodes.rbegin();
+       n != nodes.rend(); ++n) {
+    Pending pending = { *n, depth, indent };
+    stack.push_back(pending);
+  }
+  while (!stack.empty()) {
+    Pending pending = stack.back();
+    stack.pop_back();
+    for (int i = 0; i < pending.indent; ++i)
       printf("  ");
-    const char* target = (*n)->path().c_str();
-    if ((*n)->in_edge()) {
-      printf("%s: %s\n", target, (*n)->in_edge()->rule_->name().c_str());
-      if (depth > 1 || depth <= 0)
-        ToolTargetsList((*n)->in_edge()->inputs_, depth - 1, indent + 1);
-    } else {
+    const char* target = pending.node->path_c_str();
+    Edge* edge = pending.node->in_edge();
+    if (!edge) {
       printf("%s\n", target);
+      continue;
+    }
+    printf("%s: %s\n", target, edge->rule_->name().c_str());
+    if (pending.depth > 1 || pending.depth <= 0) {
+      for (vector<Node*>::reverse_iterator in = edge->inputs_.rbegin();
+           in != edge->inputs_.rend(); ++in) {
+        Pending input = { *in, pending.depth - 1, pending.indent + 1 };
+        stack.push_back(input);
+      }
     }
   }
   return 0;
@@ -428,7 +937,7 @@ int ToolTargetsSourceList(State* state) {
     for (vector<Node*>::iterator inps = (*e)->inputs_.begin();
          inps != (*e)->inputs_.end(); ++inps) {
       if (!(*inps)->in_edge())
-        printf("%s\n", (*inps)->path().c_str());
+        printf("%s\n", (*inps)->path_c_str());
     }
   }
   return 0;
@@ -443,7 +952,7 @@ int ToolTargetsList(State* state, const string& rule_name) {
     if ((*e)->rule_->name() == rule_name) {
       for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
-        rules.insert((*out_node)->path());
+        rules.insert((*out_node)->path().AsString());
       }
     }
   }
@@ -463,7 +972,7 @@ int ToolTargetsList(State* state) {
     for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
       printf("%s: %s\n",
-             (*out_node)->path().c_str(),
+             (*out_node)->path_c_str(),
              (*e)->rule_->name().c_str());
     }
   }
@@ -491,25 +1000,53 @@ int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
        it != end; ++it) {
     DepsLog::Deps* deps = deps_log_.GetDeps(*it);
     if (!deps) {
-      printf("%s: deps not found\n", (*it)->path().c_str());
+      printf("%s: deps not found\n", (*it)->path_c_str());
       continue;
     }
 
     string err;
-    TimeStamp mtime = disk_interface.Stat((*it)->path(), &err);
+    TimeStamp mtime = disk_interface.Stat((*it)->path().AsString(), &err);
     if (mtime == -1)
       Error("%s", err.c_str());  // Log and ignore Stat() errors;
     printf("%s: #deps %d, deps mtime %" PRId64 " (%s)\n",
-           (*it)->path().c_str(), deps->node_count, deps->mtime,
+           (*it)->path_c_str(), deps->node_count, deps->mtime,
            (!mtime || mtime > deps->mtime ? "STALE":"VALID"));
     for (int i = 0; i < deps->node_count; ++i)
-      printf("    %s\n", deps->nodes[i]->path().c_str());
+      printf("    %s\n", deps->nodes[i]->path_c_str());
     printf("\n");
   }
 
   return 0;
 }
 
+int NinjaMain::ToolRdeps(const Options* options, int argc, char** argv) {
+  if (argc == 0) {
+    Error("expected a target to list the dependents of");
+    return 1;
+  }
+  vector<Node*> nodes;
+  string err;
+  if (!CollectTargetsFromArgs(argc, argv, &nodes, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  if (!LoadDepsDependents())
+    return 1;
+
+  for (vector<Node*>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+    vector<Node*> dependents;
+    CollectDepsDependents(*it, &dependents);
+    printf("%s: #dependents %d\n", (*it)->path_c_str(),
+           (int)dependents.size());
+    for (vector<Node*>::iterator out = dependents.begin();
+         out != dependents.end(); ++out) {
+      printf("    %s\n", (*out)->path_c_str());
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
 int NinjaMain::ToolTargets(const Options* options, int argc, char* argv[]) {
   int depth = 1;
   if (argc >= 1) {
@@ -551,20 +1088,81 @@ int NinjaMain::ToolTargets(const Options* options, int argc, char* argv[]) {
 }
 
 enum PrintCommandMode { PCM_Single, PCM_All };
-void PrintCommands(Edge* edge, set<Edge*>* seen, PrintCommandMode mode) {
-  if (!edge)
-    return;
-  if (!seen->insert(edge).second)
+
+/// Append to |edges| the edges to print the commands of for |edge|, in
+/// order: with PCM_All, each after those of its inputs.  |seen| is indexed
+/// by the id of the edges, and marks those already added.
+void CollectCommands(Edge* edge, vector<bool>* seen, PrintCommandMode mode,
+                     vector<Edge*>* edges) {
+  if (!edge || (*seen)[edge->id_])
     return;
+  // An explicit stack of the edges being visited, with the next of their
+  // inputs to visit, as the chains can be as long as the graph is deep.
+  vector<pair<Edge*, size_t> > stack;
+  (*seen)[edge->id_] = true;
+  stack.push_back(make_pair(edge, 0));
+  while (!stack.empty()) {
+    Edge* top = stack.back().first;
+    size_t& next = stack.back().second;
+    if (mode == PCM_All && next < top->inputs_.size()) {
+      Edge* in_edge = top->inputs_[next++]->in_edge();
+      if (in_edge && !(*seen)[in_edge->id_]) {
+        (*seen)[in_edge->id_] = true;
+        stack.push_back(make_pair(in_edge, 0));
+      }
+      continue;
+    }
+    stack.pop_back();
+    if (!top->is_phony())
+      edges->push_back(top);
+  }
+}
+
+/// Edges whose commands one thread evaluates at a time.
+const size_t kCommandsEdgesPerChunk = 256;
+
+/// Arguments of CommandsChunkThread.
+struct CommandsArgs {
+  const vector<Edge*>* edges;
+  size_t first_chunk;
+  /// The commands of each chunk, one per line.
+  vector<string>* chunks;
+};
 
-  if (mode == PCM_All) {
-    for (vector<Node*>::iterator in = edge->inputs_.begin();
-         in != edge->inputs_.end(); ++in)
-      PrintCommands((*in)->in_edge(), seen, mode);
+void CommandsChunkThread(void* arg, size_t index) {
+  CommandsArgs* args = static_cast<CommandsArgs*>(arg);
+  size_t begin = (args->first_chunk + index) * kCommandsEdgesPerChunk;
+  size_t end = min(begin + kCommandsEdgesPerChunk, args->edges->size());
+  string& out = (*args->chunks)[index];
+  out.clear();
+  for (size_t i = begin; i < end; ++i) {
+    (*args->edges)[i]->EvaluateCommand(&out);
+    out += '\n';
+  }
+}
+
+/// Print the commands of |edges|, evaluated from several threads, a window
+/// of chunks at a time.
+void PrintCommands(const vector<Edge*>& edges) {
+  set<const Rule*> rules;
+  for (vector<Edge*>::const_iterator e = edges.begin(); e != edges.end(); ++e) {
+    // Rules intern their variables as they're first evaluated, which isn't
+    // safe to do from several threads.
+    if (rules.insert((*e)->rule_).second)
+      (*e)->rule_->InternVariables();
   }
 
-  if (!edge->is_phony())
-    puts(edge->EvaluateCommand().c_str());
+  size_t chunk_count =
+      (edges.size() + kCommandsEdgesPerChunk - 1) / kCommandsEdgesPerChunk;
+  int threads = max(GetProcessorCount(), 1);
+  vector<string> chunks(threads * 4);
+  for (size_t first = 0; first < chunk_count; first += chunks.size()) {
+    size_t count = min(chunks.size(), chunk_count - first);
+    CommandsArgs args = { &edges, first, &chunks };
+    ParallelFor(count, threads, CommandsChunkThread, &args);
+    for (size_t i = 0; i < count; ++i)
+      fwrite(chunks[i].data(), 1, chunks[i].size(), stdout);
+  }
 }
 
 int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
@@ -602,13 +1200,103 @@ int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
     return 1;
   }
 
-  set<Edge*> seen;
+  vector<bool> seen(state_.edges_.size());
+  vector<Edge*> edges;
   for (vector<Node*>::iterator in = nodes.begin(); in != nodes.end(); ++in)
-    PrintCommands((*in)->in_edge(), &seen, mode);
+    CollectCommands((*in)->in_edge(), &seen, mode, &edges);
+  PrintCommands(edges);
 
   return 0;
 }
 
+int NinjaMain::ToolCritPath(const Options* options, int argc, char* argv[]) {
+  // The tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "critpath".
+  ++argc;
+  --argv;
+
+  int parallelism = config_.parallelism;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hj:"))) != -1) {
+    switch (opt) {
+    case 'j': {
+      char* end;
+      parallelism = strtol(optarg, &end, 10);
+      if (*end != 0 || parallelism <= 0)
+        Fatal("invalid -j parameter");
+      break;
+    }
+    case 'h':
+    default:
+      printf("usage: ninja -t critpath [options] [targets]\n"
+"\n"
+"show the critical path of a clean build of [targets], from the durations\n"
+"in the build log, and what a number of jobs makes of it\n"
+"\n"
+"options:\n"
+"  -j N   the number of jobs to estimate for [default=%d]\n",
+             config_.parallelism);
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  vector<Node*> nodes;
+  string err;
+  if (!CollectTargetsFromArgs(argc, argv, &nodes, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  CriticalPathAnalysis analysis(&build_log_);
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+    analysis.AddTarget(*n);
+  analysis.Analyze();
+
+  const vector<CriticalPathAnalysis::Step>& path = analysis.critical_path();
+  int64_t length = analysis.critical_path_duration();
+  printf("critical path: %.3fs, %d of %d commands\n", length / 1000.0,
+         (int)path.size(), analysis.command_count());
+  if (analysis.unknown_count() > 0) {
+    printf("(%d commands aren't in the build log and are taken to last "
+           "%.3fs, marked *)\n",
+           analysis.unknown_count(), analysis.default_duration() / 1000.0);
+  }
+  printf("\n%9s %10s %6s  %s\n", "duration", "cumulative", "share", "output");
+  int64_t cumulative = 0;
+  for (vector<CriticalPathAnalysis::Step>::const_iterator s = path.begin();
+       s != path.end(); ++s) {
+    cumulative += s->duration;
+    printf("%8.3fs%s %9.3fs %5.1f%%  %s\n", s->duration / 1000.0,
+           s->known ? " " : "*", cumulative / 1000.0,
+           length ? 100.0 * s->duration / length : 0.0,
+           s->edge->outputs_[0]->path_c_str());
+  }
+
+  const int kBuckets = 20;
+  vector<double> profile;
+  int64_t total = analysis.total_duration();
+  int64_t estimate = analysis.Simulate(parallelism, kBuckets, &profile);
+  printf("\ntotal: %.3fs of commands, at most %.1fx faster than one job\n",
+         total / 1000.0, length ? (double)total / length : 1.0);
+  printf("at -j %d: about %.3fs, %.1fx faster than one job\n", parallelism,
+         estimate / 1000.0, estimate ? (double)total / estimate : 1.0);
+
+  if (estimate > 0) {
+    printf("\ncommands running over time at -j %d:\n", parallelism);
+    double most = *max_element(profile.begin(), profile.end());
+    const int kWidth = 50;
+    for (int b = 0; b < kBuckets; ++b) {
+      int bar = most > 0 ? (int)(profile[b] / most * kWidth + 0.5) : 0;
+      printf("%8.3fs %6.1f  %s\n", b * (estimate / 1000.0) / kBuckets,
+             profile[b], string(bar, '#').c_str());
+    }
+  }
+  return 0;
+}
+
 int NinjaMain::ToolClean(const Options* options, int argc, char* argv[]) {
   // The clean tool uses getopt, and expects argv[0] to contain the name of
   // the tool, i.e. "clean".
@@ -654,16 +1342,11 @@ int NinjaMain::ToolClean(const Options* options, int argc, char* argv[]) {
     else
       return cleaner.CleanTargets(argc, argv);
   } else {
-    return cleaner.CleanAll(generator);
-  }
-}
-
-void EncodeJSONString(const char *str) {
-  while (*str) {
-    if (*str == '"' || *str == '\\')
-      putchar('\\');
-    putchar(*str);
-    str++;
+    int status = cleaner.CleanAll(generator);
+    // Ninja wrote the cached graph too, though no build statement did.
+    if (!config_.dry_run && disk_interface_.RemoveFile(kManifestCachePath) < 0)
+      status = 1;
+    return status;
   }
 }
 
@@ -684,7 +1367,7 @@ string EvaluateCommandWithRspfile(Edge* edge, EvaluateCommandMode mode) {
   if (index == 0 || index == string::npos || command[index - 1] != '@')
     return command;
 
-  string rspfile_content = edge->GetBinding("rspfile_content");
+  string rspfile_content = edge->GetBinding(VarNames::kRspfileContent);
   size_t newline_index = 0;
   while ((newline_index = rspfile_content.find('\n', newline_index)) !=
          string::npos) {
@@ -695,6 +1378,60 @@ string EvaluateCommandWithRspfile(Edge* edge, EvaluateCommandMode mode) {
   return command;
 }
 
+/// Edges of a compilation database that one thread writes the entries of.
+const size_t kCompdbEdgesPerChunk = 256;
+
+/// Arguments of CompdbChunkThread.
+struct CompdbArgs {
+  const vector<Edge*>* edges;
+  size_t first_chunk;
+  EvaluateCommandMode mode;
+  /// The start of every entry, up to the command.
+  const string* prefix;
+  /// The entries of each chunk.
+  vector<string>* chunks;
+};
+
+void CompdbChunkThread(void* arg, size_t index) {
+  CompdbArgs* args = static_cast<CompdbArgs*>(arg);
+  size_t begin = (args->first_chunk + index) * kCompdbEdgesPerChunk;
+  size_t end = min(begin + kCompdbEdgesPerChunk, args->edges->size());
+  string& out = (*args->chunks)[index];
+  out.clear();
+  for (size_t i = begin; i < end; ++i) {
+    Edge* edge = (*args->edges)[i];
+    if (i != begin)
+      out += ',';
+    out += *args->prefix;
+    EncodeJSONString(EvaluateCommandWithRspfile(edge, args->mode).c_str(),
+                     &out);
+    out += "\",\n    \"file\": \"";
+    EncodeJSONString(edge->inputs_[0]->path_c_str(), &out);
+    out += "\",\n    \"output\": \"";
+    EncodeJSONString(edge->outputs_[0]->path_c_str(), &out);
+    out += "\"\n  }";
+  }
+}
+
+/// The hashes of the entries of a compilation database written by
+/// ToolCompilationDatabase(), sorted.
+vector<uint64_t> HashCompdbEntries(const string& compdb) {
+  vector<uint64_t> hashes;
+  const string kEntryStart = "\n  {\n";
+  const string kEntryEnd = "\n  }";
+  size_t start = compdb.find(kEntryStart);
+  while (start != string::npos) {
+    size_t end = compdb.find(kEntryEnd, start);
+    if (end == string::npos)
+      break;
+    end += kEntryEnd.size();
+    hashes.push_back(ContentHash::Hash(compdb.data() + start, end - start));
+    start = compdb.find(kEntryStart, end);
+  }
+  sort(hashes.begin(), hashes.end());
+  return hashes;
+}
+
 int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
                                        char* argv[]) {
   // The compdb tool uses getopt, and expects argv[0] to contain the name of
@@ -703,22 +1440,29 @@ int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
   argv--;
 
   EvaluateCommandMode eval_mode = ECM_NORMAL;
+  const char* update_path = NULL;
 
   optind = 1;
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("hx"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("hxu:"))) != -1) {
     switch(opt) {
       case 'x':
         eval_mode = ECM_EXPAND_RSPFILE;
         break;
 
+      case 'u':
+        update_path = optarg;
+        break;
+
       case 'h':
       default:
         printf(
             "usage: ninja -t compdb [options] [rules]\n"
             "\n"
             "options:\n"
-            "  -x     expand @rspfile style response file invocations\n"
+            "  -x       expand @rspfile style response file invocations\n"
+            "  -u FILE  write to FILE instead of stdout, leaving it alone if\n"
+            "           no entry changed\n"
             );
         return 1;
     }
@@ -726,7 +1470,6 @@ int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
   argv += optind;
   argc -= optind;
 
-  bool first = true;
   vector<char> cwd;
 
   do {
@@ -738,44 +1481,127 @@ int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
     return 1;
   }
 
-  putchar('[');
+  // The edges in their order in the database, once per rule they match.
+  vector<Edge*> edges;
+  set<const Rule*> rules;
   for (vector<Edge*>::iterator e = state_.edges_.begin();
        e != state_.edges_.end(); ++e) {
     if ((*e)->inputs_.empty())
       continue;
     for (int i = 0; i != argc; ++i) {
       if ((*e)->rule_->name() == argv[i]) {
-        if (!first)
-          putchar(',');
-
-        printf("\n  {\n    \"directory\": \"");
-        EncodeJSONString(&cwd[0]);
-        printf("\",\n    \"command\": \"");
-        EncodeJSONString(EvaluateCommandWithRspfile(*e, eval_mode).c_str());
-        printf("\",\n    \"file\": \"");
-        EncodeJSONString((*e)->inputs_[0]->path().c_str());
-        printf("\",\n    \"output\": \"");
-        EncodeJSONString((*e)->outputs_[0]->path().c_str());
-        printf("\"\n  }");
-
-        first = false;
+        edges.push_back(*e);
+        if (rules.insert((*e)->rule_).second)
+          (*e)->rule_->InternVariables();
       }
     }
   }
 
-  puts("\n]");
-  return 0;
-}
-
-int NinjaMain::ToolRecompact(const Options* options, int argc, char* argv[]) {
-  if (!EnsureBuildDirExists())
-    return 1;
+  string prefix = "\n  {\n    \"directory\": \"";
+  EncodeJSONString(&cwd[0], &prefix);
+  prefix += "\",\n    \"command\": \"";
+
+  // Evaluate the commands from several threads, a window of chunks at a
+  // time, and write the chunks out in order as each window is done.
+  string out = "[";
+  size_t chunk_count =
+      (edges.size() + kCompdbEdgesPerChunk - 1) / kCompdbEdgesPerChunk;
+  int threads = max(GetProcessorCount(), 1);
+  vector<string> chunks(threads * 4);
+  for (size_t first = 0; first < chunk_count; first += chunks.size()) {
+    size_t count = min(chunks.size(), chunk_count - first);
+    CompdbArgs args = { &edges, first, eval_mode, &prefix, &chunks };
+    ParallelFor(count, threads, CompdbChunkThread, &args);
+    for (size_t i = 0; i < count; ++i) {
+      if (first + i != 0)
+        out += ',';
+      out += chunks[i];
+    }
+    if (!update_path) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  }
+  out += "\n]\n";
 
-  if (!OpenBuildLog(/*recompact_only=*/true) ||
-      !OpenDepsLog(/*recompact_only=*/true))
-    return 1;
+  if (!update_path) {
+    fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+  }
 
-  return 0;
+  string old, err;
+  if (disk_interface_.ReadFile(update_path, &old, &err) == DiskInterface::Okay &&
+      old == out) {
+    printf("ninja: %s is up to date.\n", update_path);
+    return 0;
+  }
+  vector<uint64_t> old_hashes = HashCompdbEntries(old);
+  vector<uint64_t> new_hashes = HashCompdbEntries(out);
+  size_t changed = 0;
+  for (vector<uint64_t>::iterator h = new_hashes.begin();
+       h != new_hashes.end(); ++h) {
+    if (!binary_search(old_hashes.begin(), old_hashes.end(), *h))
+      ++changed;
+  }
+
+  // Replace the file at once, so that readers never see half of it.
+  string temp_path = string(update_path) + ".tmp";
+  if (!disk_interface_.WriteFile(temp_path, out))
+    return 1;
+#ifdef _WIN32
+  // rename() doesn't replace existing files on Windows.
+  unlink(update_path);
+#endif
+  if (rename(temp_path.c_str(), update_path) < 0) {
+    Error("renaming %s: %s", temp_path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+    return 1;
+  }
+  printf("ninja: %s: %d of %d entries changed.\n", update_path, (int)changed,
+         (int)new_hashes.size());
+  return 0;
+}
+
+int NinjaMain::ToolRecompact(const Options* options, int argc, char* argv[]) {
+  if (!EnsureBuildDirExists())
+    return 1;
+
+  if (!OpenBuildLog(/*recompact_only=*/true) ||
+      !OpenDepsLog(/*recompact_only=*/true))
+    return 1;
+
+  return 0;
+}
+
+int NinjaMain::ToolRestat(const Options* options, int argc, char* argv[]) {
+  vector<string> outputs;
+  for (int i = 0; i < argc; ++i) {
+    string path = argv[i];
+    string err;
+    uint64_t slash_bits;
+    if (!CanonicalizePath(&path, &slash_bits, &err)) {
+      Error("%s: %s", argv[i], err.c_str());
+      return 1;
+    }
+    outputs.push_back(path);
+  }
+
+  if (!EnsureBuildDirExists())
+    return 1;
+
+  if (!OpenBuildLog(/*recompact_only=*/true, &outputs) ||
+      !OpenDepsLog(/*recompact_only=*/true, &outputs))
+    return 1;
+
+  return 0;
+}
+
+int NinjaMain::ToolBuildLog(const Options* options, int argc, char* argv[]) {
+  if (!build_log_.WriteText(stdout)) {
+    Error("writing build log: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
 }
 
 int NinjaMain::ToolUrtle(const Options* options, int argc, char** argv) {
@@ -818,8 +1644,12 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolClean },
     { "commands", "list all commands required to rebuild given targets",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCommands },
+    { "critpath", "show the critical path of a build and how -j shortens it",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolCritPath },
     { "deps", "show dependencies stored in the deps log",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolDeps },
+    { "rdeps", "show the outputs whose stored dependencies include a path",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolRdeps },
     { "graph", "output graphviz dot file for targets",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolGraph },
     { "query", "show inputs/outputs for a path",
@@ -830,6 +1660,10 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCompilationDatabase },
     { "recompact",  "recompacts ninja-internal data structures",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
+    { "restat",  "refreshes the output mtimes recorded in the logs",
+      Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRestat },
+    { "buildlog",  "print the build log as text, whatever its format",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolBuildLog },
     { "urtle", NULL,
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolUrtle },
     { NULL, NULL, Tool::RUN_AFTER_FLAGS, NULL }
@@ -862,23 +1696,68 @@ const Tool* ChooseTool(const string& tool_name) {
   return NULL;  // Not reached.
 }
 
+/// Where '-d stats=FILE' writes the metrics as JSON, if it was given.
+string g_stats_path;
+
+/// Where '-d trace=FILE' writes the trace, if it was given.  It's opened
+/// only once all the flags are read, so that a server can turn it down.
+string g_trace_path;
+
+/// Whether '-d memstats' was given.
+bool g_memory_stats = false;
+
+/// Print what '-d stataudit' counted, however ninja exits.
+void ReportStatAudit() {
+  g_stat_audit->Report();
+}
+
+/// Print what '-d slots' accounted for, however ninja exits.
+void ReportSlotUsage() {
+  g_slot_usage->Report();
+}
+
 /// Enable a debugging mode.  Returns false if Ninja should exit instead
 /// of continuing.
 bool DebugEnable(const string& name) {
   if (name == "list") {
     printf("debugging modes:\n"
 "  stats        print operation counts/timing info\n"
+"  stats=FILE   write them to FILE as JSON instead\n"
+"  stataudit    count the stat() calls by reason, and those repeated\n"
+"  slots        report why the -j slots were idle during the build\n"
+"  memstats     print the memory the graph and the logs take after the build\n"
 "  explain      explain what caused a command to execute\n"
 "  keepdepfile  don't delete depfiles after they're read by ninja\n"
 "  keeprsp      don't delete @response files on success\n"
-#ifdef _WIN32
 "  nostatcache  don't batch stat() calls per directory and cache them\n"
+"  trace=FILE   write a Chrome trace of the commands and of ninja to FILE\n"
+#ifdef USE_IO_URING
+"  iouring      issue batches of stat() calls through io_uring\n"
 #endif
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
     g_metrics = new Metrics;
     return true;
+  } else if (name.compare(0, 6, "stats=") == 0) {
+    g_metrics = new Metrics;
+    g_stats_path = name.substr(6);
+    return true;
+  } else if (name == "stataudit") {
+    if (!g_stat_audit) {
+      g_stat_audit = new StatAudit;
+      atexit(ReportStatAudit);
+    }
+    return true;
+  } else if (name == "slots") {
+    if (!g_slot_usage) {
+      g_slot_usage = new SlotUsage;
+      atexit(ReportSlotUsage);
+    }
+    return true;
+  } else if (name == "memstats") {
+    g_memory_stats = true;
+    return true;
   } else if (name == "explain") {
     g_explaining = true;
     return true;
@@ -891,11 +1770,18 @@ bool DebugEnable(const string& name) {
   } else if (name == "nostatcache") {
     g_experimental_statcache = false;
     return true;
+  } else if (name == "iouring") {
+    g_experimental_io_uring = true;
+    return true;
+  } else if (name.compare(0, 6, "trace=") == 0) {
+    g_trace_path = name.substr(6);
+    return true;
   } else {
     const char* suggestion =
         SpellcheckString(name.c_str(),
-                         "stats", "explain", "keepdepfile", "keeprsp",
-                         "nostatcache", NULL);
+                         "stats", "stataudit", "slots", "memstats", "explain",
+                         "keepdepfile", "keeprsp", "nostatcache", "iouring",
+                         "trace", NULL);
     if (suggestion) {
       Error("unknown debug setting '%s', did you mean '%s'?",
             name.c_str(), suggestion);
@@ -940,12 +1826,14 @@ bool WarningEnable(const string& name, Options* options) {
   }
 }
 
-bool NinjaMain::OpenBuildLog(bool recompact_only) {
+bool NinjaMain::OpenBuildLog(bool recompact_only,
+                             const vector<string>* restat_outputs) {
   string log_path = ".ninja_log";
   if (!build_dir_.empty())
     log_path = build_dir_ + "/" + log_path;
 
   string err;
+  build_log_.set_binary(config_.binary_log);
   if (!build_log_.Load(log_path, &err)) {
     Error("loading build log %s: %s", log_path.c_str(), err.c_str());
     return false;
@@ -956,6 +1844,9 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
     err.clear();
   }
 
+  if (restat_outputs)
+    build_log_.Restat(disk_interface_, *restat_outputs);
+
   if (recompact_only) {
     bool success = build_log_.Recompact(log_path, *this, &err);
     if (!success)
@@ -964,6 +1855,7 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
   }
 
   if (!config_.dry_run) {
+    build_log_.set_commit_policy(config_.log_commit);
     if (!build_log_.OpenForWrite(log_path, *this, &err)) {
       Error("opening build log: %s", err.c_str());
       return false;
@@ -973,12 +1865,18 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
   return true;
 }
 
-/// Open the deps log: load it, then open for writing.
-/// @return false on error.
-bool NinjaMain::OpenDepsLog(bool recompact_only) {
+string NinjaMain::DepsLogPath() const {
   string path = ".ninja_deps";
   if (!build_dir_.empty())
     path = build_dir_ + "/" + path;
+  return path;
+}
+
+/// Open the deps log: load it, then open for writing.
+/// @return false on error.
+bool NinjaMain::OpenDepsLog(bool recompact_only,
+                            const vector<string>* restat_outputs) {
+  string path = DepsLogPath();
 
   string err;
   if (!deps_log_.Load(path, &state_, &err)) {
@@ -990,6 +1888,11 @@ bool NinjaMain::OpenDepsLog(bool recompact_only) {
     Warning("%s", err.c_str());
     err.clear();
   }
+  if (partial_graph_)
+    deps_log_.SkipRecompaction();
+
+  if (restat_outputs)
+    deps_log_.Restat(disk_interface_, *restat_outputs);
 
   if (recompact_only) {
     bool success = deps_log_.Recompact(path, &err);
@@ -999,6 +1902,7 @@ bool NinjaMain::OpenDepsLog(bool recompact_only) {
   }
 
   if (!config_.dry_run) {
+    deps_log_.set_commit_policy(config_.log_commit);
     if (!deps_log_.OpenForWrite(path, &err)) {
       Error("opening deps log: %s", err.c_str());
       return false;
@@ -1008,7 +1912,27 @@ bool NinjaMain::OpenDepsLog(bool recompact_only) {
   return true;
 }
 
+void NinjaMain::CloseLogs() {
+  build_log_.Close();
+  deps_log_.Close();
+}
+
+void NinjaMain::DumpMemoryStats() {
+  MemoryStats stats;
+  state_.ReportMemory(&stats);
+  build_log_.ReportMemory(&stats);
+  deps_log_.ReportMemory(&stats);
+  stats.Report();
+}
+
 void NinjaMain::DumpMetrics() {
+  if (!g_stats_path.empty()) {
+    string err;
+    if (!g_metrics->ReportJSON(g_stats_path, &err))
+      Error("writing %s: %s", g_stats_path.c_str(), err.c_str());
+    return;
+  }
+
   g_metrics->Report();
 
   printf("\n");
@@ -1037,10 +1961,27 @@ int NinjaMain::RunBuild(int argc, char** argv) {
     Error("%s", err.c_str());
     return 1;
   }
+  return BuildTargets(targets, false, NULL);
+}
 
+int NinjaMain::BuildTargets(const vector<Node*>& targets, bool quiet,
+                            vector<Edge*>* planned) {
+  string err;
   disk_interface_.AllowStatCache(g_experimental_statcache);
 
   Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_);
+  FailureLog failure_log;
+  if (!config_.dry_run) {
+    string path = ".ninja_failures";
+    if (!build_dir_.empty())
+      path = build_dir_ + "/" + path;
+    if (failure_log.Load(path, &err))
+      builder.SetFailureLog(&failure_log);
+    else
+      Warning("%s", err.c_str());
+    err.clear();
+  }
+  builder.PrefetchStats(targets);
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder.AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -1057,21 +1998,296 @@ int NinjaMain::RunBuild(int argc, char** argv) {
   disk_interface_.AllowStatCache(false);
 
   if (builder.AlreadyUpToDate()) {
-    printf("ninja: no work to do.\n");
+    if (!quiet)
+      printf("ninja: no work to do.\n");
     return 0;
   }
 
-  if (!builder.Build(&err)) {
+  if (planned) {
+    for (vector<Edge*>::iterator e = state_.edges_.begin();
+         e != state_.edges_.end(); ++e) {
+      if ((*e)->mark_ == Edge::VisitNone)
+        continue;
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        if ((*o)->dirty()) {
+          planned->push_back(*e);
+          break;
+        }
+      }
+    }
+  }
+
+  SimulatedCommandRunner* simulator = NULL;
+  if (config_.simulate) {
+    simulator = new SimulatedCommandRunner(config_);
+    builder.command_runner_.reset(simulator);
+  }
+
+  bool built = builder.Build(&err);
+  string save_err;
+  if (!config_.dry_run && !failure_log.Save(&save_err))
+    Warning("%s", save_err.c_str());
+  if (!built) {
     printf("ninja: build stopped: %s.\n", err.c_str());
     if (err.find("interrupted by user") != string::npos) {
       return 2;
     }
     return 1;
   }
+  if (simulator) {
+    printf("ninja: simulated build took %.3fs with -j %d.\n",
+           simulator->now() / 1e3, config_.parallelism);
+  }
 
   return 0;
 }
 
+namespace {
+
+/// Whether any edge of |state| has a dyndep binding.
+bool HasDyndeps(const State& state) {
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    if ((*e)->dyndep_)
+      return true;
+  }
+  return false;
+}
+
+/// Whether |node| is the dyndep file of an edge and was loaded into the
+/// graph, which then has to be loaded again for changes of it to show.
+bool IsLoadedDyndep(const Node* node) {
+  if (node->dyndep_pending())
+    return false;
+  for (EdgeSpan::const_iterator e = node->out_edges().begin();
+       e != node->out_edges().end(); ++e) {
+    if ((*e)->dyndep_ == node)
+      return true;
+  }
+  return false;
+}
+
+/// Whether any of the |planned| edges wrote a dyndep file that was loaded.
+bool WroteLoadedDyndep(const vector<Edge*>& planned) {
+  for (vector<Edge*>::const_iterator e = planned.begin(); e != planned.end();
+       ++e) {
+    for (vector<Node*>::const_iterator o = (*e)->outputs_.begin();
+         o != (*e)->outputs_.end(); ++o) {
+      if (IsLoadedDyndep(*o))
+        return true;
+    }
+  }
+  return false;
+}
+
+/// The directory holding the node at |path|, a canonical path.
+string DirName(const string& path) {
+  string::size_type slash = path.find_last_of('/');
+  if (slash == string::npos)
+    return ".";
+  if (slash == 0)
+    return "/";
+  return path.substr(0, slash);
+}
+
+/// Keeps the graph in step with the files that change on disk, for --watch.
+struct GraphWatcher {
+  explicit GraphWatcher(State* state) : state_(state), node_count_(0) {}
+
+  /// Start watching the manifest files and the graph's directories.
+  bool Start(const vector<ManifestFile>& manifest_files, string* err);
+
+  /// Watch the directories of the nodes in the graph.  Only looks at all the
+  /// nodes when there are new ones since last time, e.g. from deps, but
+  /// always retries the directories that were missing, which builds often
+  /// create.
+  bool WatchGraph(string* err);
+
+  /// Reset the nodes that changed, apart from the |ignored| ones, so that
+  /// the next build stats them again.  If |block|, waits until a change
+  /// concerns the graph; otherwise only looks at what's pending.  Sets
+  /// |changed| if a node changed and |reload| if a manifest did.
+  bool ReadChanges(bool block, const set<Node*>& ignored, bool* changed,
+                   bool* reload, string* err);
+
+ private:
+  /// Watch the |dirs| that aren't watched yet, remembering the ones that
+  /// don't exist.
+  bool WatchDirectories(const vector<string>& dirs, string* err);
+
+  FileWatcher watcher_;
+  State* state_;
+  set<string> manifest_paths_;
+  set<string> watched_;
+  set<string> missing_;
+  size_t node_count_;
+};
+
+bool GraphWatcher::Start(const vector<ManifestFile>& manifest_files,
+                         string* err) {
+  if (!watcher_.Start(err))
+    return false;
+  vector<string> dirs;
+  for (vector<ManifestFile>::const_iterator i = manifest_files.begin();
+       i != manifest_files.end(); ++i) {
+    string path = i->path;
+    uint64_t slash_bits;
+    string path_err;
+    if (!CanonicalizePath(&path, &slash_bits, &path_err))
+      continue;
+    manifest_paths_.insert(path);
+    dirs.push_back(DirName(path));
+  }
+  return WatchDirectories(dirs, err) && WatchGraph(err);
+}
+
+bool GraphWatcher::WatchDirectories(const vector<string>& dirs, string* err) {
+  for (vector<string>::const_iterator dir = dirs.begin(); dir != dirs.end();
+       ++dir) {
+    if (watched_.count(*dir))
+      continue;
+    if (watcher_.AddDirectory(*dir, err)) {
+      watched_.insert(*dir);
+      missing_.erase(*dir);
+    } else if (err->empty()) {
+      missing_.insert(*dir);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool GraphWatcher::WatchGraph(string* err) {
+  vector<string> dirs(missing_.begin(), missing_.end());
+  if (state_->paths_.size() != node_count_) {
+    node_count_ = state_->paths_.size();
+    for (State::Paths::const_iterator i = state_->paths_.begin();
+         i != state_->paths_.end(); ++i) {
+      dirs.push_back(DirName(i->second->path().AsString()));
+    }
+  }
+  return WatchDirectories(dirs, err);
+}
+
+bool GraphWatcher::ReadChanges(bool block, const set<Node*>& ignored,
+                               bool* changed, bool* reload, string* err) {
+  *changed = false;
+  *reload = false;
+  do {
+    vector<string> paths;
+    bool overflow = false;
+    if (!watcher_.WaitForChanges(block, &paths, &overflow, err))
+      return false;
+    for (vector<string>::iterator i = paths.begin(); i != paths.end(); ++i) {
+      uint64_t slash_bits;
+      string path_err;
+      if (!CanonicalizePath(&*i, &slash_bits, &path_err))
+        continue;
+      if (manifest_paths_.count(*i)) {
+        *reload = true;
+        return true;
+      }
+      // Files outside the graph, like .ninja_log, don't matter.
+      Node* node = state_->LookupNode(*i);
+      if (!node || ignored.count(node))
+        continue;
+      // What a dyndep file added to the graph stays there.
+      if (IsLoadedDyndep(node)) {
+        *reload = true;
+        return true;
+      }
+      node->ResetState();
+      if (node->in_edge())
+        node->in_edge()->UnloadDeps();
+      *changed = true;
+    }
+    if (overflow) {
+      // Start over with a full scan of the graph.
+      state_->Reset();
+      watched_.clear();
+      node_count_ = 0;
+      if (!WatchGraph(err))
+        return false;
+      *changed = true;
+    }
+  } while (block && !*changed);
+  return true;
+}
+
+}  // anonymous namespace
+
+int NinjaMain::RunWatch(int argc, char** argv, const char* input_file,
+                        const vector<ManifestFile>& manifest_files,
+                        bool* reload) {
+  *reload = false;
+  string err;
+  vector<Node*> targets;
+  if (!CollectTargetsFromArgs(argc, argv, &targets, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  // Watch everything before building, so that nothing changing during the
+  // build goes unnoticed.
+  GraphWatcher watcher(&state_);
+  if (!watcher.Start(manifest_files, &err)) {
+    Error("--watch: %s", err.c_str());
+    return 1;
+  }
+
+  for (bool first = true;; first = false) {
+    if (!first) {
+      if (RebuildManifest(input_file, &err)) {
+        *reload = true;
+        return 0;
+      } else if (!err.empty()) {
+        Error("rebuilding '%s': %s", input_file, err.c_str());
+        err.clear();
+      }
+    }
+
+    vector<Edge*> planned;
+    if (BuildTargets(targets, !first, &planned) == 2)
+      return 2;  // Interrupted by the user.
+    // The next build needs the graph without what a dyndep file it wrote
+    // added to it before.
+    *reload = WroteLoadedDyndep(planned);
+
+    // What the build ran may have new outputs and new deps.  Writing the
+    // outputs also woke the watcher, which mustn't start the next build.
+    set<Node*> outputs;
+    for (vector<Edge*>::iterator e = planned.begin(); e != planned.end(); ++e) {
+      (*e)->UnloadDeps();
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        (*o)->ResetState();
+        outputs.insert(*o);
+      }
+    }
+    bool changed = false;
+    if (!*reload &&
+        (!watcher.WatchGraph(&err) ||
+         !watcher.ReadChanges(false, outputs, &changed, reload, &err))) {
+      Error("--watch: %s", err.c_str());
+      return 1;
+    }
+    // Unless inputs changed during the build, wait for the next change.
+    if (!changed && !*reload) {
+      if (first || !planned.empty())
+        printf("ninja: waiting for changes (press Ctrl-C to stop)...\n");
+      if (!watcher.ReadChanges(true, set<Node*>(), &changed, reload, &err)) {
+        Error("--watch: %s", err.c_str());
+        return 1;
+      }
+    }
+    if (*reload)
+      return 0;
+    state_.ResetBuildState();
+  }
+}
+
 #ifdef _MSC_VER
 
 /// This handler processes fatal crashes that you can't catch
@@ -1095,23 +2311,106 @@ int ExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS *ep) {
 
 #endif  // _MSC_VER
 
+/// Parse a number of bytes, with an optional K, M or G suffix.
+bool ParseSize(const char* arg, int64_t* size) {
+  char* end;
+  double value = strtod(arg, &end);
+  if (end == arg)
+    return false;
+  switch (*end) {
+    case 'G': case 'g': value *= 1024;  // Fall through.
+    case 'M': case 'm': value *= 1024;  // Fall through.
+    case 'K': case 'k': value *= 1024; ++end;
+  }
+  if (*end != 0 || value < 0)
+    return false;
+  *size = (int64_t)value;
+  return true;
+}
+
+/// Parse a --log-commit argument, "RECORDS,MS" optionally followed by
+/// ",sync".
+bool ParseLogCommit(const char* arg, LogCommitPolicy* policy) {
+  char* end;
+  long records = strtol(arg, &end, 10);
+  if (end == arg || *end != ',' || records < 1)
+    return false;
+  const char* ms = end + 1;
+  long delay = strtol(ms, &end, 10);
+  if (end == ms || delay < 0)
+    return false;
+  bool sync = strcmp(end, ",sync") == 0;
+  if (*end != 0 && !sync)
+    return false;
+  policy->max_records = (int)records;
+  policy->max_delay_ms = (int)delay;
+  policy->sync = sync;
+  return true;
+}
+
+/// Note in \a options how to drop the option getopt just returned from
+/// \a argv when --dirs passes the command line on: the \a long_option
+/// however abbreviated, or -C out of any group of short options it is in,
+/// along with its argument.
+void NoteDirsRewrite(char** argv, bool long_option, Options* options) {
+  char* last = argv[optind - 1];
+  char* option = optarg == last ? argv[optind - 2] : last;
+  if (optarg == last)
+    options->dirs_rewrites[last] = "";
+  string rest;
+  if (!long_option) {
+    // What precedes the 'C' of "-C", "-nC" or "-nCdir".
+    rest = optarg == last ? string(option, strlen(option) - 1)
+                          : string(option, optarg - 1 - option);
+    if (rest == "-")
+      rest.clear();
+  }
+  options->dirs_rewrites[option] = rest;
+}
+
 /// Parse argv for command-line options.
 /// Returns an exit code, or -1 if Ninja should continue.
 int ReadFlags(int* argc, char*** argv,
               Options* options, BuildConfig* config) {
   config->parallelism = GuessParallelism();
 
-  enum { OPT_VERSION = 1 };
+  enum { OPT_VERSION = 1, OPT_JOBSERVER = 2, OPT_WATCH = 3, OPT_SERVER = 4,
+         OPT_MAX_OUTPUT = 5, OPT_LOG_COMMIT = 6, OPT_ACTION_CACHE = 7,
+         OPT_REMOTE_EXEC = 8, OPT_REMOTE_JOBS = 9, OPT_HOSTS = 10,
+         OPT_EVENTS_FD = 11, OPT_STATUS_FPS = 12, OPT_STATUS_LINES = 13,
+         OPT_READAHEAD = 14, OPT_SPECULATE = 15, OPT_DIRS = 16,
+         OPT_BINARY_LOG = 17, OPT_NUMA = 18, OPT_SIMULATE = 19,
+         OPT_HEDGE = 20, OPT_CACHE_GRAPH = 21 };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, OPT_VERSION },
+    { "jobserver", no_argument, NULL, OPT_JOBSERVER },
+    { "watch", no_argument, NULL, OPT_WATCH },
+    { "server", no_argument, NULL, OPT_SERVER },
+    { "max-output", required_argument, NULL, OPT_MAX_OUTPUT },
+    { "log-commit", required_argument, NULL, OPT_LOG_COMMIT },
+    { "action-cache", required_argument, NULL, OPT_ACTION_CACHE },
+    { "remote-exec", required_argument, NULL, OPT_REMOTE_EXEC },
+    { "remote-jobs", required_argument, NULL, OPT_REMOTE_JOBS },
+    { "hosts", required_argument, NULL, OPT_HOSTS },
+    { "events-fd", required_argument, NULL, OPT_EVENTS_FD },
+    { "status-fps", required_argument, NULL, OPT_STATUS_FPS },
+    { "status-lines", required_argument, NULL, OPT_STATUS_LINES },
+    { "readahead", no_argument, NULL, OPT_READAHEAD },
+    { "speculate", required_argument, NULL, OPT_SPECULATE },
+    { "dirs", required_argument, NULL, OPT_DIRS },
+    { "binary-log", no_argument, NULL, OPT_BINARY_LOG },
+    { "numa", no_argument, NULL, OPT_NUMA },
+    { "simulate", no_argument, NULL, OPT_SIMULATE },
+    { "hedge", required_argument, NULL, OPT_HEDGE },
+    { "cache-graph", no_argument, NULL, OPT_CACHE_GRAPH },
     { "verbose", no_argument, NULL, 'v' },
     { NULL, 0, NULL, 0 }
   };
 
   int opt;
   while (!options->tool &&
-         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:nt:vw:C:h", kLongOptions,
+         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:m:nt:vw:C:h", kLongOptions,
                             NULL)) != -1) {
     switch (opt) {
       case 'd':
@@ -1145,6 +2444,10 @@ int ReadFlags(int* argc, char*** argv,
         break;
       }
       case 'l': {
+        if (strcmp(optarg, "auto") == 0) {
+          config->adaptive_parallelism = true;
+          break;
+        }
         char* end;
         double value = strtod(optarg, &end);
         if (end == optarg)
@@ -1152,6 +2455,10 @@ int ReadFlags(int* argc, char*** argv,
         config->max_load_average = value;
         break;
       }
+      case 'm':
+        if (!ParseSize(optarg, &config->max_memory))
+          Fatal("invalid -m parameter: did you mean -m 16G?");
+        break;
       case 'n':
         config->dry_run = true;
         break;
@@ -1169,10 +2476,115 @@ int ReadFlags(int* argc, char*** argv,
         break;
       case 'C':
         options->working_dir = optarg;
+        NoteDirsRewrite(*argv, false, options);
         break;
       case OPT_VERSION:
         printf("%s\n", kNinjaVersion);
         return 0;
+      case OPT_JOBSERVER:
+        options->jobserver = true;
+        break;
+      case OPT_WATCH:
+        options->watch = true;
+        break;
+      case OPT_SERVER:
+        options->server = true;
+        break;
+      case OPT_MAX_OUTPUT:
+        if (!ParseSize(optarg, &config->max_output))
+          Fatal("invalid --max-output parameter: did you mean "
+                "--max-output=16M?");
+        break;
+      case OPT_LOG_COMMIT:
+        if (!ParseLogCommit(optarg, &config->log_commit))
+          Fatal("invalid --log-commit parameter: did you mean "
+                "--log-commit=256,100?");
+        break;
+      case OPT_ACTION_CACHE:
+        config->action_cache_dir = optarg;
+        break;
+      case OPT_REMOTE_EXEC:
+        config->remote_exec = optarg;
+        break;
+      case OPT_REMOTE_JOBS: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value <= 0)
+          Fatal("invalid --remote-jobs parameter");
+        config->remote_jobs = value;
+        break;
+      }
+      case OPT_HOSTS: {
+#ifdef _WIN32
+        Fatal("--hosts is not supported on Windows");
+#endif
+        string contents, err;
+        if (ReadFile(optarg, &contents, &err) < 0)
+          Fatal("loading %s: %s", optarg, err.c_str());
+        if (!ParseWorkerHosts(contents, &config->hosts, &err))
+          Fatal("%s: %s", optarg, err.c_str());
+        break;
+      }
+      case OPT_EVENTS_FD: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("invalid --events-fd parameter");
+        config->events_fd = value;
+        break;
+      }
+      case OPT_STATUS_FPS: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("invalid --status-fps parameter");
+        config->status_fps = value;
+        break;
+      }
+      case OPT_STATUS_LINES: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("invalid --status-lines parameter");
+        config->status_lines = value;
+        break;
+      }
+      case OPT_READAHEAD:
+        config->readahead = true;
+        break;
+      case OPT_SPECULATE: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0 || value > 100)
+          Fatal("invalid --speculate parameter");
+        config->speculation = value;
+        break;
+      }
+      case OPT_DIRS:
+        options->dirs = optarg;
+        NoteDirsRewrite(*argv, true, options);
+        break;
+      case OPT_BINARY_LOG:
+        config->binary_log = true;
+        break;
+      case OPT_NUMA:
+        config->numa_placement = true;
+        break;
+      case OPT_SIMULATE:
+        config->simulate = true;
+        config->dry_run = true;
+        break;
+      case OPT_HEDGE: {
+        char* end;
+        double value = strtod(optarg, &end);
+        if (*end != 0 || !(value >= 1))
+          Fatal("invalid --hedge parameter");
+        config->hedge_factor = value;
+        break;
+      }
+      case OPT_CACHE_GRAPH:
+        options->cache_graph = true;
+        break;
       case 'h':
       default:
         Usage(*config);
@@ -1181,10 +2593,315 @@ int ReadFlags(int* argc, char*** argv,
   }
   *argv += optind;
   *argc -= optind;
+  if (config->remote_jobs == 0)
+    config->remote_jobs = config->parallelism;
+  if (!config->hosts.empty() && !config->remote_exec.empty())
+    Fatal("--hosts and --remote-exec can't be used together");
 
   return -1;
 }
 
+/// Whether a ninja --server can run what \a options and \a config ask for:
+/// builds, and the tools that only read the graph and the logs.  Flags that
+/// name programs to run, files to write or descriptors aren't passed on.
+bool CanForward(const Options& options, const BuildConfig& config, int argc,
+                char** argv) {
+  if (options.server || options.watch || options.jobserver)
+    return false;
+  if (!config.remote_exec.empty() || !config.hosts.empty() ||
+      !config.action_cache_dir.empty() || config.events_fd >= 0 ||
+      !g_trace_path.empty() || !g_stats_path.empty()) {
+    return false;
+  }
+  if (!options.tool)
+    return true;
+  // A query reading its targets from stdin would hold on to the server for
+  // as long as it runs; it is better off loading the graph once itself.
+  if (strcmp(options.tool->name, "query") == 0) {
+    for (int i = 0; i < argc; ++i) {
+      if (strcmp(argv[i], "-i") == 0)
+        return false;
+    }
+  }
+  const char* kServedTools[] = { "commands", "deps", "graph", "query",
+                                 "rdeps", "targets", NULL };
+  for (const char** tool = kServedTools; *tool; ++tool) {
+    if (strcmp(options.tool->name, *tool) == 0)
+      return true;
+  }
+  return false;
+}
+
+/// Fill \a targets with the canonical paths of what a plain build asks
+/// for, if that's what \a options and the arguments ask for, so that only
+/// the part of the manifest they need can be loaded.
+bool GetLazyTargets(const Options& options, int argc, char** argv,
+                    vector<string>* targets) {
+  if (options.tool || options.watch || options.server || argc == 0)
+    return false;
+  for (int i = 0; i < argc; ++i) {
+    string path = argv[i];
+    string err;
+    uint64_t slash_bits;
+    // "foo^" is found through the edges that use foo, which may be
+    // anywhere.
+    if (path.empty() || path[path.size() - 1] == '^' ||
+        !CanonicalizePath(&path, &slash_bits, &err)) {
+      return false;
+    }
+    targets->push_back(path);
+  }
+  return true;
+}
+
+int NinjaMain::ServeRequest(const ServerRequest& request, BuildConfig* config,
+                            const char* input_file, vector<Edge*>* planned,
+                            bool* reload) {
+  // Commands can't share a jobserver the client inherited.
+  JobserverConfig jobserver_config;
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags &&
+      JobserverConfig::ParseMakeFlags(makeflags, &jobserver_config)) {
+    return -1;
+  }
+
+  vector<char*> args;
+  args.push_back(const_cast<char*>(ninja_command_));
+  for (vector<string>::const_iterator i = request.args.begin();
+       i != request.args.end(); ++i) {
+    args.push_back(const_cast<char*>(i->c_str()));
+  }
+  args.push_back(NULL);
+  int argc = (int)args.size() - 1;
+  char** argv = &args[0];
+
+  // Parse the flags as a fresh ninja would.  The client already did, so
+  // they are known to be valid.
+#ifdef __GLIBC__
+  optind = 0;
+#else
+  optind = 1;
+#endif
+  g_explaining = false;
+  g_keep_depfile = false;
+  g_keep_rsp = false;
+  g_experimental_statcache = true;
+  g_experimental_io_uring = false;
+  g_trace_path.clear();
+  g_stats_path.clear();
+  Options options = {};
+  options.input_file = "build.ninja";
+  options.dupe_edges_should_err = true;
+  *config = BuildConfig();
+  if (ReadFlags(&argc, &argv, &options, config) >= 0 ||
+      !CanForward(options, *config, argc, argv) ||
+      strcmp(options.input_file, input_file) != 0) {
+    return -1;
+  }
+
+  if (options.tool)
+    return (this->*options.tool->func)(&options, argc, argv);
+
+  string err;
+  // In dry_run mode the regeneration would succeed without changing the
+  // manifest, over and over again.
+  if (!config->dry_run) {
+    if (RebuildManifest(input_file, &err)) {
+      *reload = true;
+      return 0;
+    } else if (!err.empty()) {
+      Error("rebuilding '%s': %s", input_file, err.c_str());
+      return 1;
+    }
+  }
+
+  vector<Node*> targets;
+  if (!CollectTargetsFromArgs(argc, argv, &targets, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return BuildTargets(targets, false, planned);
+}
+
+int NinjaMain::RunServer(Server* server, ServerRequest* request,
+                         BuildConfig* config, const char* input_file,
+                         const vector<ManifestFile>& manifest_files,
+                         bool* reload) {
+  *reload = false;
+  string err;
+  GraphWatcher watcher(&state_);
+  bool watching = watcher.Start(manifest_files, &err);
+  if (!watching) {
+    Warning("--server: %s; checking all files for every build", err.c_str());
+    err.clear();
+  }
+
+  for (;;) {
+    if (!request->pending()) {
+      if (!server->Accept(request, &err)) {
+        if (!err.empty()) {
+          Error("--server: %s", err.c_str());
+          return 1;
+        }
+        return 0;  // Interrupted.
+      }
+      request->Begin();
+    }
+
+    // Catch up with what changed since the previous build.
+    bool changed = false;
+    if (!watching) {
+      // Nothing tells whether the dyndep files that were loaded changed.
+      for (vector<Edge*>::iterator e = state_.edges_.begin();
+           e != state_.edges_.end() && !*reload; ++e) {
+        *reload = (*e)->dyndep_ && IsLoadedDyndep((*e)->dyndep_);
+      }
+      state_.Reset();
+    } else if (!watcher.WatchGraph(&err) ||
+               !watcher.ReadChanges(false, set<Node*>(), &changed, reload,
+                                    &err)) {
+      Error("--server: %s", err.c_str());
+      request->End();
+      request->Reply(1);
+      return 1;
+    }
+    if (*reload)
+      return 0;
+
+    // Relative paths in the client's arguments are relative to its
+    // directory.
+    vector<Edge*> planned;
+    int result = request->cwd != server->dir() ? -1 :
+        ServeRequest(*request, config, input_file, &planned, reload);
+    if (*reload)
+      return 0;
+
+    // As with --watch, forget what the build wrote, without taking its own
+    // writes for changes.
+    set<Node*> outputs;
+    for (vector<Edge*>::iterator e = planned.begin(); e != planned.end(); ++e) {
+      (*e)->UnloadDeps();
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        (*o)->ResetState();
+        outputs.insert(*o);
+      }
+    }
+    *reload = WroteLoadedDyndep(planned);
+    if (watching && !*reload &&
+        (!watcher.WatchGraph(&err) ||
+         !watcher.ReadChanges(false, outputs, &changed, reload, &err))) {
+      Error("--server: %s", err.c_str());
+      request->End();
+      request->Reply(1);
+      return 1;
+    }
+    state_.ResetBuildState();
+
+    request->End();
+    if (result < 0)
+      request->Decline();
+    else
+      request->Reply(result);
+    if (*reload)
+      return 0;
+  }
+}
+
+/// Start a ninja process with the arguments \a argc and \a argv, less
+/// those that \a rewrites drops, in each of the comma-separated directories
+/// \a dirs in parallel, relative to \a working_dir if given.  They share
+/// \a parallelism jobs through a jobserver, so that the builds with more to
+/// do take the slots the others don't need.  Returns the exit code.
+int RunInDirs(const char* ninja_command, const char* working_dir,
+              const char* dirs, int parallelism,
+              const map<const char*, string>& rewrites, int argc,
+              char** argv) {
+  vector<string> dir_list;
+  for (const char* d = dirs; ; ) {
+    const char* end = strchr(d, ',');
+    string dir = end ? string(d, end - d) : string(d);
+    if (!dir.empty()) {
+      bool absolute = dir[0] == '/';
+#ifdef _WIN32
+      absolute = absolute || dir[0] == '\\' ||
+                 (dir.size() > 1 && dir[1] == ':');
+#endif
+      if (working_dir && !absolute)
+        dir = string(working_dir) + "/" + dir;
+      dir_list.push_back(dir);
+    }
+    if (!end)
+      break;
+    d = end + 1;
+  }
+  if (dir_list.empty())
+    Fatal("--dirs: no directories");
+
+  string args;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    map<const char*, string>::const_iterator r = rewrites.find(argv[i]);
+    if (r != rewrites.end()) {
+      if (r->second.empty())
+        continue;
+      arg = r->second;
+    }
+    args += ' ';
+#ifdef _WIN32
+    GetWin32EscapedString(arg, &args);
+#else
+    GetShellEscapedString(arg, &args);
+#endif
+  }
+
+  // Mark the builds, so that they can't run --dirs again themselves.
+#ifdef _WIN32
+  if (_putenv("NINJA_IN_DIRS=1") != 0)
+#else
+  if (setenv("NINJA_IN_DIRS", "1", 1) < 0)
+#endif
+    Fatal("--dirs: can't set NINJA_IN_DIRS");
+
+  // Each of the builds holds the implicit token of its process.
+  JobserverServer jobserver;
+  string err;
+  int tokens = max(1, parallelism - (int)dir_list.size() + 1);
+  if (!jobserver.Create(tokens, &err))
+    Fatal("%s", err.c_str());
+
+  SubprocessSet subprocs;
+  for (vector<string>::iterator d = dir_list.begin(); d != dir_list.end();
+       ++d) {
+    string command;
+#ifdef _WIN32
+    GetWin32EscapedString(ninja_command, &command);
+    command += " -C ";
+    GetWin32EscapedString(*d, &command);
+#else
+    GetShellEscapedString(ninja_command, &command);
+    command += " -C ";
+    GetShellEscapedString(*d, &command);
+#endif
+    command += args;
+    if (!subprocs.Add(command, true))
+      Fatal("couldn't run ninja in '%s'", d->c_str());
+  }
+
+  int exit_code = 0;
+  while (!subprocs.running_.empty() || !subprocs.finished_.empty()) {
+    Subprocess* subproc;
+    while ((subproc = subprocs.NextFinished()) != NULL) {
+      if (subproc->Finish() != ExitSuccess)
+        exit_code = 1;
+      delete subproc;
+    }
+    if (!subprocs.running_.empty() && subprocs.DoWork())
+      exit_code = 2;  // Interrupted; the builds are too.
+  }
+  return exit_code;
+}
+
 NORETURN void real_main(int argc, char** argv) {
   // Use exit() instead of return in this function to avoid potentially
   // expensive cleanup when destructing NinjaMain.
@@ -1195,11 +2912,30 @@ NORETURN void real_main(int argc, char** argv) {
 
   setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
   const char* ninja_command = argv[0];
+  // What a server would need to run this: getopt() may reorder the
+  // arguments, but doesn't drop any.
+  int forward_argc = argc - 1;
+  char** forward_argv = argv + 1;
 
   int exit_code = ReadFlags(&argc, &argv, &options, &config);
   if (exit_code >= 0)
     exit(exit_code);
 
+  if (!g_trace_path.empty()) {
+    string err;
+    g_trace = new Trace;
+    if (!g_trace->Open(g_trace_path, &err))
+      Fatal("opening trace %s: %s", g_trace_path.c_str(), err.c_str());
+  }
+
+  if (options.dirs) {
+    if (getenv("NINJA_IN_DIRS"))
+      Fatal("--dirs: already building under --dirs");
+    exit(RunInDirs(ninja_command, options.working_dir, options.dirs,
+                   config.parallelism, options.dirs_rewrites, forward_argc,
+                   forward_argv));
+  }
+
   if (options.working_dir) {
     // The formatting of this string, complete with funny quotes, is
     // so Emacs can properly identify that the cwd has changed for
@@ -1213,6 +2949,15 @@ NORETURN void real_main(int argc, char** argv) {
     }
   }
 
+  // A ninja --server running here already has everything loaded.
+  if (CanForward(options, config, argc, argv)) {
+    int result;
+    if (ForwardToServer(kServerSocketPath, forward_argc, forward_argv,
+                        &result)) {
+      exit(result);
+    }
+  }
+
   if (options.tool && options.tool->when == Tool::RUN_AFTER_FLAGS) {
     // None of the RUN_AFTER_FLAGS actually use a NinjaMain, but it's needed
     // by other tools.
@@ -1220,8 +2965,37 @@ NORETURN void real_main(int argc, char** argv) {
     exit((ninja.*options.tool->func)(&options, argc, argv));
   }
 
+  // Commands (and this process) then share the jobserver through MAKEFLAGS.
+  JobserverServer jobserver;
+  if (options.jobserver) {
+    JobserverConfig jobserver_config;
+    const char* makeflags = getenv("MAKEFLAGS");
+    string err;
+    if (makeflags &&
+        JobserverConfig::ParseMakeFlags(makeflags, &jobserver_config)) {
+      Warning("already running under a jobserver; ignoring --jobserver");
+    } else if (!jobserver.Create(config.parallelism, &err)) {
+      Fatal("%s", err.c_str());
+    }
+  }
+
+  // Listen before loading anything, so that clients can queue up meanwhile.
+  // Both outlive reloads of the manifest.
+  Server server;
+  ServerRequest request;
+  if (options.server) {
+    string err;
+    if (!server.Listen(kServerSocketPath, &err))
+      Fatal("--server: %s", err.c_str());
+  }
+
   // Limit number of rebuilds, to prevent infinite loops.
   const int kCycleLimit = 100;
+  bool use_manifest_cache = options.cache_graph;
+  bool use_manifest_index = true;
+  // The files of the manifest, split into statements, for as long as it may
+  // get regenerated and loaded again.
+  ManifestReuse manifest_reuse;
   for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
     NinjaMain ninja(ninja_command, config);
 
@@ -1232,12 +3006,85 @@ NORETURN void real_main(int argc, char** argv) {
     if (options.phony_cycle_should_err) {
       parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
     }
-    ManifestParser parser(&ninja.state_, &ninja.disk_interface_, parser_opts);
+    parser_opts.parallelism_ = GetProcessorCount();
+    parser_opts.reuse_ = &manifest_reuse;
+    RecordingFileReader manifest_reader(&ninja.disk_interface_);
     string err;
-    if (!parser.Load(options.input_file, &err)) {
-      Error("%s", err.c_str());
-      exit(1);
+    // The cached graph is only good for the same manifest and options.
+    string cache_key = string(options.input_file) +
+        (options.dupe_edges_should_err ? " dupbuild=err" : "") +
+        (options.phony_cycle_should_err ? " phonycycle=err" : "");
+    ManifestCache::LoadStatus cached = ManifestCache::LOAD_STALE;
+    if (use_manifest_cache) {
+      cached = ManifestCache::Load(kManifestCachePath, cache_key,
+                                   &ninja.disk_interface_, &ninja.state_,
+                                   &manifest_reader.files_, &err);
     }
+    if (cached == ManifestCache::LOAD_ERROR) {
+      // Start over with a fresh state.
+      Warning("%s: %s; parsing the manifest instead", kManifestCachePath,
+              err.c_str());
+      use_manifest_cache = false;
+      --cycle;
+      continue;
+    }
+    if (cached == ManifestCache::LOAD_STALE) {
+      // A build of a few targets may do without most 'subninja' files.
+      ManifestIndex index;
+      set<string> skip;
+      vector<string> targets;
+      string manifest_path = options.input_file;
+      uint64_t slash_bits;
+      if (use_manifest_index &&
+          GetLazyTargets(options, argc, argv, &targets) &&
+          CanonicalizePath(&manifest_path, &slash_bits, &err)) {
+        if (index.Load(kManifestIndexPath, cache_key, &err)) {
+          ninja.partial_graph_ =
+              index.FindSkippable(targets, manifest_path,
+                                  &ninja.disk_interface_, &skip) &&
+              !skip.empty();
+        } else if (!err.empty()) {
+          Warning("%s: %s", kManifestIndexPath, err.c_str());
+        }
+      }
+      err.clear();
+
+      ManifestIndexBuilder index_builder(options.input_file);
+      if (ninja.partial_graph_)
+        parser_opts.skip_subninjas_ = &skip;
+      else if (!config.dry_run)
+        parser_opts.index_ = &index_builder;
+      ManifestParser parser(&ninja.state_, &manifest_reader, parser_opts);
+      bool loaded = parser.Load(options.input_file, &err);
+      if (ninja.partial_graph_ &&
+          (!loaded || !index.Covers(ninja.state_) ||
+           HasDyndeps(ninja.state_))) {
+        // The parts that were loaded changed beyond what the index knows,
+        // or dyndep files may tie them to the parts that weren't: start
+        // over with the whole manifest.
+        use_manifest_index = false;
+        --cycle;
+        continue;
+      }
+      if (!loaded) {
+        Error("%s", err.c_str());
+        exit(1);
+      }
+      if (!ninja.partial_graph_ && !config.dry_run) {
+        if (options.cache_graph &&
+            !ManifestCache::Save(kManifestCachePath, cache_key, ninja.state_,
+                                 manifest_reader.files_, &err)) {
+          Warning("writing %s: %s", kManifestCachePath, err.c_str());
+        }
+        if (!index_builder.Save(kManifestIndexPath, cache_key, ninja.state_,
+                                manifest_reader.files_, &err)) {
+          Warning("writing %s: %s", kManifestIndexPath, err.c_str());
+        }
+      }
+    }
+
+    // The graph is loaded: only the deps and dyndep files add to it now.
+    ninja.state_.PackOutEdges();
 
     if (options.tool && options.tool->when == Tool::RUN_AFTER_LOAD)
       exit((ninja.*options.tool->func)(&options, argc, argv));
@@ -1248,8 +3095,11 @@ NORETURN void real_main(int argc, char** argv) {
     if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog())
       exit(1);
 
-    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS)
-      exit((ninja.*options.tool->func)(&options, argc, argv));
+    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS) {
+      int result = (ninja.*options.tool->func)(&options, argc, argv);
+      ninja.CloseLogs();
+      exit(result);
+    }
 
     // Attempt to rebuild the manifest before building anything else
     if (ninja.RebuildManifest(options.input_file, &err)) {
@@ -1261,10 +3111,45 @@ NORETURN void real_main(int argc, char** argv) {
       continue;
     } else if (!err.empty()) {
       Error("rebuilding '%s': %s", options.input_file, err.c_str());
+      ninja.CloseLogs();
       exit(1);
     }
+    // The manifest is up to date, so a build doesn't need the statements any
+    // more.  --watch and --server load it again whenever it's edited.
+    if (!options.watch && !options.server)
+      manifest_reuse.Clear();
+
+    if (options.watch) {
+      bool reload;
+      int result = ninja.RunWatch(argc, argv, options.input_file,
+                                  manifest_reader.files_, &reload);
+      if (reload) {
+        // Edits aren't regeneration loops: don't count them.
+        cycle = 0;
+        continue;
+      }
+      ninja.CloseLogs();
+      exit(result);
+    }
+
+    if (options.server) {
+      bool reload;
+      int result = ninja.RunServer(&server, &request, &config,
+                                   options.input_file, manifest_reader.files_,
+                                   &reload);
+      if (reload) {
+        cycle = 0;
+        continue;
+      }
+      server.Close();
+      ninja.CloseLogs();
+      exit(result);
+    }
 
     int result = ninja.RunBuild(argc, argv);
+    if (g_memory_stats)
+      ninja.DumpMemoryStats();
+    ninja.CloseLogs();
     if (g_metrics)
       ninja.DumpMetrics();
     exit(result);
@@ -0,0 +1,406 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifdef _WIN32
+#include <direct.h>  // Has to be before util.h is included.
+#endif
+
+#include "ninja_api.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "build.h"
+#include "build_log.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "util.h"
+
+/// What ninja_graph_load() loaded, and the logs that builds write to.
+struct ninja_graph : public BuildLogUser {
+  /// The absolute path of the build directory.
+  string dir;
+  State state;
+  RealDiskInterface disk_interface;
+  BuildLog build_log;
+  DepsLog deps_log;
+  string build_log_path;
+  string deps_log_path;
+  /// Whether a build opened the logs for writing.
+  bool logs_open;
+  vector<Node*> defaults;
+
+  ninja_graph() : logs_open(false) {}
+  virtual ~ninja_graph() {}
+
+  /// Load |manifest| and the logs, in the current directory.
+  bool Load(const char* manifest, string* err);
+
+  /// Open the logs for writing, if no earlier build did.
+  bool OpenLogs(string* err);
+
+  /// Like ninja's: outputs that the manifest no longer has and that are
+  /// gone from the disk.
+  virtual bool IsPathDead(StringPiece s) const {
+    Node* n = state.LookupNode(s);
+    if (!n || !n->in_edge())
+      return false;
+    string err;
+    return disk_interface.Stat(s.AsString(), &err) == 0;
+  }
+};
+
+namespace {
+
+/// Changes to a directory for as long as it lives, and back.
+struct ScopedDirectory {
+  ScopedDirectory(const string& dir, string* err) {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+      *err = string("getcwd: ") + strerror(errno);
+      return;
+    }
+    if (chdir(dir.c_str()) < 0) {
+      *err = "chdir to '" + dir + "': " + strerror(errno);
+      return;
+    }
+    previous_ = cwd;
+  }
+
+  ~ScopedDirectory() {
+    if (!previous_.empty() && chdir(previous_.c_str()) < 0)
+      Warning("chdir to '%s': %s", previous_.c_str(), strerror(errno));
+  }
+
+ private:
+  string previous_;
+};
+
+char* CopyString(const string& str) {
+  char* copy = (char*)malloc(str.size() + 1);
+  memcpy(copy, str.c_str(), str.size() + 1);
+  return copy;
+}
+
+void SetError(char** error, const string& message) {
+  if (error)
+    *error = CopyString(message);
+}
+
+Node* AsNode(const ninja_node* node) {
+  return reinterpret_cast<Node*>(const_cast<ninja_node*>(node));
+}
+
+ninja_node* AsApiNode(Node* node) {
+  return reinterpret_cast<ninja_node*>(node);
+}
+
+Edge* AsEdge(const ninja_edge* edge) {
+  return reinterpret_cast<Edge*>(const_cast<ninja_edge*>(edge));
+}
+
+ninja_edge* AsApiEdge(Edge* edge) {
+  return reinterpret_cast<ninja_edge*>(edge);
+}
+
+/// Passes the edges that start and finish on to a ninja_event_callback.
+struct EventForwarder : public BuildObserver {
+  EventForwarder(ninja_event_callback callback, void* user_data)
+      : callback_(callback), user_data_(user_data) {}
+
+  virtual void EdgeStarted(Edge* edge) {
+    ninja_event event = {};
+    event.type = NINJA_EVENT_EDGE_STARTED;
+    event.edge = AsApiEdge(edge);
+    callback_(&event, user_data_);
+  }
+
+  virtual void EdgeFinished(Edge* edge, const CommandRunner::Result& result) {
+    ninja_event event = {};
+    event.type = NINJA_EVENT_EDGE_FINISHED;
+    event.edge = AsApiEdge(edge);
+    event.success = result.success();
+    event.output = result.output.c_str();
+    event.output_size = result.output.size();
+    callback_(&event, user_data_);
+  }
+
+ private:
+  ninja_event_callback callback_;
+  void* user_data_;
+};
+
+}  // anonymous namespace
+
+bool ninja_graph::Load(const char* manifest, string* err) {
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    *err = string("getcwd: ") + strerror(errno);
+    return false;
+  }
+  dir = cwd;
+
+  ManifestParser parser(&state, &disk_interface);
+  if (!parser.Load(manifest, err))
+    return false;
+  state.PackOutEdges();
+
+  string build_dir = state.bindings_.LookupVariable("builddir");
+  string prefix = build_dir.empty() ? "" : build_dir + "/";
+  build_log_path = prefix + ".ninja_log";
+  deps_log_path = prefix + ".ninja_deps";
+  // Load() also returns warnings through |err|, with true.
+  if (!build_log.Load(build_log_path, err)) {
+    *err = "loading build log " + build_log_path + ": " + *err;
+    return false;
+  }
+  err->clear();
+  if (!deps_log.Load(deps_log_path, &state, err)) {
+    *err = "loading deps log " + deps_log_path + ": " + *err;
+    return false;
+  }
+  err->clear();
+
+  defaults = state.DefaultNodes(err);
+  return err->empty();
+}
+
+bool ninja_graph::OpenLogs(string* err) {
+  if (logs_open)
+    return true;
+  string build_dir = state.bindings_.LookupVariable("builddir");
+  if (!build_dir.empty() &&
+      !disk_interface.MakeDirs(build_dir + "/.") && errno != EEXIST) {
+    *err = "creating build directory " + build_dir + ": " + strerror(errno);
+    return false;
+  }
+  if (!build_log.OpenForWrite(build_log_path, *this, err)) {
+    *err = "opening build log: " + *err;
+    return false;
+  }
+  if (!deps_log.OpenForWrite(deps_log_path, err)) {
+    *err = "opening deps log: " + *err;
+    build_log.Close();
+    return false;
+  }
+  logs_open = true;
+  return true;
+}
+
+int ninja_api_version(void) {
+  return NINJA_API_VERSION;
+}
+
+ninja_graph* ninja_graph_load(const char* dir, const char* manifest,
+                              char** error) {
+  ninja_graph* graph = new ninja_graph;
+  string err;
+  {
+    ScopedDirectory scope(dir, &err);
+    if (err.empty())
+      graph->Load(manifest, &err);
+  }
+  if (!err.empty()) {
+    SetError(error, err);
+    delete graph;
+    return NULL;
+  }
+  return graph;
+}
+
+void ninja_graph_free(ninja_graph* graph) {
+  if (!graph)
+    return;
+  {
+    // Closing may finish a recompaction, which renames the logs.
+    string err;
+    ScopedDirectory scope(graph->dir, &err);
+    graph->build_log.Close();
+    graph->deps_log.Close();
+  }
+  delete graph;
+}
+
+void ninja_free_string(char* str) {
+  free(str);
+}
+
+ninja_node* ninja_graph_node(ninja_graph* graph, const char* path) {
+  string canonical = path;
+  uint64_t slash_bits;
+  string err;
+  if (!CanonicalizePath(&canonical, &slash_bits, &err))
+    return NULL;
+  return AsApiNode(graph->state.LookupNode(canonical));
+}
+
+size_t ninja_graph_default_count(ninja_graph* graph) {
+  return graph->defaults.size();
+}
+
+ninja_node* ninja_graph_default(ninja_graph* graph, size_t index) {
+  return AsApiNode(graph->defaults[index]);
+}
+
+const char* ninja_node_path(const ninja_node* node) {
+  return AsNode(node)->path_c_str();
+}
+
+ninja_edge* ninja_node_in_edge(const ninja_node* node) {
+  return AsApiEdge(AsNode(node)->in_edge());
+}
+
+size_t ninja_node_out_edge_count(const ninja_node* node) {
+  return AsNode(node)->out_edges().size();
+}
+
+ninja_edge* ninja_node_out_edge(const ninja_node* node, size_t index) {
+  return AsApiEdge(AsNode(node)->out_edges()[index]);
+}
+
+int ninja_node_dep_count(ninja_graph* graph, ninja_node* node) {
+  DepsLog::Deps* deps = graph->deps_log.GetDeps(AsNode(node));
+  return deps ? deps->node_count : -1;
+}
+
+ninja_node* ninja_node_dep(ninja_graph* graph, ninja_node* node, int index) {
+  return AsApiNode(graph->deps_log.GetDeps(AsNode(node))->nodes[index]);
+}
+
+int ninja_node_dirty(ninja_graph* graph, ninja_node* node, char** error) {
+  string err;
+  ScopedDirectory scope(graph->dir, &err);
+  if (!err.empty()) {
+    SetError(error, err);
+    return -1;
+  }
+  // Forget what an earlier query or build found.
+  graph->state.Reset();
+  DependencyScan scan(&graph->state, &graph->build_log, &graph->deps_log,
+                      &graph->disk_interface);
+  if (!scan.RecomputeDirty(AsNode(node), &err)) {
+    SetError(error, err);
+    return -1;
+  }
+  return AsNode(node)->dirty() ? 1 : 0;
+}
+
+const char* ninja_edge_rule(const ninja_edge* edge) {
+  return AsEdge(edge)->rule().name().c_str();
+}
+
+size_t ninja_edge_input_count(const ninja_edge* edge) {
+  return AsEdge(edge)->inputs_.size();
+}
+
+ninja_node* ninja_edge_input(const ninja_edge* edge, size_t index) {
+  return AsApiNode(AsEdge(edge)->inputs_[index]);
+}
+
+ninja_input_kind ninja_edge_input_kind(const ninja_edge* edge, size_t index) {
+  if (AsEdge(edge)->is_order_only(index))
+    return NINJA_INPUT_ORDER_ONLY;
+  if (AsEdge(edge)->is_implicit(index))
+    return NINJA_INPUT_IMPLICIT;
+  return NINJA_INPUT_EXPLICIT;
+}
+
+size_t ninja_edge_output_count(const ninja_edge* edge) {
+  return AsEdge(edge)->outputs_.size();
+}
+
+ninja_node* ninja_edge_output(const ninja_edge* edge, size_t index) {
+  return AsApiNode(AsEdge(edge)->outputs_[index]);
+}
+
+char* ninja_edge_command(ninja_edge* edge) {
+  if (AsEdge(edge)->is_phony())
+    return NULL;
+  return CopyString(AsEdge(edge)->EvaluateCommand());
+}
+
+void ninja_build_options_init(ninja_build_options* options) {
+  BuildConfig config;
+  options->parallelism = 0;
+  options->failures_allowed = config.failures_allowed;
+  options->dry_run = 0;
+  options->print_status = 0;
+}
+
+int ninja_build(ninja_graph* graph, const char* const* targets,
+                size_t target_count, const ninja_build_options* options,
+                ninja_event_callback callback, void* user_data,
+                char** error) {
+  string err;
+  ScopedDirectory scope(graph->dir, &err);
+  if (!err.empty()) {
+    SetError(error, err);
+    return 1;
+  }
+
+  BuildConfig config;
+  config.parallelism = options->parallelism > 0 ?
+      options->parallelism : GetProcessorCount() + 2;
+  config.failures_allowed = options->failures_allowed > 0 ?
+      options->failures_allowed : INT_MAX;
+  config.dry_run = options->dry_run != 0;
+  config.verbosity = options->print_status ? BuildConfig::NORMAL :
+                                             BuildConfig::QUIET;
+  EventForwarder observer(callback, user_data);
+  if (callback)
+    config.observer = &observer;
+  if (!config.dry_run && !graph->OpenLogs(&err)) {
+    SetError(error, err);
+    return 1;
+  }
+
+  graph->state.Reset();
+  vector<Node*> nodes = graph->defaults;
+  if (target_count) {
+    nodes.clear();
+    for (size_t i = 0; i < target_count; ++i) {
+      Node* node = AsNode(ninja_graph_node(graph, targets[i]));
+      if (!node) {
+        SetError(error, string("unknown target '") + targets[i] + "'");
+        return 1;
+      }
+      nodes.push_back(node);
+    }
+  }
+
+  Builder builder(&graph->state, config, &graph->build_log, &graph->deps_log,
+                  &graph->disk_interface);
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n) {
+    // A target that is up to date already isn't an error.
+    if (!builder.AddTarget(*n, &err) && !err.empty()) {
+      SetError(error, err);
+      return 1;
+    }
+  }
+  if (builder.AlreadyUpToDate())
+    return 0;
+  if (!builder.Build(&err)) {
+    SetError(error, err);
+    return err.find("interrupted by user") != string::npos ? 2 : 1;
+  }
+  return 0;
+}
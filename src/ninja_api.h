@@ -0,0 +1,135 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_API_H_
+#define NINJA_API_H_
+
+/* The C API of libninja, for programs that query the graph of a build
+ * directory or build in it many times, without starting a ninja process
+ * and loading the manifest each time.
+ *
+ * Functions that return a string the caller owns document it; it is freed
+ * with ninja_free_string().  Errors are returned the same way, through an
+ * |error| argument that may be NULL.  A graph may only be used by one
+ * thread at a time. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented whenever a function or a struct field is added or changes;
+ * compare it with ninja_api_version() to check what was linked in. */
+#define NINJA_API_VERSION 1
+
+int ninja_api_version(void);
+
+typedef struct ninja_graph ninja_graph;
+typedef struct ninja_node ninja_node;
+typedef struct ninja_edge ninja_edge;
+
+/* Load |manifest|, e.g. "build.ninja", in the directory |dir|, along with
+ * the build and deps logs.  The commands and the paths of the graph are
+ * relative to |dir|, which every function that touches the disk changes
+ * to for as long as it runs.  Returns NULL on error. */
+ninja_graph* ninja_graph_load(const char* dir, const char* manifest,
+                              char** error);
+/* Close the logs and free |graph|, and every node and edge of it. */
+void ninja_graph_free(ninja_graph* graph);
+void ninja_free_string(char* str);
+
+/* The node with |path|, or NULL if the graph has none. */
+ninja_node* ninja_graph_node(ninja_graph* graph, const char* path);
+/* The targets that a build of no target builds. */
+size_t ninja_graph_default_count(ninja_graph* graph);
+ninja_node* ninja_graph_default(ninja_graph* graph, size_t index);
+
+const char* ninja_node_path(const ninja_node* node);
+/* The edge that produces |node|, or NULL for a source file. */
+ninja_edge* ninja_node_in_edge(const ninja_node* node);
+size_t ninja_node_out_edge_count(const ninja_node* node);
+ninja_edge* ninja_node_out_edge(const ninja_node* node, size_t index);
+/* The number of dependencies that the deps log has for |node|, or -1 if
+ * it has none. */
+int ninja_node_dep_count(ninja_graph* graph, ninja_node* node);
+ninja_node* ninja_node_dep(ninja_graph* graph, ninja_node* node, int index);
+/* Whether |node| is out of date, as a build would find: 1 if it is, 0 if
+ * it isn't and -1 on error. */
+int ninja_node_dirty(ninja_graph* graph, ninja_node* node, char** error);
+
+typedef enum {
+  NINJA_INPUT_EXPLICIT,
+  NINJA_INPUT_IMPLICIT,
+  NINJA_INPUT_ORDER_ONLY
+} ninja_input_kind;
+
+const char* ninja_edge_rule(const ninja_edge* edge);
+size_t ninja_edge_input_count(const ninja_edge* edge);
+ninja_node* ninja_edge_input(const ninja_edge* edge, size_t index);
+ninja_input_kind ninja_edge_input_kind(const ninja_edge* edge, size_t index);
+size_t ninja_edge_output_count(const ninja_edge* edge);
+ninja_node* ninja_edge_output(const ninja_edge* edge, size_t index);
+/* The command of |edge|, which the caller owns, or NULL for a phony
+ * edge. */
+char* ninja_edge_command(ninja_edge* edge);
+
+typedef struct {
+  /* How many commands to run at once; 0 guesses from the processors. */
+  int parallelism;
+  /* How many failures stop the build; 0 means none do. */
+  int failures_allowed;
+  /* Whether to only act as if the commands ran and succeeded. */
+  int dry_run;
+  /* Whether to print the status line and the output of the commands to
+   * stdout, as ninja does. */
+  int print_status;
+} ninja_build_options;
+
+/* Set |options| to what ninja uses without flags. */
+void ninja_build_options_init(ninja_build_options* options);
+
+typedef enum {
+  NINJA_EVENT_EDGE_STARTED,
+  NINJA_EVENT_EDGE_FINISHED
+} ninja_event_type;
+
+typedef struct {
+  ninja_event_type type;
+  ninja_edge* edge;
+  /* For NINJA_EVENT_EDGE_FINISHED, whether the command succeeded, and what
+   * it printed. */
+  int success;
+  const char* output;
+  size_t output_size;
+} ninja_event;
+
+typedef void (*ninja_event_callback)(const ninja_event* event,
+                                     void* user_data);
+
+/* Build |targets|, or the default targets if |target_count| is 0, calling
+ * |callback|, if any, with |user_data| as commands start and finish.
+ * Returns 0 if the build succeeded, 1 if it failed and 2 if it was
+ * interrupted, as ninja's exit codes.  Unlike ninja, it doesn't rebuild
+ * the manifest first; load the graph again after building it. */
+int ninja_build(ninja_graph* graph, const char* const* targets,
+                size_t target_count, const ninja_build_options* options,
+                ninja_event_callback callback, void* user_data,
+                char** error);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* NINJA_API_H_ */
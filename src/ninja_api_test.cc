@@ -0,0 +1,135 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ninja_api.h"
+
+#include <string>
+#include <vector>
+
+#include "disk_interface.h"
+#include "test.h"
+
+namespace {
+
+struct NinjaApiTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("NinjaApiTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(NinjaApiTest, Query) {
+  ASSERT_TRUE(disk_.WriteFile("build.ninja",
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build mid: cat in | imp || order\n"
+"build out: cat mid\n"
+"default out\n"));
+
+  char* error = NULL;
+  ninja_graph* graph = ninja_graph_load(".", "build.ninja", &error);
+  ASSERT_TRUE(graph);
+  EXPECT_FALSE(error);
+
+  ASSERT_EQ(1u, ninja_graph_default_count(graph));
+  ninja_node* out = ninja_graph_default(graph, 0);
+  EXPECT_EQ(std::string("out"), ninja_node_path(out));
+  ninja_node* mid = ninja_graph_node(graph, "./mid");
+  ASSERT_TRUE(mid);
+  EXPECT_FALSE(ninja_graph_node(graph, "missing"));
+
+  ninja_edge* edge = ninja_node_in_edge(mid);
+  ASSERT_TRUE(edge);
+  EXPECT_EQ(std::string("cat"), ninja_edge_rule(edge));
+  ASSERT_EQ(3u, ninja_edge_input_count(edge));
+  EXPECT_EQ(std::string("imp"), ninja_node_path(ninja_edge_input(edge, 1)));
+  EXPECT_EQ(NINJA_INPUT_EXPLICIT, ninja_edge_input_kind(edge, 0));
+  EXPECT_EQ(NINJA_INPUT_IMPLICIT, ninja_edge_input_kind(edge, 1));
+  EXPECT_EQ(NINJA_INPUT_ORDER_ONLY, ninja_edge_input_kind(edge, 2));
+  ASSERT_EQ(1u, ninja_edge_output_count(edge));
+  EXPECT_EQ(mid, ninja_edge_output(edge, 0));
+  char* command = ninja_edge_command(edge);
+  EXPECT_EQ(std::string("cat in > mid"), std::string(command));
+  ninja_free_string(command);
+
+  ASSERT_EQ(1u, ninja_node_out_edge_count(mid));
+  EXPECT_EQ(ninja_node_in_edge(out), ninja_node_out_edge(mid, 0));
+  EXPECT_EQ(-1, ninja_node_dep_count(graph, out));
+
+  EXPECT_EQ(1, ninja_node_dirty(graph, out, &error));
+  EXPECT_FALSE(error);
+
+  ninja_graph_free(graph);
+}
+
+TEST_F(NinjaApiTest, LoadError) {
+  char* error = NULL;
+  EXPECT_FALSE(ninja_graph_load(".", "build.ninja", &error));
+  ASSERT_TRUE(error);
+  ninja_free_string(error);
+}
+
+#ifndef _WIN32
+void CountEvents(const ninja_event* event, void* user_data) {
+  std::vector<ninja_event_type>* events =
+      static_cast<std::vector<ninja_event_type>*>(user_data);
+  events->push_back(event->type);
+}
+
+TEST_F(NinjaApiTest, Build) {
+  ASSERT_TRUE(disk_.WriteFile("build.ninja",
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build mid: cat in\n"
+"build out: cat mid\n"));
+  ASSERT_TRUE(disk_.WriteFile("in", "x"));
+
+  ninja_graph* graph = ninja_graph_load(".", "build.ninja", NULL);
+  ASSERT_TRUE(graph);
+  ninja_node* out = ninja_graph_node(graph, "out");
+  EXPECT_EQ(1, ninja_node_dirty(graph, out, NULL));
+
+  ninja_build_options options;
+  ninja_build_options_init(&options);
+  std::vector<ninja_event_type> events;
+  const char* targets[] = { "out" };
+  char* error = NULL;
+  EXPECT_EQ(0, ninja_build(graph, targets, 1, &options, CountEvents, &events,
+                           &error));
+  EXPECT_FALSE(error);
+  ASSERT_EQ(4u, events.size());
+  EXPECT_EQ(NINJA_EVENT_EDGE_STARTED, events[0]);
+  EXPECT_EQ(NINJA_EVENT_EDGE_FINISHED, events[3]);
+  EXPECT_EQ(0, ninja_node_dirty(graph, out, NULL));
+
+  // Nothing to do the second time.
+  events.clear();
+  EXPECT_EQ(0, ninja_build(graph, NULL, 0, &options, CountEvents, &events,
+                           NULL));
+  EXPECT_TRUE(events.empty());
+
+  const char* unknown[] = { "missing" };
+  EXPECT_EQ(1, ninja_build(graph, unknown, 1, &options, NULL, NULL, &error));
+  EXPECT_EQ("unknown target 'missing'", std::string(error));
+  ninja_free_string(error);
+  ninja_graph_free(graph);
+}
+#endif
+
+}  // anonymous namespace
@@ -0,0 +1,29 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_RESOURCE_USAGE_H_
+#define NINJA_RESOURCE_USAGE_H_
+
+/// The CPU time and memory used by a finished command, including the
+/// processes it waited for.  All zero if unknown.
+struct ResourceUsage {
+  ResourceUsage() : user_time_ms(0), system_time_ms(0), max_rss_kb(0) {}
+
+  int user_time_ms;
+  int system_time_ms;
+  /// Peak resident set size (peak working set on Windows) in kilobytes.
+  int max_rss_kb;
+};
+
+#endif  // NINJA_RESOURCE_USAGE_H_
@@ -0,0 +1,467 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "version.h"
+
+extern char** environ;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// The protocol, over a Unix domain socket: the client sends the length of
+// its request along with its stdin, stdout and stderr, then the request
+// itself, a series of NUL-terminated strings: the ninja version, the working
+// directory, the number of arguments, the arguments and the environment.
+// The server answers with its pid, so that the client can pass Ctrl-C on,
+// and once done with the exit code, or kDeclined.
+
+namespace {
+
+const int32_t kDeclined = -1;
+
+/// Requests are small; anything bigger isn't from a ninja client.
+const uint32_t kMaxRequestSize = 16 << 20;
+
+volatile sig_atomic_t g_interrupted;
+
+/// The handlers from before Server::Listen().
+struct sigaction g_server_old_acts[3];
+
+void SetInterrupted(int) {
+  g_interrupted = 1;
+}
+
+/// Catch the signals that stop a ninja, without restarting system calls, so
+/// that a blocking call returns with EINTR.  Saves the old handlers to
+/// |old_acts|.
+void CatchInterrupts(struct sigaction* old_acts) {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = SetInterrupted;
+  const int kSignals[] = { SIGINT, SIGTERM, SIGHUP };
+  for (int i = 0; i < 3; ++i) {
+    if (sigaction(kSignals[i], &act, &old_acts[i]) < 0)
+      Fatal("sigaction: %s", strerror(errno));
+  }
+}
+
+void RestoreInterrupts(const struct sigaction* old_acts) {
+  const int kSignals[] = { SIGINT, SIGTERM, SIGHUP };
+  for (int i = 0; i < 3; ++i) {
+    if (sigaction(kSignals[i], &old_acts[i], NULL) < 0)
+      Fatal("sigaction: %s", strerror(errno));
+  }
+}
+
+bool SetAddress(const string& path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+bool ReadAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = read(fd, data, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = send(fd, data, size, MSG_NOSIGNAL);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0)
+      return false;
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+/// Send |size| bytes of |data| along with the descriptors |fds|.
+bool SendWithDescriptors(int fd, const char* data, size_t size,
+                         const int* fds, int fd_count) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data);
+  iov.iov_len = size;
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+  ssize_t len;
+  do {
+    len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (len < 0 && errno == EINTR);
+  if (len < 0)
+    return false;
+  return WriteAll(fd, data + len, size - len);
+}
+
+/// Receive |size| bytes into |data| along with |fd_count| descriptors,
+/// which are stored into |fds|.
+bool ReceiveWithDescriptors(int fd, char* data, size_t size, int* fds,
+                            int fd_count) {
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = size;
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t len;
+  do {
+    len = recvmsg(fd, &msg, 0);
+  } while (len < 0 && errno == EINTR);
+  if (len <= 0)
+    return false;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(fd_count * sizeof(int))) {
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+  for (int i = 0; i < fd_count; ++i)
+    SetCloseOnExec(fds[i]);
+  return ReadAll(fd, data + len, size - len);
+}
+
+/// Whether the process at the other end of |fd| runs as |uid|.
+bool PeerHasUid(int fd, uid_t uid) {
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+  return cred.uid == uid;
+#else
+  uid_t euid;
+  gid_t egid;
+  if (getpeereid(fd, &euid, &egid) < 0)
+    return false;
+  return euid == uid;
+#endif
+}
+
+/// Fill |dir| with the working directory, however long.
+bool GetWorkingDir(string* dir) {
+  vector<char> buf;
+  do {
+    buf.resize(buf.size() + 1024);
+    errno = 0;
+  } while (!getcwd(&buf[0], buf.size()) && errno == ERANGE);
+  if (errno != 0)
+    return false;
+  *dir = &buf[0];
+  return true;
+}
+
+/// Split |data| into the NUL-terminated strings it holds.
+vector<string> SplitStrings(const string& data) {
+  vector<string> strings;
+  size_t start = 0;
+  for (size_t end; (end = data.find('\0', start)) != string::npos;
+       start = end + 1) {
+    strings.push_back(data.substr(start, end - start));
+  }
+  return strings;
+}
+
+}  // anonymous namespace
+
+ServerRequest::ServerRequest() : fd_(-1), saved_environ_(NULL) {
+  for (int i = 0; i < 3; ++i)
+    stdio_[i] = saved_stdio_[i] = -1;
+}
+
+ServerRequest::~ServerRequest() {
+  Close();
+}
+
+void ServerRequest::Begin() {
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; ++i) {
+    saved_stdio_[i] = dup(i);
+    SetCloseOnExec(saved_stdio_[i]);
+    dup2(stdio_[i], i);
+  }
+  environ_.clear();
+  for (vector<string>::iterator i = env.begin(); i != env.end(); ++i)
+    environ_.push_back(const_cast<char*>(i->c_str()));
+  environ_.push_back(NULL);
+  saved_environ_ = environ;
+  environ = &environ_[0];
+}
+
+void ServerRequest::End() {
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; ++i) {
+    dup2(saved_stdio_[i], i);
+    close(saved_stdio_[i]);
+    saved_stdio_[i] = -1;
+  }
+  environ = saved_environ_;
+}
+
+void ServerRequest::Reply(int exit_code) {
+  int32_t status = exit_code;
+  WriteAll(fd_, (const char*)&status, sizeof(status));
+  Close();
+}
+
+void ServerRequest::Decline() {
+  WriteAll(fd_, (const char*)&kDeclined, sizeof(kDeclined));
+  Close();
+}
+
+void ServerRequest::Close() {
+  if (fd_ < 0)
+    return;
+  close(fd_);
+  fd_ = -1;
+  for (int i = 0; i < 3; ++i) {
+    close(stdio_[i]);
+    stdio_[i] = -1;
+  }
+}
+
+Server::Server() : fd_(-1), client_uid_(geteuid()) {}
+
+Server::~Server() {
+  Close();
+}
+
+bool Server::Listen(const string& path, string* err) {
+  struct sockaddr_un addr;
+  if (!SetAddress(path, &addr)) {
+    *err = "socket path too long";
+    return false;
+  }
+  if (!GetWorkingDir(&dir_)) {
+    *err = string("getcwd: ") + strerror(errno);
+    return false;
+  }
+  fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd_ < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fd_);
+  // A socket nobody accepts on is left over from a server that died.
+  if (connect(fd_, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    *err = "a server is already running in this directory";
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  unlink(path.c_str());
+  // Clients get to run commands as us, so only we may connect.  Not all
+  // systems check the permissions of a socket; Accept() checks the user too.
+  mode_t old_umask = umask(077);
+  bool bound = bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  umask(old_umask);
+  if (!bound || listen(fd_, 16) < 0) {
+    *err = strerror(errno);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  path_ = path;
+  CatchInterrupts(g_server_old_acts);
+  return true;
+}
+
+void Server::Close() {
+  if (fd_ < 0)
+    return;
+  close(fd_);
+  fd_ = -1;
+  unlink(path_.c_str());
+  RestoreInterrupts(g_server_old_acts);
+}
+
+bool Server::Accept(ServerRequest* request, string* err) {
+  g_interrupted = 0;
+  for (;;) {
+    int fd = accept(fd_, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        if (g_interrupted)
+          return false;
+        continue;
+      }
+      *err = strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    if (!PeerHasUid(fd, client_uid_)) {
+      close(fd);
+      continue;
+    }
+    // Don't let a client that never sends its request hang the server.
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t size;
+    int fds[3];
+    if (!ReceiveWithDescriptors(fd, (char*)&size, sizeof(size), fds, 3)) {
+      close(fd);
+      continue;
+    }
+    string data;
+    if (size <= kMaxRequestSize) {
+      data.resize(size);
+      if (size > 0 && !ReadAll(fd, &data[0], size))
+        data.clear();
+    }
+    vector<string> strings = SplitStrings(data);
+    int argc = strings.size() >= 3 ? atoi(strings[2].c_str()) : -1;
+    if (argc < 0 || strings.size() < 3 + (size_t)argc) {
+      for (int i = 0; i < 3; ++i)
+        close(fds[i]);
+      close(fd);
+      continue;
+    }
+
+    request->Close();
+    request->fd_ = fd;
+    for (int i = 0; i < 3; ++i)
+      request->stdio_[i] = fds[i];
+    request->cwd = strings[1];
+    request->args.assign(strings.begin() + 3, strings.begin() + 3 + argc);
+    request->env.assign(strings.begin() + 3 + argc, strings.end());
+
+    int32_t pid = getpid();
+    if (!WriteAll(fd, (const char*)&pid, sizeof(pid))) {
+      request->Close();
+      continue;
+    }
+    // A client of another version may mean something else by its flags.
+    if (strings[0] != kNinjaVersion) {
+      request->Decline();
+      continue;
+    }
+    return true;
+  }
+}
+
+bool ForwardToServer(const string& path, int argc, char** argv,
+                     int* exit_code) {
+  struct sockaddr_un addr;
+  if (!SetAddress(path, &addr))
+    return false;
+  string cwd;
+  if (!GetWorkingDir(&cwd))
+    return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return false;
+  }
+
+  string data = string(kNinjaVersion) + '\0' + cwd + '\0';
+  char count[16];
+  snprintf(count, sizeof(count), "%d", argc);
+  data += string(count) + '\0';
+  for (int i = 0; i < argc; ++i)
+    data += string(argv[i]) + '\0';
+  for (char** e = environ; *e; ++e)
+    data += string(*e) + '\0';
+  uint32_t size = data.size();
+  const int fds[3] = { 0, 1, 2 };
+  int32_t pid;
+  if (!SendWithDescriptors(fd, (const char*)&size, sizeof(size), fds, 3) ||
+      !WriteAll(fd, data.data(), data.size()) ||
+      !ReadAll(fd, (char*)&pid, sizeof(pid))) {
+    close(fd);
+    return false;
+  }
+
+  // Pass Ctrl-C on to the server, which stops the build as if it was its
+  // own, and keep waiting for it to finish.
+  struct sigaction old_acts[3];
+  g_interrupted = 0;
+  CatchInterrupts(old_acts);
+  int32_t status;
+  char* data_end = (char*)&status;
+  bool done = false;
+  while (!done) {
+    ssize_t len = read(fd, data_end, (char*)(&status + 1) - data_end);
+    if (len < 0 && errno == EINTR) {
+      if (g_interrupted) {
+        g_interrupted = 0;
+        kill(pid, SIGINT);
+      }
+      continue;
+    }
+    if (len <= 0)
+      break;
+    data_end += len;
+    done = data_end == (char*)(&status + 1);
+  }
+  RestoreInterrupts(old_acts);
+  close(fd);
+
+  if (!done) {
+    Error("lost the connection to the ninja server");
+    *exit_code = 1;
+    return true;
+  }
+  if (status == kDeclined)
+    return false;
+  *exit_code = status;
+  return true;
+}
@@ -0,0 +1,54 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+// Handing a console over to another process isn't possible on Windows the
+// way passing descriptors over a Unix domain socket is, so there's no
+// server there: clients always build by themselves.
+
+ServerRequest::ServerRequest() : fd_(-1), saved_environ_(NULL) {}
+
+ServerRequest::~ServerRequest() {}
+
+void ServerRequest::Begin() {}
+
+void ServerRequest::End() {}
+
+void ServerRequest::Reply(int exit_code) {}
+
+void ServerRequest::Decline() {}
+
+void ServerRequest::Close() {}
+
+Server::Server() : fd_(-1), client_uid_(-1) {}
+
+Server::~Server() {}
+
+bool Server::Listen(const string& path, string* err) {
+  *err = "not supported on Windows";
+  return false;
+}
+
+bool Server::Accept(ServerRequest* request, string* err) {
+  *err = "not supported on Windows";
+  return false;
+}
+
+void Server::Close() {}
+
+bool ForwardToServer(const string& path, int argc, char** argv,
+                     int* exit_code) {
+  return false;
+}
@@ -0,0 +1,99 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SERVER_H_
+#define NINJA_SERVER_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Where a `ninja --server` listens, in the directory it builds in.
+const char kServerSocketPath[] = ".ninja_server";
+
+/// An invocation of ninja that a client forwarded to the server.  The
+/// client passes its stdin, stdout and stderr along, so that the server can
+/// print to its terminal directly.
+struct ServerRequest {
+  ServerRequest();
+  ~ServerRequest();
+
+  /// Whether a request was received and not yet replied to.
+  bool pending() const { return fd_ >= 0; }
+
+  /// Use the client's stdio and environment in this process until End().
+  void Begin();
+  void End();
+
+  /// Send the client the exit code to exit with, and hang up.
+  void Reply(int exit_code);
+  /// Tell the client to run the build itself, and hang up.
+  void Decline();
+
+  /// The client's working directory.
+  string cwd;
+  /// The command line, without the program name.
+  vector<string> args;
+  /// The client's environment, as "NAME=value" entries.
+  vector<string> env;
+
+ private:
+  friend struct Server;
+  void Close();
+
+  int fd_;
+  int stdio_[3];
+  int saved_stdio_[3];
+  char** saved_environ_;
+  vector<char*> environ_;
+};
+
+/// The listening end of `ninja --server`.
+struct Server {
+  Server();
+  ~Server();
+
+  /// Listen at |path|, unless another server already does.  Only clients
+  /// of the same user may connect.  Returns false and fills |err| on error.
+  bool Listen(const string& path, string* err);
+
+  /// The working directory when Listen() was called.
+  const string& dir() const { return dir_; }
+
+  /// Wait for the next client.  Returns false and fills |err| on error, or
+  /// returns false with an empty |err| when interrupted by a signal.
+  bool Accept(ServerRequest* request, string* err);
+
+  /// Stop listening and remove the socket.
+  void Close();
+
+  /// Serve the clients of user |uid| instead of our own.
+  /// Used for tests.
+  void set_client_uid(int uid) { client_uid_ = uid; }
+
+ private:
+  string path_;
+  string dir_;
+  int fd_;
+  int client_uid_;
+};
+
+/// Forward the command line to the server listening at |path| and wait
+/// for the build it runs, passing interruptions on.  Returns false if
+/// there's no server or it declined, in which case ninja should go ahead
+/// by itself; otherwise sets |exit_code|.
+bool ForwardToServer(const string& path, int argc, char** argv,
+                     int* exit_code);
+
+#endif  // NINJA_SERVER_H_
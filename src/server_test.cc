@@ -0,0 +1,157 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+#include "test.h"
+#include "util.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+const char kTestSocket[] = "ServerTest-socket";
+
+/// Forwards a command line on a thread, as a client would.
+struct Client {
+  Client() : forwarded(false), exit_code(-1) {}
+
+  static void Run(void* client) {
+    Client* c = static_cast<Client*>(client);
+    char* argv[] = { const_cast<char*>("-j3"), const_cast<char*>("all") };
+    c->forwarded = ForwardToServer(kTestSocket, 2, argv, &c->exit_code);
+  }
+
+  bool forwarded;
+  int exit_code;
+  Thread thread;
+};
+
+/// A Client that then interrupts the server, for as long as it keeps
+/// waiting for clients.
+struct InterruptingClient : public Client {
+  InterruptingClient() : server_thread(pthread_self()), done(false) {}
+
+  static void Run(void* client) {
+    InterruptingClient* c = static_cast<InterruptingClient*>(client);
+    Client::Run(c);
+    while (!c->done) {
+      pthread_kill(c->server_thread, SIGINT);
+      usleep(1000);
+    }
+  }
+
+  pthread_t server_thread;
+  volatile bool done;
+};
+
+TEST(ServerTest, ForwardsCommandLine) {
+  Server server;
+  string err;
+  ASSERT_TRUE(server.Listen(kTestSocket, &err));
+  ASSERT_EQ("", err);
+
+  Client client;
+  ASSERT_TRUE(client.thread.Start(Client::Run, &client));
+  ServerRequest request;
+  ASSERT_TRUE(server.Accept(&request, &err));
+  EXPECT_TRUE(request.pending());
+  ASSERT_EQ(2u, request.args.size());
+  EXPECT_EQ("-j3", request.args[0]);
+  EXPECT_EQ("all", request.args[1]);
+  char cwd[4096];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)));
+  EXPECT_EQ(cwd, request.cwd);
+  EXPECT_FALSE(request.env.empty());
+  request.Reply(3);
+  EXPECT_FALSE(request.pending());
+  client.thread.Join();
+
+  EXPECT_TRUE(client.forwarded);
+  EXPECT_EQ(3, client.exit_code);
+}
+
+TEST(ServerTest, Decline) {
+  Server server;
+  string err;
+  ASSERT_TRUE(server.Listen(kTestSocket, &err));
+
+  // Only one server per directory.
+  Server other;
+  EXPECT_FALSE(other.Listen(kTestSocket, &err));
+  EXPECT_NE("", err);
+
+  Client client;
+  ASSERT_TRUE(client.thread.Start(Client::Run, &client));
+  ServerRequest request;
+  ASSERT_TRUE(server.Accept(&request, &err));
+  request.Decline();
+  client.thread.Join();
+  EXPECT_FALSE(client.forwarded);
+}
+
+TEST(ServerTest, OnlySameUser) {
+  Server server;
+  string err;
+  ASSERT_TRUE(server.Listen(kTestSocket, &err));
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestSocket, &st));
+  EXPECT_EQ(0, (int)(st.st_mode & 077));
+
+  // Pretend that the client runs as someone else.
+  server.set_client_uid(geteuid() + 1);
+  InterruptingClient client;
+  ASSERT_TRUE(client.thread.Start(InterruptingClient::Run, &client));
+  ServerRequest request;
+  EXPECT_FALSE(server.Accept(&request, &err));
+  EXPECT_EQ("", err);
+  if (request.pending())
+    request.Reply(0);
+  client.done = true;
+  client.thread.Join();
+  EXPECT_FALSE(client.forwarded);
+}
+
+TEST(ServerTest, NoServer) {
+  unlink(kTestSocket);
+  Client client;
+  Client::Run(&client);
+  EXPECT_FALSE(client.forwarded);
+
+  // A socket left behind by a server that died doesn't count.
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, kTestSocket);
+  ASSERT_EQ(0, bind(fd, (struct sockaddr*)&addr, sizeof(addr)));
+  close(fd);
+  Client::Run(&client);
+  EXPECT_FALSE(client.forwarded);
+
+  // A new server takes its place.
+  Server server;
+  string err;
+  EXPECT_TRUE(server.Listen(kTestSocket, &err));
+}
+
+}  // anonymous namespace
+#endif  // _WIN32
@@ -0,0 +1,145 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shared_pool.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+SharedPoolSlots::SharedPoolSlots(const string& dir, const string& name,
+                                 int count)
+    : dir_(dir), name_(name), count_(count), dir_made_(false),
+      broken_(false) {}
+
+// static
+string SharedPoolSlots::DefaultDir() {
+  const char* dir = getenv("NINJA_SHARED_POOL_DIR");
+  return dir && *dir ? dir : "/tmp/ninja-pools";
+}
+
+bool SharedPoolSlots::MakeDir(string* err) {
+#ifndef _WIN32
+  if (mkdir(dir_.c_str(), 0777) == 0) {
+    // Like /tmp, every user may add files but only remove their own.
+    if (chmod(dir_.c_str(), 01777) < 0) {
+      *err = dir_ + ": " + strerror(errno);
+      return false;
+    }
+  } else if (errno != EEXIST) {
+    *err = dir_ + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (lstat(dir_.c_str(), &st) < 0) {
+    *err = dir_ + ": " + strerror(errno);
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    *err = dir_ + ": not a directory";
+    return false;
+  }
+#endif
+  return true;
+}
+
+bool SharedPoolSlots::Acquire(int count) {
+#ifndef _WIN32
+  if (broken_)
+    return true;
+  if (!dir_made_) {
+    string err;
+    if (!MakeDir(&err)) {
+      Warning("shared pool '%s' only applies to this build: %s",
+              name_.c_str(), err.c_str());
+      broken_ = true;
+      return true;
+    }
+    dir_made_ = true;
+  }
+  size_t start = held_.size();
+  int opened = 0;
+  string err;
+  for (int slot = 0; slot < count_ && held_.size() - start < (size_t)count;
+       ++slot) {
+    bool taken = false;
+    for (size_t i = 0; i < held_.size(); ++i)
+      taken = taken || held_[i].first == slot;
+    if (taken)
+      continue;
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%d", slot);
+    string path = dir_ + "/ninja-pool." + name_ + suffix;
+    // The directory is shared with other users: never follow a link one
+    // of them put there, and only open up the mode of a file made here.
+    int fd = open(path.c_str(),
+                  O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+    bool created = fd >= 0;
+    if (fd < 0 && errno == EEXIST)
+      fd = open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      err = path + ": " + strerror(errno);
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      err = path + ": not a regular file";
+      close(fd);
+      continue;
+    }
+    // Let the builds of the other users open it, whatever the umask.
+    if (created)
+      fchmod(fd, 0666);
+    ++opened;
+    // The lock is on the open file, so another open of it in this process
+    // doesn't get it either.
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+      close(fd);
+      continue;
+    }
+    held_.push_back(make_pair(slot, fd));
+  }
+  if (held_.size() - start == (size_t)count)
+    return true;
+
+  Release((int)(held_.size() - start));
+  if (opened == 0 && start == 0 && !err.empty()) {
+    Warning("shared pool '%s' only applies to this build: %s",
+            name_.c_str(), err.c_str());
+    broken_ = true;
+    return true;
+  }
+  return false;
+#else
+  return true;
+#endif
+}
+
+void SharedPoolSlots::Release(int count) {
+#ifndef _WIN32
+  for (; count > 0 && !held_.empty(); --count) {
+    close(held_.back().second);
+    held_.pop_back();
+  }
+#endif
+}
@@ -0,0 +1,65 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SHARED_POOL_H_
+#define NINJA_SHARED_POOL_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/// The slots of a pool with 'shared = 1', which every ninja process on the
+/// machine takes its commands' weights from.  Slot i is a lock on the file
+/// "ninja-pool.NAME.i" in a directory all of them use, so that the slots
+/// of a process that dies are given back.  Only on POSIX systems; elsewhere
+/// every slot is always free.
+struct SharedPoolSlots {
+  /// |count| slots named after the pool |name|, in |dir|.
+  SharedPoolSlots(const string& dir, const string& name, int count);
+  ~SharedPoolSlots() { ReleaseAll(); }
+
+  /// The directory of the slots: $NINJA_SHARED_POOL_DIR, or
+  /// /tmp/ninja-pools.
+  static string DefaultDir();
+
+  /// Take |count| free slots and return true, or take none and return
+  /// false if there aren't that many.
+  bool Acquire(int count);
+
+  /// Give back |count| of the slots taken.
+  void Release(int count);
+  void ReleaseAll() { Release((int)held_.size()); }
+
+  /// The number of slots taken.
+  int held() const { return (int)held_.size(); }
+
+ private:
+  /// Create the directory if it's missing, sticky and writable by all, and
+  /// check that it's one.
+  bool MakeDir(string* err);
+
+  string dir_;
+  string name_;
+  int count_;
+  /// The slots taken, and the descriptors of their locked files.
+  vector<pair<int, int> > held_;
+  /// Whether MakeDir() succeeded.
+  bool dir_made_;
+  /// Whether none of the files could be opened, which was reported; the
+  /// pool then only applies to this process.
+  bool broken_;
+};
+
+#endif  // NINJA_SHARED_POOL_H_
@@ -0,0 +1,98 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shared_pool.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+namespace {
+
+#ifndef _WIN32
+struct SharedPoolTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("SharedPoolTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(SharedPoolTest, Slots) {
+  // Two of them stand for two ninja processes.
+  SharedPoolSlots a(".", "link", 3);
+  SharedPoolSlots b(".", "link", 3);
+  EXPECT_TRUE(a.Acquire(2));
+  EXPECT_FALSE(b.Acquire(2));
+  EXPECT_EQ(0, b.held());
+  EXPECT_TRUE(b.Acquire(1));
+  EXPECT_FALSE(a.Acquire(1));
+
+  a.Release(1);
+  EXPECT_EQ(1, a.held());
+  EXPECT_TRUE(b.Acquire(1));
+  b.ReleaseAll();
+  EXPECT_TRUE(a.Acquire(2));
+  EXPECT_EQ(3, a.held());
+
+  // Other pools have slots of their own.
+  SharedPoolSlots c(".", "compile", 1);
+  EXPECT_TRUE(c.Acquire(1));
+}
+
+TEST_F(SharedPoolTest, MissingDir) {
+  // The pool still applies to this process.
+  SharedPoolSlots a("missing/pools", "link", 1);
+  EXPECT_TRUE(a.Acquire(1));
+  EXPECT_EQ(0, a.held());
+}
+
+TEST_F(SharedPoolTest, MakesDir) {
+  SharedPoolSlots a("pools", "link", 1);
+  EXPECT_TRUE(a.Acquire(1));
+  EXPECT_EQ(1, a.held());
+  struct stat st;
+  ASSERT_EQ(0, stat("pools", &st));
+  EXPECT_EQ(01777, (int)(st.st_mode & 07777));
+  a.ReleaseAll();
+}
+
+TEST_F(SharedPoolTest, OtherUsersFiles) {
+  // Another user links a slot to a file of ours, and makes the other one
+  // private.
+  ASSERT_EQ(0, close(open("mine", O_WRONLY | O_CREAT, 0600)));
+  ASSERT_EQ(0, symlink("mine", "ninja-pool.link.0"));
+  ASSERT_EQ(0, close(open("ninja-pool.link.1", O_WRONLY | O_CREAT, 0600)));
+
+  SharedPoolSlots a(".", "link", 2);
+  EXPECT_TRUE(a.Acquire(1));
+  EXPECT_EQ(1, a.held());
+  EXPECT_FALSE(a.Acquire(1));
+
+  struct stat st;
+  ASSERT_EQ(0, stat("mine", &st));
+  EXPECT_EQ(0600, (int)(st.st_mode & 07777));
+  ASSERT_EQ(0, stat("ninja-pool.link.1", &st));
+  EXPECT_EQ(0600, (int)(st.st_mode & 07777));
+}
+#endif
+
+}  // anonymous namespace
@@ -0,0 +1,85 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "slot_usage.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+using namespace std;
+
+SlotUsage* g_slot_usage = NULL;
+
+SlotUsage::SlotUsage()
+    : slots_(0), running_(false), last_(0), busy_(0), idle_(kNinjaLimited) {
+  for (int i = 0; i < kStateCount; ++i)
+    times_[i] = 0;
+}
+
+// static
+const char* SlotUsage::StateName(State state) {
+  switch (state) {
+  case kBusy:            return "busy";
+  case kGraphLimited:    return "graph-limited";
+  case kResourceLimited: return "resource-limited";
+  case kNinjaLimited:    return "ninja-limited";
+  case kStateCount: break;
+  }
+  return "?";
+}
+
+void SlotUsage::Start(int slots, int64_t now) {
+  slots_ = slots;
+  running_ = true;
+  last_ = now;
+  busy_ = 0;
+  idle_ = kNinjaLimited;
+}
+
+void SlotUsage::Update(int64_t now, int busy, State idle) {
+  Account(now);
+  // An edge heavier than -j takes up all of them.
+  busy_ = min(busy, slots_);
+  idle_ = idle;
+}
+
+void SlotUsage::Finish(int64_t now) {
+  Account(now);
+  running_ = false;
+}
+
+void SlotUsage::Account(int64_t now) {
+  if (!running_ || now <= last_)
+    return;
+  int64_t elapsed = now - last_;
+  times_[kBusy] += busy_ * elapsed;
+  times_[idle_] += (slots_ - busy_) * elapsed;
+  last_ = now;
+}
+
+int64_t SlotUsage::total_time() const {
+  int64_t total = 0;
+  for (int i = 0; i < kStateCount; ++i)
+    total += times_[i];
+  return total;
+}
+
+void SlotUsage::Report() const {
+  int64_t total = total_time();
+  printf("%-16s\t%12s\t%s\n", "slot time", "seconds", "share");
+  for (int i = 0; i < kStateCount; ++i) {
+    printf("%-16s\t%12.3f\t%5.1f%%\n", StateName((State)i), times_[i] / 1e3,
+           total ? 100.0 * times_[i] / total : 0.0);
+  }
+}
@@ -0,0 +1,73 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SLOT_USAGE_H_
+#define NINJA_SLOT_USAGE_H_
+
+#include <stdint.h>
+
+/// Accounts for the wall-clock time of each -j slot of the builds, for
+/// '-d slots': whether it ran a command, or why it didn't.  That says
+/// whether a build wants more processors, a graph with more parallelism
+/// or a faster ninja.
+struct SlotUsage {
+  enum State {
+    /// Running a command.
+    kBusy,
+    /// Idle, with nothing ready to run.
+    kGraphLimited,
+    /// Idle, with commands ready to run that a pool, the load average, the
+    /// memory budget or the jobserver held back.
+    kResourceLimited,
+    /// Idle while ninja itself was busy, e.g. finishing a command or
+    /// starting the next one.
+    kNinjaLimited,
+    kStateCount
+  };
+
+  SlotUsage();
+
+  static const char* StateName(State state);
+
+  /// A build with |slots| slots starts at |now| milliseconds.
+  void Start(int slots, int64_t now);
+  /// From |now| on, |busy| slots run commands, and the others are idle for
+  /// the reason |idle|.
+  void Update(int64_t now, int busy, State idle);
+  /// The build ends at |now|.
+  void Finish(int64_t now);
+
+  /// The slot milliseconds spent in |state| so far.
+  int64_t time(State state) const { return times_[state]; }
+  int64_t total_time() const;
+
+  /// Print the time of each state, and its share of the total.
+  void Report() const;
+
+ private:
+  /// Charge the time since the last update to the states it was in.
+  void Account(int64_t now);
+
+  int slots_;
+  bool running_;
+  int64_t last_;
+  int busy_;
+  State idle_;
+  int64_t times_[kStateCount];
+};
+
+/// The global accounting, set by '-d slots'.
+extern SlotUsage* g_slot_usage;
+
+#endif  // NINJA_SLOT_USAGE_H_
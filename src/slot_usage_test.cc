@@ -0,0 +1,55 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "slot_usage.h"
+
+#include "test.h"
+
+namespace {
+
+TEST(SlotUsageTest, States) {
+  SlotUsage usage;
+  usage.Start(4, 1000);
+  // Starting the first commands.
+  usage.Update(1010, 2, SlotUsage::kResourceLimited);
+  usage.Update(1110, 1, SlotUsage::kNinjaLimited);
+  usage.Update(1120, 1, SlotUsage::kGraphLimited);
+  // A command heavier than -j.
+  usage.Update(1220, 8, SlotUsage::kGraphLimited);
+  usage.Finish(1320);
+  // Nothing counts once the build is over.
+  usage.Update(2000, 4, SlotUsage::kGraphLimited);
+
+  EXPECT_EQ(2 * 100 + 10 + 100 + 4 * 100,
+            usage.time(SlotUsage::kBusy));
+  EXPECT_EQ(2 * 100, usage.time(SlotUsage::kResourceLimited));
+  EXPECT_EQ(4 * 10 + 3 * 10, usage.time(SlotUsage::kNinjaLimited));
+  EXPECT_EQ(3 * 100, usage.time(SlotUsage::kGraphLimited));
+  EXPECT_EQ(4 * 320, usage.total_time());
+}
+
+TEST(SlotUsageTest, Builds) {
+  SlotUsage usage;
+  usage.Start(2, 0);
+  usage.Update(0, 2, SlotUsage::kGraphLimited);
+  usage.Finish(100);
+  // The time between builds doesn't count, but the next build adds up.
+  usage.Start(2, 500);
+  usage.Update(500, 1, SlotUsage::kGraphLimited);
+  usage.Finish(600);
+  EXPECT_EQ(300, usage.time(SlotUsage::kBusy));
+  EXPECT_EQ(100, usage.time(SlotUsage::kGraphLimited));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,126 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "stat_audit.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+StatAudit* g_stat_audit = NULL;
+
+namespace {
+
+bool MoreCalls(const pair<string, int>& a, const pair<string, int>& b) {
+  if (a.second != b.second)
+    return a.second > b.second;
+  return a.first < b.first;
+}
+
+}  // anonymous namespace
+
+StatAudit::StatAudit() : reason_(kOther) {
+  for (int i = 0; i < kReasonCount; ++i)
+    calls_[i] = repeats_[i] = 0;
+}
+
+// static
+const char* StatAudit::ReasonName(Reason reason) {
+  switch (reason) {
+  case kOther:      return "other";
+  case kDirtyScan:  return "dirty scan";
+  case kOutputs:    return "outputs";
+  case kRestat:     return "restat";
+  case kClean:      return "clean";
+  case kManifest:   return "manifest";
+  case kRecompact:  return "recompact";
+  case kReasonCount: break;
+  }
+  return "?";
+}
+
+void StatAudit::Record(const string& path) {
+  PathCounts& counts = paths_[path];
+  ++calls_[reason_];
+  if (counts.total > 0)
+    ++repeats_[reason_];
+  ++counts.calls[reason_];
+  ++counts.total;
+}
+
+StatAudit::Scope::Scope(Reason reason) : saved_(kOther) {
+  if (!g_stat_audit)
+    return;
+  saved_ = g_stat_audit->reason_;
+  g_stat_audit->reason_ = reason;
+}
+
+StatAudit::Scope::~Scope() {
+  if (g_stat_audit)
+    g_stat_audit->reason_ = saved_;
+}
+
+int StatAudit::total_calls() const {
+  int total = 0;
+  for (int i = 0; i < kReasonCount; ++i)
+    total += calls_[i];
+  return total;
+}
+
+void StatAudit::MostStated(size_t count,
+                           vector<pair<string, int> >* paths) const {
+  paths->clear();
+  for (map<string, PathCounts>::const_iterator i = paths_.begin();
+       i != paths_.end(); ++i) {
+    paths->push_back(make_pair(i->first, i->second.total));
+  }
+  count = min(count, paths->size());
+  partial_sort(paths->begin(), paths->begin() + count, paths->end(),
+               MoreCalls);
+  paths->resize(count);
+}
+
+void StatAudit::Report() const {
+  int total = total_calls();
+  printf("%d stat calls of %d paths, %d of them duplicates\n",
+         total, path_count(), total - path_count());
+  printf("%-12s\t%8s\t%s\n", "reason", "calls", "duplicates");
+  for (int i = 0; i < kReasonCount; ++i) {
+    if (!calls_[i])
+      continue;
+    printf("%-12s\t%8d\t%d\n", ReasonName((Reason)i), calls_[i],
+           repeats_[i]);
+  }
+
+  vector<pair<string, int> > most;
+  MostStated(20, &most);
+  if (most.empty() || most[0].second < 2)
+    return;
+  printf("\nmost stat()ed paths:\n");
+  for (vector<pair<string, int> >::iterator i = most.begin();
+       i != most.end() && i->second > 1; ++i) {
+    const PathCounts& counts = paths_.find(i->first)->second;
+    string reasons;
+    for (int r = 0; r < kReasonCount; ++r) {
+      if (!counts.calls[r])
+        continue;
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%s%s %d", reasons.empty() ? "" : ", ",
+               ReasonName((Reason)r), counts.calls[r]);
+      reasons += buf;
+    }
+    printf("%8d\t%s (%s)\n", i->second, i->first.c_str(), reasons.c_str());
+  }
+}
@@ -0,0 +1,95 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_STAT_AUDIT_H_
+#define NINJA_STAT_AUDIT_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/// Counts the Stat() calls that a RealDiskInterface gets, by why they're
+/// made, to find the paths that are looked at more than once in a build.
+/// Used by '-d stataudit'.  Only meant for the main thread.
+struct StatAudit {
+  enum Reason {
+    kOther,
+    /// Working out what's dirty, before and during the build.
+    kDirtyScan,
+    /// Looking at the outputs of a command that finished, which is also
+    /// the mtime that the deps log records.
+    kOutputs,
+    /// Looking at the inputs again, once restat cleaned an output.
+    kRestat,
+    /// Removing files, for '-t clean' or after an interrupted command.
+    kClean,
+    /// Checking whether the manifest needs to be read again.
+    kManifest,
+    /// Dropping the entries of dead outputs from the logs.
+    kRecompact,
+    kReasonCount
+  };
+
+  StatAudit();
+
+  static const char* ReasonName(Reason reason);
+
+  /// Count a Stat() of |path|, for the current reason.
+  void Record(const string& path);
+
+  /// Sets the reason of the Stat() calls made while it's in scope, if
+  /// auditing is on.
+  struct Scope {
+    explicit Scope(Reason reason);
+    ~Scope();
+   private:
+    Reason saved_;
+  };
+
+  /// Calls for |reason|, and how many of them were of a path that had
+  /// already been stat()ed, for whatever reason.
+  int calls(Reason reason) const { return calls_[reason]; }
+  int repeats(Reason reason) const { return repeats_[reason]; }
+  int total_calls() const;
+  int path_count() const { return (int)paths_.size(); }
+
+  /// The |count| paths stat()ed the most, with how many times, most first.
+  void MostStated(size_t count, vector<pair<string, int> >* paths) const;
+
+  /// Print the totals, and the paths stat()ed the most.
+  void Report() const;
+
+ private:
+  struct PathCounts {
+    PathCounts() : total(0) {
+      for (int i = 0; i < kReasonCount; ++i)
+        calls[i] = 0;
+    }
+    int calls[kReasonCount];
+    int total;
+  };
+
+  Reason reason_;
+  int calls_[kReasonCount];
+  int repeats_[kReasonCount];
+  map<string, PathCounts> paths_;
+};
+
+/// The global audit, set by '-d stataudit'.
+extern StatAudit* g_stat_audit;
+
+#endif  // NINJA_STAT_AUDIT_H_
@@ -0,0 +1,83 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "stat_audit.h"
+
+#include "disk_interface.h"
+#include "test.h"
+
+namespace {
+
+struct StatAuditTest : public testing::Test {
+  virtual void SetUp() { g_stat_audit = &audit_; }
+  virtual void TearDown() { g_stat_audit = NULL; }
+
+  StatAudit audit_;
+};
+
+TEST_F(StatAuditTest, Reasons) {
+  audit_.Record("a");
+  {
+    StatAudit::Scope scan(StatAudit::kDirtyScan);
+    audit_.Record("a");
+    audit_.Record("b");
+    {
+      StatAudit::Scope restat(StatAudit::kRestat);
+      audit_.Record("b");
+    }
+    audit_.Record("c");
+  }
+  audit_.Record("d");
+
+  EXPECT_EQ(6, audit_.total_calls());
+  EXPECT_EQ(4, audit_.path_count());
+  EXPECT_EQ(2, audit_.calls(StatAudit::kOther));
+  EXPECT_EQ(0, audit_.repeats(StatAudit::kOther));
+  EXPECT_EQ(3, audit_.calls(StatAudit::kDirtyScan));
+  EXPECT_EQ(1, audit_.repeats(StatAudit::kDirtyScan));
+  EXPECT_EQ(1, audit_.calls(StatAudit::kRestat));
+  EXPECT_EQ(1, audit_.repeats(StatAudit::kRestat));
+
+  vector<pair<string, int> > most;
+  audit_.MostStated(3, &most);
+  ASSERT_EQ(3u, most.size());
+  EXPECT_EQ("a", most[0].first);
+  EXPECT_EQ(2, most[0].second);
+  EXPECT_EQ("b", most[1].first);
+  EXPECT_EQ(2, most[1].second);
+  EXPECT_EQ("c", most[2].first);
+  EXPECT_EQ(1, most[2].second);
+}
+
+TEST_F(StatAuditTest, RealDiskInterface) {
+  RealDiskInterface disk;
+  string err;
+  StatAudit::Scope clean(StatAudit::kClean);
+  EXPECT_EQ(0, disk.Stat("stat_audit_test_missing", &err));
+  EXPECT_EQ("", err);
+
+  vector<string> paths(2, "stat_audit_test_missing");
+  vector<const string*> path_ptrs;
+  path_ptrs.push_back(&paths[0]);
+  path_ptrs.push_back(&paths[1]);
+  vector<TimeStamp> mtimes;
+  disk.StatMany(path_ptrs, &mtimes);
+
+  EXPECT_EQ(3, audit_.calls(StatAudit::kClean));
+  EXPECT_EQ(2, audit_.repeats(StatAudit::kClean));
+  EXPECT_EQ(1, audit_.path_count());
+}
+
+}  // anonymous namespace
@@ -16,12 +16,37 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include <new>
+#include <set>
 
 #include "edit_distance.h"
 #include "graph.h"
+#include "memory_stats.h"
 #include "metrics.h"
+#include "shared_pool.h"
 #include "util.h"
 
+Pool::~Pool() {
+  delete shared_slots_;
+}
+
+void Pool::set_shared(bool shared) {
+  delete shared_slots_;
+  shared_slots_ = NULL;
+  if (shared && depth_ > 0) {
+    shared_slots_ = new SharedPoolSlots(SharedPoolSlots::DefaultDir(), name_,
+                                        depth_);
+  }
+}
+
+void Pool::Reset() {
+  current_use_ = 0;
+  delayed_.clear();
+  if (shared_slots_)
+    shared_slots_->ReleaseAll();
+}
 
 void Pool::EdgeScheduled(const Edge& edge) {
   if (depth_ != 0)
@@ -31,6 +56,19 @@ void Pool::EdgeScheduled(const Edge& edge) {
 void Pool::EdgeFinished(const Edge& edge) {
   if (depth_ != 0)
     current_use_ -= edge.weight();
+  if (shared_slots_)
+    shared_slots_->Release(edge.weight());
+}
+
+bool Pool::ScheduleCopy(const Edge& edge) {
+  if (depth_ == 0)
+    return true;
+  if (!delayed_.empty() || current_use_ + edge.weight() > depth_)
+    return false;
+  if (shared_slots_ && !shared_slots_->Acquire(edge.weight()))
+    return false;
+  EdgeScheduled(edge);
+  return true;
 }
 
 void Pool::DelayEdge(Edge* edge) {
@@ -38,13 +76,16 @@ void Pool::DelayEdge(Edge* edge) {
   delayed_.insert(edge);
 }
 
-void Pool::RetrieveReadyEdges(set<Edge*>* ready_queue) {
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
   DelayedEdges::iterator it = delayed_.begin();
   while (it != delayed_.end()) {
     Edge* edge = *it;
     if (current_use_ + edge->weight() > depth_)
       break;
-    ready_queue->insert(edge);
+    // The other processes may hold the slots this one has left.
+    if (shared_slots_ && !shared_slots_->Acquire(edge->weight()))
+      break;
+    ready_queue->push(edge);
     EdgeScheduled(*edge);
     ++it;
   }
@@ -65,20 +106,69 @@ void Pool::Dump() const {
 bool Pool::WeightedEdgeCmp(const Edge* a, const Edge* b) {
   if (!a) return b;
   if (!b) return false;
+  if (a->scheduling_priority() != b->scheduling_priority())
+    return a->scheduling_priority() > b->scheduling_priority();
   int weight_diff = a->weight() - b->weight();
-  return ((weight_diff < 0) || (weight_diff == 0 && a < b));
+  return ((weight_diff < 0) || (weight_diff == 0 && EdgePriorityLess()(b, a)));
 }
 
 Pool State::kDefaultPool("", 0);
 Pool State::kConsolePool("console", 1);
 const Rule State::kPhonyRule("phony");
 
-State::State() {
+State::State() : packed_out_edges_(0) {
   bindings_.AddRule(&kPhonyRule);
   AddPool(&kDefaultPool);
   AddPool(&kConsolePool);
 }
 
+State::~State() {
+  // The arena frees the memory, but the objects' own members need their
+  // destructors.
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+    i->second->~Node();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    (*e)->~Edge();
+}
+
+void State::PackOutEdges() {
+  METRIC_RECORD("pack out edges");
+  size_t count = 0;
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+    count += i->second->out_edges().size();
+  if (!count)
+    return;
+  // The nodes are packed in the order of the edges that first use them,
+  // roughly the order the scans walk them in.
+  Edge** storage =
+      static_cast<Edge**>(arena_.Alloc(count * sizeof(Edge*)));
+  Edge** next = storage;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    for (vector<Node*>::iterator in = (*e)->inputs_.begin();
+         in != (*e)->inputs_.end(); ++in) {
+      EdgeSpan out_edges = (*in)->out_edges();
+      if (out_edges.empty() || (out_edges.begin() >= storage &&
+                                out_edges.begin() < storage + count)) {
+        continue;  // Packed already.
+      }
+      (*in)->PackOutEdges(next);
+      next += out_edges.size();
+    }
+  }
+  // Should the out edges and the inputs disagree, none is left out.
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
+    EdgeSpan out_edges = i->second->out_edges();
+    if (out_edges.empty() || (out_edges.begin() >= storage &&
+                              out_edges.begin() < storage + count)) {
+      continue;
+    }
+    i->second->PackOutEdges(next);
+    next += out_edges.size();
+  }
+  assert(next == storage + count);
+  packed_out_edges_ += count;
+}
+
 void State::AddPool(Pool* pool) {
   assert(LookupPool(pool->name()) == NULL);
   pools_[pool->name()] = pool;
@@ -92,19 +182,27 @@ Pool* State::LookupPool(const string& pool_name) {
 }
 
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  Edge* edge = new (arena_.Alloc(sizeof(Edge))) Edge();
   edge->rule_ = rule;
+  edge->id_ = edges_.size();
   edge->pool_ = &State::kDefaultPool;
   edge->env_ = &bindings_;
   edges_.push_back(edge);
   return edge;
 }
 
+void State::RemoveLastEdge() {
+  // Its memory stays in the arena until the State goes away.
+  edges_.back()->~Edge();
+  edges_.pop_back();
+}
+
 Node* State::GetNode(StringPiece path, uint64_t slash_bits) {
   Node* node = LookupNode(path);
   if (node)
     return node;
-  node = new Node(path.AsString(), slash_bits);
+  node = new (arena_.Alloc(sizeof(Node)))
+      Node(arena_.CopyString(path), slash_bits);
   paths_[node->path()] = node;
   return node;
 }
@@ -117,18 +215,50 @@ Node* State::LookupNode(StringPiece path) const {
   return NULL;
 }
 
+Node* State::GetDepfileNode(StringPiece path, string* err) {
+  Paths::const_iterator i = depfile_paths_.find(path);
+  if (i != depfile_paths_.end())
+    return i->second;
+
+  // Canonicalizing overwrites the spelling, which only needs a copy of its
+  // own if it wasn't canonical already.
+  string spelling = path.AsString();
+  uint64_t slash_bits;
+  if (!CanonicalizePath(const_cast<char*>(path.str_), &path.len_, &slash_bits,
+                        err))
+    return NULL;
+  Node* node = GetNode(path, slash_bits);
+  if (path.len_ == spelling.size() && slash_bits == 0)
+    depfile_paths_[node->path()] = node;
+  else
+    depfile_paths_[arena_.CopyString(spelling)] = node;
+  return node;
+}
+
 Node* State::SpellcheckNode(const string& path) {
   const bool kAllowReplacements = true;
   const int kMaxValidEditDistance = 3;
 
+  // Nothing beats the path itself, which ends the search below at a
+  // single edit.
+  if (Node* node = LookupNode(path))
+    return node;
+
   int min_distance = kMaxValidEditDistance + 1;
   Node* result = NULL;
+  int length = path.size();
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
+    // A path is at least as many edits away as its length differs, which
+    // the map knows without looking at the path itself.
+    if (abs((int)i->first.len_ - length) >= min_distance)
+      continue;
     int distance = EditDistance(
-        i->first, path, kAllowReplacements, kMaxValidEditDistance);
+        i->first, path, kAllowReplacements, min_distance - 1);
     if (distance < min_distance && i->second) {
       min_distance = distance;
       result = i->second;
+      if (min_distance == 1)
+        break;
     }
   }
   return result;
@@ -184,17 +314,48 @@ vector<Node*> State::DefaultNodes(string* err) const {
 void State::Reset() {
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
     i->second->ResetState();
+
+  // Drop all loaded deps at once, rebuilding the out edges from what's left
+  // rather than removing them one by one.
+  bool unloaded = false;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->loaded_deps_ > 0) {
+      vector<Node*>::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+      edge->inputs_.erase(end - edge->loaded_deps_, end);
+      edge->implicit_deps_ -= edge->loaded_deps_;
+      unloaded = true;
+    }
+    edge->loaded_deps_ = -1;
+  }
+  if (unloaded) {
+    for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+      i->second->ClearOutEdges();
+    for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+      for (vector<Node*>::iterator i = (*e)->inputs_.begin();
+           i != (*e)->inputs_.end(); ++i) {
+        (*i)->AddOutEdge(*e);
+      }
+    }
+  }
+
+  ResetBuildState();
+}
+
+void State::ResetBuildState() {
   for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
     (*e)->outputs_ready_ = false;
     (*e)->mark_ = Edge::VisitNone;
   }
+  for (map<string, Pool*>::iterator p = pools_.begin(); p != pools_.end(); ++p)
+    p->second->Reset();
 }
 
 void State::Dump() {
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
     Node* node = i->second;
     printf("%s %s [id:%d]\n",
-           node->path().c_str(),
+           node->path_c_str(),
            node->status_known() ? (node->dirty() ? "dirty" : "clean")
                                 : "unknown",
            node->id());
@@ -210,3 +371,61 @@ void State::Dump() {
     }
   }
 }
+
+void State::ReportMemory(MemoryStats* stats) const {
+  // The nodes, the edges and the paths share the arena; what's left of it
+  // is the ends of its blocks, and the edges removed since they were added.
+  size_t arena_bytes = 0;
+
+  size_t path_bytes = 0, out_edges_bytes = 0;
+  for (Paths::const_iterator i = paths_.begin(); i != paths_.end(); ++i) {
+    path_bytes += i->first.len_ + 1;
+    out_edges_bytes += i->second->out_edges_bytes();
+  }
+  stats->Add("nodes", paths_.size(), paths_.size() * sizeof(Node));
+  stats->Add("paths", paths_.size(), path_bytes);
+  arena_bytes += paths_.size() * sizeof(Node) + path_bytes;
+
+  size_t spelling_bytes = 0;
+  for (Paths::const_iterator i = depfile_paths_.begin();
+       i != depfile_paths_.end(); ++i) {
+    spelling_bytes += i->first.len_ + 1;
+  }
+  stats->Add("depfile spellings", depfile_paths_.size(), spelling_bytes);
+  arena_bytes += spelling_bytes;
+
+  size_t packed_bytes = packed_out_edges_ * sizeof(Edge*);
+  arena_bytes += packed_bytes;
+  size_t edge_lists_bytes = out_edges_bytes + packed_bytes, command_bytes = 0;
+  int commands = 0;
+  set<const BindingEnv*> scopes;
+  scopes.insert(&bindings_);
+  for (vector<Edge*>::const_iterator e = edges_.begin(); e != edges_.end();
+       ++e) {
+    edge_lists_bytes += MemoryStats::VectorBytes((*e)->inputs_) +
+                        MemoryStats::VectorBytes((*e)->outputs_);
+    if ((*e)->command_evaluated_) {
+      ++commands;
+      command_bytes += MemoryStats::StringBytes((*e)->command_);
+    }
+    const BindingEnv* env = (*e)->env_;
+    while (env && scopes.insert(env).second)
+      env = env->parent();
+  }
+  stats->Add("edges", edges_.size(),
+             edges_.size() * sizeof(Edge) + MemoryStats::VectorBytes(edges_));
+  stats->Add("edge lists", edges_.size(), edge_lists_bytes);
+  stats->Add("commands", commands, command_bytes);
+  arena_bytes += edges_.size() * sizeof(Edge);
+
+  for (set<const BindingEnv*>::const_iterator i = scopes.begin();
+       i != scopes.end(); ++i) {
+    (*i)->ReportMemory(stats);
+  }
+
+  stats->Add("hash tables", 2,
+             paths_.memory_bytes() + depfile_paths_.memory_bytes());
+  size_t allocated = arena_.bytes_allocated();
+  stats->Add("arena slack", 1,
+             allocated > arena_bytes ? allocated - arena_bytes : 0);
+}
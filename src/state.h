@@ -21,13 +21,17 @@
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
+#include "graph.h"
 #include "hash_map.h"
 #include "util.h"
 
 struct Edge;
+struct MemoryStats;
 struct Node;
 struct Rule;
+struct SharedPoolSlots;
 
 /// A pool for delayed edges.
 /// Pools are scoped to a State. Edges within a State will share Pools. A Pool
@@ -39,7 +43,9 @@ struct Rule;
 /// completes).
 struct Pool {
   Pool(const string& name, int depth)
-    : name_(name), current_use_(0), depth_(depth), delayed_(&WeightedEdgeCmp) {}
+    : name_(name), current_use_(0), depth_(depth), remote_(true),
+      shared_slots_(NULL), delayed_(&WeightedEdgeCmp) {}
+  ~Pool();
 
   // A depth of 0 is infinite
   bool is_valid() const { return depth_ >= 0; }
@@ -47,9 +53,27 @@ struct Pool {
   const string& name() const { return name_; }
   int current_use() const { return current_use_; }
 
+  /// Whether the edges in this pool may run remotely, with --remote-exec.
+  bool remote() const { return remote_; }
+  void set_remote(bool remote) { remote_ = remote; }
+
+  /// The processors that the commands of this pool run on, or all of them
+  /// if empty.  Linux only.
+  const vector<int>& cpus() const { return cpus_; }
+  void set_cpus(const vector<int>& cpus) { cpus_ = cpus; }
+
+  /// Whether the depth applies to all the ninja processes on the machine
+  /// rather than to this one alone; see SharedPoolSlots.  A pool with an
+  /// infinite depth can't be shared.
+  bool shared() const { return shared_slots_ != NULL; }
+  void set_shared(bool shared);
+
   /// true if the Pool might delay this edge
   bool ShouldDelayEdge() const { return depth_ != 0; }
 
+  /// Whether the pool holds back edges that are ready to run.
+  bool has_delayed_edges() const { return !delayed_.empty(); }
+
   /// informs this Pool that the given edge is committed to be run.
   /// Pool will count this edge as using resources from this pool.
   void EdgeScheduled(const Edge& edge);
@@ -58,11 +82,21 @@ struct Pool {
   /// relinquish its resources back to the pool
   void EdgeFinished(const Edge& edge);
 
+  /// Count another copy of |edge|, which is running already, as using
+  /// resources from this pool, if there is room for it with no edge
+  /// delayed, and for a shared pool the other processes leave a slot.
+  /// Returns false otherwise.  EdgeFinished() gives the room back.
+  bool ScheduleCopy(const Edge& edge);
+
   /// adds the given edge to this Pool to be delayed.
   void DelayEdge(Edge* edge);
 
   /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(set<Edge*>* ready_queue);
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
+
+  /// Forget the edges scheduled or delayed by an earlier build, which may
+  /// have stopped before they finished.
+  void Reset();
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
@@ -74,6 +108,10 @@ struct Pool {
   /// currently scheduled in the Plan (i.e. the edges in Plan::ready_).
   int current_use_;
   int depth_;
+  bool remote_;
+  vector<int> cpus_;
+  /// The slots taken from the other processes, for a shared pool.
+  SharedPoolSlots* shared_slots_;
 
   static bool WeightedEdgeCmp(const Edge* a, const Edge* b);
 
@@ -88,14 +126,24 @@ struct State {
   static const Rule kPhonyRule;
 
   State();
+  ~State();
 
   void AddPool(Pool* pool);
   Pool* LookupPool(const string& pool_name);
 
   Edge* AddEdge(const Rule* rule);
+  /// Undo the last AddEdge(), for an edge that turned out to be unneeded.
+  void RemoveLastEdge();
 
   Node* GetNode(StringPiece path, uint64_t slash_bits);
   Node* LookupNode(StringPiece path) const;
+  /// The node of |path| as a depfile spells it, which is canonicalized in
+  /// place if it has to be; returns NULL with |err| filled if it can't be.
+  /// The spellings seen before are remembered, so that the headers most
+  /// depfiles share are only canonicalized once.
+  Node* GetDepfileNode(StringPiece path, string* err);
+  /// The node whose path is the closest to |path|, within a few edits, or
+  /// NULL if there's none.
   Node* SpellcheckNode(const string& path);
 
   void AddIn(Edge* edge, StringPiece path, uint64_t slash_bits);
@@ -106,9 +154,23 @@ struct State {
   /// state where we haven't yet examined the disk for dirty state.
   void Reset();
 
+  /// Prepare for another build of the same graph: reset the edge marks and
+  /// the pools, but keep the mtimes and deps that were already loaded.
+  /// Nodes known to have changed need Node::ResetState() and deps known to
+  /// be stale Edge::UnloadDeps() beforehand.
+  void ResetBuildState();
+
+  /// Pack the out edges of all the nodes into one array, in the arena, for
+  /// a graph that is done loading.  Edges added later, like those of the
+  /// deps log, move the out edges of their nodes out of it again.
+  void PackOutEdges();
+
   /// Dump the nodes and Pools (useful for debugging).
   void Dump();
 
+  /// Count the memory of the graph in |stats|, for '-d memstats'.
+  void ReportMemory(MemoryStats* stats) const;
+
   /// @return the root node(s) of the graph. (Root nodes have no output edges).
   /// @param error where to write the error message if somethings went wrong.
   vector<Node*> RootNodes(string* error) const;
@@ -117,6 +179,8 @@ struct State {
   /// Mapping of path -> Node.
   typedef ExternalStringHashMap<Node*>::Type Paths;
   Paths paths_;
+  /// Mapping of path as spelled in a depfile -> Node, for GetDepfileNode().
+  Paths depfile_paths_;
 
   /// All the pools used in the graph.
   map<string, Pool*> pools_;
@@ -126,6 +190,13 @@ struct State {
 
   BindingEnv bindings_;
   vector<Node*> defaults_;
+
+  /// Holds the nodes, the edges and the node paths, which all live as long
+  /// as the State does.  Keeping them together saves a malloc() per object
+  /// and keeps the graph packed for the dirty scan.
+  Arena arena_;
+  /// The number of out edges PackOutEdges() put in the arena.
+  size_t packed_out_edges_;
 };
 
 #endif  // NINJA_STATE_H_
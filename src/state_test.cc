@@ -43,4 +43,124 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out", 0)->dirty());
 }
 
+TEST(State, RuleOwnsBindingText) {
+  State state;
+
+  // The rule has to keep its text once the manifest buffer is gone.
+  string buffer = "cc -c in -o out";
+  EvalString command;
+  command.AddText(StringPiece(buffer.data(), 3));
+  command.AddText(StringPiece(buffer.data() + 3, 3));
+  command.AddSpecial(StringPiece(buffer.data() + 6, 2));
+  command.AddText(StringPiece(buffer.data() + 8, 4));
+  command.AddSpecial(StringPiece(buffer.data() + 12, 3));
+  EXPECT_EQ("[cc -c ][$in][ -o ][$out]", command.Serialize());
+
+  Rule* rule = new Rule("cc");
+  rule->AddBinding("command", command);
+  state.bindings_.AddRule(rule);
+  // Copies of the rule's bindings keep pointing at their own text.
+  Rule copy = *rule;
+  buffer.assign(buffer.size(), 'x');
+
+  Edge* edge = state.AddEdge(rule);
+  state.AddIn(edge, "a.c", 0);
+  state.AddOut(edge, "a.o", 0);
+  EXPECT_EQ("cc -c a.c -o a.o", edge->EvaluateCommand());
+  EXPECT_EQ("[cc -c ][$in][ -o ][$out]",
+            copy.GetBinding("command")->Serialize());
+}
+
+TEST(State, GetDepfileNode) {
+  State state;
+  Node* header = state.GetNode("sub/foo.h", 0);
+
+  // Each depfile gets a buffer of its own, which gets canonicalized.
+  for (int i = 0; i < 2; ++i) {
+    char path[] = "sub/../sub/./foo.h";
+    string err;
+    EXPECT_EQ(header, state.GetDepfileNode(StringPiece(path), &err));
+    EXPECT_EQ("", err);
+    if (i == 0)
+      EXPECT_EQ(string("sub/foo.h"), string(path, strlen("sub/foo.h")));
+    char canonical[] = "sub/foo.h";
+    EXPECT_EQ(header, state.GetDepfileNode(StringPiece(canonical), &err));
+  }
+
+  char other[] = "./bar.h";
+  string err;
+  Node* bar = state.GetDepfileNode(StringPiece(other), &err);
+  ASSERT_TRUE(bar != NULL);
+  EXPECT_EQ("bar.h", bar->path());
+  EXPECT_EQ(bar, state.LookupNode("bar.h"));
+
+  char empty[] = "";
+  EXPECT_TRUE(state.GetDepfileNode(StringPiece(empty, 0), &err) == NULL);
+  EXPECT_EQ("empty path", err);
+}
+
+TEST(State, SpellcheckNode) {
+  State state;
+  Node* foo = state.GetNode("out/foo.o", 0);
+  Node* long_foo = state.GetNode("out/obj/lib/src/dir/foo.o", 0);
+  state.GetNode("bar.h", 0);
+
+  EXPECT_EQ(foo, state.SpellcheckNode("out/foo.c"));
+  EXPECT_EQ(foo, state.SpellcheckNode("ut/foo.o"));
+  EXPECT_EQ(foo, state.SpellcheckNode("out/fooo.o"));
+  EXPECT_EQ(long_foo, state.SpellcheckNode("out/obj/lib/src/dr/fo.o"));
+  EXPECT_EQ(NULL, state.SpellcheckNode("out/obj/lib/src/d/f"));
+  EXPECT_EQ(NULL, state.SpellcheckNode(""));
+
+  // The closest one wins, whatever the length.
+  Node* foo_c = state.GetNode("out/foo.cc", 0);
+  EXPECT_EQ(foo_c, state.SpellcheckNode("out/foo.ccc"));
+  EXPECT_EQ(foo_c, state.SpellcheckNode("out/fo.cc"));
+}
+
+TEST(State, PackOutEdges) {
+  State state;
+  Edge* edge1 = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge1, "in", 0);
+  state.AddIn(edge1, "shared", 0);
+  state.AddOut(edge1, "mid", 0);
+  Edge* edge2 = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge2, "mid", 0);
+  state.AddIn(edge2, "shared", 0);
+  state.AddOut(edge2, "out", 0);
+
+  state.PackOutEdges();
+  Node* shared = state.GetNode("shared", 0);
+  ASSERT_EQ(2u, shared->out_edges().size());
+  EXPECT_EQ(edge1, shared->out_edges()[0]);
+  EXPECT_EQ(edge2, shared->out_edges()[1]);
+  EXPECT_EQ(0u, shared->out_edges_bytes());
+  // The nodes are next to each other, in the order of the edges.
+  EXPECT_EQ(state.GetNode("in", 0)->out_edges().end(),
+            shared->out_edges().begin());
+  EXPECT_EQ(shared->out_edges().end(),
+            state.GetNode("mid", 0)->out_edges().begin());
+  EXPECT_TRUE(state.GetNode("out", 0)->out_edges().empty());
+
+  // Adding to a packed node moves its edges out, keeping the others.
+  Edge* edge3 = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge3, "shared", 0);
+  state.AddOut(edge3, "out2", 0);
+  ASSERT_EQ(3u, shared->out_edges().size());
+  EXPECT_EQ(edge1, shared->out_edges()[0]);
+  EXPECT_EQ(edge3, shared->out_edges()[2]);
+  EXPECT_NE(0u, shared->out_edges_bytes());
+  ASSERT_EQ(1u, state.GetNode("mid", 0)->out_edges().size());
+  EXPECT_EQ(edge2, state.GetNode("mid", 0)->out_edges()[0]);
+
+  // Packing again takes it back in.
+  state.PackOutEdges();
+  EXPECT_EQ(0u, shared->out_edges_bytes());
+  ASSERT_EQ(3u, shared->out_edges().size());
+  EXPECT_EQ(edge3, shared->out_edges()[2]);
+  shared->RemoveOutEdge(edge1);
+  ASSERT_EQ(2u, shared->out_edges().size());
+  EXPECT_EQ(edge2, shared->out_edges()[0]);
+}
+
 }  // namespace
@@ -0,0 +1,75 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include "build.h"
+#include "metrics.h"
+#include "util.h"
+
+// The default NINJA_STATUS, and one with every placeholder.
+const char* kFormats[] = {
+  "[%f/%t] ",
+  "[%p %s/%t %r running, %u left, %o/s %c/s, %es] ",
+};
+
+// Formats |format| |n| times, and returns how long it took.
+int Measure(BuildStatus* status, const char* format, bool split_once, int n) {
+  ProgressStatusFormat split;
+  string err;
+  if (!split.Parse(format, &err))
+    Fatal("%s", err.c_str());
+  string out;
+  size_t total = 0;
+
+  int64_t start = GetTimeMillis();
+  for (int i = 0; i < n; ++i) {
+    if (split_once) {
+      out.clear();
+      status->FormatProgressStatus(split, BuildStatus::kEdgeFinished, &out);
+    } else {
+      out = status->FormatProgressStatus(format, BuildStatus::kEdgeFinished);
+    }
+    total += out.size();
+  }
+  int delta = (int)(GetTimeMillis() - start);
+  if (total == 0)
+    Fatal("nothing formatted");
+  return delta;
+}
+
+int main() {
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  BuildStatus status(config);
+  status.PlanHasTotalEdges(54321);
+  status.BuildStarted();
+
+  const int kNumRepetitions = 1000000;
+  for (size_t f = 0; f < sizeof(kFormats) / sizeof(kFormats[0]); ++f) {
+    printf("'%s'\n", kFormats[f]);
+    for (int split_once = 0; split_once < 2; ++split_once) {
+      int best = -1;
+      for (int j = 0; j < 5; ++j) {
+        int delta = Measure(&status, kFormats[f], split_once, kNumRepetitions);
+        if (best < 0 || delta < best)
+          best = delta;
+      }
+      printf("  %-20s %dms for %d updates\n",
+             split_once ? "split once:" : "split every time:", best,
+             kNumRepetitions);
+    }
+  }
+  return 0;
+}
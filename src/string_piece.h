@@ -35,11 +35,12 @@ struct StringPiece {
 
   StringPiece(const char* str, size_t len) : str_(str), len_(len) {}
 
-  bool operator==(const StringPiece& other) const {
-    return len_ == other.len_ && memcmp(str_, other.str_, len_) == 0;
+  /// Non-members, so that either side may convert implicitly.
+  friend bool operator==(const StringPiece& a, const StringPiece& b) {
+    return a.len_ == b.len_ && memcmp(a.str_, b.str_, a.len_) == 0;
   }
-  bool operator!=(const StringPiece& other) const {
-    return !(*this == other);
+  friend bool operator!=(const StringPiece& a, const StringPiece& b) {
+    return !(a == b);
   }
 
   /// Convert the slice into a full-fledged std::string, copying the
@@ -22,37 +22,102 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <spawn.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include <algorithm>
 
 extern char** environ;
 
+#include "metrics.h"
 #include "util.h"
 
-Subprocess::Subprocess(bool use_console) : fd_(-1), pid_(-1),
-                                           use_console_(use_console) {
+MemoryFile::~MemoryFile() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (child_fd_ >= 0)
+    close(child_fd_);
+}
+
+bool MemoryFile::Create() {
+#ifdef MFD_CLOEXEC
+  fd_ = memfd_create("ninja", MFD_CLOEXEC);
+  if (fd_ < 0)
+    return false;
+  child_fd_ = fcntl(fd_, F_DUPFD_CLOEXEC, 0);
+  if (child_fd_ < 0)
+    return false;
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/fd/%d", child_fd_);
+  path_ = path;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MemoryFile::Read(string* content) const {
+  content->clear();
+  char buf[64 << 10];
+  off_t offset = 0;
+  for (;;) {
+    ssize_t len = pread(fd_, buf, sizeof(buf), offset);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (len == 0)
+      return true;
+    content->append(buf, len);
+    offset += len;
+  }
+}
+
+Subprocess::Subprocess(bool use_console, MemoryFile* file)
+    : file_(file), exit_code_(-1), fd_(-1), pid_(-1),
+      use_console_(use_console) {
 }
 
 Subprocess::~Subprocess() {
   if (fd_ >= 0)
-    close(fd_);
+    ClosePipe();
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
+  delete file_;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool direct_exec, const vector<int>* cpus) {
+  METRIC_COUNT("spawns", 1);
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
   fd_ = output_pipe[0];
-#if !defined(USE_PPOLL)
-  // If available, we use ppoll in DoWork(); otherwise we use pselect
-  // and so must avoid overly-large FDs.
+#if !defined(USE_PPOLL) && !defined(USE_EPOLL)
+  // If available, we use epoll or ppoll in DoWork(); otherwise we use
+  // pselect and so must avoid overly-large FDs.
   if (fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
-#endif  // !USE_PPOLL
+#endif  // !USE_PPOLL && !USE_EPOLL
   SetCloseOnExec(fd_);
+#ifdef USE_EPOLL
+  epoll_fd_ = set->epoll_fd_;
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = this;
+  if (epoll_ctl(set->epoll_fd_, EPOLL_CTL_ADD, fd_, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif
 
   posix_spawn_file_actions_t action;
   int err = posix_spawn_file_actions_init(&action);
@@ -102,6 +167,14 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     // In the console case, output_pipe is still inherited by the child and
     // closed when the subprocess finishes, which then notifies ninja.
   }
+
+  if (file_) {
+    // Replacing the child's copy of child_fd_ also drops its close-on-exec.
+    err = posix_spawn_file_actions_adddup2(&action, file_->fd_,
+                                           file_->child_fd_);
+    if (err != 0)
+      Fatal("posix_spawn_file_actions_adddup2: %s", strerror(err));
+  }
 #ifdef POSIX_SPAWN_USEVFORK
   flags |= POSIX_SPAWN_USEVFORK;
 #endif
@@ -110,9 +183,44 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (err != 0)
     Fatal("posix_spawnattr_setflags: %s", strerror(err));
 
-  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
-  err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
-        const_cast<char**>(spawned_args), environ);
+#ifdef __linux__
+  // posix_spawn() has no attribute for the affinity, but the child inherits
+  // that of the thread spawning it.  Its memory then comes from the NUMA
+  // node of those processors, by the kernel's default policy.
+  cpu_set_t old_cpus;
+  bool pinned = false;
+  if (cpus && !cpus->empty() &&
+      sched_getaffinity(0, sizeof(old_cpus), &old_cpus) == 0) {
+    cpu_set_t new_cpus;
+    CPU_ZERO(&new_cpus);
+    for (vector<int>::const_iterator i = cpus->begin(); i != cpus->end(); ++i)
+      if (*i < CPU_SETSIZE)
+        CPU_SET(*i, &new_cpus);
+    pinned = sched_setaffinity(0, sizeof(new_cpus), &new_cpus) == 0;
+  }
+#endif
+
+  // Skip the shell when it would only split the command into words and
+  // look the program up in $PATH.  If that fails, the shell gets to report
+  // it, e.g. with its own "not found" message and exit code.
+  vector<string> args;
+  err = -1;
+  if (direct_exec && SplitCommand(command, &args)) {
+    vector<char*> argv;
+    for (vector<string>::iterator i = args.begin(); i != args.end(); ++i)
+      argv.push_back(const_cast<char*>(i->c_str()));
+    argv.push_back(NULL);
+    err = posix_spawnp(&pid_, argv[0], &action, &attr, &argv[0], environ);
+  }
+  if (err != 0) {
+    const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
+    err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
+          const_cast<char**>(spawned_args), environ);
+  }
+#ifdef __linux__
+  if (pinned)
+    sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+#endif
   if (err != 0)
     Fatal("posix_spawn: %s", strerror(err));
 
@@ -124,32 +232,101 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     Fatal("posix_spawn_file_actions_destroy: %s", strerror(err));
 
   close(output_pipe[1]);
+  if (file_) {
+    close(file_->child_fd_);
+    file_->child_fd_ = -1;
+  }
+  return true;
+}
+
+// static
+bool Subprocess::SplitCommand(const string& command, vector<string>* args) {
+  args->clear();
+  string::size_type start = string::npos;
+  for (string::size_type i = 0; i <= command.size(); ++i) {
+    char c = i < command.size() ? command[i] : ' ';
+    if (c == ' ' || c == '\t') {
+      if (start != string::npos)
+        args->push_back(command.substr(start, i - start));
+      start = string::npos;
+      continue;
+    }
+    // Anything else could mean quoting, expansion, redirection or more
+    // than one command.
+    if (!(('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+          ('0' <= c && c <= '9') || strchr("_-+./,:=@%^", c))) {
+      return false;
+    }
+    if (start == string::npos)
+      start = i;
+  }
+  if (args->empty())
+    return false;
+
+  // "FOO=bar cmd" sets a variable, and the shell's builtins and reserved
+  // words aren't programs (or behave differently when they are).
+  const string& program = (*args)[0];
+  if (program.find('=') != string::npos)
+    return false;
+  static const char* const kShellWords[] = {
+    ".", ":", "alias", "break", "case", "cd", "command", "continue", "do",
+    "done", "elif", "else", "esac", "eval", "exec", "exit", "export", "fi",
+    "for", "getopts", "hash", "if", "in", "local", "read", "readonly",
+    "return", "set", "shift", "source", "then", "times", "trap", "type",
+    "ulimit", "umask", "unalias", "unset", "until", "wait", "while", NULL
+  };
+  for (const char* const* word = kShellWords; *word; ++word) {
+    if (program == *word)
+      return false;
+  }
   return true;
 }
 
 void Subprocess::OnPipeReady() {
-  char buf[4 << 10];
+  char buf[64 << 10];
   ssize_t len = read(fd_, buf, sizeof(buf));
   if (len > 0) {
-    buf_.append(buf, len);
+    buf_.Append(buf, len);
   } else {
     if (len < 0)
       Fatal("read: %s", strerror(errno));
-    close(fd_);
-    fd_ = -1;
+    buf_.Finish();
+    ClosePipe();
   }
 }
 
+void Subprocess::ClosePipe() {
+#ifdef USE_EPOLL
+  // Closing the pipe only drops it from the epoll set once no process has
+  // it open any more, and a child that is being spawned may still have a
+  // copy: so drop it explicitly, lest its events keep coming.
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd_, NULL);
+#endif
+  close(fd_);
+  fd_ = -1;
+}
+
 ExitStatus Subprocess::Finish() {
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage usage;
+  if (wait4(pid_, &status, 0, &usage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
 
+  usage_.user_time_ms = usage.ru_utime.tv_sec * 1000 +
+                        usage.ru_utime.tv_usec / 1000;
+  usage_.system_time_ms = usage.ru_stime.tv_sec * 1000 +
+                          usage.ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+  usage_.max_rss_kb = usage.ru_maxrss / 1024;  // In bytes on macOS.
+#else
+  usage_.max_rss_kb = usage.ru_maxrss;
+#endif
+
   if (WIFEXITED(status)) {
-    int exit = WEXITSTATUS(status);
-    if (exit == 0)
+    exit_code_ = WEXITSTATUS(status);
+    if (exit_code_ == 0)
       return ExitSuccess;
   } else if (WIFSIGNALED(status)) {
     if (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM
@@ -164,7 +341,11 @@ bool Subprocess::Done() const {
 }
 
 const string& Subprocess::GetOutput() const {
-  return buf_;
+  return buf_.output();
+}
+
+const ResourceUsage& Subprocess::GetResourceUsage() const {
+  return usage_;
 }
 
 int SubprocessSet::interrupted_;
@@ -206,6 +387,12 @@ SubprocessSet::SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigaction(SIGHUP, &act, &old_hup_act_) < 0)
     Fatal("sigaction: %s", strerror(errno));
+
+#ifdef USE_EPOLL
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+    Fatal("epoll_create1: %s", strerror(errno));
+#endif
 }
 
 SubprocessSet::~SubprocessSet() {
@@ -219,11 +406,16 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigprocmask(SIG_SETMASK, &old_mask_, 0) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
+#ifdef USE_EPOLL
+  close(epoll_fd_);
+#endif
 }
 
-Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
-  Subprocess *subprocess = new Subprocess(use_console);
-  if (!subprocess->Start(this, command)) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_console,
+                               bool direct_exec, MemoryFile* file,
+                               const vector<int>* cpus) {
+  Subprocess *subprocess = new Subprocess(use_console, file);
+  if (!subprocess->Start(this, command, direct_exec, cpus)) {
     delete subprocess;
     return 0;
   }
@@ -231,8 +423,42 @@ Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
   return subprocess;
 }
 
-#ifdef USE_PPOLL
-bool SubprocessSet::DoWork() {
+#if defined(USE_EPOLL)
+bool SubprocessSet::DoWork(int timeout_ms) {
+  ReapKilled();
+  struct epoll_event events[64];
+  interrupted_ = 0;
+  // Pipes are dropped from the epoll set at EOF, so only the running
+  // subprocesses are in there.
+  int ret = epoll_pwait(epoll_fd_, events, sizeof(events) / sizeof(events[0]),
+                        timeout_ms < 0 ? -1 : timeout_ms, &old_mask_);
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_pwait");
+      return false;
+    }
+    return IsInterrupted();
+  }
+
+  HandlePendingInterruption();
+  if (IsInterrupted())
+    return true;
+
+  for (int i = 0; i < ret; ++i) {
+    Subprocess* subproc = static_cast<Subprocess*>(events[i].data.ptr);
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
+      finished_.push(subproc);
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+    }
+  }
+
+  return IsInterrupted();
+}
+
+#elif defined(USE_PPOLL)
+bool SubprocessSet::DoWork(int timeout_ms) {
+  ReapKilled();
   vector<pollfd> fds;
   nfds_t nfds = 0;
 
@@ -247,7 +473,9 @@ bool SubprocessSet::DoWork() {
   }
 
   interrupted_ = 0;
-  int ret = ppoll(&fds.front(), nfds, NULL, &old_mask_);
+  timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  int ret = ppoll(&fds.front(), nfds, timeout_ms < 0 ? NULL : &timeout,
+                  &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: ppoll");
@@ -281,8 +509,9 @@ bool SubprocessSet::DoWork() {
   return IsInterrupted();
 }
 
-#else  // !defined(USE_PPOLL)
-bool SubprocessSet::DoWork() {
+#else  // !defined(USE_PPOLL) && !defined(USE_EPOLL)
+bool SubprocessSet::DoWork(int timeout_ms) {
+  ReapKilled();
   fd_set set;
   int nfds = 0;
   FD_ZERO(&set);
@@ -298,7 +527,9 @@ bool SubprocessSet::DoWork() {
   }
 
   interrupted_ = 0;
-  int ret = pselect(nfds, &set, 0, 0, 0, &old_mask_);
+  timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  int ret = pselect(nfds, &set, 0, 0, timeout_ms < 0 ? NULL : &timeout,
+                    &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: pselect");
@@ -327,7 +558,7 @@ bool SubprocessSet::DoWork() {
 
   return IsInterrupted();
 }
-#endif  // !defined(USE_PPOLL)
+#endif  // !defined(USE_PPOLL) && !defined(USE_EPOLL)
 
 Subprocess* SubprocessSet::NextFinished() {
   if (finished_.empty())
@@ -348,4 +579,46 @@ void SubprocessSet::Clear() {
        i != running_.end(); ++i)
     delete *i;
   running_.clear();
+
+  // Those that were killed and still haven't exited are left to init,
+  // rather than holding ninja up.
+  ReapKilled();
+  for (vector<Subprocess*>::iterator i = killed_.begin(); i != killed_.end();
+       ++i) {
+    (*i)->pid_ = -1;
+    delete *i;
+  }
+  killed_.clear();
+}
+
+void SubprocessSet::Kill(Subprocess* subproc) {
+  vector<Subprocess*>::iterator i =
+      find(running_.begin(), running_.end(), subproc);
+  if (i != running_.end()) {
+    running_.erase(i);
+    // SIGKILL, since a copy that ignores SIGTERM would never be reaped.
+    kill(subproc->use_console_ ? subproc->pid_ : -subproc->pid_, SIGKILL);
+    subproc->ClosePipe();
+    killed_.push_back(subproc);
+    return;
+  }
+  queue<Subprocess*> finished;
+  for (; !finished_.empty(); finished_.pop()) {
+    if (finished_.front() != subproc)
+      finished.push(finished_.front());
+  }
+  finished_ = finished;
+  delete subproc;
+}
+
+void SubprocessSet::ReapKilled() {
+  for (vector<Subprocess*>::iterator i = killed_.begin(); i != killed_.end();) {
+    if (waitpid((*i)->pid_, NULL, WNOHANG) == 0) {
+      ++i;
+      continue;
+    }
+    (*i)->pid_ = -1;
+    delete *i;
+    i = killed_.erase(i);
+  }
 }
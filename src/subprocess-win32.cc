@@ -16,83 +16,145 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <psapi.h>
 
 #include <algorithm>
 
+#include "metrics.h"
 #include "util.h"
 
-Subprocess::Subprocess(bool use_console) : child_(NULL) , overlapped_(),
-                                           is_reading_(false),
-                                           use_console_(use_console) {
+/// The parent end of a named pipe that a subprocess writes its output to.
+/// Creating the pipe and registering it with the completion port is done
+/// once: when the child closes its end, the pipe is disconnected and goes
+/// back to the SubprocessSet for the next subprocess.
+struct SubprocessPipe {
+  SubprocessPipe() : pipe(INVALID_HANDLE_VALUE), is_reading(false),
+                     owner(NULL) {}
+
+  /// Handle the completed connection or read: hand what was read to
+  /// |output|, if there is one, and start the next read.  Returns false,
+  /// with the pipe disconnected, once the child has closed its end.
+  bool OnReady(OutputBuffer* output);
+
+  HANDLE pipe;
+  char name[100];
+  OVERLAPPED overlapped;
+  char buf[64 << 10];
+  bool is_reading;
+  /// The subprocess whose output this is, or NULL if it went away while its
+  /// child was still writing.
+  Subprocess* owner;
+};
+
+bool SubprocessPipe::OnReady(OutputBuffer* output) {
+  DWORD bytes;
+  if (!GetOverlappedResult(pipe, &overlapped, &bytes, TRUE)) {
+    if (GetLastError() != ERROR_BROKEN_PIPE)
+      Win32Fatal("GetOverlappedResult");
+    DisconnectNamedPipe(pipe);
+    return false;
+  }
+
+  if (is_reading && bytes && output)
+    output->Append(buf, bytes);
+
+  memset(&overlapped, 0, sizeof(overlapped));
+  is_reading = true;
+  if (!::ReadFile(pipe, buf, sizeof(buf), &bytes, &overlapped)) {
+    if (GetLastError() == ERROR_BROKEN_PIPE) {
+      DisconnectNamedPipe(pipe);
+      return false;
+    }
+    if (GetLastError() != ERROR_IO_PENDING)
+      Win32Fatal("ReadFile");
+  }
+
+  // Even if we read any bytes in the readfile call, we'll enter this
+  // function again later and get them at that point.
+  return true;
+}
+
+MemoryFile::~MemoryFile() {}
+
+bool MemoryFile::Create() {
+  return false;
+}
+
+bool MemoryFile::Read(string* content) const {
+  return false;
+}
+
+Subprocess::Subprocess(bool use_console, MemoryFile* file)
+    : file_(file), exit_code_(-1), child_(NULL), pipe_(NULL),
+      use_console_(use_console) {
 }
 
 Subprocess::~Subprocess() {
-  if (pipe_) {
-    if (!CloseHandle(pipe_))
-      Win32Fatal("CloseHandle");
-  }
+  // A child that is still writing keeps the pipe until it's done.
+  if (pipe_)
+    pipe_->owner = NULL;
   // Reap child if forgotten.
   if (child_)
     Finish();
+  delete file_;
 }
 
-HANDLE Subprocess::SetupPipe(HANDLE ioport) {
-  char pipe_name[100];
-  snprintf(pipe_name, sizeof(pipe_name),
-           "\\\\.\\pipe\\ninja_pid%lu_sp%p", GetCurrentProcessId(), this);
-
-  pipe_ = ::CreateNamedPipeA(pipe_name,
-                             PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
-                             PIPE_TYPE_BYTE,
-                             PIPE_UNLIMITED_INSTANCES,
-                             0, 0, INFINITE, NULL);
-  if (pipe_ == INVALID_HANDLE_VALUE)
-    Win32Fatal("CreateNamedPipe");
-
-  if (!CreateIoCompletionPort(pipe_, ioport, (ULONG_PTR)this, 0))
-    Win32Fatal("CreateIoCompletionPort");
+HANDLE Subprocess::SetupPipe(SubprocessSet* set) {
+  if (set->free_pipes_.empty()) {
+    pipe_ = new SubprocessPipe;
+    set->pipes_.push_back(pipe_);
+    snprintf(pipe_->name, sizeof(pipe_->name),
+             "\\\\.\\pipe\\ninja_pid%lu_sp%p", GetCurrentProcessId(), pipe_);
+    pipe_->pipe = ::CreateNamedPipeA(pipe_->name,
+                                     PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+                                     PIPE_TYPE_BYTE,
+                                     PIPE_UNLIMITED_INSTANCES,
+                                     0, 0, INFINITE, NULL);
+    if (pipe_->pipe == INVALID_HANDLE_VALUE)
+      Win32Fatal("CreateNamedPipe");
+
+    if (!CreateIoCompletionPort(pipe_->pipe, set->ioport_, (ULONG_PTR)pipe_,
+                                0)) {
+      Win32Fatal("CreateIoCompletionPort");
+    }
+  } else {
+    pipe_ = set->free_pipes_.back();
+    set->free_pipes_.pop_back();
+  }
+  pipe_->owner = this;
+  pipe_->is_reading = false;
 
-  memset(&overlapped_, 0, sizeof(overlapped_));
-  if (!ConnectNamedPipe(pipe_, &overlapped_) &&
+  memset(&pipe_->overlapped, 0, sizeof(pipe_->overlapped));
+  if (!ConnectNamedPipe(pipe_->pipe, &pipe_->overlapped) &&
       GetLastError() != ERROR_IO_PENDING) {
     Win32Fatal("ConnectNamedPipe");
   }
 
-  // Get the write end of the pipe as a handle inheritable across processes.
-  HANDLE output_write_handle =
-      CreateFileA(pipe_name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-  HANDLE output_write_child;
-  if (!DuplicateHandle(GetCurrentProcess(), output_write_handle,
-                       GetCurrentProcess(), &output_write_child,
-                       0, TRUE, DUPLICATE_SAME_ACCESS)) {
-    Win32Fatal("DuplicateHandle");
-  }
-  CloseHandle(output_write_handle);
-
-  return output_write_child;
-}
-
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
-  HANDLE child_pipe = SetupPipe(set->ioport_);
-
+  // Open the write end of the pipe as a handle inheritable across processes.
   SECURITY_ATTRIBUTES security_attributes;
   memset(&security_attributes, 0, sizeof(SECURITY_ATTRIBUTES));
   security_attributes.nLength = sizeof(SECURITY_ATTRIBUTES);
   security_attributes.bInheritHandle = TRUE;
-  // Must be inheritable so subprocesses can dup to children.
-  HANDLE nul =
-      CreateFileA("NUL", GENERIC_READ,
-                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                  &security_attributes, OPEN_EXISTING, 0, NULL);
-  if (nul == INVALID_HANDLE_VALUE)
-    Fatal("couldn't open nul");
+  HANDLE output_write_child =
+      CreateFileA(pipe_->name, GENERIC_WRITE, 0, &security_attributes,
+                  OPEN_EXISTING, 0, NULL);
+  if (output_write_child == INVALID_HANDLE_VALUE)
+    Win32Fatal("CreateFile");
+
+  return output_write_child;
+}
+
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool direct_exec, const vector<int>* cpus) {
+  METRIC_COUNT("spawns", 1);
+  HANDLE child_pipe = SetupPipe(set);
 
-  STARTUPINFOA startup_info;
+  STARTUPINFOW startup_info;
   memset(&startup_info, 0, sizeof(startup_info));
-  startup_info.cb = sizeof(STARTUPINFO);
+  startup_info.cb = sizeof(STARTUPINFOW);
   if (!use_console_) {
     startup_info.dwFlags = STARTF_USESTDHANDLES;
-    startup_info.hStdInput = nul;
+    startup_info.hStdInput = set->nul_;
     startup_info.hStdOutput = child_pipe;
     startup_info.hStdError = child_pipe;
   }
@@ -105,9 +167,18 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   // Ninja handles ctrl-c, except for subprocesses in console pools.
   DWORD process_flags = use_console_ ? 0 : CREATE_NEW_PROCESS_GROUP;
 
+  // CreateProcessA() would convert the command itself, into a buffer of its
+  // own for each command.  It's converted from the same ANSI code page here.
+  int size = MultiByteToWideChar(CP_ACP, 0, command.c_str(), -1, NULL, 0);
+  if (size <= 0)
+    Win32Fatal("MultiByteToWideChar");
+  set->wide_command_.resize(size);
+  MultiByteToWideChar(CP_ACP, 0, command.c_str(), -1, &set->wide_command_[0],
+                      size);
+
   // Do not prepend 'cmd /c' on Windows, this breaks command
   // lines greater than 8,191 chars.
-  if (!CreateProcessA(NULL, (char*)command.c_str(), NULL, NULL,
+  if (!CreateProcessW(NULL, &set->wide_command_[0], NULL, NULL,
                       /* inherit handles */ TRUE, process_flags,
                       NULL, NULL,
                       &startup_info, &process_info)) {
@@ -115,14 +186,14 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     if (error == ERROR_FILE_NOT_FOUND) {
       // File (program) not found error is treated as a normal build
       // action failure.
-      if (child_pipe)
-        CloseHandle(child_pipe);
-      CloseHandle(pipe_);
-      CloseHandle(nul);
+      CloseHandle(child_pipe);
+      // The pipe goes back to the set once its connection is reported.
+      pipe_->owner = NULL;
       pipe_ = NULL;
       // child_ is already NULL;
-      buf_ = "CreateProcess failed: The system cannot find the file "
-          "specified.\n";
+      const char kError[] = "CreateProcess failed: The system cannot find "
+          "the file specified.\n";
+      buf_.Append(kError, sizeof(kError) - 1);
       return true;
     } else {
       Win32Fatal("CreateProcess");    // pass all other errors to Win32Fatal
@@ -130,9 +201,12 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   }
 
   // Close pipe channel only used by the child.
-  if (child_pipe)
-    CloseHandle(child_pipe);
-  CloseHandle(nul);
+  CloseHandle(child_pipe);
+
+  // Only the command itself is in the job: the processes it starts break
+  // away silently, so that servers like mspdbsrv outlive the build.
+  if (set->job_)
+    AssignProcessToJobObject(set->job_, process_info.hProcess);
 
   CloseHandle(process_info.hThread);
   child_ = process_info.hProcess;
@@ -140,37 +214,6 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   return true;
 }
 
-void Subprocess::OnPipeReady() {
-  DWORD bytes;
-  if (!GetOverlappedResult(pipe_, &overlapped_, &bytes, TRUE)) {
-    if (GetLastError() == ERROR_BROKEN_PIPE) {
-      CloseHandle(pipe_);
-      pipe_ = NULL;
-      return;
-    }
-    Win32Fatal("GetOverlappedResult");
-  }
-
-  if (is_reading_ && bytes)
-    buf_.append(overlapped_buf_, bytes);
-
-  memset(&overlapped_, 0, sizeof(overlapped_));
-  is_reading_ = true;
-  if (!::ReadFile(pipe_, overlapped_buf_, sizeof(overlapped_buf_),
-                  &bytes, &overlapped_)) {
-    if (GetLastError() == ERROR_BROKEN_PIPE) {
-      CloseHandle(pipe_);
-      pipe_ = NULL;
-      return;
-    }
-    if (GetLastError() != ERROR_IO_PENDING)
-      Win32Fatal("ReadFile");
-  }
-
-  // Even if we read any bytes in the readfile call, we'll enter this
-  // function again later and get them at that point.
-}
-
 ExitStatus Subprocess::Finish() {
   if (!child_)
     return ExitFailure;
@@ -181,8 +224,25 @@ ExitStatus Subprocess::Finish() {
   DWORD exit_code = 0;
   GetExitCodeProcess(child_, &exit_code);
 
+  // FILETIMEs count 100ns intervals.
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (GetProcessTimes(child_, &creation_time, &exit_time, &kernel_time,
+                      &user_time)) {
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernel_time.dwLowDateTime;
+    kernel.HighPart = kernel_time.dwHighDateTime;
+    user.LowPart = user_time.dwLowDateTime;
+    user.HighPart = user_time.dwHighDateTime;
+    usage_.user_time_ms = (int)(user.QuadPart / 10000);
+    usage_.system_time_ms = (int)(kernel.QuadPart / 10000);
+  }
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(child_, &counters, sizeof(counters)))
+    usage_.max_rss_kb = (int)(counters.PeakWorkingSetSize / 1024);
+
   CloseHandle(child_);
   child_ = NULL;
+  exit_code_ = (int)exit_code;
 
   return exit_code == 0              ? ExitSuccess :
          exit_code == CONTROL_C_EXIT ? ExitInterrupted :
@@ -194,7 +254,11 @@ bool Subprocess::Done() const {
 }
 
 const string& Subprocess::GetOutput() const {
-  return buf_;
+  return buf_.output();
+}
+
+const ResourceUsage& Subprocess::GetResourceUsage() const {
+  return usage_;
 }
 
 HANDLE SubprocessSet::ioport_;
@@ -205,11 +269,59 @@ SubprocessSet::SubprocessSet() {
     Win32Fatal("CreateIoCompletionPort");
   if (!SetConsoleCtrlHandler(NotifyInterrupted, TRUE))
     Win32Fatal("SetConsoleCtrlHandler");
+
+  // Commands still running when ninja goes away, however it does, are
+  // killed with the job.  Without a job, e.g. if ninja's own job doesn't
+  // allow another one, commands just aren't in one.
+  job_ = CreateJobObjectA(NULL, NULL);
+  if (job_) {
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+    memset(&info, 0, sizeof(info));
+    info.BasicLimitInformation.LimitFlags =
+        JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE |
+        JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
+    if (!SetInformationJobObject(job_, JobObjectExtendedLimitInformation,
+                                 &info, sizeof(info))) {
+      CloseHandle(job_);
+      job_ = NULL;
+    }
+  }
+
+  SECURITY_ATTRIBUTES security_attributes;
+  memset(&security_attributes, 0, sizeof(SECURITY_ATTRIBUTES));
+  security_attributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+  security_attributes.bInheritHandle = TRUE;
+  // Must be inheritable so subprocesses can dup to children.
+  nul_ = CreateFileA("NUL", GENERIC_READ,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     &security_attributes, OPEN_EXISTING, 0, NULL);
+  if (nul_ == INVALID_HANDLE_VALUE)
+    Fatal("couldn't open nul");
 }
 
 SubprocessSet::~SubprocessSet() {
   Clear();
 
+  // Pipes still in use have a connection or read pending, which must be
+  // over before the pipe's buffers go away.  This thread issued all of
+  // them, so CancelIo() does; CancelIoEx() would need Vista, and MinGW
+  // builds target XP.
+  for (vector<SubprocessPipe*>::iterator i = pipes_.begin();
+       i != pipes_.end(); ++i) {
+    SubprocessPipe* pipe = *i;
+    if (find(free_pipes_.begin(), free_pipes_.end(), pipe) ==
+        free_pipes_.end()) {
+      DWORD bytes;
+      CancelIo(pipe->pipe);
+      GetOverlappedResult(pipe->pipe, &pipe->overlapped, &bytes, TRUE);
+    }
+    CloseHandle(pipe->pipe);
+    delete pipe;
+  }
+  CloseHandle(nul_);
+  if (job_)
+    CloseHandle(job_);
+
   SetConsoleCtrlHandler(NotifyInterrupted, FALSE);
   CloseHandle(ioport_);
 }
@@ -224,9 +336,11 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
-  Subprocess *subprocess = new Subprocess(use_console);
-  if (!subprocess->Start(this, command)) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_console,
+                               bool direct_exec, MemoryFile* file,
+                               const vector<int>* cpus) {
+  Subprocess *subprocess = new Subprocess(use_console, file);
+  if (!subprocess->Start(this, command, direct_exec, cpus)) {
     delete subprocess;
     return 0;
   }
@@ -237,30 +351,41 @@ Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
   return subprocess;
 }
 
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::DoWork(int timeout_ms) {
   DWORD bytes_read;
-  Subprocess* subproc;
+  SubprocessPipe* pipe;
   OVERLAPPED* overlapped;
 
-  if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
+  if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&pipe,
+                                 &overlapped,
+                                 timeout_ms < 0 ? INFINITE : timeout_ms)) {
+    if (!overlapped && GetLastError() == WAIT_TIMEOUT)
+      return false;
     if (GetLastError() != ERROR_BROKEN_PIPE)
       Win32Fatal("GetQueuedCompletionStatus");
   }
 
-  if (!subproc) // A NULL subproc indicates that we were interrupted and is
-                // delivered by NotifyInterrupted above.
+  if (!pipe) // A NULL pipe indicates that we were interrupted and is
+             // delivered by NotifyInterrupted above.
     return true;
 
-  subproc->OnPipeReady();
-
-  if (subproc->Done()) {
-    vector<Subprocess*>::iterator end =
-        remove(running_.begin(), running_.end(), subproc);
-    if (running_.end() != end) {
-      finished_.push(subproc);
-      running_.resize(end - running_.begin());
-    }
+  Subprocess* subproc = pipe->owner;
+  if (pipe->OnReady(subproc ? &subproc->buf_ : NULL))
+    return false;
+
+  // The child closed its end: the pipe is free for the next subprocess.
+  pipe->owner = NULL;
+  free_pipes_.push_back(pipe);
+  if (!subproc)
+    return false;
+  subproc->pipe_ = NULL;
+  subproc->buf_.Finish();
+
+  vector<Subprocess*>::iterator end =
+      remove(running_.begin(), running_.end(), subproc);
+  if (running_.end() != end) {
+    finished_.push(subproc);
+    running_.resize(end - running_.begin());
   }
 
   return false;
@@ -291,3 +416,26 @@ void SubprocessSet::Clear() {
     delete *i;
   running_.clear();
 }
+
+void SubprocessSet::Kill(Subprocess* subproc) {
+  vector<Subprocess*>::iterator i =
+      find(running_.begin(), running_.end(), subproc);
+  if (i != running_.end()) {
+    running_.erase(i);
+    // Windows keeps no zombies, so there is nothing to wait for: a process
+    // that is slow to terminate mustn't hold up the build.
+    if (subproc->child_) {
+      TerminateProcess(subproc->child_, 1);
+      CloseHandle(subproc->child_);
+      subproc->child_ = NULL;
+    }
+  } else {
+    queue<Subprocess*> finished;
+    for (; !finished_.empty(); finished_.pop()) {
+      if (finished_.front() != subproc)
+        finished.push(finished_.front());
+    }
+    finished_ = finished;
+  }
+  delete subproc;
+}
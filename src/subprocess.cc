@@ -0,0 +1,90 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "subprocess.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+void OutputBuffer::Append(const char* data, size_t size) {
+  if (!filter_) {
+    Store(data, size);
+    return;
+  }
+  filtered_.clear();
+  filter_->Filter(data, size, &filtered_);
+  Store(filtered_.data(), filtered_.size());
+}
+
+void OutputBuffer::Store(const char* data, size_t size) {
+  if (limit_ == 0 || (tail_.empty() && head_.size() + size <= limit_)) {
+    head_.append(data, size);
+    return;
+  }
+
+  // Past the limit, keep the first half as it is and only the last half of
+  // the rest.
+  size_t head_size = limit_ / 2;
+  if (tail_.empty()) {
+    if (head_.size() > head_size) {
+      tail_.assign(head_, head_size, string::npos);
+      head_.resize(head_size);
+    } else {
+      size_t len = min(head_size - head_.size(), size);
+      head_.append(data, len);
+      data += len;
+      size -= len;
+    }
+  }
+  tail_.append(data, size);
+  // Drop the old output in bulk, so that it isn't moved on every read.
+  size_t tail_size = limit_ - head_size;
+  if (tail_.size() > 2 * tail_size) {
+    elided_ += tail_.size() - tail_size;
+    tail_.erase(0, tail_.size() - tail_size);
+  }
+}
+
+void OutputBuffer::Finish() {
+  if (filter_) {
+    filtered_.clear();
+    filter_->Finish(&filtered_);
+    Store(filtered_.data(), filtered_.size());
+    string().swap(filtered_);
+  }
+
+  if (tail_.empty())
+    return;
+  size_t tail_size = limit_ - limit_ / 2;
+  if (tail_.size() > tail_size) {
+    elided_ += tail_.size() - tail_size;
+    tail_.erase(0, tail_.size() - tail_size);
+  }
+  // Start the tail on a line of its own.
+  string::size_type newline = tail_.find('\n');
+  if (newline != string::npos && newline + 1 < tail_.size()) {
+    elided_ += newline + 1;
+    tail_.erase(0, newline + 1);
+  }
+
+  if (!head_.empty() && head_[head_.size() - 1] != '\n')
+    head_ += '\n';
+  char note[64];
+  snprintf(note, sizeof(note), "[... %lu bytes of output omitted ...]\n",
+           (unsigned long)elided_);
+  head_ += note;
+  head_ += tail_;
+  string().swap(tail_);
+}
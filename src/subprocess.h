@@ -35,6 +35,81 @@ using namespace std;
 #endif
 
 #include "exit_status.h"
+#include "resource_usage.h"
+
+/// Looks at the output of a subprocess as it is read, and decides what of
+/// it to keep.
+struct OutputFilter {
+  virtual ~OutputFilter() {}
+  /// Append to |kept| what to keep of the next |size| bytes.
+  virtual void Filter(const char* data, size_t size, string* kept) = 0;
+  /// Append to |kept| what to keep of anything held back, once the output
+  /// is over.
+  virtual void Finish(string* kept) = 0;
+};
+
+/// Collects the output of a subprocess, keeping about |limit| bytes at most:
+/// past that, the beginning and the end are kept but the middle is dropped.
+struct OutputBuffer {
+  OutputBuffer() : limit_(0), elided_(0), filter_(NULL) {}
+  ~OutputBuffer() { delete filter_; }
+
+  /// Zero means no limit.  Only applies to what is appended afterwards.
+  void set_limit(size_t limit) { limit_ = limit; }
+
+  /// Pass the output through |filter|, which the buffer takes ownership of,
+  /// before it counts against the limit.
+  void set_filter(OutputFilter* filter) { filter_ = filter; }
+  OutputFilter* filter() const { return filter_; }
+
+  void Append(const char* data, size_t size);
+
+  /// Put the output together, once there's no more of it.
+  void Finish();
+
+  const string& output() const { return head_; }
+
+ private:
+  size_t limit_;
+  string head_;
+  /// The end of the output, once it's over the limit.
+  string tail_;
+  /// The number of bytes dropped from the tail.
+  size_t elided_;
+  OutputFilter* filter_;
+  /// What |filter_| kept of the last chunk.
+  string filtered_;
+
+  void Store(const char* data, size_t size);
+};
+
+/// A file in memory that a subprocess writes to at a path of its own,
+/// /dev/fd/N, rather than a file on disk that ninja reads back and deletes
+/// afterwards; used for depfiles.
+struct MemoryFile {
+  MemoryFile() : fd_(-1), child_fd_(-1) {}
+  ~MemoryFile();
+
+  /// Create the file.  Returns false where files in memory aren't
+  /// supported, which is everywhere but Linux.
+  bool Create();
+
+  /// The path the subprocess writes the file at.
+  const string& path() const { return path_; }
+
+  /// Read what the subprocess wrote into |content|.  Returns false on error.
+  bool Read(string* content) const;
+
+ private:
+  int fd_;
+  /// The descriptor the file gets in the subprocess, held open by ninja
+  /// until the subprocess is spawned so that it can't be one the subprocess
+  /// inherits for something else.
+  int child_fd_;
+  string path_;
+
+  friend struct Subprocess;
+};
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
@@ -51,26 +126,61 @@ struct Subprocess {
 
   const string& GetOutput() const;
 
+  /// Resources used by the process, valid once Finish() has returned.
+  const ResourceUsage& GetResourceUsage() const;
+
+  /// The exit code of the process once Finish() has returned, or -1 if it
+  /// was killed by a signal.
+  int GetExitCode() const { return exit_code_; }
+
+  /// Keep at most about |limit| bytes of output, or all of it if zero.
+  void SetOutputLimit(size_t limit) { buf_.set_limit(limit); }
+
+  /// Pass the output through |filter| as it is read; the subprocess owns it.
+  void SetOutputFilter(OutputFilter* filter) { buf_.set_filter(filter); }
+  OutputFilter* GetOutputFilter() const { return buf_.filter(); }
+
+  /// The file in memory that was made available to the process, if any.
+  const MemoryFile* GetMemoryFile() const { return file_; }
+
+#ifndef _WIN32
+  /// Split |command| into the arguments of the program it runs, if running
+  /// it through /bin/sh would make no difference: it has no quoting,
+  /// expansions, redirections, globs or control operators, and doesn't
+  /// start with a variable assignment or a shell builtin.
+  static bool SplitCommand(const string& command, vector<string>* args);
+#endif
+
  private:
-  Subprocess(bool use_console);
-  bool Start(struct SubprocessSet* set, const string& command);
+  Subprocess(bool use_console, MemoryFile* file);
+  bool Start(struct SubprocessSet* set, const string& command,
+             bool direct_exec, const vector<int>* cpus);
   void OnPipeReady();
 
-  string buf_;
+  OutputBuffer buf_;
+  MemoryFile* file_;
+  ResourceUsage usage_;
+  int exit_code_;
 
 #ifdef _WIN32
-  /// Set up pipe_ as the parent-side pipe of the subprocess; return the
-  /// other end of the pipe, usable in the child process.
-  HANDLE SetupPipe(HANDLE ioport);
+  /// Take pipe_ from the pool of |set| as the parent-side pipe of the
+  /// subprocess; return the other end of the pipe, usable in the child
+  /// process.
+  HANDLE SetupPipe(struct SubprocessSet* set);
 
   HANDLE child_;
-  HANDLE pipe_;
-  OVERLAPPED overlapped_;
-  char overlapped_buf_[4 << 10];
-  bool is_reading_;
+  /// The pipe the output is read from until the child closes it.
+  struct SubprocessPipe* pipe_;
 #else
+  /// Close the pipe from the child.
+  void ClosePipe();
+
   int fd_;
   pid_t pid_;
+#ifdef USE_EPOLL
+  /// The epoll set of the SubprocessSet that the pipe is registered with.
+  int epoll_fd_;
+#endif
 #endif
   bool use_console_;
 
@@ -84,10 +194,24 @@ struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
-  Subprocess* Add(const string& command, bool use_console = false);
-  bool DoWork();
+  /// Start running |command|.  If |direct_exec|, a command that needs
+  /// nothing from the shell is run without it (not on Windows, which never
+  /// uses one).  |file|, if not NULL, is a MemoryFile::Create()d file
+  /// that the subprocess takes ownership of and can write at its path().
+  /// |cpus|, if not NULL or empty, are the processors the subprocess may
+  /// run on (only on Linux).
+  Subprocess* Add(const string& command, bool use_console = false,
+                  bool direct_exec = false, MemoryFile* file = NULL,
+                  const vector<int>* cpus = NULL);
+  /// Wait for a state change, or for |timeout_ms| milliseconds at most if
+  /// it isn't negative.  Returns true if interrupted.
+  bool DoWork(int timeout_ms = -1);
   Subprocess* NextFinished();
   void Clear();
+  /// Stop |subproc|, running or finished and not returned by NextFinished()
+  /// yet, and delete it.  A running one isn't waited for: DoWork() reaps it
+  /// once it has exited.
+  void Kill(Subprocess* subproc);
 
   vector<Subprocess*> running_;
   queue<Subprocess*> finished_;
@@ -95,6 +219,17 @@ struct SubprocessSet {
 #ifdef _WIN32
   static BOOL WINAPI NotifyInterrupted(DWORD dwCtrlType);
   static HANDLE ioport_;
+  /// All the pipes, each registered with ioport_ once, and those of them
+  /// that no subprocess uses; see SubprocessPipe.
+  vector<struct SubprocessPipe*> pipes_;
+  vector<struct SubprocessPipe*> free_pipes_;
+  /// The job that the subprocesses are assigned to, so that they are killed
+  /// when ninja exits, or NULL.
+  HANDLE job_;
+  /// An inheritable handle of NUL, the standard input of the subprocesses.
+  HANDLE nul_;
+  /// The command being started, converted for CreateProcessW().
+  vector<wchar_t> wide_command_;
 #else
   static void SetInterruptedFlag(int signum);
   static void HandlePendingInterruption();
@@ -104,10 +239,22 @@ struct SubprocessSet {
 
   static bool IsInterrupted() { return interrupted_ != 0; }
 
+  /// Reap and delete those of killed_ that have exited.
+  void ReapKilled();
+
+  /// The subprocesses that Kill() stopped, to reap once they exit, since
+  /// the one stuck in the kernel or ignoring signals is what gets killed.
+  vector<Subprocess*> killed_;
+
   struct sigaction old_int_act_;
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
   sigset_t old_mask_;
+#ifdef USE_EPOLL
+  /// The pipes of the running subprocesses are registered once, so that
+  /// DoWork() only ever looks at the ones that have something to read.
+  int epoll_fd_;
+#endif
 #endif
 };
 
@@ -0,0 +1,106 @@
+// Copyright 2018 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+
+#include "metrics.h"
+#include "subprocess.h"
+#include "util.h"
+
+// Measures how many trivial commands a SubprocessSet starts and reaps per
+// second, and how long each takes from Add() to NextFinished(), at a few
+// levels of parallelism.  Outside of Windows, commands are run both
+// directly and through /bin/sh.  Which of epoll, ppoll and pselect waits
+// for them is chosen when building; configure.py --force-pselect builds
+// with pselect.
+
+namespace {
+
+#ifdef _WIN32
+const char kCommand[] = "cmd /c exit 0";
+const char kBackend[] = "IOCP";
+#else
+const char kCommand[] = "true";
+#if defined(USE_EPOLL)
+const char kBackend[] = "epoll";
+#elif defined(USE_PPOLL)
+const char kBackend[] = "ppoll";
+#else
+const char kBackend[] = "pselect";
+#endif
+#endif
+
+const int kParallelism[] = { 1, 4, 16, 64 };
+
+/// Run |count| commands, |parallelism| of them at a time.
+void Run(int count, int parallelism, bool direct_exec) {
+  SubprocessSet subprocs;
+  map<Subprocess*, double> started;
+  Metric latency("latency", false);
+  Stopwatch stopwatch;
+  stopwatch.Restart();
+  int added = 0, reaped = 0;
+  while (reaped < count) {
+    while (added < count && (int)subprocs.running_.size() < parallelism) {
+      Subprocess* subproc = subprocs.Add(kCommand, false, direct_exec);
+      if (!subproc)
+        Fatal("couldn't start '%s'", kCommand);
+      started[subproc] = stopwatch.Elapsed();
+      ++added;
+    }
+    subprocs.DoWork();
+    while (Subprocess* subproc = subprocs.NextFinished()) {
+      if (subproc->Finish() != ExitSuccess)
+        Fatal("'%s' failed", kCommand);
+      latency.Add((int64_t)((stopwatch.Elapsed() - started[subproc]) * 1e6));
+      started.erase(subproc);
+      delete subproc;
+      ++reaped;
+    }
+  }
+  double elapsed = stopwatch.Elapsed();
+
+  printf("%-6s  -j%-3d  %6d commands/s  latency (us) p50 %6lld  p99 %6lld"
+         "  max %6lld\n",
+         direct_exec ? "direct" : "shell", parallelism, (int)(count / elapsed),
+         (long long)latency.Percentile(0.5),
+         (long long)latency.Percentile(0.99), (long long)latency.max);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  int count = 2000;
+  if (argc > 1)
+    count = atoi(argv[1]);
+  if (count <= 0) {
+    fprintf(stderr, "usage: subprocess_perftest [COMMANDS]\n");
+    return 1;
+  }
+
+  printf("%d runs of '%s' each, waiting with %s\n", count, kCommand,
+         kBackend);
+  const size_t kLevels = sizeof(kParallelism) / sizeof(kParallelism[0]);
+  for (size_t i = 0; i < kLevels; ++i) {
+#ifndef _WIN32
+    Run(count, kParallelism[i], true);
+#endif
+    Run(count, kParallelism[i], false);
+  }
+  return 0;
+}
@@ -14,6 +14,7 @@
 
 #include "subprocess.h"
 
+#include "metrics.h"
 #include "test.h"
 
 #ifndef _WIN32
@@ -36,8 +37,71 @@ struct SubprocessTest : public testing::Test {
   SubprocessSet subprocs_;
 };
 
+/// Drops every 'x', and adds a '!' at the end.
+struct DropXFilter : public OutputFilter {
+  virtual void Filter(const char* data, size_t size, string* kept) {
+    for (size_t i = 0; i < size; ++i) {
+      if (data[i] != 'x')
+        kept->push_back(data[i]);
+    }
+  }
+  virtual void Finish(string* kept) { kept->push_back('!'); }
+};
+
 }  // anonymous namespace
 
+TEST(OutputBufferTest, KeepsHeadAndTail) {
+  OutputBuffer unlimited;
+  unlimited.Append("abc", 3);
+  unlimited.Append("def", 3);
+  unlimited.Finish();
+  EXPECT_EQ("abcdef", unlimited.output());
+
+  OutputBuffer buffer;
+  buffer.set_limit(20);
+  buffer.Append("0123456789", 10);
+  buffer.Append("0123456789", 10);
+  buffer.Finish();
+  // Up to the limit, everything is kept.
+  EXPECT_EQ("01234567890123456789", buffer.output());
+
+  OutputBuffer noisy;
+  noisy.set_limit(20);
+  noisy.Append("head line\n", 10);
+  for (int i = 0; i < 1000; ++i)
+    noisy.Append("warning\n", 8);
+  noisy.Append("tail\n", 5);
+  noisy.Finish();
+  EXPECT_EQ("head line\n"
+            "[... 8000 bytes of output omitted ...]\n"
+            "tail\n", noisy.output());
+
+  // A single read can go over the limit too.
+  string lines;
+  for (int i = 0; i < 10; ++i)
+    lines += "line ";
+  OutputBuffer big;
+  big.set_limit(20);
+  big.Append(lines.data(), lines.size());
+  big.Finish();
+  EXPECT_EQ("line line \n"
+            "[... 30 bytes of output omitted ...]\n"
+            "line line ", big.output());
+}
+
+TEST(OutputBufferTest, Filter) {
+  OutputBuffer buffer;
+  buffer.set_limit(20);
+  buffer.set_filter(new DropXFilter);
+  buffer.Append("ab", 2);
+  // What the filter drops doesn't count against the limit.
+  string xs(1000, 'x');
+  buffer.Append(xs.data(), xs.size());
+  buffer.Append("cxd", 3);
+  buffer.Finish();
+  EXPECT_EQ("abcd!", buffer.output());
+}
+
 // Run a command that fails and emits to stderr.
 TEST_F(SubprocessTest, BadCommandStderr) {
   Subprocess* subproc = subprocs_.Add("cmd /c ninja_no_such_command");
@@ -52,6 +116,21 @@ TEST_F(SubprocessTest, BadCommandStderr) {
   EXPECT_NE("", subproc->GetOutput());
 }
 
+TEST_F(SubprocessTest, ExitCode) {
+#ifdef _WIN32
+  Subprocess* subproc = subprocs_.Add("cmd /c exit 75");
+#else
+  Subprocess* subproc = subprocs_.Add("exit 75");
+#endif
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  while (!subproc->Done())
+    subprocs_.DoWork();
+
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+  EXPECT_EQ(75, subproc->GetExitCode());
+}
+
 // Run a command that does not exist
 TEST_F(SubprocessTest, NoSuchCommand) {
   Subprocess* subproc = subprocs_.Add("ninja_no_such_command");
@@ -70,6 +149,40 @@ TEST_F(SubprocessTest, NoSuchCommand) {
 #endif
 }
 
+TEST_F(SubprocessTest, ResourceUsage) {
+  Subprocess* subproc = subprocs_.Add(kSimpleCommand);
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  // Any process needs some memory; CPU times may well round down to zero.
+  EXPECT_GT(subproc->GetResourceUsage().max_rss_kb, 0);
+  EXPECT_GE(subproc->GetResourceUsage().user_time_ms, 0);
+  EXPECT_GE(subproc->GetResourceUsage().system_time_ms, 0);
+}
+
+// Run commands one after the other, each with its own output.
+TEST_F(SubprocessTest, OneAfterAnother) {
+  for (int i = 0; i < 3; ++i) {
+    Subprocess* subproc = subprocs_.Add(kSimpleCommand);
+    ASSERT_NE((Subprocess *) 0, subproc);
+
+    while (!subproc->Done())
+      subprocs_.DoWork();
+
+    EXPECT_EQ(ExitSuccess, subproc->Finish());
+    EXPECT_NE("", subproc->GetOutput());
+    delete subprocs_.NextFinished();
+  }
+#ifdef _WIN32
+  // The pipe of the first command is used for the others.
+  EXPECT_EQ(1u, subprocs_.pipes_.size());
+#endif
+}
+
 #ifndef _WIN32
 
 TEST_F(SubprocessTest, InterruptChild) {
@@ -174,6 +287,52 @@ TEST_F(SubprocessTest, SetWithSingle) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 
+#ifndef _WIN32
+// DoWork() gives up after the timeout, and a subprocess can be killed
+// without waiting for it to finish.
+TEST_F(SubprocessTest, TimeoutAndKill) {
+  Subprocess* slow = subprocs_.Add("sleep 10");
+  Subprocess* fast = subprocs_.Add("true");
+  ASSERT_NE((Subprocess *) 0, slow);
+  ASSERT_NE((Subprocess *) 0, fast);
+
+  while (!fast->Done())
+    ASSERT_FALSE(subprocs_.DoWork(10));
+  EXPECT_FALSE(subprocs_.DoWork(10));
+  EXPECT_FALSE(slow->Done());
+  ASSERT_EQ(fast, subprocs_.NextFinished());
+  EXPECT_EQ(ExitSuccess, fast->Finish());
+  delete fast;
+
+  int64_t start = GetTimeMillis();
+  subprocs_.Kill(slow);
+  EXPECT_LT(GetTimeMillis() - start, 5000);
+  EXPECT_EQ(0u, subprocs_.running_.size());
+  EXPECT_EQ((Subprocess*)0, subprocs_.NextFinished());
+}
+
+TEST_F(SubprocessTest, KillDoesntWait) {
+  Subprocess* stubborn = subprocs_.Add("trap '' TERM; sleep 10; sleep 10");
+  Subprocess* fast = subprocs_.Add("sleep 0.2");
+  ASSERT_NE((Subprocess *) 0, stubborn);
+  ASSERT_NE((Subprocess *) 0, fast);
+
+  int64_t start = GetTimeMillis();
+  subprocs_.Kill(stubborn);
+  EXPECT_LT(GetTimeMillis() - start, 5000);
+  ASSERT_EQ(1u, subprocs_.killed_.size());
+
+  // It is reaped as the others are waited for.
+  while (!fast->Done())
+    ASSERT_FALSE(subprocs_.DoWork());
+  EXPECT_FALSE(subprocs_.DoWork(10));
+  EXPECT_EQ(0u, subprocs_.killed_.size());
+  ASSERT_EQ(fast, subprocs_.NextFinished());
+  EXPECT_EQ(ExitSuccess, fast->Finish());
+  delete fast;
+}
+#endif  // _WIN32
+
 TEST_F(SubprocessTest, SetWithMulti) {
   Subprocess* processes[3];
   const char* kCommands[3] = {
@@ -258,4 +417,70 @@ TEST_F(SubprocessTest, ReadStdin) {
   ASSERT_EQ(ExitSuccess, subproc->Finish());
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
+
+TEST_F(SubprocessTest, SplitCommand) {
+  vector<string> args;
+  EXPECT_TRUE(Subprocess::SplitCommand("cc  -c foo.c -o out/foo.o -DX=1",
+                                       &args));
+  ASSERT_EQ(6u, args.size());
+  EXPECT_EQ("cc", args[0]);
+  EXPECT_EQ("foo.c", args[2]);
+  EXPECT_EQ("-DX=1", args[5]);
+
+  EXPECT_FALSE(Subprocess::SplitCommand("", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cc -c 'foo bar.c'", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cc -c $SRC", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cc -c *.c", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cc -c foo.c > log", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cc -c foo.c && touch stamp",
+                                        &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("cd out", &args));
+  EXPECT_FALSE(Subprocess::SplitCommand("CC=gcc make", &args));
+}
+
+// Direct execution behaves like the shell, other than not starting it.
+TEST_F(SubprocessTest, DirectExec) {
+  Subprocess* subproc = subprocs_.Add("echo  hello   world", false, true);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("hello world\n", subproc->GetOutput());
+
+  // The shell reports the programs it can't find.
+  subproc = subprocs_.Add("ninja_no_such_command", false, true);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+  EXPECT_NE("", subproc->GetOutput());
+
+  // Commands that need it still go through it.
+  subproc = subprocs_.Add("echo $((1 + 2))", false, true);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("3\n", subproc->GetOutput());
+}
+
+// A subprocess can write a file in memory for ninja to read back.
+TEST_F(SubprocessTest, MemoryFile) {
+  MemoryFile* file = new MemoryFile;
+  if (!file->Create()) {
+    delete file;
+    return;  // Not supported here.
+  }
+  string command = "echo out: in > " + file->path();
+  Subprocess* subproc = subprocs_.Add(command, false, false, file);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("", subproc->GetOutput());
+
+  string content;
+  ASSERT_TRUE(subproc->GetMemoryFile()->Read(&content));
+  EXPECT_EQ("out: in\n", content);
+}
 #endif  // _WIN32
@@ -116,7 +116,7 @@ void VerifyGraph(const State& state) {
     // Check that the edge's inputs have the edge as out-edge.
     for (vector<Node*>::const_iterator in_node = (*e)->inputs_.begin();
          in_node != (*e)->inputs_.end(); ++in_node) {
-      const vector<Edge*>& out_edges = (*in_node)->out_edges();
+      EdgeSpan out_edges = (*in_node)->out_edges();
       EXPECT_NE(find(out_edges.begin(), out_edges.end(), *e),
                 out_edges.end());
     }
@@ -166,6 +166,23 @@ bool VirtualFileSystem::MakeDir(const string& path) {
   return true;  // success
 }
 
+bool VirtualFileSystem::SetMTime(const string& path, TimeStamp mtime) {
+  FileMap::iterator i = files_.find(path);
+  if (i == files_.end())
+    return false;
+  i->second.mtime = (int)mtime;
+  return true;
+}
+
+bool VirtualFileSystem::CloneFile(const string& from, const string& to) {
+  FileMap::iterator i = files_.find(from);
+  if (i == files_.end())
+    return false;
+  string contents = i->second.contents;
+  Create(to, contents);
+  return true;
+}
+
 FileReader::Status VirtualFileSystem::ReadFile(const string& path,
                                                string* contents,
                                                string* err) {
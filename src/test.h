@@ -145,6 +145,8 @@ struct VirtualFileSystem : public DiskInterface {
 
   // DiskInterface
   virtual TimeStamp Stat(const string& path, string* err) const;
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  virtual bool CloneFile(const string& from, const string& to);
   virtual bool WriteFile(const string& path, const string& contents);
   virtual bool MakeDir(const string& path);
   virtual Status ReadFile(const string& path, string* contents, string* err);
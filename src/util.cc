@@ -34,12 +34,24 @@
 #include <sys/types.h>
 
 #ifndef _WIN32
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #endif
 
+#include <algorithm>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CANONICALIZE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CANONICALIZE_NEON
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #elif defined(__SVR4) && defined(__sun)
@@ -50,6 +62,9 @@
 #elif defined(linux) || defined(__GLIBC__)
 #include <sys/sysinfo.h>
 #endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
 
 #include "edit_distance.h"
 #include "metrics.h"
@@ -110,6 +125,73 @@ static bool IsPathSeparator(char c) {
 #endif
 }
 
+#if defined(CANONICALIZE_SSE2) || defined(CANONICALIZE_NEON)
+/// Find the '/' and the '.' in the 16 bytes at |p|, one bit per byte, and
+/// whether there is any '\\'.
+static inline void FindSeparatorsAndDots(const char* p, unsigned* slashes,
+                                         unsigned* dots, bool* backslashes) {
+#ifdef CANONICALIZE_SSE2
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  *slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+  *dots = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+  *backslashes =
+      _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) != 0;
+#else
+  static const uint8_t kBits[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+  };
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+  uint8x16_t bits = vld1q_u8(kBits);
+  uint8x16_t s = vandq_u8(vceqq_u8(v, vdupq_n_u8('/')), bits);
+  uint8x16_t d = vandq_u8(vceqq_u8(v, vdupq_n_u8('.')), bits);
+  *slashes = vaddv_u8(vget_low_u8(s)) | (vaddv_u8(vget_high_u8(s)) << 8);
+  *dots = vaddv_u8(vget_low_u8(d)) | (vaddv_u8(vget_high_u8(d)) << 8);
+  *backslashes = vmaxvq_u8(vceqq_u8(v, vdupq_n_u8('\\'))) != 0;
+#endif
+}
+
+/// Whether CanonicalizePath() would leave |path| as it is, with no slash
+/// bits: it has no '.' component, no '..' one past the leading ones, no
+/// empty one, no trailing separator and no backslash.  Looks at 16 bytes
+/// at a time, and may say no for a few canonical paths, e.g. those with a
+/// component starting with a dot.
+static bool IsCanonical(const char* path, size_t len) {
+  const char* p = path;
+  const char* end = path + len;
+  if (end[-1] == '/')
+    return false;
+  if (*p == '/')
+    ++p;
+  while (end - p > 3 && p[0] == '.' && p[1] == '.' && p[2] == '/')
+    p += 3;
+
+  // A component starts at |p| and after every separator.  One that starts
+  // with a separator is empty, and one that starts with a dot may be '.'
+  // or '..'.
+  unsigned starts = 1;
+  while (p < end) {
+    char padded[16];
+    const char* block = p;
+    if (end - p < 16) {
+      memset(padded, 0, sizeof(padded));
+      memcpy(padded, p, end - p);
+      block = padded;
+    }
+    unsigned slashes, dots;
+    bool backslashes;
+    FindSeparatorsAndDots(block, &slashes, &dots, &backslashes);
+    if (backslashes)
+      return false;
+    starts |= slashes << 1;
+    if ((starts & (slashes | dots)) & 0xffff)
+      return false;
+    starts >>= 16;
+    p += 16;
+  }
+  return true;
+}
+#endif
+
 bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
                       string* err) {
   // WARNING: this function is performance-critical; please benchmark
@@ -120,6 +202,14 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
     return false;
   }
 
+#if defined(CANONICALIZE_SSE2) || defined(CANONICALIZE_NEON)
+  // Nearly every path in a generated manifest is canonical already.
+  if (IsCanonical(path, *len)) {
+    *slash_bits = 0;
+    return true;
+  }
+#endif
+
   const int kMaxPathComponents = 60;
   char* components[kMaxPathComponents];
   int component_count = 0;
@@ -237,25 +327,25 @@ static inline bool IsKnownWin32SafeCharacter(char ch) {
   }
 }
 
-static inline bool StringNeedsShellEscaping(const string& input) {
+static inline bool StringNeedsShellEscaping(StringPiece input) {
   for (size_t i = 0; i < input.size(); ++i) {
     if (!IsKnownShellSafeCharacter(input[i])) return true;
   }
   return false;
 }
 
-static inline bool StringNeedsWin32Escaping(const string& input) {
+static inline bool StringNeedsWin32Escaping(StringPiece input) {
   for (size_t i = 0; i < input.size(); ++i) {
     if (!IsKnownWin32SafeCharacter(input[i])) return true;
   }
   return false;
 }
 
-void GetShellEscapedString(const string& input, string* result) {
+void GetShellEscapedString(StringPiece input, string* result) {
   assert(result);
 
   if (!StringNeedsShellEscaping(input)) {
-    result->append(input);
+    result->append(input.str_, input.len_);
     return;
   }
 
@@ -264,9 +354,8 @@ void GetShellEscapedString(const string& input, string* result) {
 
   result->push_back(kQuote);
 
-  string::const_iterator span_begin = input.begin();
-  for (string::const_iterator it = input.begin(), end = input.end(); it != end;
-       ++it) {
+  const char* span_begin = input.begin();
+  for (const char* it = input.begin(), *end = input.end(); it != end; ++it) {
     if (*it == kQuote) {
       result->append(span_begin, it);
       result->append(kEscapeSequence);
@@ -278,10 +367,10 @@ void GetShellEscapedString(const string& input, string* result) {
 }
 
 
-void GetWin32EscapedString(const string& input, string* result) {
+void GetWin32EscapedString(StringPiece input, string* result) {
   assert(result);
   if (!StringNeedsWin32Escaping(input)) {
-    result->append(input);
+    result->append(input.str_, input.len_);
     return;
   }
 
@@ -290,9 +379,8 @@ void GetWin32EscapedString(const string& input, string* result) {
 
   result->push_back(kQuote);
   size_t consecutive_backslash_count = 0;
-  string::const_iterator span_begin = input.begin();
-  for (string::const_iterator it = input.begin(), end = input.end(); it != end;
-       ++it) {
+  const char* span_begin = input.begin();
+  for (const char* it = input.begin(), *end = input.end(); it != end; ++it) {
     switch (*it) {
       case kBackslash:
         ++consecutive_backslash_count;
@@ -372,6 +460,103 @@ int ReadFile(const string& path, string* contents, string* err) {
 #endif
 }
 
+int MappedFile::Map(const string& path, string* err) {
+  Unmap();
+#ifdef _WIN32
+  HANDLE f = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (f == INVALID_HANDLE_VALUE) {
+    DWORD error = GetLastError();
+    err->assign(GetLastErrorString());
+    return error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND ?
+        -ENOENT : -1;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(f, &size)) {
+    err->assign(GetLastErrorString());
+    ::CloseHandle(f);
+    return -1;
+  }
+  size_ = (size_t)size.QuadPart;
+  if (size_ == 0) {
+    // Empty files can't be mapped.
+    ::CloseHandle(f);
+    data_ = "";
+    return 0;
+  }
+  HANDLE mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping)
+    data_ = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data_)
+    err->assign(GetLastErrorString());
+  // The view keeps the file mapped.
+  if (mapping)
+    ::CloseHandle(mapping);
+  ::CloseHandle(f);
+  if (!data_) {
+    size_ = 0;
+    return -1;
+  }
+  return 0;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err->assign(strerror(errno));
+    close(fd);
+    return -errno;
+  }
+  size_ = st.st_size;
+  if (size_ == 0) {
+    // Empty files can't be mapped.
+    close(fd);
+    data_ = "";
+    return 0;
+  }
+  void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  int mmap_errno = errno;
+  close(fd);  // The mapping keeps the file open.
+  if (data == MAP_FAILED) {
+    err->assign(strerror(mmap_errno));
+    size_ = 0;
+    return -mmap_errno;
+  }
+  data_ = (const char*)data;
+  return 0;
+#endif
+}
+
+bool MappedFile::nul_terminated() const {
+  if (!data_)
+    return false;
+  if (size_ == 0)
+    return true;  // The empty string.
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  size_t page_size = info.dwPageSize;
+#else
+  size_t page_size = sysconf(_SC_PAGESIZE);
+#endif
+  return size_ % page_size != 0;
+}
+
+void MappedFile::Unmap() {
+  if (data_ && size_ > 0) {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap((void*)data_, size_);
+#endif
+  }
+  data_ = NULL;
+  size_ = 0;
+}
+
 void SetCloseOnExec(int fd) {
 #ifndef _WIN32
   int flags = fcntl(fd, F_GETFD);
@@ -580,6 +765,332 @@ double GetLoadAverage() {
 }
 #endif // _WIN32
 
+#ifdef _WIN32
+int64_t GetAvailableMemory() {
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status))
+    return -1;
+  return status.ullAvailPhys;
+}
+#elif defined(linux) || defined(__GLIBC__)
+int64_t GetAvailableMemory() {
+  // Unlike sysinfo()'s freeram, MemAvailable counts the page cache that
+  // can be reclaimed.
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (!f)
+    return -1;
+  char line[256];
+  long long available_kb = -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "MemAvailable: %lld kB", &available_kb) == 1)
+      break;
+  }
+  fclose(f);
+  return available_kb < 0 ? -1 : available_kb * 1024;
+}
+#else
+int64_t GetAvailableMemory() {
+  return -1;
+}
+#endif // _WIN32
+
+#if defined(linux) || defined(__GLIBC__)
+double GetPressureStall() {
+  const char* const kFiles[] = {
+    "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+  };
+  double pressure = -1.0;
+  for (size_t i = 0; i < sizeof(kFiles) / sizeof(kFiles[0]); ++i) {
+    FILE* f = fopen(kFiles[i], "r");
+    if (!f)
+      continue;
+    double avg10;
+    if (fscanf(f, "some avg10=%lf", &avg10) == 1 && avg10 > pressure)
+      pressure = avg10;
+    fclose(f);
+  }
+  return pressure;
+}
+#else
+double GetPressureStall() {
+  return -1.0;
+}
+#endif
+
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  cpus->clear();
+  const char* p = list.c_str();
+  while (*p && *p != '\n') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      return false;
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first || last - first > 1 << 16)
+        return false;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus->push_back((int)cpu);
+    if (*p == ',')
+      ++p;
+    else if (*p && *p != '\n')
+      return false;
+  }
+  sort(cpus->begin(), cpus->end());
+  cpus->erase(unique(cpus->begin(), cpus->end()), cpus->end());
+  return !cpus->empty();
+}
+
+#if defined(linux) || defined(__GLIBC__)
+vector<vector<int> > GetNumaNodeCpus() {
+  vector<vector<int> > nodes;
+  for (int node = 0; ; ++node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE* f = fopen(path, "r");
+    if (!f)
+      break;
+    char buf[4096];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+    // A node may have memory but no processors.
+    vector<int> cpus;
+    if (ParseCpuList(buf, &cpus))
+      nodes.push_back(cpus);
+  }
+  return nodes;
+}
+#else
+vector<vector<int> > GetNumaNodeCpus() {
+  return vector<vector<int> >();
+}
+#endif
+
+/// The share of busy ticks between two readings of the processors' idle and
+/// total tick counts, keeping the last one in |previous_idle| and
+/// |previous_total|.
+static double UtilizationSince(uint64_t idle, uint64_t total,
+                               uint64_t* previous_idle,
+                               uint64_t* previous_total) {
+  double utilization = -1.0;
+  if (*previous_total != 0 && total > *previous_total) {
+    uint64_t idle_delta = idle - *previous_idle;
+    uint64_t total_delta = total - *previous_total;
+    utilization = 100.0 * (1.0 - (double)idle_delta / total_delta);
+  }
+  *previous_idle = idle;
+  *previous_total = total;
+  return utilization;
+}
+
+#ifdef _WIN32
+double GetCpuUtilization() {
+  static uint64_t previous_idle = 0;
+  static uint64_t previous_total = 0;
+  FILETIME idle_time, kernel_time, user_time;
+  if (!GetSystemTimes(&idle_time, &kernel_time, &user_time))
+    return -1.0;
+  // kernel_time from GetSystemTimes already includes idle_time.
+  return UtilizationSince(
+      FileTimeToTickCount(idle_time),
+      FileTimeToTickCount(kernel_time) + FileTimeToTickCount(user_time),
+      &previous_idle, &previous_total);
+}
+#elif defined(__APPLE__)
+double GetCpuUtilization() {
+  static uint64_t previous_idle = 0;
+  static uint64_t previous_total = 0;
+  host_cpu_load_info_data_t info;
+  mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+  if (host_statistics(mach_host_self(), HOST_CPU_LOAD_INFO,
+                      (host_info_t)&info, &count) != KERN_SUCCESS) {
+    return -1.0;
+  }
+  uint64_t total = 0;
+  for (int i = 0; i < CPU_STATE_MAX; ++i)
+    total += info.cpu_ticks[i];
+  return UtilizationSince(info.cpu_ticks[CPU_STATE_IDLE], total,
+                          &previous_idle, &previous_total);
+}
+#elif defined(linux) || defined(__GLIBC__)
+double GetCpuUtilization() {
+  static uint64_t previous_idle = 0;
+  static uint64_t previous_total = 0;
+  FILE* f = fopen("/proc/stat", "r");
+  if (!f)
+    return -1.0;
+  unsigned long long ticks[8];
+  int fields = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                      &ticks[0], &ticks[1], &ticks[2], &ticks[3], &ticks[4],
+                      &ticks[5], &ticks[6], &ticks[7]);
+  fclose(f);
+  if (fields < 4)
+    return -1.0;
+  uint64_t total = 0;
+  for (int i = 0; i < fields; ++i)
+    total += ticks[i];
+  // Waiting for I/O is idle time too.
+  uint64_t idle = ticks[3] + (fields > 4 ? ticks[4] : 0);
+  return UtilizationSince(idle, total, &previous_idle, &previous_total);
+}
+#else
+double GetCpuUtilization() {
+  return -1.0;
+}
+#endif
+
+namespace {
+
+/// State shared by the threads of a ParallelFor() call.  Indices are handed
+/// out in chunks to keep the lock cold.
+struct ParallelForState {
+  size_t count;
+  size_t next;
+  void (*func)(void* arg, size_t index);
+  void* arg;
+#ifdef _WIN32
+  CRITICAL_SECTION lock;
+#else
+  pthread_mutex_t lock;
+#endif
+
+  /// Claim the next chunk of indices; returns false once all are taken.
+  bool NextChunk(size_t* begin, size_t* end) {
+    const size_t kChunkSize = 16;
+#ifdef _WIN32
+    EnterCriticalSection(&lock);
+#else
+    pthread_mutex_lock(&lock);
+#endif
+    *begin = next;
+    next = min(count, next + kChunkSize);
+    *end = next;
+#ifdef _WIN32
+    LeaveCriticalSection(&lock);
+#else
+    pthread_mutex_unlock(&lock);
+#endif
+    return *begin < *end;
+  }
+
+  void Run() {
+    size_t begin, end;
+    while (NextChunk(&begin, &end)) {
+      for (size_t i = begin; i < end; ++i)
+        func(arg, i);
+    }
+  }
+};
+
+#ifdef _WIN32
+DWORD WINAPI ParallelForThread(void* state) {
+  static_cast<ParallelForState*>(state)->Run();
+  return 0;
+}
+#else
+void* ParallelForThread(void* state) {
+  static_cast<ParallelForState*>(state)->Run();
+  return NULL;
+}
+#endif
+
+}  // anonymous namespace
+
+void ParallelFor(size_t count, int threads,
+                 void (*func)(void* arg, size_t index), void* arg) {
+  if (threads <= 1 || count <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      func(arg, i);
+    return;
+  }
+
+  ParallelForState state;
+  state.count = count;
+  state.next = 0;
+  state.func = func;
+  state.arg = arg;
+
+  // The calling thread does its share of the work too.
+#ifdef _WIN32
+  InitializeCriticalSection(&state.lock);
+  vector<HANDLE> handles;
+  for (int i = 1; i < threads; ++i) {
+    HANDLE handle = CreateThread(NULL, 0, ParallelForThread, &state, 0, NULL);
+    if (!handle)
+      break;
+    handles.push_back(handle);
+  }
+  state.Run();
+  for (size_t i = 0; i < handles.size(); ++i) {
+    WaitForSingleObject(handles[i], INFINITE);
+    CloseHandle(handles[i]);
+  }
+  DeleteCriticalSection(&state.lock);
+#else
+  pthread_mutex_init(&state.lock, NULL);
+  vector<pthread_t> thread_ids;
+  for (int i = 1; i < threads; ++i) {
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, ParallelForThread, &state) != 0)
+      break;
+    thread_ids.push_back(thread_id);
+  }
+  state.Run();
+  for (size_t i = 0; i < thread_ids.size(); ++i)
+    pthread_join(thread_ids[i], NULL);
+  pthread_mutex_destroy(&state.lock);
+#endif
+}
+
+namespace {
+
+#ifdef _WIN32
+DWORD WINAPI ThreadMain(void* thread) {
+  static_cast<Thread*>(thread)->Run();
+  return 0;
+}
+#else
+void* ThreadMain(void* thread) {
+  static_cast<Thread*>(thread)->Run();
+  return NULL;
+}
+#endif
+
+}  // anonymous namespace
+
+bool Thread::Start(void (*func)(void* arg), void* arg) {
+  assert(!started_);
+  func_ = func;
+  arg_ = arg;
+#ifdef _WIN32
+  handle_ = CreateThread(NULL, 0, ThreadMain, this, 0, NULL);
+  started_ = handle_ != NULL;
+#else
+  started_ = pthread_create(&thread_, NULL, ThreadMain, this) == 0;
+#endif
+  return started_;
+}
+
+void Thread::Join() {
+  if (!started_)
+    return;
+#ifdef _WIN32
+  WaitForSingleObject(handle_, INFINITE);
+  CloseHandle(handle_);
+#else
+  pthread_join(thread_, NULL);
+#endif
+  started_ = false;
+}
+
 string ElideMiddle(const string& str, size_t width) {
   const int kMargin = 3;  // Space for "...".
   string result = str;
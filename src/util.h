@@ -18,6 +18,7 @@
 #ifdef _WIN32
 #include "win32port.h"
 #else
+#include <pthread.h>
 #include <stdint.h>
 #endif
 
@@ -25,6 +26,8 @@
 #include <vector>
 using namespace std;
 
+#include "string_piece.h"
+
 #ifdef _MSC_VER
 #define NORETURN __declspec(noreturn)
 #else
@@ -65,14 +68,38 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
 /// Bash, or Win32's CommandLineToArgvW().
 /// Appends the string directly to |result| without modification if we can
 /// determine that it contains no problematic characters.
-void GetShellEscapedString(const string& input, string* result);
-void GetWin32EscapedString(const string& input, string* result);
+void GetShellEscapedString(StringPiece input, string* result);
+void GetWin32EscapedString(StringPiece input, string* result);
 
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
 int ReadFile(const string& path, string* contents, string* err);
 
+/// A whole file mapped read-only into memory, for reading big files without
+/// copying them.
+struct MappedFile {
+  MappedFile() : data_(NULL), size_(0) {}
+  ~MappedFile() { Unmap(); }
+
+  /// Map the file at \a path, replacing any earlier mapping.
+  /// Returns -errno and fills in \a err on error, like ReadFile().
+  int Map(const string& path, string* err);
+  void Unmap();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  /// Whether a NUL can be read right after the data, as a lexer wants: the
+  /// rest of the last page of a mapping reads as zeroes, unless the file
+  /// fills that page.
+  bool nul_terminated() const;
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
 /// Mark a file descriptor to not be inherited on exec()s.
 void SetCloseOnExec(int fd);
 
@@ -97,6 +124,63 @@ int GetProcessorCount();
 /// on error.
 double GetLoadAverage();
 
+/// @return the amount of physical memory in bytes that can be used without
+/// swapping. A negative value is returned if it's not known.
+int64_t GetAvailableMemory();
+
+/// @return the share of the last ten seconds, in percent, during which some
+/// tasks were stalled waiting for the CPU, memory or I/O, whichever is the
+/// highest, from Linux's pressure stall information.  A negative value is
+/// returned if it's not known.
+double GetPressureStall();
+
+/// @return the share of the time, in percent, that the processors were busy
+/// since the previous call.  A negative value is returned on the first call
+/// or if it's not known.
+double GetCpuUtilization();
+
+/// Parse a list of processors like "0-15,32-47" into @a cpus, sorted and
+/// without duplicates.  @return false if it isn't one.
+bool ParseCpuList(const string& list, vector<int>* cpus);
+
+/// @return the processors of each NUMA node of the machine, from Linux's
+/// sysfs, or nothing if they aren't known.
+vector<vector<int> > GetNumaNodeCpus();
+
+/// Call @a func(@a arg, i) for every i in [0, @a count) from up to
+/// @a threads threads, and return once all calls have finished.  The calls
+/// happen in no particular order and must be safe to run concurrently.
+void ParallelFor(size_t count, int threads,
+                 void (*func)(void* arg, size_t index), void* arg);
+
+/// A thread running @a func(@a arg) alongside the caller, for work that can
+/// overlap with the build, until Join() waits for it.
+struct Thread {
+  Thread() : started_(false) {}
+
+  /// Start the thread.  Returns false if it couldn't be created, in which
+  /// case the caller has to do the work itself.
+  bool Start(void (*func)(void* arg), void* arg);
+
+  /// Wait for the thread to finish; does nothing if it never started.
+  void Join();
+
+  bool started() const { return started_; }
+
+  /// The body of the new thread.
+  void Run() { func_(arg_); }
+
+ private:
+  bool started_;
+#ifdef _WIN32
+  void* handle_;
+#else
+  pthread_t thread_;
+#endif
+  void (*func_)(void* arg);
+  void* arg_;
+};
+
 /// Elide the given string @a str with '...' in the middle if the length
 /// exceeds @a width.
 string ElideMiddle(const string& str, size_t width);
@@ -14,6 +14,12 @@
 
 #include "util.h"
 
+#include <errno.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include "test.h"
 
 namespace {
@@ -349,6 +355,38 @@ TEST(CanonicalizePath, AbsolutePath) {
   EXPECT_EQ("/usr/include/stdio.h", path);
 }
 
+TEST(CanonicalizePath, BlockBoundaries) {
+  // Paths are looked at 16 bytes at a time; put what needs fixing on
+  // either side of the blocks' edges.
+  string err;
+  for (size_t n = 1; n < 40; ++n) {
+    string dir(n, 'a');
+    string path = dir + "/./b";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir + "/b", path);
+
+    path = dir + "//b";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir + "/b", path);
+
+    path = "x/" + dir + "/../b";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ("x/b", path);
+
+    path = dir + "/";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir, path);
+
+    path = dir + "/.b";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir + "/.b", path);
+
+    path = "../" + dir + "/b/c";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ("../" + dir + "/b/c", path);
+  }
+}
+
 TEST(CanonicalizePath, NotNullTerminated) {
   string path;
   string err;
@@ -416,6 +454,87 @@ TEST(StripAnsiEscapeCodes, StripColors) {
             stripped);
 }
 
+namespace {
+
+void SetToIndex(void* arg, size_t index) {
+  (*static_cast<vector<size_t>*>(arg))[index] = index;
+}
+
+}  // anonymous namespace
+
+TEST(ParseCpuList, RangesAndSingles) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("4,0-2,2\n", &cpus));
+  ASSERT_EQ(4u, cpus.size());
+  EXPECT_EQ(0, cpus[0]);
+  EXPECT_EQ(2, cpus[2]);
+  EXPECT_EQ(4, cpus[3]);
+
+  EXPECT_FALSE(ParseCpuList("", &cpus));
+  EXPECT_FALSE(ParseCpuList("2-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("0-", &cpus));
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+}
+
+TEST(ParallelFor, VisitsEveryIndexOnce) {
+  for (int threads = 0; threads <= 4; ++threads) {
+    vector<size_t> result(1000, 0);
+    ParallelFor(result.size(), threads, SetToIndex, &result);
+    for (size_t i = 0; i < result.size(); ++i)
+      ASSERT_EQ(i, result[i]);
+  }
+}
+
+TEST(MappedFile, MapsWholeFile) {
+  const char kTestFilename[] = "MappedFileTest-tempfile";
+  string err;
+  MappedFile file;
+  EXPECT_EQ(-ENOENT, file.Map(kTestFilename, &err));
+  EXPECT_NE("", err);
+
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  fclose(f);
+  ASSERT_EQ(0, file.Map(kTestFilename, &err));
+  EXPECT_EQ(0u, file.size());
+
+  f = fopen(kTestFilename, "wb");
+  fputs("contents\n", f);
+  fclose(f);
+  ASSERT_EQ(0, file.Map(kTestFilename, &err));
+  EXPECT_EQ("contents\n", string(file.data(), file.size()));
+
+  file.Unmap();
+  EXPECT_EQ(0, unlink(kTestFilename));
+}
+
+TEST(MappedFile, NulTerminated) {
+  const char kTestFilename[] = "MappedFileTest-tempfile";
+  string err;
+  MappedFile file;
+  EXPECT_FALSE(file.nul_terminated());
+
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  fputs("contents\n", f);
+  fclose(f);
+  ASSERT_EQ(0, file.Map(kTestFilename, &err));
+  ASSERT_TRUE(file.nul_terminated());
+  EXPECT_EQ('\0', file.data()[file.size()]);
+
+  // A file that fills its last page has nothing readable after it.
+  f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  string page(64 << 10, 'x');
+  fwrite(page.data(), 1, page.size(), f);
+  fclose(f);
+  ASSERT_EQ(0, file.Map(kTestFilename, &err));
+  EXPECT_FALSE(file.nul_terminated());
+
+  file.Unmap();
+  EXPECT_EQ(0, unlink(kTestFilename));
+}
+
 TEST(ElideMiddle, NothingToElide) {
   string input = "Nothing to elide in this short string.";
   EXPECT_EQ(input, ElideMiddle(input, 80));